@@ -5,6 +5,7 @@
 #include <glib-unix.h>
 
 #include <fuse_lowlevel.h>
+#include <linux/fuse.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -14,7 +15,10 @@
 #include <glib/gprintf.h>
 #include <gio/gio.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <sys/time.h>
@@ -30,11 +34,117 @@
 static GThread *fuse_thread = NULL;
 static struct fuse_session *session = NULL;
 static struct fuse_chan *main_ch = NULL;
+/* Set once xdp_fuse_init() is done, which may run in another thread */
+static gint fuse_ready; /* atomic */
 static char *mount_path = NULL;
 static pthread_t fuse_pthread = 0;
 static uid_t my_uid;
 static gid_t my_gid;
 
+/* Attribute and dentry cache timeouts given to the kernel, in seconds.
+ * Changes made through the portal are pushed to the kernel by
+ * xdp_fuse_invalidate_doc_app(), but changes made to backing files
+ * outside the mount are only noticed once the physical timeout runs
+ * out, so that defaults to no caching. */
+static double physical_timeout = 0.0;
+static double virtual_timeout = 60.0;
+
+/* How long the kernel may remember failed lookups. The virtual
+ * directories only change through the portal, which invalidates the
+ * names it adds, so their misses are kept for the virtual timeout.
+ * Misses in document directories follow the physical timeout unless
+ * set explicitly (>= 0), as files created outside the mount are not
+ * seen until they run out. */
+static double negative_timeout = -1;
+
+/* With the writeback cache the kernel buffers writes in its page cache
+ * and sends them to us in large chunks. Opt-in, as the kernel then
+ * trusts its own size and mtime over the backing file's until the
+ * dirty pages are written back. */
+static gboolean writeback_cache_requested = FALSE;
+static gboolean writeback_cache = FALSE;
+
+/* Upper bounds for the size of READ and WRITE requests and for kernel
+ * readahead, in bytes. 0 keeps the kernel and libfuse defaults. The
+ * kernel only ever lowers these, and libfuse caps max_write to its
+ * channel buffer. */
+static guint io_max_read = 0;
+static guint io_max_write = 0;
+static guint io_max_readahead = 0;
+
+/* Limits for the fuse worker pool, see xdp_fuse_worker(). A max of 0
+ * means unlimited, like fuse_session_loop_mt(). */
+static int max_threads = 0;
+static int max_idle_threads = 10;
+
+/* Per-request debug output is formatted only when enabled, as it is on
+ * every hot path. It can be toggled at runtime, a stale value just
+ * means a message more or less. */
+static gboolean fuse_debug = FALSE;
+#define xdp_fuse_debug(...) G_STMT_START { if (G_UNLIKELY (fuse_debug)) g_log (XDP_FUSE_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, __VA_ARGS__); } G_STMT_END
+
+/* Per-opcode request counts and latency histograms, see
+ * xdp_fuse_get_op_stats(). Bucket i counts requests that took less
+ * than 2^i microseconds. */
+#define N_OP_STATS_OPCODES 64
+#define N_OP_STATS_BUCKETS 24
+
+typedef struct {
+  gsize count; /* atomic */
+  gsize total_usec; /* atomic */
+  gsize buckets[N_OP_STATS_BUCKETS]; /* atomic */
+} XdpOpStats;
+
+static gboolean op_stats_enabled = FALSE;
+static XdpOpStats op_stats[N_OP_STATS_OPCODES];
+
+/* Ring buffer of the last requests, see xdp_fuse_get_trace(). A
+ * record's seq is 0 while it is written, then the index it was written
+ * for plus one, so readers can skip records that are being replaced. */
+typedef struct {
+  gint64 start; /* monotonic usec */
+  guint64 nodeid;
+  guint32 duration; /* usec */
+  guint32 size;
+  guint16 opcode;
+  guint8 domain; /* XdpDomainType + 1, 0 if unknown */
+  guint seq; /* atomic */
+} XdpTraceRecord;
+
+static XdpTraceRecord *trace_records = NULL;
+static guint trace_size = 0;
+static guint trace_next; /* atomic */
+
+/* Always collected, see xdp_fuse_get_stats() */
+static gint n_live_domains; /* atomic */
+static gsize n_invalidations; /* atomic */
+static gsize n_invalidations_skipped; /* atomic */
+static gsize n_negative_entries; /* atomic */
+
+/* File managers query statfs and xattrs of every file they show, so
+ * the results for backing files are kept for a short while. Changes to
+ * xattrs made through the portal drop the cached xattrs right away. */
+#define META_CACHE_TTL_USEC (1 * G_USEC_PER_SEC)
+
+typedef struct {
+  gint64 statfs_expires;
+  struct statvfs statfs;
+  gint64 xattrs_expires;
+  guint xattrs_serial;
+  GHashTable *xattrs; /* name -> GBytes, NULL for ENODATA */
+  GBytes *xattr_list;
+} XdpMetaCache;
+
+G_LOCK_DEFINE_STATIC (meta_cache);
+
+static void
+xdp_meta_cache_free (XdpMetaCache *cache)
+{
+  g_clear_pointer (&cache->xattrs, g_hash_table_unref);
+  g_clear_pointer (&cache->xattr_list, g_bytes_unref);
+  g_free (cache);
+}
+
 /* from libfuse */
 #define FUSE_UNKNOWN_INO 0xffffffff
 
@@ -45,6 +155,16 @@ typedef struct {
   dev_t dev;
 } DevIno;
 
+/* The global inode maps are split into shards, each with its own lock,
+ * so that concurrent fuse requests rarely contend */
+#define INODE_SHARD_BITS 6
+#define N_INODE_SHARDS (1 << INODE_SHARD_BITS)
+
+typedef struct {
+  GMutex mutex;
+  GHashTable *table;
+} XdpInodeShard;
+
 typedef enum {
  XDP_DOMAIN_ROOT,
  XDP_DOMAIN_BY_APP,
@@ -53,6 +173,7 @@ typedef enum {
 } XdpDomainType;
 
 typedef struct _XdpDomain XdpDomain;
+typedef struct _XdpDocInfo XdpDocInfo;
 
 struct _XdpDomain {
   gint ref_count; /* atomic */
@@ -60,20 +181,26 @@ struct _XdpDomain {
 
   XdpDomain *parent;
 
-  char *doc_id; /* NULL for root, by-app, app */
-  char *app_id; /* NULL for root, by-app, non-app id */
+  char *doc_id; /* NULL for root, by-app, app, owned by doc_info */
+  char *app_id; /* NULL for root, by-app, non-app id, owned by parent for document */
 
   /* root: by docid
    * app: by docid
    * by_app: by app
    * document: by physical
    */
-  GHashTable *inodes; /* Protected by domain_inodes */
+  GHashTable *inodes; /* Protected by inodes_mutex */
+  GMutex inodes_mutex; /* Lock a parent domain before its children */
+
+  /* root and app: doc ids the kernel got a negative entry for, to the
+   * monotonic second it expires. Protected by inodes_mutex. */
+  GHashTable *negative_docs;
 
   /* Below only used for XDP_DOMAIN_DOCUMENT */
 
-  char *doc_path; /* path to the directory the files are in */
-  char *doc_file; /* != NULL for non-directory documents */
+  XdpDocInfo *doc_info; /* Shared with the other views of the document */
+  char *doc_path; /* path to the directory the files are in, owned by doc_info */
+  char *doc_file; /* != NULL for non-directory documents, owned by doc_info */
   guint64 doc_dir_device;
   guint64 doc_dir_inode;
   guint32 doc_flags;
@@ -81,21 +208,86 @@ struct _XdpDomain {
   /* Below is mutable, protected by mutex */
   GMutex  tempfile_mutex;
   GHashTable *tempfiles; /* Name -> physical */
+  gboolean no_tmpfile;   /* O_TMPFILE not supported in doc_path */
+
+  /* The permissions of app_id on the document, valid while the db
+   * generation is unchanged. Protected by perms_mutex. */
+  GMutex  perms_mutex;
+  gboolean perms_valid;
+  guint perms_generation;
+  DocumentPermissionFlags perms;
 };
 
 static void xdp_domain_unref (XdpDomain *domain);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpDomain, xdp_domain_unref)
 
-G_LOCK_DEFINE (domain_inodes);
+/* The db data of a document, decoded once and shared by the domains
+ * of the root and per-app views of it. Permissions are looked up per
+ * app as needed, so nothing in here depends on the app. */
+struct _XdpDocInfo {
+  int ref_count; /* Protected by doc_infos */
+  char *doc_id;
+  char *path;
+  char *file;
+  guint64 dir_device;
+  guint64 dir_inode;
+  guint32 flags;
+
+  /* For the toplevel dir, protected by meta_cache */
+  XdpMetaCache *meta_cache;
+
+  /* Protected by dirfd_cache */
+  struct _XdpDirFd *cached_dirfd;
+  GList cached_dirfd_link;
+};
+
+/* doc id -> XdpDocInfo, not reffed */
+G_LOCK_DEFINE_STATIC (doc_infos);
+static GHashTable *doc_infos;
+
+static void xdp_doc_info_unref (XdpDocInfo *info);
+
+/* A verified O_PATH fd for the directory of a document, shared between
+ * the domain's cache and the requests using it */
+typedef struct _XdpDirFd {
+  gint ref_count; /* atomic */
+  int fd;
+} XdpDirFd;
+
+static void xdp_dir_fd_unref (XdpDirFd *dirfd);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpDirFd, xdp_dir_fd_unref)
+
+/* Documents with a cached dirfd, most recently used first. This bounds
+ * the number of fds kept open for idle documents. */
+#define DIRFD_CACHE_SIZE 256
+G_LOCK_DEFINE_STATIC (dirfd_cache);
+static GQueue dirfd_cache = G_QUEUE_INIT;
 
 typedef struct {
   gint ref_count; /* atomic */
   DevIno backing_devino;
   int fd; /* O_PATH fd */
+  XdpMetaCache *meta_cache; /* Protected by meta_cache */
+  GList *forgotten_link; /* Protected by forgotten_physical */
+  gint64 forgotten_at; /* Protected by forgotten_physical */
 } XdpPhysicalInode;
 
+/* Physical inodes of recently forgotten inodes, most recent first,
+ * each holding a ref. This keeps the O_PATH fd and the meta cache for
+ * files the kernel drops from its dentry cache and looks up again
+ * soon after. The size is bounded by RLIMIT_NOFILE, see
+ * xdp_fuse_init(). */
+#define FORGOTTEN_PHYSICAL_MAX 4096
+/* Entries are dropped once they were unused this long */
+#define FORGOTTEN_PHYSICAL_TTL_SEC 60
+G_LOCK_DEFINE_STATIC (forgotten_physical);
+static GQueue forgotten_physical = G_QUEUE_INIT;
+static guint forgotten_physical_max = 1024;
+static guint expire_forgotten_id;
+
 static XdpPhysicalInode *xdp_physical_inode_ref   (XdpPhysicalInode *inode);
 static void              xdp_physical_inode_unref (XdpPhysicalInode *inode);
+static void              unforget_physical_inode  (XdpPhysicalInode *physical);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpPhysicalInode, xdp_physical_inode_unref)
 
 typedef struct {
@@ -104,7 +296,8 @@ typedef struct {
   char *name;      /* This changes over time (i.e. in renames)
                       protected by domain->tempfile_mutex,
                       used as key in domain->tempfiles */
-  char *tempname;  /* Real filename on disk.
+  char *tempname;  /* Real filename on disk, or NULL for unnamed
+                      O_TMPFILE files.
                       This can be NULLed to avoid unlink at finalize */
   XdpPhysicalInode *physical;
   XdpDomain *domain;
@@ -131,12 +324,39 @@ typedef struct {
 
 
 typedef struct {
-  DIR *dir;
-  struct dirent *entry;
+  char *name;
+  mode_t mode;
+} XdpDirEntry;
+
+/* As returned by getdents64() */
+struct xdp_dirent64 {
+  guint64 d_ino;
+  gint64 d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Physical dirs are read with getdents64() into a buffer this big */
+#define DENTS_BUF_SIZE (64 * 1024)
+
+typedef struct {
+  /* For physical dirs, the offset is the d_off of the last entry
+   * returned, and dents holds the entries read from dir_fd but not
+   * returned yet, from dents_pos to dents_len */
+  int dir_fd;
+  char *dents;
+  gsize dents_pos;
+  gsize dents_len;
   off_t offset;
 
-  char *dirbuf;
-  gsize dirbuf_size;
+  /* For buffered dirs, the offset is an index into this */
+  GArray *entries; /* XdpDirEntry */
+
+  /* The entries serialized for READDIR, entry_ends[i] is where entry i
+   * ends in dirbuf */
+  GByteArray *dirbuf;
+  GArray *entry_ends; /* gsize */
 } XdpDir;
 
 XdpInode *root_inode;
@@ -146,23 +366,10 @@ static XdpInode *xdp_inode_ref (XdpInode *inode);
 static void xdp_inode_unref (XdpInode *inode);
 
 /* Lookup by inode for verification */
-static GHashTable *all_inodes;
-G_LOCK_DEFINE (all_inodes);
+static XdpInodeShard all_inodes[N_INODE_SHARDS];
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpInode, xdp_inode_unref)
 
-static gboolean
-app_can_write_doc (PermissionDbEntry *entry, const char *app_id)
-{
-  if (app_id == NULL)
-    return TRUE;
-
-  if (document_entry_has_permissions (entry, app_id, DOCUMENT_PERMISSION_FLAGS_WRITE))
-    return TRUE;
-
-  return FALSE;
-}
-
 static gboolean
 app_can_see_doc (PermissionDbEntry *entry, const char *app_id)
 {
@@ -181,6 +388,17 @@ fd_to_path (int fd)
   return g_strdup_printf ("/proc/self/fd/%d", fd);
 }
 
+/* Like fd_to_path(), without the allocation */
+typedef char XdpFdPath[32];
+
+static const char *
+fd_to_path_buf (int       fd,
+                XdpFdPath buf)
+{
+  g_snprintf (buf, sizeof (XdpFdPath), "/proc/self/fd/%d", fd);
+  return buf;
+}
+
 static char *
 open_flags_to_string (int flags)
 {
@@ -276,12 +494,26 @@ setattr_flags_to_string (int flags)
   return g_string_free (s, FALSE);
 }
 
+/* Finalizer from splitmix64, so that sequential inode numbers spread
+ * over both the shards (top bits) and the hash buckets (low bits) */
+static guint64
+mix64 (guint64 h)
+{
+  h ^= h >> 30;
+  h *= G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+  h ^= h >> 27;
+  h *= G_GUINT64_CONSTANT (0x94d049bb133111eb);
+  h ^= h >> 31;
+  return h;
+}
+
 static guint
 devino_hash  (gconstpointer  key)
 {
   DevIno *devino = (DevIno *)key;
+  guint64 dev = devino->dev;
 
-  return (devino->ino >> 2) ^ devino->dev;
+  return (guint) mix64 ((guint64) devino->ino ^ (dev << 32 | dev >> 32));
 }
 
 static gboolean
@@ -294,20 +526,45 @@ devino_equal (gconstpointer  _a,
 }
 
 /* Lookup by physical backing devino */
-static GHashTable *physical_inodes;
-G_LOCK_DEFINE (physical_inodes);
+static XdpInodeShard physical_inodes[N_INODE_SHARDS];
 
+static void
+xdp_inode_shards_init (XdpInodeShard *shards,
+                       GHashFunc      hash_func,
+                       GEqualFunc     key_equal_func)
+{
+  int i;
+
+  for (i = 0; i < N_INODE_SHARDS; i++)
+    {
+      g_mutex_init (&shards[i].mutex);
+      shards[i].table = g_hash_table_new (hash_func, key_equal_func);
+    }
+}
+
+static XdpInodeShard *
+physical_inodes_shard (DevIno *devino)
+{
+  return &physical_inodes[devino_hash (devino) >> (32 - INODE_SHARD_BITS)];
+}
+
+static XdpInodeShard *
+all_inodes_shard (gconstpointer inode)
+{
+  return &all_inodes[mix64 ((gsize) inode) >> (64 - INODE_SHARD_BITS)];
+}
 
 /* Takes ownership of the o_path fd if passed in */
 static XdpPhysicalInode *
 ensure_physical_inode (dev_t dev, ino_t ino, int o_path_fd)
 {
   DevIno devino = {ino, dev};
+  XdpInodeShard *shard = physical_inodes_shard (&devino);
   XdpPhysicalInode *inode = NULL;
 
-  G_LOCK (physical_inodes);
+  g_mutex_lock (&shard->mutex);
 
-  inode = g_hash_table_lookup (physical_inodes, &devino);
+  inode = g_hash_table_lookup (shard->table, &devino);
   if (inode != NULL)
     {
       inode = xdp_physical_inode_ref (inode);
@@ -320,14 +577,159 @@ ensure_physical_inode (dev_t dev, ino_t ino, int o_path_fd)
       inode->ref_count = 1;
       inode->fd = o_path_fd;
       inode->backing_devino = devino;
-      g_hash_table_insert (physical_inodes, &inode->backing_devino, inode);
+      g_hash_table_insert (shard->table, &inode->backing_devino, inode);
     }
 
-  G_UNLOCK (physical_inodes);
+  g_mutex_unlock (&shard->mutex);
+
+  unforget_physical_inode (inode);
+
+  return inode;
+}
+
+/* Like ensure_physical_inode(), but only returns an existing physical
+ * inode, so a lookup doesn't have to open the file to find it */
+static XdpPhysicalInode *
+lookup_physical_inode (dev_t dev, ino_t ino)
+{
+  DevIno devino = {ino, dev};
+  XdpInodeShard *shard = physical_inodes_shard (&devino);
+  XdpPhysicalInode *inode = NULL;
+
+  g_mutex_lock (&shard->mutex);
+
+  inode = g_hash_table_lookup (shard->table, &devino);
+  if (inode != NULL)
+    inode = xdp_physical_inode_ref (inode);
+
+  g_mutex_unlock (&shard->mutex);
+
+  if (inode != NULL)
+    unforget_physical_inode (inode);
 
   return inode;
 }
 
+/* Called with the forgotten_physical lock held. Returns the entries that
+ * were unused for too long, the caller has to unref them without the
+ * lock. */
+static GSList *
+pop_expired_physical_locked (gint64 now)
+{
+  GSList *expired = NULL;
+  XdpPhysicalInode *oldest;
+
+  while ((oldest = g_queue_peek_tail (&forgotten_physical)) != NULL &&
+         now - oldest->forgotten_at > FORGOTTEN_PHYSICAL_TTL_SEC * G_USEC_PER_SEC)
+    {
+      g_queue_pop_tail (&forgotten_physical);
+      oldest->forgotten_link = NULL;
+      expired = g_slist_prepend (expired, oldest);
+    }
+
+  return expired;
+}
+
+/* Called when an inode using physical goes away */
+static void
+forget_physical_inode (XdpPhysicalInode *physical)
+{
+  XdpPhysicalInode *evicted = NULL;
+  GSList *expired;
+  gint64 now;
+  struct stat buf;
+
+  if (forgotten_physical_max == 0)
+    return;
+
+  /* Keeping the fd of a deleted file around would keep its space
+   * allocated, and it can't be looked up again anyway */
+  if (fstat (physical->fd, &buf) == 0 && buf.st_nlink == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  G_LOCK (forgotten_physical);
+  if (physical->forgotten_link != NULL)
+    {
+      g_queue_unlink (&forgotten_physical, physical->forgotten_link);
+      g_queue_push_head_link (&forgotten_physical, physical->forgotten_link);
+    }
+  else
+    {
+      g_queue_push_head (&forgotten_physical, xdp_physical_inode_ref (physical));
+      physical->forgotten_link = forgotten_physical.head;
+
+      if (forgotten_physical.length > forgotten_physical_max)
+        {
+          evicted = g_queue_pop_tail (&forgotten_physical);
+          evicted->forgotten_link = NULL;
+        }
+    }
+  physical->forgotten_at = now;
+  expired = pop_expired_physical_locked (now);
+  G_UNLOCK (forgotten_physical);
+
+  /* Takes the shard lock if this was the last ref */
+  if (evicted)
+    xdp_physical_inode_unref (evicted);
+  g_slist_free_full (expired, (GDestroyNotify) xdp_physical_inode_unref);
+}
+
+/* Also runs periodically, for when nothing gets forgotten for a while */
+static gboolean
+expire_forgotten_physical (gpointer user_data)
+{
+  GSList *expired;
+
+  G_LOCK (forgotten_physical);
+  expired = pop_expired_physical_locked (g_get_monotonic_time ());
+  G_UNLOCK (forgotten_physical);
+
+  g_slist_free_full (expired, (GDestroyNotify) xdp_physical_inode_unref);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Called when physical is in use again, the caller holds a ref */
+static void
+unforget_physical_inode (XdpPhysicalInode *physical)
+{
+  gboolean was_forgotten = FALSE;
+
+  G_LOCK (forgotten_physical);
+  if (physical->forgotten_link != NULL)
+    {
+      g_queue_delete_link (&forgotten_physical, physical->forgotten_link);
+      physical->forgotten_link = NULL;
+      was_forgotten = TRUE;
+    }
+  G_UNLOCK (forgotten_physical);
+
+  if (was_forgotten)
+    xdp_physical_inode_unref (physical);
+}
+
+static void
+trim_forgotten_physical (void)
+{
+  XdpPhysicalInode *physical;
+
+  while (TRUE)
+    {
+      G_LOCK (forgotten_physical);
+      physical = g_queue_pop_head (&forgotten_physical);
+      if (physical)
+        physical->forgotten_link = NULL;
+      G_UNLOCK (forgotten_physical);
+
+      if (physical == NULL)
+        break;
+
+      xdp_physical_inode_unref (physical);
+    }
+}
+
 static XdpPhysicalInode *
 xdp_physical_inode_ref (XdpPhysicalInode *inode)
 {
@@ -356,19 +758,22 @@ retry_atomic_decrement1:
           return;
         }
 
+      XdpInodeShard *shard = physical_inodes_shard (&inode->backing_devino);
+
       /* Might be revived from physical_inodes hash by this time, so protect by lock */
-      G_LOCK (physical_inodes);
+      g_mutex_lock (&shard->mutex);
 
       if (!g_atomic_int_compare_and_exchange ((int *) &inode->ref_count, old_ref, old_ref - 1))
         {
-          G_UNLOCK (physical_inodes);
+          g_mutex_unlock (&shard->mutex);
           goto retry_atomic_decrement1;
         }
-      g_hash_table_remove (physical_inodes, &inode->backing_devino);
+      g_hash_table_remove (shard->table, &inode->backing_devino);
 
-      G_UNLOCK (physical_inodes);
+      g_mutex_unlock (&shard->mutex);
 
       close (inode->fd);
+      g_clear_pointer (&inode->meta_cache, xdp_meta_cache_free);
       g_free (inode);
     }
 }
@@ -385,17 +790,21 @@ xdp_domain_unref (XdpDomain *domain)
 {
   if (g_atomic_int_dec_and_test (&domain->ref_count))
     {
-      g_free (domain->doc_id);
-      g_free (domain->app_id);
-      g_free (domain->doc_path);
-      g_free (domain->doc_file);
+      if (domain->type == XDP_DOMAIN_DOCUMENT)
+        xdp_doc_info_unref (domain->doc_info);
+      else
+        g_free (domain->app_id);
       if (domain->inodes)
         g_assert (g_hash_table_size (domain->inodes) == 0);
       g_clear_pointer (&domain->inodes, g_hash_table_unref);
+      g_clear_pointer (&domain->negative_docs, g_hash_table_unref);
       g_clear_pointer (&domain->parent, xdp_domain_unref);
       g_clear_pointer (&domain->tempfiles, g_hash_table_unref);
       g_mutex_clear (&domain->tempfile_mutex);
+      g_mutex_clear (&domain->inodes_mutex);
+      g_mutex_clear (&domain->perms_mutex);
       g_free (domain);
+      g_atomic_int_add (&n_live_domains, -1);
     }
 }
 
@@ -415,6 +824,9 @@ _xdp_domain_new (XdpDomainType type)
   domain->ref_count = 1;
   domain->type = type;
   g_mutex_init (&domain->tempfile_mutex);
+  g_mutex_init (&domain->inodes_mutex);
+  g_mutex_init (&domain->perms_mutex);
+  g_atomic_int_inc (&n_live_domains);
   return domain;
 }
 
@@ -423,6 +835,7 @@ xdp_domain_new_root (void)
 {
   XdpDomain *domain = _xdp_domain_new (XDP_DOMAIN_ROOT);
   domain->inodes = g_hash_table_new (g_str_hash, g_str_equal);
+  domain->negative_docs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   return domain;
 }
 
@@ -443,68 +856,213 @@ xdp_domain_new_app (XdpDomain *parent,
   domain->parent = xdp_domain_ref (parent);
   domain->app_id = g_strdup (app_id);
   domain->inodes = g_hash_table_new (g_str_hash, g_str_equal);
+  domain->negative_docs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   return domain;
 }
 
+/* Past this, expired entries are dropped before adding more */
+#define MAX_NEGATIVE_DOCS 1024
+
+static gint
+monotonic_seconds (void)
+{
+  return (gint) (g_get_monotonic_time () / G_USEC_PER_SEC);
+}
+
+/* Remembers that the kernel may cache a failed lookup of name for
+ * timeout seconds, so a doc that appears later only invalidates the
+ * names that were actually missed */
+static void
+xdp_domain_add_negative_doc (XdpDomain  *domain,
+                             const char *name,
+                             double      timeout)
+{
+  gint now = monotonic_seconds ();
+  GHashTableIter iter;
+  gpointer value;
+
+  if (domain->negative_docs == NULL)
+    return;
+
+  g_mutex_lock (&domain->inodes_mutex);
+  if (g_hash_table_size (domain->negative_docs) >= MAX_NEGATIVE_DOCS)
+    {
+      g_hash_table_iter_init (&iter, domain->negative_docs);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          if (GPOINTER_TO_INT (value) < now)
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+  /* Rounded up, a late invalidation is harmless, a missed one isn't */
+  g_hash_table_replace (domain->negative_docs, g_strdup (name),
+                        GINT_TO_POINTER (now + (gint) timeout + 1));
+  g_mutex_unlock (&domain->inodes_mutex);
+}
+
+/* Called with the inodes lock held. Returns whether the kernel may
+ * still have a negative entry for doc_id, and forgets about it. */
+static gboolean
+xdp_domain_take_negative_doc (XdpDomain  *domain,
+                              const char *doc_id)
+{
+  gpointer value;
+  gboolean cached;
+
+  if (domain->negative_docs == NULL ||
+      !g_hash_table_lookup_extended (domain->negative_docs, doc_id, NULL, &value))
+    return FALSE;
+
+  cached = GPOINTER_TO_INT (value) >= monotonic_seconds ();
+  g_hash_table_remove (domain->negative_docs, doc_id);
+
+  return cached;
+}
+
+static XdpDocInfo *
+xdp_doc_info_ensure (const char        *doc_id,
+                     PermissionDbEntry *doc_entry)
+{
+  guint32 flags = document_entry_get_flags (doc_entry);
+  guint64 dir_device = document_entry_get_device (doc_entry);
+  guint64 dir_inode = document_entry_get_inode (doc_entry);
+  XdpDocInfo *info;
+
+  G_LOCK (doc_infos);
+
+  if (doc_infos == NULL)
+    doc_infos = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* A doc id may be reused for a different file after a delete */
+  info = g_hash_table_lookup (doc_infos, doc_id);
+  if (info != NULL &&
+      info->flags == flags &&
+      info->dir_device == dir_device &&
+      info->dir_inode == dir_inode)
+    info->ref_count++;
+  else
+    {
+      const char *db_path = document_entry_get_path (doc_entry);
+
+      info = g_new0 (XdpDocInfo, 1);
+      info->ref_count = 1;
+      info->doc_id = g_strdup (doc_id);
+      info->flags = flags;
+      info->dir_device = dir_device;
+      info->dir_inode = dir_inode;
+
+      if (flags & DOCUMENT_ENTRY_FLAG_DIRECTORY)
+        info->path = g_strdup (db_path);
+      else
+        {
+          info->path = g_path_get_dirname (db_path);
+          info->file = g_path_get_basename (db_path);
+        }
+
+      g_hash_table_replace (doc_infos, info->doc_id, info);
+    }
+
+  G_UNLOCK (doc_infos);
+
+  return info;
+}
+
+static void
+xdp_doc_info_unref (XdpDocInfo *info)
+{
+  gboolean last;
+
+  G_LOCK (doc_infos);
+  last = --info->ref_count == 0;
+  if (last && g_hash_table_lookup (doc_infos, info->doc_id) == info)
+    g_hash_table_remove (doc_infos, info->doc_id);
+  G_UNLOCK (doc_infos);
+
+  if (!last)
+    return;
+
+  G_LOCK (dirfd_cache);
+  if (info->cached_dirfd)
+    {
+      g_queue_unlink (&dirfd_cache, &info->cached_dirfd_link);
+      g_clear_pointer (&info->cached_dirfd, xdp_dir_fd_unref);
+    }
+  G_UNLOCK (dirfd_cache);
+
+  g_clear_pointer (&info->meta_cache, xdp_meta_cache_free);
+  g_free (info->doc_id);
+  g_free (info->path);
+  g_free (info->file);
+  g_free (info);
+}
+
 static XdpDomain *
 xdp_domain_new_document (XdpDomain *parent,
                          const char *doc_id,
                          PermissionDbEntry *doc_entry)
 {
   XdpDomain *domain = _xdp_domain_new (XDP_DOMAIN_DOCUMENT);
-  const char *db_path;
+  XdpDocInfo *info = xdp_doc_info_ensure (doc_id, doc_entry);
 
   domain->parent = xdp_domain_ref (parent);
-  domain->doc_id = g_strdup (doc_id);
-  domain->app_id = g_strdup (parent->app_id);
+  domain->doc_info = info;
+  domain->doc_id = info->doc_id;
+  domain->app_id = parent->app_id;
   domain->inodes = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-  domain->doc_flags = document_entry_get_flags (doc_entry);
-  domain->doc_dir_device = document_entry_get_device (doc_entry);
-  domain->doc_dir_inode =  document_entry_get_inode (doc_entry);
-
-  db_path = document_entry_get_path (doc_entry);
-  if (domain->doc_flags & DOCUMENT_ENTRY_FLAG_DIRECTORY)
-    domain->doc_path = g_strdup (db_path);
-  else
-    {
-      domain->doc_path = g_path_get_dirname (db_path);
-      domain->doc_file = g_path_get_basename (db_path);
-    }
+  domain->doc_flags = info->flags;
+  domain->doc_dir_device = info->dir_device;
+  domain->doc_dir_inode = info->dir_inode;
+  domain->doc_path = info->path;
+  domain->doc_file = info->file;
 
   domain->tempfiles = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)xdp_tempfile_unref);
 
   return domain;
 }
 
-static gboolean
-xdp_document_domain_can_see (XdpDomain *domain)
+/* Looking up the db entry takes locks and decodes the entry, so the
+ * result is kept until any document changes */
+static DocumentPermissionFlags
+xdp_document_domain_get_permissions (XdpDomain *domain)
 {
-  if (domain->app_id != NULL)
-    {
-      g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (domain->doc_id);
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  DocumentPermissionFlags perms;
+  guint generation;
+
+  if (domain->app_id == NULL)
+    return DOCUMENT_PERMISSION_FLAGS_ALL;
 
-      if (entry == NULL ||
-          !app_can_see_doc (entry, domain->app_id))
-        return FALSE;
+  /* Read before the lookup, so a change racing with it only makes
+   * the next call look again */
+  generation = xdp_get_docs_generation ();
+
+  g_mutex_lock (&domain->perms_mutex);
+  if (domain->perms_valid && domain->perms_generation == generation)
+    {
+      perms = domain->perms;
+      g_mutex_unlock (&domain->perms_mutex);
+      return perms;
     }
+  g_mutex_unlock (&domain->perms_mutex);
 
-  return TRUE;
+  entry = xdp_lookup_doc (domain->doc_id);
+  perms = entry ? document_entry_get_permissions (entry, domain->app_id) : 0;
+
+  g_mutex_lock (&domain->perms_mutex);
+  domain->perms_valid = TRUE;
+  domain->perms_generation = generation;
+  domain->perms = perms;
+  g_mutex_unlock (&domain->perms_mutex);
+
+  return perms;
 }
 
 static gboolean
 xdp_document_domain_can_write (XdpDomain *domain)
 {
-  if (domain->app_id != NULL)
-    {
-      g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (domain->doc_id);
-
-      if (entry == NULL ||
-          !app_can_write_doc (entry, domain->app_id))
-        return FALSE;
-    }
-
-  return TRUE;
+  return (xdp_document_domain_get_permissions (domain) & DOCUMENT_PERMISSION_FLAGS_WRITE) != 0;
 }
 
 static char **
@@ -515,13 +1073,13 @@ xdp_domain_get_inode_keys_as_string (XdpDomain *domain)
 
   g_assert (domain->type == XDP_DOMAIN_BY_APP);
 
-  G_LOCK (domain_inodes);
+  g_mutex_lock (&domain->inodes_mutex);
 
   res = (char **)g_hash_table_get_keys_as_array (domain->inodes, &length);
   for (i = 0; i < length; i++)
     res[i] = g_strdup (res[i]);
 
-  G_UNLOCK (domain_inodes);
+  g_mutex_unlock (&domain->inodes_mutex);
 
   return res;
 }
@@ -570,12 +1128,13 @@ static XdpInode *
 _xdp_inode_new (void)
 {
   XdpInode *inode = g_new0 (XdpInode, 1);
+  XdpInodeShard *shard = all_inodes_shard (inode);
   inode->ref_count = 1;
   inode->kernel_ref_count = 0;
 
-  G_LOCK (all_inodes);
-  g_hash_table_insert (all_inodes, inode, inode);
-  G_UNLOCK (all_inodes);
+  g_mutex_lock (&shard->mutex);
+  g_hash_table_add (shard->table, inode);
+  g_mutex_unlock (&shard->mutex);
   return inode;
 }
 
@@ -632,11 +1191,28 @@ xdp_inode_ref (XdpInode *inode)
   return inode;
 }
 
+/* The domain whose inodes table holds inode, if any */
+static XdpDomain *
+xdp_inode_get_table_domain (XdpInode *inode)
+{
+  XdpDomain *domain = inode->domain;
+
+  if (domain->type == XDP_DOMAIN_APP)
+    return domain->parent;
+
+  if (domain->type == XDP_DOMAIN_DOCUMENT)
+    return inode->physical ? domain : domain->parent;
+
+  return NULL;
+}
+
 static void
 xdp_inode_unref (XdpInode *inode)
 {
   gint old_ref;
   XdpDomain *domain;
+  XdpDomain *table_domain;
+  XdpInodeShard *shard;
 
   /* here we want to atomically do: if (ref_count>1) { ref_count--; return; } */
 retry_atomic_decrement1:
@@ -654,34 +1230,41 @@ retry_atomic_decrement1:
           return;
         }
 
+      domain = inode->domain;
+      table_domain = xdp_inode_get_table_domain (inode);
+
       /* Might be revived from domain->inodes hash by this time, so protect by lock */
-      G_LOCK (domain_inodes);
+      if (table_domain)
+        g_mutex_lock (&table_domain->inodes_mutex);
 
       if (!g_atomic_int_compare_and_exchange ((int *) &inode->ref_count, old_ref, old_ref - 1))
         {
-          G_UNLOCK (domain_inodes);
+          if (table_domain)
+            g_mutex_unlock (&table_domain->inodes_mutex);
           goto retry_atomic_decrement1;
         }
 
-      domain = inode->domain;
-
       if (domain->type == XDP_DOMAIN_APP)
-        g_hash_table_remove (domain->parent->inodes, domain->app_id);
+        g_hash_table_remove (table_domain->inodes, domain->app_id);
       else if (domain->type == XDP_DOMAIN_DOCUMENT)
         {
           if (inode->physical)
-            g_hash_table_remove (domain->inodes, inode->physical);
+            g_hash_table_remove (table_domain->inodes, inode->physical);
           else
-            g_hash_table_remove (domain->parent->inodes, domain->doc_id);
+            g_hash_table_remove (table_domain->inodes, domain->doc_id);
         }
 
-      G_UNLOCK (domain_inodes);
+      if (table_domain)
+        g_mutex_unlock (&table_domain->inodes_mutex);
 
       /* This doesn't allow ressurection (but can read inode data) */
-      G_LOCK (all_inodes);
-      g_hash_table_remove (all_inodes, inode);
-      G_UNLOCK (all_inodes);
+      shard = all_inodes_shard (inode);
+      g_mutex_lock (&shard->mutex);
+      g_hash_table_remove (shard->table, inode);
+      g_mutex_unlock (&shard->mutex);
 
+      if (inode->physical)
+        forget_physical_inode (inode->physical);
       g_clear_pointer (&inode->physical, xdp_physical_inode_unref);
       xdp_domain_unref (inode->domain);
       g_free (inode);
@@ -729,62 +1312,165 @@ verify_doc_dir_devino (int dirfd, XdpDomain *doc_domain)
   return 0;
  }
 
-/* Only for toplevel dirs */
-static int
-xdp_nonphysical_document_inode_opendir (XdpInode *inode)
+static XdpDirFd *
+xdp_dir_fd_new (int fd)
 {
-  XdpDomain *domain = inode->domain;
-  xdp_autofd int dirfd = -1;
-  int res;
-
-  g_assert (domain->type == XDP_DOMAIN_DOCUMENT);
-  g_assert (inode->physical == NULL);
+  XdpDirFd *dirfd = g_new0 (XdpDirFd, 1);
+  dirfd->ref_count = 1;
+  dirfd->fd = fd;
+  return dirfd;
+}
 
-  dirfd = open (domain->doc_path, O_PATH | O_DIRECTORY);
-  if (dirfd < 0)
-    return -errno;
+static XdpDirFd *
+xdp_dir_fd_ref (XdpDirFd *dirfd)
+{
+  g_atomic_int_inc (&dirfd->ref_count);
+  return dirfd;
+}
 
-  res = verify_doc_dir_devino (dirfd, domain);
-  if (res != 0)
-    return res;
+static void
+xdp_dir_fd_unref (XdpDirFd *dirfd)
+{
+  if (g_atomic_int_dec_and_test (&dirfd->ref_count))
+    {
+      close (dirfd->fd);
+      g_free (dirfd);
+    }
+}
 
-  return xdp_steal_fd (&dirfd);
+/* Drops the cached dirfd if it is still expected */
+static void
+xdp_doc_info_uncache_dirfd (XdpDocInfo *info,
+                            XdpDirFd   *expected)
+{
+  G_LOCK (dirfd_cache);
+  if (info->cached_dirfd == expected)
+    {
+      g_queue_unlink (&dirfd_cache, &info->cached_dirfd_link);
+      g_clear_pointer (&info->cached_dirfd, xdp_dir_fd_unref);
+    }
+  G_UNLOCK (dirfd_cache);
 }
 
-static int
-xdp_document_inode_ensure_dirfd (XdpInode *inode,
-                                 int *close_fd_out)
+static void
+xdp_doc_info_cache_dirfd (XdpDocInfo *info,
+                          XdpDirFd   *dirfd)
 {
-  int close_fd;
+  G_LOCK (dirfd_cache);
+  if (info->cached_dirfd == NULL)
+    {
+      info->cached_dirfd = xdp_dir_fd_ref (dirfd);
+      info->cached_dirfd_link.data = info;
+      g_queue_push_head_link (&dirfd_cache, &info->cached_dirfd_link);
 
-  g_assert (inode->domain->type == XDP_DOMAIN_DOCUMENT);
+      while (dirfd_cache.length > DIRFD_CACHE_SIZE)
+        {
+          GList *oldest = g_queue_pop_tail_link (&dirfd_cache);
+          XdpDocInfo *old_info = oldest->data;
+
+          g_clear_pointer (&old_info->cached_dirfd, xdp_dir_fd_unref);
+        }
+    }
+  G_UNLOCK (dirfd_cache);
+}
 
-  *close_fd_out = -1;
+/* Always checked against the main file path, as the file may have been
+ * replaced outside the portal, e.g. by a rename over it */
+static gboolean
+xdp_doc_info_is_main_file (XdpDomain    *domain,
+                           const DevIno *devino)
+{
+  g_autofree char *main_path = NULL;
+  struct stat buf;
 
-  if (inode->physical)
-    return inode->physical->fd;
-  else
-    {
-      close_fd = xdp_nonphysical_document_inode_opendir (inode);
-      if (close_fd < 0)
-        return close_fd;
+  main_path = g_build_filename (domain->doc_path, domain->doc_file, NULL);
+  if (lstat (main_path, &buf) != 0)
+    return FALSE;
 
-      *close_fd_out = close_fd;
-      return close_fd;
-    }
+  return buf.st_dev == devino->dev && buf.st_ino == devino->ino;
 }
 
+/* Only for toplevel dirs. Returns the dir fd, which stays valid as
+ * long as the ref returned in dirfd_out. */
 static int
-xdp_document_inode_open_self_fd (XdpInode *inode, int open_flags, mode_t mode)
+xdp_nonphysical_document_inode_opendir (XdpInode  *inode,
+                                        XdpDirFd **dirfd_out)
 {
   XdpDomain *domain = inode->domain;
-  int dirfd, fd;
-  xdp_autofd int close_fd = -1;
+  g_autoptr(XdpDirFd) dirfd = NULL;
+  struct stat buf;
+  int fd;
+  int res;
 
   g_assert (domain->type == XDP_DOMAIN_DOCUMENT);
+  g_assert (inode->physical == NULL);
 
-  dirfd = xdp_document_inode_ensure_dirfd (inode, &close_fd);
-  if (dirfd < 0)
+  G_LOCK (dirfd_cache);
+  if (domain->doc_info->cached_dirfd)
+    {
+      dirfd = xdp_dir_fd_ref (domain->doc_info->cached_dirfd);
+      g_queue_unlink (&dirfd_cache, &domain->doc_info->cached_dirfd_link);
+      g_queue_push_head_link (&dirfd_cache, &domain->doc_info->cached_dirfd_link);
+    }
+  G_UNLOCK (dirfd_cache);
+
+  /* The fd keeps following the dir if it is moved, like the fds of
+   * physical inodes do, but a removed dir must be looked up again */
+  if (dirfd != NULL)
+    {
+      if (fstat (dirfd->fd, &buf) == 0 && buf.st_nlink > 0)
+        {
+          *dirfd_out = g_steal_pointer (&dirfd);
+          return (*dirfd_out)->fd;
+        }
+
+      xdp_doc_info_uncache_dirfd (domain->doc_info, dirfd);
+      g_clear_pointer (&dirfd, xdp_dir_fd_unref);
+    }
+
+  fd = open (domain->doc_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  dirfd = xdp_dir_fd_new (fd);
+
+  res = verify_doc_dir_devino (dirfd->fd, domain);
+  if (res != 0)
+    return res;
+
+  xdp_doc_info_cache_dirfd (domain->doc_info, dirfd);
+
+  *dirfd_out = g_steal_pointer (&dirfd);
+  return (*dirfd_out)->fd;
+}
+
+/* Returns a dir fd for inode, valid as long as the ref in dirfd_out
+ * (which is NULL for physical inodes) */
+static int
+xdp_document_inode_ensure_dirfd (XdpInode  *inode,
+                                 XdpDirFd **dirfd_out)
+{
+  g_assert (inode->domain->type == XDP_DOMAIN_DOCUMENT);
+
+  *dirfd_out = NULL;
+
+  if (inode->physical)
+    return inode->physical->fd;
+  else
+    return xdp_nonphysical_document_inode_opendir (inode, dirfd_out);
+}
+
+static int
+xdp_document_inode_open_self_fd (XdpInode *inode, int open_flags, mode_t mode)
+{
+  XdpDomain *domain = inode->domain;
+  int dirfd, fd;
+  g_autoptr(XdpDirFd) dirfd_ref = NULL;
+
+  g_assert (domain->type == XDP_DOMAIN_DOCUMENT);
+
+  dirfd = xdp_document_inode_ensure_dirfd (inode, &dirfd_ref);
+  if (dirfd < 0)
     return dirfd;
 
   fd = openat (dirfd, ".", open_flags, mode);
@@ -851,6 +1537,35 @@ open_temp_at (int    dirfd,
   return -EEXIST;
 }
 
+/* Gives the unnamed (O_TMPFILE) file behind fd a unique temporary name */
+static int
+link_temp_at (int    dirfd,
+              int    fd,
+              const char *orig_name,
+              char **name_out)
+{
+  g_autofree char *proc_path = fd_to_path (fd);
+  const guint count_max = 100;
+  g_autofree char *tmp = g_strconcat (".xdp-", orig_name, "-XXXXXX", NULL);
+
+  for (int count = 0; count < count_max; count++)
+    {
+      gen_temp_name (tmp);
+
+      if (linkat (AT_FDCWD, proc_path, dirfd, tmp, AT_SYMLINK_FOLLOW) != 0)
+        {
+          if (errno == EEXIST)
+            continue;
+          else
+            return -errno;
+        }
+
+      *name_out = g_steal_pointer (&tmp);
+      return 0;
+    }
+
+  return -EEXIST;
+}
 
 /* allocates tempfile for existing file,
    Called with tempfile lock held, sets errno */
@@ -907,9 +1622,23 @@ create_tempfile (XdpDomain *domain,
   if (tempfile_out != NULL)
     *tempfile_out = NULL;
 
-  real_fd = open_temp_at (dirfd, name, &tmpname, mode);
+  /* Prefer an unnamed file, which gets linked in only if it is
+   * renamed over the main file, so nothing is left behind on crashes */
+  if (!domain->no_tmpfile)
+    {
+      real_fd = openat (dirfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, mode);
+      if (real_fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR))
+        domain->no_tmpfile = TRUE;
+      else if (real_fd < 0)
+        return -errno;
+    }
+
   if (real_fd < 0)
-    return real_fd;
+    {
+      real_fd = open_temp_at (dirfd, name, &tmpname, mode);
+      if (real_fd < 0)
+        return real_fd;
+    }
 
   real_fd_path = fd_to_path (real_fd);
   o_path_fd = open (real_fd_path, O_PATH, 0);
@@ -959,9 +1688,10 @@ xdp_document_inode_open_child_fd (XdpInode *inode, const char *name, int open_fl
     }
   else
     {
-      xdp_autofd int dirfd = -1;
+      g_autoptr(XdpDirFd) dirfd_ref = NULL;
+      int dirfd;
 
-      dirfd = xdp_nonphysical_document_inode_opendir (inode);
+      dirfd = xdp_nonphysical_document_inode_opendir (inode, &dirfd_ref);
       if (dirfd < 0)
         return dirfd;
 
@@ -1040,12 +1770,16 @@ tweak_statbuf_for_document_inode (XdpInode *inode,
 
   if (!xdp_document_domain_can_write (domain))
     buf->st_mode &= ~(0222);
+
+  /* Unnamed tempfiles still show up under their name in the doc dir */
+  if (buf->st_nlink == 0 && S_ISREG (buf->st_mode))
+    buf->st_nlink = 1;
 }
 
 static void
 xdp_reply_err (const char *op, fuse_req_t req, int err)
 {
-  if (err != 0)
+  if (err != 0 && G_UNLIKELY (fuse_debug))
     {
       const char *errname = NULL;
       switch (err)
@@ -1072,9 +1806,9 @@ xdp_reply_err (const char *op, fuse_req_t req, int err)
           errname = NULL;
         }
       if (errname != NULL)
-        g_debug ("%s -> error %s", op, errname);
+        xdp_fuse_debug ("%s -> error %s", op, errname);
       else
-        g_debug ("%s -> error %d", op, err);
+        xdp_fuse_debug ("%s -> error %d", op, err);
     }
   fuse_reply_err (req, err);
 }
@@ -1092,6 +1826,7 @@ xdp_document_inode_checks (const char *op,
                            XdpDocumentChecks checks)
 {
   XdpDomain *domain = inode->domain;
+  DocumentPermissionFlags perms;
 
   if (domain->type != XDP_DOMAIN_DOCUMENT)
     {
@@ -1099,8 +1834,10 @@ xdp_document_inode_checks (const char *op,
       return FALSE;
     }
 
+  perms = xdp_document_domain_get_permissions (domain);
+
   /* We allowed the inode lookup to succeed, but maybe the permissions changed since then */
-  if (!xdp_document_domain_can_see (domain))
+  if ((perms & DOCUMENT_PERMISSION_FLAGS_READ) == 0)
     {
       xdp_reply_err (op, req, EACCES);
       return FALSE;
@@ -1114,7 +1851,7 @@ xdp_document_inode_checks (const char *op,
     }
 
   if ((checks & CHECK_CAN_WRITE) != 0 &&
-      !xdp_document_domain_can_write (domain))
+      (perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0)
     {
       xdp_reply_err (op, req, EACCES);
       return FALSE;
@@ -1130,40 +1867,49 @@ xdp_document_inode_checks (const char *op,
   return TRUE;
 }
 
+/* Filled in at init, everything but st_ino is the same for all
+ * virtual directories of a kind */
+static struct stat non_doc_dir_stat;
+static struct stat doc_dir_stat;
+
+static void
+init_virtual_stat_templates (void)
+{
+  memset (&non_doc_dir_stat, 0, sizeof (struct stat));
+  non_doc_dir_stat.st_uid = my_uid;
+  non_doc_dir_stat.st_gid = my_gid;
+  non_doc_dir_stat.st_mode = S_IFDIR | NON_DOC_DIR_PERMS;
+  non_doc_dir_stat.st_nlink = 2;
+
+  doc_dir_stat = non_doc_dir_stat;
+  doc_dir_stat.st_mode = S_IFDIR | DOC_DIR_PERMS;
+}
+
 static void
 stat_virtual_inode (XdpInode *inode,
                     struct stat *buf)
 {
-  memset (buf, 0, sizeof (struct stat));
-  buf->st_ino = xdp_inode_to_ino (inode);
-  buf->st_uid = my_uid;
-  buf->st_gid = my_gid;
-
   switch (inode->domain->type)
     {
     case XDP_DOMAIN_ROOT:
     case XDP_DOMAIN_BY_APP:
     case XDP_DOMAIN_APP:
-      buf->st_mode = S_IFDIR | NON_DOC_DIR_PERMS;
-      buf->st_nlink = 2;
+      *buf = non_doc_dir_stat;
       break;
     case XDP_DOMAIN_DOCUMENT:
-      buf->st_mode = S_IFDIR | DOC_DIR_PERMS;
-      buf->st_nlink = 2;
+      *buf = doc_dir_stat;
 
       /* Remove perms if not writable */
-      if (inode->domain->app_id != NULL)
-        {
-          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (inode->domain->doc_id);
-          if (entry == NULL || !app_can_write_doc (entry, inode->domain->app_id))
-            buf->st_mode &= ~(0222);
-        }
+      if (!xdp_document_domain_can_write (inode->domain))
+        buf->st_mode &= ~(0222);
       break;
 
     default:
       g_assert_not_reached ();
       break;
     }
+
+  buf->st_ino = xdp_inode_to_ino (inode);
 }
 
 static void
@@ -1175,15 +1921,14 @@ xdp_fuse_getattr (fuse_req_t req,
   XdpDomain *domain = inode->domain;
   struct stat buf;
   int res;
-  double attr_valid_time = 0.0;/* Time in secs for attribute validation */
   const char *op = "GETATTR";
 
-  g_debug ("GETATTR %lx", ino);
+  xdp_fuse_debug ("GETATTR %lx", ino);
 
   if (xdp_domain_is_virtual_type (domain))
     {
       stat_virtual_inode (inode, &buf);
-      fuse_reply_attr (req, &buf, attr_valid_time);
+      fuse_reply_attr (req, &buf, virtual_timeout);
       return;
     }
 
@@ -1201,7 +1946,7 @@ xdp_fuse_getattr (fuse_req_t req,
 
   tweak_statbuf_for_document_inode (inode, &buf);
 
-  fuse_reply_attr (req, &buf, attr_valid_time);
+  fuse_reply_attr (req, &buf, inode->physical ? physical_timeout : virtual_timeout);
 }
 
 static void
@@ -1212,50 +1957,46 @@ xdp_fuse_setattr (fuse_req_t             req,
                   struct fuse_file_info *fi)
 {
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
-  g_autofree char *to_set_string = setattr_flags_to_string (to_set);
+  g_autofree char *to_set_string = NULL;
+  XdpFdPath path;
   struct stat buf;
-  double attr_valid_time = 0.0;/* Time in secs for attribute validation */
+  int fd = -1;
   int res;
   const char *op = "SETATTR";
 
-  g_debug ("SETATTR %lx %s", ino, to_set_string);
+  if (G_UNLIKELY (fuse_debug))
+    {
+      to_set_string = setattr_flags_to_string (to_set);
+      g_debug ("SETATTR %lx %s", ino, to_set_string);
+    }
 
   if (!xdp_document_inode_checks (op, req, inode,
                                   CHECK_CAN_WRITE | CHECK_IS_PHYSICAL))
     return;
 
+  /* Build tools touch a lot of files, so each change is a single
+   * syscall: on the open file if the kernel passed one, otherwise on
+   * the O_PATH fd, going through /proc only where that isn't
+   * allowed. The kernel only passes files of ftruncate() and open with
+   * O_TRUNC, so fh is never a directory. */
+  if (fi != NULL && fi->fh != 0)
+    fd = ((XdpFile *) fi->fh)->fd;
+
   /* Truncate */
   if (to_set & FUSE_SET_ATTR_SIZE)
     {
-      g_autofree char *path = NULL;
-      XdpFile *file = (XdpFile *)fi->fh;
-
-      if (file)
-        {
-          res = ftruncate (file->fd, attr->st_size);
-          if (res == -1)
-            res = -errno;
-        }
-      else if (inode->physical)
-        {
-          path = fd_to_path (inode->physical->fd);
-          res = truncate (path, attr->st_size);
-          if (res == -1)
-            res = -errno;
-        }
+      if (fd != -1)
+        res = ftruncate (fd, attr->st_size);
       else
-        {
-          res = -EISDIR;
-        }
+        res = truncate (fd_to_path_buf (inode->physical->fd, path), attr->st_size);
 
       if (res != 0)
-        return xdp_reply_err (op, req, -res);
+        return xdp_reply_err (op, req, errno);
     }
 
   if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
     {
       struct timespec times[2] = { {0, UTIME_OMIT}, {0, UTIME_OMIT} }; /* 0 = atime, 1 = mtime */
-      g_autofree char *path = NULL;
 
       if (to_set & FUSE_SET_ATTR_ATIME_NOW)
         times[0].tv_nsec = UTIME_NOW;
@@ -1267,13 +2008,10 @@ xdp_fuse_setattr (fuse_req_t             req,
       else if (to_set & FUSE_SET_ATTR_MTIME)
         times[1] = attr->st_mtim;
 
-      if (inode->physical)
-        {
-          path = fd_to_path (inode->physical->fd);
-          res = utimensat (AT_FDCWD, path, times, 0);
-        }
+      if (fd != -1)
+        res = futimens (fd, times);
       else
-        res = utimensat (AT_FDCWD, inode->domain->doc_path, times, 0); /* follow symlink here */
+        res = utimensat (AT_FDCWD, fd_to_path_buf (inode->physical->fd, path), times, 0);
 
       if (res != 0)
         return xdp_reply_err (op, req, errno);
@@ -1281,7 +2019,6 @@ xdp_fuse_setattr (fuse_req_t             req,
 
   if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
     {
-      g_autofree char *path = NULL;
       uid_t uid = -1;
       gid_t gid = -1;
 
@@ -1291,53 +2028,34 @@ xdp_fuse_setattr (fuse_req_t             req,
       if (to_set & FUSE_SET_ATTR_GID)
         gid = attr->st_gid;
 
-      if (inode->physical)
-        {
-          path = fd_to_path (inode->physical->fd);
-          res = chown (path, uid, gid);
-          if (res == -1)
-            res = -errno;
-        }
-      else
-        {
-          res = -EACCES;
-        }
-
+      res = fchownat (fd != -1 ? fd : inode->physical->fd, "", uid, gid,
+                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
       if (res != 0)
-        return xdp_reply_err (op, req, -res);
+        return xdp_reply_err (op, req, errno);
     }
 
   if (to_set & (FUSE_SET_ATTR_MODE))
     {
-      g_autofree char *path = NULL;
-
-      if (inode->physical)
-        {
-          path = fd_to_path (inode->physical->fd);
-          res = chmod (path, attr->st_mode);
-          if (res == -1)
-            res = -errno;
-        }
+      if (fd != -1)
+        res = fchmod (fd, attr->st_mode);
       else
-        {
-          res = -EACCES;
-        }
+        res = chmod (fd_to_path_buf (inode->physical->fd, path), attr->st_mode);
 
       if (res != 0)
-        return xdp_reply_err (op, req, -res);
+        return xdp_reply_err (op, req, errno);
     }
 
-  if (inode->physical)
-    res = fstatat (inode->physical->fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+  if (fd != -1)
+    res = fstat (fd, &buf);
   else
-    res = stat (inode->domain->doc_path, &buf); /* Follow symlinks here */
+    res = fstatat (inode->physical->fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
 
   if (res != 0)
     return xdp_reply_err (op, req, errno);
 
   tweak_statbuf_for_document_inode (inode, &buf);
 
-  fuse_reply_attr (req, &buf, attr_valid_time);
+  fuse_reply_attr (req, &buf, physical_timeout);
 }
 
 static void
@@ -1349,8 +2067,8 @@ prepare_reply_entry (XdpInode *inode,
   e->ino = xdp_inode_to_ino (inode);
   e->generation = 1;
   e->attr = *buf;
-  e->attr_timeout = 0.0; /* attribute timeout */
-  e->entry_timeout = 0.0; /* dentry timeout */
+  e->attr_timeout = physical_timeout; /* attribute timeout */
+  e->entry_timeout = physical_timeout; /* dentry timeout */
 }
 
 static void
@@ -1364,8 +2082,8 @@ prepare_reply_virtual_entry (XdpInode *inode,
   e->generation = 1;
 
   /* Cache virtual dirs */
-  e->attr_timeout = 60.0; /* attribute timeout */
-  e->entry_timeout = 60.0; /* dentry timeout */
+  e->attr_timeout = virtual_timeout; /* attribute timeout */
+  e->entry_timeout = virtual_timeout; /* dentry timeout */
 }
 
 static void
@@ -1375,13 +2093,46 @@ abort_reply_entry (struct fuse_entry_param *e)
   xdp_inode_kernel_unref (inode);
 }
 
+static double
+negative_entry_timeout (XdpDomain *domain)
+{
+  if (domain->type != XDP_DOMAIN_DOCUMENT)
+    return virtual_timeout;
+
+  return negative_timeout >= 0 ? negative_timeout : physical_timeout;
+}
+
+/* buf is the stat of the physical inode */
+static void
+ensure_docdir_inode_for_physical (XdpDomain               *domain,
+                                  XdpPhysicalInode        *physical,
+                                  struct stat             *buf,
+                                  struct fuse_entry_param *e)
+{
+  g_autoptr(XdpInode) inode = NULL;
+
+  g_mutex_lock (&domain->inodes_mutex);
+  inode = g_hash_table_lookup (domain->inodes, physical);
+  if (inode != NULL)
+    inode = xdp_inode_ref (inode);
+  else
+    {
+      inode = xdp_inode_new (domain, physical);
+      g_hash_table_insert (domain->inodes, physical, inode);
+    }
+  g_mutex_unlock (&domain->inodes_mutex);
+
+  tweak_statbuf_for_document_inode (inode, buf);
+
+  prepare_reply_entry (inode, buf, e);
+}
+
 static int
 ensure_docdir_inode (XdpDomain *domain,
                      int o_path_fd_in, /* Takes ownership */
                      struct fuse_entry_param *e)
 {
   g_autoptr(XdpPhysicalInode) physical = NULL;
-  g_autoptr(XdpInode) inode = NULL;
   xdp_autofd int o_path_fd = o_path_fd_in;
   struct stat buf;
   int res;
@@ -1397,20 +2148,7 @@ ensure_docdir_inode (XdpDomain *domain,
 
   physical = ensure_physical_inode (buf.st_dev, buf.st_ino, xdp_steal_fd (&o_path_fd)); /* passed ownership of fd */
 
-  G_LOCK(domain_inodes);
-  inode = g_hash_table_lookup (domain->inodes, physical);
-  if (inode != NULL)
-    inode = xdp_inode_ref (inode);
-  else
-    {
-      inode = xdp_inode_new (domain, physical);
-      g_hash_table_insert (domain->inodes, physical, inode);
-    }
-  G_UNLOCK(domain_inodes);
-
-  tweak_statbuf_for_document_inode (inode, &buf);
-
-  prepare_reply_entry (inode, &buf, e);
+  ensure_docdir_inode_for_physical (domain, physical, &buf, e);
 
   return 0;
 }
@@ -1440,7 +2178,7 @@ ensure_by_app_inode (XdpDomain *by_app_domain,
   if (!xdp_is_valid_app_id (app_id))
     return NULL;
 
-  G_LOCK(domain_inodes);
+  g_mutex_lock (&by_app_domain->inodes_mutex);
   inode = g_hash_table_lookup (by_app_domain->inodes, app_id);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1450,11 +2188,14 @@ ensure_by_app_inode (XdpDomain *by_app_domain,
       inode = xdp_inode_new (app_domain, NULL);
       g_hash_table_insert (by_app_domain->inodes, app_domain->app_id, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&by_app_domain->inodes_mutex);
 
   return g_steal_pointer (&inode);
 }
 
+static int app_doc_visible_cached (const char *app_id,
+                                   const char *doc_id);
+
 static XdpInode *
 ensure_doc_inode (XdpDomain *parent_domain,
                   const char *doc_id)
@@ -1462,6 +2203,27 @@ ensure_doc_inode (XdpDomain *parent_domain,
   g_autoptr(XdpInode) inode = NULL;
   g_autoptr(PermissionDbEntry) doc_entry = NULL;
 
+  if (parent_domain->app_id)
+    {
+      int visible = app_doc_visible_cached (parent_domain->app_id, doc_id);
+
+      if (visible == 0)
+        return NULL;
+
+      /* Known to be visible, only go to the db for a new inode */
+      if (visible == 1)
+        {
+          g_mutex_lock (&parent_domain->inodes_mutex);
+          inode = g_hash_table_lookup (parent_domain->inodes, doc_id);
+          if (inode != NULL)
+            inode = xdp_inode_ref (inode);
+          g_mutex_unlock (&parent_domain->inodes_mutex);
+
+          if (inode != NULL)
+            return g_steal_pointer (&inode);
+        }
+    }
+
   doc_entry = xdp_lookup_doc (doc_id);
 
   if (doc_entry == NULL ||
@@ -1469,7 +2231,7 @@ ensure_doc_inode (XdpDomain *parent_domain,
        !app_can_see_doc (doc_entry, parent_domain->app_id)))
     return NULL;
 
-  G_LOCK(domain_inodes);
+  g_mutex_lock (&parent_domain->inodes_mutex);
   inode = g_hash_table_lookup (parent_domain->inodes, doc_id);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1479,33 +2241,23 @@ ensure_doc_inode (XdpDomain *parent_domain,
       inode = xdp_inode_new (doc_domain, NULL);
       g_hash_table_insert (parent_domain->inodes, doc_domain->doc_id, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&parent_domain->inodes_mutex);
 
   return g_steal_pointer (&inode);
 }
 
-static void
-xdp_fuse_lookup (fuse_req_t req,
-                 fuse_ino_t parent_ino,
-                 const char *name)
+/* Resolves name in parent and fills in e, taking a kernel ref on the
+ * resulting inode. Returns 0 or a negative errno. */
+static int
+xdp_lookup_child (XdpInode                *parent,
+                  const char              *name,
+                  struct fuse_entry_param *e)
 {
-  g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   XdpDomain *parent_domain = parent->domain;
   g_autoptr(XdpInode) inode = NULL;
-  struct fuse_entry_param e;
-  int res, fd;
+  int fd;
+  int res;
   int open_flags = O_PATH|O_NOFOLLOW;
-  const char *op = "LOOKUP";
-
-  g_debug ("LOOKUP %lx:%s", parent_ino, name);
-
-  if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
-    {
-      /* We don't set FUSE_CAP_EXPORT_SUPPORT, so should not get
-       * here. But lets make sure we never ever resolve them as that
-       * could be a security issue by escaping the root. */
-      return xdp_reply_err (op, req, ESTALE);
-    }
 
   if (xdp_domain_is_virtual_type (parent_domain))
     {
@@ -1528,23 +2280,80 @@ xdp_fuse_lookup (fuse_req_t req,
         }
 
       if (inode == NULL)
-        return xdp_reply_err (op, req, ENOENT);
+        return -ENOENT;
 
-      prepare_reply_virtual_entry (inode, &e);
+      prepare_reply_virtual_entry (inode, e);
+      return 0;
     }
-  else
+
+  g_assert (parent_domain->type == XDP_DOMAIN_DOCUMENT);
+
+  /* Inside directory documents, a file that still has a physical inode
+   * (maybe just forgotten by the kernel) is found without opening it.
+   * Its O_PATH fd keeps the backing inode alive, so its devino can't
+   * have been reused for a different file. */
+  if (parent->physical)
     {
-      g_assert (parent_domain->type == XDP_DOMAIN_DOCUMENT);
+      g_autoptr(XdpPhysicalInode) physical = NULL;
+      struct stat buf;
 
-      fd = xdp_document_inode_open_child_fd (parent, name, open_flags, 0);
-      if (fd < 0)
-        return xdp_reply_err (op, req, -fd);
+      if (fstatat (parent->physical->fd, name, &buf, AT_SYMLINK_NOFOLLOW) == -1)
+        return -errno;
 
-      res = ensure_docdir_inode (parent->domain, fd, &e); /* Takes ownershif of fd */
-      if (res != 0)
-        return xdp_reply_err (op, req, -res);
+      physical = lookup_physical_inode (buf.st_dev, buf.st_ino);
+      if (physical != NULL)
+        {
+          ensure_docdir_inode_for_physical (parent_domain, physical, &buf, e);
+          return 0;
+        }
+    }
+
+  fd = xdp_document_inode_open_child_fd (parent, name, open_flags, 0);
+  if (fd < 0)
+    return fd;
+
+  res = ensure_docdir_inode (parent->domain, fd, e); /* Takes ownershif of fd */
+
+  return res;
+}
+
+static void
+xdp_fuse_lookup (fuse_req_t req,
+                 fuse_ino_t parent_ino,
+                 const char *name)
+{
+  g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
+  struct fuse_entry_param e;
+  int res;
+  const char *op = "LOOKUP";
+
+  xdp_fuse_debug ("LOOKUP %lx:%s", parent_ino, name);
+
+  if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+    {
+      /* We don't set FUSE_CAP_EXPORT_SUPPORT, so should not get
+       * here. But lets make sure we never ever resolve them as that
+       * could be a security issue by escaping the root. */
+      return xdp_reply_err (op, req, ESTALE);
+    }
+
+  res = xdp_lookup_child (parent, name, &e);
+  if (res == -ENOENT && negative_entry_timeout (parent->domain) > 0)
+    {
+      /* A zero ino lets the kernel cache the miss */
+      memset (&e, 0, sizeof (e));
+      e.entry_timeout = negative_entry_timeout (parent->domain);
+      g_atomic_pointer_add (&n_negative_entries, 1);
+      if (parent->domain->type == XDP_DOMAIN_ROOT ||
+          parent->domain->type == XDP_DOMAIN_APP)
+        xdp_domain_add_negative_doc (parent->domain, name, e.entry_timeout);
+      fuse_reply_entry (req, &e);
+      return;
     }
 
+  if (res != 0)
+    return xdp_reply_err (op, req, -res);
+
   if (fuse_reply_entry (req, &e) == -ENOENT)
     abort_reply_entry (&e);
 }
@@ -1571,14 +2380,18 @@ xdp_fuse_open (fuse_req_t req,
 {
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   int open_flags = fi->flags;
-  g_autofree char *open_flags_string = open_flags_to_string (open_flags);
+  g_autofree char *open_flags_string = NULL;
   int fd;
   g_autofree char *path = NULL;
   XdpFile *file = NULL;
   XdpDocumentChecks checks;
   const char *op = "OPEN";
 
-  g_debug ("OPEN %lx %s", ino, open_flags_string);
+  if (G_UNLIKELY (fuse_debug))
+    {
+      open_flags_string = open_flags_to_string (open_flags);
+      g_debug ("OPEN %lx %s", ino, open_flags_string);
+    }
 
   checks = CHECK_IS_PHYSICAL;
   if (open_flags_has_write (open_flags))
@@ -1588,13 +2401,30 @@ xdp_fuse_open (fuse_req_t req,
   if (!xdp_document_inode_checks (op, req, inode, checks))
     return;
 
+  /* In writeback mode the kernel tracks the file size itself, so
+   * appends arrive with explicit offsets */
+  if (writeback_cache)
+    open_flags &= ~O_APPEND;
+
   path = fd_to_path (inode->physical->fd);
-  fd = open (path, open_flags, 0);
+  fd = -1;
+
+  /* The kernel may also need to read in a partially written page, even
+   * on a write-only file. Fall back to write-only if we can't read. */
+  if (writeback_cache && (open_flags & O_ACCMODE) == O_WRONLY)
+    fd = open (path, (open_flags & ~O_ACCMODE) | O_RDWR, 0);
+  if (fd == -1)
+    fd = open (path, open_flags, 0);
   if (fd == -1)
     return xdp_reply_err (op, req, errno);
 
   file = xdp_file_new (fd);
 
+  /* Apps asking for O_DIRECT want large I/O passed through as is, so
+   * skip the kernel page cache for this open */
+  if (open_flags & O_DIRECT)
+    fi->direct_io = 1;
+
   fi->fh = (gsize)file;
   if (fuse_reply_open (req, fi) == -ENOENT)
     {
@@ -1603,6 +2433,9 @@ xdp_fuse_open (fuse_req_t req,
     }
 }
 
+static void invalidate_name_in_other_views (XdpInode   *parent,
+                                            const char *name);
+
 static void
 xdp_fuse_create (fuse_req_t             req,
                  fuse_ino_t             parent_ino,
@@ -1612,7 +2445,7 @@ xdp_fuse_create (fuse_req_t             req,
 {
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   int open_flags = fi->flags;
-  g_autofree char *open_flags_string = open_flags_to_string (open_flags);
+  g_autofree char *open_flags_string = NULL;
   struct fuse_entry_param e;
   int res;
   xdp_autofd int fd = -1;
@@ -1621,11 +2454,23 @@ xdp_fuse_create (fuse_req_t             req,
   XdpFile *file = NULL;
   const char *op = "CREATE";
 
-  g_debug ("CREATE %lx %s %s, 0%o", parent_ino, filename, open_flags_string, mode);
+  if (G_UNLIKELY (fuse_debug))
+    {
+      open_flags_string = open_flags_to_string (open_flags);
+      g_debug ("CREATE %lx %s %s, 0%o", parent_ino, filename, open_flags_string, mode);
+    }
 
   if (!xdp_document_inode_checks (op, req, parent, CHECK_CAN_WRITE))
     return;
 
+  /* See xdp_fuse_open() */
+  if (writeback_cache)
+    {
+      open_flags &= ~O_APPEND;
+      if ((open_flags & O_ACCMODE) == O_WRONLY)
+        open_flags = (open_flags & ~O_ACCMODE) | O_RDWR;
+    }
+
   fd = xdp_document_inode_open_child_fd (parent, filename, open_flags, mode);
   if (fd < 0)
     return xdp_reply_err (op, req, -fd);
@@ -1639,8 +2484,14 @@ xdp_fuse_create (fuse_req_t             req,
   if (res != 0)
     return xdp_reply_err (op, req, -res);
 
+  invalidate_name_in_other_views (parent, filename);
+
   file = xdp_file_new (xdp_steal_fd (&fd)); /* Takes ownership of fd */
 
+  /* See xdp_fuse_open() */
+  if (open_flags & O_DIRECT)
+    fi->direct_io = 1;
+
   fi->fh = (gsize)file;
   if (fuse_reply_create (req, &e, fi) == -ENOENT)
     {
@@ -1660,7 +2511,7 @@ xdp_fuse_read (fuse_req_t req,
   struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
   XdpFile *file = (XdpFile *)fi->fh;
 
-  g_debug ("READ %lx size %ld off %ld", ino, size, off);
+  xdp_fuse_debug ("READ %lx size %ld off %ld", ino, size, off);
 
   buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
   buf.buf[0].fd = file->fd;
@@ -1682,7 +2533,7 @@ xdp_fuse_write (fuse_req_t             req,
   ssize_t res;
   const char *op = "WRITE";
 
-  g_debug ("WRITE %lx size %ld off %ld", ino, size, off);
+  xdp_fuse_debug ("WRITE %lx size %ld off %ld", ino, size, off);
 
   res = pwrite (file->fd, buf, size, off);
 
@@ -1704,7 +2555,7 @@ xdp_fuse_write_buf (fuse_req_t             req,
   ssize_t res;
   const char *op = "WRITEBUF";
 
-  g_debug ("WRITEBUF %lx off %ld", ino, off);
+  xdp_fuse_debug ("WRITEBUF %lx off %ld", ino, off);
 
   dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
   dst.buf[0].fd = file->fd;
@@ -1717,31 +2568,170 @@ xdp_fuse_write_buf (fuse_req_t             req,
     xdp_reply_err (op, req, errno);
 }
 
-static void
-xdp_fuse_fsync (fuse_req_t             req,
-                fuse_ino_t             ino,
-                int                    datasync,
-                struct fuse_file_info *fi)
-{
-  XdpFile *file = (XdpFile *)fi->fh;
-  int res;
-  const char *op = "FSYNC";
+/* Concurrent fsyncs of the same backing file share one flush. Flushes
+ * run in fsync_pool, so fuse workers don't wait on the disk. Requests
+ * only join a flush that hasn't started yet, as one that is in progress
+ * may not cover their writes. */
+#define MAX_FSYNC_THREADS 4
 
-  g_debug ("FSYNC %lx", ino);
+typedef struct {
+  XdpPhysicalInode *physical;
+  const char *op;
+  gboolean flushing;
+  /* The next flush, fd is -1 if nobody is waiting for it */
+  int fd;
+  gboolean datasync;
+  GPtrArray *reqs; /* fuse_req_t */
+} XdpFsyncGroup;
 
-  if (datasync)
-    res = fdatasync (file->fd);
-  else
-    res = fsync (file->fd);
-  if (res == 0)
-    xdp_reply_err (op, req, 0);
-  else
-    xdp_reply_err (op, req, errno);
+G_LOCK_DEFINE_STATIC (fsync_groups);
+static GHashTable *fsync_groups; /* XdpPhysicalInode -> XdpFsyncGroup */
+static GThreadPool *fsync_pool;
+
+static void
+xdp_fsync_group_free (XdpFsyncGroup *group)
+{
+  xdp_physical_inode_unref (group->physical);
+  g_ptr_array_unref (group->reqs);
+  g_free (group);
 }
 
 static void
-xdp_fuse_fallocate (fuse_req_t req,
-                    fuse_ino_t ino,
+xdp_fsync_group_flush (gpointer data,
+                       gpointer user_data)
+{
+  XdpFsyncGroup *group = data;
+
+  while (TRUE)
+    {
+      g_autoptr(GPtrArray) reqs = NULL;
+      gboolean datasync;
+      int fd, res, err;
+      guint i;
+
+      G_LOCK (fsync_groups);
+      if (group->reqs->len == 0)
+        {
+          g_hash_table_steal (fsync_groups, group->physical);
+          G_UNLOCK (fsync_groups);
+          xdp_fsync_group_free (group);
+          return;
+        }
+
+      reqs = g_steal_pointer (&group->reqs);
+      group->reqs = g_ptr_array_new ();
+      fd = group->fd;
+      group->fd = -1;
+      datasync = group->datasync;
+      G_UNLOCK (fsync_groups);
+
+      if (datasync)
+        res = fdatasync (fd);
+      else
+        res = fsync (fd);
+      err = res == 0 ? 0 : errno;
+      close (fd);
+
+      for (i = 0; i < reqs->len; i++)
+        xdp_reply_err (group->op, g_ptr_array_index (reqs, i), err);
+    }
+}
+
+/* Returns FALSE if the request has to be handled inline */
+static gboolean
+xdp_fsync_group_add (const char       *op,
+                     fuse_req_t        req,
+                     XdpPhysicalInode *physical,
+                     int               fd,
+                     int               datasync)
+{
+  XdpFsyncGroup *group;
+  gboolean start = FALSE;
+
+  if (fsync_pool == NULL || physical == NULL)
+    return FALSE;
+
+  G_LOCK (fsync_groups);
+
+  group = g_hash_table_lookup (fsync_groups, physical);
+  if (group == NULL)
+    {
+      group = g_new0 (XdpFsyncGroup, 1);
+      group->physical = xdp_physical_inode_ref (physical);
+      group->op = op;
+      group->fd = -1;
+      group->reqs = g_ptr_array_new ();
+      g_hash_table_insert (fsync_groups, physical, group);
+    }
+
+  /* The fd may be closed before the flush runs */
+  if (group->fd == -1)
+    {
+      group->fd = fcntl (fd, F_DUPFD_CLOEXEC, 3);
+      group->datasync = TRUE;
+    }
+
+  if (group->fd == -1)
+    {
+      if (!group->flushing)
+        {
+          g_hash_table_steal (fsync_groups, physical);
+          G_UNLOCK (fsync_groups);
+          xdp_fsync_group_free (group);
+        }
+      else
+        G_UNLOCK (fsync_groups);
+
+      return FALSE;
+    }
+
+  /* A full fsync covers the waiters that only need their data */
+  group->datasync = group->datasync && datasync;
+  g_ptr_array_add (group->reqs, req);
+
+  if (!group->flushing)
+    {
+      group->flushing = TRUE;
+      start = TRUE;
+    }
+
+  G_UNLOCK (fsync_groups);
+
+  if (start)
+    g_thread_pool_push (fsync_pool, group, NULL);
+
+  return TRUE;
+}
+
+static void
+xdp_fuse_fsync (fuse_req_t             req,
+                fuse_ino_t             ino,
+                int                    datasync,
+                struct fuse_file_info *fi)
+{
+  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  XdpFile *file = (XdpFile *)fi->fh;
+  int res;
+  const char *op = "FSYNC";
+
+  xdp_fuse_debug ("FSYNC %lx", ino);
+
+  if (xdp_fsync_group_add (op, req, inode->physical, file->fd, datasync))
+    return;
+
+  if (datasync)
+    res = fdatasync (file->fd);
+  else
+    res = fsync (file->fd);
+  if (res == 0)
+    xdp_reply_err (op, req, 0);
+  else
+    xdp_reply_err (op, req, errno);
+}
+
+static void
+xdp_fuse_fallocate (fuse_req_t req,
+                    fuse_ino_t ino,
                     int mode,
                     off_t offset,
                     off_t length,
@@ -1751,7 +2741,7 @@ xdp_fuse_fallocate (fuse_req_t req,
   int res;
   const char *op = "FALLOCATE";
 
-  g_debug ("FALLOCATE %lx", ino);
+  xdp_fuse_debug ("FALLOCATE %lx", ino);
 
   res = fallocate (file->fd, mode, offset, length);
 
@@ -1768,7 +2758,11 @@ xdp_fuse_flush (fuse_req_t req,
 {
   const char *op = "FLUSH";
 
-  g_debug ("FLUSH %lx", ino);
+  xdp_fuse_debug ("FLUSH %lx", ino);
+
+  /* Nothing is buffered here; in writeback mode the kernel writes back
+   * the dirty pages before sending FLUSH or FSYNC, and reports any
+   * failed WRITE from close(). */
   xdp_reply_err (op, req, 0);
 }
 
@@ -1780,24 +2774,75 @@ xdp_fuse_release (fuse_req_t             req,
   XdpFile *file = (XdpFile *)fi->fh;
   const char *op = "RELEASE";
 
-  g_debug ("RELEASE %lx", ino);
+  xdp_fuse_debug ("RELEASE %lx", ino);
 
   xdp_file_free (file);
 
   xdp_reply_err (op, req, 0);
 }
 
-static void
+/* Inodes whose last ref was dropped by a forget are torn down in
+ * this thread, so that the big forget batches the kernel sends after
+ * e.g. a find over the mount don't stall the fuse workers on inode
+ * locks and closing fds. Pushing reaper_quit stops the thread. */
+static GThread *reaper_thread;
+static GAsyncQueue *reaper_queue;
+static char reaper_quit;
+
+static gpointer
+xdp_fuse_reaper_thread (gpointer data)
+{
+  while (TRUE)
+    {
+      gpointer item = g_async_queue_pop (reaper_queue);
+
+      if (item == &reaper_quit)
+        break;
+
+      xdp_inode_unref (item);
+    }
+
+  return NULL;
+}
+
+/* Drops nlookup kernel refs on ino. Returns the inode if only the ref
+ * that may tear it down is left, which is passed to the caller. */
+static XdpInode *
 forget_one (fuse_ino_t ino,
             unsigned long nlookup)
 {
-  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  /* The kernel refs keep the inode alive, so no need to take a ref */
+  XdpInode *inode = _xdp_inode_from_maybe_ino (ino);
+  gint n = nlookup;
+  gint old_ref;
+
+  if (n <= 0)
+    return NULL;
+
+ retry_atomic_decrement1:
+  old_ref = g_atomic_int_get (&inode->kernel_ref_count);
+  if (old_ref < n)
+    {
+      g_warning ("Can't kernel_unref inode with no kernel refs");
+      return NULL;
+    }
+  if (!g_atomic_int_compare_and_exchange (&inode->kernel_ref_count, old_ref, old_ref - n))
+    goto retry_atomic_decrement1;
 
-  while (nlookup > 0)
+  /* Drop the matching normal refs at once, except for a final one */
+ retry_atomic_decrement2:
+  old_ref = g_atomic_int_get (&inode->ref_count);
+  if (old_ref > n)
     {
-      xdp_inode_kernel_unref (inode);
-      nlookup--;
+      if (!g_atomic_int_compare_and_exchange (&inode->ref_count, old_ref, old_ref - n))
+        goto retry_atomic_decrement2;
+      return NULL;
     }
+
+  if (!g_atomic_int_compare_and_exchange (&inode->ref_count, old_ref, old_ref - n + 1))
+    goto retry_atomic_decrement2;
+
+  return inode;
 }
 
 static void
@@ -1805,8 +2850,14 @@ xdp_fuse_forget (fuse_req_t req,
                  fuse_ino_t ino,
                  unsigned long nlookup)
 {
-  g_debug ("FORGET %lx %ld", ino, nlookup);
-  forget_one (ino, nlookup);
+  XdpInode *last;
+
+  xdp_fuse_debug ("FORGET %lx %ld", ino, nlookup);
+
+  last = forget_one (ino, nlookup);
+  if (last)
+    g_async_queue_push (reaper_queue, last);
+
   fuse_reply_none (req);
 }
 
@@ -1816,11 +2867,28 @@ xdp_fuse_forget_multi (fuse_req_t req,
                        struct fuse_forget_data *forgets)
 {
   size_t i;
+  gboolean locked = FALSE;
 
-  g_debug ("FORGET_MULTI %ld", count);
+  xdp_fuse_debug ("FORGET_MULTI %ld", count);
 
   for (i = 0; i < count; i++)
-    forget_one (forgets[i].ino, forgets[i].nlookup);
+    {
+      XdpInode *last = forget_one (forgets[i].ino, forgets[i].nlookup);
+
+      if (last == NULL)
+        continue;
+
+      /* Hand all of the batch to the reaper in one go */
+      if (!locked)
+        {
+          g_async_queue_lock (reaper_queue);
+          locked = TRUE;
+        }
+      g_async_queue_push_unlocked (reaper_queue, last);
+    }
+
+  if (locked)
+    g_async_queue_unlock (reaper_queue);
 
   fuse_reply_none (req);
 }
@@ -1828,181 +2896,571 @@ xdp_fuse_forget_multi (fuse_req_t req,
 static void
 xdp_dir_free (XdpDir *d)
 {
-  if (d->dir)
-    closedir (d->dir);
-  g_free (d->dirbuf);
+  if (d->dir_fd >= 0)
+    close (d->dir_fd);
+  g_free (d->dents);
+  if (d->entries)
+    g_array_unref (d->entries);
+  if (d->dirbuf)
+    g_byte_array_unref (d->dirbuf);
+  if (d->entry_ends)
+    g_array_unref (d->entry_ends);
   g_free (d);
 }
 
+static void
+xdp_dir_entry_clear (XdpDirEntry *entry)
+{
+  g_free (entry->name);
+}
+
 static void
 xdp_dir_add (XdpDir        *d,
              fuse_req_t     req,
              const char    *name,
              mode_t         mode)
 {
-  struct stat stbuf;
+  XdpDirEntry entry = { g_strdup (name), mode };
+
+  g_array_append_val (d->entries, entry);
+}
+
+/* Serializes the buffered entries once, so READDIR can reply straight
+ * from the buffer */
+static void
+xdp_dir_finish (XdpDir     *d,
+                fuse_req_t  req)
+{
+  guint i;
+
+  d->dirbuf = g_byte_array_new ();
+  d->entry_ends = g_array_sized_new (FALSE, FALSE, sizeof (gsize), d->entries->len);
+
+  for (i = 0; i < d->entries->len; i++)
+    {
+      XdpDirEntry *entry = &g_array_index (d->entries, XdpDirEntry, i);
+      struct stat st = {
+        .st_ino = FUSE_UNKNOWN_INO,
+        .st_mode = entry->mode,
+      };
+      gsize oldsize = d->dirbuf->len;
+      gsize entsize = fuse_add_direntry (req, NULL, 0, entry->name, NULL, 0);
+
+      g_byte_array_set_size (d->dirbuf, oldsize + entsize);
+      fuse_add_direntry (req, (char *) d->dirbuf->data + oldsize, entsize,
+                         entry->name, &st, i + 1);
+      g_array_append_val (d->entry_ends, d->dirbuf->len);
+    }
+}
+
+/* Thread-local READDIR scratch buffer, reused between requests */
+static void
+scratch_buf_free (gpointer data)
+{
+  g_byte_array_unref (data);
+}
+
+static GPrivate scratch_buf_key = G_PRIVATE_INIT (scratch_buf_free);
+
+static char *
+get_scratch_buf (size_t size)
+{
+  GByteArray *scratch = g_private_get (&scratch_buf_key);
+
+  if (scratch == NULL)
+    {
+      scratch = g_byte_array_new ();
+      g_private_set (&scratch_buf_key, scratch);
+    }
 
-  size_t oldsize = d->dirbuf_size;
+  if (scratch->len < size)
+    g_byte_array_set_size (scratch, size);
 
-  d->dirbuf_size += fuse_add_direntry (req, NULL, 0, name, NULL, 0);
-  d->dirbuf = (char *) g_realloc (d->dirbuf, d->dirbuf_size);
-  memset (&stbuf, 0, sizeof (stbuf));
-  stbuf.st_ino = FUSE_UNKNOWN_INO;
-  stbuf.st_mode = mode;
-  fuse_add_direntry (req, d->dirbuf + oldsize,
-                     d->dirbuf_size - oldsize,
-                     name, &stbuf,
-                     d->dirbuf_size);
+  return (char *) scratch->data;
 }
 
 static XdpDir *
-xdp_dir_new_physical (DIR *dir)
+xdp_dir_new_physical (int dir_fd) /* Takes ownership of dir_fd */
 {
   XdpDir *d = g_new0 (XdpDir, 1);
-  d->dir = dir;
+  d->dir_fd = dir_fd;
   d->offset = 0;
-  d->entry = NULL;
   return d;
 }
 
+/* Returns the next entry of a physical dir without consuming it, or
+ * NULL at the end of the dir or on errors, with errno set for the
+ * latter. As the entries carry their own offsets, seeking is just an
+ * lseek() of the fd, unlike with seekdir() and telldir(). */
+static struct xdp_dirent64 *
+xdp_dir_peek_physical (XdpDir *d,
+                       off_t   off)
+{
+  long res;
+
+  if (off != d->offset)
+    {
+      if (lseek (d->dir_fd, off, SEEK_SET) == -1)
+        return NULL;
+      d->offset = off;
+      d->dents_pos = d->dents_len = 0;
+    }
+
+  if (d->dents_pos >= d->dents_len)
+    {
+      if (d->dents == NULL)
+        d->dents = g_malloc (DENTS_BUF_SIZE);
+
+      res = syscall (SYS_getdents64, d->dir_fd, d->dents, DENTS_BUF_SIZE);
+      if (res <= 0)
+        {
+          if (res == 0)
+            errno = 0;
+          return NULL;
+        }
+
+      d->dents_pos = 0;
+      d->dents_len = res;
+    }
+
+  return (struct xdp_dirent64 *) (d->dents + d->dents_pos);
+}
+
+static void
+xdp_dir_consume_physical (XdpDir              *d,
+                          struct xdp_dirent64 *entry)
+{
+  d->dents_pos += entry->d_reclen;
+  d->offset = entry->d_off;
+}
+
 static XdpDir *
 xdp_dir_new_buffered (fuse_req_t  req)
 {
   XdpDir *d = g_new0 (XdpDir, 1);
+  d->dir_fd = -1;
+  d->entries = g_array_new (FALSE, FALSE, sizeof (XdpDirEntry));
+  g_array_set_clear_func (d->entries, (GDestroyNotify) xdp_dir_entry_clear);
   xdp_dir_add (d, req, ".", S_IFDIR);
   xdp_dir_add (d, req, "..", S_IFDIR);
   return d;
 }
 
+/* Sorted listings of the db for the virtual directories, so polling a
+ * directory doesn't scan the db each time. xdp_fuse_invalidate_docs(),
+ * which is called after every change to the documents or their
+ * permissions, drops the doc and app lists and updates the per-app
+ * doc sets in place. A listing built while the serial changed may be
+ * stale, so it is not cached. */
+G_LOCK_DEFINE_STATIC (listings);
+static guint listings_serial; /* Protected by listings */
+static char **cached_docs; /* Protected by listings */
+static char **cached_apps; /* Protected by listings */
+static GHashTable *cached_app_docs; /* app id -> XdpAppDocs, protected by listings */
+
+/* The docs an app can see, only kept for apps whose directory was
+ * listed. Lookups in /by-app/$APP check this before the db.
+ *
+ * Every app's set would otherwise hold its own copy of the ids, so
+ * they are quarks. Only ids of documents that are in the db are turned
+ * into quarks, as they are never freed; names from lookups are only
+ * ever looked up with g_quark_try_string(). */
+typedef struct {
+  GHashTable *visible; /* GQuark set of doc ids */
+  char **sorted; /* NULL until listed again after a change */
+} XdpAppDocs;
+
+#define DOC_QUARK_KEY(q) GUINT_TO_POINTER (q)
+
 static void
-xdp_dir_add_docs (XdpDir     *d,
-                  fuse_req_t  req,
-                  const char *for_app_id)
+xdp_app_docs_free (XdpAppDocs *app_docs)
 {
-  g_auto(GStrv) docs = NULL;
-  int i;
-
-  docs = xdp_list_docs ();
-  for (i = 0; docs[i] != NULL; i++)
-    {
-      if (for_app_id)
-        {
-          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (docs[i]);
-          if (entry == NULL ||
-              !app_can_see_doc (entry, for_app_id))
-            continue;
-        }
+  g_hash_table_unref (app_docs->visible);
+  g_strfreev (app_docs->sorted);
+  g_free (app_docs);
+}
 
-      xdp_dir_add (d, req, docs[i], S_IFDIR);
-    }
+static int
+strv_cmp (gconstpointer a,
+          gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
 }
 
 static void
-xdp_dir_add_apps (XdpDir     *d,
-                  XdpDomain  *domain,
-                  fuse_req_t  req,
-                  const char *for_app_id)
+invalidate_listings (void)
 {
-  g_auto(GStrv) apps = NULL;
-  g_auto(GStrv) names = NULL;
-  int i;
-
-  /* First all pre-used apps as these can be created on demand */
-  names = xdp_domain_get_inode_keys_as_string (domain);
-  for (i = 0; names[i] != NULL; i++)
-    xdp_dir_add (d, req, names[i], S_IFDIR);
-
-  /* Then all in the db (that don't already have inodes) */
-  apps = xdp_list_apps ();
-  for (i = 0; apps[i] != NULL; i++)
-    {
-      const char *app = apps[i];
-      if (!g_strv_contains ((const gchar * const *)names, app))
-        xdp_dir_add (d, req, app, S_IFDIR);
-    }
+  G_LOCK (listings);
+  listings_serial++;
+  g_clear_pointer (&cached_apps, g_strfreev);
+  g_clear_pointer (&cached_docs, g_strfreev);
+  if (cached_app_docs)
+    g_hash_table_remove_all (cached_app_docs);
+  G_UNLOCK (listings);
 }
 
+/* Updates the per-app doc sets for the changed docs, for opt_app_ids or
+ * all apps. This is one db lookup per changed doc, rather than a scan
+ * of all docs for every app the next time it is listed.
+ *
+ * The lookups happen without the lock. If another update ran in the
+ * meantime, the entries may be older than what it applied, so the sets
+ * are dropped instead and rebuilt from the db when next listed. */
 static void
-xdp_fuse_opendir (fuse_req_t             req,
-                  fuse_ino_t             ino,
-                  struct fuse_file_info *fi)
+update_listings (const char * const *doc_ids,
+                 const char * const *opt_app_ids)
 {
-  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
-  XdpDomain *domain = inode->domain;
-  XdpDir *d = NULL;
-  int open_flags = O_RDONLY | O_DIRECTORY;
-  DIR *dir;
-  const char *op = "OPENDIR";
+  g_autofree PermissionDbEntry **entries = NULL;
+  gboolean have_app_docs;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint serial;
+  guint n_docs;
+  guint i, j;
+
+  G_LOCK (listings);
+  serial = ++listings_serial;
+  g_clear_pointer (&cached_apps, g_strfreev);
+  if (opt_app_ids == NULL)
+    g_clear_pointer (&cached_docs, g_strfreev);
+  have_app_docs = cached_app_docs && g_hash_table_size (cached_app_docs) > 0;
+  G_UNLOCK (listings);
+
+  if (!have_app_docs)
+    return;
 
-  g_debug ("OPENDIR %lx domain %d", ino, inode->domain->type);
+  n_docs = g_strv_length ((char **) doc_ids);
+  entries = g_new0 (PermissionDbEntry *, n_docs);
+  for (i = 0; i < n_docs; i++)
+    entries[i] = xdp_lookup_doc (doc_ids[i]);
 
-  if (xdp_domain_is_virtual_type (domain))
+  G_LOCK (listings);
+  if (serial != listings_serial)
     {
-      d = xdp_dir_new_buffered (req);
-      switch (domain->type)
+      listings_serial++;
+      g_hash_table_iter_init (&iter, cached_app_docs);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
         {
-        case XDP_DOMAIN_ROOT:
-          xdp_dir_add (d, req, BY_APP_NAME, S_IFDIR);
-          xdp_dir_add_docs (d, req, NULL);
-          break;
-        case XDP_DOMAIN_APP:
-          xdp_dir_add_docs (d, req, domain->app_id);
-          break;
-        case XDP_DOMAIN_BY_APP:
-          xdp_dir_add_apps (d, inode->domain, req, NULL);
-          break;
-        default:
-          g_assert_not_reached ();
+          if (opt_app_ids == NULL || g_strv_contains (opt_app_ids, key))
+            g_hash_table_iter_remove (&iter);
         }
+      G_UNLOCK (listings);
+      goto out;
     }
-  else
+
+  listings_serial++;
+  g_hash_table_iter_init (&iter, cached_app_docs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      g_assert (domain->type == XDP_DOMAIN_DOCUMENT);
+      const char *app_id = key;
+      XdpAppDocs *app_docs = value;
 
-      if (domain->doc_flags & DOCUMENT_ENTRY_FLAG_DIRECTORY)
+      if (opt_app_ids && !g_strv_contains (opt_app_ids, app_id))
+        continue;
+
+      for (i = 0; i < n_docs; i++)
         {
-          int fd = xdp_document_inode_open_self_fd (inode, open_flags, 0);
-          if (fd < 0)
-            return xdp_reply_err (op, req, -fd);
+          gboolean visible = entries[i] != NULL && app_can_see_doc (entries[i], app_id);
+          gboolean changed;
 
-          dir = fdopendir (fd);
-          if (dir == NULL)
-            {
-              xdp_reply_err (op, req, errno);
-              close (fd);
-              return;
-            }
+          if (visible)
+            changed = g_hash_table_add (app_docs->visible, DOC_QUARK_KEY (g_quark_from_string (doc_ids[i])));
+          else
+            changed = g_hash_table_remove (app_docs->visible, DOC_QUARK_KEY (g_quark_try_string (doc_ids[i])));
 
-          d = xdp_dir_new_physical (dir);
+          if (changed)
+            g_clear_pointer (&app_docs->sorted, g_strfreev);
         }
-      else
-        {
-          g_autofree char *main_path = g_build_filename (domain->doc_path, domain->doc_file, NULL);
-          struct stat buf;
-          GHashTableIter iter;
-          gpointer key, value;
+    }
+  G_UNLOCK (listings);
 
-          d = xdp_dir_new_buffered (req);
+out:
+  for (j = 0; j < n_docs; j++)
+    g_clear_pointer (&entries[j], permission_db_entry_unref);
+}
 
-          if (stat (main_path, &buf) == 0)
-            xdp_dir_add (d, req, domain->doc_file, buf.st_mode);
+/* Returns 1 if app_id can see doc_id, 0 if not and -1 if that isn't
+ * known without going to the db */
+static int
+app_doc_visible_cached (const char *app_id,
+                        const char *doc_id)
+{
+  XdpAppDocs *app_docs;
+  int res = -1;
 
-          g_mutex_lock (&domain->tempfile_mutex);
+  G_LOCK (listings);
+  if (cached_app_docs &&
+      (app_docs = g_hash_table_lookup (cached_app_docs, app_id)) != NULL)
+    res = g_hash_table_contains (app_docs->visible, DOC_QUARK_KEY (g_quark_try_string (doc_id))) ? 1 : 0;
+  G_UNLOCK (listings);
 
-          g_hash_table_iter_init (&iter, domain->tempfiles);
-          while (g_hash_table_iter_next (&iter, &key, &value))
-            {
-              const char *tempname = key;
-              xdp_dir_add (d, req, tempname, S_IFREG);
-            }
+  return res;
+}
 
-          g_mutex_unlock (&domain->tempfile_mutex);
-        }
-    }
+/* Drops the listing and dir fd caches, they are refilled on demand */
+void
+xdp_fuse_trim_caches (void)
+{
+  GList *link;
 
-   fi->fh = (gsize)d;
+  invalidate_listings ();
 
-  if (fuse_reply_open (req, fi) == -ENOENT)
+  G_LOCK (dirfd_cache);
+  while ((link = g_queue_pop_head_link (&dirfd_cache)) != NULL)
+    {
+      XdpDocInfo *info = link->data;
+
+      g_clear_pointer (&info->cached_dirfd, xdp_dir_fd_unref);
+    }
+  G_UNLOCK (dirfd_cache);
+
+  trim_forgotten_physical ();
+}
+
+static char **
+sorted_doc_ids (GHashTable *set)
+{
+  GHashTableIter iter;
+  gpointer key;
+  char **docs;
+  guint i = 0;
+
+  docs = g_new (char *, g_hash_table_size (set) + 1);
+  g_hash_table_iter_init (&iter, set);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    docs[i++] = g_strdup (g_quark_to_string (GPOINTER_TO_UINT (key)));
+  docs[i] = NULL;
+
+  qsort (docs, i, sizeof (char *), strv_cmp);
+
+  return docs;
+}
+
+/* Returns a sorted copy of the docs visible to for_app_id, or all docs */
+static char **
+list_docs_cached (const char *for_app_id)
+{
+  g_autoptr(GHashTable) visible = NULL;
+  char **docs = NULL;
+  guint serial;
+  int i;
+
+  G_LOCK (listings);
+  if (for_app_id == NULL)
+    {
+      if (cached_docs)
+        docs = g_strdupv (cached_docs);
+    }
+  else if (cached_app_docs)
+    {
+      XdpAppDocs *app_docs = g_hash_table_lookup (cached_app_docs, for_app_id);
+      if (app_docs)
+        {
+          if (app_docs->sorted == NULL)
+            app_docs->sorted = sorted_doc_ids (app_docs->visible);
+          docs = g_strdupv (app_docs->sorted);
+        }
+    }
+  serial = listings_serial;
+  G_UNLOCK (listings);
+
+  if (docs)
+    return docs;
+
+  if (for_app_id == NULL)
+    {
+      docs = xdp_list_docs ();
+      qsort (docs, g_strv_length (docs), sizeof (char *), strv_cmp);
+    }
+  else
+    {
+      g_auto(GStrv) all_docs = list_docs_cached (NULL);
+
+      visible = g_hash_table_new (NULL, NULL);
+      for (i = 0; all_docs[i] != NULL; i++)
+        {
+          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (all_docs[i]);
+          if (entry != NULL &&
+              app_can_see_doc (entry, for_app_id))
+            g_hash_table_add (visible, DOC_QUARK_KEY (g_quark_from_string (all_docs[i])));
+        }
+      docs = sorted_doc_ids (visible);
+    }
+
+  G_LOCK (listings);
+  if (serial == listings_serial)
+    {
+      if (for_app_id == NULL)
+        {
+          g_strfreev (cached_docs);
+          cached_docs = g_strdupv (docs);
+        }
+      else
+        {
+          XdpAppDocs *app_docs = g_new0 (XdpAppDocs, 1);
+
+          app_docs->visible = g_steal_pointer (&visible);
+          app_docs->sorted = g_strdupv (docs);
+
+          if (cached_app_docs == NULL)
+            cached_app_docs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, (GDestroyNotify) xdp_app_docs_free);
+          g_hash_table_replace (cached_app_docs, g_strdup (for_app_id), app_docs);
+        }
+    }
+  G_UNLOCK (listings);
+
+  return docs;
+}
+
+static char **
+list_apps_cached (void)
+{
+  char **apps = NULL;
+  guint serial;
+
+  G_LOCK (listings);
+  if (cached_apps)
+    apps = g_strdupv (cached_apps);
+  serial = listings_serial;
+  G_UNLOCK (listings);
+
+  if (apps)
+    return apps;
+
+  apps = xdp_list_apps ();
+  qsort (apps, g_strv_length (apps), sizeof (char *), strv_cmp);
+
+  G_LOCK (listings);
+  if (serial == listings_serial)
+    {
+      g_strfreev (cached_apps);
+      cached_apps = g_strdupv (apps);
+    }
+  G_UNLOCK (listings);
+
+  return apps;
+}
+
+static void
+xdp_dir_add_docs (XdpDir     *d,
+                  fuse_req_t  req,
+                  const char *for_app_id)
+{
+  g_auto(GStrv) docs = NULL;
+  int i;
+
+  docs = list_docs_cached (for_app_id);
+  for (i = 0; docs[i] != NULL; i++)
+    xdp_dir_add (d, req, docs[i], S_IFDIR);
+}
+
+static void
+xdp_dir_add_apps (XdpDir     *d,
+                  XdpDomain  *domain,
+                  fuse_req_t  req,
+                  const char *for_app_id)
+{
+  g_auto(GStrv) apps = NULL;
+  g_auto(GStrv) names = NULL;
+  g_autoptr(GPtrArray) all = g_ptr_array_new ();
+  int i;
+
+  /* All pre-used apps as these can be created on demand, and then all
+   * in the db (that don't already have inodes), sorted together so the
+   * order is stable between listings */
+  names = xdp_domain_get_inode_keys_as_string (domain);
+  for (i = 0; names[i] != NULL; i++)
+    g_ptr_array_add (all, names[i]);
+
+  apps = list_apps_cached ();
+  for (i = 0; apps[i] != NULL; i++)
+    {
+      const char *app = apps[i];
+      if (!g_strv_contains ((const gchar * const *)names, app))
+        g_ptr_array_add (all, (char *) app);
+    }
+
+  g_ptr_array_sort (all, strv_cmp);
+  for (i = 0; i < all->len; i++)
+    xdp_dir_add (d, req, g_ptr_array_index (all, i), S_IFDIR);
+}
+
+static void
+xdp_fuse_opendir (fuse_req_t             req,
+                  fuse_ino_t             ino,
+                  struct fuse_file_info *fi)
+{
+  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  XdpDomain *domain = inode->domain;
+  XdpDir *d = NULL;
+  int open_flags = O_RDONLY | O_DIRECTORY;
+  const char *op = "OPENDIR";
+
+  xdp_fuse_debug ("OPENDIR %lx domain %d", ino, inode->domain->type);
+
+  if (xdp_domain_is_virtual_type (domain))
+    {
+      d = xdp_dir_new_buffered (req);
+      switch (domain->type)
+        {
+        case XDP_DOMAIN_ROOT:
+          xdp_dir_add (d, req, BY_APP_NAME, S_IFDIR);
+          xdp_dir_add_docs (d, req, NULL);
+          break;
+        case XDP_DOMAIN_APP:
+          xdp_dir_add_docs (d, req, domain->app_id);
+          break;
+        case XDP_DOMAIN_BY_APP:
+          xdp_dir_add_apps (d, inode->domain, req, NULL);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+  else
+    {
+      g_assert (domain->type == XDP_DOMAIN_DOCUMENT);
+
+      if (domain->doc_flags & DOCUMENT_ENTRY_FLAG_DIRECTORY)
+        {
+          int fd = xdp_document_inode_open_self_fd (inode, open_flags, 0);
+          if (fd < 0)
+            return xdp_reply_err (op, req, -fd);
+
+          d = xdp_dir_new_physical (fd);
+        }
+      else
+        {
+          g_autofree char *main_path = g_build_filename (domain->doc_path, domain->doc_file, NULL);
+          struct stat buf;
+          GHashTableIter iter;
+          gpointer key, value;
+
+          d = xdp_dir_new_buffered (req);
+
+          if (stat (main_path, &buf) == 0)
+            xdp_dir_add (d, req, domain->doc_file, buf.st_mode);
+
+          g_mutex_lock (&domain->tempfile_mutex);
+
+          g_hash_table_iter_init (&iter, domain->tempfiles);
+          while (g_hash_table_iter_next (&iter, &key, &value))
+            {
+              const char *tempname = key;
+              xdp_dir_add (d, req, tempname, S_IFREG);
+            }
+
+          g_mutex_unlock (&domain->tempfile_mutex);
+        }
+    }
+
+  if (d->entries)
+    xdp_dir_finish (d, req);
+
+  fi->fh = (gsize)d;
+
+  if (fuse_reply_open (req, fi) == -ENOENT)
     {
       /* The opendir syscall was interrupted, so it  must be cancelled */
       xdp_dir_free (d);
@@ -2021,55 +3479,36 @@ xdp_fuse_readdir (fuse_req_t req,
   size_t rem;
   const char *op = "READDIR";
 
-  g_debug ("READDIR %lx %ld %ld", ino, size, off);
+  xdp_fuse_debug ("READDIR %lx %ld %ld", ino, size, off);
 
-  if (d->dir)
+  if (d->dir_fd >= 0)
     {
-      g_autofree char *buf = g_try_malloc (size);
-
-      if (buf == NULL)
-        {
-          xdp_reply_err (op, req, ENOMEM);
-          return;
-        }
-
-      /* If offset is not same, need to seek it */
-      if (off != d->offset)
-        {
-          seekdir (d->dir, off);
-          d->entry = NULL;
-          d->offset = off;
-        }
+      char *buf = get_scratch_buf (size);
 
       p = buf;
       rem = size;
       while (TRUE)
         {
+          struct xdp_dirent64 *entry;
           size_t entsize;
-          off_t nextoff;
 
-          if (!d->entry)
+          entry = xdp_dir_peek_physical (d, off);
+          if (entry == NULL)
             {
-              errno = 0;
-              d->entry = readdir (d->dir);
-              if (!d->entry)
+              if (errno && rem == size)
                 {
-                  if (errno && rem == size)
-                    {
-                      xdp_reply_err (op, req, errno);
-                      return;
-                    }
-                  break;
+                  xdp_reply_err (op, req, errno);
+                  return;
                 }
+              break;
             }
-          nextoff = telldir (d->dir);
 
           struct stat st = {
             .st_ino = FUSE_UNKNOWN_INO,
-            .st_mode = d->entry->d_type << 12,
+            .st_mode = entry->d_type << 12,
           };
           entsize = fuse_add_direntry (req, p, rem,
-                                       d->entry->d_name, &st, nextoff);
+                                       entry->d_name, &st, entry->d_off);
           /* The above function returns the size of the entry size even though
            * the copy failed due to smaller buf size, so I'm checking after this
            * function and breaking out incase we exceed the size.
@@ -2080,24 +3519,167 @@ xdp_fuse_readdir (fuse_req_t req,
           p += entsize;
           rem -= entsize;
 
-          d->entry = NULL;
-          d->offset = nextoff;
+          xdp_dir_consume_physical (d, entry);
+          off = d->offset;
         }
 
       fuse_reply_buf(req, buf, size - rem);
     }
   else
     {
-      if (off < d->dirbuf_size)
+      guint n = d->entry_ends->len;
+      gsize start, end;
+      guint lo, hi;
+
+      if (off < 0 || off >= n)
         {
-          gsize reply_size = MIN (d->dirbuf_size - off, size);
-          g_autofree char *buf = g_memdup (d->dirbuf + off, reply_size);
-          fuse_reply_buf (req, buf, reply_size);
+          fuse_reply_buf (req, NULL, 0);
+          return;
+        }
+
+      start = off == 0 ? 0 : g_array_index (d->entry_ends, gsize, off - 1);
+
+      /* Find the last entry that fits */
+      lo = off;
+      hi = n;
+      while (lo < hi)
+        {
+          guint mid = lo + (hi - lo) / 2;
+
+          if (g_array_index (d->entry_ends, gsize, mid) - start <= size)
+            lo = mid + 1;
+          else
+            hi = mid;
         }
+      end = lo == off ? start : g_array_index (d->entry_ends, gsize, lo - 1);
+
+      fuse_reply_buf (req, (char *) d->dirbuf->data + start, end - start);
+    }
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+/* Adds one READDIRPLUS entry, looking up the child so that the kernel
+ * doesn't have to. Returns the entry size, which is larger than rem if
+ * it didn't fit. */
+static size_t
+xdp_dir_add_plus (fuse_req_t  req,
+                  XdpInode   *dir_inode,
+                  char       *p,
+                  size_t      rem,
+                  const char *name,
+                  mode_t      mode,
+                  off_t       nextoff,
+                  GArray     *reffed)
+{
+  struct fuse_entry_param e = { 0 };
+  size_t entsize;
+
+  /* Never resolve "." and "..", see xdp_fuse_lookup(). A zero ino makes
+   * the kernel treat this as a plain readdir entry. */
+  if (strcmp (name, ".") == 0 ||
+      strcmp (name, "..") == 0 ||
+      xdp_lookup_child (dir_inode, name, &e) != 0)
+    {
+      memset (&e, 0, sizeof (e));
+      e.attr.st_ino = FUSE_UNKNOWN_INO;
+      e.attr.st_mode = mode;
+    }
+
+  entsize = fuse_add_direntry_plus (req, p, rem, name, &e, nextoff);
+  if (e.ino != 0)
+    {
+      if (entsize > rem)
+        abort_reply_entry (&e);
       else
-        fuse_reply_buf (req, NULL, 0);
+        g_array_append_val (reffed, e.ino);
+    }
+
+  return entsize;
+}
+
+static void
+xdp_fuse_readdirplus (fuse_req_t req,
+                      fuse_ino_t ino,
+                      size_t size,
+                      off_t off,
+                      struct fuse_file_info *fi)
+{
+  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  g_autoptr(GArray) reffed = g_array_new (FALSE, FALSE, sizeof (fuse_ino_t));
+  XdpDir *d = (XdpDir *)fi->fh;
+  char *buf;
+  char *p;
+  size_t rem;
+  guint i;
+  const char *op = "READDIRPLUS";
+
+  xdp_fuse_debug ("READDIRPLUS %lx %ld %ld", ino, size, off);
+
+  buf = get_scratch_buf (size);
+
+  p = buf;
+  rem = size;
+
+  if (d->dir_fd >= 0)
+    {
+      while (TRUE)
+        {
+          struct xdp_dirent64 *entry;
+          size_t entsize;
+
+          entry = xdp_dir_peek_physical (d, off);
+          if (entry == NULL)
+            {
+              if (errno && rem == size)
+                {
+                  xdp_reply_err (op, req, errno);
+                  return;
+                }
+              break;
+            }
+
+          entsize = xdp_dir_add_plus (req, inode, p, rem,
+                                      entry->d_name, entry->d_type << 12,
+                                      entry->d_off, reffed);
+          if (entsize > rem)
+            break;
+
+          p += entsize;
+          rem -= entsize;
+
+          xdp_dir_consume_physical (d, entry);
+          off = d->offset;
+        }
+    }
+  else
+    {
+      for (i = MAX (off, 0); i < d->entries->len; i++)
+        {
+          XdpDirEntry *entry = &g_array_index (d->entries, XdpDirEntry, i);
+          size_t entsize;
+
+          entsize = xdp_dir_add_plus (req, inode, p, rem,
+                                      entry->name, entry->mode,
+                                      i + 1, reffed);
+          if (entsize > rem)
+            break;
+
+          p += entsize;
+          rem -= entsize;
+        }
+    }
+
+  if (fuse_reply_buf (req, buf, size - rem) == -ENOENT)
+    {
+      /* Interrupted, so the kernel never saw the entries */
+      for (i = 0; i < reffed->len; i++)
+        {
+          struct fuse_entry_param e = { .ino = g_array_index (reffed, fuse_ino_t, i) };
+          abort_reply_entry (&e);
+        }
     }
 }
+#endif
 
 static void
 xdp_fuse_releasedir (fuse_req_t             req,
@@ -2107,7 +3689,7 @@ xdp_fuse_releasedir (fuse_req_t             req,
   XdpDir *d = (XdpDir *)fi->fh;
   const char *op = "RELEASEDIR";
 
-  g_debug ("RELEASEDIR %lx", ino);
+  xdp_fuse_debug ("RELEASEDIR %lx", ino);
 
   xdp_dir_free (d);
 
@@ -2120,15 +3702,20 @@ xdp_fuse_fsyncdir (fuse_req_t             req,
                    int                    datasync,
                    struct fuse_file_info *fi)
 {
+  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   XdpDir *dir = (XdpDir *)fi->fh;
   int fd, res;
   const char *op = "FSYNCDIR";
 
-  g_debug ("FSYNCDIR %lx", ino);
+  xdp_fuse_debug ("FSYNCDIR %lx", ino);
+
+  if (dir->dir_fd >= 0 &&
+      xdp_fsync_group_add (op, req, inode->physical, dir->dir_fd, datasync))
+    return;
 
-  if (dir->dir)
+  if (dir->dir_fd >= 0)
     {
-      fd = dirfd (dir->dir);
+      fd = dir->dir_fd;
       if (datasync)
         res = fdatasync (fd);
       else
@@ -2152,18 +3739,18 @@ xdp_fuse_mkdir (fuse_req_t  req,
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   struct fuse_entry_param e;
   int res;
-  xdp_autofd int close_fd = -1;
+  g_autoptr(XdpDirFd) dirfd_ref = NULL;
   int dirfd;
   const char *op = "MKDIR";
 
-  g_debug ("MKDIR %lx %s", parent_ino, name);
+  xdp_fuse_debug ("MKDIR %lx %s", parent_ino, name);
 
   if (!xdp_document_inode_checks (op, req, parent,
                                   CHECK_CAN_WRITE |
                                   CHECK_IS_DIRECTORY))
     return;
 
-  dirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd);
+  dirfd = xdp_document_inode_ensure_dirfd (parent, &dirfd_ref);
   if (dirfd < 0)
     return xdp_reply_err (op, req, -dirfd);
 
@@ -2171,6 +3758,8 @@ xdp_fuse_mkdir (fuse_req_t  req,
   if (res != 0)
     return xdp_reply_err (op, req, errno);
 
+  invalidate_name_in_other_views (parent, name);
+
   res = ensure_docdir_inode_by_name (parent->domain, dirfd, name, &e); /* Takes ownershif of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
@@ -2189,7 +3778,7 @@ xdp_fuse_unlink (fuse_req_t  req,
   int res = -1;
   const char * op = "UNLINK";
 
-  g_debug ("UNLINK %lx %s", parent_ino, filename);
+  xdp_fuse_debug ("UNLINK %lx %s", parent_ino, filename);
 
   if (!xdp_document_inode_checks (op, req, parent,
                                   CHECK_CAN_WRITE))
@@ -2203,11 +3792,12 @@ xdp_fuse_unlink (fuse_req_t  req,
     }
   else
     {
-      xdp_autofd int dirfd = -1;
+      g_autoptr(XdpDirFd) dirfd_ref = NULL;
+      int dirfd;
 
-      dirfd = xdp_nonphysical_document_inode_opendir (parent);
+      dirfd = xdp_nonphysical_document_inode_opendir (parent, &dirfd_ref);
       if (dirfd < 0)
-        xdp_reply_err (op, req, -dirfd);
+        return xdp_reply_err (op, req, -dirfd);
 
       if (parent_domain->doc_flags & DOCUMENT_ENTRY_FLAG_DIRECTORY ||
           strcmp (filename, parent_domain->doc_file) == 0)
@@ -2245,11 +3835,11 @@ xdp_fuse_rename (fuse_req_t  req,
   XdpDomain *domain;
   int res, errsv;
   int olddirfd, newdirfd, dirfd;
-  xdp_autofd int close_fd1 = -1;
-  xdp_autofd int close_fd2 = -1;
+  g_autoptr(XdpDirFd) dirfd_ref1 = NULL;
+  g_autoptr(XdpDirFd) dirfd_ref2 = NULL;
   const char *op = "RENAME";
 
-  g_debug ("RENAME %lx %s -> %lx %s", parent_ino, name, newparent_ino, newname);
+  xdp_fuse_debug ("RENAME %lx %s -> %lx %s", parent_ino, name, newparent_ino, newname);
 
   if (!xdp_document_inode_checks (op, req, parent,
                                   CHECK_CAN_WRITE))
@@ -2262,11 +3852,11 @@ xdp_fuse_rename (fuse_req_t  req,
   domain = parent->domain;
   if (domain->doc_flags & DOCUMENT_ENTRY_FLAG_DIRECTORY)
     {
-      olddirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd1);
+      olddirfd = xdp_document_inode_ensure_dirfd (parent, &dirfd_ref1);
       if (olddirfd < 0)
         return xdp_reply_err (op, req, -olddirfd);
 
-      newdirfd = xdp_document_inode_ensure_dirfd (newparent, &close_fd2);
+      newdirfd = xdp_document_inode_ensure_dirfd (newparent, &dirfd_ref2);
       if (newdirfd < 0)
         return xdp_reply_err (op, req, -newdirfd);
 
@@ -2274,6 +3864,8 @@ xdp_fuse_rename (fuse_req_t  req,
       if (res != 0)
         return xdp_reply_err (op, req, errno);
 
+      invalidate_name_in_other_views (newparent, newname);
+
       xdp_reply_err (op, req, 0);
     }
   else
@@ -2286,10 +3878,9 @@ xdp_fuse_rename (fuse_req_t  req,
       if (strcmp (name, newname) == 0)
         return xdp_reply_err (op, req, 0);
 
-      dirfd = xdp_nonphysical_document_inode_opendir (parent);
+      dirfd = xdp_nonphysical_document_inode_opendir (parent, &dirfd_ref1);
       if (dirfd < 0)
         return xdp_reply_err (op, req, -dirfd);
-      close_fd1 = dirfd;
 
       if (strcmp (name, domain->doc_file) == 0)
         {
@@ -2335,10 +3926,23 @@ xdp_fuse_rename (fuse_req_t  req,
             {
               XdpTempfile *tempfile = stolen_value;
 
-              res = renameat (dirfd, tempfile->tempname, dirfd, newname);
-              errsv = errno;
+              if (tempfile->tempname == NULL)
+                {
+                  /* Unnamed, link it in and atomically replace the main file */
+                  res = link_temp_at (dirfd, tempfile->physical->fd, newname,
+                                      &tempfile->tempname);
+                  errsv = -res;
+                }
+              else
+                res = 0;
+
+              if (res == 0)
+                {
+                  res = renameat (dirfd, tempfile->tempname, dirfd, newname);
+                  errsv = errno;
+                }
 
-              if (res == -1) /* Revert tempfile steal */
+              if (res != 0) /* Revert tempfile steal */
                 g_hash_table_replace (domain->tempfiles, tempfile->name, tempfile);
               else
                 {
@@ -2358,6 +3962,9 @@ xdp_fuse_rename (fuse_req_t  req,
           if (res != 0)
             return xdp_reply_err (op, req, errsv);
 
+          /* Tempfiles are only seen in this view, but the main file isn't */
+          invalidate_name_in_other_views (parent, newname);
+
           xdp_reply_err (op, req, 0);
         }
       else
@@ -2401,7 +4008,7 @@ xdp_fuse_access (fuse_req_t req,
   int res;
   const char *op = "ACCESS";
 
-  g_debug ("ACCESS %lx", ino);
+  xdp_fuse_debug ("ACCESS %lx", ino);
 
   if (inode->domain->type != XDP_DOMAIN_DOCUMENT)
     {
@@ -2437,18 +4044,18 @@ xdp_fuse_rmdir (fuse_req_t req,
                 const char *filename)
 {
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
-  xdp_autofd int close_fd = -1;
+  g_autoptr(XdpDirFd) dirfd_ref = NULL;
   int dirfd;
   int res;
   const char *op = "RMDIR";
 
-  g_debug ("RMDIR %lx %s", parent_ino, filename);
+  xdp_fuse_debug ("RMDIR %lx %s", parent_ino, filename);
 
   if (!xdp_document_inode_checks (op, req, parent,
                                   CHECK_CAN_WRITE | CHECK_IS_DIRECTORY))
     return;
 
-  dirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd);
+  dirfd = xdp_document_inode_ensure_dirfd (parent, &dirfd_ref);
   if (dirfd < 0)
     return xdp_reply_err (op, req, -dirfd);
 
@@ -2468,7 +4075,7 @@ xdp_fuse_readlink (fuse_req_t req,
   ssize_t res;
   const char *op = "READLINK";
 
-  g_debug ("READLINK %lx", ino);
+  xdp_fuse_debug ("READLINK %lx", ino);
 
   if (!xdp_document_inode_checks (op, req, inode,
                                   CHECK_IS_DIRECTORY))
@@ -2494,17 +4101,17 @@ xdp_fuse_symlink (fuse_req_t req,
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   int res;
   int dirfd;
-  xdp_autofd int close_fd = -1;
+  g_autoptr(XdpDirFd) dirfd_ref = NULL;
   struct fuse_entry_param e;
   const char * op = "SYMLINK";
 
-  g_debug ("SYMLINK %s %lx %s", link, parent_ino, name);
+  xdp_fuse_debug ("SYMLINK %s %lx %s", link, parent_ino, name);
 
   if (!xdp_document_inode_checks (op, req, parent,
                                   CHECK_CAN_WRITE | CHECK_IS_DIRECTORY))
     return;
 
-  dirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd);
+  dirfd = xdp_document_inode_ensure_dirfd (parent, &dirfd_ref);
   if (dirfd < 0)
     return xdp_reply_err (op, req, -dirfd);
 
@@ -2512,6 +4119,8 @@ xdp_fuse_symlink (fuse_req_t req,
   if (res != 0)
     return xdp_reply_err (op, req, errno);
 
+  invalidate_name_in_other_views (parent, name);
+
   res = ensure_docdir_inode_by_name (parent->domain, dirfd, name, &e); /* Takes ownershif of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
@@ -2531,11 +4140,11 @@ xdp_fuse_link (fuse_req_t req,
   int res;
   g_autofree char *proc_path = NULL;
   int newparent_dirfd;
-  xdp_autofd int close_fd = -1;
+  g_autoptr(XdpDirFd) dirfd_ref = NULL;
   struct fuse_entry_param e;
   const char * op = "LINK";
 
-  g_debug ("LINK %lx %lx %s", ino, newparent_ino, newname);
+  xdp_fuse_debug ("LINK %lx %lx %s", ino, newparent_ino, newname);
 
   /* hardlinks only supported in docdirs, and only physical files */
   if (!xdp_document_inode_checks (op, req, inode,
@@ -2547,7 +4156,7 @@ xdp_fuse_link (fuse_req_t req,
     return xdp_reply_err (op, req, EXDEV);
 
   proc_path = fd_to_path (inode->physical->fd);
-  newparent_dirfd = xdp_document_inode_ensure_dirfd (newparent, &close_fd);
+  newparent_dirfd = xdp_document_inode_ensure_dirfd (newparent, &dirfd_ref);
   if (newparent_dirfd < 0)
     return xdp_reply_err (op, req, -newparent_dirfd);
 
@@ -2555,6 +4164,8 @@ xdp_fuse_link (fuse_req_t req,
   if (res != 0)
     return xdp_reply_err (op, req, errno);
 
+  invalidate_name_in_other_views (newparent, newname);
+
   res = ensure_docdir_inode_by_name (inode->domain, newparent_dirfd, newname, &e); /* Takes ownership of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
@@ -2564,29 +4175,235 @@ xdp_fuse_link (fuse_req_t req,
 }
 
 
-static void
-xdp_fuse_statfs (fuse_req_t req,
-                 fuse_ino_t ino)
+/* Called with meta_cache lock held */
+static XdpMetaCache *
+xdp_document_inode_get_meta_cache (XdpInode *inode)
 {
-  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
-  struct statvfs buf;
-  int res;
-  const char *op = "STATFS";
+  XdpMetaCache **cachep;
 
-  g_debug ("STATFS %lx", ino);
+  if (inode->physical)
+    cachep = &inode->physical->meta_cache;
+  else
+    cachep = &inode->domain->doc_info->meta_cache;
+
+  if (*cachep == NULL)
+    *cachep = g_new0 (XdpMetaCache, 1);
+
+  return *cachep;
+}
+
+/* Called with meta_cache lock held */
+static void
+xdp_meta_cache_expire_xattrs (XdpMetaCache *cache,
+                              gint64        now)
+{
+  if (cache->xattrs_expires <= now)
+    {
+      g_clear_pointer (&cache->xattrs, g_hash_table_unref);
+      g_clear_pointer (&cache->xattr_list, g_bytes_unref);
+      cache->xattrs_expires = now + META_CACHE_TTL_USEC;
+    }
+}
+
+static void
+xdp_document_inode_clear_xattr_cache (XdpInode *inode)
+{
+  XdpMetaCache *cache;
+
+  G_LOCK (meta_cache);
+  cache = xdp_document_inode_get_meta_cache (inode);
+  cache->xattrs_expires = 0;
+  cache->xattrs_serial++;
+  G_UNLOCK (meta_cache);
+}
+
+/* Returns the size of the value, or -errno */
+static ssize_t
+xdp_document_inode_getxattr (XdpInode   *inode,
+                             const char *name,
+                             GBytes    **value_out)
+{
+  XdpMetaCache *cache;
+  g_autofree char *path = NULL;
+  g_autofree char *buf = NULL;
+  g_autoptr(GBytes) value = NULL;
+  gpointer cached = NULL;
+  gboolean found = FALSE;
+  guint serial;
+  ssize_t res;
+
+  G_LOCK (meta_cache);
+  cache = xdp_document_inode_get_meta_cache (inode);
+  xdp_meta_cache_expire_xattrs (cache, g_get_monotonic_time ());
+  if (cache->xattrs)
+    found = g_hash_table_lookup_extended (cache->xattrs, name, NULL, &cached);
+  if (cached)
+    value = g_bytes_ref (cached);
+  serial = cache->xattrs_serial;
+  G_UNLOCK (meta_cache);
+
+  if (found)
+    {
+      if (value == NULL)
+        return -ENODATA;
+      *value_out = g_steal_pointer (&value);
+      return g_bytes_get_size (*value_out);
+    }
+
+  path = xdp_document_inode_get_self_as_path (inode);
+  do
+    {
+      res = getxattr (path, name, NULL, 0);
+      if (res < 0)
+        break;
+      buf = g_realloc (buf, MAX (res, 1));
+      res = getxattr (path, name, buf, res);
+    }
+  while (res < 0 && errno == ERANGE);
+
+  if (res < 0)
+    {
+      res = -errno;
+      if (res != -ENODATA)
+        return res;
+    }
+  else
+    value = g_bytes_new_take (g_steal_pointer (&buf), res);
+
+  G_LOCK (meta_cache);
+  cache = xdp_document_inode_get_meta_cache (inode);
+  if (cache->xattrs_serial == serial)
+    {
+      if (cache->xattrs == NULL)
+        cache->xattrs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, (GDestroyNotify) g_bytes_unref);
+      g_hash_table_replace (cache->xattrs, g_strdup (name),
+                            value ? g_bytes_ref (value) : NULL);
+    }
+  G_UNLOCK (meta_cache);
+
+  if (res < 0)
+    return res;
+
+  *value_out = g_steal_pointer (&value);
+  return res;
+}
+
+/* Returns the size of the list, or -errno */
+static ssize_t
+xdp_document_inode_listxattr (XdpInode *inode,
+                              GBytes  **list_out)
+{
+  XdpMetaCache *cache;
+  g_autofree char *path = NULL;
+  g_autofree char *buf = NULL;
+  g_autoptr(GBytes) list = NULL;
+  guint serial;
+  ssize_t res;
+
+  G_LOCK (meta_cache);
+  cache = xdp_document_inode_get_meta_cache (inode);
+  xdp_meta_cache_expire_xattrs (cache, g_get_monotonic_time ());
+  if (cache->xattr_list)
+    list = g_bytes_ref (cache->xattr_list);
+  serial = cache->xattrs_serial;
+  G_UNLOCK (meta_cache);
+
+  if (list == NULL)
+    {
+      path = xdp_document_inode_get_self_as_path (inode);
+      do
+        {
+          res = listxattr (path, NULL, 0);
+          if (res < 0)
+            break;
+          buf = g_realloc (buf, MAX (res, 1));
+          res = listxattr (path, buf, res);
+        }
+      while (res < 0 && errno == ERANGE);
+
+      if (res < 0)
+        return -errno;
+
+      list = g_bytes_new_take (g_steal_pointer (&buf), res);
+
+      G_LOCK (meta_cache);
+      cache = xdp_document_inode_get_meta_cache (inode);
+      if (cache->xattrs_serial == serial && cache->xattr_list == NULL)
+        cache->xattr_list = g_bytes_ref (list);
+      G_UNLOCK (meta_cache);
+    }
+
+  *list_out = g_steal_pointer (&list);
+  return g_bytes_get_size (*list_out);
+}
+
+static void
+xdp_reply_xattr_bytes (const char *op,
+                       fuse_req_t  req,
+                       GBytes     *value,
+                       size_t      size)
+{
+  gsize len;
+  gconstpointer data = g_bytes_get_data (value, &len);
+
+  if (size == 0)
+    fuse_reply_xattr (req, len);
+  else if (size < len)
+    xdp_reply_err (op, req, ERANGE);
+  else
+    fuse_reply_buf (req, data, len);
+}
+
+static void
+xdp_fuse_statfs (fuse_req_t req,
+                 fuse_ino_t ino)
+{
+  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  XdpMetaCache *cache;
+  struct statvfs buf;
+  gboolean cached = FALSE;
+  gint64 now;
+  int res;
+  const char *op = "STATFS";
+
+  xdp_fuse_debug ("STATFS %lx", ino);
 
   if (!xdp_document_inode_checks (op, req, inode, 0))
     return;
 
+  now = g_get_monotonic_time ();
+
+  G_LOCK (meta_cache);
+  cache = xdp_document_inode_get_meta_cache (inode);
+  if (cache->statfs_expires > now)
+    {
+      buf = cache->statfs;
+      cached = TRUE;
+    }
+  G_UNLOCK (meta_cache);
+
+  if (cached)
+    {
+      fuse_reply_statfs (req, &buf);
+      return;
+    }
+
   if (inode->physical)
     res = fstatvfs (inode->physical->fd, &buf);
   else
     res = statvfs (inode->domain->doc_path, &buf);
 
-  if (!res)
-    fuse_reply_statfs (req, &buf);
-  else
-    xdp_reply_err (op, req, errno);
+  if (res != 0)
+    return xdp_reply_err (op, req, errno);
+
+  G_LOCK (meta_cache);
+  cache = xdp_document_inode_get_meta_cache (inode);
+  cache->statfs = buf;
+  cache->statfs_expires = now + META_CACHE_TTL_USEC;
+  G_UNLOCK (meta_cache);
+
+  fuse_reply_statfs (req, &buf);
 }
 
 static void
@@ -2602,7 +4419,7 @@ xdp_fuse_setxattr (fuse_req_t req,
   g_autofree char *path = NULL;
   const char *op = "SETXATTR";
 
-  g_debug ("SETXATTR %lx %s", ino, name);
+  xdp_fuse_debug ("SETXATTR %lx %s", ino, name);
 
   if (!xdp_document_inode_checks (op, req, inode,
                                   CHECK_CAN_WRITE | CHECK_IS_DIRECTORY))
@@ -2616,6 +4433,8 @@ xdp_fuse_setxattr (fuse_req_t req,
   else
     res = setxattr (inode->domain->doc_path, name, value, size, flags);
 
+  xdp_document_inode_clear_xattr_cache (inode);
+
   if (res < 0)
     return xdp_reply_err (op, req, errno);
 
@@ -2629,28 +4448,20 @@ xdp_fuse_getxattr (fuse_req_t req,
                    size_t size)
 {
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  g_autoptr(GBytes) value = NULL;
   ssize_t res;
-  g_autofree char *buf = NULL;
-  g_autofree char *path = NULL;
   const char *op = "GETXATTR";
 
-  g_debug ("GETXATTR %lx %s %ld", ino, name, size);
+  xdp_fuse_debug ("GETXATTR %lx %s %ld", ino, name, size);
 
   if (inode->domain->type != XDP_DOMAIN_DOCUMENT)
     return xdp_reply_err (op, req, ENODATA);
 
-  if (size != 0)
-    buf = g_malloc (size);
-
-  path = xdp_document_inode_get_self_as_path (inode);
-  res = getxattr (path, name, buf, size);
+  res = xdp_document_inode_getxattr (inode, name, &value);
   if (res < 0)
-    return xdp_reply_err (op, req, errno);
+    return xdp_reply_err (op, req, -res);
 
-  if (size == 0)
-    fuse_reply_xattr (req, res);
-  else
-    fuse_reply_buf (req, buf, res);
+  xdp_reply_xattr_bytes (op, req, value, size);
 }
 
 static void
@@ -2659,34 +4470,20 @@ xdp_fuse_listxattr (fuse_req_t req,
                     size_t size)
 {
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  g_autoptr(GBytes) list = NULL;
   ssize_t res;
-  g_autofree char *buf = NULL;
-  g_autofree char *path = NULL;
   const char *op = "LISTXATTR";
 
-  g_debug ("LISTXATTR %lx %ld", ino, size);
+  xdp_fuse_debug ("LISTXATTR %lx %ld", ino, size);
 
   if (inode->domain->type != XDP_DOMAIN_DOCUMENT)
     return xdp_reply_err (op, req, ENOTSUP);
 
-  if (size != 0)
-    buf = g_malloc (size);
-
-  if (inode->physical)
-    {
-      path = fd_to_path (inode->physical->fd);
-      res = listxattr (path, buf, size);
-    }
-  else
-    res = listxattr (inode->domain->doc_path, buf, size);
-
+  res = xdp_document_inode_listxattr (inode, &list);
   if (res < 0)
-    return xdp_reply_err (op, req, errno);
+    return xdp_reply_err (op, req, -res);
 
-  if (size == 0)
-    fuse_reply_xattr (req, res);
-  else
-    fuse_reply_buf (req, buf, res);
+  xdp_reply_xattr_bytes (op, req, list, size);
 }
 
 static void
@@ -2699,7 +4496,7 @@ xdp_fuse_removexattr (fuse_req_t req,
   ssize_t res;
   const char *op = "REMOVEXATTR";
 
-  g_debug ("REMOVEXATTR %lx %s", ino, name);
+  xdp_fuse_debug ("REMOVEXATTR %lx %s", ino, name);
 
   if (!xdp_document_inode_checks (op, req, inode,
                                   CHECK_CAN_WRITE | CHECK_IS_DIRECTORY))
@@ -2713,6 +4510,8 @@ xdp_fuse_removexattr (fuse_req_t req,
   else
     res = removexattr (inode->domain->doc_path, name);
 
+  xdp_document_inode_clear_xattr_cache (inode);
+
   if (res < 0)
     xdp_reply_err (op, req, errno);
   else
@@ -2720,133 +4519,926 @@ xdp_fuse_removexattr (fuse_req_t req,
 }
 
 static void
-xdp_fuse_getlk (fuse_req_t req,
-                fuse_ino_t ino,
-                struct fuse_file_info *fi,
-                struct flock *lock)
+xdp_fuse_getlk (fuse_req_t req,
+                fuse_ino_t ino,
+                struct fuse_file_info *fi,
+                struct flock *lock)
+{
+  const char *op = "GETLK";
+
+  xdp_fuse_debug ("GETLK %lx", ino);
+
+  xdp_reply_err (op, req, ENOSYS);
+}
+
+static void
+xdp_fuse_setlk (fuse_req_t req,
+                fuse_ino_t ino,
+                struct fuse_file_info *fi,
+                struct flock *lock,
+                int sleep)
+{
+  const char *op = "SETLK";
+
+  xdp_fuse_debug ("SETLK %lx", ino);
+
+  xdp_reply_err (op, req, ENOSYS);
+}
+
+static void
+xdp_fuse_flock (fuse_req_t req,
+                fuse_ino_t ino,
+                struct fuse_file_info *fi,
+                int lock_op)
+{
+  const char *op = "FLOCK";
+
+  xdp_fuse_debug ("FLOCK %lx", ino);
+
+  xdp_reply_err (op, req, ENOSYS);
+}
+
+static void
+xdp_fuse_init_cb (void                  *userdata,
+                  struct fuse_conn_info *conn)
+{
+  g_debug ("INIT");
+
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+  if (writeback_cache_requested)
+    {
+      if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+        {
+          conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+          writeback_cache = TRUE;
+        }
+      else
+        g_warning ("Kernel does not support the fuse writeback cache");
+    }
+#else
+  if (writeback_cache_requested)
+    g_warning ("Fuse writeback cache not supported by this build");
+#endif
+
+#ifdef FUSE_CAP_READDIRPLUS
+  /* Listings are usually followed by a stat of every entry, so let
+   * the kernel get the attributes along with the names */
+  if (conn->capable & FUSE_CAP_READDIRPLUS)
+    conn->want |= FUSE_CAP_READDIRPLUS;
+#endif
+
+  if (io_max_write > 0)
+    conn->max_write = MIN (conn->max_write, io_max_write);
+  if (io_max_readahead > 0)
+    conn->max_readahead = MIN (conn->max_readahead, io_max_readahead);
+
+  g_debug ("INIT max_write %u max_readahead %u", conn->max_write, conn->max_readahead);
+}
+
+extern void on_fuse_unmount (void);
+
+static int destroyed;
+
+static void
+xdp_fuse_destroy_cb (void *userdata)
+{
+  g_debug ("DESTROY");
+
+  destroyed = 1;
+
+  on_fuse_unmount ();
+}
+
+static struct fuse_lowlevel_ops xdp_fuse_oper = {
+ .init         = xdp_fuse_init_cb,
+ .destroy      = xdp_fuse_destroy_cb,
+ .lookup       = xdp_fuse_lookup,
+ .getattr      = xdp_fuse_getattr,
+ .setattr      = xdp_fuse_setattr,
+ .readdir      = xdp_fuse_readdir,
+#ifdef FUSE_CAP_READDIRPLUS
+ .readdirplus  = xdp_fuse_readdirplus,
+#endif
+ .open         = xdp_fuse_open,
+ .read         = xdp_fuse_read,
+ .write        = xdp_fuse_write,
+ .write_buf    = xdp_fuse_write_buf,
+ .fsync        = xdp_fuse_fsync,
+ .forget       = xdp_fuse_forget,
+ .forget_multi = xdp_fuse_forget_multi,
+ .releasedir   = xdp_fuse_releasedir,
+ .release      = xdp_fuse_release,
+ .opendir      = xdp_fuse_opendir,
+ .fsyncdir     = xdp_fuse_fsyncdir,
+ .create       = xdp_fuse_create,
+ .unlink       = xdp_fuse_unlink,
+ .rename       = xdp_fuse_rename,
+ .access       = xdp_fuse_access,
+ .readlink     = xdp_fuse_readlink,
+ .rmdir        = xdp_fuse_rmdir,
+ .mkdir        = xdp_fuse_mkdir,
+ .symlink      = xdp_fuse_symlink,
+ .link         = xdp_fuse_link,
+ .flush        = xdp_fuse_flush,
+ .statfs       = xdp_fuse_statfs,
+ .setxattr     = xdp_fuse_setxattr,
+ .getxattr     = xdp_fuse_getxattr,
+ .listxattr    = xdp_fuse_listxattr,
+ .removexattr  = xdp_fuse_removexattr,
+ .getlk        = xdp_fuse_getlk,
+ .setlk        = xdp_fuse_setlk,
+ .flock        = xdp_fuse_flock,
+ .fallocate    = xdp_fuse_fallocate,
+};
+
+static void
+xdp_op_stats_record (guint32 opcode,
+                     gint64  usec)
+{
+  XdpOpStats *stats;
+  guint bucket;
+
+  if (opcode >= N_OP_STATS_OPCODES)
+    return;
+
+  stats = &op_stats[opcode];
+  bucket = usec > 0 ? g_bit_storage ((gulong) usec) : 0;
+  bucket = MIN (bucket, N_OP_STATS_BUCKETS - 1);
+
+  g_atomic_pointer_add (&stats->count, 1);
+  g_atomic_pointer_add (&stats->total_usec, usec);
+  g_atomic_pointer_add (&stats->buckets[bucket], 1);
+}
+
+static const char *
+opcode_to_string (guint32 opcode)
+{
+  switch (opcode)
+    {
+    case FUSE_LOOKUP: return "LOOKUP";
+    case FUSE_FORGET: return "FORGET";
+    case FUSE_GETATTR: return "GETATTR";
+    case FUSE_SETATTR: return "SETATTR";
+    case FUSE_READLINK: return "READLINK";
+    case FUSE_SYMLINK: return "SYMLINK";
+    case FUSE_MKNOD: return "MKNOD";
+    case FUSE_MKDIR: return "MKDIR";
+    case FUSE_UNLINK: return "UNLINK";
+    case FUSE_RMDIR: return "RMDIR";
+    case FUSE_RENAME: return "RENAME";
+    case FUSE_LINK: return "LINK";
+    case FUSE_OPEN: return "OPEN";
+    case FUSE_READ: return "READ";
+    case FUSE_WRITE: return "WRITE";
+    case FUSE_STATFS: return "STATFS";
+    case FUSE_RELEASE: return "RELEASE";
+    case FUSE_FSYNC: return "FSYNC";
+    case FUSE_SETXATTR: return "SETXATTR";
+    case FUSE_GETXATTR: return "GETXATTR";
+    case FUSE_LISTXATTR: return "LISTXATTR";
+    case FUSE_REMOVEXATTR: return "REMOVEXATTR";
+    case FUSE_FLUSH: return "FLUSH";
+    case FUSE_INIT: return "INIT";
+    case FUSE_OPENDIR: return "OPENDIR";
+    case FUSE_READDIR: return "READDIR";
+    case FUSE_RELEASEDIR: return "RELEASEDIR";
+    case FUSE_FSYNCDIR: return "FSYNCDIR";
+    case FUSE_GETLK: return "GETLK";
+    case FUSE_SETLK: return "SETLK";
+    case FUSE_SETLKW: return "SETLKW";
+    case FUSE_ACCESS: return "ACCESS";
+    case FUSE_CREATE: return "CREATE";
+    case FUSE_INTERRUPT: return "INTERRUPT";
+    case FUSE_DESTROY: return "DESTROY";
+    case FUSE_BATCH_FORGET: return "FORGET_MULTI";
+    case FUSE_FALLOCATE: return "FALLOCATE";
+#ifdef FUSE_READDIRPLUS
+    case FUSE_READDIRPLUS: return "READDIRPLUS";
+#endif
+    default: return NULL;
+    }
+}
+
+/* Returns a{s(tta(tt))}: op name -> (count, total usec, list of
+ * (bucket upper bound in usec, count)) for every op seen so far */
+GVariant *
+xdp_fuse_get_op_stats (void)
+{
+  GVariantBuilder builder;
+  guint32 opcode;
+  int i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(tta(tt))}"));
+
+  for (opcode = 0; opcode < N_OP_STATS_OPCODES; opcode++)
+    {
+      XdpOpStats *stats = &op_stats[opcode];
+      g_autofree char *unknown = NULL;
+      GVariantBuilder buckets;
+      const char *name;
+      gsize count;
+
+      count = (gsize) g_atomic_pointer_get (&stats->count);
+      if (count == 0)
+        continue;
+
+      name = opcode_to_string (opcode);
+      if (name == NULL)
+        name = unknown = g_strdup_printf ("OP%u", opcode);
+
+      g_variant_builder_init (&buckets, G_VARIANT_TYPE ("a(tt)"));
+      for (i = 0; i < N_OP_STATS_BUCKETS; i++)
+        {
+          gsize n = (gsize) g_atomic_pointer_get (&stats->buckets[i]);
+          if (n != 0)
+            g_variant_builder_add (&buckets, "(tt)", (guint64) 1 << i, (guint64) n);
+        }
+
+      g_variant_builder_add (&builder, "{s(tt@a(tt))}", name,
+                             (guint64) count,
+                             (guint64) (gsize) g_atomic_pointer_get (&stats->total_usec),
+                             g_variant_builder_end (&buckets));
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/* The request header is still in the buffer after processing, unless
+ * it was spliced */
+static void
+xdp_trace_record (const struct fuse_buf *fbuf,
+                  guint32                opcode,
+                  guint8                 domain,
+                  gint64                 start,
+                  gint64                 end)
+{
+  const struct fuse_in_header *in = NULL;
+  XdpTraceRecord *record;
+  guint index;
+
+  if (!(fbuf->flags & FUSE_BUF_IS_FD))
+    in = fbuf->mem;
+
+  index = (guint) g_atomic_int_add (&trace_next, 1);
+  record = &trace_records[index % trace_size];
+
+  g_atomic_int_set (&record->seq, 0);
+
+  record->start = start;
+  record->duration = (guint32) MIN (end - start, G_MAXUINT32);
+  record->opcode = opcode;
+  record->nodeid = in ? in->nodeid : 0;
+  record->domain = domain;
+  record->size = in ? in->len : fbuf->size;
+
+  if (in && opcode == FUSE_READ)
+    record->size = ((const struct fuse_read_in *) (in + 1))->size;
+  else if (in && opcode == FUSE_WRITE)
+    record->size = ((const struct fuse_write_in *) (in + 1))->size;
+
+  g_atomic_int_set (&record->seq, index + 1);
+}
+
+/* Called before the request is processed, while the kernel still holds
+ * a reference on the node */
+static guint8
+xdp_trace_domain (const struct fuse_buf *fbuf,
+                  guint32                opcode)
+{
+  const struct fuse_in_header *in = fbuf->mem;
+  XdpInode *inode;
+
+  if ((fbuf->flags & FUSE_BUF_IS_FD) || in->nodeid == 0 ||
+      opcode == FUSE_FORGET || opcode == FUSE_BATCH_FORGET)
+    return 0;
+
+  inode = _xdp_inode_from_maybe_ino (in->nodeid);
+  return inode->domain->type + 1;
+}
+
+/* Returns a(tusytu): (start usec relative to the first record, duration
+ * usec, op name, domain, node id, size) for the recorded requests,
+ * oldest first. The domain is 1 for the root, 2 for by-app, 3 for an
+ * app directory, 4 for a document and 0 if unknown. Our node ids are
+ * inode pointers, so they are numbered in order of appearance instead,
+ * with 0 for requests without a node. */
+GVariant *
+xdp_fuse_get_trace (void)
+{
+  GVariantBuilder builder;
+  g_autoptr(GHashTable) node_ids = NULL;
+  gint64 first_start = -1;
+  guint next, first, i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(tusytu)"));
+
+  if (trace_records == NULL)
+    return g_variant_builder_end (&builder);
+
+  next = (guint) g_atomic_int_get (&trace_next);
+  first = next > trace_size ? next - trace_size : 0;
+  node_ids = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+
+  for (i = first; i != next; i++)
+    {
+      XdpTraceRecord *slot = &trace_records[i % trace_size];
+      g_autofree char *unknown = NULL;
+      XdpTraceRecord record;
+      const char *name;
+      guint64 node_id = 0;
+
+      if ((guint) g_atomic_int_get (&slot->seq) != i + 1)
+        continue;
+      record = *slot;
+      if ((guint) g_atomic_int_get (&slot->seq) != i + 1)
+        continue;
+
+      if (first_start < 0)
+        first_start = record.start;
+
+      name = opcode_to_string (record.opcode);
+      if (name == NULL)
+        name = unknown = g_strdup_printf ("OP%u", record.opcode);
+
+      if (record.nodeid != 0)
+        {
+          node_id = GPOINTER_TO_SIZE (g_hash_table_lookup (node_ids, &record.nodeid));
+          if (node_id == 0)
+            {
+              guint64 *key = g_new (guint64, 1);
+
+              *key = record.nodeid;
+              node_id = g_hash_table_size (node_ids) + 1;
+              g_hash_table_insert (node_ids, key, GSIZE_TO_POINTER (node_id));
+            }
+        }
+
+      g_variant_builder_add (&builder, "(tusytu)",
+                             (guint64) MAX (record.start - first_start, 0),
+                             record.duration,
+                             name,
+                             record.domain,
+                             node_id,
+                             record.size);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static guint
+xdp_inode_shards_size (XdpInodeShard *shards)
+{
+  guint size = 0;
+  int i;
+
+  for (i = 0; i < N_INODE_SHARDS; i++)
+    {
+      g_mutex_lock (&shards[i].mutex);
+      if (shards[i].table)
+        size += g_hash_table_size (shards[i].table);
+      g_mutex_unlock (&shards[i].mutex);
+    }
+
+  return size;
+}
+
+/* Returns a{sv} with the number of live inodes and domains, of the
+ * invalidations sent to the kernel and of the cached lookup misses */
+GVariant *
+xdp_fuse_get_stats (void)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "inodes",
+                         g_variant_new_uint32 (xdp_inode_shards_size (all_inodes)));
+  g_variant_builder_add (&builder, "{sv}", "physical-inodes",
+                         g_variant_new_uint32 (xdp_inode_shards_size (physical_inodes)));
+  g_variant_builder_add (&builder, "{sv}", "domains",
+                         g_variant_new_uint32 (g_atomic_int_get (&n_live_domains)));
+  g_variant_builder_add (&builder, "{sv}", "invalidations",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&n_invalidations)));
+  g_variant_builder_add (&builder, "{sv}", "invalidations-skipped",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&n_invalidations_skipped)));
+  g_variant_builder_add (&builder, "{sv}", "negative-entries",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&n_negative_entries)));
+
+  return g_variant_builder_end (&builder);
+}
+
+typedef struct {
+  pthread_t thread;
+  char *buf;
+  size_t bufsize;
+} XdpFuseWorker;
+
+/* Worker pool state, protected by workers_lock */
+G_LOCK_DEFINE_STATIC (workers);
+static GList *workers;
+static int n_workers;
+static int n_avail_workers;
+static gboolean workers_exiting;
+static sem_t workers_finished;
+
+static void *xdp_fuse_worker (void *data);
+
+static gsize
+strv_memory_size (char **strv)
+{
+  gsize size = 0;
+  int i;
+
+  if (strv == NULL)
+    return 0;
+
+  for (i = 0; strv[i] != NULL; i++)
+    size += sizeof (char *) + strlen (strv[i]) + 1;
+
+  return size + sizeof (char *);
+}
+
+static void
+fuse_memory_usage (GArray *usage)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  guint n_inodes, n_physical, n_domains, n_doc_infos = 0;
+  guint64 n_listed = 0;
+  guint64 listing_bytes = 0;
+  guint64 buffer_bytes = 0;
+  guint n_buffers = 0;
+  GList *l;
+
+  n_inodes = xdp_inode_shards_size (all_inodes);
+  n_physical = xdp_inode_shards_size (physical_inodes);
+  n_domains = g_atomic_int_get (&n_live_domains);
+
+  G_LOCK (doc_infos);
+  if (doc_infos)
+    n_doc_infos = g_hash_table_size (doc_infos);
+  G_UNLOCK (doc_infos);
+
+  G_LOCK (listings);
+  listing_bytes = strv_memory_size (cached_docs) + strv_memory_size (cached_apps);
+  if (cached_app_docs)
+    {
+      g_hash_table_iter_init (&iter, cached_app_docs);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          XdpAppDocs *app_docs = value;
+          guint n_visible = g_hash_table_size (app_docs->visible);
+
+          /* A rough estimate of a hash table slot */
+          n_listed += n_visible;
+          listing_bytes += sizeof (XdpAppDocs) + strlen (key) + 1 +
+                           n_visible * 2 * sizeof (gpointer) +
+                           strv_memory_size (app_docs->sorted);
+        }
+    }
+  G_UNLOCK (listings);
+
+  G_LOCK (workers);
+  for (l = workers; l != NULL; l = l->next)
+    {
+      n_buffers++;
+      buffer_bytes += sizeof (XdpFuseWorker) + ((XdpFuseWorker *) l->data)->bufsize;
+    }
+  G_UNLOCK (workers);
+
+  xdp_memory_usage_add (usage, "fuse-inodes", n_inodes, n_inodes * sizeof (XdpInode));
+  xdp_memory_usage_add (usage, "fuse-physical-inodes", n_physical, n_physical * sizeof (XdpPhysicalInode));
+  xdp_memory_usage_add (usage, "fuse-domains", n_domains, n_domains * sizeof (XdpDomain));
+  xdp_memory_usage_add (usage, "fuse-doc-infos", n_doc_infos, n_doc_infos * sizeof (XdpDocInfo));
+  xdp_memory_usage_add (usage, "fuse-listings", n_listed, listing_bytes);
+  xdp_memory_usage_add (usage, "fuse-buffers", n_buffers, buffer_bytes);
+  xdp_memory_usage_add (usage, "fuse-trace", trace_size, (guint64) trace_size * sizeof (XdpTraceRecord));
+}
+
+static void
+xdp_fuse_worker_free (XdpFuseWorker *w)
+{
+  g_free (w->buf);
+  g_free (w);
+}
+
+/* Called with the workers lock held */
+static gboolean
+xdp_fuse_start_worker (void)
+{
+  XdpFuseWorker *w = g_new0 (XdpFuseWorker, 1);
+  sigset_t oldset, newset;
+  int res;
+
+  w->bufsize = fuse_chan_bufsize (main_ch);
+  w->buf = g_malloc (w->bufsize);
+
+  /* Leave the signals to the mainloop thread, see xdp_fuse_exit() */
+  sigemptyset (&newset);
+  sigaddset (&newset, SIGTERM);
+  sigaddset (&newset, SIGINT);
+  sigaddset (&newset, SIGHUP);
+  sigaddset (&newset, SIGQUIT);
+  pthread_sigmask (SIG_BLOCK, &newset, &oldset);
+  res = pthread_create (&w->thread, NULL, xdp_fuse_worker, w);
+  pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+
+  if (res != 0)
+    {
+      g_warning ("Can't start fuse worker thread: %s", g_strerror (res));
+      xdp_fuse_worker_free (w);
+      return FALSE;
+    }
+
+  workers = g_list_prepend (workers, w);
+  n_workers++;
+  n_avail_workers++;
+
+  return TRUE;
+}
+
+/* Like the workers of fuse_session_loop_mt(): a new thread is started
+ * when the last idle one picks up a request, up to max_threads, and
+ * threads beyond max_idle_threads exit once they are done, except for
+ * the last one. */
+static void *
+xdp_fuse_worker (void *data)
+{
+  XdpFuseWorker *w = data;
+
+  xdp_thread_apply_sched (XDP_THREAD_KIND_FUSE);
+
+  while (!fuse_session_exited (session))
+    {
+      struct fuse_chan *ch = main_ch;
+      struct fuse_buf fbuf = {
+        .mem = w->buf,
+        .size = w->bufsize,
+      };
+      int res;
+
+      pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+      res = fuse_session_receive_buf (session, &fbuf, &ch);
+      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+      if (res == -EINTR)
+        continue;
+      if (res <= 0)
+        {
+          if (res < 0)
+            fuse_session_exit (session);
+          break;
+        }
+
+      G_LOCK (workers);
+      if (workers_exiting)
+        {
+          G_UNLOCK (workers);
+          break;
+        }
+      n_avail_workers--;
+      if (n_avail_workers == 0 &&
+          (max_threads <= 0 || n_workers < max_threads))
+        xdp_fuse_start_worker ();
+      G_UNLOCK (workers);
+
+      if (G_UNLIKELY (op_stats_enabled || trace_records != NULL))
+        {
+          guint32 opcode;
+          guint8 domain = 0;
+          gint64 start = g_get_monotonic_time ();
+          gint64 end;
+
+          /* Large spliced writes leave the header in the pipe */
+          if (fbuf.flags & FUSE_BUF_IS_FD)
+            opcode = FUSE_WRITE;
+          else
+            opcode = ((struct fuse_in_header *) fbuf.mem)->opcode;
+
+          if (trace_records != NULL)
+            domain = xdp_trace_domain (&fbuf, opcode);
+
+          fuse_session_process_buf (session, &fbuf, ch);
+
+          end = g_get_monotonic_time ();
+          if (op_stats_enabled)
+            xdp_op_stats_record (opcode, end - start);
+          if (trace_records != NULL)
+            xdp_trace_record (&fbuf, opcode, domain, start, end);
+        }
+      else
+        fuse_session_process_buf (session, &fbuf, ch);
+
+      G_LOCK (workers);
+      n_avail_workers++;
+      /* The last worker stays, nothing would read requests otherwise */
+      if (!workers_exiting && n_avail_workers > max_idle_threads && n_workers > 1)
+        {
+          workers = g_list_remove (workers, w);
+          n_workers--;
+          n_avail_workers--;
+          G_UNLOCK (workers);
+
+          pthread_detach (w->thread);
+          xdp_fuse_worker_free (w);
+          return NULL;
+        }
+      G_UNLOCK (workers);
+    }
+
+  sem_post (&workers_finished);
+
+  return NULL;
+}
+
+static void
+xdp_fuse_session_loop (void)
+{
+  gboolean started;
+  GList *l;
+
+  sem_init (&workers_finished, 0, 0);
+
+  G_LOCK (workers);
+  started = xdp_fuse_start_worker ();
+  G_UNLOCK (workers);
+
+  if (!started)
+    fuse_session_exit (session);
+
+  /* Woken by a worker exiting, or by SIGHUP from xdp_fuse_exit() */
+  while (!fuse_session_exited (session))
+    sem_wait (&workers_finished);
+
+  G_LOCK (workers);
+  workers_exiting = TRUE;
+  for (l = workers; l != NULL; l = l->next)
+    {
+      XdpFuseWorker *w = l->data;
+      pthread_cancel (w->thread);
+    }
+  G_UNLOCK (workers);
+
+  /* Nobody changes the list once workers_exiting is set */
+  for (l = workers; l != NULL; l = l->next)
+    {
+      XdpFuseWorker *w = l->data;
+      pthread_join (w->thread, NULL);
+    }
+
+  g_list_free_full (g_steal_pointer (&workers), (GDestroyNotify) xdp_fuse_worker_free);
+  n_workers = n_avail_workers = 0;
+  sem_destroy (&workers_finished);
+}
+
+static gpointer
+xdp_fuse_mainloop (gpointer data)
+{
+  const char *status;
+
+  fuse_pthread = pthread_self ();
+
+  xdp_fuse_session_loop ();
+
+  status = getenv ("TEST_DOCUMENT_PORTAL_FUSE_STATUS");
+  if (status)
+    {
+      GError *error = NULL;
+      g_autoptr(GString) s = g_string_new ("");
+
+      g_string_append (s, "ok");
+
+      g_file_set_contents (status, s->str, -1, &error);
+      g_assert_no_error (error);
+    }
+
+  /* Queued flushes still reply to their requests, which needs the
+   * session. No new ones are queued now that the loop is done. */
+  if (fsync_pool)
+    g_thread_pool_free (g_steal_pointer (&fsync_pool), FALSE, TRUE);
+
+  fuse_session_remove_chan (main_ch);
+  fuse_session_destroy (session);
+  fuse_unmount (mount_path, main_ch);
+
+  return NULL;
+}
+
+typedef struct {
+  fuse_ino_t ino;
+  char *filename;
+} Invalidate;
+
+/* Called with the inodes lock of parent_inode's domain held, don't block.
+ * Sets negative if a failed lookup the kernel may have cached is dropped,
+ * only docs that were actually looked up get one. */
+static void
+invalidate_doc_inode (XdpInode *parent_inode,
+                      const char *doc_id,
+                      GArray *invalidates,
+                      gboolean *negative)
 {
-  const char *op = "GETLK";
+  XdpInode *doc_inode = g_hash_table_lookup (parent_inode->domain->inodes, doc_id);
+  Invalidate inval;
 
-  g_debug ("GETLK %lx", ino);
+  if (doc_inode == NULL)
+    {
+      /* The kernel may have cached a failed lookup of it */
+      if (xdp_domain_take_negative_doc (parent_inode->domain, doc_id))
+        {
+          inval.ino = xdp_inode_to_ino (parent_inode);
+          inval.filename = g_strdup (doc_id);
+          g_array_append_val (invalidates, inval);
+          *negative = TRUE;
+        }
+      return;
+    }
 
-  xdp_reply_err (op, req, ENOSYS);
-}
+  inval.ino = xdp_inode_to_ino (doc_inode);
+  inval.filename = NULL;
+  g_array_append_val (invalidates, inval);
 
-static void
-xdp_fuse_setlk (fuse_req_t req,
-                fuse_ino_t ino,
-                struct fuse_file_info *fi,
-                struct flock *lock,
-                int sleep)
-{
-  const char *op = "SETLK";
+  inval.ino = xdp_inode_to_ino (parent_inode);
+  inval.filename = g_strdup (doc_id);
+  g_array_append_val (invalidates, inval);
 
-  g_debug ("SETLK %lx", ino);
+  /* The mode of the doc children depends on the permissions too */
+  if (physical_timeout > 0)
+    {
+      XdpDomain *doc_domain = doc_inode->domain;
+      GHashTableIter iter;
+      gpointer value;
 
-  xdp_reply_err (op, req, ENOSYS);
+      g_mutex_lock (&doc_domain->inodes_mutex);
+      g_hash_table_iter_init (&iter, doc_domain->inodes);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          inval.ino = xdp_inode_to_ino ((XdpInode *) value);
+          inval.filename = NULL;
+          g_array_append_val (invalidates, inval);
+        }
+      g_mutex_unlock (&doc_domain->inodes_mutex);
+    }
 }
 
 static void
-xdp_fuse_flock (fuse_req_t req,
-                fuse_ino_t ino,
-                struct fuse_file_info *fi,
-                int lock_op)
+invalidate_doc_inodes (XdpInode           *parent_inode,
+                       const char * const *doc_ids,
+                       GArray             *invalidates,
+                       gboolean           *negative)
 {
-  const char *op = "FLOCK";
-
-  g_debug ("FLOCK %lx", ino);
+  XdpDomain *parent_domain = parent_inode->domain;
+  int i;
 
-  xdp_reply_err (op, req, ENOSYS);
+  g_mutex_lock (&parent_domain->inodes_mutex);
+  for (i = 0; doc_ids[i] != NULL; i++)
+    invalidate_doc_inode (parent_inode, doc_ids[i], invalidates, negative);
+  g_mutex_unlock (&parent_domain->inodes_mutex);
 }
 
 static void
-xdp_fuse_init_cb (void                  *userdata,
-                  struct fuse_conn_info *conn)
+invalidate_clear (Invalidate *invalidate)
 {
-  g_debug ("INIT");
+  g_free (invalidate->filename);
 }
 
-extern void on_fuse_unmount (void);
+/* The kernel may need to call back into us before a notification
+ * returns, so they are sent from a separate thread. A batch without
+ * invalidates stops the thread. */
+typedef struct {
+  guint64 serial;
+  GArray *invalidates;
+} InvalidateBatch;
 
-static int destroyed;
+static GThread *invalidate_thread;
+static GAsyncQueue *invalidate_queue;
+static GMutex invalidate_mutex;
+static GCond invalidate_cond;
+static guint64 invalidate_queued; /* Protected by invalidate_mutex */
+static guint64 invalidate_done; /* Protected by invalidate_mutex */
 
-static void
-xdp_fuse_destroy_cb (void *userdata)
+static guint
+invalidate_hash (gconstpointer key)
 {
-  g_debug ("DESTROY");
+  const Invalidate *invalidate = key;
+  guint64 ino = invalidate->ino;
+  guint h = (guint) (ino ^ (ino >> 32));
 
-  destroyed = 1;
+  if (invalidate->filename)
+    h ^= g_str_hash (invalidate->filename);
 
-  on_fuse_unmount ();
+  return h;
 }
 
-static struct fuse_lowlevel_ops xdp_fuse_oper = {
- .init         = xdp_fuse_init_cb,
- .destroy      = xdp_fuse_destroy_cb,
- .lookup       = xdp_fuse_lookup,
- .getattr      = xdp_fuse_getattr,
- .setattr      = xdp_fuse_setattr,
- .readdir      = xdp_fuse_readdir,
- .open         = xdp_fuse_open,
- .read         = xdp_fuse_read,
- .write        = xdp_fuse_write,
- .write_buf    = xdp_fuse_write_buf,
- .fsync        = xdp_fuse_fsync,
- .forget       = xdp_fuse_forget,
- .forget_multi = xdp_fuse_forget_multi,
- .releasedir   = xdp_fuse_releasedir,
- .release      = xdp_fuse_release,
- .opendir      = xdp_fuse_opendir,
- .fsyncdir     = xdp_fuse_fsyncdir,
- .create       = xdp_fuse_create,
- .unlink       = xdp_fuse_unlink,
- .rename       = xdp_fuse_rename,
- .access       = xdp_fuse_access,
- .readlink     = xdp_fuse_readlink,
- .rmdir        = xdp_fuse_rmdir,
- .mkdir        = xdp_fuse_mkdir,
- .symlink      = xdp_fuse_symlink,
- .link         = xdp_fuse_link,
- .flush        = xdp_fuse_flush,
- .statfs       = xdp_fuse_statfs,
- .setxattr     = xdp_fuse_setxattr,
- .getxattr     = xdp_fuse_getxattr,
- .listxattr    = xdp_fuse_listxattr,
- .removexattr  = xdp_fuse_removexattr,
- .getlk        = xdp_fuse_getlk,
- .setlk        = xdp_fuse_setlk,
- .flock        = xdp_fuse_flock,
- .fallocate    = xdp_fuse_fallocate,
-};
+static gboolean
+invalidate_equal (gconstpointer a,
+                  gconstpointer b)
+{
+  const Invalidate *invalidate_a = a;
+  const Invalidate *invalidate_b = b;
+
+  return invalidate_a->ino == invalidate_b->ino &&
+         g_strcmp0 (invalidate_a->filename, invalidate_b->filename) == 0;
+}
 
 static gpointer
-xdp_fuse_mainloop (gpointer data)
+xdp_fuse_invalidate_thread (gpointer data)
 {
-  const char *status;
+  gboolean quit = FALSE;
 
-  fuse_pthread = pthread_self ();
+  while (!quit)
+    {
+      g_autoptr(GPtrArray) batches = g_ptr_array_new_with_free_func (g_free);
+      g_autoptr(GHashTable) sent = g_hash_table_new (invalidate_hash, invalidate_equal);
+      InvalidateBatch *batch = g_async_queue_pop (invalidate_queue);
+      guint n_skipped = 0;
+      int i, j;
+
+      /* Everything queued while the last notifications were blocked in
+       * the kernel is sent in one go, each inode and entry only once */
+      do
+        {
+          g_ptr_array_add (batches, batch);
+          if (batch->invalidates == NULL)
+            {
+              quit = TRUE;
+              break;
+            }
+        }
+      while ((batch = g_async_queue_try_pop (invalidate_queue)) != NULL);
 
-  fuse_session_loop_mt (session);
+      for (i = 0; i < batches->len; i++)
+        {
+          batch = g_ptr_array_index (batches, i);
+          if (batch->invalidates == NULL)
+            continue;
 
-  status = getenv ("TEST_DOCUMENT_PORTAL_FUSE_STATUS");
-  if (status)
-    {
-      GError *error = NULL;
-      g_autoptr(GString) s = g_string_new ("");
+          for (j = 0; j < batch->invalidates->len; j++)
+            {
+              Invalidate *invalidate = &g_array_index (batch->invalidates, Invalidate, j);
 
-      g_string_append (s, "ok");
+              if (!g_hash_table_add (sent, invalidate))
+                {
+                  n_skipped++;
+                  continue;
+                }
 
-      g_file_set_contents (status, s->str, -1, &error);
-      g_assert_no_error (error);
-    }
+              if (invalidate->filename)
+                fuse_lowlevel_notify_inval_entry (main_ch, invalidate->ino,
+                                                  invalidate->filename, strlen (invalidate->filename));
+              else
+                fuse_lowlevel_notify_inval_inode (main_ch, invalidate->ino, 0, 0);
+            }
+        }
 
-  fuse_session_remove_chan (main_ch);
-  fuse_session_destroy (session);
-  fuse_unmount (mount_path, main_ch);
+      g_atomic_pointer_add (&n_invalidations, g_hash_table_size (sent));
+      if (n_skipped > 0)
+        {
+          g_atomic_pointer_add (&n_invalidations_skipped, n_skipped);
+          xdp_fuse_debug ("invalidate: skipped %u duplicate notifications", n_skipped);
+        }
+
+      /* Batches are queued in serial order */
+      batch = g_ptr_array_index (batches, batches->len - 1);
+      g_mutex_lock (&invalidate_mutex);
+      invalidate_done = batch->serial;
+      g_cond_broadcast (&invalidate_cond);
+      g_mutex_unlock (&invalidate_mutex);
+
+      /* The keys of sent point into the batches */
+      g_clear_pointer (&sent, g_hash_table_unref);
+      for (i = 0; i < batches->len; i++)
+        {
+          batch = g_ptr_array_index (batches, i);
+          g_clear_pointer (&batch->invalidates, g_array_unref);
+        }
+    }
 
   return NULL;
 }
 
+static void
+queue_invalidates (GArray   *invalidates, /* Takes ownership, NULL to quit */
+                   gboolean  wait)
+{
+  InvalidateBatch *batch = g_new0 (InvalidateBatch, 1);
+  guint64 serial;
+
+  batch->invalidates = invalidates;
+
+  g_mutex_lock (&invalidate_mutex);
+  serial = batch->serial = ++invalidate_queued;
+  g_async_queue_push (invalidate_queue, batch);
+
+  if (wait)
+    {
+      while (invalidate_done < serial)
+        g_cond_wait (&invalidate_cond, &invalidate_mutex);
+    }
+  g_mutex_unlock (&invalidate_mutex);
+}
+
+/* Can run in a worker thread, nothing else touches the fuse state
+ * until it's done, see fuse_ready */
 gboolean
 xdp_fuse_init (GError **error)
 {
@@ -2857,8 +5449,12 @@ xdp_fuse_init (GError **error)
    *  splice_move: move buffers from writing app to kernel during splice write
    *  atomic_o_trunc: We handle O_TRUNC in create()
    *  big_writes: Allow > 4k writes
+   *  max_read: Limit the size of READ requests, see xdp_fuse_set_io_limits()
    */
-  char *fusermount_argv[] = { "xdp-fuse", "-osubtype=portal,fsname=portal,auto_unmount,splice_read,splice_write,splice_move,atomic_o_trunc,big_writes" };
+  g_autofree char *max_read_opt = io_max_read > 0 ? g_strdup_printf (",max_read=%u", io_max_read) : NULL;
+  g_autofree char *mount_opts = g_strconcat ("-osubtype=portal,fsname=portal,auto_unmount,splice_read,splice_write,splice_move,atomic_o_trunc,big_writes",
+                                             max_read_opt, NULL);
+  char *fusermount_argv[] = { "xdp-fuse", mount_opts };
   struct fuse_args args = FUSE_ARGS_INIT (G_N_ELEMENTS (fusermount_argv), fusermount_argv);
   struct stat st;
   struct statfs stfs;
@@ -2870,17 +5466,17 @@ xdp_fuse_init (GError **error)
 
   my_uid = getuid ();
   my_gid = getgid ();
+  init_virtual_stat_templates ();
 
-  all_inodes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, NULL);
+  xdp_inode_shards_init (all_inodes, g_direct_hash, g_direct_equal);
+  xdp_inode_shards_init (physical_inodes, devino_hash, devino_equal);
+  xdp_add_memory_usage_func (fuse_memory_usage);
 
   root_domain = xdp_domain_new_root ();
   root_inode = xdp_inode_new (root_domain, NULL);
   by_app_domain = xdp_domain_new_by_app (root_domain);
   by_app_inode = xdp_inode_new (by_app_domain, NULL);
 
-  physical_inodes =
-    g_hash_table_new_full (devino_hash, devino_equal, NULL, NULL);
-
     /* Bump nr of filedescriptor limit to max */
   if (getrlimit (RLIMIT_NOFILE , &rl) == 0 &&
       rl.rlim_cur != rl.rlim_max)
@@ -2889,6 +5485,13 @@ xdp_fuse_init (GError **error)
       setrlimit (RLIMIT_NOFILE, &rl);
     }
 
+  /* Leave most fds to open files and the dirfd cache */
+  if (getrlimit (RLIMIT_NOFILE , &rl) == 0)
+    forgotten_physical_max = MIN (rl.rlim_cur / 8, FORGOTTEN_PHYSICAL_MAX);
+  if (expire_forgotten_id == 0)
+    expire_forgotten_id = g_timeout_add_seconds (FORGOTTEN_PHYSICAL_TTL_SEC,
+                                                 expire_forgotten_physical, NULL);
+
   path = xdp_fuse_get_mountpoint ();
 
   if ((stat (path, &st) == -1 && errno == ENOTCONN) ||
@@ -2903,7 +5506,7 @@ xdp_fuse_init (GError **error)
 
       g_usleep (10000); /* 10ms */
       count = 0;
-      while (stat (path, &st) == -1 && count < 10)
+      while (stat (path, &st) == -1 && count++ < 10)
         g_usleep (10000); /* 10ms */
     }
 
@@ -2934,16 +5537,33 @@ xdp_fuse_init (GError **error)
     }
   fuse_session_add_chan (session, main_ch);
 
+  invalidate_queue = g_async_queue_new ();
+  invalidate_thread = g_thread_new ("fuse invalidate", xdp_fuse_invalidate_thread, NULL);
+
+  reaper_queue = g_async_queue_new ();
+  reaper_thread = g_thread_new ("fuse reaper", xdp_fuse_reaper_thread, NULL);
+
+  fsync_groups = g_hash_table_new (NULL, NULL);
+  fsync_pool = g_thread_pool_new (xdp_fsync_group_flush, NULL, MAX_FSYNC_THREADS, FALSE, NULL);
+
   fuse_thread = g_thread_new ("fuse mainloop", xdp_fuse_mainloop, session);
 
   fuse_opt_free_args (&args);
 
+  g_atomic_int_set (&fuse_ready, TRUE);
+
   return TRUE;
 }
 
 void
 xdp_fuse_exit (void)
 {
+  if (invalidate_thread)
+    {
+      queue_invalidates (NULL, FALSE);
+      g_thread_join (g_steal_pointer (&invalidate_thread));
+    }
+
   if (!destroyed && session)
     fuse_session_exit (session);
 
@@ -2952,96 +5572,233 @@ xdp_fuse_exit (void)
 
   if (fuse_thread)
     g_thread_join (fuse_thread);
+
+  if (reaper_thread)
+    {
+      g_async_queue_push (reaper_queue, &reaper_quit);
+      g_thread_join (g_steal_pointer (&reaper_thread));
+    }
 }
 
-const char *
-xdp_fuse_get_mountpoint (void)
+void
+xdp_fuse_set_cache_timeouts (double physical,
+                             double virtual,
+                             double negative)
 {
-  if (mount_path == NULL)
-    mount_path = g_build_filename (g_get_user_runtime_dir (), "doc", NULL);
-  return mount_path;
+  physical_timeout = MAX (physical, 0.0);
+  virtual_timeout = MAX (virtual, 0.0);
+  negative_timeout = negative < 0 ? -1 : negative;
 }
 
-typedef struct {
-  fuse_ino_t ino;
-  char *filename;
-} Invalidate;
+void
+xdp_fuse_set_thread_limits (int max,
+                            int max_idle)
+{
+  max_threads = MAX (max, 0);
+  max_idle_threads = MAX (max_idle, 0);
+}
 
-/* Called with domain_inodes lock held, don't block */
-static void
-invalidate_doc_inode (XdpInode *parent_inode,
-                      const char *doc_id,
-                      GArray *invalidates)
+void
+xdp_fuse_set_debug (gboolean debug,
+                    gboolean op_stats)
 {
-  XdpInode *doc_inode = g_hash_table_lookup (parent_inode->domain->inodes, doc_id);
-  Invalidate inval;
+  fuse_debug = debug;
+  op_stats_enabled = op_stats;
+}
 
-  if (doc_inode == NULL)
+/* Keeps the last n_records requests for xdp_fuse_get_trace(), must be
+ * called before xdp_fuse_init() */
+void
+xdp_fuse_set_trace_size (guint n_records)
+{
+  g_return_if_fail (trace_records == NULL);
+
+  if (n_records == 0)
     return;
 
-  inval.ino = xdp_inode_to_ino (doc_inode);
-  inval.filename = NULL;
-  g_array_append_val (invalidates, inval);
+  trace_size = n_records;
+  trace_records = g_new0 (XdpTraceRecord, n_records);
+}
 
-  inval.ino = xdp_inode_to_ino (parent_inode);
-  inval.filename = g_strdup (doc_id);
-  g_array_append_val (invalidates, inval);
+void
+xdp_fuse_set_writeback_cache (gboolean enable)
+{
+  writeback_cache_requested = enable;
+}
 
-  /* No need to invalidate doc children, we don't cache them */
+void
+xdp_fuse_set_io_limits (int max_read,
+                        int max_write,
+                        int max_readahead)
+{
+  io_max_read = MAX (max_read, 0);
+  io_max_write = MAX (max_write, 0);
+  io_max_readahead = MAX (max_readahead, 0);
 }
 
+const char *
+xdp_fuse_get_mountpoint (void)
+{
+  if (mount_path == NULL)
+    mount_path = g_build_filename (g_get_user_runtime_dir (), "doc", NULL);
+  return mount_path;
+}
 
-/* Called when a apps permissions to see a document is changed,
-   and with null opt_app_id when the doc is created/removed */
+/* Called when apps permissions to see documents are changed, and with
+   null opt_app_ids when the docs are created/removed. The notifications
+   are sent in the background, unless wait is set, in which case this
+   returns once the kernel has dropped its caches. */
 void
-xdp_fuse_invalidate_doc_app (const char *doc_id,
-                             const char *opt_app_id)
+xdp_fuse_invalidate_docs (const char * const *doc_ids,
+                          const char * const *opt_app_ids,
+                          gboolean            wait)
 {
-  g_autoptr(GArray) invalidates = NULL;
+  XdpDomain *by_app_domain;
+  GArray *invalidates;
+  gboolean negative = FALSE;
   int i;
 
+  update_listings (doc_ids, opt_app_ids);
+
   /* This can happen if fuse is not initialized yet for the very
-     first dbus message that activated the service */
-  if (main_ch == NULL)
+     first dbus message that activated the service, or while it is
+     being mounted */
+  if (!g_atomic_int_get (&fuse_ready))
     return;
 
-  g_debug ("invalidate %s/%s", doc_id, opt_app_id ? opt_app_id : "*");
+  if (doc_ids[0] == NULL)
+    return;
 
   invalidates = g_array_new (FALSE, FALSE, sizeof (Invalidate));
+  g_array_set_clear_func (invalidates, (GDestroyNotify) invalidate_clear);
 
-  G_LOCK (domain_inodes);
-  if (opt_app_id != NULL)
+  if (opt_app_ids == NULL)
+    invalidate_doc_inodes (root_inode, doc_ids, invalidates, &negative);
+
+  by_app_domain = by_app_inode->domain;
+  g_mutex_lock (&by_app_domain->inodes_mutex);
+  if (opt_app_ids != NULL)
     {
-      XdpInode *app_inode = g_hash_table_lookup (by_app_inode->domain->inodes, opt_app_id);
-      if (app_inode)
-        invalidate_doc_inode (app_inode, doc_id, invalidates);
+      for (i = 0; opt_app_ids[i] != NULL; i++)
+        {
+          XdpInode *app_inode = g_hash_table_lookup (by_app_domain->inodes, opt_app_ids[i]);
+          if (app_inode)
+            invalidate_doc_inodes (app_inode, doc_ids, invalidates, &negative);
+        }
     }
   else
     {
       GHashTableIter iter;
       gpointer key, value;
 
-      invalidate_doc_inode (root_inode, doc_id, invalidates);
-      g_hash_table_iter_init (&iter, by_app_inode->domain->inodes);
+      g_hash_table_iter_init (&iter, by_app_domain->inodes);
       while (g_hash_table_iter_next (&iter, &key, &value))
-        invalidate_doc_inode ((XdpInode *)value, doc_id, invalidates);
+        invalidate_doc_inodes ((XdpInode *)value, doc_ids, invalidates, &negative);
+    }
+  g_mutex_unlock (&by_app_domain->inodes_mutex);
+
+  xdp_fuse_debug ("invalidate %d docs: %d notifications", g_strv_length ((char **) doc_ids), invalidates->len);
+
+  if (invalidates->len == 0 && !wait)
+    {
+      g_array_unref (invalidates);
+      return;
+    }
+
+  /* A doc that was looked up before it became visible would otherwise
+   * still fail to look up for a while after the caller got its reply.
+   * Everything else is sent in the background. */
+  queue_invalidates (invalidates, wait || negative);
+}
+
+void
+xdp_fuse_invalidate_doc_app (const char *doc_id,
+                             const char *opt_app_id)
+{
+  const char *doc_ids[] = { doc_id, NULL };
+  const char *app_ids[] = { opt_app_id, NULL };
+
+  xdp_fuse_invalidate_docs (doc_ids, opt_app_id ? app_ids : NULL, FALSE);
+}
+
+/* Called after name was added to parent. The kernel updates the cache
+ * of the view it was added through itself, but the same document may
+ * also be seen under the root and by-app dirs, and a cached failed
+ * lookup of name there would now be wrong. */
+static void
+invalidate_name_in_other_views (XdpInode   *parent,
+                                const char *name)
+{
+  XdpDomain *domain = parent->domain;
+  XdpDomain *by_app_domain;
+  g_autoptr(GPtrArray) views = NULL;
+  GArray *invalidates;
+  GHashTableIter iter;
+  gpointer value;
+  XdpInode *doc_inode;
+  guint i;
+
+  if (domain->type != XDP_DOMAIN_DOCUMENT ||
+      negative_entry_timeout (domain) <= 0 ||
+      !g_atomic_int_get (&fuse_ready))
+    return;
+
+  views = g_ptr_array_new_with_free_func ((GDestroyNotify) xdp_inode_unref);
+
+  g_mutex_lock (&root_inode->domain->inodes_mutex);
+  doc_inode = g_hash_table_lookup (root_inode->domain->inodes, domain->doc_id);
+  if (doc_inode != NULL && doc_inode->domain != domain)
+    g_ptr_array_add (views, xdp_inode_ref (doc_inode));
+  g_mutex_unlock (&root_inode->domain->inodes_mutex);
+
+  by_app_domain = by_app_inode->domain;
+  g_mutex_lock (&by_app_domain->inodes_mutex);
+  g_hash_table_iter_init (&iter, by_app_domain->inodes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      XdpDomain *app_domain = ((XdpInode *) value)->domain;
+
+      g_mutex_lock (&app_domain->inodes_mutex);
+      doc_inode = g_hash_table_lookup (app_domain->inodes, domain->doc_id);
+      if (doc_inode != NULL && doc_inode->domain != domain)
+        g_ptr_array_add (views, xdp_inode_ref (doc_inode));
+      g_mutex_unlock (&app_domain->inodes_mutex);
     }
+  g_mutex_unlock (&by_app_domain->inodes_mutex);
 
-  G_UNLOCK (domain_inodes);
+  invalidates = g_array_new (FALSE, FALSE, sizeof (Invalidate));
+  g_array_set_clear_func (invalidates, (GDestroyNotify) invalidate_clear);
 
-  for (i = 0; i < invalidates->len; i++)
+  for (i = 0; i < views->len; i++)
     {
-      Invalidate *invalidate = &g_array_index (invalidates, Invalidate, i);
+      XdpInode *view = g_ptr_array_index (views, i);
+      XdpInode *dir = view;
+      Invalidate inval;
 
-      if (invalidate->filename)
+      /* Subdirs of directory documents are keyed by their physical inode */
+      if (parent->physical != NULL)
         {
-          fuse_lowlevel_notify_inval_entry (main_ch, invalidate->ino,
-                                            invalidate->filename, strlen (invalidate->filename));
-          g_free (invalidate->filename);
+          g_mutex_lock (&view->domain->inodes_mutex);
+          dir = g_hash_table_lookup (view->domain->inodes, parent->physical);
+          g_mutex_unlock (&view->domain->inodes_mutex);
+
+          /* Not looked up in this view, so nothing cached */
+          if (dir == NULL)
+            continue;
         }
-      else
-        fuse_lowlevel_notify_inval_inode (main_ch, invalidate->ino, 0, 0);
+
+      inval.ino = xdp_inode_to_ino (dir);
+      inval.filename = g_strdup (name);
+      g_array_append_val (invalidates, inval);
+    }
+
+  if (invalidates->len == 0)
+    {
+      g_array_unref (invalidates);
+      return;
     }
+
+  queue_invalidates (invalidates, FALSE);
 }
 
 char *
@@ -3049,14 +5806,15 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
                               char **real_path_out)
 {
   XdpInode *inode = _xdp_inode_from_maybe_ino (ino);
+  XdpInodeShard *shard = all_inodes_shard (inode);
   g_autoptr(XdpDomain) domain = NULL;
   g_autoptr(XdpPhysicalInode) physical = NULL;
 
   if (real_path_out)
     *real_path_out = NULL;
 
-  G_LOCK (all_inodes);
-  inode = g_hash_table_lookup (all_inodes, inode);
+  g_mutex_lock (&shard->mutex);
+  inode = g_hash_table_lookup (shard->table, inode);
   if (inode)
     {
       /* We're not allowed to ressurect the inode here, but we can get the data while in the lock */
@@ -3064,7 +5822,7 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
       if (inode->physical)
         physical = xdp_physical_inode_ref (inode->physical);
     }
-  G_UNLOCK (all_inodes);
+  g_mutex_unlock (&shard->mutex);
 
   if (domain == NULL)
     return NULL;
@@ -3079,18 +5837,10 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
       if (directory)
         return NULL;
 
-      if (physical != NULL)
-        {
-          g_autofree char *main_path = g_build_filename (domain->doc_path, domain->doc_file, NULL);
-          DevIno file_devino = physical->backing_devino;
-          struct stat buf;
-
-          /* Only return for main file */
-          if (lstat (main_path, &buf) == 0 &&
-              buf.st_dev == file_devino.dev &&
-              buf.st_ino == file_devino.ino)
-            return g_strdup (domain->doc_id);
-        }
+      /* Only return for main file */
+      if (physical != NULL &&
+          xdp_doc_info_is_main_file (domain, &physical->backing_devino))
+        return g_strdup (domain->doc_id);
     }
   else
     {
@@ -6,15 +6,38 @@
 
 G_BEGIN_DECLS
 
+/* Per-request debug output, see SetLogDomains() */
+#define XDP_FUSE_LOG_DOMAIN "xdg-document-portal-fuse"
+
 char **        xdp_list_apps (void);
 char **        xdp_list_docs (void);
 PermissionDbEntry *xdp_lookup_doc (const char *doc_id);
+guint          xdp_get_docs_generation (void);
 
+void        xdp_fuse_set_cache_timeouts (double physical,
+                                         double virtual,
+                                         double negative);
+void        xdp_fuse_set_debug (gboolean debug,
+                                gboolean op_stats);
+GVariant   *xdp_fuse_get_op_stats (void);
+GVariant   *xdp_fuse_get_stats (void);
+void        xdp_fuse_set_trace_size (guint n_records);
+GVariant   *xdp_fuse_get_trace (void);
+void        xdp_fuse_set_writeback_cache (gboolean enable);
+void        xdp_fuse_set_thread_limits (int max,
+                                        int max_idle);
+void        xdp_fuse_set_io_limits (int max_read,
+                                    int max_write,
+                                    int max_readahead);
+void        xdp_fuse_trim_caches (void);
 gboolean    xdp_fuse_init (GError **error);
 void        xdp_fuse_exit (void);
 const char *xdp_fuse_get_mountpoint (void);
 void        xdp_fuse_invalidate_doc_app (const char *doc_id,
                                          const char *opt_app_id);
+void        xdp_fuse_invalidate_docs (const char * const *doc_ids,
+                                      const char * const *opt_app_ids,
+                                      gboolean            wait);
 char      *xdp_fuse_lookup_id_for_inode (ino_t    inode,
                                          gboolean directory,
                                          char   **real_path_out);
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/statfs.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -17,6 +18,7 @@
 #include "src/xdp-utils.h"
 #include "permission-db.h"
 #include "permission-store-dbus.h"
+#include "xdg-permission-store.h"
 #include "document-portal-fuse.h"
 #include "file-transfer.h"
 #include "document-portal.h"
@@ -38,34 +40,212 @@ typedef struct
 
 static GMainLoop *loop = NULL;
 static PermissionDb *db = NULL;
-static XdgPermissionStore *permission_store;
+static XdgPermissionStore *permission_store; /* db lock */
+static XdgPermissionStore *bus_permission_store;
 static int final_exit_status = 0;
 static GError *exit_error = NULL;
 static dev_t fuse_dev = 0;
 static GQueue get_mount_point_invocations = G_QUEUE_INIT;
+/* Method calls that arrived before the mount was up, see handle_method() */
+static GQueue pending_invocations = G_QUEUE_INIT;
+static gboolean name_acquired;
+static gboolean fuse_mount_started;
+static gboolean fuse_mount_pending;
 static XdpDbusDocuments *dbus_api;
+static XdpDbusDocumentsDebug *debug_api;
+
+static gboolean opt_verbose;
+static gboolean opt_replace;
+static gboolean opt_version;
+static gboolean opt_preload_db;
+static double opt_physical_cache_timeout = 0.0;
+static double opt_virtual_cache_timeout = 60.0;
+static double opt_negative_cache_timeout = -1;
+static gboolean opt_writeback_cache;
+static int opt_fuse_threads = 0;
+static int opt_fuse_idle_threads = 10;
+static gboolean opt_fuse_stats;
+static int opt_fuse_trace = 0;
+static char **opt_thread_sched;
+static int opt_fuse_max_read = 0;
+static int opt_fuse_max_write = 0;
+static int opt_fuse_max_readahead = 0;
+static int opt_max_transfers = 64;
+static int opt_vacuum_interval = 60 * 60;
+static gboolean opt_no_peer;
+static gboolean opt_lazy_mount;
 
 G_LOCK_DEFINE (db);
 
+/* Fold the db updates into a new base table once there are this many,
+ * to keep snapshots cheap */
+#define MAX_SNAPSHOT_UPDATES 512
+
+/* The fuse threads only read from the db, so they get an immutable
+ * snapshot of it, which is replaced whenever the db has changed.
+ * The db_snapshot lock only protects the pointer swap. */
+G_LOCK_DEFINE_STATIC (db_snapshot);
+static PermissionDb *db_snapshot = NULL;
+
+/* Counters for GetStatistics */
+static gsize stats_lookups; /* atomic */
+static gsize stats_lookup_misses; /* atomic */
+static gsize stats_snapshot_copies; /* atomic */
+static gsize stats_db_updates; /* atomic */
+static gsize stats_db_update_usec; /* atomic */
+
+/* Folds the db updates into a new base table, must be called with the
+ * db lock held */
+static void
+update_db_locked (void)
+{
+  gint64 start = g_get_monotonic_time ();
+
+  permission_db_update (db);
+
+  g_atomic_pointer_add (&stats_db_updates, 1);
+  g_atomic_pointer_add (&stats_db_update_usec, g_get_monotonic_time () - start);
+}
+
+static PermissionDb *
+get_db_snapshot (void)
+{
+  PermissionDb *snapshot = NULL;
+  PermissionDb *old_snapshot = NULL;
+
+  G_LOCK (db_snapshot);
+  if (db_snapshot != NULL &&
+      permission_db_get_generation (db_snapshot) == permission_db_get_generation (db))
+    snapshot = g_object_ref (db_snapshot);
+  G_UNLOCK (db_snapshot);
+
+  if (snapshot != NULL)
+    return snapshot;
+
+  {
+    XDP_AUTOLOCK (db);
+
+    /* Another thread may have made the snapshot while we waited */
+    G_LOCK (db_snapshot);
+    if (db_snapshot != NULL &&
+        permission_db_get_generation (db_snapshot) == permission_db_get_generation (db))
+      snapshot = g_object_ref (db_snapshot);
+    G_UNLOCK (db_snapshot);
+
+    if (snapshot != NULL)
+      return snapshot;
+
+    if (permission_db_get_n_updates (db) > MAX_SNAPSHOT_UPDATES)
+      update_db_locked ();
+
+    snapshot = permission_db_dup_snapshot (db);
+    g_atomic_pointer_add (&stats_snapshot_copies, 1);
+  }
+
+  G_LOCK (db_snapshot);
+  if (db_snapshot == NULL ||
+      (int) (permission_db_get_generation (snapshot) - permission_db_get_generation (db_snapshot)) > 0)
+    {
+      old_snapshot = db_snapshot;
+      db_snapshot = g_object_ref (snapshot);
+    }
+  G_UNLOCK (db_snapshot);
+
+  g_clear_object (&old_snapshot);
+
+  return snapshot;
+}
+
+static void
+trim_caches (void)
+{
+  PermissionDb *old_snapshot;
+
+  G_LOCK (db_snapshot);
+  old_snapshot = g_steal_pointer (&db_snapshot);
+  G_UNLOCK (db_snapshot);
+
+  g_clear_object (&old_snapshot);
+
+  xdp_fuse_trim_caches ();
+}
+
+static void
+db_memory_usage (GArray *usage)
+{
+  PermissionDbMemoryUsage db_usage;
+  g_autoptr(PermissionDb) snapshot = NULL;
+
+  {
+    XDP_AUTOLOCK (db);
+    permission_db_get_memory_usage (db, &db_usage);
+  }
+
+  xdp_memory_usage_add (usage, "db-updates", db_usage.updates, db_usage.updates_bytes);
+  xdp_memory_usage_add (usage, "db-app-changes", db_usage.app_changes, db_usage.app_changes_bytes);
+  xdp_memory_usage_add (usage, "db-journal", 0, db_usage.journal_bytes);
+  xdp_memory_usage_add (usage, "db-content", 0, db_usage.content_bytes);
+
+  /* The snapshot shares the content, but has its own copy of the
+   * changes */
+  G_LOCK (db_snapshot);
+  if (db_snapshot)
+    snapshot = g_object_ref (db_snapshot);
+  G_UNLOCK (db_snapshot);
+
+  if (snapshot)
+    {
+      permission_db_get_memory_usage (snapshot, &db_usage);
+      xdp_memory_usage_add (usage, "db-snapshot", db_usage.updates + db_usage.app_changes,
+                            db_usage.updates_bytes + db_usage.app_changes_bytes);
+    }
+}
+
+#if GLIB_CHECK_VERSION(2, 63, 3)
+static void
+low_memory_warning_cb (GMemoryMonitor             *monitor,
+                       GMemoryMonitorWarningLevel  level,
+                       gpointer                    user_data)
+{
+  xdp_trim_caches ();
+}
+#endif
+
 char **
 xdp_list_apps (void)
 {
-  XDP_AUTOLOCK (db);
-  return permission_db_list_apps (db);
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+
+  return permission_db_list_apps (snapshot);
 }
 
 char **
 xdp_list_docs (void)
 {
-  XDP_AUTOLOCK (db);
-  return permission_db_list_ids (db);
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+
+  return permission_db_list_ids (snapshot);
 }
 
 PermissionDbEntry *
 xdp_lookup_doc (const char *doc_id)
 {
-  XDP_AUTOLOCK (db);
-  return permission_db_lookup (db, doc_id);
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+  PermissionDbEntry *entry = permission_db_lookup (snapshot, doc_id);
+
+  g_atomic_pointer_add (&stats_lookups, 1);
+  if (entry == NULL)
+    g_atomic_pointer_add (&stats_lookup_misses, 1);
+
+  return entry;
+}
+
+/* Changes whenever any document changes, so the fuse side can cache
+ * what it derives from the db */
+guint
+xdp_get_docs_generation (void)
+{
+  return permission_db_get_generation (db);
 }
 
 static gboolean
@@ -76,11 +256,14 @@ persist_entry (PermissionDbEntry *entry)
   return (flags & DOCUMENT_ENTRY_FLAG_TRANSIENT) == 0;
 }
 
+/* If store_changes is not NULL, the permission store change is added
+ * to it as a SetMany element instead of being sent right away */
 static void
 do_set_permissions (PermissionDbEntry    *entry,
                     const char        *doc_id,
                     const char        *app_id,
-                    DocumentPermissionFlags perms)
+                    DocumentPermissionFlags perms,
+                    GVariantBuilder   *store_changes)
 {
   g_autofree const char **perms_s = xdg_unparse_permissions (perms);
 
@@ -91,7 +274,9 @@ do_set_permissions (PermissionDbEntry    *entry,
   new_entry = permission_db_entry_set_app_permissions (entry, app_id, perms_s);
   permission_db_set_entry (db, doc_id, new_entry);
 
-  if (persist_entry (new_entry))
+  if (persist_entry (new_entry) && store_changes)
+    g_variant_builder_add (store_changes, "(ss^as)", doc_id, app_id, perms_s);
+  else if (persist_entry (new_entry))
     {
       xdg_permission_store_call_set_permission (permission_store,
                                                 TABLE_NAME,
@@ -104,6 +289,56 @@ do_set_permissions (PermissionDbEntry    *entry,
     }
 }
 
+static void
+set_many_done (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      data)
+{
+  g_autoptr(GVariant) changes = data;
+  g_autoptr(GError) error = NULL;
+  GVariantIter iter;
+  const char *doc_id;
+  const char *app_id;
+  const char **perms;
+
+  if (xdg_permission_store_call_set_many_finish (XDG_PERMISSION_STORE (source_object), res, &error))
+    return;
+
+  /* SetMany changes nothing if one of the documents is missing from
+   * the store, don't let that take the others down with it */
+  g_warning ("Failed to store document permissions: %s", error->message);
+
+  if (!g_error_matches (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND))
+    return;
+
+  g_variant_iter_init (&iter, changes);
+  while (g_variant_iter_next (&iter, "(&s&s^a&s)", &doc_id, &app_id, &perms))
+    {
+      xdg_permission_store_call_set_permission (permission_store,
+                                                TABLE_NAME,
+                                                FALSE,
+                                                doc_id,
+                                                app_id,
+                                                perms,
+                                                NULL,
+                                                NULL, NULL);
+      g_free (perms);
+    }
+}
+
+/* Sends the changes collected by do_set_permissions() */
+static void
+store_permission_changes (GVariant *changes)
+{
+  xdg_permission_store_call_set_many (permission_store,
+                                      TABLE_NAME,
+                                      FALSE,
+                                      changes,
+                                      NULL,
+                                      set_many_done,
+                                      g_variant_ref (changes));
+}
+
 static void
 portal_grant_permissions (GDBusMethodInvocation *invocation,
                           GVariant              *parameters,
@@ -158,7 +393,8 @@ portal_grant_permissions (GDBusMethodInvocation *invocation,
       }
 
     do_set_permissions (entry, id, target_app_id,
-                        perms | document_entry_get_permissions (entry, target_app_id));
+                        perms | document_entry_get_permissions (entry, target_app_id),
+                        NULL);
   }
 
   /* Invalidate with lock dropped to avoid deadlock */
@@ -167,6 +403,118 @@ portal_grant_permissions (GDBusMethodInvocation *invocation,
   g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
 }
 
+/* Makes all the grants with a single db lock hold, one store call and
+ * one fuse invalidation, after checking all of them */
+static void
+portal_grant_permissions_many (GDBusMethodInvocation *invocation,
+                               GVariant              *parameters,
+                               XdpAppInfo            *app_info)
+{
+  const char *app_id = xdp_app_info_get_id (app_info);
+  g_autoptr(GVariant) grants = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autofree DocumentPermissionFlags *perms = NULL;
+  g_autoptr(GPtrArray) doc_ids = NULL;
+  g_autoptr(GPtrArray) app_ids = NULL;
+  g_autoptr(GVariant) changes = NULL;
+  GVariantBuilder store_changes;
+  gsize n_grants, i;
+
+  g_variant_get (parameters, "(@a(ssas))", &grants);
+  n_grants = g_variant_n_children (grants);
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify) permission_db_entry_unref);
+  perms = g_new0 (DocumentPermissionFlags, n_grants);
+  doc_ids = g_ptr_array_new ();
+  app_ids = g_ptr_array_new ();
+
+  {
+    XDP_AUTOLOCK (db);
+
+    for (i = 0; i < n_grants; i++)
+      {
+        const char *id;
+        const char *target_app_id;
+        g_autofree const char **permissions = NULL;
+        PermissionDbEntry *entry;
+        GError *error = NULL;
+
+        g_variant_get_child (grants, i, "(&s&s^a&s)", &id, &target_app_id, &permissions);
+
+        entry = permission_db_lookup (db, id);
+        if (entry == NULL)
+          {
+            g_dbus_method_invocation_return_error (invocation,
+                                                   XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                                                   "No such document: %s", id);
+            return;
+          }
+        g_ptr_array_add (entries, entry);
+
+        if (!xdp_is_valid_app_id (target_app_id))
+          {
+            g_dbus_method_invocation_return_error (invocation,
+                                                   XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                                                   "'%s' is not a valid app name", target_app_id);
+            return;
+          }
+
+        perms[i] = xdp_parse_permissions (permissions, &error);
+        if (error)
+          {
+            g_dbus_method_invocation_take_error (invocation, error);
+            return;
+          }
+
+        /* Must have grant-permissions and all the newly granted permissions */
+        if (!document_entry_has_permissions (entry, app_id,
+                                             DOCUMENT_PERMISSION_FLAGS_GRANT_PERMISSIONS | perms[i]))
+          {
+            g_dbus_method_invocation_return_error (invocation,
+                                                   XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                                   "Not enough permissions for %s", id);
+            return;
+          }
+      }
+
+    g_variant_builder_init (&store_changes, G_VARIANT_TYPE ("a(ssas)"));
+
+    for (i = 0; i < n_grants; i++)
+      {
+        const char *id;
+        const char *target_app_id;
+        g_autoptr(PermissionDbEntry) entry = NULL;
+
+        g_variant_get_child (grants, i, "(&s&s@as)", &id, &target_app_id, NULL);
+
+        /* Earlier grants in the batch may have changed the entry */
+        entry = permission_db_lookup (db, id);
+        do_set_permissions (entry, id, target_app_id,
+                            perms[i] | document_entry_get_permissions (entry, target_app_id),
+                            &store_changes);
+
+        g_ptr_array_add (doc_ids, (char *) id);
+        g_ptr_array_add (app_ids, (char *) target_app_id);
+      }
+
+    changes = g_variant_ref_sink (g_variant_builder_end (&store_changes));
+    if (g_variant_n_children (changes) > 0)
+      store_permission_changes (changes);
+  }
+
+  /* Invalidate with lock dropped to avoid deadlock */
+  if (doc_ids->len > 0)
+    {
+      g_ptr_array_add (doc_ids, NULL);
+      g_ptr_array_add (app_ids, NULL);
+      xdp_fuse_invalidate_docs ((const char * const *) doc_ids->pdata,
+                                (const char * const *) app_ids->pdata,
+                                FALSE);
+    }
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+}
+
 static void
 portal_revoke_permissions (GDBusMethodInvocation *invocation,
                            GVariant              *parameters,
@@ -222,7 +570,8 @@ portal_revoke_permissions (GDBusMethodInvocation *invocation,
       }
 
     do_set_permissions (entry, id, target_app_id,
-                        ~perms & document_entry_get_permissions (entry, target_app_id));
+                        ~perms & document_entry_get_permissions (entry, target_app_id),
+                        NULL);
   }
 
   /* Invalidate with lock dropped to avoid deadlock */
@@ -239,8 +588,7 @@ portal_delete (GDBusMethodInvocation *invocation,
   const char *id;
   const char *app_id = xdp_app_info_get_id (app_info);
   g_autoptr(PermissionDbEntry) entry = NULL;
-  g_autofree const char **old_apps = NULL;
-  int i;
+  const char *doc_ids[2] = { NULL, NULL };
 
   g_variant_get (parameters, "(s)", &id);
 
@@ -275,11 +623,10 @@ portal_delete (GDBusMethodInvocation *invocation,
                                         id, NULL, NULL, NULL);
   }
 
-  /* All i/o is done now, so drop the lock so we can invalidate the fuse caches */
-  old_apps = permission_db_entry_list_apps (entry);
-  for (i = 0; old_apps[i] != NULL; i++)
-    xdp_fuse_invalidate_doc_app (id, old_apps[i]);
-  xdp_fuse_invalidate_doc_app (id, NULL);
+  /* All i/o is done now, so drop the lock so we can invalidate the fuse
+   * caches. A NULL app list covers the old apps too. */
+  doc_ids[0] = id;
+  xdp_fuse_invalidate_docs (doc_ids, NULL, TRUE);
 
   /* Now fuse view is up-to-date, so we can return the call */
   g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
@@ -331,10 +678,10 @@ do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_exis
   g_debug ("create_doc %s", id);
 
   entry = permission_db_entry_new (data);
-  permission_db_set_entry (db, id, entry);
 
   if (persistent)
     {
+      permission_db_set_entry (db, id, entry);
       xdg_permission_store_call_set (permission_store,
                                      TABLE_NAME,
                                      TRUE,
@@ -343,6 +690,12 @@ do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_exis
                                      g_variant_new_variant (data),
                                      NULL, NULL, NULL);
     }
+  else
+    {
+      /* Transient documents are gone on restart anyway, so they are
+       * kept out of the tables that get rebuilt on updates */
+      permission_db_set_volatile_entry (db, id, entry);
+    }
 
   return id;
 }
@@ -421,6 +774,7 @@ verify_existing_document (struct stat *st_buf,
                           gboolean     allow_write,
                           char       **real_path_out)
 {
+  g_autoptr(PermissionDb) snapshot = NULL;
   g_autoptr(PermissionDbEntry) old_entry = NULL;
   g_autofree char *id = NULL;
 
@@ -433,15 +787,16 @@ verify_existing_document (struct stat *st_buf,
     return NULL;
 
   /* Don't lock the db before doing the fuse call above, because it takes takes a lock
-     that can block something calling back, causing a deadlock on the db lock */
-  XDP_AUTOLOCK (db);
+     that can block something calling back, causing a deadlock on the db lock.
+     The check only needs a snapshot, which is current when taken. */
+  snapshot = get_db_snapshot ();
 
   /* If the entry doesn't exist anymore, fail.  Also fail if not
    * reuse_existing, because otherwise the user could use this to
    * get a copy with permissions and thus escape later permission
    * revocations
    */
-  old_entry = permission_db_lookup (db, id);
+  old_entry = permission_db_lookup (snapshot, id);
   if (old_entry == NULL || !reuse_existing)
     return NULL;
 
@@ -524,17 +879,12 @@ flatpak (GError **error,
      2 == read-write
 */
 static void
-metadata_check_file_access (const char *keyfile_path,
+metadata_check_file_access (GKeyFile *keyfile,
                             int *allow_host_out,
                             int *allow_home_out)
 {
-  g_autoptr(GKeyFile) keyfile = NULL;
   g_auto(GStrv) fss = NULL;
 
-  keyfile = g_key_file_new ();
-  if (!g_key_file_load_from_file (keyfile, keyfile_path, G_KEY_FILE_NONE, NULL))
-    return;
-
   fss = g_key_file_get_string_list (keyfile, "Context",  "filesystems", NULL, NULL);
   if (fss)
     {
@@ -560,154 +910,562 @@ metadata_check_file_access (const char *keyfile_path,
     }
 }
 
-/* This is a simplified version that only looks at filesystem=host and
- * filesystem=home, as such it should not cause false positives, but
- * be may create a document for files that the app should have access
- * to (e.g. when the app has a more strict access but the file is
- * still accessible) */
-static gboolean
-app_has_file_access_fallback (const char *target_app_id,
-                              DocumentPermissionFlags target_perms,
-                              const char *path)
+/* The files that decide which filesystems an app can see, in the
+ * order flatpak applies them */
+#define N_FILE_ACCESS_SOURCES 6
+
+static void
+get_file_access_sources (const char *target_app_id,
+                         char      **sources)
 {
-  g_autofree char *user_metadata = NULL;
-  g_autofree char *system_metadata = NULL;
-  g_autofree char *user_override = NULL;
-  g_autofree char *system_override = NULL;
-  g_autofree char *user_global_override = NULL;
-  g_autofree char *system_global_override = NULL;
-  g_autofree char *homedir = NULL;
-  g_autofree char *canonical_path = NULL;
-  gboolean is_in_home = FALSE;
   g_autofree char *user_installation = g_build_filename (g_get_user_data_dir (), "flatpak", NULL);
   const char *system_installation = "/var/lib/flatpak";
-  int allow_host = 0;
-  int allow_home = 0;
-
-  if (g_str_has_prefix (path, "/usr") || g_str_has_prefix (path, "/app") || g_str_has_prefix (path, "/tmp"))
-    return FALSE;
 
-  user_metadata = g_build_filename (user_installation, "app", target_app_id, "current/active/metadata", NULL);
-  system_metadata = g_build_filename (system_installation, "app", target_app_id, "current/active/metadata", NULL);
-  user_override = g_build_filename (user_installation, "overrides", target_app_id, NULL);
-  system_override = g_build_filename (system_installation, "overrides", target_app_id, NULL);
-  user_global_override = g_build_filename (user_installation, "overrides", "global", NULL);
-  system_global_override = g_build_filename (system_installation, "overrides", "global", NULL);
-
-  metadata_check_file_access (system_metadata, &allow_host, &allow_home);
-  metadata_check_file_access (user_metadata, &allow_host, &allow_home);
-  metadata_check_file_access (system_global_override, &allow_host, &allow_home);
-  metadata_check_file_access (system_override, &allow_host, &allow_home);
-  metadata_check_file_access (user_global_override, &allow_host, &allow_home);
-  metadata_check_file_access (user_override, &allow_host, &allow_home);
+  sources[0] = g_build_filename (system_installation, "app", target_app_id, "current/active/metadata", NULL);
+  sources[1] = g_build_filename (user_installation, "app", target_app_id, "current/active/metadata", NULL);
+  sources[2] = g_build_filename (system_installation, "overrides", "global", NULL);
+  sources[3] = g_build_filename (system_installation, "overrides", target_app_id, NULL);
+  sources[4] = g_build_filename (user_installation, "overrides", "global", NULL);
+  sources[5] = g_build_filename (user_installation, "overrides", target_app_id, NULL);
+}
 
-  if (allow_host == 2 ||
-      ((allow_host == 1) &&
-       (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0))
-    return TRUE;
+static void
+free_file_access_sources (char **sources)
+{
+  int i;
 
-  homedir = xdp_canonicalize_filename (g_get_home_dir ());
-  canonical_path = xdp_canonicalize_filename (path);
+  for (i = 0; i < N_FILE_ACCESS_SOURCES; i++)
+    g_free (sources[i]);
+}
 
-  is_in_home = xdp_has_path_prefix (canonical_path, homedir);
+/* In-process version of flatpak info --file-access. The filesystems
+ * keys of the metadata and overrides are compiled into a table of
+ * exported paths per app, and a path gets the mode of its deepest
+ * exported ancestor. The table is rebuilt when any of the source files
+ * changes. Entries we don't understand make the app undecided, and then
+ * we ask flatpak. */
+
+typedef struct {
+  gboolean exists;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+} FileAccessStamp;
+
+typedef struct {
+  FileAccessStamp stamps[N_FILE_ACCESS_SOURCES];
+  GHashTable *exports; /* canonical path -> mode, 1 == read-only, 2 == read-write */
+  gboolean decided;
+  /* For app_has_file_access_fallback */
+  int allow_host;
+  int allow_home;
+} AppFileAccess;
+
+G_LOCK_DEFINE_STATIC (file_access);
+static GHashTable *file_access; /* app id -> AppFileAccess */
+
+/* Computed once, the home dir doesn't change under us */
+static const char *
+get_canonical_home (void)
+{
+  static char *canonical_home = NULL;
 
-  if (is_in_home &&
-      ((allow_home == 2) ||
-       (allow_home == 1 && (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0)))
-    return TRUE;
+  if (g_once_init_enter (&canonical_home))
+    g_once_init_leave (&canonical_home, xdp_canonicalize_filename (g_get_home_dir ()));
 
-  return FALSE;
+  return canonical_home;
 }
 
-
-static gboolean
-app_has_file_access (const char *target_app_id,
-                     DocumentPermissionFlags target_perms,
-                     const char *path)
+static void
+app_file_access_free (AppFileAccess *access)
 {
-  g_autoptr(GError) error = NULL;
-  g_autofree char *res = NULL;
-  g_autofree char *arg = NULL;
-
-  if (target_app_id == NULL || target_app_id[0] == '\0')
-    return FALSE;
+  g_hash_table_unref (access->exports);
+  g_free (access);
+}
 
-  /* First we try flatpak info --file-access=PATH APPID, which is supported on new versions */
-  arg = g_strdup_printf ("--file-access=%s", path);
-  res = flatpak (&error, "info", arg, target_app_id, NULL);
+static void
+get_file_access_stamps (char           **sources,
+                        FileAccessStamp *stamps)
+{
+  int i;
 
-  if (res)
+  for (i = 0; i < N_FILE_ACCESS_SOURCES; i++)
     {
-      if (strcmp (res, "read-write") == 0)
-        return TRUE;
+      struct stat st;
 
-      if (strcmp (res, "read-only") == 0 &&
-          ((target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0))
-        return TRUE;
+      memset (&stamps[i], 0, sizeof (FileAccessStamp));
+      if (stat (sources[i], &st) == 0)
+        {
+          stamps[i].exists = TRUE;
+          stamps[i].dev = st.st_dev;
+          stamps[i].ino = st.st_ino;
+          stamps[i].mtime = st.st_mtim;
+        }
+    }
+}
 
-      return FALSE;
+static gboolean
+file_access_stamps_equal (const FileAccessStamp *a,
+                          const FileAccessStamp *b)
+{
+  int i;
+
+  for (i = 0; i < N_FILE_ACCESS_SOURCES; i++)
+    {
+      if (a[i].exists != b[i].exists ||
+          a[i].dev != b[i].dev ||
+          a[i].ino != b[i].ino ||
+          a[i].mtime.tv_sec != b[i].mtime.tv_sec ||
+          a[i].mtime.tv_nsec != b[i].mtime.tv_nsec)
+        return FALSE;
     }
 
-  /* Secondly we fall back to a simple check that will not be perfect but should not
-     cause false positives. */
-  return app_has_file_access_fallback (target_app_id, target_perms, path);
+  return TRUE;
 }
 
-static void
-portal_add_full (GDBusMethodInvocation *invocation,
-                 GVariant              *parameters,
-                 XdpAppInfo            *app_info)
+static const struct {
+  const char *name;
+  GUserDirectory dir;
+} xdg_user_dirs[] = {
+  { "xdg-desktop", G_USER_DIRECTORY_DESKTOP },
+  { "xdg-documents", G_USER_DIRECTORY_DOCUMENTS },
+  { "xdg-download", G_USER_DIRECTORY_DOWNLOAD },
+  { "xdg-music", G_USER_DIRECTORY_MUSIC },
+  { "xdg-pictures", G_USER_DIRECTORY_PICTURES },
+  { "xdg-public-share", G_USER_DIRECTORY_PUBLIC_SHARE },
+  { "xdg-templates", G_USER_DIRECTORY_TEMPLATES },
+  { "xdg-videos", G_USER_DIRECTORY_VIDEOS },
+};
+
+/* Returns the host path for a filesystems entry without its mode
+ * suffix. Returns FALSE if we don't know what the entry means, and
+ * TRUE with a NULL path for entries that don't expose anything the
+ * document portal cares about. */
+static gboolean
+filesystem_to_path (const char *fs,
+                    char      **path_out)
 {
-  g_autoptr(GVariant) array = NULL;
-  guint32 flags;
-  const char *target_app_id;
-  g_autofree const char **permissions = NULL;
-  DocumentPermissionFlags target_perms;
-  gsize n_args;
-  GDBusMessage *message;
-  GUnixFDList *fd_list;
-  g_autofree int *fd = NULL;
-  g_auto(GStrv) ids = NULL;
-  GError *error = NULL;
-  GVariantBuilder builder;
-  int fds_len;
-  int i;
-  const int *fds;
+  const char *base = NULL;
+  const char *rest = NULL;
+  gsize i;
 
-  g_variant_get (parameters, "(@ahu&s^a&s)",
-                 &array, &flags, &target_app_id, &permissions);
+  *path_out = NULL;
 
-  if ((flags & ~DOCUMENT_ADD_FLAGS_FLAGS_ALL) != 0)
+  if (strcmp (fs, "host") == 0)
     {
-      g_dbus_method_invocation_return_error (invocation,
-                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
-                                             "Invalid flags");
-      return;
+      *path_out = g_strdup ("/");
+      return TRUE;
     }
 
-  target_perms = xdp_parse_permissions (permissions, &error);
-  if (error)
+  /* These are mounted below /run/host, not at their real paths */
+  if (strcmp (fs, "host-os") == 0 || strcmp (fs, "host-etc") == 0)
+    return TRUE;
+
+  if (strcmp (fs, "home") == 0)
     {
-      g_dbus_method_invocation_take_error (invocation, error);
-      return;
+      *path_out = g_strdup (get_canonical_home ());
+      return TRUE;
     }
 
-  n_args = g_variant_n_children (array);
-  fd = g_new (int, n_args);
-  message = g_dbus_method_invocation_get_message (invocation);
-  fd_list = g_dbus_message_get_unix_fd_list (message);
-
-  if (fd_list == NULL)
+  if (g_str_has_prefix (fs, "~/"))
     {
-      g_dbus_method_invocation_return_error (invocation,
-                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
-                                             "No fds passed");
-      return;
+      *path_out = g_build_filename (g_get_home_dir (), fs + 2, NULL);
+      return TRUE;
     }
 
-  fds_len = 0;
-  fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
-  for (i = 0; i < n_args; i++)
+  if (fs[0] == '/')
+    {
+      *path_out = g_strdup (fs);
+      return TRUE;
+    }
+
+  if (!g_str_has_prefix (fs, "xdg-"))
+    return FALSE;
+
+  rest = strchr (fs, '/');
+  for (i = 0; i < G_N_ELEMENTS (xdg_user_dirs); i++)
+    {
+      gsize len = strlen (xdg_user_dirs[i].name);
+
+      if (strncmp (fs, xdg_user_dirs[i].name, len) == 0 &&
+          (fs[len] == '\0' || fs[len] == '/'))
+        {
+          base = g_get_user_special_dir (xdg_user_dirs[i].dir);
+          /* Flatpak ignores unset dirs, and dirs that are just $HOME */
+          if (base == NULL ||
+              (rest == NULL && strcmp (base, g_get_home_dir ()) == 0))
+            return TRUE;
+          break;
+        }
+    }
+
+  if (base == NULL)
+    {
+      if (g_str_has_prefix (fs, "xdg-config") && (fs[10] == '\0' || fs[10] == '/'))
+        base = g_get_user_config_dir ();
+      else if (g_str_has_prefix (fs, "xdg-data") && (fs[8] == '\0' || fs[8] == '/'))
+        base = g_get_user_data_dir ();
+      else if (g_str_has_prefix (fs, "xdg-cache") && (fs[9] == '\0' || fs[9] == '/'))
+        base = g_get_user_cache_dir ();
+      else
+        return FALSE; /* e.g. xdg-run, which is not the same path on the host */
+    }
+
+  if (rest)
+    *path_out = g_build_filename (base, rest + 1, NULL);
+  else
+    *path_out = g_strdup (base);
+
+  return TRUE;
+}
+
+/* Applies one filesystems entry, returns FALSE if it is not understood */
+static gboolean
+app_file_access_apply (AppFileAccess *access,
+                       const char    *entry)
+{
+  g_autofree char *fs = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *real_path = NULL;
+  gboolean remove = FALSE;
+  char *suffix;
+  int mode = 2;
+
+  if (entry[0] == '!')
+    {
+      remove = TRUE;
+      entry++;
+    }
+
+  fs = g_strdup (entry);
+  suffix = strrchr (fs, ':');
+  if (suffix)
+    {
+      if (strcmp (suffix, ":ro") == 0)
+        mode = 1;
+      else if (strcmp (suffix, ":rw") != 0 && strcmp (suffix, ":create") != 0)
+        return FALSE;
+      *suffix = '\0';
+    }
+
+  if (!filesystem_to_path (fs, &path))
+    return FALSE;
+
+  if (path == NULL)
+    return TRUE;
+
+  /* Exports follow symlinks, and the paths we check are canonical */
+  real_path = realpath (path, NULL);
+  if (real_path == NULL)
+    real_path = xdp_canonicalize_filename (path);
+
+  if (remove)
+    g_hash_table_remove (access->exports, real_path);
+  else
+    g_hash_table_insert (access->exports, g_steal_pointer (&real_path), GINT_TO_POINTER (mode));
+
+  return TRUE;
+}
+
+static AppFileAccess *
+app_file_access_new (char                 **sources,
+                     const FileAccessStamp *stamps)
+{
+  AppFileAccess *access = g_new0 (AppFileAccess, 1);
+  gboolean have_metadata = FALSE;
+  int i, j;
+
+  memcpy (access->stamps, stamps, sizeof (access->stamps));
+  access->exports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  access->decided = TRUE;
+
+  for (i = 0; i < N_FILE_ACCESS_SOURCES; i++)
+    {
+      g_autoptr(GKeyFile) keyfile = NULL;
+      g_auto(GStrv) fss = NULL;
+
+      if (!stamps[i].exists)
+        continue;
+
+      keyfile = g_key_file_new ();
+      if (!g_key_file_load_from_file (keyfile, sources[i], G_KEY_FILE_NONE, NULL))
+        {
+          access->decided = FALSE;
+          continue;
+        }
+
+      /* The first two are the app metadata, the rest overrides */
+      if (i < 2)
+        have_metadata = TRUE;
+
+      metadata_check_file_access (keyfile, &access->allow_host, &access->allow_home);
+
+      fss = g_key_file_get_string_list (keyfile, "Context", "filesystems", NULL, NULL);
+      for (j = 0; fss != NULL && fss[j] != NULL; j++)
+        {
+          if (!app_file_access_apply (access, fss[j]))
+            access->decided = FALSE;
+        }
+    }
+
+  /* Not in a default installation, only flatpak knows */
+  if (!have_metadata)
+    access->decided = FALSE;
+
+  return access;
+}
+
+/* These are never those of the host, even with filesystem=host. /var
+ * and /root aren't mounted from the host, /var/tmp is per app. */
+static gboolean
+is_reserved_path (const char *path)
+{
+  const char *reserved[] = { "/app", "/bin", "/boot", "/dev", "/etc", "/lib", "/lib32",
+                             "/lib64", "/proc", "/root", "/run", "/sbin", "/sys", "/tmp",
+                             "/usr", "/var" };
+  gsize i;
+
+  if (xdp_has_path_prefix (path, "/run/media"))
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (reserved); i++)
+    {
+      if (xdp_has_path_prefix (path, reserved[i]))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Returns 0 == hidden, 1 == read-only, 2 == read-write, or -1 if
+ * unknown */
+static int
+app_file_access_get_mode (AppFileAccess *access,
+                          const char    *canonical_path)
+{
+  g_autofree char *dir = g_strdup (canonical_path);
+
+  if (!access->decided)
+    return -1;
+
+  if (xdp_has_path_prefix (canonical_path, "/usr") ||
+      xdp_has_path_prefix (canonical_path, "/app"))
+    return 0;
+
+  while (TRUE)
+    {
+      gpointer mode;
+      char *slash;
+
+      if (dir[0] == '\0')
+        {
+          g_free (dir);
+          dir = g_strdup ("/");
+        }
+
+      if (g_hash_table_lookup_extended (access->exports, dir, NULL, &mode))
+        {
+          if (strcmp (dir, "/") == 0 && is_reserved_path (canonical_path))
+            return 0;
+          return GPOINTER_TO_INT (mode);
+        }
+
+      if (strcmp (dir, "/") == 0)
+        return 0;
+
+      slash = strrchr (dir, '/');
+      *slash = '\0';
+    }
+}
+
+static void
+trim_file_access (void)
+{
+  G_LOCK (file_access);
+  if (file_access)
+    g_hash_table_remove_all (file_access);
+  G_UNLOCK (file_access);
+}
+
+/* Returns the entry for the app, reparsing its files if any of them
+ * changed. The entry is only valid under the lock. */
+static AppFileAccess *
+ensure_app_file_access_locked (const char *target_app_id)
+{
+  char *sources[N_FILE_ACCESS_SOURCES];
+  FileAccessStamp stamps[N_FILE_ACCESS_SOURCES];
+  AppFileAccess *access;
+
+  get_file_access_sources (target_app_id, sources);
+  get_file_access_stamps (sources, stamps);
+
+  if (file_access == NULL)
+    file_access = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, (GDestroyNotify)app_file_access_free);
+
+  access = g_hash_table_lookup (file_access, target_app_id);
+  if (access == NULL || !file_access_stamps_equal (access->stamps, stamps))
+    {
+      access = app_file_access_new (sources, stamps);
+      g_hash_table_insert (file_access, g_strdup (target_app_id), access);
+    }
+
+  free_file_access_sources (sources);
+
+  return access;
+}
+
+static int
+lookup_file_access (const char *target_app_id,
+                    const char *path)
+{
+  g_autofree char *canonical_path = xdp_canonicalize_filename (path);
+  int mode;
+
+  G_LOCK (file_access);
+  mode = app_file_access_get_mode (ensure_app_file_access_locked (target_app_id), canonical_path);
+  G_UNLOCK (file_access);
+
+  return mode;
+}
+
+/* This is a simplified version that only looks at filesystem=host and
+ * filesystem=home, as such it should not cause false positives, but
+ * be may create a document for files that the app should have access
+ * to (e.g. when the app has a more strict access but the file is
+ * still accessible) */
+static gboolean
+app_has_file_access_fallback (const char *target_app_id,
+                              DocumentPermissionFlags target_perms,
+                              const char *path)
+{
+  g_autofree char *canonical_path = NULL;
+  gboolean is_in_home = FALSE;
+  AppFileAccess *access;
+  int allow_host = 0;
+  int allow_home = 0;
+
+  if (g_str_has_prefix (path, "/usr") || g_str_has_prefix (path, "/app") || g_str_has_prefix (path, "/tmp"))
+    return FALSE;
+
+  G_LOCK (file_access);
+  access = ensure_app_file_access_locked (target_app_id);
+  allow_host = access->allow_host;
+  allow_home = access->allow_home;
+  G_UNLOCK (file_access);
+
+  if (allow_host == 2 ||
+      ((allow_host == 1) &&
+       (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0))
+    return TRUE;
+
+  canonical_path = xdp_canonicalize_filename (path);
+
+  is_in_home = xdp_has_path_prefix (canonical_path, get_canonical_home ());
+
+  if (is_in_home &&
+      ((allow_home == 2) ||
+       (allow_home == 1 && (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0)))
+    return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+app_has_file_access (const char *target_app_id,
+                     DocumentPermissionFlags target_perms,
+                     const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *res = NULL;
+  g_autofree char *arg = NULL;
+  int mode;
+
+  if (target_app_id == NULL || target_app_id[0] == '\0')
+    return FALSE;
+
+  /* Most of the time we can answer without spawning flatpak */
+  mode = lookup_file_access (target_app_id, path);
+  if (mode != -1)
+    return mode == 2 ||
+      (mode == 1 && (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0);
+
+  /* Then we try flatpak info --file-access=PATH APPID, which is supported on new versions */
+  arg = g_strdup_printf ("--file-access=%s", path);
+  res = flatpak (&error, "info", arg, target_app_id, NULL);
+
+  if (res)
+    {
+      if (strcmp (res, "read-write") == 0)
+        return TRUE;
+
+      if (strcmp (res, "read-only") == 0 &&
+          ((target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0))
+        return TRUE;
+
+      return FALSE;
+    }
+
+  /* Secondly we fall back to a simple check that will not be perfect but should not
+     cause false positives. */
+  return app_has_file_access_fallback (target_app_id, target_perms, path);
+}
+
+static void
+portal_add_full (GDBusMethodInvocation *invocation,
+                 GVariant              *parameters,
+                 XdpAppInfo            *app_info)
+{
+  g_autoptr(GVariant) array = NULL;
+  guint32 flags;
+  const char *target_app_id;
+  g_autofree const char **permissions = NULL;
+  DocumentPermissionFlags target_perms;
+  gsize n_args;
+  GDBusMessage *message;
+  GUnixFDList *fd_list;
+  g_autofree int *fd = NULL;
+  g_auto(GStrv) ids = NULL;
+  GError *error = NULL;
+  GVariantBuilder builder;
+  int fds_len;
+  int i;
+  const int *fds;
+
+  g_variant_get (parameters, "(@ahu&s^a&s)",
+                 &array, &flags, &target_app_id, &permissions);
+
+  if ((flags & ~DOCUMENT_ADD_FLAGS_FLAGS_ALL) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                                             "Invalid flags");
+      return;
+    }
+
+  target_perms = xdp_parse_permissions (permissions, &error);
+  if (error)
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      return;
+    }
+
+  n_args = g_variant_n_children (array);
+  fd = g_new (int, n_args);
+  message = g_dbus_method_invocation_get_message (invocation);
+  fd_list = g_dbus_message_get_unix_fd_list (message);
+
+  if (fd_list == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                                             "No fds passed");
+      return;
+    }
+
+  fds_len = 0;
+  fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
+  for (i = 0; i < n_args; i++)
     {
       int fd_id;
       g_variant_get_child (array, i, "h", &fd_id);
@@ -735,33 +1493,160 @@ portal_add_full (GDBusMethodInvocation *invocation,
                                                         g_variant_builder_end (&builder)));
 }
 
+/* Adds of at least this many fds validate them in parallel, as
+ * validation is mostly waiting for the filesystem */
+#define PARALLEL_VALIDATE_MIN_FDS 8
+#define VALIDATE_MAX_THREADS 4
+
+typedef struct {
+  GMutex mutex;
+  GCond cond;
+  guint n_pending;
+} ValidateBatch;
+
+typedef struct {
+  ValidateBatch *batch;
+  int fd;
+  XdpAppInfo *app_info;
+  ValidateFdType ensure_type;
+  struct stat st_buf;
+  struct stat real_dir_st_buf;
+  char *path;
+  gboolean writable;
+  GError *error;
+} FdValidation;
+
+static void
+fd_validation_run (FdValidation *v)
+{
+  validate_fd (v->fd, v->app_info, v->ensure_type,
+               &v->st_buf, &v->real_dir_st_buf, &v->path, &v->writable,
+               &v->error);
+}
+
+static void
+validate_pool_func (gpointer data,
+                    gpointer user_data)
+{
+  FdValidation *v = data;
+  ValidateBatch *batch = v->batch;
+
+  fd_validation_run (v);
+
+  g_mutex_lock (&batch->mutex);
+  if (--batch->n_pending == 0)
+    g_cond_signal (&batch->cond);
+  g_mutex_unlock (&batch->mutex);
+}
+
+/* Validates all fds, in parallel for large batches. The results are
+ * only looked at afterwards, in order, so errors are reported the
+ * same way as when validating one at a time. */
+static void
+validate_fds (FdValidation *validations,
+              int           n_validations)
+{
+  static GThreadPool *validate_pool = NULL;
+  ValidateBatch batch;
+  int i;
+
+  if (n_validations < PARALLEL_VALIDATE_MIN_FDS)
+    {
+      for (i = 0; i < n_validations; i++)
+        fd_validation_run (&validations[i]);
+      return;
+    }
+
+  if (g_once_init_enter (&validate_pool))
+    g_once_init_leave (&validate_pool,
+                       g_thread_pool_new (validate_pool_func, NULL,
+                                          VALIDATE_MAX_THREADS, FALSE, NULL));
+
+  g_mutex_init (&batch.mutex);
+  g_cond_init (&batch.cond);
+  batch.n_pending = n_validations;
+
+  for (i = 0; i < n_validations; i++)
+    {
+      validations[i].batch = &batch;
+      g_thread_pool_push (validate_pool, &validations[i], NULL);
+    }
+
+  g_mutex_lock (&batch.mutex);
+  while (batch.n_pending > 0)
+    g_cond_wait (&batch.cond, &batch.mutex);
+  g_mutex_unlock (&batch.mutex);
+
+  g_mutex_clear (&batch.mutex);
+  g_cond_clear (&batch.cond);
+}
+
+static void
+fd_validation_clear (FdValidation *v)
+{
+  g_free (v->path);
+  g_clear_error (&v->error);
+}
+
+struct _DocumentAddBatch
+{
+  int n_args;
+  DocumentAddFullFlags flags;
+  char *app_id;
+  char *target_app_id;
+  DocumentPermissionFlags target_perms;
+  GPtrArray *ids;
+  GPtrArray *paths;
+  struct stat *real_dir_st_bufs;
+  gboolean *writable;
+  gboolean *has_file_access;
+};
+
+void
+document_add_batch_free (DocumentAddBatch *batch)
+{
+  g_free (batch->app_id);
+  g_free (batch->target_app_id);
+  g_ptr_array_unref (batch->ids);
+  g_ptr_array_unref (batch->paths);
+  g_free (batch->real_dir_st_bufs);
+  g_free (batch->writable);
+  g_free (batch->has_file_access);
+  g_free (batch);
+}
+
 /*
  * if the fd array contains fds that were not opened by the client itself,
  * parent_dev and parent_ino must contain the st_dev/st_ino fields for the
  * parent directory to check for, to prevent symlink attacks.
  */
-char **
-document_add_full (int                      *fd,
-                   int                      *parent_dev,
-                   int                      *parent_ino,
-                   int                       n_args,
-                   DocumentAddFullFlags      flags,
-                   XdpAppInfo               *app_info,
-                   const char               *target_app_id,
-                   DocumentPermissionFlags   target_perms,
-                   GError                  **error)
+/*
+ * This validates the fds without changing any document, so several
+ * batches can be checked before the first of them is committed.
+ */
+DocumentAddBatch *
+document_add_prepare (int                      *fd,
+                      int                      *parent_dev,
+                      int                      *parent_ino,
+                      int                       n_args,
+                      DocumentAddFullFlags      flags,
+                      XdpAppInfo               *app_info,
+                      const char               *target_app_id,
+                      DocumentPermissionFlags   target_perms,
+                      GError                  **error)
 {
   const char *app_id = xdp_app_info_get_id (app_info);
   g_autoptr(GPtrArray) ids = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
-  gboolean reuse_existing, persistent, as_needed_by_app, allow_write, is_dir;
+  gboolean reuse_existing, as_needed_by_app, allow_write, is_dir;
   g_autofree struct stat *real_dir_st_bufs = NULL;
-  struct stat st_buf;
   g_autofree gboolean *writable = NULL;
+  g_autofree gboolean *has_file_access = NULL;
+  g_autoptr(GArray) validations = NULL;
+  DocumentAddBatch *batch;
   int i;
 
   reuse_existing = (flags & DOCUMENT_ADD_FLAGS_REUSE_EXISTING) != 0;
-  persistent = (flags & DOCUMENT_ADD_FLAGS_PERSISTENT) != 0;
   as_needed_by_app = (flags & DOCUMENT_ADD_FLAGS_AS_NEEDED_BY_APP) != 0;
   is_dir = (flags & DOCUMENT_ADD_FLAGS_DIRECTORY) != 0;
   allow_write = (target_perms & DOCUMENT_PERMISSION_FLAGS_WRITE) != 0;
@@ -771,12 +1656,36 @@ document_add_full (int                      *fd,
   real_dir_st_bufs = g_new0 (struct stat, n_args);
   writable = g_new0 (gboolean, n_args);
 
+  validations = g_array_sized_new (FALSE, TRUE, sizeof (FdValidation), n_args);
+  g_array_set_clear_func (validations, (GDestroyNotify) fd_validation_clear);
+  g_array_set_size (validations, n_args);
+  for (i = 0; i < n_args; i++)
+    {
+      FdValidation *v = &g_array_index (validations, FdValidation, i);
+
+      v->fd = fd[i];
+      v->app_info = app_info;
+      v->ensure_type = is_dir ? VALIDATE_FD_FILE_TYPE_DIR : VALIDATE_FD_FILE_TYPE_REGULAR;
+    }
+
+  validate_fds ((FdValidation *) validations->data, n_args);
+
   for (i = 0; i < n_args; i++)
     {
+      FdValidation *v = &g_array_index (validations, FdValidation, i);
       g_autofree char *path = NULL;
+      struct stat st_buf;
 
-      if (!validate_fd (fd[i], app_info, is_dir ? VALIDATE_FD_FILE_TYPE_DIR : VALIDATE_FD_FILE_TYPE_REGULAR, &st_buf, &real_dir_st_bufs[i], &path, &writable[i], error))
-        return NULL;
+      if (v->error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&v->error));
+          return NULL;
+        }
+
+      path = g_steal_pointer (&v->path);
+      st_buf = v->st_buf;
+      real_dir_st_bufs[i] = v->real_dir_st_buf;
+      writable[i] = v->writable;
 
       if (parent_dev != NULL && parent_ino != NULL)
         {
@@ -840,6 +1749,53 @@ document_add_full (int                      *fd,
       g_ptr_array_index(paths,i) = g_steal_pointer (&path);
     }
 
+  /* This may spawn flatpak, so do it before taking the db lock */
+  has_file_access = g_new0 (gboolean, n_args);
+  if (as_needed_by_app)
+    {
+      for (i = 0; i < n_args; i++)
+        has_file_access[i] = app_has_file_access (target_app_id, target_perms,
+                                                  g_ptr_array_index (paths, i));
+    }
+
+  batch = g_new0 (DocumentAddBatch, 1);
+  batch->n_args = n_args;
+  batch->flags = flags;
+  batch->app_id = g_strdup (app_id);
+  batch->target_app_id = g_strdup (target_app_id);
+  batch->target_perms = target_perms;
+  batch->ids = g_steal_pointer (&ids);
+  batch->paths = g_steal_pointer (&paths);
+  batch->real_dir_st_bufs = g_steal_pointer (&real_dir_st_bufs);
+  batch->writable = g_steal_pointer (&writable);
+  batch->has_file_access = g_steal_pointer (&has_file_access);
+
+  return batch;
+}
+
+/* Creates the documents of a prepared batch, this can't fail */
+char **
+document_add_commit (DocumentAddBatch *batch)
+{
+  const char *app_id = batch->app_id;
+  const char *target_app_id = batch->target_app_id;
+  DocumentPermissionFlags target_perms = batch->target_perms;
+  int n_args = batch->n_args;
+  GPtrArray *ids = batch->ids;
+  GPtrArray *paths = batch->paths;
+  struct stat *real_dir_st_bufs = batch->real_dir_st_bufs;
+  gboolean *writable = batch->writable;
+  gboolean *has_file_access = batch->has_file_access;
+  g_autoptr(GPtrArray) invalidate_ids = NULL;
+  gboolean reuse_existing, persistent, is_dir;
+  GVariantBuilder store_changes;
+  g_autoptr(GVariant) changes = NULL;
+  int i;
+
+  reuse_existing = (batch->flags & DOCUMENT_ADD_FLAGS_REUSE_EXISTING) != 0;
+  persistent = (batch->flags & DOCUMENT_ADD_FLAGS_PERSISTENT) != 0;
+  is_dir = (batch->flags & DOCUMENT_ADD_FLAGS_DIRECTORY) != 0;
+
   {
     DocumentPermissionFlags caller_base_perms = DOCUMENT_PERMISSION_FLAGS_GRANT_PERMISSIONS |
                                                 DOCUMENT_PERMISSION_FLAGS_READ;
@@ -851,13 +1807,15 @@ document_add_full (int                      *fd,
 
     XDP_AUTOLOCK (db); /* Lock once for all ops */
 
+    /* The permissions of the whole batch go to the store in one call */
+    g_variant_builder_init (&store_changes, G_VARIANT_TYPE ("a(ssas)"));
+
     for (i = 0; i < n_args; i++)
       {
         const char *path = g_ptr_array_index(paths,i);
         g_assert (path != NULL);
 
-        if (as_needed_by_app &&
-            app_has_file_access (target_app_id, target_perms, path))
+        if (has_file_access[i])
           {
             g_free (g_ptr_array_index(ids,i));
             g_ptr_array_index(ids,i) = g_strdup ("");
@@ -877,39 +1835,64 @@ document_add_full (int                      *fd,
                   caller_perms |= caller_write_perms;
 
                 g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);;
-                do_set_permissions (entry, id, app_id, caller_perms);
+                do_set_permissions (entry, id, app_id, caller_perms, &store_changes);
               }
 
             if (target_app_id[0] != '\0' && target_perms != 0)
               {
                 g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
-                do_set_permissions (entry, id, target_app_id, target_perms);
+                do_set_permissions (entry, id, target_app_id, target_perms, &store_changes);
               }
           }
       }
+
+    /* The store handles calls in order, so the Set calls of the new
+     * documents have created them by the time this is handled */
+    changes = g_variant_ref_sink (g_variant_builder_end (&store_changes));
+    if (g_variant_n_children (changes) > 0)
+      store_permission_changes (changes);
   }
 
-  /* Invalidate with lock dropped to avoid deadlock */
+  /* Invalidate with lock dropped to avoid deadlock. A NULL app list
+   * covers both app_id and target_app_id. */
+  invalidate_ids = g_ptr_array_new ();
   for (i = 0; i < n_args; i++)
     {
       const char *id = g_ptr_array_index (ids,i);
       g_assert (id != NULL);
 
-      if (*id == 0)
-        continue;
-
-      xdp_fuse_invalidate_doc_app (id, NULL);
-      if (app_id[0] != '\0')
-        xdp_fuse_invalidate_doc_app (id, app_id);
-      if (target_app_id[0] != '\0' && target_perms != 0)
-        xdp_fuse_invalidate_doc_app (id, target_app_id);
+      if (*id != 0)
+        g_ptr_array_add (invalidate_ids, (char *) id);
     }
+  g_ptr_array_add (invalidate_ids, NULL);
+  xdp_fuse_invalidate_docs ((const char * const *) invalidate_ids->pdata, NULL, FALSE);
 
   g_ptr_array_index(ids,n_args) = NULL;
 
   return g_strdupv ((char**)ids->pdata);
 }
 
+char **
+document_add_full (int                      *fd,
+                   int                      *parent_dev,
+                   int                      *parent_ino,
+                   int                       n_args,
+                   DocumentAddFullFlags      flags,
+                   XdpAppInfo               *app_info,
+                   const char               *target_app_id,
+                   DocumentPermissionFlags   target_perms,
+                   GError                  **error)
+{
+  g_autoptr(DocumentAddBatch) batch = NULL;
+
+  batch = document_add_prepare (fd, parent_dev, parent_ino, n_args, flags,
+                                app_info, target_app_id, target_perms, error);
+  if (batch == NULL)
+    return NULL;
+
+  return document_add_commit (batch);
+}
+
 static void
 portal_add_named_full (GDBusMethodInvocation *invocation,
                        GVariant              *parameters,
@@ -1010,10 +1993,13 @@ portal_add_named_full (GDBusMethodInvocation *invocation,
     if (!reuse_existing)
       caller_perms |= DOCUMENT_PERMISSION_FLAGS_DELETE;
 
+    /* See document_add_full() */
+    gboolean has_file_access = as_needed_by_app &&
+      app_has_file_access (target_app_id, target_perms, path);
+
     XDP_AUTOLOCK (db);
 
-    if (as_needed_by_app &&
-        app_has_file_access (target_app_id, target_perms, path))
+    if (has_file_access)
       {
         id = g_strdup ("");
       }
@@ -1024,13 +2010,13 @@ portal_add_named_full (GDBusMethodInvocation *invocation,
         if (app_id[0] != '\0' && strcmp (app_id, target_app_id) != 0)
           {
             g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);;
-            do_set_permissions (entry, id, app_id, caller_perms);
+            do_set_permissions (entry, id, app_id, caller_perms, NULL);
           }
 
         if (target_app_id[0] != '\0' && target_perms != 0)
           {
             g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
-            do_set_permissions (entry, id, target_app_id, target_perms);
+            do_set_permissions (entry, id, target_app_id, target_perms, NULL);
           }
       }
   }
@@ -1038,14 +2024,9 @@ portal_add_named_full (GDBusMethodInvocation *invocation,
   /* Invalidate with lock dropped to avoid deadlock */
   g_assert (id != NULL);
 
+  /* This covers app_id and target_app_id too */
   if (*id != 0)
-    {
-      xdp_fuse_invalidate_doc_app (id, NULL);
-      if (app_id[0] != '\0')
-        xdp_fuse_invalidate_doc_app (id, app_id);
-      if (target_app_id[0] != '\0' && target_perms != 0)
-        xdp_fuse_invalidate_doc_app (id, target_app_id);
-    }
+    xdp_fuse_invalidate_doc_app (id, NULL);
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&builder, "{sv}", "mountpoint",
@@ -1130,6 +2111,25 @@ typedef void (*PortalMethod) (GDBusMethodInvocation *invocation,
                               GVariant              *parameters,
                               XdpAppInfo            *app_info);
 
+static void ensure_fuse_mount (void);
+
+/* Until the fuse filesystem is mounted, queues the invocation and
+ * returns TRUE. It's handled by method_callback once the mount is
+ * there. */
+gboolean
+document_portal_defer_until_mounted (GCallback              method_callback,
+                                     GDBusMethodInvocation *invocation)
+{
+  if (fuse_dev != 0)
+    return FALSE;
+
+  g_object_set_data (G_OBJECT (invocation), "portal-method", method_callback);
+  g_queue_push_tail (&pending_invocations, g_object_ref (invocation));
+  ensure_fuse_mount ();
+
+  return TRUE;
+}
+
 static gboolean
 handle_method (GCallback              method_callback,
                GDBusMethodInvocation *invocation)
@@ -1138,7 +2138,15 @@ handle_method (GCallback              method_callback,
   g_autoptr(XdpAppInfo) app_info = NULL;
   PortalMethod portal_method = (PortalMethod)method_callback;
 
-  app_info = xdp_invocation_lookup_app_info_sync (invocation, NULL, &error);
+  if (document_portal_defer_until_mounted (method_callback, invocation))
+    return TRUE;
+
+  /* Calls from peer connections have no sender, see new_peer_connection() */
+  if (g_dbus_method_invocation_get_sender (invocation) == NULL)
+    app_info = xdp_app_info_ref (g_object_get_data (G_OBJECT (g_dbus_method_invocation_get_connection (invocation)),
+                                                    "app-info"));
+  else
+    app_info = xdp_invocation_lookup_app_info_sync (invocation, NULL, &error);
   if (app_info == NULL)
     g_dbus_method_invocation_return_gerror (invocation, error);
   else
@@ -1147,6 +2155,150 @@ handle_method (GCallback              method_callback,
   return TRUE;
 }
 
+static void
+portal_get_fuse_stats (GDBusMethodInvocation *invocation,
+                       GVariant              *parameters,
+                       XdpAppInfo            *app_info)
+{
+  /* The stats show what other apps are doing */
+  if (!xdp_app_info_is_host (app_info))
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Not allowed inside sandbox");
+      return;
+    }
+
+  xdp_dbus_documents_debug_complete_get_fuse_stats (debug_api, invocation,
+                                                    xdp_fuse_get_op_stats ());
+}
+
+static void
+portal_get_fuse_trace (GDBusMethodInvocation *invocation,
+                       GVariant              *parameters,
+                       XdpAppInfo            *app_info)
+{
+  /* See portal_get_fuse_stats() */
+  if (!xdp_app_info_is_host (app_info))
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Not allowed inside sandbox");
+      return;
+    }
+
+  xdp_dbus_documents_debug_complete_get_fuse_trace (debug_api, invocation,
+                                                    xdp_fuse_get_trace ());
+}
+
+static void
+message_handler (const gchar   *log_domain,
+                 GLogLevelFlags log_level,
+                 const gchar   *message,
+                 gpointer       user_data)
+{
+  /* Make this look like normal console output */
+  if (log_level & G_LOG_LEVEL_DEBUG)
+    xdp_log_write (g_strdup_printf ("XDP: %s\n", message));
+  else
+    xdp_log_write (g_strdup_printf ("%s: %s\n", g_get_prgname (), message));
+}
+
+static void
+portal_set_log_domains (GDBusMethodInvocation *invocation,
+                        GVariant              *parameters,
+                        XdpAppInfo            *app_info)
+{
+  g_autofree const char **domains = NULL;
+
+  /* Debug output includes file names of all apps */
+  if (!xdp_app_info_is_host (app_info))
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Not allowed inside sandbox");
+      return;
+    }
+
+  g_variant_get (parameters, "(^a&s)", &domains);
+
+  xdp_log_set_debug_domains (domains, message_handler);
+  xdp_fuse_set_debug (xdp_log_debug_domain_enabled (XDP_FUSE_LOG_DOMAIN), opt_fuse_stats);
+
+  xdp_dbus_documents_debug_complete_set_log_domains (debug_api, invocation);
+}
+
+static void
+portal_get_statistics (GDBusMethodInvocation *invocation,
+                       GVariant              *parameters,
+                       XdpAppInfo            *app_info)
+{
+  g_autoptr(PermissionDb) snapshot = NULL;
+  g_autoptr(GVariant) fuse_stats = NULL;
+  g_auto(GStrv) ids = NULL;
+  g_auto(GStrv) apps = NULL;
+  GVariantBuilder builder;
+  GVariantBuilder per_app;
+  GVariantIter iter;
+  const char *key;
+  GVariant *value;
+  int i;
+
+  /* See portal_get_fuse_stats() */
+  if (!xdp_app_info_is_host (app_info))
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Not allowed inside sandbox");
+      return;
+    }
+
+  snapshot = get_db_snapshot ();
+  ids = permission_db_list_ids (snapshot);
+  apps = permission_db_list_apps (snapshot);
+
+  g_variant_builder_init (&per_app, G_VARIANT_TYPE ("a{su}"));
+  for (i = 0; apps[i] != NULL; i++)
+    {
+      g_auto(GStrv) app_ids = permission_db_list_ids_by_app (snapshot, apps[i]);
+
+      g_variant_builder_add (&per_app, "{su}", apps[i], g_strv_length (app_ids));
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "documents",
+                         g_variant_new_uint32 (g_strv_length (ids)));
+  g_variant_builder_add (&builder, "{sv}", "documents-per-app",
+                         g_variant_builder_end (&per_app));
+  g_variant_builder_add (&builder, "{sv}", "lookups",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&stats_lookups)));
+  g_variant_builder_add (&builder, "{sv}", "lookup-misses",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&stats_lookup_misses)));
+  g_variant_builder_add (&builder, "{sv}", "snapshot-copies",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&stats_snapshot_copies)));
+  g_variant_builder_add (&builder, "{sv}", "db-updates",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&stats_db_updates)));
+  g_variant_builder_add (&builder, "{sv}", "db-update-usec",
+                         g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&stats_db_update_usec)));
+  g_variant_builder_add (&builder, "{sv}", "db-pending-updates",
+                         g_variant_new_uint32 (permission_db_get_n_updates (snapshot)));
+  g_variant_builder_add (&builder, "{sv}", "transfers-per-client",
+                         file_transfer_get_usage ());
+  g_variant_builder_add (&builder, "{sv}", "memory",
+                         xdp_get_memory_usage ());
+
+  fuse_stats = xdp_fuse_get_stats ();
+  g_variant_iter_init (&iter, fuse_stats);
+  while (g_variant_iter_next (&iter, "{&sv}", &key, &value))
+    {
+      g_variant_builder_add (&builder, "{sv}", key, value);
+      g_variant_unref (value);
+    }
+
+  xdp_dbus_documents_debug_complete_get_statistics (debug_api, invocation,
+                                                    g_variant_builder_end (&builder));
+}
+
 static gboolean
 handle_get_mount_point (XdpDbusDocuments *object, GDBusMethodInvocation *invocation)
 {
@@ -1155,6 +2307,7 @@ handle_get_mount_point (XdpDbusDocuments *object, GDBusMethodInvocation *invocat
       /* We mustn't reply to this until the FUSE mount point is open for
        * business. */
       g_queue_push_tail (&get_mount_point_invocations, g_object_ref (invocation));
+      ensure_fuse_mount ();
       return TRUE;
     }
 
@@ -1296,9 +2449,10 @@ portal_info (GDBusMethodInvocation *invocation,
 
   g_variant_get (parameters, "(&s)", &id);
 
-  XDP_AUTOLOCK (db);
-
-  entry = permission_db_lookup (db, id);
+  {
+    g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+    entry = permission_db_lookup (snapshot, id);
+  }
 
   if (!entry)
     {
@@ -1308,22 +2462,144 @@ portal_info (GDBusMethodInvocation *invocation,
       return TRUE;
     }
 
-  g_dbus_method_invocation_return_value (invocation,
-                                         g_variant_new ("(@ay@a{sas})",
-                                                        get_path (entry),
-                                                        get_app_permissions (entry)));
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(@ay@a{sas})",
+                                                        get_path (entry),
+                                                        get_app_permissions (entry)));
+
+  return TRUE;
+}
+
+static gboolean
+portal_list (GDBusMethodInvocation *invocation,
+             GVariant *parameters,
+             XdpAppInfo *app_info)
+{
+  const char *app_id = xdp_app_info_get_id (app_info);
+  g_autoptr(PermissionDb) snapshot = NULL;
+  g_auto(GStrv) ids = NULL;
+  GVariantBuilder builder;
+  int i;
+
+  if (!xdp_app_info_is_host (app_info))
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Not allowed in sandbox");
+      return TRUE;
+    }
+
+  g_variant_get (parameters, "(&s)", &app_id);
+
+  /* Don't hold up the db while listing everything */
+  snapshot = get_db_snapshot ();
+
+  if (strcmp (app_id, "") == 0)
+    ids = permission_db_list_ids (snapshot);
+  else
+    ids = permission_db_list_ids_by_app (snapshot, app_id);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{say}"));
+  for (i = 0; ids[i]; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+
+      entry = permission_db_lookup (snapshot, ids[i]);
+
+      g_variant_builder_add (&builder, "{s@ay}", ids[i], get_path (entry));
+    }
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(@a{say})",
+                                                        g_variant_builder_end (&builder)));
+
+  return TRUE;
+}
+
+#define DEFAULT_LIST_PAGE_SIZE 1000
+#define MAX_LIST_PAGE_SIZE 10000
+
+/* The sorted ids of the last listing, so that paging through a big
+ * store doesn't list and sort everything for each page */
+G_LOCK_DEFINE_STATIC (list_pages);
+static guint list_pages_generation;
+static char *list_pages_app_id = NULL;
+static char **list_pages_ids = NULL;
+static guint list_pages_n_ids;
+
+static int
+compare_ids (gconstpointer a,
+             gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/* Returns up to limit ids after start_after, in id order */
+static char **
+list_ids_page (PermissionDb *snapshot,
+               const char   *app_id,
+               const char   *start_after,
+               guint         limit,
+               gboolean     *more_out)
+{
+  GPtrArray *page = g_ptr_array_new ();
+  guint lo, hi;
+
+  G_LOCK (list_pages);
+
+  if (list_pages_ids == NULL ||
+      list_pages_generation != permission_db_get_generation (snapshot) ||
+      g_strcmp0 (list_pages_app_id, app_id) != 0)
+    {
+      g_strfreev (list_pages_ids);
+      g_free (list_pages_app_id);
+
+      if (strcmp (app_id, "") == 0)
+        list_pages_ids = permission_db_list_ids (snapshot);
+      else
+        list_pages_ids = permission_db_list_ids_by_app (snapshot, app_id);
+      list_pages_n_ids = g_strv_length (list_pages_ids);
+      qsort (list_pages_ids, list_pages_n_ids, sizeof (char *), compare_ids);
+
+      list_pages_app_id = g_strdup (app_id);
+      list_pages_generation = permission_db_get_generation (snapshot);
+    }
+
+  /* First id that sorts after start_after */
+  lo = 0;
+  hi = list_pages_n_ids;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (strcmp (list_pages_ids[mid], start_after) <= 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  for (; lo < list_pages_n_ids && page->len < limit; lo++)
+    g_ptr_array_add (page, g_strdup (list_pages_ids[lo]));
+  *more_out = lo < list_pages_n_ids;
+
+  G_UNLOCK (list_pages);
 
-  return TRUE;
+  g_ptr_array_add (page, NULL);
+  return (char **) g_ptr_array_free (page, FALSE);
 }
 
 static gboolean
-portal_list (GDBusMethodInvocation *invocation,
-             GVariant *parameters,
-             XdpAppInfo *app_info)
+portal_list_paged (GDBusMethodInvocation *invocation,
+                   GVariant *parameters,
+                   XdpAppInfo *app_info)
 {
-  const char *app_id = xdp_app_info_get_id (app_info);
+  const char *app_id;
+  const char *start_after;
+  g_autoptr(PermissionDb) snapshot = NULL;
   g_auto(GStrv) ids = NULL;
   GVariantBuilder builder;
+  gboolean more;
+  guint limit;
   int i;
 
   if (!xdp_app_info_is_host (app_info))
@@ -1334,32 +2610,198 @@ portal_list (GDBusMethodInvocation *invocation,
       return TRUE;
     }
 
-  g_variant_get (parameters, "(&s)", &app_id);
+  g_variant_get (parameters, "(&s&su)", &app_id, &start_after, &limit);
 
-  XDP_AUTOLOCK (db);
+  if (limit == 0)
+    limit = DEFAULT_LIST_PAGE_SIZE;
+  limit = MIN (limit, MAX_LIST_PAGE_SIZE);
 
-  if (strcmp (app_id, "") == 0)
-    ids = permission_db_list_ids (db);
-  else
-    ids = permission_db_list_ids_by_app (db, app_id);
+  snapshot = get_db_snapshot ();
+  ids = list_ids_page (snapshot, app_id, start_after, limit, &more);
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{say}"));
   for (i = 0; ids[i]; i++)
     {
       g_autoptr(PermissionDbEntry) entry = NULL;
 
-      entry = permission_db_lookup (db, ids[i]);
+      entry = permission_db_lookup (snapshot, ids[i]);
 
       g_variant_builder_add (&builder, "{s@ay}", ids[i], get_path (entry));
     }
 
   g_dbus_method_invocation_return_value (invocation,
-                                         g_variant_new ("(@a{say})",
-                                                        g_variant_builder_end (&builder)));
+                                         g_variant_new ("(@a{say}s)",
+                                                        g_variant_builder_end (&builder),
+                                                        (more && i > 0) ? ids[i - 1] : ""));
 
   return TRUE;
 }
 
+/* Documents are checked this many at a time, with a pause in between
+ * so the vacuum never competes with real requests for long */
+#define VACUUM_BATCH_SIZE 256
+#define VACUUM_BATCH_DELAY_USEC (10 * 1000)
+
+static gint vacuum_running;
+
+/* Remote filesystems can fail lookups while the server is away, and
+ * automounts may not be mounted right now. Neither says anything about
+ * whether the file is gone. */
+static gboolean
+is_unreliable_fs (const char *path)
+{
+  struct statfs stfs;
+  int res;
+  int fd;
+
+  fd = open (path, O_PATH | O_CLOEXEC);
+  if (fd == -1)
+    return TRUE;
+
+  res = fstatfs (fd, &stfs);
+  close (fd);
+  if (res != 0)
+    return TRUE;
+
+  switch ((guint32) stfs.f_type)
+    {
+    case 0x6969:     /* nfs */
+    case 0x517b:     /* smb */
+    case 0xff534d42: /* cifs */
+    case 0xfe534d42: /* smb2 */
+    case 0x5346414f: /* afs */
+    case 0x00c36400: /* ceph */
+    case 0x01021997: /* 9p */
+    case 0x65735546: /* fuse, e.g. sshfs */
+    case 0x0187:     /* autofs */
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+/* A document is dead for good once its directory is gone from the
+ * filesystem it was on, or replaced by another inode there. If the path
+ * is on another device, the disk is probably just not mounted. */
+static gboolean
+document_entry_is_dead (PermissionDbEntry *entry)
+{
+  guint32 flags = document_entry_get_flags (entry);
+  g_autofree char *dir = NULL;
+  g_autofree char *parent = NULL;
+  struct stat st;
+
+  if (flags & DOCUMENT_ENTRY_FLAG_DIRECTORY)
+    dir = g_strdup (document_entry_get_path (entry));
+  else
+    dir = document_entry_dup_dirname (entry);
+
+  if (fstatat (AT_FDCWD, dir, &st, AT_NO_AUTOMOUNT) == 0)
+    return st.st_dev == document_entry_get_device (entry) &&
+           st.st_ino != document_entry_get_inode (entry) &&
+           !is_unreliable_fs (dir);
+
+  if (errno != ENOENT)
+    return FALSE;
+
+  parent = g_path_get_dirname (dir);
+  if (fstatat (AT_FDCWD, parent, &st, AT_NO_AUTOMOUNT) != 0)
+    return FALSE;
+
+  return st.st_dev == document_entry_get_device (entry) &&
+         !is_unreliable_fs (parent);
+}
+
+static void
+vacuum_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+  g_auto(GStrv) ids = permission_db_list_ids (snapshot);
+  g_autoptr(GPtrArray) dead_ids = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) dead_entries = g_ptr_array_new_with_free_func ((GDestroyNotify) permission_db_entry_unref);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new ();
+  guint i;
+
+  /* The checks do i/o, so they run against a snapshot without the lock */
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (snapshot, ids[i]);
+
+      if (entry != NULL && document_entry_is_dead (entry))
+        {
+          g_ptr_array_add (dead_ids, g_strdup (ids[i]));
+          g_ptr_array_add (dead_entries, g_steal_pointer (&entry));
+        }
+
+      if ((i + 1) % VACUUM_BATCH_SIZE == 0)
+        g_usleep (VACUUM_BATCH_DELAY_USEC);
+    }
+
+  if (dead_ids->len > 0)
+    {
+      XDP_AUTOLOCK (db);
+
+      for (i = 0; i < dead_ids->len; i++)
+        {
+          const char *id = g_ptr_array_index (dead_ids, i);
+          g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
+
+          /* Changed since the snapshot, leave it to the next run */
+          if (entry == NULL ||
+              !g_variant_equal ((GVariant *) entry, g_ptr_array_index (dead_entries, i)))
+            continue;
+
+          permission_db_set_entry (db, id, NULL);
+
+          /* The store batches these into a single writeout */
+          if (persist_entry (entry))
+            xdg_permission_store_call_delete (permission_store, TABLE_NAME,
+                                              id, NULL, NULL, NULL);
+
+          g_ptr_array_add (removed, (char *) id);
+        }
+
+      if (removed->len > 0)
+        update_db_locked ();
+    }
+
+  /* Invalidate with the lock dropped to avoid deadlock */
+  if (removed->len > 0)
+    {
+      g_debug ("vacuum dropped %u dead documents", removed->len);
+
+      g_ptr_array_add (removed, NULL);
+      xdp_fuse_invalidate_docs ((const char * const *) removed->pdata, NULL, TRUE);
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+vacuum_done (GObject      *source_object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+  g_atomic_int_set (&vacuum_running, FALSE);
+}
+
+static gboolean
+vacuum_timeout_cb (gpointer user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  if (!g_atomic_int_compare_and_exchange (&vacuum_running, FALSE, TRUE))
+    return G_SOURCE_CONTINUE;
+
+  task = g_task_new (NULL, NULL, vacuum_done, NULL);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, vacuum_thread);
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void
 peer_died_cb (const char *name)
 {
@@ -1376,7 +2818,7 @@ on_bus_acquired (GDBusConnection *connection,
 
   dbus_api = xdp_dbus_documents_skeleton_new ();
 
-  xdp_dbus_documents_set_version (XDP_DBUS_DOCUMENTS (dbus_api), 4);
+  xdp_dbus_documents_set_version (XDP_DBUS_DOCUMENTS (dbus_api), 6);
 
   g_signal_connect_swapped (dbus_api, "handle-get-mount-point", G_CALLBACK (handle_get_mount_point), NULL);
   g_signal_connect_swapped (dbus_api, "handle-add", G_CALLBACK (handle_method), portal_add);
@@ -1384,11 +2826,20 @@ on_bus_acquired (GDBusConnection *connection,
   g_signal_connect_swapped (dbus_api, "handle-add-full", G_CALLBACK (handle_method), portal_add_full);
   g_signal_connect_swapped (dbus_api, "handle-add-named-full", G_CALLBACK (handle_method), portal_add_named_full);
   g_signal_connect_swapped (dbus_api, "handle-grant-permissions", G_CALLBACK (handle_method), portal_grant_permissions);
+  g_signal_connect_swapped (dbus_api, "handle-grant-permissions-many", G_CALLBACK (handle_method), portal_grant_permissions_many);
   g_signal_connect_swapped (dbus_api, "handle-revoke-permissions", G_CALLBACK (handle_method), portal_revoke_permissions);
   g_signal_connect_swapped (dbus_api, "handle-delete", G_CALLBACK (handle_method), portal_delete);
   g_signal_connect_swapped (dbus_api, "handle-lookup", G_CALLBACK (handle_method), portal_lookup);
   g_signal_connect_swapped (dbus_api, "handle-info", G_CALLBACK (handle_method), portal_info);
   g_signal_connect_swapped (dbus_api, "handle-list", G_CALLBACK (handle_method), portal_list);
+  g_signal_connect_swapped (dbus_api, "handle-list-paged", G_CALLBACK (handle_method), portal_list_paged);
+
+  debug_api = xdp_dbus_documents_debug_skeleton_new ();
+
+  g_signal_connect_swapped (debug_api, "handle-get-fuse-stats", G_CALLBACK (handle_method), portal_get_fuse_stats);
+  g_signal_connect_swapped (debug_api, "handle-get-fuse-trace", G_CALLBACK (handle_method), portal_get_fuse_trace);
+  g_signal_connect_swapped (debug_api, "handle-set-log-domains", G_CALLBACK (handle_method), portal_set_log_domains);
+  g_signal_connect_swapped (debug_api, "handle-get-statistics", G_CALLBACK (handle_method), portal_get_statistics);
 
   file_transfer = file_transfer_create ();
   g_dbus_interface_skeleton_set_flags (file_transfer,
@@ -1417,19 +2868,148 @@ on_bus_acquired (GDBusConnection *connection,
     }
 
   g_debug ("Providing portal %s", g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (file_transfer))->name);
+
+  if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (debug_api),
+                                         connection,
+                                         "/org/freedesktop/portal/documents",
+                                         &error))
+    {
+      g_warning ("error: %s", error->message);
+      g_error_free (error);
+    }
+}
+
+static gboolean
+authorize_peer (GDBusAuthObserver *observer,
+                GIOStream         *stream,
+                GCredentials      *credentials,
+                gpointer           user_data)
+{
+  return credentials != NULL &&
+         g_credentials_get_unix_user (credentials, NULL) == getuid ();
 }
 
 static void
-on_name_acquired (GDBusConnection *connection,
-                  const gchar     *name,
-                  gpointer         user_data)
+peer_closed (GDBusConnection *connection,
+             gboolean         remote_peer_vanished,
+             GError          *error,
+             gpointer         user_data)
+{
+  g_debug ("Peer connection closed");
+  g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (dbus_api),
+                                                      connection);
+  g_object_unref (connection);
+}
+
+static gboolean
+new_peer_connection (GDBusServer     *server,
+                     GDBusConnection *connection,
+                     gpointer         user_data)
+{
+  GCredentials *credentials = g_dbus_connection_get_peer_credentials (connection);
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GError) error = NULL;
+  pid_t pid;
+
+  pid = credentials ? g_credentials_get_unix_pid (credentials, NULL) : -1;
+  if (pid > 0)
+    app_info = xdp_get_app_info_from_pid (pid, &error);
+
+  /* Sandboxed apps have to go through the bus like before */
+  if (app_info == NULL || !xdp_app_info_is_host (app_info))
+    {
+      g_debug ("Rejecting peer connection from pid %d", (int) pid);
+      return FALSE;
+    }
+
+  /* Set before any call can arrive, and read-only after that */
+  g_object_set_data_full (G_OBJECT (connection), "app-info",
+                          g_steal_pointer (&app_info), (GDestroyNotify) xdp_app_info_unref);
+
+  if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (dbus_api),
+                                         connection,
+                                         "/org/freedesktop/portal/documents",
+                                         &error))
+    {
+      g_warning ("Failed to export documents portal to peer: %s", error->message);
+      return FALSE;
+    }
+
+  g_debug ("New peer connection from pid %d", (int) pid);
+  g_signal_connect (connection, "closed", G_CALLBACK (peer_closed), NULL);
+  g_object_ref (connection);
+
+  return TRUE;
+}
+
+/* Lets xdg-desktop-portal reach us without the bus daemon in the
+ * middle, which matters most for the fd passing of file choosers */
+static void
+listen_peer (void)
+{
+  static GDBusServer *peer_server;
+  g_autoptr(GDBusAuthObserver) observer = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *address = NULL;
+  g_autofree char *guid = NULL;
+
+  path = g_build_filename (g_get_user_runtime_dir (), DOCUMENT_PORTAL_PEER_SOCKET, NULL);
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      g_warning ("Failed to create %s: %s", dir, g_strerror (errno));
+      return;
+    }
+
+  /* Left over from a previous instance, or one we are replacing */
+  unlink (path);
+
+  address = g_strdup_printf ("unix:path=%s", path);
+  guid = g_dbus_generate_guid ();
+  observer = g_dbus_auth_observer_new ();
+  g_signal_connect (observer, "authorize-authenticated-peer", G_CALLBACK (authorize_peer), NULL);
+
+  peer_server = g_dbus_server_new_sync (address, G_DBUS_SERVER_FLAGS_NONE,
+                                        guid, observer, NULL, &error);
+  if (peer_server == NULL)
+    {
+      g_warning ("No peer socket: %s", error->message);
+      return;
+    }
+
+  g_signal_connect (peer_server, "new-connection", G_CALLBACK (new_peer_connection), NULL);
+  g_dbus_server_start (peer_server);
+
+  g_debug ("Listening for peers on %s", path);
+}
+
+static void
+fuse_mount_in_thread (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  GError *error = NULL;
+
+  if (!xdp_fuse_init (&error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+fuse_mount_done (GObject      *source_object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
 {
   struct stat stbuf;
   gpointer invocation;
 
-  g_debug ("%s acquired", name);
+  fuse_mount_pending = FALSE;
 
-  if (!xdp_fuse_init (&exit_error))
+  if (!g_task_propagate_boolean (G_TASK (result), &exit_error))
     {
       final_exit_status = 6;
       g_printerr ("fuse init failed: %s", exit_error->message);
@@ -1448,11 +3028,73 @@ on_name_acquired (GDBusConnection *connection,
 
   fuse_dev = stbuf.st_dev;
 
+  g_debug ("fuse mounted on %s", xdp_fuse_get_mountpoint ());
+
+  if (opt_vacuum_interval > 0)
+    g_timeout_add_seconds_full (G_PRIORITY_LOW, opt_vacuum_interval,
+                                vacuum_timeout_cb, NULL, NULL);
+
   while ((invocation = g_queue_pop_head (&get_mount_point_invocations)) != NULL)
     {
       xdp_dbus_documents_complete_get_mount_point (dbus_api, invocation, xdp_fuse_get_mountpoint ());
       g_object_unref (invocation);
     }
+
+  while ((invocation = g_queue_pop_head (&pending_invocations)) != NULL)
+    {
+      handle_method (g_object_get_data (G_OBJECT (invocation), "portal-method"), invocation);
+      g_object_unref (invocation);
+    }
+}
+
+/* Mounting can take a while, e.g. when a stale mount from a previous
+ * instance has to go first, so it's done in a thread while the main
+ * loop keeps going. It only starts once we own the name, so that we
+ * never unmount the filesystem of an instance that is still running. */
+static void
+ensure_fuse_mount (void)
+{
+  g_autoptr(GTask) task = NULL;
+
+  if (!name_acquired || fuse_mount_started)
+    return;
+
+  fuse_mount_started = TRUE;
+  fuse_mount_pending = TRUE;
+
+  task = g_task_new (NULL, NULL, fuse_mount_done, NULL);
+  g_task_set_source_tag (task, ensure_fuse_mount);
+  g_task_run_in_thread (task, fuse_mount_in_thread);
+}
+
+static void
+on_name_acquired (GDBusConnection *connection,
+                  const gchar     *name,
+                  gpointer         user_data)
+{
+  g_debug ("%s acquired", name);
+
+  xdp_fuse_set_cache_timeouts (opt_physical_cache_timeout, opt_virtual_cache_timeout,
+                               opt_negative_cache_timeout);
+  xdp_fuse_set_writeback_cache (opt_writeback_cache);
+  xdp_fuse_set_thread_limits (opt_fuse_threads, opt_fuse_idle_threads);
+  xdp_fuse_set_io_limits (opt_fuse_max_read, opt_fuse_max_write, opt_fuse_max_readahead);
+  xdp_fuse_set_debug (xdp_log_debug_domain_enabled (XDP_FUSE_LOG_DOMAIN), opt_fuse_stats);
+  xdp_fuse_set_trace_size (MAX (opt_fuse_trace, 0));
+  file_transfer_set_max_per_sender (MAX (opt_max_transfers, 0));
+
+  name_acquired = TRUE;
+
+  /* Before answering GetMountPoint, so callers waiting on it find the
+   * socket there */
+  if (!opt_no_peer)
+    listen_peer ();
+
+  /* With --lazy-mount, sessions that never use documents never mount */
+  if (!opt_lazy_mount ||
+      !g_queue_is_empty (&get_mount_point_invocations) ||
+      !g_queue_is_empty (&pending_invocations))
+    ensure_fuse_mount ();
 }
 
 static void
@@ -1497,6 +3139,122 @@ exit_handler (int sig)
   g_main_loop_quit (loop);
 }
 
+/* The store is used over its private socket when it has one, so
+ * document changes don't go through the bus daemon. The bus proxy is
+ * kept as the fallback, and to notice when the store is restarted. */
+
+#define MAX_PEER_CONNECT_ATTEMPTS 3
+
+static guint peer_connect_attempts;
+
+static void connect_permission_store_peer (void);
+
+static void
+set_permission_store (XdgPermissionStore *store)
+{
+  XdgPermissionStore *old_store;
+
+  G_LOCK (db);
+  old_store = permission_store;
+  permission_store = g_object_ref (store);
+  G_UNLOCK (db);
+
+  g_clear_object (&old_store);
+}
+
+static void
+permission_store_peer_closed (GDBusConnection *connection,
+                              gboolean         remote_peer_vanished,
+                              GError          *error,
+                              gpointer         user_data)
+{
+  g_debug ("Permission store peer connection closed, using the bus");
+  set_permission_store (bus_permission_store);
+}
+
+static gboolean
+retry_connect_permission_store_peer (gpointer user_data)
+{
+  connect_permission_store_peer ();
+  return G_SOURCE_REMOVE;
+}
+
+static void
+permission_store_peer_connected (GObject      *source_object,
+                                 GAsyncResult *res,
+                                 gpointer      user_data)
+{
+  g_autoptr(GDBusConnection) connection = NULL;
+  g_autoptr(XdgPermissionStore) peer_store = NULL;
+  g_autoptr(GError) error = NULL;
+
+  connection = g_dbus_connection_new_for_address_finish (res, &error);
+  if (connection == NULL)
+    {
+      g_debug ("No permission store peer connection: %s", error->message);
+
+      /* The store may not be listening yet right after it started */
+      if (++peer_connect_attempts < MAX_PEER_CONNECT_ATTEMPTS)
+        g_timeout_add_seconds (1, retry_connect_permission_store_peer, NULL);
+      return;
+    }
+
+  peer_store = xdg_permission_store_proxy_new_sync (connection,
+                                                    G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                                    G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                                    NULL,
+                                                    "/org/freedesktop/impl/portal/PermissionStore",
+                                                    NULL, &error);
+  if (peer_store == NULL)
+    {
+      g_warning ("Failed to create permission store peer proxy: %s", error->message);
+      return;
+    }
+
+  g_debug ("Using the permission store peer connection");
+  g_signal_connect (connection, "closed", G_CALLBACK (permission_store_peer_closed), NULL);
+  set_permission_store (peer_store);
+}
+
+static void
+connect_permission_store_peer (void)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *address = NULL;
+
+  path = g_build_filename (g_get_user_runtime_dir (), XDG_PERMISSION_STORE_PEER_SOCKET, NULL);
+  address = g_strdup_printf ("unix:path=%s", path);
+
+  g_dbus_connection_new_for_address (address,
+                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                     NULL, NULL,
+                                     permission_store_peer_connected,
+                                     NULL);
+}
+
+static void
+permission_store_owner_changed (GObject    *object,
+                                GParamSpec *pspec,
+                                gpointer    user_data)
+{
+  g_autofree char *owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (object));
+  gboolean on_bus;
+
+  if (owner == NULL)
+    return;
+
+  G_LOCK (db);
+  on_bus = permission_store == bus_permission_store;
+  G_UNLOCK (db);
+
+  /* A restarted store has a new socket */
+  if (on_bus)
+    {
+      peer_connect_attempts = 0;
+      connect_permission_store_peer ();
+    }
+}
+
 static void
 session_bus_closed (GDBusConnection *connection,
                     gboolean         remote_peer_vanished,
@@ -1537,30 +3295,30 @@ set_one_signal_handler (int    sig,
   return 0;
 }
 
-static gboolean opt_verbose;
-static gboolean opt_replace;
-static gboolean opt_version;
-
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
+  { "preload-db", 0, 0, G_OPTION_ARG_NONE, &opt_preload_db, "Fault in the whole document db at startup", NULL },
+  { "file-cache-timeout", 0, 0, G_OPTION_ARG_DOUBLE, &opt_physical_cache_timeout, "Let the kernel cache file attributes for SECS seconds", "SECS" },
+  { "dir-cache-timeout", 0, 0, G_OPTION_ARG_DOUBLE, &opt_virtual_cache_timeout, "Let the kernel cache the virtual directories for SECS seconds", "SECS" },
+  { "negative-cache-timeout", 0, 0, G_OPTION_ARG_DOUBLE, &opt_negative_cache_timeout, "Let the kernel cache missing files in documents for SECS seconds, defaults to the file cache timeout", "SECS" },
+  { "writeback-cache", 0, 0, G_OPTION_ARG_NONE, &opt_writeback_cache, "Let the kernel buffer writes to documents", NULL },
+  { "fuse-threads", 0, 0, G_OPTION_ARG_INT, &opt_fuse_threads, "Use at most N threads for fuse requests (0 for no limit)", "N" },
+  { "fuse-idle-threads", 0, 0, G_OPTION_ARG_INT, &opt_fuse_idle_threads, "Keep at most N idle fuse threads", "N" },
+  { "fuse-max-read", 0, 0, G_OPTION_ARG_INT, &opt_fuse_max_read, "Limit fuse reads to BYTES bytes (0 for the kernel default)", "BYTES" },
+  { "fuse-max-write", 0, 0, G_OPTION_ARG_INT, &opt_fuse_max_write, "Limit fuse writes to BYTES bytes (0 for the kernel default)", "BYTES" },
+  { "fuse-max-readahead", 0, 0, G_OPTION_ARG_INT, &opt_fuse_max_readahead, "Limit kernel readahead on documents to BYTES bytes (0 for the kernel default)", "BYTES" },
+  { "fuse-stats", 0, 0, G_OPTION_ARG_NONE, &opt_fuse_stats, "Collect fuse request statistics", NULL },
+  { "fuse-trace", 0, 0, G_OPTION_ARG_INT, &opt_fuse_trace, "Record the last N fuse requests for GetFuseTrace (0 to disable)", "N" },
+  { "thread-sched", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_thread_sched, "Scheduling for the fuse workers, e.g. fuse=other:-5", "fuse=POLICY[:NICE]" },
+  { "max-transfers-per-client", 0, 0, G_OPTION_ARG_INT, &opt_max_transfers, "Allow each client at most N ongoing file transfers (0 for no limit)", "N" },
+  { "vacuum-interval", 0, 0, G_OPTION_ARG_INT, &opt_vacuum_interval, "Drop dead documents every SECS seconds (0 to disable)", "SECS" },
+  { "no-peer", 0, 0, G_OPTION_ARG_NONE, &opt_no_peer, "Don't serve peers on the private socket", NULL },
+  { "lazy-mount", 0, 0, G_OPTION_ARG_NONE, &opt_lazy_mount, "Mount the fuse filesystem on the first call instead of at startup", NULL },
   { NULL }
 };
 
-static void
-message_handler (const gchar   *log_domain,
-                 GLogLevelFlags log_level,
-                 const gchar   *message,
-                 gpointer       user_data)
-{
-  /* Make this look like normal console output */
-  if (log_level & G_LOG_LEVEL_DEBUG)
-    printf ("XDP: %s\n", message);
-  else
-    printf ("%s: %s\n", g_get_prgname (), message);
-}
-
 static void
 printerr_handler (const gchar *string)
 {
@@ -1572,12 +3330,16 @@ main (int    argc,
       char **argv)
 {
   guint owner_id;
+  int i;
 
   g_autoptr(GError) error = NULL;
   g_autofree char *path = NULL;
   GDBusConnection *session_bus;
   g_autoptr(GOptionContext) context = NULL;
   GDBusMethodInvocation *invocation;
+#if GLIB_CHECK_VERSION(2, 63, 3)
+  g_autoptr(GMemoryMonitor) memory_monitor = NULL;
+#endif
 
   setlocale (LC_ALL, "");
 
@@ -1594,6 +3356,23 @@ main (int    argc,
       return 1;
     }
 
+  for (i = 0; opt_thread_sched && opt_thread_sched[i]; i++)
+    {
+      /* The other kinds of threads only exist in xdg-desktop-portal */
+      if (!g_str_has_prefix (opt_thread_sched[i], "fuse="))
+        {
+          g_printerr ("%s: Invalid thread scheduling '%s', expected fuse=POLICY[:NICE]\n",
+                      g_get_application_name (), opt_thread_sched[i]);
+          return 1;
+        }
+
+      if (!xdp_set_thread_sched (opt_thread_sched[i], &error))
+        {
+          g_printerr ("%s: %s\n", g_get_application_name (), error->message);
+          return 1;
+        }
+    }
+
   if (opt_version)
     {
       g_print ("%s\n", PACKAGE_STRING);
@@ -1601,14 +3380,31 @@ main (int    argc,
     }
 
   if (opt_verbose)
-    g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
+    {
+      const char *domains[] = { G_LOG_DOMAIN, XDP_FUSE_LOG_DOMAIN, NULL };
+
+      xdp_log_set_debug_domains (domains, message_handler);
+    }
 
   g_set_prgname (argv[0]);
 
   loop = g_main_loop_new (NULL, FALSE);
 
+  xdp_add_cache_trim_func (trim_caches);
+  xdp_add_cache_trim_func (trim_file_access);
+  xdp_add_memory_usage_func (db_memory_usage);
+  xdp_dump_memory_usage_on_signal ();
+#if GLIB_CHECK_VERSION(2, 63, 3)
+  memory_monitor = g_memory_monitor_dup_default ();
+  g_signal_connect (memory_monitor, "low-memory-warning", G_CALLBACK (low_memory_warning_cb), NULL);
+#endif
+
   path = g_build_filename (g_get_user_data_dir (), "flatpak/db", TABLE_NAME, NULL);
-  db = permission_db_new (path, FALSE, &error);
+  db = g_initable_new (PERMISSION_TYPE_DB, NULL, &error,
+                       "path", path,
+                       "fail-if-not-found", FALSE,
+                       "populate", opt_preload_db,
+                       NULL);
   if (db == NULL)
     {
       g_printerr ("Failed to load db from '%s': %s", path, error->message);
@@ -1622,16 +3418,21 @@ main (int    argc,
       exit (3);
     }
 
-  permission_store = xdg_permission_store_proxy_new_sync (session_bus, G_DBUS_PROXY_FLAGS_NONE,
-                                                          "org.freedesktop.impl.portal.PermissionStore",
-                                                          "/org/freedesktop/impl/portal/PermissionStore",
-                                                          NULL, &error);
-  if (permission_store == NULL)
+  bus_permission_store = xdg_permission_store_proxy_new_sync (session_bus, G_DBUS_PROXY_FLAGS_NONE,
+                                                              "org.freedesktop.impl.portal.PermissionStore",
+                                                              "/org/freedesktop/impl/portal/PermissionStore",
+                                                              NULL, &error);
+  if (bus_permission_store == NULL)
     {
       g_print ("No permission store: %s", error->message);
       exit (4);
     }
 
+  permission_store = g_object_ref (bus_permission_store);
+  g_signal_connect (bus_permission_store, "notify::g-name-owner",
+                    G_CALLBACK (permission_store_owner_changed), NULL);
+  connect_permission_store_peer ();
+
   /* We want do do our custom post-mainloop exit */
   g_dbus_connection_set_exit_on_close (session_bus, FALSE);
 
@@ -1654,7 +3455,12 @@ main (int    argc,
 
   g_main_loop_run (loop);
 
-  while ((invocation = g_queue_pop_head (&get_mount_point_invocations)) != NULL)
+  /* Don't tear down fuse under a mount that is still being set up */
+  while (fuse_mount_pending)
+    g_main_context_iteration (NULL, TRUE);
+
+  while ((invocation = g_queue_pop_head (&get_mount_point_invocations)) != NULL ||
+         (invocation = g_queue_pop_head (&pending_invocations)) != NULL)
     {
       if (exit_error != NULL)
         g_dbus_method_invocation_return_gerror (invocation, exit_error);
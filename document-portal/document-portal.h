@@ -38,6 +38,22 @@ gboolean validate_fd (int           fd,
                       gboolean     *writable_out,
                       GError      **error);
 
+typedef struct _DocumentAddBatch DocumentAddBatch;
+
+DocumentAddBatch * document_add_prepare (int                      *fd,
+                                         int                      *parent_dev,
+                                         int                      *parent_ino,
+                                         int                       n_args,
+                                         DocumentAddFullFlags      flags,
+                                         XdpAppInfo               *app_info,
+                                         const char               *target_app_id,
+                                         DocumentPermissionFlags   target_perms,
+                                         GError                  **error);
+char ** document_add_commit (DocumentAddBatch *batch);
+void document_add_batch_free (DocumentAddBatch *batch);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DocumentAddBatch, document_add_batch_free)
+
 char ** document_add_full (int                      *fd,
                            int                      *parent_dev,
                            int                      *parent_ino,
@@ -47,3 +63,6 @@ char ** document_add_full (int                      *fd,
                            const char               *target_app_id,
                            DocumentPermissionFlags   target_perms,
                            GError                  **error);
+
+gboolean document_portal_defer_until_mounted (GCallback              method_callback,
+                                              GDBusMethodInvocation *invocation);
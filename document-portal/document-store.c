@@ -5,21 +5,155 @@
 #include "document-store.h"
 #include "src/xdp-utils.h"
 
+/* Decoding entries allocates a fair bit, and the fuse side asks for
+ * the same few fields of the same entries all the time, so we keep the
+ * decoded form around, keyed on the serialized entry. */
+#define ENTRY_CACHE_SIZE 1024
+
+typedef struct
+{
+  gconstpointer data;
+  gsize         size;
+} EntryKey;
+
+typedef struct
+{
+  char                   *app_id;
+  DocumentPermissionFlags permissions;
+} EntryAppPermissions;
+
+typedef struct
+{
+  EntryKey             key;
+  GBytes              *serialized;
+  guint64              device;
+  guint64              inode;
+  guint32              flags;
+  guint                n_apps;
+  EntryAppPermissions *apps;
+} EntryInfo;
+
+/* Indexed by the bit number of the DocumentPermissionFlags */
+static const char * const permission_names[] = {
+  "read",
+  "write",
+  "grant-permissions",
+  "delete",
+  NULL
+};
+
+G_STATIC_ASSERT (DOCUMENT_PERMISSION_FLAGS_ALL == (1 << (G_N_ELEMENTS (permission_names) - 1)) - 1);
+
+G_LOCK_DEFINE_STATIC (entry_cache);
+static GHashTable *entry_cache = NULL;
+
+static guint
+entry_key_hash (gconstpointer p)
+{
+  const EntryKey *key = p;
+  const guchar *data = key->data;
+  guint32 h = 5381;
+  gsize i;
+
+  for (i = 0; i < key->size; i++)
+    h = (h << 5) + h + data[i];
+
+  return h;
+}
+
+static gboolean
+entry_key_equal (gconstpointer a,
+                 gconstpointer b)
+{
+  const EntryKey *key_a = a;
+  const EntryKey *key_b = b;
+
+  return key_a->size == key_b->size &&
+         memcmp (key_a->data, key_b->data, key_a->size) == 0;
+}
+
+static void
+entry_info_free (EntryInfo *info)
+{
+  guint i;
+
+  for (i = 0; i < info->n_apps; i++)
+    g_free (info->apps[i].app_id);
+  g_free (info->apps);
+  g_bytes_unref (info->serialized);
+  g_free (info);
+}
+
+static EntryInfo *
+entry_info_new (PermissionDbEntry *entry)
+{
+  g_autoptr(GVariant) data = permission_db_entry_get_data (entry);
+  g_autofree const char **apps = NULL;
+  EntryInfo *info;
+  guint i;
+
+  info = g_new0 (EntryInfo, 1);
+  info->serialized = g_variant_get_data_as_bytes ((GVariant *) entry);
+  info->key.data = g_bytes_get_data (info->serialized, &info->key.size);
+
+  if (g_variant_is_of_type (data, G_VARIANT_TYPE ("(ayttu)")))
+    g_variant_get (data, "(@ayttu)", NULL, &info->device, &info->inode, &info->flags);
+
+  apps = permission_db_entry_list_apps (entry);
+  info->n_apps = g_strv_length ((char **) apps);
+  info->apps = g_new0 (EntryAppPermissions, info->n_apps);
+  for (i = 0; i < info->n_apps; i++)
+    {
+      info->apps[i].app_id = g_strdup (apps[i]);
+      info->apps[i].permissions =
+        permission_db_entry_get_permission_flags (entry, apps[i], permission_names);
+    }
+
+  return info;
+}
+
+/* Must be called with the entry_cache lock held, the result is only
+ * valid until it is released */
+static EntryInfo *
+lookup_entry_info_locked (PermissionDbEntry *entry)
+{
+  GVariant *v = (GVariant *) entry;
+  EntryKey key;
+  EntryInfo *info;
+
+  if (entry_cache == NULL)
+    entry_cache = g_hash_table_new_full (entry_key_hash, entry_key_equal,
+                                         NULL, (GDestroyNotify) entry_info_free);
+
+  key.data = g_variant_get_data (v);
+  key.size = g_variant_get_size (v);
+
+  info = g_hash_table_lookup (entry_cache, &key);
+  if (info != NULL)
+    return info;
+
+  if (g_hash_table_size (entry_cache) >= ENTRY_CACHE_SIZE)
+    g_hash_table_remove_all (entry_cache);
+
+  info = entry_info_new (entry);
+  g_hash_table_insert (entry_cache, &info->key, info);
+
+  return info;
+}
+
 const char **
 xdg_unparse_permissions (DocumentPermissionFlags permissions)
 {
   GPtrArray *array;
+  int i;
 
   array = g_ptr_array_new ();
 
-  if (permissions & DOCUMENT_PERMISSION_FLAGS_READ)
-    g_ptr_array_add (array, "read");
-  if (permissions & DOCUMENT_PERMISSION_FLAGS_WRITE)
-    g_ptr_array_add (array, "write");
-  if (permissions & DOCUMENT_PERMISSION_FLAGS_GRANT_PERMISSIONS)
-    g_ptr_array_add (array, "grant-permissions");
-  if (permissions & DOCUMENT_PERMISSION_FLAGS_DELETE)
-    g_ptr_array_add (array, "delete");
+  for (i = 0; permission_names[i] != NULL; i++)
+    {
+      if (permissions & (1 << i))
+        g_ptr_array_add (array, (char *) permission_names[i]);
+    }
 
   g_ptr_array_add (array, NULL);
   return (const char **) g_ptr_array_free (array, FALSE);
@@ -59,13 +193,26 @@ DocumentPermissionFlags
 document_entry_get_permissions (PermissionDbEntry *entry,
                                 const char     *app_id)
 {
-  g_autofree const char **permissions = NULL;
+  DocumentPermissionFlags perms = 0;
+  EntryInfo *info;
+  guint i;
 
   if (strcmp (app_id, "") == 0)
     return DOCUMENT_PERMISSION_FLAGS_ALL;
 
-  permissions = permission_db_entry_list_permissions (entry, app_id);
-  return xdp_parse_permissions (permissions, NULL);
+  G_LOCK (entry_cache);
+  info = lookup_entry_info_locked (entry);
+  for (i = 0; i < info->n_apps; i++)
+    {
+      if (strcmp (info->apps[i].app_id, app_id) == 0)
+        {
+          perms = info->apps[i].permissions;
+          break;
+        }
+    }
+  G_UNLOCK (entry_cache);
+
+  return perms;
 }
 
 gboolean
@@ -113,23 +260,35 @@ document_entry_dup_dirname (PermissionDbEntry *entry)
 guint64
 document_entry_get_device (PermissionDbEntry *entry)
 {
-  g_autoptr(GVariant) v = permission_db_entry_get_data (entry);
-  g_autoptr(GVariant) c = g_variant_get_child_value (v, 1);
-  return g_variant_get_uint64 (c);
+  guint64 device;
+
+  G_LOCK (entry_cache);
+  device = lookup_entry_info_locked (entry)->device;
+  G_UNLOCK (entry_cache);
+
+  return device;
 }
 
 guint64
 document_entry_get_inode (PermissionDbEntry *entry)
 {
-  g_autoptr(GVariant) v = permission_db_entry_get_data (entry);
-  g_autoptr(GVariant) c = g_variant_get_child_value (v, 2);
-  return g_variant_get_uint64 (c);
+  guint64 inode;
+
+  G_LOCK (entry_cache);
+  inode = lookup_entry_info_locked (entry)->inode;
+  G_UNLOCK (entry_cache);
+
+  return inode;
 }
 
 guint32
 document_entry_get_flags (PermissionDbEntry *entry)
 {
-  g_autoptr(GVariant) v = permission_db_entry_get_data (entry);
-  g_autoptr(GVariant) c = g_variant_get_child_value (v, 3);
-  return g_variant_get_uint32 (c);
+  guint32 flags;
+
+  G_LOCK (entry_cache);
+  flags = lookup_entry_info_locked (entry)->flags;
+  G_UNLOCK (entry_cache);
+
+  return flags;
 }
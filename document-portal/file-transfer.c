@@ -27,6 +27,7 @@
 #include <errno.h>
 
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -43,11 +44,23 @@
 
 static XdpDbusFileTransfer *file_transfer;
 
+/* The fds validated by AddFiles are kept for RetrieveFiles, as long as
+ * all transfers together keep no more than an eighth of RLIMIT_NOFILE,
+ * the rest is for open files and the fuse caches */
+#define KEPT_FDS_RLIMIT_SHARE 8
+
+/* Files of a transfer are turned into documents this many at a time,
+ * so the db isn't locked for the whole of a big transfer */
+#define DOCUMENT_CHUNK_SIZE 256
+
+static int n_kept_fds;
+
 typedef struct
 {
   char *path;
   int parent_dev;
   int parent_ino;
+  int fd;
 } ExportedFile;
 
 static void
@@ -55,6 +68,11 @@ exported_file_free (gpointer data)
 {
   ExportedFile *file = data;
 
+  if (file->fd != -1)
+    {
+      close (file->fd);
+      g_atomic_int_add (&n_kept_fds, -1);
+    }
   g_free (file->path);
   g_free (file);
 }
@@ -134,6 +152,117 @@ auto_lock_helper (FileTransfer *transfer)
 
 G_LOCK_DEFINE (transfers);
 static GHashTable *transfers;
+/* sender -> set of the transfers started by it, not owning a ref */
+static GHashTable *transfers_by_sender;
+
+static guint transfer_serial;
+
+/* 0 means unlimited */
+static guint max_transfers_per_sender;
+
+void
+file_transfer_set_max_per_sender (guint max_transfers)
+{
+  max_transfers_per_sender = max_transfers;
+}
+
+/* Returns the number of ongoing transfers of each sender */
+GVariant *
+file_transfer_get_usage (void)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{su}"));
+
+  G_LOCK (transfers);
+  g_hash_table_iter_init (&iter, transfers_by_sender);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{su}", (const char *) key, g_hash_table_size (value));
+  G_UNLOCK (transfers);
+
+  return g_variant_builder_end (&builder);
+}
+
+static void
+file_transfer_memory_usage (GArray *usage)
+{
+  g_autoptr(GPtrArray) all = g_ptr_array_new_with_free_func (g_object_unref);
+  GHashTableIter iter;
+  gpointer value;
+  guint64 n_files = 0;
+  guint64 bytes = 0;
+  guint i, j;
+
+  G_LOCK (transfers);
+  g_hash_table_iter_init (&iter, transfers);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (all, g_object_ref (value));
+  G_UNLOCK (transfers);
+
+  /* The transfer mutex is taken before the transfers lock elsewhere,
+   * so the transfers are looked at outside of it */
+  for (i = 0; i < all->len; i++)
+    {
+      FileTransfer *transfer = g_ptr_array_index (all, i);
+
+      g_mutex_lock (&transfer->mutex);
+      bytes += sizeof (FileTransfer) + strlen (transfer->key) + 1 + strlen (transfer->sender) + 1;
+      bytes += transfer->files->len * sizeof (gpointer);
+      for (j = 0; j < transfer->files->len; j++)
+        {
+          ExportedFile *file = g_ptr_array_index (transfer->files, j);
+
+          n_files++;
+          bytes += sizeof (ExportedFile) + strlen (file->path) + 1;
+        }
+      g_mutex_unlock (&transfer->mutex);
+    }
+
+  xdp_memory_usage_add (usage, "transfers", all->len, bytes);
+  xdp_memory_usage_add (usage, "transfer-files", n_files, 0);
+}
+
+/* Called with the transfers lock held, transfers owns the ref */
+static void
+add_transfer_locked (FileTransfer *transfer)
+{
+  GHashTable *sender_transfers;
+
+  g_hash_table_insert (transfers, transfer->key, transfer);
+
+  sender_transfers = g_hash_table_lookup (transfers_by_sender, transfer->sender);
+  if (sender_transfers == NULL)
+    {
+      sender_transfers = g_hash_table_new (NULL, NULL);
+      g_hash_table_insert (transfers_by_sender, g_strdup (transfer->sender), sender_transfers);
+    }
+  g_hash_table_add (sender_transfers, transfer);
+}
+
+/* Called with the transfers lock held, returns the ref transfers owned,
+ * or FALSE if the transfer was already removed */
+static gboolean
+steal_transfer_locked (FileTransfer *transfer)
+{
+  GHashTable *sender_transfers;
+
+  if (g_hash_table_lookup (transfers, transfer->key) != transfer)
+    return FALSE;
+
+  g_hash_table_steal (transfers, transfer->key);
+
+  sender_transfers = g_hash_table_lookup (transfers_by_sender, transfer->sender);
+  if (sender_transfers)
+    {
+      g_hash_table_remove (sender_transfers, transfer);
+      if (g_hash_table_size (sender_transfers) == 0)
+        g_hash_table_remove (transfers_by_sender, transfer->sender);
+    }
+
+  return TRUE;
+}
 
 static FileTransfer *
 lookup_transfer (const char *key)
@@ -153,10 +282,31 @@ static FileTransfer *
 file_transfer_start (XdpAppInfo *app_info,
                      const char *sender,
                      gboolean    writable,
-                     gboolean    autostop)
+                     gboolean    autostop,
+                     GError    **error)
 {
   FileTransfer *transfer;
 
+  if (max_transfers_per_sender > 0)
+    {
+      GHashTable *sender_transfers;
+      guint n_transfers = 0;
+
+      G_LOCK (transfers);
+      sender_transfers = g_hash_table_lookup (transfers_by_sender, sender);
+      if (sender_transfers)
+        n_transfers = g_hash_table_size (sender_transfers);
+      G_UNLOCK (transfers);
+
+      if (n_transfers >= max_transfers_per_sender)
+        {
+          g_warning ("%s has %u ongoing file transfers, refusing more", sender, n_transfers);
+          g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                       "Too many ongoing file transfers");
+          return NULL;
+        }
+    }
+
   transfer = g_object_new (file_transfer_get_type (), NULL);
 
   transfer->app_info = xdp_app_info_ref (app_info);
@@ -165,16 +315,13 @@ file_transfer_start (XdpAppInfo *app_info,
   transfer->autostop = autostop;
   transfer->files = g_ptr_array_new_with_free_func (exported_file_free);
 
+  /* The serial makes the key unique, the random part unguessable */
+  transfer->key = g_strdup_printf ("%u-%u%u",
+                                   (guint) g_atomic_int_add (&transfer_serial, 1),
+                                   g_random_int (), g_random_int ());
+
   G_LOCK (transfers);
-  do {
-    guint64 key;
-    g_free (transfer->key);
-    key = g_random_int ();
-    key = (key << 32) | g_random_int ();
-    transfer->key = g_strdup_printf ("%lu", key);
-  }
-  while (g_hash_table_contains (transfers, transfer->key));
-  g_hash_table_insert (transfers, transfer->key, g_object_ref (transfer));
+  add_transfer_locked (g_object_ref (transfer));
   G_UNLOCK (transfers);
 
   g_debug ("start file transfer owned by '%s' (%s)",
@@ -198,6 +345,14 @@ static void
 file_transfer_stop (FileTransfer *transfer)
 {
   GDBusConnection *bus;
+  gboolean stolen;
+
+  G_LOCK (transfers);
+  stolen = steal_transfer_locked (transfer);
+  G_UNLOCK (transfers);
+
+  if (!stolen)
+    return;
 
   g_debug ("stop file transfer owned by '%s' (%s)",
            xdp_app_info_get_id (transfer->app_info),
@@ -212,17 +367,29 @@ file_transfer_stop (FileTransfer *transfer)
                                  g_variant_new ("(s)", transfer->key),
                                  NULL);
 
-  G_LOCK (transfers);
-  g_hash_table_steal (transfers, transfer->key);
-  G_UNLOCK (transfers);
-
   g_idle_add (stop, transfer);
 }
 
+/* The fuse mount raises the limit, so this isn't looked up just once */
+static int
+max_kept_fds (void)
+{
+  struct rlimit rl;
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) != 0)
+    return 0;
+
+  if (rl.rlim_cur == RLIM_INFINITY)
+    return G_MAXINT;
+
+  return MIN (rl.rlim_cur / KEPT_FDS_RLIMIT_SHARE, G_MAXINT);
+}
+
 static void
 file_transfer_add_file (FileTransfer *transfer,
                         const char *path,
-                        struct stat *parent_st_buf)
+                        struct stat *parent_st_buf,
+                        int fd)
 {
   ExportedFile *file;
 
@@ -230,6 +397,18 @@ file_transfer_add_file (FileTransfer *transfer,
   file->path = g_strdup (path);
   file->parent_dev = parent_st_buf->st_dev;
   file->parent_ino = parent_st_buf->st_ino;
+  file->fd = -1;
+
+  /* Reopen as O_PATH, so the documents are created from the same kind
+   * of fd as when opening the path in file_transfer_execute() */
+  if (g_atomic_int_add (&n_kept_fds, 1) < max_kept_fds ())
+    {
+      g_autofree char *proc_path = g_strdup_printf ("/proc/self/fd/%d", fd);
+
+      file->fd = open (proc_path, O_PATH | O_CLOEXEC);
+    }
+  if (file->fd == -1)
+    g_atomic_int_add (&n_kept_fds, -1);
 
   g_ptr_array_add (transfer->files, file);
 }
@@ -244,10 +423,12 @@ file_transfer_execute (FileTransfer *transfer,
   const char *target_app_id;
   int n_fds;
   g_autofree int *fds = NULL;
+  g_autofree gboolean *opened = NULL;
   g_autofree int *parent_devs = NULL;
   g_autofree int *parent_inos = NULL;
   int i;
-  g_auto(GStrv) ids = NULL;
+  g_autoptr(GPtrArray) batches = NULL;
+  g_autoptr(GPtrArray) ids = NULL;
   char **files = NULL;
 
   g_debug ("retrieve %d files for %s from file transfer owned by '%s' (%s)",
@@ -279,29 +460,68 @@ file_transfer_execute (FileTransfer *transfer,
 
   n_fds = transfer->files->len;
   fds = g_new (int, n_fds);
+  opened = g_new0 (gboolean, n_fds);
   parent_devs = g_new (int, n_fds);
   parent_inos = g_new (int, n_fds);
   for (i = 0; i < n_fds; i++)
     {
       ExportedFile *file = (ExportedFile*)g_ptr_array_index (transfer->files, i);
 
-      fds[i] = open (file->path, O_PATH | O_CLOEXEC);
+      fds[i] = file->fd;
       if (fds[i] == -1)
         {
-          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "File transfer %s failed", transfer->key);
-          for (; i > 0; i--)
-            close (fds[i - 1]);
-          return NULL;
+          fds[i] = open (file->path, O_PATH | O_CLOEXEC);
+          if (fds[i] == -1)
+            {
+              g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "File transfer %s failed", transfer->key);
+              for (; i > 0; i--)
+                if (opened[i - 1])
+                  close (fds[i - 1]);
+              return NULL;
+            }
+          opened[i] = TRUE;
         }
 
       parent_devs[i] = file->parent_dev;
       parent_inos[i] = file->parent_ino;
     }
 
-  ids = document_add_full (fds, parent_devs, parent_inos, n_fds, flags, transfer->app_info, target_app_id, perms, error);
+  /* Every chunk is validated before the first one creates documents,
+   * so a bad file doesn't leave the earlier chunks behind */
+  batches = g_ptr_array_new_with_free_func ((GDestroyNotify) document_add_batch_free);
+  for (i = 0; i < n_fds; i += DOCUMENT_CHUNK_SIZE)
+    {
+      int n = MIN (n_fds - i, DOCUMENT_CHUNK_SIZE);
+      DocumentAddBatch *batch;
+
+      batch = document_add_prepare (fds + i, parent_devs + i, parent_inos + i, n,
+                                    flags, transfer->app_info, target_app_id, perms, error);
+      if (batch == NULL)
+        {
+          g_clear_pointer (&batches, g_ptr_array_unref);
+          break;
+        }
+
+      g_ptr_array_add (batches, batch);
+    }
+
+  if (batches)
+    {
+      ids = g_ptr_array_new_with_free_func (g_free);
+      for (i = 0; i < batches->len; i++)
+        {
+          g_auto(GStrv) chunk_ids = NULL;
+          int j;
+
+          chunk_ids = document_add_commit (g_ptr_array_index (batches, i));
+          for (j = 0; chunk_ids[j] != NULL; j++)
+            g_ptr_array_add (ids, g_steal_pointer (&chunk_ids[j]));
+        }
+    }
 
   for (i = 0; i < n_fds; i++)
-    close (fds[i]);
+    if (opened[i])
+      close (fds[i]);
 
   if (ids)
     {
@@ -311,12 +531,14 @@ file_transfer_execute (FileTransfer *transfer,
         {
           ExportedFile *file = (ExportedFile *) g_ptr_array_index (transfer->files, i);
 
-          if (ids[i][0] == '\0')
+          const char *id = g_ptr_array_index (ids, i);
+
+          if (id[0] == '\0')
             files[i] = g_strdup (file->path);
           else
             {
               g_autofree char *name = g_path_get_basename (file->path);
-              files[i] = g_build_filename (mountpoint, ids[i], name, NULL);
+              files[i] = g_build_filename (mountpoint, id, name, NULL);
             }
         }
       files[n_fds] = NULL;
@@ -332,6 +554,7 @@ start_transfer (GDBusMethodInvocation *invocation,
 {
   g_autoptr(GVariant) options = NULL;
   g_autoptr(FileTransfer) transfer = NULL;
+  g_autoptr(GError) error = NULL;
   gboolean writable;
   gboolean autostop;
   const char *sender;
@@ -345,7 +568,12 @@ start_transfer (GDBusMethodInvocation *invocation,
 
   sender = g_dbus_method_invocation_get_sender (invocation);
 
-  transfer = file_transfer_start (app_info, sender, writable, autostop);
+  transfer = file_transfer_start (app_info, sender, writable, autostop, &error);
+  if (transfer == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
 
   g_dbus_method_invocation_return_value (invocation, g_variant_new ("(s)", transfer->key));
 }
@@ -427,7 +655,7 @@ add_files (GDBusMethodInvocation *invocation,
           return;
         }
 
-      file_transfer_add_file (transfer, path, &parent_st_buf);
+      file_transfer_add_file (transfer, path, &parent_st_buf, fd);
     }
 
   g_dbus_method_invocation_return_value (invocation, NULL);
@@ -516,6 +744,18 @@ handle_method (GCallback              method_callback,
   return TRUE;
 }
 
+static gboolean
+handle_retrieve_files (GCallback              method_callback,
+                       GDBusMethodInvocation *invocation)
+{
+  /* The files are returned as paths in the fuse mount, which with
+   * --lazy-mount may not be there yet */
+  if (document_portal_defer_until_mounted (method_callback, invocation))
+    return TRUE;
+
+  return handle_method (method_callback, invocation);
+}
+
 GDBusInterfaceSkeleton *
 file_transfer_create (void)
 {
@@ -523,12 +763,15 @@ file_transfer_create (void)
 
   g_signal_connect_swapped (file_transfer, "handle-start-transfer", G_CALLBACK (handle_method), start_transfer);
   g_signal_connect_swapped (file_transfer, "handle-add-files", G_CALLBACK (handle_method), add_files);
-  g_signal_connect_swapped (file_transfer, "handle-retrieve-files", G_CALLBACK (handle_method), retrieve_files);
+  g_signal_connect_swapped (file_transfer, "handle-retrieve-files", G_CALLBACK (handle_retrieve_files), retrieve_files);
   g_signal_connect_swapped (file_transfer, "handle-stop-transfer", G_CALLBACK (handle_method), stop_transfer);
 
   xdp_dbus_file_transfer_set_version (XDP_DBUS_FILE_TRANSFER (file_transfer), 1);
 
   transfers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+  transfers_by_sender = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, (GDestroyNotify) g_hash_table_unref);
+  xdp_add_memory_usage_func (file_transfer_memory_usage);
 
   return G_DBUS_INTERFACE_SKELETON (file_transfer);
 }
@@ -540,23 +783,30 @@ stop_file_transfers_in_thread_func (GTask        *task,
                                     GCancellable *cancellable)
 {
   const char *sender = (const char *)task_data;
+  g_autoptr(GPtrArray) stopped = NULL;
+  GHashTable *sender_transfers;
   GHashTableIter iter;
   FileTransfer *transfer;
 
+  stopped = g_ptr_array_new_with_free_func (g_object_unref);
+
   G_LOCK (transfers);
-  if (transfers)
+  sender_transfers = transfers_by_sender ? g_hash_table_lookup (transfers_by_sender, sender) : NULL;
+  if (sender_transfers)
     {
-      g_hash_table_iter_init (&iter, transfers);
-      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&transfer))
+      g_hash_table_iter_init (&iter, sender_transfers);
+      while (g_hash_table_iter_next (&iter, (gpointer *)&transfer, NULL))
         {
-          if (strcmp (sender, transfer->sender) == 0)
-            {
-              g_print ("removing transfer %s for dead peer %s\n", transfer->key, transfer->sender);
-              g_hash_table_iter_remove (&iter);
-            }
+          g_print ("removing transfer %s for dead peer %s\n", transfer->key, transfer->sender);
+          g_hash_table_steal (transfers, transfer->key);
+          g_ptr_array_add (stopped, transfer);
         }
+      g_hash_table_remove (transfers_by_sender, sender);
     }
   G_UNLOCK (transfers);
+
+  /* The last refs, and with them the kept fds, are dropped here,
+   * outside the lock */
 }
 
 void
@@ -25,3 +25,6 @@
 GDBusInterfaceSkeleton *file_transfer_create (void);
 
 void stop_file_transfers_for_sender (const char *name);
+
+void file_transfer_set_max_per_sender (guint max_transfers);
+GVariant *file_transfer_get_usage (void);
@@ -71,8 +71,9 @@ gvdb_hash_table_new (GHashTable  *parent,
 {
   GHashTable *table;
 
+  /* The keys are owned by the items */
   table = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                 g_free, gvdb_item_free);
+                                 NULL, gvdb_item_free);
 
   if (parent)
     {
@@ -85,17 +86,6 @@ gvdb_hash_table_new (GHashTable  *parent,
   return table;
 }
 
-static guint32
-djb_hash (const gchar *key)
-{
-  guint32 hash_value = 5381;
-
-  while (*key)
-    hash_value = hash_value * 33 + *(signed char *)key++;
-
-  return hash_value;
-}
-
 GvdbItem *
 gvdb_hash_table_insert (GHashTable  *table,
                         const gchar *key)
@@ -104,9 +94,9 @@ gvdb_hash_table_insert (GHashTable  *table,
 
   item = g_slice_new0 (GvdbItem);
   item->key = g_strdup (key);
-  item->hash_value = djb_hash (key);
+  item->hash_value = gvdb_hash (key, strlen (key));
 
-  g_hash_table_insert (table, g_strdup (key), item);
+  g_hash_table_replace (table, item->key, item);
 
   return item;
 }
@@ -190,12 +180,11 @@ hash_table_insert (gpointer key,
                    gpointer value,
                    gpointer data)
 {
-  guint32 hash_value, bucket;
   HashTable *table = data;
   GvdbItem *item = value;
+  guint32 bucket;
 
-  hash_value = djb_hash (key);
-  bucket = hash_value % table->n_buckets;
+  bucket = item->hash_value % table->n_buckets;
   item->next = table->buckets[bucket];
   table->buckets[bucket] = item;
 }
@@ -209,19 +198,93 @@ item_to_index (GvdbItem *item)
   return guint32_to_le (-1u);
 }
 
+typedef struct _FileChunk FileChunk;
+
+struct _FileChunk
+{
+  gsize offset;
+  gsize size;
+  gconstpointer data;
+  FileChunk *next;
+};
+
+/* Everything the builder allocates comes from a few big blocks, which
+ * never move (the hash code writes through pointers into earlier
+ * chunks), and are freed together at the end. */
+#define ARENA_MIN_BLOCK_SIZE (64 * 1024)
+
+typedef struct
+{
+  GSList *blocks;
+  guchar *pos;
+  gsize left;
+  gsize block_size;
+} Arena;
+
 typedef struct
 {
-  GQueue *chunks;
+  FileChunk *chunks;
+  FileChunk *last_chunk;
+  Arena arena;
   guint64 offset;
   gboolean byteswap;
 } FileBuilder;
 
-typedef struct
+static gpointer
+arena_alloc (Arena *arena,
+             gsize  size)
 {
-  gsize offset;
-  gsize size;
-  gpointer data;
-} FileChunk;
+  gpointer mem;
+
+  /* Keep everything 8-aligned, for the values and the chunks */
+  size = (size + 7) & ~(gsize) 7;
+
+  if (size > arena->left)
+    {
+      gsize block_size = MAX (arena->block_size, size);
+
+      arena->pos = g_malloc (block_size);
+      arena->left = block_size;
+      arena->blocks = g_slist_prepend (arena->blocks, arena->pos);
+    }
+
+  mem = arena->pos;
+  arena->pos += size;
+  arena->left -= size;
+
+  return mem;
+}
+
+static void
+arena_clear (Arena *arena)
+{
+  g_slist_free_full (arena->blocks, g_free);
+  arena->blocks = NULL;
+  arena->pos = NULL;
+  arena->left = 0;
+}
+
+static void
+file_builder_add_chunk (FileBuilder   *fb,
+                        gconstpointer  data,
+                        gsize          size)
+{
+  FileChunk *chunk;
+
+  chunk = arena_alloc (&fb->arena, sizeof (FileChunk));
+  chunk->offset = fb->offset;
+  chunk->size = size;
+  chunk->data = data;
+  chunk->next = NULL;
+
+  if (fb->last_chunk)
+    fb->last_chunk->next = chunk;
+  else
+    fb->chunks = chunk;
+  fb->last_chunk = chunk;
+
+  fb->offset += size;
+}
 
 static gpointer
 file_builder_allocate (FileBuilder         *fb,
@@ -229,24 +292,19 @@ file_builder_allocate (FileBuilder         *fb,
                        gsize                size,
                        struct gvdb_pointer *pointer)
 {
-  FileChunk *chunk;
+  gpointer data;
 
   if (size == 0)
     return NULL;
 
   fb->offset += (-fb->offset) & (alignment - 1);
-  chunk = g_slice_new (FileChunk);
-  chunk->offset = fb->offset;
-  chunk->size = size;
-  chunk->data = g_malloc (size);
+  data = arena_alloc (&fb->arena, size);
 
   pointer->start = guint32_to_le (fb->offset);
-  fb->offset += size;
+  file_builder_add_chunk (fb, data, size);
   pointer->end = guint32_to_le (fb->offset);
 
-  g_queue_push_tail (fb->chunks, chunk);
-
-  return chunk->data;
+  return data;
 }
 
 static void
@@ -276,29 +334,22 @@ file_builder_add_value (FileBuilder         *fb,
   g_variant_unref (normal);
 }
 
+/* The string is not copied, it must stay around until the builder is
+ * serialised. The keys of the items do. */
 static void
 file_builder_add_string (FileBuilder *fb,
                          const gchar *string,
                          guint32_le  *start,
                          guint16_le  *size)
 {
-  FileChunk *chunk;
   gsize length;
 
   length = strlen (string);
 
-  chunk = g_slice_new (FileChunk);
-  chunk->offset = fb->offset;
-  chunk->size = length;
-  chunk->data = g_malloc (length);
-  if (length != 0)
-    memcpy (chunk->data, string, length);
-
   *start = guint32_to_le (fb->offset);
   *size = guint16_to_le (length);
-  fb->offset += length;
 
-  g_queue_push_tail (fb->chunks, chunk);
+  file_builder_add_chunk (fb, string, length);
 }
 
 static void
@@ -339,13 +390,32 @@ file_builder_allocate_for_hash (FileBuilder            *fb,
 #undef chunk
 
   memset (*bloom_filter, 0, n_bloom_words * sizeof (guint32_le));
+}
 
-  /* NOTE - the code to actually fill in the bloom filter here is missing.
-   * Patches welcome! 
-   *
-   * http://en.wikipedia.org/wiki/Bloom_filter
-   * http://0pointer.de/blog/projects/bloom.html
-   */
+/* Roughly 8 bits per item, which with the reader's two bits per key
+ * rejects about 95% of missing keys without touching the hash buckets */
+static gsize
+bloom_words_for_items (gsize n_items)
+{
+  return MIN ((n_items + 3) / 4, (1u << 27) - 1);
+}
+
+static void
+bloom_filter_add (guint32_le *bloom_filter,
+                  gsize       n_bloom_words,
+                  guint       bloom_shift,
+                  guint32     hash_value)
+{
+  guint32 word, mask;
+
+  if (n_bloom_words == 0)
+    return;
+
+  word = (hash_value / 32) % n_bloom_words;
+  mask = 1u << (hash_value & 31);
+  mask |= 1u << ((hash_value >> bloom_shift) & 31);
+
+  bloom_filter[word] = guint32_to_le (guint32_from_le (bloom_filter[word]) | mask);
 }
 
 static void
@@ -356,6 +426,7 @@ file_builder_add_hash (FileBuilder         *fb,
   guint32_le *buckets, *bloom_filter;
   struct gvdb_hash_item *items;
   HashTable *mytable;
+  gsize n_bloom_words;
   GvdbItem *item;
   guint32 index;
   gint bucket;
@@ -368,7 +439,9 @@ file_builder_add_hash (FileBuilder         *fb,
     for (item = mytable->buckets[bucket]; item; item = item->next)
       item->assigned_index = guint32_to_le (index++);
 
-  file_builder_allocate_for_hash (fb, mytable->n_buckets, index, 5, 0,
+  n_bloom_words = bloom_words_for_items (index);
+  file_builder_allocate_for_hash (fb, mytable->n_buckets, index,
+                                  GVDB_BLOOM_SHIFT, n_bloom_words,
                                   &bloom_filter, &buckets, &items, pointer);
 
   index = 0;
@@ -383,6 +456,8 @@ file_builder_add_hash (FileBuilder         *fb,
 
           g_assert (index == guint32_from_le (item->assigned_index));
           entry->hash_value = guint32_to_le (item->hash_value);
+          bloom_filter_add (bloom_filter, n_bloom_words, GVDB_BLOOM_SHIFT,
+                            item->hash_value);
           entry->parent = item_to_index (item->parent);
           entry->unused = 0;
 
@@ -437,25 +512,54 @@ file_builder_add_hash (FileBuilder         *fb,
   hash_table_free (mytable);
 }
 
+/* Roughly what a table takes per item: the hash item, the key and a
+ * small value */
+#define ESTIMATED_ITEM_SIZE 128
+
 static FileBuilder *
-file_builder_new (gboolean byteswap)
+file_builder_new (gboolean byteswap,
+                  gsize    n_items_estimate)
 {
   FileBuilder *builder;
 
-  builder = g_slice_new (FileBuilder);
-  builder->chunks = g_queue_new ();
+  builder = g_slice_new0 (FileBuilder);
   builder->offset = sizeof (struct gvdb_header);
   builder->byteswap = byteswap;
+  builder->arena.block_size = MAX (ARENA_MIN_BLOCK_SIZE,
+                                   n_items_estimate * ESTIMATED_ITEM_SIZE);
 
   return builder;
 }
 
-static GString *
+static gsize
+count_items (GHashTable *table)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gsize n_items;
+
+  n_items = g_hash_table_size (table);
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      GvdbItem *item = value;
+
+      if (item->table)
+        n_items += count_items (item->table);
+    }
+
+  return n_items;
+}
+
+static GBytes *
 file_builder_serialise (FileBuilder          *fb,
                         struct gvdb_pointer   root)
 {
   struct gvdb_header header = { { 0, }, };
-  GString *result;
+  FileChunk *chunk;
+  guchar *result;
+  gsize len;
 
   if (fb->byteswap)
     {
@@ -468,36 +572,35 @@ file_builder_serialise (FileBuilder          *fb,
       header.signature[1] = GVDB_SIGNATURE1;
     }
 
-  result = g_string_new (NULL);
+  /* The final size is known, so the result is allocated once */
+  result = g_malloc (fb->offset);
 
   header.root = root;
-  g_string_append_len (result, (gpointer) &header, sizeof header);
+  memcpy (result, &header, sizeof header);
+  len = sizeof header;
 
-  while (!g_queue_is_empty (fb->chunks))
+  for (chunk = fb->chunks; chunk; chunk = chunk->next)
     {
-      FileChunk *chunk = g_queue_pop_head (fb->chunks);
-
-      if (result->len != chunk->offset)
+      if (len != chunk->offset)
         {
-          gchar zero[8] = { 0, };
+          g_assert (chunk->offset > len);
+          g_assert (chunk->offset - len < 8);
 
-          g_assert (chunk->offset > result->len);
-          g_assert (chunk->offset - result->len < 8);
-
-          g_string_append_len (result, zero, chunk->offset - result->len);
-          g_assert (result->len == chunk->offset);
+          memset (result + len, 0, chunk->offset - len);
+          len = chunk->offset;
         }
 
-      g_string_append_len (result, chunk->data, chunk->size);
-      g_free (chunk->data);
-
-      g_slice_free (FileChunk, chunk);
+      if (chunk->size != 0)
+        memcpy (result + len, chunk->data, chunk->size);
+      len += chunk->size;
     }
 
-  g_queue_free (fb->chunks);
+  g_assert (len == fb->offset);
+
+  arena_clear (&fb->arena);
   g_slice_free (FileBuilder, fb);
 
-  return result;
+  return g_bytes_new_take (result, len);
 }
 
 GBytes *
@@ -506,17 +609,11 @@ gvdb_table_get_content (GHashTable     *table,
 {
   struct gvdb_pointer root;
   FileBuilder *fb;
-  GString *str;
-  GBytes *res;
 
-  fb = file_builder_new (byteswap);
+  fb = file_builder_new (byteswap, count_items (table));
   file_builder_add_hash (fb, table, &root);
-  str = file_builder_serialise (fb, root);
-
-  res = g_bytes_new_take (str->str, str->len);
-  g_string_free (str, FALSE);
 
-  return res;
+  return file_builder_serialise (fb, root);
 }
 
 gboolean
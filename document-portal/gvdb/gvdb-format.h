@@ -77,6 +77,33 @@ static inline guint16 guint16_from_le (guint16_le value) {
   return GUINT16_FROM_LE (value.value);
 }
 
+/* The djb hash, h = h * 33 + c over the signed bytes of the key.
+ * Four bytes are folded in per step so that the multiplications don't
+ * form one long dependency chain; the result is the same as the
+ * byte-at-a-time loop, so existing files stay valid. */
+static inline guint32 gvdb_hash (const gchar *key, gsize length) {
+  const signed char *s = (const signed char *) key;
+  guint32 hash_value = 5381;
+  gsize i = 0;
+
+  for (; i + 4 <= length; i += 4)
+    hash_value = hash_value * (33u * 33 * 33 * 33) +
+                 (guint32) s[i] * (33u * 33 * 33) +
+                 (guint32) s[i + 1] * (33u * 33) +
+                 (guint32) s[i + 2] * 33u +
+                 (guint32) s[i + 3];
+
+  for (; i < length; i++)
+    hash_value = hash_value * 33 + (guint32) s[i];
+
+  return hash_value;
+}
+
+/* Both bloom filter bits live in the same word; the second bit comes
+ * from the top of the hash, so it is independent of the word index and
+ * the first bit. */
+#define GVDB_BLOOM_SHIFT 27
+
 #define GVDB_SIGNATURE0 1918981703
 #define GVDB_SIGNATURE1 1953390953
 #define GVDB_SWAPPED_SIGNATURE0 GUINT32_SWAP_LE_BE (GVDB_SIGNATURE0)
@@ -96,6 +96,7 @@ gvdb_table_setup_root (GvdbTable                 *file,
 
   n_bloom_words = guint32_from_le (header->n_bloom_words);
   n_buckets = guint32_from_le (header->n_buckets);
+  file->bloom_shift = n_bloom_words >> 27;
   n_bloom_words &= (1u << 27) - 1;
 
   if G_UNLIKELY (n_bloom_words * sizeof (guint32_le) > size)
@@ -265,7 +266,7 @@ gvdb_table_lookup (GvdbTable   *file,
                    const gchar *key,
                    gchar        type)
 {
-  guint32 hash_value = 5381;
+  guint32 hash_value;
   guint key_length;
   guint32 bucket;
   guint32 lastno;
@@ -274,8 +275,8 @@ gvdb_table_lookup (GvdbTable   *file,
   if G_UNLIKELY (file->n_buckets == 0 || file->n_hash_items == 0)
     return NULL;
 
-  for (key_length = 0; key[key_length]; key_length++)
-    hash_value = (hash_value * 33) + ((signed char *) key)[key_length];
+  key_length = strlen (key);
+  hash_value = gvdb_hash (key, key_length);
 
   if (!gvdb_table_bloom_filter (file, hash_value))
     return NULL;
@@ -470,6 +471,71 @@ gvdb_table_get_names (GvdbTable *table,
   return names;
 }
 
+/**
+ * gvdb_table_iter_init:
+ * @iter: an uninitialised #GvdbTableIter
+ * @table: a #GvdbTable
+ *
+ * Initialises @iter to walk the root-level keys of @table, in file
+ * order.  Unlike gvdb_table_get_names() this does not allocate.
+ *
+ * @table must stay alive while @iter is in use.
+ **/
+void
+gvdb_table_iter_init (GvdbTableIter *iter,
+                      GvdbTable     *table)
+{
+  iter->table = table;
+  iter->item = NULL;
+  iter->index = 0;
+}
+
+/**
+ * gvdb_table_iter_next:
+ * @iter: a #GvdbTableIter
+ * @key: (out): the key of the next item
+ * @key_length: (out): the length of @key
+ *
+ * Advances @iter to the next root-level item.
+ *
+ * @key points into the mapped file and is not nul-terminated; it is
+ * valid for as long as the table is.  As with gvdb_table_get_names(),
+ * the key may not be utf8.
+ *
+ * Returns: %FALSE once all items have been returned
+ **/
+gboolean
+gvdb_table_iter_next (GvdbTableIter  *iter,
+                      const gchar   **key,
+                      gsize          *key_length)
+{
+  GvdbTable *table = iter->table;
+
+  while (iter->index < table->n_hash_items)
+    {
+      const struct gvdb_hash_item *item = &table->hash_items[iter->index++];
+      const gchar *name;
+      gsize name_length;
+
+      if (guint32_from_le (item->parent) != 0xffffffffu)
+        continue;
+
+      name = gvdb_table_item_get_key (table, item, &name_length);
+      if (name == NULL)
+        continue;
+
+      iter->item = item;
+      *key = name;
+      *key_length = name_length;
+
+      return TRUE;
+    }
+
+  iter->item = NULL;
+
+  return FALSE;
+}
+
 /**
  * gvdb_table_list:
  * @file: a #GvdbTable
@@ -644,6 +710,40 @@ gvdb_table_get_raw_value (GvdbTable   *table,
   return gvdb_table_value_from_item (table, item);
 }
 
+/**
+ * gvdb_table_iter_get_value:
+ * @iter: a #GvdbTableIter
+ * @returns: a #GVariant, or %NULL
+ *
+ * Returns the value of the item that @iter currently points at, as
+ * gvdb_table_get_value() would, but without looking the key up again.
+ *
+ * %NULL is returned if the item is not a value (for example if it is a
+ * sub-table) or if the file is corrupted.
+ **/
+GVariant *
+gvdb_table_iter_get_value (GvdbTableIter *iter)
+{
+  const struct gvdb_hash_item *item = iter->item;
+  GVariant *value;
+
+  if (item == NULL || item->type != 'v')
+    return NULL;
+
+  value = gvdb_table_value_from_item (iter->table, item);
+
+  if (value && iter->table->byteswapped)
+    {
+      GVariant *tmp;
+
+      tmp = g_variant_byteswap (value);
+      g_variant_unref (value);
+      value = tmp;
+    }
+
+  return value;
+}
+
 /**
  * gvdb_table_get_table:
  * @file: a #GvdbTable
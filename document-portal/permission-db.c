@@ -22,9 +22,13 @@
 #include "config.h"
 
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/statfs.h>
 
 #include "permission-db.h"
@@ -37,21 +41,45 @@ struct PermissionDb
 
   char      *path;
   gboolean   fail_if_not_found;
+  gboolean   populate;
   GvdbTable *gvdb;
   GBytes    *gvdb_contents;
 
   gboolean   dirty;
+  gint       generation;
+  gboolean   on_nfs;
 
   /* Map id => GVariant (data, sorted-dict[appid->perms]) */
   GvdbTable  *main_table;
   GHashTable *main_updates;
 
-  /* (reverse) Map app id => [ id ]*/
+  /* (reverse) Map app id => [ id ], the updates are sets of ids */
   GvdbTable  *app_table;
   GHashTable *app_additions;
   GHashTable *app_removals;
+
+  /* Append-only log of set_entry() calls that are not yet in the gvdb
+   * file. Pending records are not yet written to journal_fd, tail
+   * records are the ones made since the last permission_db_update(). */
+  int         journal_fd;
+  gsize       journal_size;
+  GByteArray *journal_pending;
+  GByteArray *journal_tail;
+
+  /* Map entry data => [ id ], built on first use by list_ids_by_value() */
+  GHashTable *value_index;
+
+  /* Map id => entry for the entries that only live in memory. They are
+   * never folded into the gvdb tables, serialized or journaled, and
+   * don't count as updates. */
+  GHashTable *volatile_entries;
+
+  /* (reverse) Map app id => [ id ] of the volatile entries */
+  GHashTable *volatile_apps;
 };
 
+#define JOURNAL_RECORD_TYPE "(sm(va{sas}))"
+
 typedef struct
 {
   GObjectClass parent_class;
@@ -66,6 +94,7 @@ enum {
   PROP_0,
   PROP_PATH,
   PROP_FAIL_IF_NOT_FOUND,
+  PROP_POPULATE,
   LAST_PROP
 };
 
@@ -145,6 +174,14 @@ permission_db_finalize (GObject *object)
   g_clear_pointer (&self->main_updates, g_hash_table_unref);
   g_clear_pointer (&self->app_additions, g_hash_table_unref);
   g_clear_pointer (&self->app_removals, g_hash_table_unref);
+  g_clear_pointer (&self->journal_pending, g_byte_array_unref);
+  g_clear_pointer (&self->journal_tail, g_byte_array_unref);
+  g_clear_pointer (&self->value_index, g_hash_table_unref);
+  g_clear_pointer (&self->volatile_entries, g_hash_table_unref);
+  g_clear_pointer (&self->volatile_apps, g_hash_table_unref);
+
+  if (self->journal_fd >= 0)
+    close (self->journal_fd);
 
   G_OBJECT_CLASS (permission_db_parent_class)->finalize (object);
 }
@@ -167,6 +204,10 @@ permission_db_get_property (GObject    *object,
       g_value_set_boolean (value, self->fail_if_not_found);
       break;
 
+    case PROP_POPULATE:
+      g_value_set_boolean (value, self->populate);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -191,6 +232,10 @@ permission_db_set_property (GObject      *object,
       self->fail_if_not_found = g_value_get_boolean (value);
       break;
 
+    case PROP_POPULATE:
+      self->populate = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -219,22 +264,134 @@ permission_db_class_init (PermissionDbClass *klass)
                                                          "",
                                                          TRUE,
                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class,
+                                   PROP_POPULATE,
+                                   g_param_spec_boolean ("populate",
+                                                         "",
+                                                         "",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 }
 
 static void
 permission_db_init (PermissionDb *self)
 {
   self->fail_if_not_found = TRUE;
+  self->journal_fd = -1;
 
   self->main_updates =
     g_hash_table_new_full (g_str_hash, g_str_equal,
                            g_free, (GDestroyNotify) permission_db_entry_unref);
   self->app_additions =
     g_hash_table_new_full (g_str_hash, g_str_equal,
-                           g_free, (GDestroyNotify) g_ptr_array_unref);
+                           g_free, (GDestroyNotify) g_hash_table_unref);
   self->app_removals =
     g_hash_table_new_full (g_str_hash, g_str_equal,
-                           g_free, (GDestroyNotify) g_ptr_array_unref);
+                           g_free, (GDestroyNotify) g_hash_table_unref);
+  self->journal_pending = g_byte_array_new ();
+  self->journal_tail = g_byte_array_new ();
+  self->volatile_entries =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+                           g_free, (GDestroyNotify) permission_db_entry_unref);
+  self->volatile_apps =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+                           g_free, (GDestroyNotify) g_hash_table_unref);
+}
+
+static char *
+get_journal_path (PermissionDb *self)
+{
+  return g_strconcat (self->path, ".journal", NULL);
+}
+
+static gboolean
+replay_journal (PermissionDb *self,
+                GError      **error)
+{
+  g_autofree char *journal_path = get_journal_path (self);
+  g_autofree char *contents = NULL;
+  GError *my_error = NULL;
+  gsize length;
+  gsize offset;
+
+  if (!g_file_get_contents (journal_path, &contents, &length, &my_error))
+    {
+      if (g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_error_free (my_error);
+          return TRUE;
+        }
+
+      g_propagate_error (error, my_error);
+      return FALSE;
+    }
+
+  offset = 0;
+  while (length - offset >= sizeof (guint32))
+    {
+      g_autoptr(GBytes) bytes = NULL;
+      g_autoptr(GVariant) record = NULL;
+      g_autoptr(GVariant) entry = NULL;
+      const char *id;
+      guint32 len;
+
+      memcpy (&len, contents + offset, sizeof (guint32));
+      len = GUINT32_FROM_LE (len);
+
+      /* A truncated record at the end is from a write that never completed */
+      if (len > length - offset - sizeof (guint32))
+        break;
+
+      bytes = g_bytes_new (contents + offset + sizeof (guint32), len);
+      record = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (JOURNAL_RECORD_TYPE),
+                                                             bytes, FALSE));
+      if (G_BYTE_ORDER == G_BIG_ENDIAN)
+        {
+          GVariant *tmp = g_variant_byteswap (record);
+          g_variant_unref (record);
+          record = tmp;
+        }
+
+      /* This checks the record once and marks it trusted, so the entry
+       * taken from it isn't validated again on every use. Anything that
+       * fails is treated like a torn write. */
+      if (!g_variant_is_normal_form (record))
+        break;
+
+      g_variant_get (record, "(&sm@(va{sas}))", &id, &entry);
+      permission_db_set_entry (self, id, (PermissionDbEntry *) entry);
+
+      offset += sizeof (guint32) + len;
+    }
+
+  self->journal_size = offset;
+
+  return TRUE;
+}
+
+static void
+append_journal_record (GByteArray        *array,
+                       const char        *id,
+                       PermissionDbEntry *entry)
+{
+  g_autoptr(GVariant) record = NULL;
+  g_autoptr(GVariant) normal = NULL;
+  guint32 len;
+
+  record = g_variant_ref_sink (g_variant_new ("(sm@(va{sas}))", id, (GVariant *) entry));
+  normal = g_variant_get_normal_form (record);
+
+  /* Records are always stored little-endian */
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *tmp = g_variant_byteswap (normal);
+      g_variant_unref (normal);
+      normal = tmp;
+    }
+
+  len = GUINT32_TO_LE (g_variant_get_size (normal));
+  g_byte_array_append (array, (const guint8 *) &len, sizeof (guint32));
+  g_byte_array_append (array, g_variant_get_data (normal), g_variant_get_size (normal));
 }
 
 static gboolean
@@ -253,6 +410,134 @@ is_on_nfs (const char *path)
   return statfs_buffer.f_type == 0x6969;
 }
 
+typedef struct
+{
+  gpointer data;
+  gsize    size;
+} Mapping;
+
+static void
+mapping_free (gpointer user_data)
+{
+  Mapping *mapping = user_data;
+
+  munmap (mapping->data, mapping->size);
+  g_free (mapping);
+}
+
+/* Maps the file read-only. The pages are shared with the page cache,
+ * and values looked up from the db point straight into them. */
+static GBytes *
+map_file (const char *path,
+          gboolean    populate,
+          GError    **error)
+{
+  struct stat st;
+  Mapping *mapping;
+  gpointer data;
+  int errsv;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    goto fail;
+
+  if (fstat (fd, &st) != 0)
+    goto fail;
+
+  /* Can't map an empty file, but we don't need to */
+  if (st.st_size == 0)
+    {
+      close (fd);
+      return g_bytes_new (NULL, 0);
+    }
+
+  data = mmap (NULL, st.st_size, PROT_READ,
+               MAP_PRIVATE | (populate ? MAP_POPULATE : 0),
+               fd, 0);
+  if (data == MAP_FAILED)
+    goto fail;
+
+  close (fd);
+
+  /* Lookups hash into the file, so readahead is mostly wasted, unless
+   * we were asked to have everything in memory up front */
+  madvise (data, st.st_size, populate ? MADV_WILLNEED : MADV_RANDOM);
+
+  mapping = g_new (Mapping, 1);
+  mapping->data = data;
+  mapping->size = st.st_size;
+
+  return g_bytes_new_with_free_func (data, st.st_size, mapping_free, mapping);
+
+fail:
+  errsv = errno;
+  if (fd >= 0)
+    close (fd);
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+               "Failed to map %s: %s", path, g_strerror (errsv));
+  return NULL;
+}
+
+static gboolean
+open_tables (PermissionDb *self,
+             gboolean      trusted,
+             GError      **error)
+{
+  self->gvdb = gvdb_table_new_from_bytes (self->gvdb_contents, trusted, error);
+  if (self->gvdb == NULL)
+    return FALSE;
+
+  self->main_table = gvdb_table_get_table (self->gvdb, "main");
+  if (self->main_table == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No main table in db");
+      return FALSE;
+    }
+
+  self->app_table = gvdb_table_get_table (self->gvdb, "apps");
+  if (self->app_table == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No app table in db");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Every key must be a valid string and every value of @type and in
+ * normal form, which is what the rest of the code assumes of a trusted
+ * table */
+static gboolean
+validate_table (GvdbTable          *table,
+                const GVariantType *type,
+                GError            **error)
+{
+  GvdbTableIter iter;
+  const char *name;
+  gsize name_length;
+
+  gvdb_table_iter_init (&iter, table);
+  while (gvdb_table_iter_next (&iter, &name, &name_length))
+    {
+      g_autoptr(GVariant) value = gvdb_table_iter_get_value (&iter);
+
+      if (!g_utf8_validate (name, name_length, NULL) ||
+          value == NULL ||
+          !g_variant_is_of_type (value, type) ||
+          !g_variant_is_normal_form (value))
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Invalid entry in db");
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 static gboolean
 initable_init (GInitable    *initable,
                GCancellable *cancellable,
@@ -264,7 +549,9 @@ initable_init (GInitable    *initable,
   if (self->path == NULL)
     return TRUE;
 
-  if (is_on_nfs (self->path))
+  self->on_nfs = is_on_nfs (self->path);
+
+  if (self->on_nfs)
     {
       g_autoptr(GFile) file = g_file_new_for_path (self->path);
       char *contents;
@@ -277,12 +564,7 @@ initable_init (GInitable    *initable,
     }
   else
     {
-      GMappedFile *mapped = g_mapped_file_new (self->path, FALSE, &my_error);
-      if (mapped)
-        {
-          self->gvdb_contents = g_mapped_file_get_bytes (mapped);
-          g_mapped_file_unref (mapped);
-        }
+      self->gvdb_contents = map_file (self->path, self->populate, &my_error);
     }
 
   if (self->gvdb_contents == NULL)
@@ -301,27 +583,24 @@ initable_init (GInitable    *initable,
     }
   else
     {
-      self->gvdb = gvdb_table_new_from_bytes (self->gvdb_contents, TRUE, error);
-      if (self->gvdb == NULL)
+      /* Check the whole file once, then reopen it trusted so that
+       * lookups don't validate values again */
+      if (!open_tables (self, FALSE, error) ||
+          !validate_table (self->main_table, G_VARIANT_TYPE ("(va{sas})"), error) ||
+          !validate_table (self->app_table, G_VARIANT_TYPE_STRING_ARRAY, error))
         return FALSE;
 
-      self->main_table = gvdb_table_get_table (self->gvdb, "main");
-      if (self->main_table == NULL)
-        {
-          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
-                       "No main table in db");
-          return FALSE;
-        }
+      g_clear_pointer (&self->main_table, gvdb_table_free);
+      g_clear_pointer (&self->app_table, gvdb_table_free);
+      g_clear_pointer (&self->gvdb, gvdb_table_free);
 
-      self->app_table = gvdb_table_get_table (self->gvdb, "apps");
-      if (self->app_table == NULL)
-        {
-          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
-                       "No app table in db");
-          return FALSE;
-        }
+      if (!open_tables (self, TRUE, error))
+        return FALSE;
     }
 
+  if (!replay_journal (self, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -331,6 +610,17 @@ initable_iface_init (GInitableIface *initable_iface)
   initable_iface->init = initable_init;
 }
 
+/* gvdb keys point into the mapped file and are not nul-terminated,
+ * copy them into a reused buffer for hash table lookups */
+static void
+gvdb_key_to_string (GString    *buf,
+                    const char *key,
+                    gsize       key_length)
+{
+  g_string_truncate (buf, 0);
+  g_string_append_len (buf, key, key_length);
+}
+
 /* Transfer: full */
 char **
 permission_db_list_ids (PermissionDb *self)
@@ -338,7 +628,6 @@ permission_db_list_ids (PermissionDb *self)
   GPtrArray *res;
   GHashTableIter iter;
   gpointer key, value;
-  int i;
 
   g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
 
@@ -353,20 +642,25 @@ permission_db_list_ids (PermissionDb *self)
 
   if (self->main_table)
     {
-      // TODO: can we use gvdb_table_list here???
-      g_autofree char **main_ids = gvdb_table_get_names (self->main_table, NULL);
+      g_autoptr(GString) id = g_string_new (NULL);
+      GvdbTableIter gvdb_iter;
+      const char *name;
+      gsize name_length;
 
-      for (i = 0; main_ids[i] != NULL; i++)
+      gvdb_table_iter_init (&gvdb_iter, self->main_table);
+      while (gvdb_table_iter_next (&gvdb_iter, &name, &name_length))
         {
-          char *id = main_ids[i];
+          gvdb_key_to_string (id, name, name_length);
 
-          if (g_hash_table_lookup_extended (self->main_updates, id, NULL, NULL))
-            g_free (id);
-          else
-            g_ptr_array_add (res, id);
+          if (!g_hash_table_lookup_extended (self->main_updates, id->str, NULL, NULL))
+            g_ptr_array_add (res, g_strndup (name, name_length));
         }
     }
 
+  g_hash_table_iter_init (&iter, self->volatile_entries);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (res, g_strdup (key));
+
   g_ptr_array_add (res, NULL);
   return (char **) g_ptr_array_free (res, FALSE);
 }
@@ -374,13 +668,20 @@ permission_db_list_ids (PermissionDb *self)
 static gboolean
 app_update_empty (GHashTable *ht, const char *app)
 {
-  GPtrArray *array;
+  GHashTable *set;
 
-  array = g_hash_table_lookup (ht, app);
-  if (array == NULL)
+  set = g_hash_table_lookup (ht, app);
+  if (set == NULL)
     return TRUE;
 
-  return array->len == 0;
+  return g_hash_table_size (set) == 0;
+}
+
+static gboolean
+id_set_contains (GHashTable *set,
+                 const char *id)
+{
+  return set != NULL && g_hash_table_contains (set, id);
 }
 
 /* Transfer: full */
@@ -390,7 +691,6 @@ permission_db_list_apps (PermissionDb *self)
   gpointer key, _value;
   GHashTableIter iter;
   GPtrArray *res;
-  int i;
 
   g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
 
@@ -399,72 +699,83 @@ permission_db_list_apps (PermissionDb *self)
   g_hash_table_iter_init (&iter, self->app_additions);
   while (g_hash_table_iter_next (&iter, &key, &_value))
     {
-      GPtrArray *value = _value;
-      if (value->len > 0)
+      GHashTable *value = _value;
+      if (g_hash_table_size (value) > 0)
         g_ptr_array_add (res, g_strdup (key));
     }
 
   if (self->app_table)
     {
-      // TODO: can we use gvdb_table_list here???
-      g_autofree char **apps = gvdb_table_get_names (self->app_table, NULL);
+      g_autoptr(GString) app = g_string_new (NULL);
+      GvdbTableIter gvdb_iter;
+      const char *name;
+      gsize name_length;
 
-      for (i = 0; apps[i] != NULL; i++)
+      gvdb_table_iter_init (&gvdb_iter, self->app_table);
+      while (gvdb_table_iter_next (&gvdb_iter, &name, &name_length))
         {
-          char *app = apps[i];
+          g_autoptr(GVariant) ids_v = NULL;
           gboolean empty = TRUE;
-          GPtrArray *removals;
-          int j;
+          GHashTable *removals;
+
+          gvdb_key_to_string (app, name, name_length);
 
           /* Don't use if we already added above */
-          if (app_update_empty (self->app_additions, app))
-            {
-              g_autoptr(GVariant) ids_v = NULL;
+          if (!app_update_empty (self->app_additions, app->str))
+            continue;
 
-              removals = g_hash_table_lookup (self->app_removals, app);
+          removals = g_hash_table_lookup (self->app_removals, app->str);
 
-              /* Add unless all items are removed */
-              ids_v = gvdb_table_get_value (self->app_table, app);
+          /* Add unless all items are removed */
+          ids_v = gvdb_table_iter_get_value (&gvdb_iter);
 
-              if (ids_v)
-                {
-                  g_autofree const char **ids = g_variant_get_strv (ids_v, NULL);
+          if (ids_v && removals == NULL)
+            {
+              empty = g_variant_n_children (ids_v) == 0;
+            }
+          else if (ids_v)
+            {
+              GVariantIter ids_iter;
+              const char *id;
 
-                  for (j = 0; ids[j] != NULL; j++)
+              g_variant_iter_init (&ids_iter, ids_v);
+              while (g_variant_iter_next (&ids_iter, "&s", &id))
+                {
+                  if (!id_set_contains (removals, id))
                     {
-                      if (removals == NULL ||
-                          !str_ptr_array_contains (removals, ids[j]))
-                        {
-                          empty = FALSE;
-                          break;
-                        }
+                      empty = FALSE;
+                      break;
                     }
                 }
             }
 
-          if (empty)
-            g_free (app);
-          else
-            g_ptr_array_add (res, app);
+          if (!empty)
+            g_ptr_array_add (res, g_strdup (app->str));
         }
     }
 
+  g_hash_table_iter_init (&iter, self->volatile_apps);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (!str_ptr_array_contains (res, key))
+        g_ptr_array_add (res, g_strdup (key));
+    }
+
   g_ptr_array_add (res, NULL);
   return (char **) g_ptr_array_free (res, FALSE);
 }
 
-/* Transfer: full */
-char **
-permission_db_list_ids_by_app (PermissionDb  *self,
-                               const char *app)
+static char **
+list_ids_by_app (PermissionDb *self,
+                 const char   *app,
+                 gboolean      include_volatile)
 {
   GPtrArray *res;
-  GPtrArray *additions;
-  GPtrArray *removals;
+  GHashTable *additions;
+  GHashTable *removals;
+  GHashTable *volatile_ids = NULL;
   int i;
 
-  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
-
   res = g_ptr_array_new ();
 
   additions = g_hash_table_lookup (self->app_additions, app);
@@ -472,9 +783,12 @@ permission_db_list_ids_by_app (PermissionDb  *self,
 
   if (additions)
     {
-      for (i = 0; i < additions->len; i++)
-        g_ptr_array_add (res,
-                         g_strdup (g_ptr_array_index (additions, i)));
+      GHashTableIter iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&iter, additions);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_ptr_array_add (res, g_strdup (key));
     }
 
   if (self->app_table)
@@ -486,17 +800,40 @@ permission_db_list_ids_by_app (PermissionDb  *self,
 
           for (i = 0; ids[i] != NULL; i++)
             {
-              if (removals == NULL ||
-                  !str_ptr_array_contains (removals, ids[i]))
+              /* Ids that were removed and re-added are already listed */
+              if (!id_set_contains (removals, ids[i]) &&
+                  !id_set_contains (additions, ids[i]))
                 g_ptr_array_add (res, g_strdup (ids[i]));
             }
         }
     }
 
+  if (include_volatile)
+    volatile_ids = g_hash_table_lookup (self->volatile_apps, app);
+  if (volatile_ids)
+    {
+      GHashTableIter iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&iter, volatile_ids);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_ptr_array_add (res, g_strdup (key));
+    }
+
   g_ptr_array_add (res, NULL);
   return (char **) g_ptr_array_free (res, FALSE);
 }
 
+/* Transfer: full */
+char **
+permission_db_list_ids_by_app (PermissionDb  *self,
+                               const char *app)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
+
+  return list_ids_by_app (self, app, TRUE);
+}
+
 /* Transfer: full */
 PermissionDbEntry *
 permission_db_lookup (PermissionDb  *self,
@@ -513,6 +850,10 @@ permission_db_lookup (PermissionDb  *self,
       if (value != NULL)
         res = g_variant_ref ((GVariant *) value);
     }
+  else if ((value = g_hash_table_lookup (self->volatile_entries, id)) != NULL)
+    {
+      res = g_variant_ref ((GVariant *) value);
+    }
   else if (self->main_table)
     {
       res = gvdb_table_get_value (self->main_table, id);
@@ -521,75 +862,151 @@ permission_db_lookup (PermissionDb  *self,
   return (PermissionDbEntry *) res;
 }
 
+/* Keys are always in normal form, so equal values serialize the same */
+static guint
+value_index_hash (gconstpointer key)
+{
+  GVariant *value = (GVariant *) key;
+  const guchar *data = g_variant_get_data (value);
+  gsize size = g_variant_get_size (value);
+  guint32 h = g_str_hash (g_variant_get_type_string (value));
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    h = (h << 5) + h + data[i];
+
+  return h;
+}
+
+static gboolean
+value_index_equal (gconstpointer a,
+                   gconstpointer b)
+{
+  return g_variant_equal (a, b);
+}
+
+static void
+value_index_add (PermissionDb      *self,
+                 const char        *id,
+                 PermissionDbEntry *entry)
+{
+  g_autoptr(GVariant) data = permission_db_entry_get_data (entry);
+  g_autoptr(GVariant) normal = g_variant_get_normal_form (data);
+  GPtrArray *ids;
+
+  ids = g_hash_table_lookup (self->value_index, normal);
+  if (ids == NULL)
+    {
+      ids = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_insert (self->value_index, g_variant_ref (normal), ids);
+    }
+
+  if (!str_ptr_array_contains (ids, id))
+    g_ptr_array_add (ids, g_strdup (id));
+}
+
+static void
+value_index_remove (PermissionDb      *self,
+                    const char        *id,
+                    PermissionDbEntry *entry)
+{
+  g_autoptr(GVariant) data = permission_db_entry_get_data (entry);
+  g_autoptr(GVariant) normal = g_variant_get_normal_form (data);
+  GPtrArray *ids;
+  int i;
+
+  ids = g_hash_table_lookup (self->value_index, normal);
+  if (ids == NULL)
+    return;
+
+  i = str_ptr_array_find (ids, id);
+  if (i >= 0)
+    g_ptr_array_remove_index_fast (ids, i);
+
+  if (ids->len == 0)
+    g_hash_table_remove (self->value_index, normal);
+}
+
+static void
+ensure_value_index (PermissionDb *self)
+{
+  g_auto(GStrv) ids = NULL;
+  int i;
+
+  if (self->value_index != NULL)
+    return;
+
+  self->value_index = g_hash_table_new_full (value_index_hash, value_index_equal,
+                                             (GDestroyNotify) g_variant_unref,
+                                             (GDestroyNotify) g_ptr_array_unref);
+
+  ids = permission_db_list_ids (self);
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (self, ids[i]);
+
+      if (entry)
+        value_index_add (self, ids[i], entry);
+    }
+}
+
 /* Transfer: full */
 char **
 permission_db_list_ids_by_value (PermissionDb *self,
                                  GVariant  *data)
 {
-  g_autofree char **ids = permission_db_list_ids (self);
-  int i;
+  g_autoptr(GVariant) normal = NULL;
+  GPtrArray *ids;
   GPtrArray *res;
+  int i;
 
   g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
   g_return_val_if_fail (data != NULL, NULL);
 
+  ensure_value_index (self);
+
   res = g_ptr_array_new ();
 
-  for (i = 0; ids[i] != NULL; i++)
+  normal = g_variant_get_normal_form (data);
+  ids = g_hash_table_lookup (self->value_index, normal);
+  if (ids)
     {
-      char *id = ids[i];
-
-      g_autoptr(PermissionDbEntry) entry = NULL;
-      g_autoptr(GVariant) entry_data = NULL;
-
-      entry = permission_db_lookup (self, id);
-      if (entry)
-        {
-          entry_data = permission_db_entry_get_data (entry);
-          if (g_variant_equal (data, entry_data))
-            {
-              g_ptr_array_add (res, id);
-              id = NULL; /* Don't free, as we return this */
-            }
-        }
-      g_free (id);
+      for (i = 0; i < ids->len; i++)
+        g_ptr_array_add (res, g_strdup (g_ptr_array_index (ids, i)));
     }
 
   g_ptr_array_add (res, NULL);
   return (char **) g_ptr_array_free (res, FALSE);
 }
 
+static GHashTable *
+ensure_id_set (GHashTable *ht,
+               const char *app)
+{
+  GHashTable *set;
+
+  set = g_hash_table_lookup (ht, app);
+  if (set == NULL)
+    {
+      set = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert (ht, g_strdup (app), set);
+    }
+
+  return set;
+}
+
 static void
 add_app_id (PermissionDb  *self,
             const char *app,
             const char *id)
 {
-  GPtrArray *additions;
-  GPtrArray *removals;
-  int i;
+  GHashTable *removals;
 
-  additions = g_hash_table_lookup (self->app_additions, app);
   removals = g_hash_table_lookup (self->app_removals, app);
-
   if (removals)
-    {
-      i = str_ptr_array_find (removals, id);
-      if (i >= 0)
-        g_ptr_array_remove_index_fast (removals, i);
-    }
+    g_hash_table_remove (removals, id);
 
-  if (additions)
-    {
-      if (!str_ptr_array_contains (additions, id))
-        g_ptr_array_add (additions, g_strdup (id));
-    }
-  else
-    {
-      additions = g_ptr_array_new_with_free_func (g_free);
-      g_ptr_array_add (additions, g_strdup (id));
-      g_hash_table_insert (self->app_additions,
-                           g_strdup (app), additions);
-    }
+  g_hash_table_add (ensure_id_set (self->app_additions, app), g_strdup (id));
 }
 
 static void
@@ -597,45 +1014,185 @@ remove_app_id (PermissionDb  *self,
                const char *app,
                const char *id)
 {
-  GPtrArray *additions;
-  GPtrArray *removals;
-  int i;
+  GHashTable *additions;
 
   additions = g_hash_table_lookup (self->app_additions, app);
-  removals = g_hash_table_lookup (self->app_removals, app);
-
   if (additions)
-    {
-      i = str_ptr_array_find (additions, id);
-      if (i >= 0)
-        g_ptr_array_remove_index_fast (additions, i);
-    }
+    g_hash_table_remove (additions, id);
 
-  if (removals)
-    {
-      if (!str_ptr_array_contains (removals, id))
-        g_ptr_array_add (removals, g_strdup (id));
-    }
-  else
-    {
-      removals = g_ptr_array_new_with_free_func (g_free);
-      g_ptr_array_add (removals, g_strdup (id));
-      g_hash_table_insert (self->app_removals,
-                           g_strdup (app), removals);
-    }
+  g_hash_table_add (ensure_id_set (self->app_removals, app), g_strdup (id));
 }
 
-gboolean
-permission_db_is_dirty (PermissionDb *self)
+/* Bumped on every change, may be read without holding any lock */
+guint
+permission_db_get_generation (PermissionDb *self)
 {
-  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+  g_return_val_if_fail (PERMISSION_IS_DB (self), 0);
 
-  return self->dirty;
+  return (guint) g_atomic_int_get (&self->generation);
 }
 
-/* add, replace, or NULL entry to remove */
-void
-permission_db_set_entry (PermissionDb      *self,
+/* Number of entries changed since the last permission_db_update() */
+guint
+permission_db_get_n_updates (PermissionDb *self)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), 0);
+
+  return g_hash_table_size (self->main_updates);
+}
+
+static void
+id_sets_memory_usage (GHashTable *ht,
+                      guint64    *objects,
+                      guint64    *bytes)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, ht);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GHashTableIter set_iter;
+      gpointer id;
+
+      *bytes += strlen (key) + 1;
+
+      g_hash_table_iter_init (&set_iter, value);
+      while (g_hash_table_iter_next (&set_iter, &id, NULL))
+        {
+          (*objects)++;
+          *bytes += strlen (id) + 1;
+        }
+    }
+}
+
+/* Estimates the memory held by the changes not folded into the gvdb
+ * tables yet, for finding out where a long running process grows */
+void
+permission_db_get_memory_usage (PermissionDb            *self,
+                                PermissionDbMemoryUsage *usage)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_if_fail (PERMISSION_IS_DB (self));
+
+  memset (usage, 0, sizeof (*usage));
+
+  g_hash_table_iter_init (&iter, self->main_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      usage->updates++;
+      usage->updates_bytes += strlen (key) + 1;
+      if (value)
+        usage->updates_bytes += g_variant_get_size ((GVariant *) value);
+    }
+
+  id_sets_memory_usage (self->app_additions, &usage->app_changes, &usage->app_changes_bytes);
+  id_sets_memory_usage (self->app_removals, &usage->app_changes, &usage->app_changes_bytes);
+
+  usage->journal_bytes = self->journal_pending->len + self->journal_tail->len;
+
+  if (self->gvdb_contents)
+    usage->content_bytes = g_bytes_get_size (self->gvdb_contents);
+}
+
+static GHashTable *
+copy_id_sets (GHashTable *ht)
+{
+  GHashTable *copy;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                g_free, (GDestroyNotify) g_hash_table_unref);
+
+  g_hash_table_iter_init (&iter, ht);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GHashTable *set = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      GHashTableIter set_iter;
+      gpointer id;
+
+      g_hash_table_iter_init (&set_iter, value);
+      while (g_hash_table_iter_next (&set_iter, &id, NULL))
+        g_hash_table_add (set, g_strdup (id));
+
+      g_hash_table_insert (copy, g_strdup (key), set);
+    }
+
+  return copy;
+}
+
+/* Returns a pathless copy of the current state that shares the
+ * serialized tables with @self and copies the pending updates, so the
+ * cost is proportional to what changed since the last update. The
+ * snapshot is never modified, so any number of threads can read from
+ * it at the same time without locking, as long as they stick to
+ * lookups and the list functions other than list_ids_by_value(). */
+PermissionDb *
+permission_db_dup_snapshot (PermissionDb *self)
+{
+  PermissionDb *snapshot;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
+
+  snapshot = permission_db_new (NULL, FALSE, NULL);
+
+  if (self->gvdb_contents)
+    {
+      snapshot->gvdb_contents = g_bytes_ref (self->gvdb_contents);
+      snapshot->gvdb = gvdb_table_new_from_bytes (snapshot->gvdb_contents, TRUE, NULL);
+      g_assert (snapshot->gvdb != NULL);
+      snapshot->main_table = gvdb_table_get_table (snapshot->gvdb, "main");
+      snapshot->app_table = gvdb_table_get_table (snapshot->gvdb, "apps");
+    }
+
+  g_hash_table_iter_init (&iter, self->main_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (snapshot->main_updates, g_strdup (key),
+                         permission_db_entry_ref (value));
+
+  g_clear_pointer (&snapshot->app_additions, g_hash_table_unref);
+  g_clear_pointer (&snapshot->app_removals, g_hash_table_unref);
+  snapshot->app_additions = copy_id_sets (self->app_additions);
+  snapshot->app_removals = copy_id_sets (self->app_removals);
+
+  g_hash_table_iter_init (&iter, self->volatile_entries);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (snapshot->volatile_entries, g_strdup (key),
+                         permission_db_entry_ref (value));
+
+  g_clear_pointer (&snapshot->volatile_apps, g_hash_table_unref);
+  snapshot->volatile_apps = copy_id_sets (self->volatile_apps);
+
+  snapshot->generation = self->generation;
+
+  return snapshot;
+}
+
+gboolean
+permission_db_is_dirty (PermissionDb *self)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  return self->dirty;
+}
+
+/* Whether the db file is on NFS, where rewriting it is slow */
+gboolean
+permission_db_is_on_nfs (PermissionDb *self)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  return self->on_nfs;
+}
+
+/* add, replace, or NULL entry to remove */
+void
+permission_db_set_entry (PermissionDb      *self,
                          const char     *id,
                          PermissionDbEntry *entry)
 {
@@ -649,10 +1206,32 @@ permission_db_set_entry (PermissionDb      *self,
   g_return_if_fail (PERMISSION_IS_DB (self));
   g_return_if_fail (id != NULL);
 
+  /* Volatile entries stay volatile until removed */
+  if (g_hash_table_contains (self->volatile_entries, id))
+    {
+      permission_db_set_volatile_entry (self, id, entry);
+      return;
+    }
+
   self->dirty = TRUE;
+  g_atomic_int_inc (&self->generation);
+
+  if (self->journal_fd >= 0)
+    {
+      append_journal_record (self->journal_pending, id, entry);
+      append_journal_record (self->journal_tail, id, entry);
+    }
 
   old_entry = permission_db_lookup (self, id);
 
+  if (self->value_index)
+    {
+      if (old_entry)
+        value_index_remove (self, id, old_entry);
+      if (entry)
+        value_index_add (self, id, entry);
+    }
+
   g_hash_table_insert (self->main_updates,
                        g_strdup (id),
                        permission_db_entry_ref (entry));
@@ -716,16 +1295,109 @@ permission_db_set_entry (PermissionDb      *self,
     }
 }
 
+/* Like permission_db_set_entry(), but the entry is only kept in memory
+ * until it is removed or the db is freed. The id must not be used by
+ * a regular entry. Later set_entry() calls for the id also stay in
+ * memory. */
+void
+permission_db_set_volatile_entry (PermissionDb      *self,
+                                  const char        *id,
+                                  PermissionDbEntry *entry)
+{
+  g_autoptr(PermissionDbEntry) old_entry = NULL;
+  const char **apps;
+  int i;
+
+  g_return_if_fail (PERMISSION_IS_DB (self));
+  g_return_if_fail (id != NULL);
+
+  g_atomic_int_inc (&self->generation);
+
+  old_entry = g_hash_table_lookup (self->volatile_entries, id);
+  if (old_entry)
+    permission_db_entry_ref (old_entry);
+
+  if (self->value_index)
+    {
+      if (old_entry)
+        value_index_remove (self, id, old_entry);
+      if (entry)
+        value_index_add (self, id, entry);
+    }
+
+  if (old_entry)
+    {
+      g_autofree const char **old_apps = permission_db_entry_list_apps (old_entry);
+
+      for (i = 0; old_apps[i] != NULL; i++)
+        {
+          GHashTable *set = g_hash_table_lookup (self->volatile_apps, old_apps[i]);
+
+          if (set == NULL)
+            continue;
+
+          g_hash_table_remove (set, id);
+          if (g_hash_table_size (set) == 0)
+            g_hash_table_remove (self->volatile_apps, old_apps[i]);
+        }
+    }
+
+  if (entry == NULL)
+    {
+      g_hash_table_remove (self->volatile_entries, id);
+      return;
+    }
+
+  g_hash_table_insert (self->volatile_entries,
+                       g_strdup (id),
+                       permission_db_entry_ref (entry));
+
+  apps = permission_db_entry_list_apps (entry);
+  for (i = 0; apps[i] != NULL; i++)
+    g_hash_table_add (ensure_id_set (self->volatile_apps, apps[i]), g_strdup (id));
+  g_free (apps);
+}
+
+static gboolean
+app_has_updates (PermissionDb *self,
+                 const char   *app)
+{
+  return !app_update_empty (self->app_additions, app) ||
+         !app_update_empty (self->app_removals, app);
+}
+
+static void
+add_app_ids_item (GHashTable *apps_h,
+                  const char *app,
+                  char      **app_ids)
+{
+  GVariantBuilder builder;
+  GvdbItem *item;
+  int j;
+
+  /* May as well ensure that on-disk arrays are sorted, even if we don't use it yet */
+  sort_strv ((const char **) app_ids);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
+  for (j = 0; app_ids[j] != NULL; j++)
+    g_variant_builder_add (&builder, "s", app_ids[j]);
+
+  item = gvdb_hash_table_insert (apps_h, app);
+  gvdb_item_set_value (item, g_variant_builder_end (&builder));
+}
+
+/* Serializes the current state and makes it the new base. Entries
+ * and apps that have not changed since the last update are copied
+ * as-is from the old tables, so only the changed ids need any lookup
+ * or merging. */
 void
 permission_db_update (PermissionDb *self)
 {
   GHashTable *root, *main_h, *apps_h;
   GBytes *new_contents;
   GvdbTable *new_gvdb;
-  int i;
-
-  g_auto(GStrv) ids = NULL;
-  g_auto(GStrv) apps = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
 
   g_return_if_fail (PERMISSION_IS_DB (self));
 
@@ -735,51 +1407,123 @@ permission_db_update (PermissionDb *self)
   g_hash_table_unref (main_h);
   g_hash_table_unref (apps_h);
 
-  ids = permission_db_list_ids (self);
-  for (i = 0; ids[i] != 0; i++)
+  if (self->main_table)
     {
-      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (self, ids[i]);
-      if (entry != NULL)
+      g_autoptr(GString) id = g_string_new (NULL);
+      GvdbTableIter gvdb_iter;
+      const char *name;
+      gsize name_length;
+
+      gvdb_table_iter_init (&gvdb_iter, self->main_table);
+      while (gvdb_table_iter_next (&gvdb_iter, &name, &name_length))
         {
+          g_autoptr(GVariant) entry = NULL;
           GvdbItem *item;
 
-          item = gvdb_hash_table_insert (main_h, ids[i]);
-          gvdb_item_set_value (item, (GVariant *) entry);
+          gvdb_key_to_string (id, name, name_length);
+
+          if (g_hash_table_contains (self->main_updates, id->str))
+            continue;
+
+          entry = gvdb_table_iter_get_value (&gvdb_iter);
+          if (entry == NULL)
+            continue;
+
+          item = gvdb_hash_table_insert (main_h, id->str);
+          gvdb_item_set_value (item, entry);
         }
     }
 
-  apps = permission_db_list_apps (self);
-  for (i = 0; apps[i] != 0; i++)
+  g_hash_table_iter_init (&iter, self->main_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      g_auto(GStrv) app_ids = permission_db_list_ids_by_app (self, apps[i]);
-      GVariantBuilder builder;
       GvdbItem *item;
-      int j;
 
-      /* May as well ensure that on-disk arrays are sorted, even if we don't use it yet */
-      sort_strv ((const char **) app_ids);
+      if (value == NULL)
+        continue;
 
-      /* We should never list an app that has empty id lists */
-      g_assert (app_ids[0] != NULL);
+      item = gvdb_hash_table_insert (main_h, key);
+      gvdb_item_set_value (item, (GVariant *) value);
+    }
 
-      g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
-      for (j = 0; app_ids[j] != NULL; j++)
-        g_variant_builder_add (&builder, "s", app_ids[j]);
+  if (self->app_table)
+    {
+      g_autoptr(GString) app = g_string_new (NULL);
+      GvdbTableIter gvdb_iter;
+      const char *name;
+      gsize name_length;
+
+      gvdb_table_iter_init (&gvdb_iter, self->app_table);
+      while (gvdb_table_iter_next (&gvdb_iter, &name, &name_length))
+        {
+          gvdb_key_to_string (app, name, name_length);
+
+          if (app_has_updates (self, app->str))
+            {
+              g_auto(GStrv) app_ids = list_ids_by_app (self, app->str, FALSE);
+
+              if (app_ids[0] != NULL)
+                add_app_ids_item (apps_h, app->str, app_ids);
+            }
+          else
+            {
+              g_autoptr(GVariant) ids_v = gvdb_table_iter_get_value (&gvdb_iter);
+              GvdbItem *item;
+
+              if (ids_v == NULL)
+                continue;
+
+              item = gvdb_hash_table_insert (apps_h, app->str);
+              gvdb_item_set_value (item, ids_v);
+            }
+        }
+    }
+
+  /* Apps that are new since the last update */
+  g_hash_table_iter_init (&iter, self->app_additions);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GHashTable *additions = value;
+      g_auto(GStrv) app_ids = NULL;
+
+      if (g_hash_table_size (additions) == 0)
+        continue;
 
-      item = gvdb_hash_table_insert (apps_h, apps[i]);
-      gvdb_item_set_value (item, g_variant_builder_end (&builder));
+      if (self->app_table && gvdb_table_has_value (self->app_table, key))
+        continue;
+
+      app_ids = list_ids_by_app (self, key, FALSE);
+      add_app_ids_item (apps_h, key, app_ids);
     }
 
   new_contents = gvdb_table_get_content (root, FALSE);
+  g_hash_table_unref (root);
+  /* We just serialized this from validated data, no need to check it */
   new_gvdb = gvdb_table_new_from_bytes (new_contents, TRUE, NULL);
 
   /* This was just created, any failure to parse it is purely an internal error */
   g_assert (new_gvdb != NULL);
 
+  g_clear_pointer (&self->main_table, gvdb_table_free);
+  g_clear_pointer (&self->app_table, gvdb_table_free);
   g_clear_pointer (&self->gvdb_contents, g_bytes_unref);
   g_clear_pointer (&self->gvdb, gvdb_table_free);
   self->gvdb_contents = new_contents;
   self->gvdb = new_gvdb;
+
+  /* Rebase on the new tables, so that the next update only has to
+   * deal with what changes from now on. */
+  self->main_table = gvdb_table_get_table (self->gvdb, "main");
+  self->app_table = gvdb_table_get_table (self->gvdb, "apps");
+  g_assert (self->main_table != NULL && self->app_table != NULL);
+
+  g_hash_table_remove_all (self->main_updates);
+  g_hash_table_remove_all (self->app_additions);
+  g_hash_table_remove_all (self->app_removals);
+
+  /* From now on, the journal only needs what comes after this */
+  g_byte_array_set_size (self->journal_tail, 0);
+
   self->dirty = FALSE;
 }
 
@@ -882,6 +1626,155 @@ permission_db_save_content_finish (PermissionDb    *self,
 }
 
 
+/* Starts logging all changes to a journal file next to the db file.
+ * Changes are made durable with permission_db_sync_journal(), and
+ * when the journal has grown too big they can be folded into the db
+ * by updating, saving and then calling permission_db_reset_journal(). */
+gboolean
+permission_db_open_journal (PermissionDb *self,
+                            GError      **error)
+{
+  g_autofree char *journal_path = NULL;
+  int fd;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  if (self->path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No path set");
+      return FALSE;
+    }
+
+  if (self->journal_fd >= 0)
+    return TRUE;
+
+  journal_path = get_journal_path (self);
+  fd = open (journal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Unable to open %s: %s", journal_path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  /* Drop any partial record left behind by a crash */
+  if (ftruncate (fd, self->journal_size) != 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Unable to truncate %s: %s", journal_path, g_strerror (errsv));
+      close (fd);
+      return FALSE;
+    }
+
+  self->journal_fd = fd;
+
+  return TRUE;
+}
+
+gsize
+permission_db_get_journal_size (PermissionDb *self)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), 0);
+
+  return self->journal_size;
+}
+
+gboolean
+permission_db_sync_journal (PermissionDb *self,
+                            GError      **error)
+{
+  gsize written = 0;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  if (self->journal_fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No journal open");
+      return FALSE;
+    }
+
+  while (written < self->journal_pending->len)
+    {
+      ssize_t res = write (self->journal_fd,
+                           self->journal_pending->data + written,
+                           self->journal_pending->len - written);
+      if (res < 0)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+
+          /* Don't leave half a record behind */
+          if (ftruncate (self->journal_fd, self->journal_size) != 0)
+            g_debug ("Unable to drop partial journal record: %s", g_strerror (errno));
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Unable to write journal: %s", g_strerror (errsv));
+          return FALSE;
+        }
+
+      written += res;
+    }
+
+  if (written > 0 && fdatasync (self->journal_fd) != 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Unable to sync journal: %s", g_strerror (errsv));
+      return FALSE;
+    }
+
+  self->journal_size += written;
+  g_byte_array_set_size (self->journal_pending, 0);
+
+  return TRUE;
+}
+
+/* Call after the content from the last permission_db_update() has been
+ * saved. This replaces the journal with only the changes made since. */
+gboolean
+permission_db_reset_journal (PermissionDb *self,
+                             GError      **error)
+{
+  g_autofree char *journal_path = NULL;
+  int fd;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  if (self->journal_fd < 0)
+    return TRUE;
+
+  journal_path = get_journal_path (self);
+  if (!g_file_set_contents (journal_path,
+                            (const char *) self->journal_tail->data,
+                            self->journal_tail->len,
+                            error))
+    return FALSE;
+
+  fd = open (journal_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Unable to open %s: %s", journal_path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  close (self->journal_fd);
+  self->journal_fd = fd;
+  self->journal_size = self->journal_tail->len;
+
+  /* Everything pending is either in the saved db or in the tail */
+  g_byte_array_set_size (self->journal_pending, 0);
+
+  return TRUE;
+}
+
 GString *
 permission_db_print_string (PermissionDb *self,
                             GString   *string)
@@ -1022,9 +1915,12 @@ permission_db_entry_get_permissions_variant (PermissionDbEntry *entry,
       g_variant_get_child (child, 0, "&s", &child_app_id);
 
       cmp = strcmp (app_id, child_app_id);
+      if (cmp == 0)
+        res = g_variant_get_child_value (child, 1);
+      g_variant_unref (child);
+
       if (cmp == 0)
         {
-          res = g_variant_get_child_value (child, 1);
           break;
         }
       else if (cmp < 0)
@@ -1066,6 +1962,51 @@ permission_db_entry_list_permissions (PermissionDbEntry *entry,
     return g_new0 (const char *, 1);
 }
 
+/* Returns the "as" permissions of @app as stored in the entry, without
+ * copying them, or %NULL if the entry has none for @app. Unlike
+ * permission_db_entry_list_permissions() this tells an app with an
+ * empty list from one that isn't in the entry. */
+GVariant *
+permission_db_entry_dup_app_permissions (PermissionDbEntry *entry,
+                                         const char        *app)
+{
+  return permission_db_entry_get_permissions_variant (entry, app);
+}
+
+/* Maps the permissions of @app to a bitmask, where a permission equal
+ * to names[i] sets bit i. Unknown permissions are ignored. Unlike
+ * permission_db_entry_list_permissions() this allocates no strings. */
+guint32
+permission_db_entry_get_permission_flags (PermissionDbEntry  *entry,
+                                          const char         *app,
+                                          const char * const *names)
+{
+  g_autoptr(GVariant) permissions = NULL;
+  GVariantIter iter;
+  const char *permission;
+  guint32 flags = 0;
+  int i;
+
+  permissions = permission_db_entry_get_permissions_variant (entry, app);
+  if (permissions == NULL)
+    return 0;
+
+  g_variant_iter_init (&iter, permissions);
+  while (g_variant_iter_next (&iter, "&s", &permission))
+    {
+      for (i = 0; names[i] != NULL; i++)
+        {
+          if (strcmp (permission, names[i]) == 0)
+            {
+              flags |= 1 << i;
+              break;
+            }
+        }
+    }
+
+  return flags;
+}
+
 gboolean
 permission_db_entry_has_permission (PermissionDbEntry *entry,
                                     const char     *app,
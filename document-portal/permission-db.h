@@ -53,9 +53,28 @@ GString *      permission_db_print_string (PermissionDb *self,
 char *         permission_db_print (PermissionDb *self);
 
 gboolean       permission_db_is_dirty (PermissionDb *self);
+gboolean       permission_db_is_on_nfs (PermissionDb *self);
+guint          permission_db_get_generation (PermissionDb *self);
+guint          permission_db_get_n_updates (PermissionDb *self);
+
+typedef struct {
+  guint64 updates;           /* Entries changed since the last update */
+  guint64 updates_bytes;
+  guint64 app_changes;       /* Ids added to or removed from apps */
+  guint64 app_changes_bytes;
+  guint64 journal_bytes;     /* Journal records buffered in memory */
+  guint64 content_bytes;     /* Size of the gvdb file content */
+} PermissionDbMemoryUsage;
+
+void           permission_db_get_memory_usage (PermissionDb            *self,
+                                               PermissionDbMemoryUsage *usage);
+PermissionDb * permission_db_dup_snapshot (PermissionDb *self);
 void           permission_db_set_entry (PermissionDb      *self,
                                         const char     *id,
                                         PermissionDbEntry *entry);
+void           permission_db_set_volatile_entry (PermissionDb      *self,
+                                                 const char        *id,
+                                                 PermissionDbEntry *entry);
 void           permission_db_update (PermissionDb *self);
 GBytes *       permission_db_get_content (PermissionDb *self);
 const char *   permission_db_get_path (PermissionDb *self);
@@ -70,6 +89,13 @@ gboolean       permission_db_save_content_finish (PermissionDb    *self,
                                                   GError      **error);
 void           permission_db_set_path (PermissionDb  *self,
                                        const char *path);
+gboolean       permission_db_open_journal (PermissionDb *self,
+                                           GError      **error);
+gsize          permission_db_get_journal_size (PermissionDb *self);
+gboolean       permission_db_sync_journal (PermissionDb *self,
+                                           GError      **error);
+gboolean       permission_db_reset_journal (PermissionDb *self,
+                                            GError      **error);
 
 
 PermissionDbEntry  *permission_db_entry_ref (PermissionDbEntry *entry);
@@ -78,6 +104,11 @@ GVariant *      permission_db_entry_get_data (PermissionDbEntry *entry);
 const char **   permission_db_entry_list_apps (PermissionDbEntry *entry);
 const char **   permission_db_entry_list_permissions (PermissionDbEntry *entry,
                                                       const char     *app);
+GVariant *      permission_db_entry_dup_app_permissions (PermissionDbEntry *entry,
+                                                         const char        *app);
+guint32         permission_db_entry_get_permission_flags (PermissionDbEntry  *entry,
+                                                          const char         *app,
+                                                          const char * const *names);
 gboolean        permission_db_entry_has_permission (PermissionDbEntry *entry,
                                                     const char     *app,
                                                     const char     *permission);
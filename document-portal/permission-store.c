@@ -28,6 +28,12 @@
 #include "permission-store-dbus.h"
 #include "xdg-permission-store.h"
 
+static gboolean opt_verbose;
+static gboolean opt_replace;
+static gboolean opt_version;
+static gboolean opt_no_peer;
+static int opt_writeout_delay = -1;
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
@@ -41,6 +47,12 @@ on_name_acquired (GDBusConnection *connection,
                   const gchar     *name,
                   gpointer         user_data)
 {
+  g_autoptr(GError) error = NULL;
+
+  /* Only once we own the name, so we don't take over the socket of
+   * an instance that keeps running */
+  if (!opt_no_peer && !xdg_permission_store_listen_peer (&error))
+    g_warning ("No peer socket: %s", error->message);
 }
 
 static void
@@ -52,14 +64,12 @@ on_name_lost (GDBusConnection *connection,
   exit (1);
 }
 
-static gboolean opt_verbose;
-static gboolean opt_replace;
-static gboolean opt_version;
-
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
+  { "writeout-delay", 0, 0, G_OPTION_ARG_INT, &opt_writeout_delay, "Collect writes for MSEC milliseconds before saving", "MSEC" },
+  { "no-peer", 0, 0, G_OPTION_ARG_NONE, &opt_no_peer, "Don't serve peers on the private socket", NULL },
   { NULL }
 };
 
@@ -118,6 +128,9 @@ main (int    argc,
 
   g_set_prgname (argv[0]);
 
+  if (opt_writeout_delay >= 0)
+    xdg_permission_store_set_writeout_delay (opt_writeout_delay);
+
   owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
                              "org.freedesktop.impl.portal.PermissionStore",
                              G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | (opt_replace ? G_BUS_NAME_OWNER_FLAGS_REPLACE : 0),
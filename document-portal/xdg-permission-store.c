@@ -23,6 +23,10 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include "permission-store-dbus.h"
 #include "xdg-permission-store.h"
@@ -31,6 +35,28 @@
 
 GHashTable *tables = NULL;
 
+static XdgPermissionStore *store;
+static GDBusServer *peer_server;
+
+/* Fold the journal into the db file once it grows past this */
+#define JOURNAL_COMPACT_SIZE (256 * 1024)
+
+/* ... or when a table has seen no writes for this long */
+#define IDLE_FLUSH_SECONDS 10
+
+/* On NFS, rewriting the db file costs a round trip per block and the
+ * rename, while appending to the journal is cheap, so the journal is
+ * allowed to grow much further before it is folded in */
+#define JOURNAL_COMPACT_SIZE_NFS (4 * 1024 * 1024)
+#define IDLE_FLUSH_SECONDS_NFS 300
+
+/* Tables that haven't been used for this long are closed, and
+ * loaded again when they are next needed */
+#define TABLE_UNLOAD_SECONDS 60
+
+/* How long to collect writes before flushing them together, in ms */
+static guint writeout_delay = 5;
+
 typedef struct
 {
   char      *name;
@@ -38,6 +64,13 @@ typedef struct
   GList     *outstanding_writes;
   GList     *current_writes;
   gboolean   writing;
+  gboolean   journal;
+  gsize      journal_compact_size;
+  guint      idle_flush_seconds;
+  guint      flush_timeout;
+  guint      idle_timeout;
+  guint      unload_timeout;
+  gint64     last_used;
 } Table;
 
 static void start_writeout (Table *table);
@@ -45,11 +78,39 @@ static void start_writeout (Table *table);
 static void
 table_free (Table *table)
 {
+  if (table->flush_timeout)
+    g_source_remove (table->flush_timeout);
+  if (table->idle_timeout)
+    g_source_remove (table->idle_timeout);
+  if (table->unload_timeout)
+    g_source_remove (table->unload_timeout);
   g_free (table->name);
   g_object_unref (table->db);
   g_free (table);
 }
 
+static gboolean
+unload_timeout_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  /* Keep tables that are in use or have changes that aren't in the db file yet */
+  if (table->writing ||
+      table->outstanding_writes != NULL ||
+      table->flush_timeout != 0 ||
+      table->idle_timeout != 0 ||
+      permission_db_is_dirty (table->db) ||
+      g_get_monotonic_time () - table->last_used < TABLE_UNLOAD_SECONDS * G_USEC_PER_SEC)
+    return G_SOURCE_CONTINUE;
+
+  g_debug ("Unloading idle table %s", table->name);
+
+  table->unload_timeout = 0;
+  g_hash_table_remove (tables, table->name);
+
+  return G_SOURCE_REMOVE;
+}
+
 static Table *
 lookup_table (const char            *name,
               GDBusMethodInvocation *invocation)
@@ -63,7 +124,10 @@ lookup_table (const char            *name,
 
   table = g_hash_table_lookup (tables, name);
   if (table != NULL)
-    return table;
+    {
+      table->last_used = g_get_monotonic_time ();
+      return table;
+    }
 
   dir = g_build_filename (g_get_user_data_dir (), "flatpak/db", NULL);
   g_mkdir_with_parents (dir, 0755);
@@ -82,11 +146,34 @@ lookup_table (const char            *name,
   table->name = g_strdup (name);
   table->db = db;
 
+  if (permission_db_open_journal (db, &error))
+    table->journal = TRUE;
+  else
+    g_warning ("Unable to open journal for table %s, writing full db instead: %s",
+               name, error->message);
+
+  if (table->journal && permission_db_is_on_nfs (db))
+    {
+      g_debug ("Table %s is on NFS, folding the journal in less often", name);
+      table->journal_compact_size = JOURNAL_COMPACT_SIZE_NFS;
+      table->idle_flush_seconds = IDLE_FLUSH_SECONDS_NFS;
+    }
+  else
+    {
+      table->journal_compact_size = JOURNAL_COMPACT_SIZE;
+      table->idle_flush_seconds = IDLE_FLUSH_SECONDS;
+    }
+
+  table->last_used = g_get_monotonic_time ();
+  table->unload_timeout = g_timeout_add_seconds (TABLE_UNLOAD_SECONDS, unload_timeout_cb, table);
+
   g_hash_table_insert (tables, table->name, table);
 
   return table;
 }
 
+static void flush_table (Table *table);
+
 static void
 writeout_done (GObject      *source_object,
                GAsyncResult *res,
@@ -100,6 +187,15 @@ writeout_done (GObject      *source_object,
 
   ok = permission_db_save_content_finish (table->db, res, &error);
 
+  if (ok && table->journal)
+    {
+      g_autoptr(GError) journal_error = NULL;
+
+      if (!permission_db_reset_journal (table->db, &journal_error))
+        g_warning ("Unable to reset journal for table %s: %s",
+                   table->name, journal_error->message);
+    }
+
   for (l = table->current_writes; l != NULL; l = l->next)
     {
       GDBusMethodInvocation *invocation = l->data;
@@ -117,8 +213,8 @@ writeout_done (GObject      *source_object,
   table->current_writes = NULL;
   table->writing = FALSE;
 
-  if (table->outstanding_writes != NULL)
-    start_writeout (table);
+  if (table->outstanding_writes != NULL && table->flush_timeout == 0)
+    flush_table (table);
 }
 
 static void
@@ -134,14 +230,83 @@ start_writeout (Table *table)
   permission_db_save_content_async (table->db, NULL, writeout_done, table);
 }
 
+static void
+flush_table (Table *table)
+{
+  if (table->journal)
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (permission_db_sync_journal (table->db, &error))
+        {
+          GList *l;
+
+          for (l = table->outstanding_writes; l != NULL; l = l->next)
+            g_dbus_method_invocation_return_value (l->data, g_variant_new ("()"));
+          g_clear_pointer (&table->outstanding_writes, g_list_free);
+
+          if (!table->writing &&
+              permission_db_get_journal_size (table->db) > table->journal_compact_size)
+            start_writeout (table);
+
+          return;
+        }
+
+      g_warning ("Unable to write journal for table %s, writing full db instead: %s",
+                 table->name, error->message);
+    }
+
+  /* If a write is in progress, writeout_done() picks up the rest */
+  if (!table->writing)
+    start_writeout (table);
+}
+
+static gboolean
+flush_timeout_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  table->flush_timeout = 0;
+  flush_table (table);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+idle_flush_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  table->idle_timeout = 0;
+
+  /* Nothing is going on, so bring the db file itself up to date */
+  if (!table->writing && permission_db_is_dirty (table->db))
+    {
+      g_debug ("Flushing idle table %s", table->name);
+      start_writeout (table);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 ensure_writeout (Table                 *table,
                  GDBusMethodInvocation *invocation)
 {
   table->outstanding_writes = g_list_prepend (table->outstanding_writes, invocation);
 
-  if (!table->writing)
-    start_writeout (table);
+  if (table->idle_timeout)
+    g_source_remove (table->idle_timeout);
+  table->idle_timeout = g_timeout_add_seconds (table->idle_flush_seconds, idle_flush_cb, table);
+
+  /* Collect everything that arrives within the window into one flush */
+  if (table->flush_timeout != 0)
+    return;
+
+  if (writeout_delay == 0)
+    flush_table (table);
+  else
+    table->flush_timeout = g_timeout_add (writeout_delay, flush_timeout_cb, table);
 }
 
 static gboolean
@@ -221,6 +386,281 @@ handle_lookup (XdgPermissionStore     *object,
   return TRUE;
 }
 
+static gboolean
+handle_get_permission (XdgPermissionStore     *object,
+                       GDBusMethodInvocation  *invocation,
+                       const gchar            *table_name,
+                       const gchar            *id,
+                       const gchar            *app)
+{
+  Table *table;
+  GVariantBuilder builder;
+
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GVariant) permissions = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  entry = permission_db_lookup (table->db, id);
+  if (entry == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                                             "No entry for %s", id);
+      return TRUE;
+    }
+
+  data = permission_db_entry_get_data (entry);
+  permissions = permission_db_entry_dup_app_permissions (entry, app);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+  if (permissions)
+    g_variant_builder_add (&builder, "{s@as}", app, permissions);
+
+  xdg_permission_store_complete_get_permission (object, invocation,
+                                                g_variant_builder_end (&builder),
+                                                g_variant_new_variant (data));
+
+  return TRUE;
+}
+
+static gboolean
+handle_lookup_many (XdgPermissionStore     *object,
+                    GDBusMethodInvocation  *invocation,
+                    const gchar            *table_name,
+                    const gchar * const    *ids)
+{
+  Table *table;
+  GVariantBuilder builder;
+  int i;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(a{sas}v)}"));
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+      g_autoptr(GVariant) data = NULL;
+      g_autoptr(GVariant) permissions = NULL;
+
+      entry = permission_db_lookup (table->db, ids[i]);
+      if (entry == NULL)
+        continue;
+
+      data = permission_db_entry_get_data (entry);
+      permissions = get_app_permissions (entry);
+
+      g_variant_builder_add (&builder, "{s(@a{sas}v)}", ids[i], permissions, data);
+    }
+
+  xdg_permission_store_complete_lookup_many (object, invocation,
+                                             g_variant_builder_end (&builder));
+
+  return TRUE;
+}
+
+/* Clients can subscribe to the changes of one table, optionally
+ * for one app only, instead of listening to every Changed broadcast.
+ * Their signals are sent to them alone. */
+typedef struct
+{
+  char     *table;
+  char     *app;     /* "" for all apps */
+  gboolean  compact; /* Only send the permissions of the changed app */
+} Subscription;
+
+typedef struct
+{
+  char      *name;
+  guint      watch_id;
+  GPtrArray *subscriptions;
+} Subscriber;
+
+static GHashTable *subscribers; /* unique name -> Subscriber */
+
+static void
+subscription_free (Subscription *subscription)
+{
+  g_free (subscription->table);
+  g_free (subscription->app);
+  g_free (subscription);
+}
+
+static void
+subscriber_free (Subscriber *subscriber)
+{
+  g_bus_unwatch_name (subscriber->watch_id);
+  g_ptr_array_unref (subscriber->subscriptions);
+  g_free (subscriber->name);
+  g_free (subscriber);
+}
+
+static void
+subscriber_vanished (GDBusConnection *connection,
+                     const char      *name,
+                     gpointer         user_data)
+{
+  g_hash_table_remove (subscribers, name);
+}
+
+static gboolean
+strv_equal (const char **a,
+            const char **b)
+{
+  int i;
+
+  for (i = 0; a[i] != NULL && b[i] != NULL; i++)
+    {
+      if (strcmp (a[i], b[i]) != 0)
+        return FALSE;
+    }
+
+  return a[i] == NULL && b[i] == NULL;
+}
+
+static gboolean
+app_permissions_changed (PermissionDbEntry *old_entry,
+                         PermissionDbEntry *new_entry,
+                         const char        *app)
+{
+  g_autofree const char **old_perms = NULL;
+  g_autofree const char **new_perms = NULL;
+  const char *none[] = { NULL };
+
+  if (old_entry)
+    old_perms = permission_db_entry_list_permissions (old_entry, app);
+  if (new_entry)
+    new_perms = permission_db_entry_list_permissions (new_entry, app);
+
+  return !strv_equal (old_perms ? old_perms : none, new_perms ? new_perms : none);
+}
+
+/* Apps whose permissions differ between the two entries */
+static GPtrArray *
+list_changed_apps (PermissionDbEntry *old_entry,
+                   PermissionDbEntry *new_entry)
+{
+  GPtrArray *changed = g_ptr_array_new ();
+  g_autofree const char **old_apps = NULL;
+  g_autofree const char **new_apps = NULL;
+  int i;
+
+  if (new_entry)
+    {
+      new_apps = permission_db_entry_list_apps (new_entry);
+      for (i = 0; new_apps[i] != NULL; i++)
+        if (app_permissions_changed (old_entry, new_entry, new_apps[i]))
+          g_ptr_array_add (changed, (char *) new_apps[i]);
+    }
+
+  if (old_entry)
+    {
+      old_apps = permission_db_entry_list_apps (old_entry);
+      for (i = 0; old_apps[i] != NULL; i++)
+        {
+          g_autofree const char **perms = NULL;
+
+          /* Apps still in the new entry were handled above */
+          if (new_entry)
+            perms = permission_db_entry_list_permissions (new_entry, old_apps[i]);
+          if (perms == NULL || perms[0] == NULL)
+            {
+              if (app_permissions_changed (old_entry, new_entry, old_apps[i]))
+                g_ptr_array_add (changed, (char *) old_apps[i]);
+            }
+        }
+    }
+
+  return changed;
+}
+
+static void
+notify_subscribers (XdgPermissionStore *object,
+                    const char         *table_name,
+                    const char         *id,
+                    gboolean            deleted,
+                    PermissionDbEntry  *old_entry,
+                    PermissionDbEntry  *new_entry,
+                    GVariant           *data,
+                    GVariant           *permissions)
+{
+  GDBusConnection *connection;
+  g_autoptr(GPtrArray) changed = NULL;
+  GHashTableIter iter;
+  Subscriber *subscriber;
+  guint i, j;
+
+  if (subscribers == NULL || g_hash_table_size (subscribers) == 0)
+    return;
+
+  connection = g_dbus_interface_skeleton_get_connection (G_DBUS_INTERFACE_SKELETON (object));
+  if (connection == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, subscribers);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &subscriber))
+    {
+      gboolean sent_full = FALSE;
+
+      for (i = 0; i < subscriber->subscriptions->len; i++)
+        {
+          Subscription *subscription = g_ptr_array_index (subscriber->subscriptions, i);
+
+          if (strcmp (subscription->table, table_name) != 0)
+            continue;
+
+          if (changed == NULL)
+            changed = list_changed_apps (old_entry, new_entry);
+
+          for (j = 0; j < changed->len; j++)
+            {
+              const char *app = g_ptr_array_index (changed, j);
+
+              if (subscription->app[0] != '\0' && strcmp (subscription->app, app) != 0)
+                continue;
+
+              if (subscription->compact)
+                {
+                  g_autofree const char **perms = NULL;
+                  const char *none[] = { NULL };
+
+                  if (new_entry)
+                    perms = permission_db_entry_list_permissions (new_entry, app);
+
+                  g_dbus_connection_emit_signal (connection,
+                                                 subscriber->name,
+                                                 "/org/freedesktop/impl/portal/PermissionStore",
+                                                 "org.freedesktop.impl.portal.PermissionStore",
+                                                 "AppPermissionsChanged",
+                                                 g_variant_new ("(sss^as)",
+                                                                table_name, id, app,
+                                                                perms ? perms : none),
+                                                 NULL);
+                }
+              else if (!sent_full)
+                {
+                  g_dbus_connection_emit_signal (connection,
+                                                 subscriber->name,
+                                                 "/org/freedesktop/impl/portal/PermissionStore",
+                                                 "org.freedesktop.impl.portal.PermissionStore",
+                                                 "Changed",
+                                                 g_variant_new ("(ssbv@a{sas})",
+                                                                table_name, id, deleted,
+                                                                data, permissions),
+                                                 NULL);
+                  sent_full = TRUE;
+                }
+            }
+        }
+    }
+}
+
 static void
 emit_deleted (XdgPermissionStore     *object,
               const gchar            *table_name,
@@ -238,6 +678,7 @@ emit_deleted (XdgPermissionStore     *object,
                                      TRUE,
                                      g_variant_new_variant (data),
                                      permissions);
+  notify_subscribers (object, table_name, id, TRUE, entry, NULL, data, permissions);
 }
 
 
@@ -245,6 +686,7 @@ static void
 emit_changed (XdgPermissionStore     *object,
               const gchar            *table_name,
               const gchar            *id,
+              PermissionDbEntry      *old_entry,
               PermissionDbEntry         *entry)
 {
   g_autoptr(GVariant) data = NULL;
@@ -258,6 +700,101 @@ emit_changed (XdgPermissionStore     *object,
                                      FALSE,
                                      g_variant_new_variant (data),
                                      permissions);
+  notify_subscribers (object, table_name, id, FALSE, old_entry, entry, data, permissions);
+}
+
+static gboolean
+handle_subscribe (XdgPermissionStore     *object,
+                  GDBusMethodInvocation  *invocation,
+                  const gchar            *table_name,
+                  const gchar            *app,
+                  gboolean                compact)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+  Subscriber *subscriber;
+  Subscription *subscription;
+  guint i;
+
+  /* Peer connections have no names to watch or signal */
+  if (sender == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+                                             "Subscriptions need a bus connection");
+      return TRUE;
+    }
+
+  subscriber = g_hash_table_lookup (subscribers, sender);
+  if (subscriber == NULL)
+    {
+      subscriber = g_new0 (Subscriber, 1);
+      subscriber->name = g_strdup (sender);
+      subscriber->subscriptions = g_ptr_array_new_with_free_func ((GDestroyNotify) subscription_free);
+      subscriber->watch_id = g_bus_watch_name_on_connection (g_dbus_method_invocation_get_connection (invocation),
+                                                             sender,
+                                                             G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                             NULL,
+                                                             subscriber_vanished,
+                                                             NULL, NULL);
+      g_hash_table_insert (subscribers, subscriber->name, subscriber);
+    }
+
+  for (i = 0; i < subscriber->subscriptions->len; i++)
+    {
+      subscription = g_ptr_array_index (subscriber->subscriptions, i);
+      if (strcmp (subscription->table, table_name) == 0 &&
+          strcmp (subscription->app, app) == 0)
+        {
+          subscription->compact = compact;
+          xdg_permission_store_complete_subscribe (object, invocation);
+          return TRUE;
+        }
+    }
+
+  subscription = g_new0 (Subscription, 1);
+  subscription->table = g_strdup (table_name);
+  subscription->app = g_strdup (app);
+  subscription->compact = compact;
+  g_ptr_array_add (subscriber->subscriptions, subscription);
+
+  xdg_permission_store_complete_subscribe (object, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_unsubscribe (XdgPermissionStore     *object,
+                    GDBusMethodInvocation  *invocation,
+                    const gchar            *table_name,
+                    const gchar            *app)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+  Subscriber *subscriber = NULL;
+  guint i;
+
+  if (sender != NULL)
+    subscriber = g_hash_table_lookup (subscribers, sender);
+  if (subscriber)
+    {
+      for (i = 0; i < subscriber->subscriptions->len; i++)
+        {
+          Subscription *subscription = g_ptr_array_index (subscriber->subscriptions, i);
+
+          if (strcmp (subscription->table, table_name) == 0 &&
+              strcmp (subscription->app, app) == 0)
+            {
+              g_ptr_array_remove_index_fast (subscriber->subscriptions, i);
+              break;
+            }
+        }
+
+      if (subscriber->subscriptions->len == 0)
+        g_hash_table_remove (subscribers, sender);
+    }
+
+  xdg_permission_store_complete_unsubscribe (object, invocation);
+
+  return TRUE;
 }
 
 static gboolean
@@ -318,7 +855,7 @@ handle_delete_permission (XdgPermissionStore     *object,
 
   new_entry = permission_db_entry_remove_app_permissions (entry, app);
   permission_db_set_entry (table->db, id, new_entry);
-  emit_changed (object, table_name, id, new_entry);
+  emit_changed (object, table_name, id, entry, new_entry);
 
   ensure_writeout (table, invocation);
 
@@ -376,7 +913,7 @@ handle_set (XdgPermissionStore     *object,
     }
 
   permission_db_set_entry (table->db, id, new_entry);
-  emit_changed (object, table_name, id, new_entry);
+  emit_changed (object, table_name, id, old_entry, new_entry);
 
   ensure_writeout (table, invocation);
 
@@ -419,7 +956,65 @@ handle_set_permission (XdgPermissionStore     *object,
 
   new_entry = permission_db_entry_set_app_permissions (entry, app, (const char **) permissions);
   permission_db_set_entry (table->db, id, new_entry);
-  emit_changed (object, table_name, id, new_entry);
+  emit_changed (object, table_name, id, entry, new_entry);
+
+  ensure_writeout (table, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_set_many (XdgPermissionStore     *object,
+                 GDBusMethodInvocation  *invocation,
+                 const gchar            *table_name,
+                 gboolean                create,
+                 GVariant               *permissions)
+{
+  Table *table;
+  GVariantIter iter;
+  const char *id;
+  const char *app;
+  const char **perms;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  /* Check everything first, so a failure doesn't leave a partial change */
+  if (!create)
+    {
+      g_variant_iter_init (&iter, permissions);
+      while (g_variant_iter_next (&iter, "(&s&s^a&s)", &id, &app, &perms))
+        {
+          g_autoptr(PermissionDbEntry) entry = permission_db_lookup (table->db, id);
+
+          g_free (perms);
+          if (entry == NULL)
+            {
+              g_dbus_method_invocation_return_error (invocation,
+                                                     XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                                                     "Id %s not found", id);
+              return TRUE;
+            }
+        }
+    }
+
+  g_variant_iter_init (&iter, permissions);
+  while (g_variant_iter_next (&iter, "(&s&s^a&s)", &id, &app, &perms))
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+      g_autoptr(PermissionDbEntry) new_entry = NULL;
+
+      entry = permission_db_lookup (table->db, id);
+      if (entry == NULL)
+        entry = permission_db_entry_new (NULL);
+
+      new_entry = permission_db_entry_set_app_permissions (entry, app, perms);
+      permission_db_set_entry (table->db, id, new_entry);
+      emit_changed (object, table_name, id, entry, new_entry);
+
+      g_free (perms);
+    }
 
   ensure_writeout (table, invocation);
 
@@ -467,35 +1062,47 @@ handle_set_value (XdgPermissionStore     *object,
     }
 
   permission_db_set_entry (table->db, id, new_entry);
-  emit_changed (object, table_name, id, new_entry);
+  emit_changed (object, table_name, id, entry, new_entry);
 
   ensure_writeout (table, invocation);
 
   return TRUE;
 }
 
+void
+xdg_permission_store_set_writeout_delay (guint msec)
+{
+  writeout_delay = msec;
+}
+
 void
 xdg_permission_store_start (GDBusConnection *connection)
 {
-  XdgPermissionStore *store;
   GError *error = NULL;
 
   g_debug ("Starting permission store");
 
   tables = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                  g_free, (GDestroyNotify) table_free);
+                                  NULL, (GDestroyNotify) table_free);
+  subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       NULL, (GDestroyNotify) subscriber_free);
 
   store = xdg_permission_store_skeleton_new ();
 
-  xdg_permission_store_set_version (XDG_PERMISSION_STORE (store), 2);
+  xdg_permission_store_set_version (XDG_PERMISSION_STORE (store), 5);
 
   g_signal_connect (store, "handle-list", G_CALLBACK (handle_list), NULL);
   g_signal_connect (store, "handle-lookup", G_CALLBACK (handle_lookup), NULL);
+  g_signal_connect (store, "handle-lookup-many", G_CALLBACK (handle_lookup_many), NULL);
+  g_signal_connect (store, "handle-get-permission", G_CALLBACK (handle_get_permission), NULL);
   g_signal_connect (store, "handle-set", G_CALLBACK (handle_set), NULL);
   g_signal_connect (store, "handle-set-permission", G_CALLBACK (handle_set_permission), NULL);
+  g_signal_connect (store, "handle-set-many", G_CALLBACK (handle_set_many), NULL);
   g_signal_connect (store, "handle-set-value", G_CALLBACK (handle_set_value), NULL);
   g_signal_connect (store, "handle-delete", G_CALLBACK (handle_delete), NULL);
   g_signal_connect (store, "handle-delete-permission", G_CALLBACK (handle_delete_permission), NULL);
+  g_signal_connect (store, "handle-subscribe", G_CALLBACK (handle_subscribe), NULL);
+  g_signal_connect (store, "handle-unsubscribe", G_CALLBACK (handle_unsubscribe), NULL);
 
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (store),
                                          connection,
@@ -506,3 +1113,110 @@ xdg_permission_store_start (GDBusConnection *connection)
       g_error_free (error);
     }
 }
+
+static gboolean
+authorize_peer (GDBusAuthObserver *observer,
+                GIOStream         *stream,
+                GCredentials      *credentials,
+                gpointer           user_data)
+{
+  return credentials != NULL &&
+         g_credentials_get_unix_user (credentials, NULL) == getuid ();
+}
+
+static void
+peer_closed (GDBusConnection *connection,
+             gboolean         remote_peer_vanished,
+             GError          *error,
+             gpointer         user_data)
+{
+  g_debug ("Peer connection closed");
+  g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (store),
+                                                      connection);
+  g_object_unref (connection);
+}
+
+static gboolean
+new_peer_connection (GDBusServer     *server,
+                     GDBusConnection *connection,
+                     gpointer         user_data)
+{
+  GCredentials *credentials = g_dbus_connection_get_peer_credentials (connection);
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GError) error = NULL;
+  pid_t pid;
+
+  pid = credentials ? g_credentials_get_unix_pid (credentials, NULL) : -1;
+  if (pid > 0)
+    app_info = xdp_get_app_info_from_pid (pid, &error);
+
+  /* Sandboxed apps must not reach the store at all */
+  if (app_info == NULL || !xdp_app_info_is_host (app_info))
+    {
+      g_debug ("Rejecting peer connection from pid %d", (int) pid);
+      return FALSE;
+    }
+
+  if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (store),
+                                         connection,
+                                         "/org/freedesktop/impl/portal/PermissionStore",
+                                         &error))
+    {
+      g_warning ("Failed to export permission store to peer: %s", error->message);
+      return FALSE;
+    }
+
+  g_debug ("New peer connection from pid %d", (int) pid);
+  g_signal_connect (connection, "closed", G_CALLBACK (peer_closed), NULL);
+  g_object_ref (connection);
+
+  return TRUE;
+}
+
+/* Serves the store to same-user, unsandboxed peers on XDG_PERMISSION_STORE_PEER_SOCKET,
+ * saving them the round trip through the bus daemon. Change signals
+ * still go to the bus, and subscriptions need it. */
+gboolean
+xdg_permission_store_listen_peer (GError **error)
+{
+  g_autoptr(GDBusAuthObserver) observer = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *address = NULL;
+  g_autofree char *guid = NULL;
+
+  g_return_val_if_fail (store != NULL, FALSE);
+
+  if (peer_server != NULL)
+    return TRUE;
+
+  path = g_build_filename (g_get_user_runtime_dir (), XDG_PERMISSION_STORE_PEER_SOCKET, NULL);
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Failed to create %s: %s", dir, g_strerror (errsv));
+      return FALSE;
+    }
+
+  /* Left over from a previous instance, or one we are replacing */
+  g_unlink (path);
+
+  address = g_strdup_printf ("unix:path=%s", path);
+  guid = g_dbus_generate_guid ();
+  observer = g_dbus_auth_observer_new ();
+  g_signal_connect (observer, "authorize-authenticated-peer", G_CALLBACK (authorize_peer), NULL);
+
+  peer_server = g_dbus_server_new_sync (address, G_DBUS_SERVER_FLAGS_NONE,
+                                        guid, observer, NULL, error);
+  if (peer_server == NULL)
+    return FALSE;
+
+  g_signal_connect (peer_server, "new-connection", G_CALLBACK (new_peer_connection), NULL);
+  g_dbus_server_start (peer_server);
+
+  g_debug ("Listening for peers on %s", path);
+
+  return TRUE;
+}
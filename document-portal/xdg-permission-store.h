@@ -21,6 +21,12 @@
 #ifndef __FLATPAK_PERMISSION_STORE_H__
 #define __FLATPAK_PERMISSION_STORE_H__
 
+/* Private socket for same-user peers that want to skip the bus,
+ * relative to the user runtime dir */
+#define XDG_PERMISSION_STORE_PEER_SOCKET "xdg-permission-store/peer"
+
+void xdg_permission_store_set_writeout_delay (guint msec);
 void xdg_permission_store_start (GDBusConnection *connection);
+gboolean xdg_permission_store_listen_peer (GError **error);
 
 #endif /* __FLATPAK_PERMISSION_STORE_H__ */
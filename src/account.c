@@ -127,6 +127,8 @@ get_user_information_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_account_call_get_user_information_finish (XDP_IMPL_ACCOUNT (source),
                                                           &response,
                                                           &results,
@@ -143,7 +145,7 @@ get_user_information_done (GObject *source,
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static gboolean
@@ -176,26 +178,13 @@ handle_get_user_information (XdpAccount *object,
 {
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
-  g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder options;
 
   g_debug ("Handling GetUserInformation");
 
   REQUEST_AUTOLOCK (request);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
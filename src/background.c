@@ -22,6 +22,7 @@
 
 #include <string.h>
 #include <glib/gi18n.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 #include <gio/gdesktopappinfo.h>
 
@@ -44,9 +45,10 @@
  * We determine this condition by getting per-application
  * state from the compositor, and comparing that list to
  * the list of running flatpak instances obtained from
- * $XDG_RUNTIME_DIR/.flatpak/. A thread is comparing
- * this list every minute, and if it finds an app that
- * is in the background twice, we take actions:
+ * $XDG_RUNTIME_DIR/.flatpak/. A thread compares these
+ * lists whenever either of them changes, and if it finds
+ * an app that stays in the background for longer than a
+ * grace period, we take actions:
  * - if the permission is NO, we kill it
  * - if the permission is YES or ASK, we notify the user
  *
@@ -79,7 +81,6 @@ struct _BackgroundClass
 static XdpImplAccess *access_impl;
 static XdpImplBackground *background_impl;
 static Background *background;
-static GFileMonitor *instance_monitor;
 
 GType background_get_type (void) G_GNUC_CONST;
 static void background_iface_init (XdpBackgroundIface *iface);
@@ -111,25 +112,13 @@ get_all_permissions (void)
   return g_steal_pointer (&out_perms);
 }
 
+static void queue_check (void);
+
 static Permission
-get_one_permission (const char *app_id,
-                    GVariant   *perms)
+parse_permission (const char  *app_id,
+                  const char **permissions)
 {
-  const char **permissions;
-
-  if (perms == NULL)
-    {
-      g_debug ("No background permissions found");
-
-      return PERMISSION_UNSET;
-    }
-  else if (!g_variant_lookup (perms, app_id, "^a&s", &permissions))
-    {
-      g_debug ("No background permissions stored for: app %s", app_id);
-
-      return PERMISSION_UNSET;
-    }
-  else if (g_strv_length ((char **)permissions) != 1)
+  if (g_strv_length ((char **)permissions) != 1)
     {
       g_autofree char *a = g_strjoinv (" ", (char **)permissions);
       g_warning ("Wrong background permission format, ignoring (%s)", a);
@@ -153,16 +142,121 @@ get_one_permission (const char *app_id,
   return PERMISSION_UNSET;
 }
 
-static Permission
-get_permission (const char *app_id)
+/* The background permission table, indexed by app ID. It is loaded
+ * once and then kept current from the permission store's Changed
+ * signal.
+ *
+ * Apps whose permission or state changed are collected in changed_apps,
+ * so a check only needs to look at their instances again.
+ */
+static GHashTable *permission_table;
+static GHashTable *changed_apps;
+G_LOCK_DEFINE_STATIC (permissions);
+
+/* Called with the permissions lock held */
+static void
+mark_app_changed (const char *app_id)
+{
+  g_hash_table_add (changed_apps, g_strdup (app_id));
+}
+
+/* Called with the permissions lock held */
+static void
+load_permissions (GVariant *perms)
+{
+  g_autoptr(GHashTable) old = g_steal_pointer (&permission_table);
+  GVariantIter iter;
+  const char *app_id;
+  const char **app_permissions;
+  GHashTableIter old_iter;
+  gpointer value;
+
+  permission_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (perms)
+    {
+      g_variant_iter_init (&iter, perms);
+      while (g_variant_iter_next (&iter, "{&s^a&s}", &app_id, &app_permissions))
+        {
+          Permission permission = parse_permission (app_id, app_permissions);
+
+          g_hash_table_insert (permission_table, g_strdup (app_id), GINT_TO_POINTER (permission));
+          g_free (app_permissions);
+        }
+    }
+
+  if (old == NULL)
+    return;
+
+  g_hash_table_iter_init (&old_iter, permission_table);
+  while (g_hash_table_iter_next (&old_iter, (gpointer *)&app_id, &value))
+    {
+      if (!g_hash_table_lookup_extended (old, app_id, NULL, NULL) ||
+          g_hash_table_lookup (old, app_id) != value)
+        mark_app_changed (app_id);
+    }
+
+  g_hash_table_iter_init (&old_iter, old);
+  while (g_hash_table_iter_next (&old_iter, (gpointer *)&app_id, NULL))
+    {
+      if (!g_hash_table_contains (permission_table, app_id))
+        mark_app_changed (app_id);
+    }
+}
+
+static void
+permission_store_changed (XdpImplPermissionStore *store,
+                          const char             *table,
+                          const char             *id,
+                          gboolean                deleted,
+                          GVariant               *data,
+                          GVariant               *perms,
+                          gpointer                user_data)
+{
+  if (strcmp (table, PERMISSION_TABLE) != 0 || strcmp (id, PERMISSION_ID) != 0)
+    return;
+
+  G_LOCK (permissions);
+  /* Until the table is first needed, there is nothing to update */
+  if (permission_table)
+    load_permissions (deleted ? NULL : perms);
+  G_UNLOCK (permissions);
+
+  queue_check ();
+}
+
+/* Called with the permissions lock held, which is dropped while
+ * the table is read from the permission store */
+static void
+ensure_permission_table (void)
 {
   g_autoptr(GVariant) perms = NULL;
 
+  if (permission_table)
+    return;
+
+  G_UNLOCK (permissions);
   perms = get_all_permissions ();
-  if (perms)
-    return get_one_permission (app_id, perms);
+  G_LOCK (permissions);
 
-  return PERMISSION_UNSET;
+  if (permission_table == NULL)
+    load_permissions (perms);
+}
+
+static Permission
+get_permission (const char *app_id)
+{
+  Permission permission;
+
+  G_LOCK (permissions);
+  ensure_permission_table ();
+  permission = GPOINTER_TO_INT (g_hash_table_lookup (permission_table, app_id));
+  G_UNLOCK (permissions);
+
+  if (permission == PERMISSION_UNSET)
+    g_debug ("No background permissions stored for: app %s", app_id);
+
+  return permission;
 }
 
 static void
@@ -196,7 +290,103 @@ set_permission (const char *app_id,
     {
       g_dbus_error_strip_remote_error (error);
       g_warning ("Error updating permission store: %s", error->message);
+      return;
     }
+
+  /* Don't wait for the Changed signal */
+  G_LOCK (permissions);
+  if (permission_table)
+    g_hash_table_insert (permission_table, g_strdup (app_id), GINT_TO_POINTER (permission));
+  G_UNLOCK (permissions);
+}
+
+static void
+permission_write_failed (GError *error)
+{
+  g_dbus_error_strip_remote_error (error);
+  g_warning ("Error updating permission store: %s", error->message);
+
+  /* Read the table again, rather than keeping what didn't make it */
+  G_LOCK (permissions);
+  g_clear_pointer (&permission_table, g_hash_table_unref);
+  G_UNLOCK (permissions);
+}
+
+static void
+set_many_done (GObject      *source,
+               GAsyncResult *result,
+               gpointer      data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!xdp_impl_permission_store_call_set_many_finish (XDP_IMPL_PERMISSION_STORE (source),
+                                                       result, &error))
+    permission_write_failed (error);
+}
+
+static void
+set_permission_done (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!xdp_impl_permission_store_call_set_permission_finish (XDP_IMPL_PERMISSION_STORE (source),
+                                                             result, &error))
+    permission_write_failed (error);
+}
+
+/* Gives all of app_ids the same permission with one store update,
+ * without waiting for it. Lookups see the new permission right away. */
+static void
+set_permissions_in_background (GPtrArray  *app_ids,
+                               Permission  permission)
+{
+  XdpImplPermissionStore *store = get_permission_store ();
+  g_auto(GStrv) perms = permissions_from_tristate (permission);
+  GVariantBuilder builder;
+  guint i;
+
+  if (app_ids->len == 0 || perms == NULL)
+    return;
+
+  G_LOCK (permissions);
+  if (permission_table)
+    {
+      for (i = 0; i < app_ids->len; i++)
+        g_hash_table_insert (permission_table,
+                             g_strdup (g_ptr_array_index (app_ids, i)),
+                             GINT_TO_POINTER (permission));
+    }
+  G_UNLOCK (permissions);
+
+  if (xdp_impl_permission_store_get_version (store) < 3)
+    {
+      for (i = 0; i < app_ids->len; i++)
+        xdp_impl_permission_store_call_set_permission (store,
+                                                       PERMISSION_TABLE,
+                                                       TRUE,
+                                                       PERMISSION_ID,
+                                                       g_ptr_array_index (app_ids, i),
+                                                       (const char * const *) perms,
+                                                       NULL,
+                                                       set_permission_done,
+                                                       NULL);
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  for (i = 0; i < app_ids->len; i++)
+    g_variant_builder_add (&builder, "(ss^as)",
+                           PERMISSION_ID, g_ptr_array_index (app_ids, i), perms);
+
+  xdp_impl_permission_store_call_set_many (store,
+                                           PERMISSION_TABLE,
+                                           TRUE,
+                                           g_variant_builder_end (&builder),
+                                           NULL,
+                                           set_many_done,
+                                           NULL);
 }
 
 typedef enum {
@@ -253,17 +443,17 @@ handle_request_background_in_thread_func (GTask *task,
       guint32 response = 2;
       g_autoptr(GVariant) results = NULL;
       g_autoptr(GError) error = NULL;
-      g_autoptr(GAppInfo) info = NULL;
+      g_autofree char *name = NULL;
 
-      info = xdp_app_info_load_app_info (request->app_info);
+      name = xdp_get_app_display_name (app_id);
 
-      title = g_strdup_printf (_("Allow %s to run in the background?"), info ? g_app_info_get_display_name (info) : app_id);
+      title = g_strdup_printf (_("Allow %s to run in the background?"), name);
       if (reason)
         subtitle = g_strdup (reason);
       else if (autostart_requested)
-        subtitle = g_strdup_printf (_("%s requests to be started automatically and run in the background."), info ? g_app_info_get_display_name (info) : app_id);
+        subtitle = g_strdup_printf (_("%s requests to be started automatically and run in the background."), name);
       else
-        subtitle = g_strdup_printf (_("%s requests to run in the background."), info ? g_app_info_get_display_name (info) : app_id);
+        subtitle = g_strdup_printf (_("%s requests to run in the background."), name);
       body = g_strdup (_("The ‘run in background’ permission can be changed at any time from the application settings."));
 
       g_debug ("Calling backend for background access for: %s", app_id);
@@ -398,7 +588,6 @@ handle_request_background (XdpBackground *object,
 {
   Request *request = request_from_invocation (invocation);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   g_autoptr(GTask) task = NULL;
   GVariantBuilder opt_builder;
   g_autoptr(GVariant) options = NULL;
@@ -419,25 +608,14 @@ handle_request_background (XdpBackground *object,
   g_object_set_data_full (G_OBJECT (request), "window", g_strdup (arg_window), g_free);
   g_object_set_data_full (G_OBJECT (request), "options", g_variant_ref (options), (GDestroyNotify)g_variant_unref);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (access_impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (access_impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (access_impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   xdp_background_complete_request_background (object, invocation, request->id);
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_request_background_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG, handle_request_background_in_thread_func);
 
   return TRUE;
 }
@@ -466,27 +644,52 @@ background_class_init (BackgroundClass *klass)
  * We rely on the RunningApplicationsChanged signal from the backend to get
  * notified about applications that start or stop having open windows, and on
  * file monitoring to learn about flatpak instances appearing and disappearing.
+ * Instances that exit are noticed through a pidfd where available.
  *
- * When either of these changes happens, we wake up the background monitor
- * thread, and it will do a check the state of applications a few times, with
- * a few seconds of wait in between. When we find an application in the background
- * more than once, we check the permissions, and kill or notify if warranted.
+ * When either of these changes happens, the monitor thread checks the state
+ * of applications. An application that is found in the background gets a
+ * grace period, and only if it is still in the background when that runs
+ * out do we check the permissions, and kill or notify if warranted.
  *
- * We require an application to be in background state for more than once check
- * to avoid killing an unlucky application that just happend to start up as we
- * did our check.
+ * The grace period avoids killing an unlucky application that just happend
+ * to start up as we did our check.
  */
 
+#define DEFAULT_GRACE_SECONDS 30
+
+/* Bursts of changes are collected for this long before checking */
+#define CHECK_DELAY_MS 500
+
+static guint grace_seconds = DEFAULT_GRACE_SECONDS;
+
+void
+background_set_grace_period (guint seconds)
+{
+  grace_seconds = seconds;
+}
+
 typedef enum { BACKGROUND, RUNNING, ACTIVE } AppState;
 
-static GHashTable *
-get_app_states (void)
+/* app ID -> AppState, as last reported by the backend. Only the
+ * monitor thread touches it. It is fetched again after the backend
+ * emits RunningApplicationsChanged.
+ */
+static GHashTable *app_states;
+static int app_states_dirty = TRUE;
+
+static gboolean
+update_app_states (void)
 {
   g_autoptr(GVariant) apps = NULL;
-  g_autoptr(GHashTable) app_states = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) old = NULL;
   const char *appid;
   GVariant *value;
   g_autoptr(GError) error = NULL;
+  GHashTableIter iter;
+  gpointer state;
+
+  if (!g_atomic_int_compare_and_exchange (&app_states_dirty, TRUE, FALSE))
+    return app_states != NULL;
 
   if (!xdp_impl_background_call_get_app_state_sync (background_impl, &apps, NULL, &error))
     {
@@ -498,22 +701,46 @@ get_app_states (void)
           warned = 1;
         }
 
-      return NULL;
+      g_atomic_int_set (&app_states_dirty, TRUE);
+      return app_states != NULL;
     }
 
-  g_autoptr(GVariantIter) iter = g_variant_iter_new (apps);
-  while (g_variant_iter_loop (iter, "{&sv}", &appid, &value))
+  old = g_steal_pointer (&app_states);
+  app_states = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  g_autoptr(GVariantIter) apps_iter = g_variant_iter_new (apps);
+  while (g_variant_iter_loop (apps_iter, "{&sv}", &appid, &value))
     {
-      AppState state = g_variant_get_uint32 (value);
-      g_hash_table_insert (app_states, g_strdup (appid), GINT_TO_POINTER (state));
+      AppState app_state = g_variant_get_uint32 (value);
+      g_hash_table_insert (app_states, g_strdup (appid), GINT_TO_POINTER (app_state));
     }
 
-  return g_steal_pointer (&app_states);
+  if (old == NULL)
+    return TRUE;
+
+  G_LOCK (permissions);
+
+  g_hash_table_iter_init (&iter, app_states);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&appid, &state))
+    {
+      if (g_hash_table_lookup (old, appid) != state)
+        mark_app_changed (appid);
+    }
+
+  g_hash_table_iter_init (&iter, old);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&appid, &state))
+    {
+      if (!g_hash_table_contains (app_states, appid))
+        mark_app_changed (appid);
+    }
+
+  G_UNLOCK (permissions);
+
+  return TRUE;
 }
 
 static AppState
-get_one_app_state (const char *app_id,
-                   GHashTable *app_states)
+get_one_app_state (const char *app_id)
 {
   return (AppState)GPOINTER_TO_INT (g_hash_table_lookup (app_states, app_id));
 }
@@ -525,13 +752,41 @@ typedef struct {
   char *handle;
   gboolean notified;
   Permission permission;
+
+  /* Owned by the monitor thread */
+  GSource *grace_source;
+  gboolean grace_expired;
+  GSource *exit_source;
+
+  /* New, or its grace period ran out since the last check */
+  gboolean needs_check;
 } InstanceData;
 
+static void
+clear_source (GSource **source)
+{
+  if (*source)
+    {
+      g_source_destroy (*source);
+      g_clear_pointer (source, g_source_unref);
+    }
+}
+
+/* Instances without a pidfd, which are only found to be gone when
+ * they are missing from a check. Protected by the applications lock. */
+static guint n_unwatched_instances;
+
 static void
 instance_data_free (gpointer data)
 {
   InstanceData *idata = data;
 
+  if (idata->exit_source == NULL)
+    n_unwatched_instances--;
+
+  clear_source (&idata->grace_source);
+  clear_source (&idata->exit_source);
+
   g_object_unref (idata->instance);
   g_free (idata->handle);
 
@@ -558,6 +813,106 @@ close_notification (const char *handle)
                           NULL, NULL, NULL);
 }
 
+static GMainContext *monitor_context;
+static int check_queued;
+
+static gboolean
+check_background_apps_cb (gpointer data);
+
+/* May be called from any thread */
+static void
+queue_check (void)
+{
+  g_autoptr(GSource) source = NULL;
+
+  if (!g_atomic_int_compare_and_exchange (&check_queued, FALSE, TRUE))
+    return;
+
+  source = g_timeout_source_new (CHECK_DELAY_MS);
+  g_source_set_callback (source, check_background_apps_cb, NULL, NULL);
+  g_source_attach (source, monitor_context);
+}
+
+static gboolean
+grace_period_expired (gpointer data)
+{
+  InstanceData *idata = data;
+
+  G_LOCK (applications);
+  g_clear_pointer (&idata->grace_source, g_source_unref);
+  idata->grace_expired = TRUE;
+  idata->needs_check = TRUE;
+  G_UNLOCK (applications);
+
+  queue_check ();
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Called with the applications lock held */
+static void
+start_grace_period (InstanceData *idata)
+{
+  if (idata->grace_source || idata->grace_expired)
+    return;
+
+  idata->grace_source = g_timeout_source_new_seconds (grace_seconds);
+  g_source_set_callback (idata->grace_source, grace_period_expired, idata, NULL);
+  g_source_attach (idata->grace_source, monitor_context);
+}
+
+/* Called with the applications lock held */
+static void
+stop_grace_period (InstanceData *idata)
+{
+  clear_source (&idata->grace_source);
+  idata->grace_expired = FALSE;
+}
+
+static gboolean
+instance_exited (int          fd,
+                 GIOCondition condition,
+                 gpointer     data)
+{
+  g_autofree char *id = g_strdup (data);
+  g_autofree char *handle = NULL;
+  InstanceData *idata;
+
+  G_LOCK (applications);
+  idata = g_hash_table_lookup (applications, id);
+  if (idata)
+    {
+      g_debug ("Instance %s exited", id);
+      handle = g_steal_pointer (&idata->handle);
+      g_hash_table_remove (applications, id);
+    }
+  G_UNLOCK (applications);
+
+  if (handle)
+    close_notification (handle);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Called with the applications lock held */
+static void
+watch_instance_exit (InstanceData *idata,
+                     const char   *id)
+{
+  int pidfd = flatpak_instance_get_pidfd (idata->instance);
+
+  if (pidfd < 0)
+    {
+      n_unwatched_instances++;
+      return;
+    }
+
+  idata->exit_source = g_unix_fd_source_new (pidfd, G_IO_IN);
+  g_source_set_callback (idata->exit_source, (GSourceFunc) instance_exited,
+                         g_strdup (id), g_free);
+  g_source_attach (idata->exit_source, monitor_context);
+}
+
 static void
 remove_outdated_instances (int stamp)
 {
@@ -567,13 +922,21 @@ remove_outdated_instances (int stamp)
   g_autoptr(GPtrArray) handles = NULL;
   int i;
 
+  G_LOCK (applications);
+
+  /* Instances with a pidfd are removed by instance_exited() */
+  if (n_unwatched_instances == 0)
+    {
+      G_UNLOCK (applications);
+      return;
+    }
+
   handles = g_ptr_array_new_with_free_func (g_free);
 
-  G_LOCK (applications);
   g_hash_table_iter_init (&iter, applications);
   while (g_hash_table_iter_next (&iter, (gpointer *)&id, (gpointer *)&data))
     {
-      if (data->stamp < stamp)
+      if (data->exit_source == NULL && data->stamp < stamp)
         {
           if (data->handle)
             g_ptr_array_add (handles, g_strdup (data->handle));
@@ -589,25 +952,6 @@ remove_outdated_instances (int stamp)
     }
 }
 
-static char *
-flatpak_instance_get_display_name (FlatpakInstance *instance)
-{
-  const char *app_id = flatpak_instance_get_app (instance);
-  if (app_id[0] != 0)
-    {
-      g_autofree char *desktop_id = NULL;
-      g_autoptr(GAppInfo) info = NULL;
-
-      desktop_id = g_strconcat (app_id, ".desktop", NULL);
-      info = (GAppInfo*)g_desktop_app_info_new (desktop_id);
-
-      if (info)
-        return g_strdup (g_app_info_get_display_name (info));
-    }
-
-  return g_strdup (app_id);
-}
-
 typedef struct {
   char *handle;
   char *app_id;
@@ -704,20 +1048,24 @@ notify_background_done (GObject *source,
 static void
 check_background_apps (void)
 {
-  g_autoptr(GVariant) perms = NULL;
-  g_autoptr(GHashTable) app_states = NULL;
+  g_autoptr(GHashTable) changed = NULL;
   g_autoptr(GPtrArray) instances = NULL;
   int i;
   static int stamp;
   g_autoptr(GPtrArray) notifications = NULL;
+  g_autoptr(GPtrArray) notified_apps = NULL;
 
-  app_states = get_app_states ();
-  if (app_states == NULL)
+  if (!update_app_states ())
     return;
 
   g_debug ("Checking background permissions");
 
-  perms = get_all_permissions ();
+  G_LOCK (permissions);
+  ensure_permission_table ();
+  changed = g_steal_pointer (&changed_apps);
+  changed_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  G_UNLOCK (permissions);
+
   instances = flatpak_instance_get_all ();
   notifications = g_ptr_array_new ();
 
@@ -732,7 +1080,6 @@ check_background_apps (void)
       pid_t child_pid;
       InstanceData *idata;
       const char *state_names[] = { "background", "running", "active" };
-      gboolean is_new = FALSE;
 
       if (!flatpak_instance_is_running (instance))
         continue;
@@ -748,31 +1095,47 @@ check_background_apps (void)
 
       if (!idata)
         {
-          is_new = TRUE;
           idata = g_new0 (InstanceData, 1);
           idata->instance = g_object_ref (instance);
+          idata->needs_check = TRUE;
+          watch_instance_exit (idata, id);
           g_hash_table_insert (applications, g_strdup (id), idata);
         }
 
       idata->stamp = stamp;
-      idata->state = get_one_app_state (app_id, app_states);
+
+      /* Nothing to do for instances whose app didn't change */
+      if (!idata->needs_check && !g_hash_table_contains (changed, app_id))
+        continue;
+
+      idata->needs_check = FALSE;
+      idata->state = get_one_app_state (app_id);
 
       g_debug ("App %s is %s", app_id, state_names[idata->state]);
 
-      idata->permission = get_one_permission (app_id, perms);
+      idata->permission = get_permission (app_id);
+
+      if (idata->state != BACKGROUND)
+        {
+          stop_grace_period (idata);
+          continue;
+        }
 
-      /* If the app is not in the list yet, add it,
-       * but don't notify yet - this gives apps some
+      if (idata->notified)
+        {
+          g_debug ("Already notified app %s ...skipping\n", app_id);
+          continue;
+        }
+
+      /* Don't act right away - this gives apps some
        * leeway to get their window up. If it is still
-       * in the background next time around, we'll proceed
-       * to the next step.
+       * in the background when the grace period is over,
+       * we'll proceed to the next step.
        */
-      if (idata->state != BACKGROUND || idata->notified || is_new)
+      if (!idata->grace_expired)
         {
-          if (idata->notified)
-            g_debug ("Already notified app %s ...skipping\n", app_id);
-          if (is_new)
-            g_debug ("App %s is new ...skipping\n", app_id);
+          g_debug ("App %s is in the background, waiting %u seconds\n", app_id, grace_seconds);
+          start_grace_period (idata);
           continue;
         }
 
@@ -800,7 +1163,7 @@ check_background_apps (void)
             idata->notified = TRUE;
 
             nd->handle = g_strdup (idata->handle);
-            nd->name = flatpak_instance_get_display_name (instance);
+            nd->name = xdp_get_app_display_name (app_id);
             nd->app_id = g_strdup (app_id);
             nd->id = g_strdup (id);
             nd->child_pid = child_pid;
@@ -817,13 +1180,20 @@ check_background_apps (void)
     }
   G_UNLOCK (applications);
 
+  /* At login many apps may need this at once, so they share one write */
+  notified_apps = g_ptr_array_new ();
   for (i = 0; i < notifications->len; i++)
     {
       NotificationData *nd = g_ptr_array_index (notifications, i);
 
       g_debug ("Tentatively allow background for %s", nd->app_id);
+      g_ptr_array_add (notified_apps, nd->app_id);
+    }
+  set_permissions_in_background (notified_apps, PERMISSION_YES);
 
-      set_permission (nd->app_id, PERMISSION_YES);
+  for (i = 0; i < notifications->len; i++)
+    {
+      NotificationData *nd = g_ptr_array_index (notifications, i);
 
       g_debug ("Notify background for %s", nd->app_id);
 
@@ -839,23 +1209,28 @@ check_background_apps (void)
   remove_outdated_instances (stamp);
 }
 
-static GMainContext *monitor_context;
+static gboolean
+check_background_apps_cb (gpointer data)
+{
+  g_atomic_int_set (&check_queued, FALSE);
+  check_background_apps ();
+
+  return G_SOURCE_REMOVE;
+}
 
 static gpointer
 background_monitor (gpointer data)
 {
-  applications = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                        g_free, instance_data_free);
+  g_autoptr(GMainLoop) loop = NULL;
 
-  while (TRUE)
-    {
-      g_main_context_iteration (monitor_context, TRUE);
-      /* We check twice, to avoid killing unlucky apps hit at a bad time */
-      sleep (30);
-      check_background_apps ();
-      sleep (30);
-      check_background_apps ();
-    }
+  xdp_thread_apply_sched (XDP_THREAD_KIND_MONITOR);
+
+  g_main_context_push_thread_default (monitor_context);
+
+  loop = g_main_loop_new (monitor_context, FALSE);
+  g_main_loop_run (loop);
+
+  g_main_context_pop_thread_default (monitor_context);
 
   g_clear_pointer (&applications, g_hash_table_unref);
   g_clear_pointer (&monitor_context, g_main_context_unref);
@@ -870,23 +1245,29 @@ start_background_monitor (void)
 
   g_debug ("Starting background app monitor");
 
+  applications = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free, instance_data_free);
+  changed_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   monitor_context = g_main_context_new ();
 
   thread = g_thread_new ("background monitor", background_monitor, NULL);
+
+  queue_check ();
 }
 
 static void
 running_apps_changed (gpointer data)
 {
-  g_debug ("Running app windows changed, wake up monitor thread");
-  g_main_context_wakeup (monitor_context);
+  g_debug ("Running app windows changed, check background apps");
+  g_atomic_int_set (&app_states_dirty, TRUE);
+  queue_check ();
 }
 
 static void
 instances_changed (gpointer data)
 {
-  g_debug ("Running instances changed, wake up monitor thread");
-  g_main_context_wakeup (monitor_context);
+  g_debug ("Running instances changed, check background apps");
+  queue_check ();
 }
 
 GDBusInterfaceSkeleton *
@@ -894,8 +1275,6 @@ background_create (GDBusConnection *connection,
                    const char *dbus_name_access,
                    const char *dbus_name_background)
 {
-  g_autofree char *instance_path = NULL;
-  g_autoptr(GFile) instance_dir = NULL;
   g_autoptr(GError) error = NULL;
 
   access_impl = xdp_impl_access_proxy_new_sync (connection,
@@ -931,15 +1310,12 @@ background_create (GDBusConnection *connection,
 
   g_signal_connect (background_impl, "running-applications-changed",
                     G_CALLBACK (running_apps_changed), NULL);
+  g_signal_connect (get_permission_store (), "changed",
+                    G_CALLBACK (permission_store_changed), NULL);
 
   /* FIXME: it would be better if libflatpak had a monitor api for this */
-  instance_path = g_build_filename (g_get_user_runtime_dir (), ".flatpak", NULL);
-  instance_dir = g_file_new_for_path (instance_path);
-  instance_monitor = g_file_monitor_directory (instance_dir, G_FILE_MONITOR_NONE, NULL, &error);
-  if (!instance_monitor)
-    g_warning ("Failed to create a monitor for %s: %s", instance_path, error->message);
-  else
-    g_signal_connect (instance_monitor, "changed", G_CALLBACK (instances_changed), NULL);
+  if (!flatpak_instance_watch_all (G_CALLBACK (instances_changed), NULL, &error))
+    g_warning ("Failed to monitor flatpak instances: %s", error->message);
 
   return G_DBUS_INTERFACE_SKELETON (background);
 }
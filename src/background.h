@@ -26,3 +26,5 @@
 GDBusInterfaceSkeleton * background_create (GDBusConnection *connection,
                                             const char *dbus_name_access,
                                             const char *dbus_name_background);
+
+void background_set_grace_period (guint seconds);
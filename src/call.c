@@ -18,30 +18,95 @@
 
 #include "call.h"
 
+/* Every portal method call gets a Call, so freed ones are kept for
+ * reuse by the thread that frees them. Calls are attached with a
+ * preallocated quark, as g_object_get_data() looks up its key in the
+ * global quark table each time. */
+
+#define CALL_POOL_SIZE 32
+
+typedef struct {
+  Call *calls[CALL_POOL_SIZE];
+  guint n_calls;
+} CallPool;
+
+static GQuark
+call_quark (void)
+{
+  static GQuark quark;
+
+  if (G_UNLIKELY (quark == 0))
+    quark = g_quark_from_static_string ("xdp-call");
+
+  return quark;
+}
+
+static void
+call_pool_free (gpointer data)
+{
+  CallPool *pool = data;
+  guint i;
+
+  for (i = 0; i < pool->n_calls; i++)
+    g_free (pool->calls[i]);
+  g_free (pool);
+}
+
+static GPrivate call_pool = G_PRIVATE_INIT (call_pool_free);
+
+static CallPool *
+get_call_pool (void)
+{
+  CallPool *pool = g_private_get (&call_pool);
+
+  if (pool == NULL)
+    {
+      pool = g_new0 (CallPool, 1);
+      g_private_set (&call_pool, pool);
+    }
+
+  return pool;
+}
+
 static void
 call_free (Call *call)
 {
+  CallPool *pool = get_call_pool ();
+
+  g_clear_object (&call->request);
   xdp_app_info_unref (call->app_info);
   g_free (call->sender);
-  g_free (call);
+
+  if (pool->n_calls < CALL_POOL_SIZE)
+    pool->calls[pool->n_calls++] = call;
+  else
+    g_free (call);
 }
 
-void
+Call *
 call_init_invocation (GDBusMethodInvocation *invocation,
                       XdpAppInfo *app_info)
 {
+  CallPool *pool = get_call_pool ();
   Call *call;
 
-  call = g_new0 (Call, 1);
+  if (pool->n_calls > 0)
+    call = pool->calls[--pool->n_calls];
+  else
+    call = g_new (Call, 1);
+
   call->app_info = xdp_app_info_ref (app_info);
   call->sender = g_strdup (g_dbus_method_invocation_get_sender (invocation));
+  call->request = NULL;
+
+  g_object_set_qdata_full (G_OBJECT (invocation), call_quark (),
+                           call, (GDestroyNotify) call_free);
 
-  g_object_set_data_full (G_OBJECT (invocation), "call",
-                          call, (GDestroyNotify) call_free);
+  return call;
 }
 
 Call *
 call_from_invocation (GDBusMethodInvocation *invocation)
 {
-  return g_object_get_data (G_OBJECT (invocation), "call");
+  return g_object_get_qdata (G_OBJECT (invocation), call_quark ());
 }
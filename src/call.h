@@ -25,9 +25,10 @@ typedef struct _Call
 {
   XdpAppInfo *app_info;
   char *sender;
+  struct _Request *request; /* Set for methods that create a request */
 } Call;
 
-void call_init_invocation (GDBusMethodInvocation *invocation,
+Call *call_init_invocation (GDBusMethodInvocation *invocation,
                            XdpAppInfo *app_info);
 
 Call *call_from_invocation (GDBusMethodInvocation *invocation);
@@ -43,11 +43,23 @@ struct _Camera
   PipeWireRemote *pipewire_remote;
   GSource *pipewire_source;
   GFileMonitor *pipewire_socket_monitor;
-  int64_t connect_timestamps[10];
-  int connect_timestamps_i;
+  int64_t connected_at;
+  guint reconnect_delay;
+  guint reconnect_id;
   GHashTable *cameras;
+  guint update_present_id;
 };
 
+/* Camera nodes come and go in bursts (hotplug, PipeWire restarts), the
+ * property is updated once things settled */
+#define UPDATE_PRESENT_DELAY_MS 250
+
+/* Reconnecting after losing PipeWire backs off from the first to the
+ * last delay, unless the connection lasted for a while */
+#define MIN_RECONNECT_DELAY_MS 500
+#define MAX_RECONNECT_DELAY_MS 30000
+#define STABLE_CONNECTION_USEC (10 * G_USEC_PER_SEC)
+
 struct _CameraClass
 {
   XdpCameraSkeletonClass parent_class;
@@ -131,7 +143,7 @@ handle_access_camera (XdpCamera *object,
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_access_camera_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG, handle_access_camera_in_thread_func);
 
   return TRUE;
 }
@@ -148,9 +160,7 @@ open_pipewire_camera_remote (const char *app_id,
     pw_properties_new ("pipewire.access.portal.app_id", app_id,
                        "pipewire.access.portal.media_roles", "Camera",
                        NULL);
-  remote = pipewire_remote_new_sync (pipewire_properties,
-                                     NULL, NULL, NULL, NULL,
-                                     error);
+  remote = pipewire_remote_new_client_sync (pipewire_properties, error);
   if (!remote)
     return NULL;
 
@@ -161,21 +171,29 @@ open_pipewire_camera_remote (const char *app_id,
   permission_items[0] = PW_PERMISSION_INIT (PW_ID_CORE, PW_PERM_RWX);
   permission_items[1] = PW_PERMISSION_INIT (PW_ID_ANY, 0);
 
-  pw_client_update_permissions (pw_core_get_client(remote->core),
-                                G_N_ELEMENTS (permission_items),
-                                permission_items);
+  pipewire_remote_update_permissions (remote,
+                                      G_N_ELEMENTS (permission_items),
+                                      permission_items);
 
-  pipewire_remote_roundtrip (remote);
+  if (!pipewire_remote_roundtrip (remote, error))
+    {
+      pipewire_remote_destroy (remote);
+      return NULL;
+    }
 
   return remote;
 }
 
-static gboolean
-handle_open_pipewire_remote (XdpCamera *object,
-                             GDBusMethodInvocation *invocation,
-                             GUnixFDList *in_fd_list,
-                             GVariant *arg_options)
+/* Runs in a worker thread: looking up the permission and waiting for
+ * PipeWire shouldn't hold up the bus. */
+static void
+handle_open_pipewire_remote_in_thread_func (GTask *task,
+                                            gpointer source_object,
+                                            gpointer task_data,
+                                            GCancellable *cancellable)
 {
+  XdpCamera *object = source_object;
+  GDBusMethodInvocation *invocation = task_data;
   g_autoptr(XdpAppInfo) app_info = NULL;
   const char *app_id;
   Permission permission;
@@ -185,16 +203,6 @@ handle_open_pipewire_remote (XdpCamera *object,
   g_autoptr(GError) error = NULL;
   PipeWireRemote *remote;
 
-  if (xdp_impl_lockdown_get_disable_camera (lockdown))
-    {
-      g_debug ("Camera access disabled");
-      g_dbus_method_invocation_return_error (invocation,
-                                             XDG_DESKTOP_PORTAL_ERROR,
-                                             XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
-                                             "Camera access disabled");
-      return TRUE;
-    }
-
   app_info = xdp_invocation_lookup_app_info_sync (invocation, NULL, &error);
   app_id = xdp_app_info_get_id (app_info);
   permission = device_get_permission_sync (app_id, "camera");
@@ -204,7 +212,7 @@ handle_open_pipewire_remote (XdpCamera *object,
                                              XDG_DESKTOP_PORTAL_ERROR,
                                              XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
                                              "Permission denied");
-      return TRUE;
+      return;
     }
 
   remote = open_pipewire_camera_remote (app_id, &error);
@@ -215,11 +223,11 @@ handle_open_pipewire_remote (XdpCamera *object,
                                              XDG_DESKTOP_PORTAL_ERROR_FAILED,
                                              "Failed to open PipeWire remote: %s",
                                              error->message);
-      return TRUE;
+      return;
     }
 
   out_fd_list = g_unix_fd_list_new ();
-  fd = pw_core_steal_fd (remote->core);
+  fd = pipewire_remote_steal_fd (remote);
   fd_id = g_unix_fd_list_append (out_fd_list, fd, &error);
   close (fd);
   pipewire_remote_destroy (remote);
@@ -231,12 +239,37 @@ handle_open_pipewire_remote (XdpCamera *object,
                                              XDG_DESKTOP_PORTAL_ERROR_FAILED,
                                              "Failed to append fd: %s",
                                              error->message);
-      return TRUE;
+      return;
     }
 
   xdp_camera_complete_open_pipewire_remote (object, invocation,
                                             out_fd_list,
                                             g_variant_new_handle (fd_id));
+}
+
+static gboolean
+handle_open_pipewire_remote (XdpCamera *object,
+                             GDBusMethodInvocation *invocation,
+                             GUnixFDList *in_fd_list,
+                             GVariant *arg_options)
+{
+  g_autoptr(GTask) task = NULL;
+
+  if (xdp_impl_lockdown_get_disable_camera (lockdown))
+    {
+      g_debug ("Camera access disabled");
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR,
+                                             XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                             "Camera access disabled");
+      return TRUE;
+    }
+
+  task = g_task_new (object, NULL, NULL, NULL);
+  g_task_set_task_data (task, g_object_ref (invocation), g_object_unref);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG,
+                        handle_open_pipewire_remote_in_thread_func);
+
   return TRUE;
 }
 
@@ -247,6 +280,37 @@ camera_iface_init (XdpCameraIface *iface)
   iface->handle_open_pipewire_remote = handle_open_pipewire_remote;
 }
 
+static gboolean
+update_camera_present (gpointer user_data)
+{
+  Camera *camera = user_data;
+  gboolean present = g_hash_table_size (camera->cameras) > 0;
+
+  /* Cameras that show up again on the new connection don't count as
+   * gone, check again once it is up */
+  if (camera->reconnect_id)
+    return G_SOURCE_CONTINUE;
+
+  camera->update_present_id = 0;
+
+  if (xdp_camera_get_is_camera_present (XDP_CAMERA (camera)) != present)
+    xdp_camera_set_is_camera_present (XDP_CAMERA (camera), present);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Restarts the delay, so the update runs once changes stopped */
+static void
+queue_update_camera_present (Camera *camera)
+{
+  if (camera->update_present_id)
+    g_source_remove (camera->update_present_id);
+
+  camera->update_present_id = g_timeout_add (UPDATE_PRESENT_DELAY_MS,
+                                             update_camera_present,
+                                             camera);
+}
+
 static void
 global_added_cb (PipeWireRemote *remote,
                  uint32_t id,
@@ -278,10 +342,8 @@ global_added_cb (PipeWireRemote *remote,
   if (g_strcmp0 (media_role->value, "Camera") != 0)
     return;
 
-  g_hash_table_add (camera->cameras, GINT_TO_POINTER (id));
-
-  xdp_camera_set_is_camera_present (XDP_CAMERA (camera),
-                                    g_hash_table_size (camera->cameras) > 0);
+  if (g_hash_table_add (camera->cameras, GINT_TO_POINTER (id)))
+    queue_update_camera_present (camera);
 }
 
 static void global_removed_cb (PipeWireRemote *remote,
@@ -290,10 +352,36 @@ static void global_removed_cb (PipeWireRemote *remote,
 {
   Camera *camera = user_data;
 
-  g_hash_table_remove (camera->cameras, GINT_TO_POINTER (id));
+  if (g_hash_table_remove (camera->cameras, GINT_TO_POINTER (id)))
+    queue_update_camera_present (camera);
+}
+
+static gboolean
+reconnect_cb (gpointer user_data)
+{
+  Camera *camera = user_data;
+  g_autoptr(GError) error = NULL;
+
+  camera->reconnect_id = 0;
+
+  if (camera->pipewire_remote)
+    return G_SOURCE_REMOVE;
 
-  xdp_camera_set_is_camera_present (XDP_CAMERA (camera),
-                                    g_hash_table_size (camera->cameras) > 0);
+  /* On failure, wait for the PipeWire socket to show up again */
+  if (!create_pipewire_remote (camera, &error))
+    g_warning ("Failed connect to PipeWire: %s", error->message);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_reconnect (Camera *camera)
+{
+  if (camera->reconnect_id)
+    return;
+
+  camera->reconnect_id = g_timeout_add (camera->reconnect_delay, reconnect_cb, camera);
+  camera->reconnect_delay = MIN (camera->reconnect_delay * 2, MAX_RECONNECT_DELAY_MS);
 }
 
 static void
@@ -301,16 +389,19 @@ pipewire_remote_error_cb (gpointer data,
                           gpointer user_data)
 {
   Camera *camera = user_data;
-  g_autoptr(GError) error = NULL;
 
+  /* The node ids won't be valid on the next connection. Cameras that
+   * are still there by then don't cause a property change. */
   g_hash_table_remove_all (camera->cameras);
-  xdp_camera_set_is_camera_present (XDP_CAMERA (camera), FALSE);
+  queue_update_camera_present (camera);
 
   g_clear_pointer (&camera->pipewire_source, g_source_destroy);
   g_clear_pointer (&camera->pipewire_remote, pipewire_remote_destroy);
 
-  if (!create_pipewire_remote (camera, &error))
-    g_warning ("Failed connect to PipeWire: %s", error->message);
+  if (g_get_monotonic_time () - camera->connected_at > STABLE_CONNECTION_USEC)
+    camera->reconnect_delay = MIN_RECONNECT_DELAY_MS;
+
+  schedule_reconnect (camera);
 }
 
 static gboolean
@@ -318,27 +409,6 @@ create_pipewire_remote (Camera *camera,
                         GError **error)
 {
   struct pw_properties *pipewire_properties;
-  const int n_connect_retries = G_N_ELEMENTS (camera->connect_timestamps);
-  int64_t now;
-  int max_retries_ago_i;
-  int64_t max_retries_ago;
-
-  now = g_get_monotonic_time ();
-  camera->connect_timestamps[camera->connect_timestamps_i] = now;
-
-  max_retries_ago_i = (camera->connect_timestamps_i + 1) % n_connect_retries;
-  max_retries_ago = camera->connect_timestamps[max_retries_ago_i];
-
-  camera->connect_timestamps_i =
-    (camera->connect_timestamps_i + 1) % n_connect_retries;
-
-  if (max_retries_ago &&
-      now - max_retries_ago < G_USEC_PER_SEC * 10)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Tried to reconnect to PipeWire too often, giving up");
-      return FALSE;
-    }
 
   pipewire_properties = pw_properties_new ("pipewire.access.portal.is_portal", "true",
                                            "portal.monitor", "Camera",
@@ -354,6 +424,7 @@ create_pipewire_remote (Camera *camera,
 
   camera->pipewire_source =
     pipewire_remote_create_source (camera->pipewire_remote);
+  camera->connected_at = g_get_monotonic_time ();
 
   return TRUE;
 }
@@ -365,8 +436,6 @@ on_pipewire_socket_changed (GFileMonitor *monitor,
                             GFileMonitorEvent event_type,
                             Camera *camera)
 {
-  g_autoptr(GError) error = NULL;
-
   if (event_type != G_FILE_MONITOR_EVENT_CREATED)
     return;
 
@@ -378,8 +447,9 @@ on_pipewire_socket_changed (GFileMonitor *monitor,
 
   g_debug ("PipeWireSocket created, tracking cameras");
 
-  if (!create_pipewire_remote (camera, &error))
-    g_warning ("Failed connect to PipeWire: %s", error->message);
+  /* The socket may be replaced several times while PipeWire
+   * starts up, connect once it settled */
+  schedule_reconnect (camera);
 }
 
 static gboolean
@@ -404,6 +474,7 @@ init_camera_tracker (Camera *camera,
                     camera);
 
   camera->cameras = g_hash_table_new (NULL, NULL);
+  camera->reconnect_delay = MIN_RECONNECT_DELAY_MS;
 
   if (!create_pipewire_remote (camera, &local_error))
     g_warning ("Failed connect to PipeWire: %s", local_error->message);
@@ -416,6 +487,10 @@ camera_finalize (GObject *object)
 {
   Camera *camera = (Camera *)object;
 
+  if (camera->update_present_id)
+    g_source_remove (camera->update_present_id);
+  if (camera->reconnect_id)
+    g_source_remove (camera->reconnect_id);
   g_clear_pointer (&camera->pipewire_source, g_source_destroy);
   g_clear_pointer (&camera->pipewire_remote, pipewire_remote_destroy);
   g_clear_pointer (&camera->cameras, g_hash_table_unref);
@@ -78,6 +78,114 @@ device_get_permission_sync (const char *app_id,
   return get_permission_sync (app_id, PERMISSION_TABLE, device);
 }
 
+static GAppInfo *
+load_desktop_app_info (const char *app_id)
+{
+  g_autofree char *desktop_id = g_strconcat (app_id, ".desktop", NULL);
+
+  return (GAppInfo *) g_desktop_app_info_new (desktop_id);
+}
+
+/* An app info load that runs ahead in the background pool. Whoever
+ * gets to it first does the load, so a busy pool never delays the
+ * dialog by more than loading it inline would. */
+typedef struct {
+  GMutex mutex;
+  GCond cond;
+  char *app_id;
+  gboolean started;
+  gboolean done;
+  GAppInfo *info;
+} AppInfoLoad;
+
+static void
+app_info_load_free (AppInfoLoad *load)
+{
+  g_mutex_clear (&load->mutex);
+  g_cond_clear (&load->cond);
+  g_free (load->app_id);
+  g_clear_object (&load->info);
+  g_free (load);
+}
+
+static void
+load_app_info_in_thread_func (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+  AppInfoLoad *load = task_data;
+  GAppInfo *info;
+
+  g_mutex_lock (&load->mutex);
+  if (load->started)
+    {
+      g_mutex_unlock (&load->mutex);
+      g_task_return_boolean (task, FALSE);
+      return;
+    }
+  load->started = TRUE;
+  g_mutex_unlock (&load->mutex);
+
+  info = load_desktop_app_info (load->app_id);
+
+  g_mutex_lock (&load->mutex);
+  load->info = info;
+  load->done = TRUE;
+  g_cond_broadcast (&load->cond);
+  g_mutex_unlock (&load->mutex);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static GTask *
+start_app_info_load (const char *app_id)
+{
+  GTask *task = g_task_new (NULL, NULL, NULL, NULL);
+  AppInfoLoad *load = g_new0 (AppInfoLoad, 1);
+
+  g_mutex_init (&load->mutex);
+  g_cond_init (&load->cond);
+  load->app_id = g_strdup (app_id);
+  g_task_set_task_data (task, load, (GDestroyNotify) app_info_load_free);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, load_app_info_in_thread_func);
+
+  return task;
+}
+
+static GAppInfo *
+finish_app_info_load (GTask *task)
+{
+  AppInfoLoad *load = g_task_get_task_data (task);
+  GAppInfo *info;
+
+  g_mutex_lock (&load->mutex);
+  if (!load->started)
+    {
+      load->started = TRUE;
+      g_mutex_unlock (&load->mutex);
+      return load_desktop_app_info (load->app_id);
+    }
+
+  while (!load->done)
+    g_cond_wait (&load->cond, &load->mutex);
+  info = g_steal_pointer (&load->info);
+  g_mutex_unlock (&load->mutex);
+
+  return info;
+}
+
+static void
+drop_app_info_load (GTask *task)
+{
+  AppInfoLoad *load = g_task_get_task_data (task);
+
+  /* Not needed after all, skip it if it hasn't run yet */
+  g_mutex_lock (&load->mutex);
+  load->started = TRUE;
+  g_mutex_unlock (&load->mutex);
+}
+
 gboolean
 device_query_permission_sync (const char *app_id,
                               const char *device,
@@ -85,6 +193,13 @@ device_query_permission_sync (const char *app_id,
 {
   Permission permission;
   gboolean allowed;
+  g_autoptr(GTask) app_info_load = NULL;
+
+  /* On first use the permission store has to be asked, and the dialog
+   * that likely follows needs the app info, which can take as long to
+   * load, so both happen at the same time */
+  if (app_id[0] != 0 && !permission_is_cached (PERMISSION_TABLE, device))
+    app_info_load = start_app_info_load (app_id);
 
   permission = device_get_permission_sync (app_id, device);
   if (permission == PERMISSION_ASK || permission == PERMISSION_UNSET)
@@ -97,14 +212,11 @@ device_query_permission_sync (const char *app_id,
       g_autoptr(GVariant) results = NULL;
       g_autoptr(GError) error = NULL;
       g_autoptr(GAppInfo) info = NULL;
-      g_autoptr(XdpImplRequest) impl_request = NULL;
 
-      if (app_id[0] != 0)
-        {
-          g_autofree char *desktop_id;
-          desktop_id = g_strconcat (app_id, ".desktop", NULL);
-          info = (GAppInfo*)g_desktop_app_info_new (desktop_id);
-        }
+      if (app_info_load)
+        info = finish_app_info_load (app_info_load);
+      else if (app_id[0] != 0)
+        info = load_desktop_app_info (app_id);
 
       g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
 
@@ -148,15 +260,7 @@ device_query_permission_sync (const char *app_id,
             subtitle = g_strdup_printf (_("%s wants to use your camera."), g_app_info_get_display_name (info));
         }
 
-      impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                      G_DBUS_PROXY_FLAGS_NONE,
-                                                      g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                      request->id,
-                                                      NULL, &error);
-      if (!impl_request)
-        return FALSE;
-
-      request_set_impl_request (request, impl_request);
+      request_set_impl (request, G_DBUS_PROXY (impl));
 
       g_debug ("Calling backend for device access to: %s", device);
 
@@ -179,11 +283,14 @@ device_query_permission_sync (const char *app_id,
       allowed = response == 0;
 
       if (permission == PERMISSION_UNSET)
-        set_permission_sync (app_id, PERMISSION_TABLE, device, allowed ? PERMISSION_YES : PERMISSION_NO);
+        set_permission_in_background (app_id, PERMISSION_TABLE, device, allowed ? PERMISSION_YES : PERMISSION_NO);
     }
   else
     allowed = permission == PERMISSION_YES ? TRUE : FALSE;
 
+  if (app_info_load)
+    drop_app_info_load (app_info_load);
+
   return allowed;
 }
 
@@ -227,7 +334,6 @@ handle_access_device (XdpDevice *object,
   Request *request = request_from_invocation (invocation);
   g_autoptr(XdpAppInfo) app_info = NULL;
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   g_autoptr(GTask) task = NULL;
 
   if (g_strv_length ((char **)devices) != 1 || !g_strv_contains (known_devices, devices[0]))
@@ -294,25 +400,14 @@ handle_access_device (XdpDevice *object,
   g_object_set_data_full (G_OBJECT (request), "app-id", g_strdup (xdp_app_info_get_id (app_info)), g_free);
   g_object_set_data_full (G_OBJECT (request), "device", g_strdup (devices[0]), g_free);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   xdp_device_complete_access_device (object, invocation, request->id);
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_access_device_in_thread);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG, handle_access_device_in_thread);
 
   return TRUE;
 }
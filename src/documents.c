@@ -22,6 +22,7 @@
 #include "config.h"
 
 #include <errno.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -31,20 +32,157 @@
 #include <gio/gunixfdlist.h>
 
 #include "xdp-dbus.h"
+#include "xdp-utils.h"
 
-static XdpDocuments *documents = NULL;
+static XdpDocuments *bus_documents = NULL;
 static char *documents_mountpoint = NULL;
 
+/* The document portal is called over its private socket when it has
+ * one, which keeps the bus daemon out of the fd passing. The bus proxy
+ * stays the fallback, and has the cached version property. */
+G_LOCK_DEFINE_STATIC (peer_documents);
+static XdpDocuments *peer_documents = NULL;
+
+#define MAX_PEER_CONNECT_ATTEMPTS 3
+
+static guint peer_connect_attempts;
+
+static void connect_document_peer (void);
+
+static XdpDocuments *
+get_documents (void)
+{
+  XdpDocuments *documents;
+
+  G_LOCK (peer_documents);
+  documents = g_object_ref (peer_documents ? peer_documents : bus_documents);
+  G_UNLOCK (peer_documents);
+
+  return documents;
+}
+
+static void
+document_peer_closed (GDBusConnection *connection,
+                      gboolean         remote_peer_vanished,
+                      GError          *error,
+                      gpointer         user_data)
+{
+  XdpDocuments *old_documents;
+
+  g_debug ("Document portal peer connection closed, using the bus");
+
+  G_LOCK (peer_documents);
+  old_documents = g_steal_pointer (&peer_documents);
+  G_UNLOCK (peer_documents);
+
+  g_clear_object (&old_documents);
+}
+
+static gboolean
+retry_connect_document_peer (gpointer user_data)
+{
+  connect_document_peer ();
+  return G_SOURCE_REMOVE;
+}
+
+static void
+document_peer_connected (GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
+{
+  g_autoptr(GDBusConnection) connection = NULL;
+  g_autoptr(XdpDocuments) documents = NULL;
+  g_autoptr(GError) error = NULL;
+  XdpDocuments *old_documents;
+
+  connection = g_dbus_connection_new_for_address_finish (res, &error);
+  if (connection == NULL)
+    {
+      g_debug ("No document portal peer connection: %s", error->message);
+
+      /* The document portal may not be listening yet right after it started */
+      if (++peer_connect_attempts < MAX_PEER_CONNECT_ATTEMPTS)
+        g_timeout_add_seconds (1, retry_connect_document_peer, NULL);
+      return;
+    }
+
+  documents = xdp_documents_proxy_new_sync (connection,
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                            NULL,
+                                            "/org/freedesktop/portal/documents",
+                                            NULL, &error);
+  if (documents == NULL)
+    {
+      g_warning ("Failed to create document portal peer proxy: %s", error->message);
+      return;
+    }
+
+  g_debug ("Using the document portal peer connection");
+  g_signal_connect (connection, "closed", G_CALLBACK (document_peer_closed), NULL);
+
+  G_LOCK (peer_documents);
+  old_documents = peer_documents;
+  peer_documents = g_steal_pointer (&documents);
+  G_UNLOCK (peer_documents);
+
+  g_clear_object (&old_documents);
+}
+
+static void
+connect_document_peer (void)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *address = NULL;
+
+  path = g_build_filename (g_get_user_runtime_dir (), DOCUMENT_PORTAL_PEER_SOCKET, NULL);
+  address = g_strdup_printf ("unix:path=%s", path);
+
+  g_dbus_connection_new_for_address (address,
+                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                     NULL, NULL,
+                                     document_peer_connected,
+                                     NULL);
+}
+
+static void
+documents_owner_changed (GObject    *object,
+                         GParamSpec *pspec,
+                         gpointer    user_data)
+{
+  g_autofree char *owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (object));
+  gboolean on_bus;
+
+  if (owner == NULL)
+    return;
+
+  G_LOCK (peer_documents);
+  on_bus = peer_documents == NULL;
+  G_UNLOCK (peer_documents);
+
+  /* A restarted document portal has a new socket */
+  if (on_bus)
+    {
+      peer_connect_attempts = 0;
+      connect_document_peer ();
+    }
+}
+
 void
 init_document_proxy (GDBusConnection *connection)
 {
-  documents = xdp_documents_proxy_new_sync (connection, 0,
-                                            "org.freedesktop.portal.Documents",
-                                            "/org/freedesktop/portal/documents",
-                                            NULL, NULL);
-  xdp_documents_call_get_mount_point_sync (documents,
+  bus_documents = xdp_documents_proxy_new_sync (connection, 0,
+                                                "org.freedesktop.portal.Documents",
+                                                "/org/freedesktop/portal/documents",
+                                                NULL, NULL);
+  xdp_documents_call_get_mount_point_sync (bus_documents,
                                            &documents_mountpoint,
                                            NULL, NULL);
+
+  /* The document portal listens before answering GetMountPoint */
+  g_signal_connect (bus_documents, "notify::g-name-owner",
+                    G_CALLBACK (documents_owner_changed), NULL);
+  connect_document_peer ();
 }
 
 char *
@@ -68,10 +206,13 @@ register_document (const char *uri,
   int i;
   int version;
   gboolean handled_permissions = FALSE;
+  g_autoptr(XdpDocuments) documents = NULL;
 
   if (app_id == NULL || *app_id == 0)
     return g_strdup (uri);
 
+  documents = get_documents ();
+
   file = g_file_new_for_uri (uri);
   path = g_file_get_path (file);
   basename = g_path_get_basename (path);
@@ -102,7 +243,7 @@ register_document (const char *uri,
   permissions[i++] = "grant-permissions";
   permissions[i++] = NULL;
 
-  version = xdp_documents_get_version (documents);
+  version = xdp_documents_get_version (bus_documents);
 
   if (for_save)
     {
@@ -192,3 +333,280 @@ register_document (const char *uri,
   doc_path = g_build_filename (documents_mountpoint, doc_id, basename, NULL);
   return g_filename_to_uri (doc_path, NULL, NULL);
 }
+
+static char *
+document_uri (const char *path,
+              const char *doc_id)
+{
+  g_autofree char *basename = NULL;
+  g_autofree char *doc_path = NULL;
+
+  if (!g_strcmp0 (doc_id, ""))
+    return g_filename_to_uri (path, NULL, NULL);
+
+  basename = g_path_get_basename (path);
+  doc_path = g_build_filename (documents_mountpoint, doc_id, basename, NULL);
+  return g_filename_to_uri (doc_path, NULL, NULL);
+}
+
+typedef struct {
+  int pending;
+  char **doc_ids;
+  GError *error;
+} SaveBatch;
+
+typedef struct {
+  SaveBatch *batch;
+  int index;
+} SaveBatchItem;
+
+static void
+add_named_full_done (GObject *source,
+                     GAsyncResult *result,
+                     gpointer data)
+{
+  SaveBatchItem *item = data;
+  SaveBatch *batch = item->batch;
+  g_autoptr(GError) error = NULL;
+
+  if (!xdp_documents_call_add_named_full_finish (XDP_DOCUMENTS (source),
+                                                 &batch->doc_ids[item->index],
+                                                 NULL,
+                                                 NULL,
+                                                 result,
+                                                 &error) &&
+      batch->error == NULL)
+    batch->error = g_steal_pointer (&error);
+
+  batch->pending--;
+  g_free (item);
+}
+
+/* There is no batched AddNamedFull, so for saving several files all
+ * the calls are sent at once and the replies collected afterwards,
+ * instead of waiting for a round trip per file. The calls are separate,
+ * so on failure the files that did get through stay registered. */
+static char **
+register_saved_documents (const char * const *uris,
+                          const char *app_id,
+                          GError **error)
+{
+  const char *permissions[] = { "read", "write", "grant-permissions", NULL };
+  g_autoptr(GMainContext) context = NULL;
+  g_autoptr(GPtrArray) paths = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autofree char *fd_dirname = NULL;
+  g_autoptr(GPtrArray) ruris = NULL;
+  g_autoptr(XdpDocuments) documents = get_documents ();
+  SaveBatch batch = { 0, };
+  int i;
+
+  paths = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; uris[i]; i++)
+    {
+      g_autoptr(GFile) file = g_file_new_for_uri (uris[i]);
+      char *path = g_file_get_path (file);
+
+      if (path == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Not a local file: %s", uris[i]);
+          return NULL;
+        }
+      g_ptr_array_add (paths, path);
+    }
+
+  batch.doc_ids = g_new0 (char *, paths->len + 1);
+
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  for (i = 0; i < paths->len; i++)
+    {
+      const char *path = g_ptr_array_index (paths, i);
+      g_autofree char *dirname = g_path_get_dirname (path);
+      g_autofree char *basename = g_path_get_basename (path);
+      SaveBatchItem *item;
+
+      /* The files usually all go to the same folder */
+      if (fd_list == NULL || strcmp (dirname, fd_dirname) != 0)
+        {
+          int fd, fd_in;
+
+          g_clear_object (&fd_list);
+
+          fd = open (dirname, O_PATH | O_CLOEXEC);
+          if (fd == -1)
+            {
+              g_set_error (&batch.error, G_IO_ERROR, g_io_error_from_errno (errno),
+                           "Failed to open %s", uris[i]);
+              break;
+            }
+
+          fd_list = g_unix_fd_list_new ();
+          fd_in = g_unix_fd_list_append (fd_list, fd, &batch.error);
+          close (fd);
+
+          if (fd_in == -1)
+            break;
+
+          g_free (fd_dirname);
+          fd_dirname = g_steal_pointer (&dirname);
+        }
+
+      item = g_new (SaveBatchItem, 1);
+      item->batch = &batch;
+      item->index = i;
+      batch.pending++;
+
+      xdp_documents_call_add_named_full (documents,
+                                         g_variant_new_handle (0),
+                                         basename,
+                                         7, /* reuse+persistent+as-needed */
+                                         app_id,
+                                         permissions,
+                                         fd_list,
+                                         NULL,
+                                         add_named_full_done,
+                                         item);
+    }
+
+  while (batch.pending > 0)
+    g_main_context_iteration (context, TRUE);
+
+  g_main_context_pop_thread_default (context);
+
+  if (batch.error)
+    {
+      g_propagate_error (error, batch.error);
+      g_strfreev (batch.doc_ids);
+      return NULL;
+    }
+
+  ruris = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < paths->len; i++)
+    g_ptr_array_add (ruris, document_uri (g_ptr_array_index (paths, i), batch.doc_ids[i]));
+  g_ptr_array_add (ruris, NULL);
+
+  g_strfreev (batch.doc_ids);
+
+  return (char **) g_ptr_array_free (g_steal_pointer (&ruris), FALSE);
+}
+
+/* Like register_document() for several uris, but with a single AddFull
+ * call for all of them if the document portal supports it. The uris are
+ * returned in order. With AddFull, either all uris are registered or
+ * none; otherwise the ones before a failure may stay registered. */
+char **
+register_documents (const char * const *uris,
+                    const char *app_id,
+                    gboolean for_save,
+                    gboolean writable,
+                    GError **error)
+{
+  g_autoptr(GPtrArray) paths = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GArray) handles = NULL;
+  g_auto(GStrv) doc_ids = NULL;
+  g_autoptr(GPtrArray) ruris = NULL;
+  g_autoptr(XdpDocuments) documents = NULL;
+  const char *permissions[4];
+  int i;
+
+  ruris = g_ptr_array_new_with_free_func (g_free);
+
+  if (for_save && app_id != NULL && *app_id != 0 &&
+      uris[0] != NULL && uris[1] != NULL &&
+      xdp_documents_get_version (bus_documents) >= 3)
+    return register_saved_documents (uris, app_id, error);
+
+  /* Saving has no AddFull equivalent, and old document portals
+   * don't have AddFull */
+  if (for_save ||
+      app_id == NULL || *app_id == 0 ||
+      xdp_documents_get_version (bus_documents) < 2)
+    {
+      for (i = 0; uris[i]; i++)
+        {
+          char *ruri = register_document (uris[i], app_id, for_save, writable, error);
+
+          if (ruri == NULL)
+            return NULL;
+          g_ptr_array_add (ruris, ruri);
+        }
+      g_ptr_array_add (ruris, NULL);
+
+      return (char **) g_ptr_array_free (g_steal_pointer (&ruris), FALSE);
+    }
+
+  documents = get_documents ();
+  paths = g_ptr_array_new_with_free_func (g_free);
+  fd_list = g_unix_fd_list_new ();
+  handles = g_array_new (FALSE, FALSE, sizeof (gint32));
+
+  for (i = 0; uris[i]; i++)
+    {
+      g_autoptr(GFile) file = g_file_new_for_uri (uris[i]);
+      char *path = g_file_get_path (file);
+      int fd, fd_in;
+
+      if (path == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Not a local file: %s", uris[i]);
+          return NULL;
+        }
+      g_ptr_array_add (paths, path);
+
+      fd = open (path, O_PATH | O_CLOEXEC);
+      if (fd == -1)
+        {
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                       "Failed to open %s", uris[i]);
+          return NULL;
+        }
+
+      fd_in = g_unix_fd_list_append (fd_list, fd, error);
+      close (fd);
+
+      if (fd_in == -1)
+        return NULL;
+
+      g_array_append_val (handles, fd_in);
+    }
+
+  i = 0;
+  permissions[i++] = "read";
+  if (writable)
+    permissions[i++] = "write";
+  permissions[i++] = "grant-permissions";
+  permissions[i++] = NULL;
+
+  if (!xdp_documents_call_add_full_sync (documents,
+                                         g_variant_new_fixed_array (G_VARIANT_TYPE_HANDLE,
+                                                                    handles->data, handles->len,
+                                                                    sizeof (gint32)),
+                                         7, /* reuse+persistent+as-needed */
+                                         app_id,
+                                         permissions,
+                                         fd_list,
+                                         &doc_ids,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         error))
+    return NULL;
+
+  if (g_strv_length (doc_ids) != paths->len)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unexpected number of documents");
+      return NULL;
+    }
+
+  for (i = 0; i < paths->len; i++)
+    g_ptr_array_add (ruris, document_uri (g_ptr_array_index (paths, i), doc_ids[i]));
+  g_ptr_array_add (ruris, NULL);
+
+  return (char **) g_ptr_array_free (g_steal_pointer (&ruris), FALSE);
+}
@@ -29,3 +29,9 @@ char *register_document (const char *uri,
                          gboolean for_save,
                          gboolean writable,
                          GError **error);
+
+char **register_documents (const char * const *uris,
+                           const char *app_id,
+                           gboolean for_save,
+                           gboolean writable,
+                           GError **error);
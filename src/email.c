@@ -53,6 +53,9 @@ struct _EmailClass
 };
 
 static XdpImplEmail *impl;
+static GDBusConnection *impl_connection;
+static char *impl_dbus_name;
+G_LOCK_DEFINE_STATIC (impl);
 static Email *email;
 
 GType email_get_type (void) G_GNUC_CONST;
@@ -93,30 +96,44 @@ compose_email_done (GObject *source,
 {
   g_autoptr(Request) request = data;
   guint response = 2;
+  g_autoptr(GVariant) ret = NULL;
   g_autoptr(GVariant) results = NULL;
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
-  if (!xdp_impl_email_call_compose_email_finish (XDP_IMPL_EMAIL (source),
-                                                 &response,
-                                                 &results,
-                                                 result,
-                                                 &error))
-    {
-      g_warning ("Backend call failed: %s", error->message);
-    }
+  request_impl_done (request);
+
+  ret = g_dbus_proxy_call_with_unix_fd_list_finish (G_DBUS_PROXY (source),
+                                                    NULL,
+                                                    result,
+                                                    &error);
+  if (ret == NULL)
+    g_warning ("Backend call failed: %s", error->message);
+  else
+    g_variant_get (ret, "(u@a{sv})", &response, &results);
 
   g_object_set_data (G_OBJECT (request), "response", GINT_TO_POINTER (response));
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
+/* Compiled once, a GRegex can be matched from any thread */
 static gboolean
 is_valid_email (const char *string)
 {
-  return g_regex_match_simple ("^\\w+([-+.]\\w+)*@\\w+([-.]\\w+)*\\.\\w+([-.]\\w+)*$", string, 0, 0);
+  static GRegex *regex;
+
+  if (g_once_init_enter (&regex))
+    {
+      GRegex *compiled = g_regex_new ("^\\w+([-+.]\\w+)*@\\w+([-.]\\w+)*\\.\\w+([-.]\\w+)*$",
+                                      G_REGEX_OPTIMIZE, 0, NULL);
+      g_assert (compiled != NULL);
+      g_once_init_leave (&regex, compiled);
+    }
+
+  return g_regex_match (regex, string, 0, NULL);
 }
 
 static gboolean
@@ -193,6 +210,31 @@ static XdpOptionKey compose_email_options[] = {
   { "body", G_VARIANT_TYPE_STRING, NULL }
 };
 
+/* The backend is only contacted once the portal is used */
+static gboolean
+ensure_impl (GError **error)
+{
+  gboolean ok = TRUE;
+
+  G_LOCK (impl);
+  if (impl == NULL)
+    {
+      impl = xdp_impl_email_proxy_new_sync (impl_connection,
+                                        G_DBUS_PROXY_FLAGS_NONE,
+                                        impl_dbus_name,
+                                        DESKTOP_PORTAL_OBJECT_PATH,
+                                        NULL,
+                                        error);
+      if (impl == NULL)
+        ok = FALSE;
+      else
+        g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
+    }
+  G_UNLOCK (impl);
+
+  return ok;
+}
+
 static gboolean
 handle_compose_email (XdpEmail *object,
                       GDBusMethodInvocation *invocation,
@@ -203,53 +245,79 @@ handle_compose_email (XdpEmail *object,
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder options;
   g_autoptr(GVariant) attachment_fds = NULL;
+  g_autoptr(GUnixFDList) impl_fd_list = NULL;
 
   g_debug ("Handling ComposeEmail");
 
-  REQUEST_AUTOLOCK (request);
-
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
+  if (!ensure_impl (&error))
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
 
+  REQUEST_AUTOLOCK (request);
+
   g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
 
   attachment_fds = g_variant_lookup_value (arg_options, "attachment_fds", G_VARIANT_TYPE ("ah"));
   if (attachment_fds)
     {
-      GVariantBuilder attachments;
-      int i;
+      gsize n_attachments = g_variant_n_children (attachment_fds);
+      g_autofree int *fds = g_new (int, n_attachments);
+      g_auto(GStrv) paths = NULL;
+      GVariantBuilder handles;
+      const int *fd_array;
+      int n_fds = 0;
+      gsize i;
+
+      fd_array = fd_list ? g_unix_fd_list_peek_fds (fd_list, &n_fds) : NULL;
 
-      g_variant_builder_init (&attachments, G_VARIANT_TYPE_STRING_ARRAY);
-      for (i = 0; i < g_variant_n_children (attachment_fds); i++)
+      for (i = 0; i < n_attachments; i++)
         {
-          g_autofree char *path = NULL;
           int fd_id;
-          int fd;
 
           g_variant_get_child (attachment_fds, i, "h", &fd_id);
-          fd = g_unix_fd_list_get (fd_list, fd_id, &error);
-          if (fd == -1)
+          if (fd_id < 0 || fd_id >= n_fds)
             {
-              g_dbus_method_invocation_return_gerror (invocation, error);
+              g_dbus_method_invocation_return_error (invocation,
+                                                     XDG_DESKTOP_PORTAL_ERROR,
+                                                     XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                                                     "Bad file descriptor index");
               return TRUE;
             }
 
-          path = xdp_app_info_get_path_for_fd (request->app_info, fd, 0, NULL, NULL);
-          g_variant_builder_add (&attachments, "s", path);
+          fds[i] = fd_array[fd_id];
+        }
+
+      paths = xdp_app_info_get_paths_for_fds (request->app_info, fds, n_attachments, 0, &error);
+      if (paths == NULL)
+        {
+          g_dbus_method_invocation_return_gerror (invocation, error);
+          return TRUE;
         }
 
-      g_variant_builder_add (&options, "{sv}", "attachments", g_variant_builder_end (&attachments));
+      g_variant_builder_add (&options, "{sv}", "attachments", g_variant_new_strv ((const char * const *) paths, -1));
+
+      /* Also hand the already validated fds to the backend, so the mail
+       * client does not have to open the files again */
+      impl_fd_list = g_unix_fd_list_new ();
+      g_variant_builder_init (&handles, G_VARIANT_TYPE ("ah"));
+      for (i = 0; i < n_attachments; i++)
+        {
+          int handle = g_unix_fd_list_append (impl_fd_list, fds[i], &error);
+
+          if (handle == -1)
+            {
+              g_variant_builder_clear (&handles);
+              g_dbus_method_invocation_return_gerror (invocation, error);
+              return TRUE;
+            }
+
+          g_variant_builder_add (&handles, "h", handle);
+        }
+      g_variant_builder_add (&options, "{sv}", "attachment_fds", g_variant_builder_end (&handles));
     }
 
   if (!xdp_filter_options (arg_options, &options,
@@ -261,19 +329,26 @@ handle_compose_email (XdpEmail *object,
       return TRUE;
     }
 
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   xdp_email_complete_compose_email (object, invocation, NULL, request->id);
 
-  xdp_impl_email_call_compose_email (impl,
-                                     request->id,
-                                     app_id,
-                                     arg_parent_window,
-                                     g_variant_builder_end (&options),
-                                     NULL,
-                                     compose_email_done,
-                                     g_object_ref (request));
+  /* The generated proxy can't pass fds, the backend interface has no
+   * fd list so old backends keep working */
+  g_dbus_proxy_call_with_unix_fd_list (G_DBUS_PROXY (impl),
+                                       "ComposeEmail",
+                                       g_variant_new ("(oss@a{sv})",
+                                                      request->id,
+                                                      app_id,
+                                                      arg_parent_window,
+                                                      g_variant_builder_end (&options)),
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       -1,
+                                       impl_fd_list,
+                                       NULL,
+                                       compose_email_done,
+                                       g_object_ref (request));
 
   return TRUE;
 }
@@ -299,22 +374,8 @@ GDBusInterfaceSkeleton *
 email_create (GDBusConnection *connection,
               const char      *dbus_name)
 {
-  g_autoptr(GError) error = NULL;
-
-  impl = xdp_impl_email_proxy_new_sync (connection,
-                                        G_DBUS_PROXY_FLAGS_NONE,
-                                        dbus_name,
-                                        DESKTOP_PORTAL_OBJECT_PATH,
-                                        NULL,
-                                        &error);
-
-  if (impl == NULL)
-    {
-      g_warning ("Failed to create email proxy: %s", error->message);
-      return NULL;
-    }
-
-  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
+  impl_connection = g_object_ref (connection);
+  impl_dbus_name = g_strdup (dbus_name);
 
   email = g_object_new (email_get_type (), NULL);
 
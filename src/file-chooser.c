@@ -98,23 +98,40 @@ send_response_in_thread_func (GTask        *task,
   if (choices)
     g_variant_builder_add (&results, "{sv}", "choices", choices);
 
-  if (g_variant_lookup (options, "uris", "^a&s", &uris))
+  if (g_variant_lookup (options, "uris", "^a&s", &uris) && uris)
     {
+      g_auto(GStrv) batch_ruris = NULL;
+      g_autoptr(GError) batch_error = NULL;
       int i;
 
-      for (i = 0; uris && uris[i]; i++)
+      batch_ruris = register_documents ((const char * const *) uris, xdp_app_info_get_id (request->app_info), for_save, writable, &batch_error);
+      if (batch_ruris != NULL)
         {
-          g_autofree char *ruri = NULL;
-          g_autoptr(GError) error = NULL;
+          for (i = 0; batch_ruris[i]; i++)
+            {
+              g_debug ("convert uri %s -> %s\n", uris[i], batch_ruris[i]);
+              g_variant_builder_add (&ruris, "s", batch_ruris[i]);
+            }
+        }
+      else
+        {
+          /* Register one by one, so the other files still get through */
+          g_debug ("Failed to register uris at once: %s", batch_error->message);
 
-          ruri = register_document (uris[i], xdp_app_info_get_id (request->app_info), for_save, writable, &error);
-          if (ruri == NULL)
+          for (i = 0; uris[i]; i++)
             {
-              g_warning ("Failed to register %s: %s", uris[i], error->message);
-              continue;
+              g_autofree char *ruri = NULL;
+              g_autoptr(GError) error = NULL;
+
+              ruri = register_document (uris[i], xdp_app_info_get_id (request->app_info), for_save, writable, &error);
+              if (ruri == NULL)
+                {
+                  g_warning ("Failed to register %s: %s", uris[i], error->message);
+                  continue;
+                }
+              g_debug ("convert uri %s -> %s\n", uris[i], ruri);
+              g_variant_builder_add (&ruris, "s", ruri);
             }
-          g_debug ("convert uri %s -> %s\n", uris[i], ruri);
-          g_variant_builder_add (&ruris, "s", ruri);
         }
     }
 
@@ -141,6 +158,8 @@ open_file_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_file_chooser_call_open_file_finish (XDP_IMPL_FILE_CHOOSER (source),
                                                     &response,
                                                     &options,
@@ -156,7 +175,7 @@ open_file_done (GObject *source,
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static gboolean
@@ -177,6 +196,73 @@ check_value_type (const char *key,
   return FALSE;
 }
 
+/* Apps tend to send the same filters and choices with every request,
+ * so remember the values that passed validation, keyed by their
+ * serialized form. Equal bytes of the same type are the same value. */
+#define MAX_VALIDATED 64
+
+G_LOCK_DEFINE_STATIC (validated);
+static GHashTable *validated;
+
+static guint
+serialized_hash (gconstpointer v)
+{
+  GVariant *value = (GVariant *) v;
+  const guchar *data = g_variant_get_data (value);
+  gsize size = g_variant_get_size (value);
+  guint hash = g_str_hash (g_variant_get_type_string (value));
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    hash = (hash << 5) + hash + data[i];
+
+  return hash;
+}
+
+static gboolean
+serialized_equal (gconstpointer a,
+                  gconstpointer b)
+{
+  GVariant *value_a = (GVariant *) a;
+  GVariant *value_b = (GVariant *) b;
+  gsize size = g_variant_get_size (value_a);
+
+  return
+    g_variant_type_equal (g_variant_get_type (value_a), g_variant_get_type (value_b)) &&
+    size == g_variant_get_size (value_b) &&
+    (size == 0 ||
+     memcmp (g_variant_get_data (value_a), g_variant_get_data (value_b), size) == 0);
+}
+
+static gboolean
+is_validated (GVariant *value)
+{
+  gboolean found;
+
+  G_LOCK (validated);
+  found = g_hash_table_contains (validated, value);
+  G_UNLOCK (validated);
+
+  return found;
+}
+
+static void
+remember_validated (GVariant *value)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  GVariant *copy;
+
+  /* Copy the data, so the cache doesn't keep the whole message alive */
+  bytes = g_bytes_new (g_variant_get_data (value), g_variant_get_size (value));
+  copy = g_variant_ref_sink (g_variant_new_from_bytes (g_variant_get_type (value), bytes, TRUE));
+
+  G_LOCK (validated);
+  if (g_hash_table_size (validated) >= MAX_VALIDATED)
+    g_hash_table_remove_all (validated);
+  g_hash_table_add (validated, copy);
+  G_UNLOCK (validated);
+}
+
 static gboolean
 check_filter (GVariant *filter,
               GError **error)
@@ -259,6 +345,9 @@ validate_filters (const char *key,
   if (!check_value_type ("filters", value, G_VARIANT_TYPE ("a(sa(us))"), error))
     return FALSE;
 
+  if (is_validated (value))
+    return TRUE;
+
   for (i = 0; i < g_variant_n_children (value); i++)
     {
       g_autoptr(GVariant) filter = g_variant_get_child_value (value, i);
@@ -270,6 +359,8 @@ validate_filters (const char *key,
         }
     }
 
+  remember_validated (value);
+
   return TRUE;
 }
 
@@ -285,10 +376,15 @@ validate_current_filter (const char *key,
   if (!check_value_type ("current_filter", value, G_VARIANT_TYPE ("(sa(us))"), error))
     return FALSE;
 
-  if (!check_filter (value, error))
+  if (!is_validated (value))
     {
-      g_prefix_error (error, "invalid filter: ");
-      return FALSE;
+      if (!check_filter (value, error))
+        {
+          g_prefix_error (error, "invalid filter: ");
+          return FALSE;
+        }
+
+      remember_validated (value);
     }
 
   /* If the filters list is nonempty and current_filter is specified,
@@ -421,6 +517,9 @@ validate_choices (const char *key,
   if (!check_value_type ("choices", value, G_VARIANT_TYPE ("a(ssa(ss)s)"), error))
     return FALSE;
 
+  if (is_validated (value))
+    return TRUE;
+
   for (i = 0; i < g_variant_n_children (value); i++)
     {
       g_autoptr(GVariant) choice = g_variant_get_child_value (value, i);
@@ -432,6 +531,8 @@ validate_choices (const char *key,
         }
     }
 
+  remember_validated (value);
+
   return TRUE;
 }
 
@@ -454,34 +555,21 @@ handle_open_file (XdpFileChooser *object,
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
-  GVariantBuilder options;
+  g_autoptr(GVariant) options = NULL;
 
   g_debug ("Handling OpenFile");
 
   REQUEST_AUTOLOCK (request);
 
-  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options,
-                           open_file_options, G_N_ELEMENTS (open_file_options),
-                           &error))
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
+  if (!xdp_filter_options_forward (arg_options, &options,
+                                   open_file_options, G_N_ELEMENTS (open_file_options),
+                                   &error))
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
 
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   xdp_impl_file_chooser_call_open_file (impl,
@@ -489,7 +577,7 @@ handle_open_file (XdpFileChooser *object,
                                         app_id,
                                         arg_parent_window,
                                         arg_title,
-                                        g_variant_builder_end (&options),
+                                        options,
                                         NULL,
                                         open_file_done,
                                         g_object_ref (request));
@@ -521,6 +609,8 @@ save_file_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_file_chooser_call_save_file_finish (XDP_IMPL_FILE_CHOOSER (source),
                                                     &response,
                                                     &options,
@@ -536,7 +626,7 @@ save_file_done (GObject *source,
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static gboolean
@@ -549,8 +639,7 @@ handle_save_file (XdpFileChooser *object,
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autoptr(GError) error = NULL;
-  XdpImplRequest *impl_request;
-  GVariantBuilder options;
+  g_autoptr(GVariant) options = NULL;
 
   g_debug ("Handling SaveFile");
 
@@ -566,21 +655,9 @@ handle_save_file (XdpFileChooser *object,
 
   REQUEST_AUTOLOCK (request);
 
-  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options,
-                           save_file_options, G_N_ELEMENTS (save_file_options),
-                           &error))
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
+  if (!xdp_filter_options_forward (arg_options, &options,
+                                   save_file_options, G_N_ELEMENTS (save_file_options),
+                                   &error))
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
@@ -588,7 +665,7 @@ handle_save_file (XdpFileChooser *object,
 
   g_object_set_data (G_OBJECT (request), "for-save", GINT_TO_POINTER (TRUE));
 
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   xdp_impl_file_chooser_call_save_file (impl,
@@ -596,7 +673,7 @@ handle_save_file (XdpFileChooser *object,
                                         app_id,
                                         arg_parent_window,
                                         arg_title,
-                                        g_variant_builder_end (&options),
+                                        options,
                                         NULL,
                                         save_file_done,
                                         g_object_ref (request));
@@ -626,6 +703,8 @@ save_files_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_file_chooser_call_save_files_finish (XDP_IMPL_FILE_CHOOSER (source),
                                                      &response,
                                                      &options,
@@ -641,7 +720,7 @@ save_files_done (GObject *source,
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static gboolean
@@ -654,8 +733,7 @@ handle_save_files (XdpFileChooser *object,
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autoptr(GError) error = NULL;
-  XdpImplRequest *impl_request;
-  GVariantBuilder options;
+  g_autoptr(GVariant) options = NULL;
 
   if (xdp_impl_lockdown_get_disable_save_to_disk (lockdown))
     {
@@ -669,21 +747,9 @@ handle_save_files (XdpFileChooser *object,
 
   REQUEST_AUTOLOCK (request);
 
-  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options,
-                           save_files_options, G_N_ELEMENTS (save_files_options),
-                           &error))
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
+  if (!xdp_filter_options_forward (arg_options, &options,
+                                   save_files_options, G_N_ELEMENTS (save_files_options),
+                                   &error))
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
@@ -691,7 +757,7 @@ handle_save_files (XdpFileChooser *object,
 
   g_object_set_data (G_OBJECT (request), "for-save", GINT_TO_POINTER (TRUE));
 
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   xdp_impl_file_chooser_call_save_files (impl,
@@ -699,7 +765,7 @@ handle_save_files (XdpFileChooser *object,
                                          app_id,
                                          arg_parent_window,
                                          arg_title,
-                                         g_variant_builder_end (&options),
+                                         options,
                                          NULL,
                                          save_files_done,
                                          g_object_ref (request));
@@ -737,6 +803,9 @@ file_chooser_create (GDBusConnection *connection,
 
   lockdown = lockdown_proxy;
 
+  validated = g_hash_table_new_full (serialized_hash, serialized_equal,
+                                     (GDestroyNotify) g_variant_unref, NULL);
+
   impl = xdp_impl_file_chooser_proxy_new_sync (connection,
                                                G_DBUS_PROXY_FLAGS_NONE,
                                                dbus_name,
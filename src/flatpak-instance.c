@@ -20,6 +20,10 @@
 
 #include "config.h"
 
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <gio/gio.h>
 #include <json-glib/json-glib.h>
 
@@ -92,6 +96,7 @@ struct _FlatpakInstancePrivate
 
   int       pid;
   int       child_pid;
+  int       pidfd;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstance, flatpak_instance, G_TYPE_OBJECT)
@@ -114,6 +119,9 @@ flatpak_instance_finalize (GObject *object)
   if (priv->info)
     g_key_file_unref (priv->info);
 
+  if (priv->pidfd >= 0)
+    close (priv->pidfd);
+
   G_OBJECT_CLASS (flatpak_instance_parent_class)->finalize (object);
 }
 
@@ -128,6 +136,9 @@ flatpak_instance_class_init (FlatpakInstanceClass *klass)
 static void
 flatpak_instance_init (FlatpakInstance *self)
 {
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  priv->pidfd = -1;
 }
 
 /**
@@ -280,6 +291,23 @@ flatpak_instance_get_pid (FlatpakInstance *self)
   return priv->pid;
 }
 
+/**
+ * flatpak_instance_get_pidfd:
+ * @self: a #FlatpakInstance
+ *
+ * Gets a pidfd for the outermost process in the sandbox, which becomes
+ * readable when the sandbox exits. The fd is owned by @self.
+ *
+ * Returns: the pidfd, or -1 if pidfds are not supported
+ */
+int
+flatpak_instance_get_pidfd (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  return priv->pidfd;
+}
+
 static int get_child_pid (const char *dir);
 
 /**
@@ -416,6 +444,10 @@ flatpak_instance_new (const char *dir)
   priv->id = g_path_get_basename (dir);
 
   priv->pid = get_pid (priv->dir);
+#ifdef SYS_pidfd_open
+  if (priv->pid > 0)
+    priv->pidfd = (int) syscall (SYS_pidfd_open, priv->pid, 0);
+#endif
   priv->child_pid = get_child_pid (priv->dir);
   priv->info = get_instance_info (priv->dir);
 
@@ -456,26 +488,42 @@ flatpak_instance_new_for_id (const char *id)
   return flatpak_instance_new (dir);
 }
 
-/**
- * flatpak_instance_get_all:
- *
- * Gets FlatpakInstance objects for all running sandboxes in the current session.
- *
- * Returns: (transfer full) (element-type FlatpakInstance): a #GPtrArray of
- *   #FlatpakInstance objects
- *
- * Since: 1.1
+/* All instances we know about, so each one is only parsed once.
+ * instance ID -> FlatpakInstance, or NULL if it has not been parsed
+ * (successfully) yet. While the instance directory is watched, the
+ * registry is kept up to date from the monitor events; otherwise it is
+ * synced with the directory on each flatpak_instance_get_all().
  */
-GPtrArray *
-flatpak_instance_get_all (void)
+static GHashTable *registry;
+static GFileMonitor *registry_monitor;
+G_LOCK_DEFINE_STATIC (registry);
+
+static char *
+get_instances_dir (void)
 {
-  g_autoptr(GPtrArray) instances = NULL;
+  return g_build_filename (g_get_user_runtime_dir (), ".flatpak", NULL);
+}
+
+static void
+ensure_registry (void)
+{
+  if (registry == NULL)
+    registry = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+}
+
+/* Called with the registry lock held */
+static void
+sync_registry (void)
+{
+  g_autoptr(GHashTable) seen = NULL;
   g_autofree char *base_dir = NULL;
   g_autoptr(GFile) file = NULL;
   g_autoptr(GFileEnumerator) iter = NULL;
+  GHashTableIter hash_iter;
+  const char *id;
 
-  instances = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  base_dir = g_build_filename (g_get_user_runtime_dir (), ".flatpak", NULL);
+  seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  base_dir = get_instances_dir ();
   file = g_file_new_for_path (base_dir);
   iter = g_file_enumerate_children (file,
                                     G_FILE_ATTRIBUTE_STANDARD_NAME ","
@@ -483,10 +531,7 @@ flatpak_instance_get_all (void)
                                     G_FILE_QUERY_INFO_NONE,
                                     NULL,
                                     NULL);
-  if (!iter)
-    return g_steal_pointer (&instances);
-
-  while (TRUE)
+  while (iter)
     {
       GFileInfo *info;
 
@@ -496,13 +541,148 @@ flatpak_instance_get_all (void)
       if (!info)
         break;
 
-      if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
-        g_ptr_array_add (instances, flatpak_instance_new_for_id (g_file_info_get_name (info)));
+      if (g_file_info_get_file_type (info) != G_FILE_TYPE_DIRECTORY)
+        continue;
+
+      id = g_file_info_get_name (info);
+      if (!g_hash_table_contains (registry, id))
+        g_hash_table_insert (registry, g_strdup (id), NULL);
+
+      g_hash_table_add (seen, g_strdup (id));
+    }
+
+  g_hash_table_iter_init (&hash_iter, registry);
+  while (g_hash_table_iter_next (&hash_iter, (gpointer *)&id, NULL))
+    {
+      if (!g_hash_table_contains (seen, id))
+        g_hash_table_iter_remove (&hash_iter);
     }
+}
+
+/**
+ * flatpak_instance_get_all:
+ *
+ * Gets FlatpakInstance objects for all running sandboxes in the current session.
+ *
+ * Returns: (transfer full) (element-type FlatpakInstance): a #GPtrArray of
+ *   #FlatpakInstance objects
+ *
+ * Since: 1.1
+ */
+GPtrArray *
+flatpak_instance_get_all (void)
+{
+  g_autoptr(GPtrArray) instances = NULL;
+  GHashTableIter iter;
+  const char *id;
+  FlatpakInstance *instance;
+
+  instances = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+
+  G_LOCK (registry);
+
+  ensure_registry ();
+  if (registry_monitor == NULL)
+    sync_registry ();
+
+  g_hash_table_iter_init (&iter, registry);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&id, (gpointer *)&instance))
+    {
+      if (instance == NULL)
+        {
+          FlatpakInstancePrivate *priv;
+
+          instance = flatpak_instance_new_for_id (id);
+          priv = flatpak_instance_get_instance_private (instance);
+
+          /* The directory may still be being filled in, try again next time */
+          if (priv->info == NULL || priv->pid == 0)
+            {
+              g_ptr_array_add (instances, instance);
+              continue;
+            }
+
+          g_hash_table_iter_replace (&iter, instance);
+        }
+
+      g_ptr_array_add (instances, g_object_ref (instance));
+    }
+
+  G_UNLOCK (registry);
 
   return g_steal_pointer (&instances);
 }
 
+static void
+instances_dir_changed (GFileMonitor      *monitor,
+                       GFile             *file,
+                       GFile             *other_file,
+                       GFileMonitorEvent  event_type,
+                       gpointer           data)
+{
+  g_autofree char *id = g_file_get_basename (file);
+
+  G_LOCK (registry);
+
+  switch (event_type)
+    {
+    case G_FILE_MONITOR_EVENT_CREATED:
+      if (g_file_query_file_type (file, G_FILE_QUERY_INFO_NONE, NULL) == G_FILE_TYPE_DIRECTORY)
+        g_hash_table_replace (registry, g_steal_pointer (&id), NULL);
+      break;
+
+    case G_FILE_MONITOR_EVENT_DELETED:
+      g_hash_table_remove (registry, id);
+      break;
+
+    default:
+      break;
+    }
+
+  G_UNLOCK (registry);
+}
+
+/**
+ * flatpak_instance_watch_all:
+ * @callback: function to call when instances appear or disappear
+ * @user_data: data to pass to @callback
+ * @error: return location for a #GError
+ *
+ * Starts watching the instance directory, in the thread-default main
+ * context. After this, flatpak_instance_get_all() only parses new
+ * instances instead of reading the directory again.
+ *
+ * Returns: %TRUE if the directory is watched
+ */
+gboolean
+flatpak_instance_watch_all (GCallback   callback,
+                            gpointer    user_data,
+                            GError    **error)
+{
+  g_autofree char *base_dir = get_instances_dir ();
+  g_autoptr(GFile) file = g_file_new_for_path (base_dir);
+  GFileMonitor *monitor;
+
+  monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE, NULL, error);
+  if (monitor == NULL)
+    return FALSE;
+
+  G_LOCK (registry);
+  ensure_registry ();
+  sync_registry ();
+  g_clear_object (&registry_monitor);
+  registry_monitor = monitor;
+  g_signal_connect (monitor, "changed", G_CALLBACK (instances_dir_changed), NULL);
+  G_UNLOCK (registry);
+
+  /* Connected after our own handler, so the registry is current when
+   * @callback runs */
+  if (callback)
+    g_signal_connect_swapped (monitor, "changed", callback, user_data);
+
+  return TRUE;
+}
+
 /**
  * flatpak_instance_is_running:
  * @self: a #FlatpakInstance
@@ -516,6 +696,14 @@ flatpak_instance_is_running (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  if (priv->pidfd >= 0)
+    {
+      struct pollfd pfd = { priv->pidfd, POLLIN, 0 };
+
+      /* The pidfd becomes readable when the process exits */
+      return poll (&pfd, 1, 0) == 0;
+    }
+
   if (kill (priv->pid, 0) == 0)
     return TRUE;
 
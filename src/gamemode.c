@@ -100,6 +100,7 @@ static gboolean handle_unregister_game_by_pidfd (XdpGameMode *object,
 
 /* globals  */
 static GameMode *gamemode;
+G_LOCK_DEFINE_STATIC (client);
 
 /* gobject  */
 
@@ -107,8 +108,9 @@ struct _GameMode
 {
   XdpGameModeSkeleton parent_instance;
 
-  /*  */
+  /* Created on first use, protected by the client lock */
   GDBusProxy *client;
+  GDBusConnection *connection;
 };
 
 struct _GameModeClass
@@ -156,46 +158,28 @@ game_mode_class_init (GameModeClass *klass)
 static gboolean
 game_mode_is_allowed_for_app (const char *app_id, GError **error)
 {
-  g_autoptr(GVariant) perms = NULL;
-  g_autoptr(GVariant) data = NULL;
-  g_autoptr(GError) err = NULL;
-  const char **stored;
-  gboolean ok;
-
-  ok = xdp_impl_permission_store_call_lookup_sync (get_permission_store (),
-                                                   PERMISSION_TABLE,
-                                                   PERMISSION_ID,
-                                                   &perms,
-                                                   &data,
-                                                   NULL,
-                                                   &err);
+  g_auto(GStrv) stored = NULL;
+  g_autofree char *as_str = NULL;
+  gboolean allowed;
 
-  if (!ok)
+  /* Cached by the permissions code, so this is cheap for repeated calls */
+  stored = get_permissions_sync (app_id, PERMISSION_TABLE, PERMISSION_ID);
+  if (stored == NULL)
     {
-      g_dbus_error_strip_remote_error (err);
-      g_debug ("No gamemode permissions found: %s", err->message);
-      g_clear_error (&err);
+      g_debug ("No gamemode permissions stored for %s: allowing", app_id);
+      return TRUE;
     }
-  else if (perms != NULL && g_variant_lookup (perms, app_id, "^a&s", &stored))
-    {
-      g_autofree char *as_str = NULL;
-      gboolean allowed;
 
-      as_str = g_strjoinv (" ", (char **)stored);
-      g_debug ("GameMode permissions for %s: %s", app_id, as_str);
+  as_str = g_strjoinv (" ", stored);
+  g_debug ("GameMode permissions for %s: %s", app_id, as_str);
 
-      allowed = !g_strv_contains (stored, "no");
-
-      if (!allowed)
-        g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
-                     "GameMode is not allowed for %s", app_id);
-
-      return allowed;
-    }
+  allowed = !g_strv_contains ((const char * const *) stored, "no");
 
-  g_debug ("No gamemode permissions stored for %s: allowing", app_id);
+  if (!allowed)
+    g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                 "GameMode is not allowed for %s", app_id);
 
-  return TRUE;
+  return allowed;
 }
 
 static gboolean
@@ -259,6 +243,28 @@ call_data_free (gpointer data)
   g_slice_free (CallData, call);
 }
 
+/* GameMode mostly isn't running, only set up the proxy once it is used */
+static GDBusProxy *
+ensure_client (GError **error)
+{
+  GDBusProxy *client;
+
+  G_LOCK (client);
+  if (gamemode->client == NULL)
+    gamemode->client = g_dbus_proxy_new_sync (gamemode->connection,
+                                              G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START_AT_CONSTRUCTION,
+                                              NULL,
+                                              GAMEMODE_DBUS_NAME,
+                                              GAMEMODE_DBUS_PATH,
+                                              GAMEMODE_DBUS_IFACE,
+                                              NULL,
+                                              error);
+  client = gamemode->client;
+  G_UNLOCK (client);
+
+  return client;
+}
+
 static void
 handle_call_thread (GTask        *task,
                     gpointer      source_object,
@@ -268,6 +274,7 @@ handle_call_thread (GTask        *task,
   g_autoptr(GError) error = NULL;
   g_autoptr(GVariant) res = NULL;
   GUnixFDList *fdlist = NULL;
+  GDBusProxy *client;
   GVariant *params;
   const char *app_id;
   CallData *call;
@@ -292,7 +299,7 @@ handle_call_thread (GTask        *task,
       n_pids = call->n_ids;
 
       for (guint i = 0; i < n_pids; i++)
-        pids[0] = (pid_t) call->ids[i];
+        pids[i] = (pid_t) call->ids[i];
 
       ok = xdg_app_info_map_pids (call->app_info, pids, n_pids, &error);
 
@@ -337,7 +344,18 @@ handle_call_thread (GTask        *task,
       params = g_variant_new ("(hh)", 0, 1);
     }
 
-  res = g_dbus_proxy_call_with_unix_fd_list_sync (G_DBUS_PROXY (gamemode->client),
+  client = ensure_client (&error);
+  if (client == NULL)
+    {
+      g_warning ("Failed to create GameMode proxy: %s", error->message);
+      g_dbus_method_invocation_return_error (call->inv,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED,
+                                             "GameMode is not available");
+      return;
+    }
+
+  res = g_dbus_proxy_call_with_unix_fd_list_sync (client,
                                                   call->method,
                                                   params,
                                                   G_DBUS_CALL_FLAGS_NONE,
@@ -383,7 +401,7 @@ handle_call_in_thread_fds (XdpGameMode           *object,
   task = g_task_new (object, NULL, NULL, NULL);
 
   g_task_set_task_data (task, call, call_data_free);
-  g_task_run_in_thread (task, handle_call_thread);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, handle_call_thread);
 }
 
 static void
@@ -415,7 +433,7 @@ handle_call_in_thread (XdpGameMode           *object,
   task = g_task_new (object, NULL, NULL, NULL);
 
   g_task_set_task_data (task, call, call_data_free);
-  g_task_run_in_thread (task, handle_call_thread);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, handle_call_thread);
 }
 
 /* dbus */
@@ -539,28 +557,8 @@ handle_unregister_game_by_pidfd (XdpGameMode *object,
 GDBusInterfaceSkeleton *
 game_mode_create (GDBusConnection *connection)
 {
-  g_autoptr(GError) err = NULL;
-  GDBusProxy *client;
-  GDBusProxyFlags flags;
-
-  flags = G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START_AT_CONSTRUCTION;
-  client = g_dbus_proxy_new_sync (connection,
-                                  flags,
-                                  NULL,
-                                  GAMEMODE_DBUS_NAME,
-                                  GAMEMODE_DBUS_PATH,
-                                  GAMEMODE_DBUS_IFACE,
-                                  NULL,
-                                  &err);
-
-  if (client == NULL)
-    {
-      g_warning ("Failed to create GameMode proxy: %s", err->message);
-      return NULL;
-    }
-
   gamemode = g_object_new (game_mode_get_type (), NULL);
-  gamemode->client = client;
+  gamemode->connection = g_object_ref (connection);
 
-  return G_DBUS_INTERFACE_SKELETON (gamemode);;
+  return G_DBUS_INTERFACE_SKELETON (gamemode);
 }
@@ -191,8 +191,6 @@ handle_inhibit (XdpInhibit *object,
                 GVariant *arg_options)
 {
   Request *request = request_from_invocation (invocation);
-  g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   g_autoptr(GTask) task = NULL;
   GVariantBuilder opt_builder;
   g_autoptr(GVariant) options = NULL;
@@ -219,34 +217,32 @@ handle_inhibit (XdpInhibit *object,
   g_object_set_data (G_OBJECT (request), "flags", GUINT_TO_POINTER (arg_flags));
   g_object_set_data_full (G_OBJECT (request), "options", g_variant_ref (options), (GDestroyNotify)g_variant_unref);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_inhibit_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, handle_inhibit_in_thread_func);
 
   xdp_inhibit_complete_inhibit (object, invocation, request->id);
 
   return TRUE;
 }
 
+/* State changes arriving within this long of the last one sent are
+ * folded into a single StateChanged signal */
+#define STATE_CHANGED_INTERVAL_MS 100
+
 typedef struct _InhibitSession
 {
   Session parent;
 
   gboolean closed;
+
+  /* Protected by the session lock */
+  GVariant *last_state;
+  GVariant *pending_state;
+  guint state_changed_id;
 } InhibitSession;
 
 typedef struct _InhibitSessionClass
@@ -265,12 +261,22 @@ inhibit_session_close (Session *session)
 
   inhibit_session->closed = TRUE;
 
+  g_clear_pointer (&inhibit_session->pending_state, g_variant_unref);
+  if (inhibit_session->state_changed_id)
+    g_source_remove (inhibit_session->state_changed_id);
+  inhibit_session->state_changed_id = 0;
+
   g_debug ("inhibit session owned by '%s' closed", session->sender);
 }
 
 static void
 inhibit_session_finalize (GObject *object)
 {
+  InhibitSession *inhibit_session = (InhibitSession *)object;
+
+  g_clear_pointer (&inhibit_session->last_state, g_variant_unref);
+  g_clear_pointer (&inhibit_session->pending_state, g_variant_unref);
+
   G_OBJECT_CLASS (inhibit_session_parent_class)->finalize (object);
 }
 
@@ -340,6 +346,8 @@ create_monitor_done (GObject *source_object,
 
   g_variant_builder_init (&results_builder, G_VARIANT_TYPE_VARDICT);
 
+  request_impl_done (request);
+
   if (!xdp_impl_inhibit_call_create_monitor_finish (impl, &response, res, &error))
     {
       g_warning ("A backend call failed: %s", error->message);
@@ -393,24 +401,11 @@ handle_create_monitor (XdpInhibit *object,
 {
   Request *request = request_from_invocation (invocation);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   Session *session;
 
   REQUEST_AUTOLOCK (request);
 
-  impl_request =
-    xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                     G_DBUS_PROXY_FLAGS_NONE,
-                                     g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                     request->id,
-                                     NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   session = (Session *)inhibit_session_new (arg_options, request, &error);
@@ -478,13 +473,78 @@ inhibit_class_init (InhibitClass *klass)
 {
 }
 
+static gboolean state_changed_timeout (gpointer data);
+
+#define SESSION_STATE_QUERY_END 2
+
+/* Apps only have a second to answer a Query End, so it is never held
+ * back or dropped */
+static gboolean
+is_query_end (GVariant *state)
+{
+  guint32 session_state = 0;
+
+  g_variant_lookup (state, "session-state", "u", &session_state);
+
+  return session_state == SESSION_STATE_QUERY_END;
+}
+
+/* Called with the session lock held */
+static void
+send_state_changed (InhibitSession *inhibit_session,
+                    GVariant *state)
+{
+  Session *session = (Session *)inhibit_session;
+  GDBusConnection *connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (impl));
+
+  /* Nothing to tell if the state flipped back in the meantime */
+  if (!is_query_end (state) &&
+      inhibit_session->last_state && g_variant_equal (inhibit_session->last_state, state))
+    return;
+
+  g_clear_pointer (&inhibit_session->last_state, g_variant_unref);
+  inhibit_session->last_state = g_variant_ref (state);
+
+  g_dbus_connection_emit_signal (connection,
+                                 session->sender,
+                                 "/org/freedesktop/portal/desktop",
+                                 "org.freedesktop.portal.Inhibit",
+                                 "StateChanged",
+                                 g_variant_new ("(o@a{sv})", session->id, state),
+                                 NULL);
+
+  if (inhibit_session->state_changed_id)
+    g_source_remove (inhibit_session->state_changed_id);
+  inhibit_session->state_changed_id =
+    g_timeout_add_full (G_PRIORITY_DEFAULT, STATE_CHANGED_INTERVAL_MS,
+                        state_changed_timeout,
+                        g_object_ref (inhibit_session), g_object_unref);
+}
+
+static gboolean
+state_changed_timeout (gpointer data)
+{
+  InhibitSession *inhibit_session = data;
+  Session *session = (Session *)inhibit_session;
+  g_autoptr(GVariant) state = NULL;
+
+  SESSION_AUTOLOCK (session);
+
+  inhibit_session->state_changed_id = 0;
+
+  state = g_steal_pointer (&inhibit_session->pending_state);
+  if (state && !inhibit_session->closed)
+    send_state_changed (inhibit_session, state);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 state_changed_cb (XdpImplInhibit *impl,
                   const char *session_id,
                   GVariant *state,
                   gpointer data)
 {
-  GDBusConnection *connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (impl));
   g_autoptr(Session) session = lookup_session (session_id);
   InhibitSession *inhibit_session = (InhibitSession *)session;
   gboolean active = FALSE;
@@ -495,14 +555,29 @@ state_changed_cb (XdpImplInhibit *impl,
   g_debug ("Received state-changed %s: screensaver-active: %d, session-state: %u",
            session_id, active, session_state);
 
-  if (inhibit_session && !inhibit_session->closed)
-    g_dbus_connection_emit_signal (connection,
-                                   session->sender,
-                                   "/org/freedesktop/portal/desktop",
-                                   "org.freedesktop.portal.Inhibit",
-                                   "StateChanged",
-                                   g_variant_new ("(o@a{sv})", session_id, state),
-                                   NULL);
+  if (inhibit_session == NULL)
+    return;
+
+  SESSION_AUTOLOCK (session);
+
+  if (inhibit_session->closed)
+    return;
+
+  /* The first change goes out right away, the ones that follow it too
+   * closely only once the interval is over, and only the last of them.
+   * A Query End replaces whatever was held back. */
+  if (is_query_end (state))
+    {
+      g_clear_pointer (&inhibit_session->pending_state, g_variant_unref);
+      send_state_changed (inhibit_session, state);
+    }
+  else if (inhibit_session->state_changed_id)
+    {
+      g_clear_pointer (&inhibit_session->pending_state, g_variant_unref);
+      inhibit_session->pending_state = g_variant_ref (state);
+    }
+  else
+    send_state_changed (inhibit_session, state);
 }
 
 GDBusInterfaceSkeleton *
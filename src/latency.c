@@ -0,0 +1,185 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "latency.h"
+
+/* Latency histograms per method, with power of two buckets in
+ * microseconds. The last bucket takes everything above ~8 seconds. */
+#define N_BUCKETS 24
+
+typedef struct {
+  guint64 count;
+  gint64 max_usec;
+  guint64 buckets[N_BUCKETS];
+} LatencyHistogram;
+
+typedef struct {
+  LatencyHistogram kinds[LATENCY_N_KINDS];
+} LatencyEntry;
+
+static const char *kind_names[LATENCY_N_KINDS] = {
+  "portal",
+  "backend",
+  "permission store",
+};
+
+static gboolean enabled;
+
+G_LOCK_DEFINE_STATIC (latency);
+static GHashTable *entries;
+
+void
+latency_enable (void)
+{
+  G_LOCK (latency);
+  if (entries == NULL)
+    entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  G_UNLOCK (latency);
+
+  g_atomic_int_set (&enabled, TRUE);
+}
+
+gboolean
+latency_enabled (void)
+{
+  return g_atomic_int_get (&enabled);
+}
+
+static int
+bucket_for_usec (gint64 usec)
+{
+  int bucket = 0;
+
+  while (usec > 1 && bucket < N_BUCKETS - 1)
+    {
+      usec >>= 1;
+      bucket++;
+    }
+
+  return bucket;
+}
+
+void
+latency_record (const char  *name,
+                LatencyKind  kind,
+                gint64       usec)
+{
+  LatencyEntry *entry;
+  LatencyHistogram *histogram;
+
+  if (!latency_enabled ())
+    return;
+
+  G_LOCK (latency);
+
+  entry = g_hash_table_lookup (entries, name);
+  if (entry == NULL)
+    {
+      entry = g_new0 (LatencyEntry, 1);
+      g_hash_table_insert (entries, g_strdup (name), entry);
+    }
+
+  histogram = &entry->kinds[kind];
+  histogram->count++;
+  histogram->max_usec = MAX (histogram->max_usec, usec);
+  histogram->buckets[bucket_for_usec (usec)]++;
+
+  G_UNLOCK (latency);
+}
+
+/* Upper bound of the bucket that holds the given percentile, which
+ * is a good enough estimate for spotting the slow part */
+static double
+percentile_ms (LatencyHistogram *histogram,
+               int               percent)
+{
+  guint64 wanted = (histogram->count * percent + 99) / 100;
+  guint64 seen = 0;
+  int i;
+
+  for (i = 0; i < N_BUCKETS - 1; i++)
+    {
+      seen += histogram->buckets[i];
+      if (seen >= wanted)
+        return MIN ((gint64) 2 << i, histogram->max_usec) / 1000.0;
+    }
+
+  return histogram->max_usec / 1000.0;
+}
+
+static int
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+  return g_strcmp0 (*(const char **) a, *(const char **) b);
+}
+
+/* Returns the latencies recorded since the last summary, one line per
+ * method, or NULL if nothing was recorded */
+char *
+latency_summary (void)
+{
+  g_autoptr(GHashTable) old_entries = NULL;
+  g_autoptr(GPtrArray) names = NULL;
+  GString *summary;
+  GHashTableIter iter;
+  gpointer key;
+  int i;
+
+  G_LOCK (latency);
+  if (entries == NULL || g_hash_table_size (entries) == 0)
+    {
+      G_UNLOCK (latency);
+      return NULL;
+    }
+  old_entries = g_steal_pointer (&entries);
+  entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  G_UNLOCK (latency);
+
+  names = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, old_entries);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (names, key);
+  g_ptr_array_sort (names, compare_names);
+
+  summary = g_string_new ("");
+  for (i = 0; i < names->len; i++)
+    {
+      const char *name = g_ptr_array_index (names, i);
+      LatencyEntry *entry = g_hash_table_lookup (old_entries, name);
+      LatencyKind kind;
+
+      g_string_append (summary, name);
+      for (kind = 0; kind < LATENCY_N_KINDS; kind++)
+        {
+          LatencyHistogram *histogram = &entry->kinds[kind];
+
+          if (histogram->count == 0)
+            continue;
+
+          g_string_append_printf (summary,
+                                  "  %s: %" G_GUINT64_FORMAT " calls, p50 %.1f ms, p99 %.1f ms, max %.1f ms",
+                                  kind_names[kind], histogram->count,
+                                  percentile_ms (histogram, 50),
+                                  percentile_ms (histogram, 99),
+                                  histogram->max_usec / 1000.0);
+        }
+      g_string_append_c (summary, '\n');
+    }
+
+  return g_string_free (summary, FALSE);
+}
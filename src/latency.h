@@ -0,0 +1,32 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef enum {
+  LATENCY_PORTAL,           /* Time spent in the portal itself */
+  LATENCY_BACKEND,          /* Time waiting for the backend */
+  LATENCY_PERMISSION_STORE, /* Time waiting for the permission store */
+  LATENCY_N_KINDS
+} LatencyKind;
+
+void     latency_enable  (void);
+gboolean latency_enabled (void);
+void     latency_record  (const char  *name,
+                          LatencyKind  kind,
+                          gint64       usec);
+char *   latency_summary (void);
@@ -49,6 +49,29 @@ typedef enum {
   LOCATION_SESSION_STATE_CLOSED
 } LocationSessionState;
 
+/* A GeoClue client, shared by all the sessions that ask for the same
+ * accuracy and distance threshold. The time threshold is enforced per
+ * session by the portal. */
+typedef struct
+{
+  gint ref_count;
+  char *key;
+
+  GClueAccuracyLevel accuracy;
+  guint distance_threshold;
+
+  /* Serializes starting the client */
+  GMutex mutex;
+  GeoclueClient *client;
+  gulong updated_id;
+
+  /* Protected by the clients lock. The started sessions are reffed
+   * until they are closed. */
+  guint n_users;
+  GPtrArray *sessions;
+  GVariant *last_location;
+} LocationClient;
+
 typedef struct
 {
   Session parent;
@@ -59,7 +82,12 @@ typedef struct
   guint time_threshold;
   guint accuracy;
 
-  GeoclueClient *client;
+  LocationClient *client;
+
+  /* Protected by the clients lock */
+  gint64 last_sent;
+  GVariant *pending_location;
+  guint throttle_id;
 } LocationSession;
 
 typedef struct
@@ -71,6 +99,12 @@ GType location_session_get_type (void);
 
 G_DEFINE_TYPE (LocationSession, location_session, session_get_type ())
 
+G_LOCK_DEFINE_STATIC (clients);
+static GHashTable *clients;
+
+static void location_client_release (LocationClient  *client,
+                                     LocationSession *session);
+
 static void
 location_session_init (LocationSession *session)
 {
@@ -87,7 +121,14 @@ location_session_close (Session *session)
   loc_session->state = LOCATION_SESSION_STATE_CLOSED;
 
   if (loc_session->client)
-    geoclue_client_call_stop (loc_session->client, NULL, NULL, NULL);
+    location_client_release (g_steal_pointer (&loc_session->client), loc_session);
+
+  G_LOCK (clients);
+  g_clear_pointer (&loc_session->pending_location, g_variant_unref);
+  if (loc_session->throttle_id)
+    g_source_remove (loc_session->throttle_id);
+  loc_session->throttle_id = 0;
+  G_UNLOCK (clients);
 
   g_debug ("location session '%s' closed", session->id);
 }
@@ -97,7 +138,9 @@ location_session_finalize (GObject *object)
 {
   LocationSession *loc_session = (LocationSession *)object;
 
-  g_clear_object (&loc_session->client);
+  if (loc_session->client)
+    location_client_release (g_steal_pointer (&loc_session->client), loc_session);
+  g_clear_pointer (&loc_session->pending_location, g_variant_unref);
 
   G_OBJECT_CLASS (location_session_parent_class)->finalize (object);
 }
@@ -138,44 +181,101 @@ location_session_new (GVariant *options,
 
 /*** GeoClue integration ***/
 
+static LocationClient *
+location_client_ref (LocationClient *client)
+{
+  g_atomic_int_inc (&client->ref_count);
+  return client;
+}
+
 static void
-location_updated (GeoclueClient *client,
-                  const char *old_location,
-                  const char *new_location,
-                  gpointer data)
+location_client_unref (LocationClient *client)
 {
-  Session *session = data;
-  g_autoptr(GVariant) ret = NULL;
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GVariant) dict = NULL;
+  if (!g_atomic_int_dec_and_test (&client->ref_count))
+    return;
 
-  g_debug ("GeoClue client ::LocationUpdated %s -> %s\n",  old_location, new_location);
+  g_clear_object (&client->client);
+  g_mutex_clear (&client->mutex);
+  g_ptr_array_unref (client->sessions);
+  g_clear_pointer (&client->last_location, g_variant_unref);
+  g_free (client->key);
+  g_free (client);
+}
 
-  if (strcmp (new_location, "/") == 0)
-    return;
+/* Returns the client for the given settings, creating it if needed. The
+ * caller becomes a user of it until location_client_release(). */
+static LocationClient *
+location_client_acquire (GClueAccuracyLevel accuracy,
+                         guint distance_threshold)
+{
+  g_autofree char *key = NULL;
+  LocationClient *client;
 
-  ret = g_dbus_connection_call_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (client)),
-                                     "org.freedesktop.GeoClue2",
-                                     new_location,
-                                     "org.freedesktop.DBus.Properties",
-                                     "GetAll",
-                                     g_variant_new ("(s)", "org.freedesktop.GeoClue2.Location"),
-                                     G_VARIANT_TYPE ("(a{sv})"),
-                                     0, -1, NULL, &error);
-  if (ret == NULL)
+  key = g_strdup_printf ("%d:%u", accuracy, distance_threshold);
+
+  G_LOCK (clients);
+
+  if (clients == NULL)
+    clients = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     NULL, (GDestroyNotify) location_client_unref);
+
+  client = g_hash_table_lookup (clients, key);
+  if (client == NULL)
     {
-      g_warning ("Failed to get location properties: %s", error->message);
-      return;
+      client = g_new0 (LocationClient, 1);
+      client->ref_count = 1;
+      client->key = g_steal_pointer (&key);
+      client->accuracy = accuracy;
+      client->distance_threshold = distance_threshold;
+      g_mutex_init (&client->mutex);
+      client->sessions = g_ptr_array_new ();
+      g_hash_table_insert (clients, client->key, client);
     }
 
-  g_variant_get (ret, "(@a{sv})", &dict);
+  client->n_users++;
+  location_client_ref (client);
 
-  if (opt_verbose)
+  G_UNLOCK (clients);
+
+  return client;
+}
+
+static void
+location_client_release (LocationClient  *client,
+                         LocationSession *session)
+{
+  gboolean removed;
+  gboolean last;
+
+  G_LOCK (clients);
+  removed = g_ptr_array_remove (client->sessions, session);
+  last = --client->n_users == 0;
+  if (last && g_hash_table_lookup (clients, client->key) == client)
+    g_hash_table_remove (clients, client->key);
+  G_UNLOCK (clients);
+
+  /* Nobody can start the client anymore, it's out of the table */
+  if (last && client->client)
     {
-      g_autofree char *a = g_variant_print (dict, FALSE);
-      g_debug ("location data: %s\n", a);
+      g_debug ("Stopping GeoClue client for %s", client->key);
+
+      g_signal_handler_disconnect (client->client, client->updated_id);
+      geoclue_client_call_stop (client->client, NULL, NULL, NULL);
     }
 
+  /* Dropped outside the lock, it may be the last ref */
+  if (removed)
+    g_object_unref (session);
+
+  location_client_unref (client);
+}
+
+static void
+emit_location_updated (Session *session,
+                       GVariant *dict)
+{
+  g_autoptr(GError) error = NULL;
+
   if (!g_dbus_connection_emit_signal (session->connection,
                                       session->sender,
                                       "/org/freedesktop/portal/desktop",
@@ -189,12 +289,144 @@ location_updated (GeoclueClient *client,
 }
 
 static gboolean
-location_session_start (LocationSession *loc_session)
+send_pending_location (gpointer data)
+{
+  LocationSession *loc_session = data;
+  g_autoptr(GVariant) dict = NULL;
+
+  G_LOCK (clients);
+  loc_session->throttle_id = 0;
+  dict = g_steal_pointer (&loc_session->pending_location);
+  if (dict)
+    loc_session->last_sent = g_get_monotonic_time ();
+  G_UNLOCK (clients);
+
+  if (dict)
+    emit_location_updated ((Session *)loc_session, dict);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Sends the location, unless the session got one less than its time
+ * threshold ago. Then only the latest location is sent once the
+ * threshold has passed. */
+static void
+location_session_send_location (LocationSession *loc_session,
+                                GVariant *dict)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 next;
+  gboolean send = FALSE;
+
+  G_LOCK (clients);
+
+  next = loc_session->last_sent + (gint64) loc_session->time_threshold * G_USEC_PER_SEC;
+  if (loc_session->state != LOCATION_SESSION_STATE_STARTED)
+    ;
+  else if (loc_session->time_threshold == 0 || loc_session->last_sent == 0 || now >= next)
+    {
+      g_clear_pointer (&loc_session->pending_location, g_variant_unref);
+      loc_session->last_sent = now;
+      send = TRUE;
+    }
+  else
+    {
+      g_clear_pointer (&loc_session->pending_location, g_variant_unref);
+      loc_session->pending_location = g_variant_ref (dict);
+      if (loc_session->throttle_id == 0)
+        loc_session->throttle_id = g_timeout_add_full (G_PRIORITY_DEFAULT,
+                                                       (next - now + 999) / 1000,
+                                                       send_pending_location,
+                                                       g_object_ref (loc_session),
+                                                       g_object_unref);
+    }
+
+  G_UNLOCK (clients);
+
+  if (send)
+    emit_location_updated ((Session *)loc_session, dict);
+}
+
+static void
+got_location_properties (GObject *source,
+                         GAsyncResult *result,
+                         gpointer data)
+{
+  LocationClient *client = data;
+  g_autoptr(GVariant) ret = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) dict = NULL;
+  g_autoptr(GPtrArray) sessions = NULL;
+  guint i;
+
+  ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+  if (ret == NULL)
+    {
+      g_warning ("Failed to get location properties: %s", error->message);
+      location_client_unref (client);
+      return;
+    }
+
+  g_variant_get (ret, "(@a{sv})", &dict);
+
+  if (opt_verbose)
+    {
+      g_autofree char *a = g_variant_print (dict, FALSE);
+      g_debug ("location data: %s\n", a);
+    }
+
+  sessions = g_ptr_array_new_with_free_func (g_object_unref);
+
+  G_LOCK (clients);
+  g_clear_pointer (&client->last_location, g_variant_unref);
+  client->last_location = g_variant_ref (dict);
+  for (i = 0; i < client->sessions->len; i++)
+    g_ptr_array_add (sessions, g_object_ref (g_ptr_array_index (client->sessions, i)));
+  G_UNLOCK (clients);
+
+  for (i = 0; i < sessions->len; i++)
+    location_session_send_location (g_ptr_array_index (sessions, i), dict);
+
+  location_client_unref (client);
+}
+
+static void
+location_updated (GeoclueClient *gclue_client,
+                  const char *old_location,
+                  const char *new_location,
+                  gpointer data)
+{
+  LocationClient *client = data;
+
+  g_debug ("GeoClue client ::LocationUpdated %s -> %s\n",  old_location, new_location);
+
+  if (strcmp (new_location, "/") == 0)
+    return;
+
+  /* Fetched once for all the sessions sharing the client */
+  g_dbus_connection_call (g_dbus_proxy_get_connection (G_DBUS_PROXY (gclue_client)),
+                          "org.freedesktop.GeoClue2",
+                          new_location,
+                          "org.freedesktop.DBus.Properties",
+                          "GetAll",
+                          g_variant_new ("(s)", "org.freedesktop.GeoClue2.Location"),
+                          G_VARIANT_TYPE ("(a{sv})"),
+                          0, -1, NULL,
+                          got_location_properties,
+                          location_client_ref (client));
+}
+
+static gboolean
+location_client_start_locked (LocationClient *client)
 {
   g_autoptr(GDBusConnection) system_bus = NULL;
   g_autoptr(GVariant) ret = NULL;
   g_autoptr(GError) error = NULL;
-  char *client_id;
+  GeoclueClient *gclue_client;
+  g_autofree char *client_id = NULL;
+
+  if (client->client)
+    return TRUE;
 
   /* FIXME: this is all ugly and sync */
 
@@ -210,58 +442,112 @@ location_session_start (LocationSession *loc_session)
   if (ret == NULL)
     {
       g_warning ("Failed to get GeoClue client: %s", error->message);
-      loc_session->state = LOCATION_SESSION_STATE_CLOSED;
       return FALSE;
     }
 
   g_variant_get (ret, "(o)", &client_id);
 
-  loc_session->client = geoclue_client_proxy_new_sync (system_bus,
-                                                       G_DBUS_PROXY_FLAGS_NONE,
-                                                       "org.freedesktop.GeoClue2",
-                                                       client_id,
-                                                       NULL,
-                                                       &error);
-  if (loc_session->client == NULL)
+  gclue_client = geoclue_client_proxy_new_sync (system_bus,
+                                                G_DBUS_PROXY_FLAGS_NONE,
+                                                "org.freedesktop.GeoClue2",
+                                                client_id,
+                                                NULL,
+                                                &error);
+  if (gclue_client == NULL)
     {
       g_warning ("Failed to get GeoClue client: %s", error->message);
-      loc_session->state = LOCATION_SESSION_STATE_CLOSED;
       return FALSE;
     }
 
-  g_debug ("location session '%s', GeoClue client '%s'", ((Session*)loc_session)->id, client_id);
-  g_debug ("location session '%s', distance-threshold %d, time-threshold %d, accuracy %s",
-           ((Session *)loc_session)->id,
-           loc_session->distance_threshold,
-           loc_session->time_threshold,
-           gclue_accuracy_level_to_string (loc_session->accuracy));
-  
-  g_object_set (loc_session->client,
+  g_debug ("GeoClue client '%s', distance-threshold %d, accuracy %s",
+           client_id,
+           client->distance_threshold,
+           gclue_accuracy_level_to_string (client->accuracy));
+
+  g_object_set (gclue_client,
                 "desktop-id", "xdg-desktop-portal",
-                "distance-threshold", loc_session->distance_threshold,
-                "time-threshold", loc_session->time_threshold,
-                "requested-accuracy-level", loc_session->accuracy,
+                "distance-threshold", client->distance_threshold,
+                "requested-accuracy-level", client->accuracy,
                 NULL);
-  
-  g_signal_connect (loc_session->client, "location-updated",
-                    G_CALLBACK (location_updated), loc_session);
 
-  if (!geoclue_client_call_start_sync (loc_session->client, NULL, &error))
+  client->updated_id = g_signal_connect_data (gclue_client, "location-updated",
+                                              G_CALLBACK (location_updated),
+                                              location_client_ref (client),
+                                              (GClosureNotify) location_client_unref,
+                                              0);
+
+  if (!geoclue_client_call_start_sync (gclue_client, NULL, &error))
     {
       g_warning ("Starting GeoClue client failed: %s", error->message);
-      loc_session->state = LOCATION_SESSION_STATE_CLOSED;
-      g_clear_object (&loc_session->client);
+      g_signal_handler_disconnect (gclue_client, client->updated_id);
+      g_object_unref (gclue_client);
       return FALSE;
     }
 
   g_debug ("GeoClue client '%s' started", client_id);
 
+  client->client = gclue_client;
+
+  return TRUE;
+}
+
+static gboolean
+location_client_start (LocationClient *client)
+{
+  gboolean ret;
+
+  g_mutex_lock (&client->mutex);
+  ret = location_client_start_locked (client);
+  g_mutex_unlock (&client->mutex);
+
+  return ret;
+}
+
+static gboolean
+location_session_start (LocationSession *loc_session)
+{
+  LocationClient *client;
+
+  client = location_client_acquire (loc_session->accuracy,
+                                    loc_session->distance_threshold);
+
+  g_debug ("location session '%s', GeoClue client for %s, time-threshold %d",
+           ((Session*)loc_session)->id, client->key, loc_session->time_threshold);
+
+  if (!location_client_start (client))
+    {
+      location_client_release (client, loc_session);
+      loc_session->state = LOCATION_SESSION_STATE_CLOSED;
+      return FALSE;
+    }
+
+  G_LOCK (clients);
+  g_ptr_array_add (client->sessions, g_object_ref (loc_session));
   loc_session->state = LOCATION_SESSION_STATE_STARTED;
+  G_UNLOCK (clients);
+
+  loc_session->client = client;
   g_debug ("location session '%s' started", ((Session*)loc_session)->id);
 
   return TRUE;
 }
 
+/* A session joining a running client won't see a LocationUpdated until
+ * the location changes, so give it the last known one */
+static void
+location_session_send_last_location (LocationSession *loc_session)
+{
+  g_autoptr(GVariant) dict = NULL;
+
+  G_LOCK (clients);
+  if (loc_session->client && loc_session->client->last_location)
+    dict = g_variant_ref (loc_session->client->last_location);
+  G_UNLOCK (clients);
+
+  if (dict)
+    location_session_send_location (loc_session, dict);
+}
+
 /*** Permission handling ***/
 
 /* We use a table named 'location' with a single row with ID 'location'.
@@ -507,19 +793,12 @@ handle_start_in_thread_func (GTask *task,
     {
       guint access_response = 2;
       g_autoptr(GVariant) access_results = NULL;
-      g_autoptr(XdpImplRequest) impl_request = NULL;
       GVariantBuilder access_opt_builder;
       g_autofree char *title = NULL;
       g_autofree char *subtitle = NULL;
       const char *body;
 
-      impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (access_impl)),
-                                                      G_DBUS_PROXY_FLAGS_NONE,
-                                                      g_dbus_proxy_get_name (G_DBUS_PROXY (access_impl)),
-                                                      request->id,
-                                                      NULL, NULL);
-
-      request_set_impl_request (request, impl_request);
+      request_set_impl (request, G_DBUS_PROXY (access_impl));
 
       g_variant_builder_init (&access_opt_builder, G_VARIANT_TYPE_VARDICT);
       g_variant_builder_add (&access_opt_builder, "{sv}",
@@ -570,7 +849,7 @@ handle_start_in_thread_func (GTask *task,
           goto out;
         }
 
-      request_set_impl_request (request, NULL);
+      request_set_impl (request, NULL);
 
       accuracy = (access_response == 0) ? GCLUE_ACCURACY_LEVEL_EXACT : GCLUE_ACCURACY_LEVEL_NONE;
     }
@@ -612,6 +891,9 @@ out:
       request_unexport (request);
     }  
 
+  if (response == 0)
+    location_session_send_last_location (loc_session);
+
   if (response != 0)
     {
        g_debug ("closing session");
@@ -690,7 +972,7 @@ handle_start (XdpLocation *object,
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_start_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG, handle_start_in_thread_func);
 
   return TRUE;
 }
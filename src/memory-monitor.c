@@ -70,6 +70,9 @@ low_memory_warning_cb (GObject *object,
                        MemoryMonitor *mm)
 {
   xdp_memory_monitor_emit_low_memory_warning (XDP_MEMORY_MONITOR (mm), level);
+
+  /* Don't be part of the problem */
+  xdp_trim_caches ();
 }
 #endif /* HAS_MEMORY_MONITOR */
 
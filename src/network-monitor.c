@@ -36,6 +36,17 @@ struct _NetworkMonitor
   XdpNetworkMonitorSkeleton parent_instance;
 
   GNetworkMonitor *monitor;
+
+  /* A snapshot of the monitor state, taken on changes of the monitor,
+   * so the handlers don't have to ask it. Protected by the status lock. */
+  gboolean available;
+  gboolean metered;
+  GNetworkConnectivity connectivity;
+  GVariant *status;
+
+  /* Only touched from the main thread */
+  guint changed_id;
+  gboolean network_changed;
 };
 
 struct _NetworkMonitorClass
@@ -45,6 +56,8 @@ struct _NetworkMonitorClass
 
 static NetworkMonitor *network_monitor;
 
+G_LOCK_DEFINE_STATIC (status);
+
 GType network_monitor_get_type (void) G_GNUC_CONST;
 static void network_monitor_iface_init (XdpNetworkMonitorIface *iface);
 
@@ -67,7 +80,11 @@ handle_get_available (XdpNetworkMonitor     *object,
   else
     {
       NetworkMonitor *nm = (NetworkMonitor *)object;
-      gboolean available = g_network_monitor_get_network_available (nm->monitor);
+      gboolean available;
+
+      G_LOCK (status);
+      available = nm->available;
+      G_UNLOCK (status);
 
       g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", available));
     }
@@ -91,7 +108,11 @@ handle_get_metered (XdpNetworkMonitor     *object,
   else
     {
       NetworkMonitor *nm = (NetworkMonitor *)object;
-      gboolean metered = g_network_monitor_get_network_metered (nm->monitor);
+      gboolean metered;
+
+      G_LOCK (status);
+      metered = nm->metered;
+      G_UNLOCK (status);
 
       g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", metered));
     }
@@ -115,7 +136,11 @@ handle_get_connectivity (XdpNetworkMonitor     *object,
   else
     {
       NetworkMonitor *nm = (NetworkMonitor *)object;
-      GNetworkConnectivity connectivity = g_network_monitor_get_connectivity (nm->monitor);
+      GNetworkConnectivity connectivity;
+
+      G_LOCK (status);
+      connectivity = nm->connectivity;
+      G_UNLOCK (status);
 
       g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", connectivity));
     }
@@ -139,21 +164,13 @@ handle_get_status (XdpNetworkMonitor     *object,
   else
     {
       NetworkMonitor *nm = (NetworkMonitor *)object;
-      GVariantBuilder status;
-      gboolean b;
-      guint c;
-
-      g_variant_builder_init (&status, G_VARIANT_TYPE_VARDICT);
-      b = g_network_monitor_get_network_available (nm->monitor);
-      g_variant_builder_add (&status, "{sv}",
-                             "available", g_variant_new_boolean (b));
-      b = g_network_monitor_get_network_metered (nm->monitor);
-      g_variant_builder_add (&status, "{sv}",
-                             "metered", g_variant_new_boolean (b));
-      c = g_network_monitor_get_connectivity (nm->monitor);
-      g_variant_builder_add (&status, "{sv}",
-                             "connectivity", g_variant_new_uint32 (c));
-      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a{sv})", &status));
+      g_autoptr(GVariant) status_v = NULL;
+
+      G_LOCK (status);
+      status_v = g_variant_ref (nm->status);
+      G_UNLOCK (status);
+
+      g_dbus_method_invocation_return_value (invocation, status_v);
     }
 
   return TRUE;
@@ -210,12 +227,94 @@ network_monitor_iface_init (XdpNetworkMonitorIface *iface)
   iface->handle_can_reach = handle_can_reach;
 }
 
+/* Returns whether the snapshot changed */
+static gboolean
+update_status (NetworkMonitor *nm)
+{
+  gboolean available = g_network_monitor_get_network_available (nm->monitor);
+  gboolean metered = g_network_monitor_get_network_metered (nm->monitor);
+  GNetworkConnectivity connectivity = g_network_monitor_get_connectivity (nm->monitor);
+  GVariantBuilder builder;
+  GVariant *old_status;
+
+  G_LOCK (status);
+
+  if (nm->status != NULL &&
+      nm->available == available &&
+      nm->metered == metered &&
+      nm->connectivity == connectivity)
+    {
+      G_UNLOCK (status);
+      return FALSE;
+    }
+
+  nm->available = available;
+  nm->metered = metered;
+  nm->connectivity = connectivity;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}",
+                         "available", g_variant_new_boolean (available));
+  g_variant_builder_add (&builder, "{sv}",
+                         "metered", g_variant_new_boolean (metered));
+  g_variant_builder_add (&builder, "{sv}",
+                         "connectivity", g_variant_new_uint32 (connectivity));
+
+  old_status = nm->status;
+  nm->status = g_variant_ref_sink (g_variant_new ("(a{sv})", &builder));
+
+  G_UNLOCK (status);
+
+  if (old_status)
+    g_variant_unref (old_status);
+
+  return TRUE;
+}
+
+static gboolean
+emit_changed (gpointer data)
+{
+  NetworkMonitor *nm = data;
+  gboolean changed;
+
+  nm->changed_id = 0;
+
+  changed = update_status (nm);
+
+  /* network-changed means more than the three properties, e.g. a
+   * host may be reachable now, so it always makes it to the apps */
+  if (changed || nm->network_changed)
+    xdp_network_monitor_emit_changed (XDP_NETWORK_MONITOR (nm));
+
+  nm->network_changed = FALSE;
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The monitor tends to report a change as several signals and
+ * notifications in a row, so they are sent on as one changed signal */
+static void
+queue_emit_changed (NetworkMonitor *nm)
+{
+  if (nm->changed_id == 0)
+    nm->changed_id = g_idle_add (emit_changed, nm);
+}
+
 static void
 network_changed (GObject *object,
                  gboolean network_available,
                  NetworkMonitor *nm)
 {
-  xdp_network_monitor_emit_changed (XDP_NETWORK_MONITOR (nm));
+  nm->network_changed = TRUE;
+  queue_emit_changed (nm);
+}
+
+static void
+network_property_changed (GObject *object,
+                          GParamSpec *pspec,
+                          NetworkMonitor *nm)
+{
+  queue_emit_changed (nm);
 }
 
 static void
@@ -223,7 +322,11 @@ network_monitor_init (NetworkMonitor *nm)
 {
   nm->monitor = g_network_monitor_get_default ();
 
+  update_status (nm);
+
   g_signal_connect (nm->monitor, "network-changed", G_CALLBACK (network_changed), nm);
+  g_signal_connect (nm->monitor, "notify::network-metered", G_CALLBACK (network_property_changed), nm);
+  g_signal_connect (nm->monitor, "notify::connectivity", G_CALLBACK (network_property_changed), nm);
 
   xdp_network_monitor_set_version (XDP_NETWORK_MONITOR (nm), 3);
 }
@@ -22,8 +22,10 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
-#include <gio/gunixoutputstream.h>
 
 #include "notification.h"
 #include "request.h"
@@ -112,6 +114,8 @@ add_done (GObject *source,
   g_autoptr(Request) request = data;
   g_autoptr(GError) error = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_notification_call_add_notification_finish (impl, result, &error))
     {
       g_warning ("Backend call failed: %s", error->message);
@@ -344,114 +348,373 @@ check_notification (GVariant *notification,
   return TRUE;
 }
 
+/* Validation results for bytes icons, keyed by the SHA-256 of the
+ * icon data. Apps tend to send the same icon with every notification,
+ * so this saves us from spawning the validator each time. Only icons
+ * the validator accepted are added, see icon_validation_done().
+ */
+#define ICON_CACHE_SIZE 256
+
+typedef struct {
+  char *checksum;
+  gboolean valid;
+  GList link;
+} IconCacheEntry;
+
+static GHashTable *icon_cache; /* checksum -> IconCacheEntry */
+static GQueue icon_cache_lru = G_QUEUE_INIT; /* most recently used first */
+G_LOCK_DEFINE_STATIC (icon_cache);
+
 static void
-cleanup_temp_file (void *p)
+icon_cache_entry_free (IconCacheEntry *entry)
 {
-  void **pp = (void **)p;
-
-  if (*pp)
-    remove (*pp);
-  g_free (*pp);
+  g_free (entry->checksum);
+  g_free (entry);
 }
 
 static gboolean
-validate_icon_more (GVariant *v)
+icon_cache_lookup (const char *checksum,
+                   gboolean   *valid)
+{
+  IconCacheEntry *entry = NULL;
+
+  G_LOCK (icon_cache);
+  if (icon_cache)
+    entry = g_hash_table_lookup (icon_cache, checksum);
+  if (entry)
+    {
+      *valid = entry->valid;
+      g_queue_unlink (&icon_cache_lru, &entry->link);
+      g_queue_push_head_link (&icon_cache_lru, &entry->link);
+    }
+  G_UNLOCK (icon_cache);
+
+  return entry != NULL;
+}
+
+static void
+icon_cache_insert (const char *checksum,
+                   gboolean    valid)
+{
+  IconCacheEntry *entry;
+
+  G_LOCK (icon_cache);
+
+  if (icon_cache == NULL)
+    icon_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        NULL, (GDestroyNotify)icon_cache_entry_free);
+
+  entry = g_hash_table_lookup (icon_cache, checksum);
+  if (entry == NULL)
+    {
+      entry = g_new0 (IconCacheEntry, 1);
+      entry->checksum = g_strdup (checksum);
+      entry->link.data = entry;
+      g_hash_table_insert (icon_cache, entry->checksum, entry);
+    }
+  else
+    g_queue_unlink (&icon_cache_lru, &entry->link);
+
+  entry->valid = valid;
+  g_queue_push_head_link (&icon_cache_lru, &entry->link);
+
+  while (icon_cache_lru.length > ICON_CACHE_SIZE)
+    {
+      GList *last = g_queue_pop_tail_link (&icon_cache_lru);
+      IconCacheEntry *evicted = last->data;
+
+      g_hash_table_remove (icon_cache, evicted->checksum);
+    }
+
+  G_UNLOCK (icon_cache);
+}
+
+static void
+trim_icon_cache (void)
+{
+  G_LOCK (icon_cache);
+  if (icon_cache)
+    g_hash_table_remove_all (icon_cache);
+  g_queue_init (&icon_cache_lru);
+  G_UNLOCK (icon_cache);
+}
+
+typedef enum {
+  ICON_VALID,
+  ICON_INVALID,
+  ICON_UNKNOWN,
+} IconValidity;
+
+/* Decides what can be decided without running the validator. For
+ * ICON_UNKNOWN, @bytes and @checksum are set for validate_icon(). */
+static IconValidity
+check_icon (GVariant  *v,
+            GBytes   **bytes,
+            char     **checksum)
 {
   g_autoptr(GIcon) icon = g_icon_deserialize (v);
-  GBytes *bytes;
-  __attribute__((cleanup(cleanup_temp_file))) char *name = NULL;
-  int fd = -1;
-  g_autoptr(GOutputStream) stream = NULL;
-  gssize written;
-  int status;
-  g_autofree char *err = NULL;
-  g_autoptr(GError) error = NULL;
   const char *icon_validator = LIBEXECDIR "/flatpak-validate-icon";
-  const char *args[6];
+  g_autofree char *icon_checksum = NULL;
+  gboolean valid;
 
   if (G_IS_THEMED_ICON (icon))
     {
       g_autofree char *a = g_strjoinv (" ", (char **)g_themed_icon_get_names (G_THEMED_ICON (icon)));
       g_debug ("Icon validation: themed icon (%s) is ok", a);
-      return TRUE;
+      return ICON_VALID;
     }
 
   if (!G_IS_BYTES_ICON (icon))
     {
       g_warning ("Unexpected icon type: %s", G_OBJECT_TYPE_NAME (icon));
-      return FALSE;
+      return ICON_INVALID;
     }
 
   if (!g_file_test (icon_validator, G_FILE_TEST_EXISTS))
     {
       g_debug ("Icon validation: %s not found, accepting icon without further validation.", icon_validator);
-      return TRUE;
+      return ICON_VALID;
     }
 
-  bytes = g_bytes_icon_get_bytes (G_BYTES_ICON (icon));
-  fd = g_file_open_tmp ("iconXXXXXX", &name, &error); 
-  if (fd == -1)
+  icon_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, g_bytes_icon_get_bytes (G_BYTES_ICON (icon)));
+  if (icon_cache_lookup (icon_checksum, &valid))
     {
-      g_debug ("Icon validation: %s", error->message);
-      return FALSE;
+      g_debug ("Icon validation: cached result for %s", icon_checksum);
+      return valid ? ICON_VALID : ICON_INVALID;
     }
 
-  stream = g_unix_output_stream_new (fd, TRUE);
-  written = g_output_stream_write_bytes (stream, bytes, NULL, &error);
-  if (written < g_bytes_get_size (bytes))
+  *bytes = g_bytes_ref (g_bytes_icon_get_bytes (G_BYTES_ICON (icon)));
+  *checksum = g_steal_pointer (&icon_checksum);
+
+  return ICON_UNKNOWN;
+}
+
+static GVariant *
+maybe_remove_icon (GVariant *notification,
+                   gboolean  keep_icon)
+{
+  GVariantBuilder n;
+  int i;
+
+  g_variant_builder_init (&n, G_VARIANT_TYPE_VARDICT);
+  for (i = 0; i < g_variant_n_children (notification); i++)
     {
-      g_debug ("Icon validation: %s", error->message);
-      return FALSE;
+      const char *key;
+      g_autoptr(GVariant) value = NULL;
+
+      g_variant_get_child (notification, i, "{&sv}", &key, &value);
+      if (strcmp (key, "icon") != 0 || keep_icon)
+        g_variant_builder_add (&n, "{sv}", key, value);
     }
 
-  if (!g_output_stream_close (stream, NULL, &error))
+  return g_variant_ref_sink (g_variant_builder_end (&n));
+}
+
+/* Called with the request lock held */
+static void
+send_notification (Request  *request,
+                   gboolean  keep_icon)
+{
+  const char *id;
+  GVariant *notification;
+  g_autoptr(GVariant) notification2 = NULL;
+
+  id = (const char *)g_object_get_data (G_OBJECT (request), "id");
+  notification = (GVariant *)g_object_get_data (G_OBJECT (request), "notification");
+
+  notification2 = maybe_remove_icon (notification, keep_icon);
+  xdp_impl_notification_call_add_notification (impl,
+                                               xdp_app_info_get_id (request->app_info),
+                                               id,
+                                               notification2,
+                                               NULL,
+                                               add_done,
+                                               g_object_ref (request));
+}
+
+/* Icons that need the validator are written to a temporary file for
+ * it, and the validator runs as an async subprocess. It re-executes
+ * itself in a sandbox, so it needs a real path, not an fd of ours. At
+ * most MAX_ICON_VALIDATIONS run at a time, the rest wait in a queue.
+ */
+#define MAX_ICON_VALIDATIONS 4
+
+typedef struct {
+  Request *request;
+  GBytes *bytes;
+  char *checksum;
+  char *path; /* Removed when done */
+} IconValidation;
+
+static GQueue queued_validations = G_QUEUE_INIT;
+static int running_validations;
+G_LOCK_DEFINE_STATIC (validations);
+
+static void
+icon_validation_free (IconValidation *validation)
+{
+  if (validation->path)
+    g_unlink (validation->path);
+  g_free (validation->path);
+  g_object_unref (validation->request);
+  g_bytes_unref (validation->bytes);
+  g_free (validation->checksum);
+  g_free (validation);
+}
+
+static char *
+write_icon_file (GBytes  *bytes,
+                 GError **error)
+{
+  g_autofree char *path = NULL;
+  const guint8 *data;
+  gsize len;
+  int fd;
+
+  fd = g_file_open_tmp ("iconXXXXXX", &path, error);
+  if (fd == -1)
+    return NULL;
+
+  data = g_bytes_get_data (bytes, &len);
+  while (len > 0)
     {
-      g_debug ("Icon validation: %s", error->message);
-      return FALSE;
+      ssize_t res = write (fd, data, len);
+
+      if (res < 0 && errno == EINTR)
+        continue;
+
+      if (res < 0)
+        {
+          int errsv = errno;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "write: %s", g_strerror (errsv));
+          close (fd);
+          g_unlink (path);
+          return NULL;
+        }
+
+      data += res;
+      len -= res;
     }
 
-  args[0] = icon_validator;
-  args[1] = "--sandbox";
-  args[2] = "512";
-  args[3] = "512";
-  args[4] = name;
-  args[5] = NULL;
+  close (fd);
+
+  return g_steal_pointer (&path);
+}
+
+static void start_next_validation (void);
+
+static void
+icon_validation_done (GObject      *source,
+                      GAsyncResult *result,
+                      gpointer      data)
+{
+  IconValidation *validation = data;
+  g_autoptr(GError) error = NULL;
+  gboolean valid;
+
+  valid = g_subprocess_wait_check_finish (G_SUBPROCESS (source), result, &error);
+  if (!valid)
+    g_debug ("Icon validation: %s", error->message);
+
+  /* The validator exits with an error both for bad icons and when its
+   * sandbox can't be set up, so only acceptance is a verdict */
+  if (valid)
+    icon_cache_insert (validation->checksum, TRUE);
 
-  if (!g_spawn_sync (NULL, (char **)args, NULL, 0, NULL, NULL, NULL, &err, &status, &error))
+  {
+    REQUEST_AUTOLOCK (validation->request);
+    send_notification (validation->request, valid);
+  }
+
+  icon_validation_free (validation);
+
+  G_LOCK (validations);
+  running_validations--;
+  G_UNLOCK (validations);
+
+  start_next_validation ();
+}
+
+static gboolean
+start_validation (IconValidation *validation)
+{
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GError) error = NULL;
+
+  validation->path = write_icon_file (validation->bytes, &error);
+  if (validation->path == NULL)
     {
       g_debug ("Icon validation: %s", error->message);
-
       return FALSE;
     }
 
-  if (!g_spawn_check_exit_status (status, &error))
+  subprocess = g_subprocess_new (G_SUBPROCESS_FLAGS_STDERR_SILENCE, &error,
+                                 LIBEXECDIR "/flatpak-validate-icon",
+                                 "--sandbox", "512", "512",
+                                 validation->path,
+                                 NULL);
+  if (subprocess == NULL)
     {
       g_debug ("Icon validation: %s", error->message);
-
       return FALSE;
     }
 
+  g_subprocess_wait_check_async (subprocess, NULL, icon_validation_done, validation);
+
   return TRUE;
 }
 
-static GVariant *
-maybe_remove_icon (GVariant *notification)
+static void
+start_next_validation (void)
 {
-  GVariantBuilder n;
-  int i;
-
-  g_variant_builder_init (&n, G_VARIANT_TYPE_VARDICT);
-  for (i = 0; i < g_variant_n_children (notification); i++)
+  while (TRUE)
     {
-      const char *key;
-      g_autoptr(GVariant) value = NULL;
+      IconValidation *validation;
 
-      g_variant_get_child (notification, i, "{&sv}", &key, &value);
-      if (strcmp (key, "icon") != 0 || validate_icon_more (value))
-        g_variant_builder_add (&n, "{sv}", key, value);
+      G_LOCK (validations);
+      if (running_validations >= MAX_ICON_VALIDATIONS ||
+          (validation = g_queue_pop_head (&queued_validations)) == NULL)
+        {
+          G_UNLOCK (validations);
+          return;
+        }
+      running_validations++;
+      G_UNLOCK (validations);
+
+      if (start_validation (validation))
+        continue;
+
+      G_LOCK (validations);
+      running_validations--;
+      G_UNLOCK (validations);
+
+      {
+        REQUEST_AUTOLOCK (validation->request);
+        send_notification (validation->request, FALSE);
+      }
+
+      icon_validation_free (validation);
     }
+}
 
-  return g_variant_ref_sink (g_variant_builder_end (&n));
+static void
+validate_icon (Request *request,
+               GBytes  *bytes,
+               char    *checksum)
+{
+  IconValidation *validation = g_new0 (IconValidation, 1);
+
+  validation->request = g_object_ref (request);
+  validation->bytes = bytes;
+  validation->checksum = checksum;
+
+  G_LOCK (validations);
+  g_queue_push_tail (&queued_validations, validation);
+  G_UNLOCK (validations);
+
+  start_next_validation ();
 }
 
 static void
@@ -461,27 +724,263 @@ handle_add_in_thread_func (GTask *task,
                            GCancellable *cancellable)
 {
   Request *request = (Request *)task_data;
-  const char *id;
   GVariant *notification;
-  g_autoptr(GVariant) notification2 = NULL;
+  g_autoptr(GVariant) icon = NULL;
+  IconValidity validity = ICON_VALID;
+  GBytes *bytes = NULL;
+  char *checksum = NULL;
+
+  {
+    REQUEST_AUTOLOCK (request);
+
+    if (!xdp_app_info_is_host (request->app_info) &&
+        !get_notification_allowed (xdp_app_info_get_id (request->app_info)))
+      return;
+
+    notification = (GVariant *)g_object_get_data (G_OBJECT (request), "notification");
+
+    icon = g_variant_lookup_value (notification, "icon", NULL);
+    if (icon)
+      validity = check_icon (icon, &bytes, &checksum);
+
+    if (validity != ICON_UNKNOWN)
+      {
+        send_notification (request, validity == ICON_VALID);
+        return;
+      }
+  }
+
+  /* Without the request lock, the queue may send other requests */
+  validate_icon (request, bytes, checksum);
+}
+
+/* Notifications are rate limited per app with a token bucket. Host
+ * apps all share the empty app id, so they are told apart by their bus
+ * name instead. When an app runs out of tokens, its notifications wait in a queue until
+ * tokens are refilled. A notification that replaces a queued one with
+ * the same id takes its place in the queue, so only the latest version
+ * is forwarded.
+ */
+#define NOTIFICATION_RATE 2 /* per second */
+#define NOTIFICATION_BURST 20
+#define MAX_QUEUED_NOTIFICATIONS 64
+
+typedef struct {
+  double tokens;
+  gint64 last_refill;
+  GQueue queued; /* Request, oldest first */
+  GHashTable *queued_by_id; /* id -> link in queued */
+  guint flush_id;
+} AppLimiter;
+
+static GHashTable *limiters; /* app ID or host sender -> AppLimiter */
+static NotificationStats stats;
+G_LOCK_DEFINE_STATIC (limiters);
+
+static void
+app_limiter_free (AppLimiter *limiter)
+{
+  if (limiter->flush_id)
+    g_source_remove (limiter->flush_id);
+  g_queue_clear_full (&limiter->queued, g_object_unref);
+  g_hash_table_unref (limiter->queued_by_id);
+  g_free (limiter);
+}
+
+static const char *
+limiter_key (Request *request)
+{
+  if (xdp_app_info_is_host (request->app_info))
+    return request->sender;
+
+  return xdp_app_info_get_id (request->app_info);
+}
+
+/* Called with the limiters lock held */
+static AppLimiter *
+ensure_limiter (const char *app_id)
+{
+  AppLimiter *limiter;
+
+  if (limiters == NULL)
+    limiters = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      g_free, (GDestroyNotify)app_limiter_free);
+
+  limiter = g_hash_table_lookup (limiters, app_id);
+  if (limiter == NULL)
+    {
+      limiter = g_new0 (AppLimiter, 1);
+      limiter->tokens = NOTIFICATION_BURST;
+      limiter->last_refill = g_get_monotonic_time ();
+      limiter->queued_by_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert (limiters, g_strdup (app_id), limiter);
+    }
+
+  return limiter;
+}
+
+/* Called with the limiters lock held */
+static void
+refill_tokens (AppLimiter *limiter)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  limiter->tokens = MIN (NOTIFICATION_BURST,
+                         limiter->tokens + (double)(now - limiter->last_refill) * NOTIFICATION_RATE / G_USEC_PER_SEC);
+  limiter->last_refill = now;
+}
+
+static void
+forward_notification (Request *request)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (notification, NULL, NULL, NULL);
+  g_task_set_task_data (task, g_object_ref (request), g_object_unref);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, handle_add_in_thread_func);
+}
 
-  REQUEST_AUTOLOCK (request);
+static gboolean flush_queued (gpointer data);
 
-  if (!xdp_app_info_is_host (request->app_info) &&
-      !get_notification_allowed (xdp_app_info_get_id (request->app_info)))
+/* Called with the limiters lock held */
+static void
+schedule_flush (const char *app_id,
+                AppLimiter *limiter)
+{
+  guint delay;
+
+  if (limiter->flush_id || limiter->queued.length == 0)
     return;
 
-  id = (const char *)g_object_get_data (G_OBJECT (request), "id");
-  notification = (GVariant *)g_object_get_data (G_OBJECT (request), "notification");
+  delay = (guint) (MAX (1.0 - limiter->tokens, 0.0) * 1000 / NOTIFICATION_RATE) + 1;
+  limiter->flush_id = g_timeout_add_full (G_PRIORITY_DEFAULT, delay,
+                                          flush_queued, g_strdup (app_id), g_free);
+}
 
-  notification2 = maybe_remove_icon (notification);
-  xdp_impl_notification_call_add_notification (impl,
-                                               xdp_app_info_get_id (request->app_info),
-                                               id,
-                                               notification2,
-                                               NULL,
-                                               add_done,
-                                               g_object_ref (request));
+static gboolean
+flush_queued (gpointer data)
+{
+  const char *app_id = data;
+  g_autoptr(GPtrArray) ready = g_ptr_array_new_with_free_func (g_object_unref);
+  AppLimiter *limiter;
+  guint i;
+
+  G_LOCK (limiters);
+
+  limiter = g_hash_table_lookup (limiters, app_id);
+  limiter->flush_id = 0;
+
+  refill_tokens (limiter);
+  while (limiter->tokens >= 1 && limiter->queued.length > 0)
+    {
+      Request *request = g_queue_pop_head (&limiter->queued);
+
+      g_hash_table_remove (limiter->queued_by_id, g_object_get_data (G_OBJECT (request), "id"));
+      limiter->tokens -= 1;
+      g_ptr_array_add (ready, request);
+    }
+
+  schedule_flush (app_id, limiter);
+
+  stats.forwarded += ready->len;
+  stats.queued -= ready->len;
+
+  G_UNLOCK (limiters);
+
+  for (i = 0; i < ready->len; i++)
+    forward_notification (g_ptr_array_index (ready, i));
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Returns %TRUE if @request can be forwarded right away, otherwise it
+ * has been queued, or has replaced a queued notification. */
+static gboolean
+rate_limit_notification (Request    *request,
+                         const char *id)
+{
+  const char *app_id = limiter_key (request);
+  AppLimiter *limiter;
+  GList *link;
+  gboolean forward = FALSE;
+
+  G_LOCK (limiters);
+
+  limiter = ensure_limiter (app_id);
+  refill_tokens (limiter);
+
+  link = g_hash_table_lookup (limiter->queued_by_id, id);
+  if (link)
+    {
+      g_debug ("Coalescing notification %s for %s", id, app_id);
+      g_object_unref (link->data);
+      link->data = g_object_ref (request);
+      stats.coalesced++;
+    }
+  else if (limiter->queued.length == 0 && limiter->tokens >= 1)
+    {
+      limiter->tokens -= 1;
+      stats.forwarded++;
+      forward = TRUE;
+    }
+  else
+    {
+      if (limiter->queued.length >= MAX_QUEUED_NOTIFICATIONS)
+        {
+          Request *oldest = g_queue_pop_head (&limiter->queued);
+
+          g_debug ("Too many notifications from %s, dropping %s", app_id,
+                   (const char *) g_object_get_data (G_OBJECT (oldest), "id"));
+          g_hash_table_remove (limiter->queued_by_id, g_object_get_data (G_OBJECT (oldest), "id"));
+          g_object_unref (oldest);
+          stats.dropped++;
+          stats.queued--;
+        }
+
+      g_debug ("Delaying notification %s for %s", id, app_id);
+      g_queue_push_tail (&limiter->queued, g_object_ref (request));
+      g_hash_table_insert (limiter->queued_by_id, g_strdup (id), g_queue_peek_tail_link (&limiter->queued));
+      stats.delayed++;
+      stats.queued++;
+      schedule_flush (app_id, limiter);
+    }
+
+  G_UNLOCK (limiters);
+
+  return forward;
+}
+
+/* Called for RemoveNotification, so a queued notification doesn't show
+ * up after it was removed. */
+static void
+drop_queued_notification (const char *app_id,
+                          const char *id)
+{
+  AppLimiter *limiter = NULL;
+  GList *link;
+
+  G_LOCK (limiters);
+
+  if (limiters)
+    limiter = g_hash_table_lookup (limiters, app_id);
+
+  if (limiter && (link = g_hash_table_lookup (limiter->queued_by_id, id)) != NULL)
+    {
+      g_hash_table_remove (limiter->queued_by_id, id);
+      g_object_unref (link->data);
+      g_queue_delete_link (&limiter->queued, link);
+      stats.queued--;
+    }
+
+  G_UNLOCK (limiters);
+}
+
+void
+notification_get_stats (NotificationStats *out_stats)
+{
+  G_LOCK (limiters);
+  *out_stats = stats;
+  G_UNLOCK (limiters);
 }
 
 static gboolean
@@ -491,7 +990,6 @@ notification_handle_add_notification (XdpNotification *object,
                                       GVariant *notification)
 {
   Request *request = request_from_invocation (invocation);
-  g_autoptr(GTask) task = NULL;
   g_autoptr(GError) error = NULL;
 
   g_object_set_data_full (G_OBJECT (request), "id", g_strdup (arg_id), g_free);
@@ -504,9 +1002,8 @@ notification_handle_add_notification (XdpNotification *object,
       return TRUE;
     }
 
-  task = g_task_new (object, NULL, NULL, NULL);
-  g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_add_in_thread_func);
+  if (rate_limit_notification (request, arg_id))
+    forward_notification (request);
 
   xdp_notification_complete_add_notification (object, invocation);
 
@@ -521,6 +1018,8 @@ remove_done (GObject *source,
   g_autoptr(Request) request = data;
   g_autoptr(GError) error = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_notification_call_remove_notification_finish (impl, result, &error))
     {
       g_warning ("Backend call failed: %s", error->message);
@@ -547,6 +1046,8 @@ notification_handle_remove_notification (XdpNotification *object,
 
   g_object_set_data_full (G_OBJECT (request), "id", g_strdup (arg_id), g_free);
 
+  drop_queued_notification (limiter_key (request), arg_id);
+
   xdp_impl_notification_call_remove_notification (impl,
                                                   xdp_app_info_get_id (request->app_info),
                                                   arg_id,
@@ -662,6 +1163,7 @@ notification_create (GDBusConnection *connection,
 
   notification = g_object_new (notification_get_type (), NULL);
   active = g_hash_table_new_full (pair_hash, pair_equal, pair_free, g_free);
+  xdp_add_cache_trim_func (trim_icon_cache);
 
   g_dbus_connection_signal_subscribe (connection,
                                       dbus_name,
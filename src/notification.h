@@ -23,5 +23,15 @@
 
 #include <gio/gio.h>
 
+typedef struct {
+  guint64 forwarded; /* sent to the backend */
+  guint64 delayed;   /* queued because the app ran out of tokens */
+  guint64 coalesced; /* replaced a queued notification with the same id */
+  guint64 dropped;   /* pushed out of a full queue */
+  guint queued;      /* waiting right now */
+} NotificationStats;
+
+void notification_get_stats (NotificationStats *stats);
+
 GDBusInterfaceSkeleton * notification_create (GDBusConnection *connection,
                                               const char *dbus_name);
@@ -124,15 +124,13 @@ get_latest_choice_info (const char *app_id,
   g_autoptr(GVariant) out_perms = NULL;
   g_autoptr(GVariant) out_data = NULL;
 
-  if (!xdp_impl_permission_store_call_lookup_sync (get_permission_store (),
-                                                   PERMISSION_TABLE,
-                                                   content_type,
-                                                   &out_perms,
-                                                   &out_data,
-                                                   NULL,
-                                                   &error))
-    {
-      g_dbus_error_strip_remote_error (error);
+  if (!get_app_permission_entry_sync (app_id,
+                                      PERMISSION_TABLE,
+                                      content_type,
+                                      &out_perms,
+                                      &out_data,
+                                      &error))
+    {
       /* Not finding an entry for the content type in the permission store is perfectly ok */
       if (!g_error_matches (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND))
         g_warning ("Unable to retrieve info for '%s' in the %s table of the permission store: %s",
@@ -267,7 +265,6 @@ update_permissions_store (const char *app_id,
                           const char *content_type,
                           const char *chosen_id)
 {
-  g_autoptr(GError) error = NULL;
   g_autofree char *latest_id = NULL;
   gint latest_count;
   gint latest_threshold;
@@ -302,19 +299,82 @@ update_permissions_store (const char *app_id,
            in_permissions[PERM_APP_COUNT],
            in_permissions[PERM_APP_THRESHOLD]);
 
-  
-  if (!xdp_impl_permission_store_call_set_permission_sync (get_permission_store (),
-                                                           PERMISSION_TABLE,
-                                                           TRUE,
-                                                           content_type,
-                                                           app_id,
-                                                           (const char * const*) in_permissions,
-                                                           NULL,
-                                                           &error))
-    {
-      g_dbus_error_strip_remote_error (error);
-      g_warning ("Error updating permission store: %s", error->message);
-      g_clear_error (&error);
+  set_permissions_sync (app_id, PERMISSION_TABLE, content_type,
+                        (const char * const*) in_permissions);
+}
+
+/* Choices are recorded in the background, after the response went out.
+ * One worker applies them in order, since each update depends on the
+ * count left by the previous one. */
+typedef struct
+{
+  char *app_id;
+  char *content_type;
+  char *chosen_id;
+} StoreUpdate;
+
+G_LOCK_DEFINE_STATIC (store_updates);
+static GQueue store_updates = G_QUEUE_INIT;
+static gboolean store_updates_running;
+
+static void
+store_update_free (StoreUpdate *update)
+{
+  g_free (update->app_id);
+  g_free (update->content_type);
+  g_free (update->chosen_id);
+  g_free (update);
+}
+
+static void
+update_permissions_store_in_thread_func (GTask *task,
+                                         gpointer source_object,
+                                         gpointer task_data,
+                                         GCancellable *cancellable)
+{
+  while (TRUE)
+    {
+      StoreUpdate *update;
+
+      G_LOCK (store_updates);
+      update = g_queue_pop_head (&store_updates);
+      if (update == NULL)
+        store_updates_running = FALSE;
+      G_UNLOCK (store_updates);
+
+      if (update == NULL)
+        break;
+
+      update_permissions_store (update->app_id, update->content_type, update->chosen_id);
+      store_update_free (update);
+    }
+}
+
+static void
+queue_update_permissions_store (const char *app_id,
+                                const char *content_type,
+                                const char *chosen_id)
+{
+  StoreUpdate *update;
+  gboolean start;
+
+  update = g_new0 (StoreUpdate, 1);
+  update->app_id = g_strdup (app_id);
+  update->content_type = g_strdup (content_type);
+  update->chosen_id = g_strdup (chosen_id);
+
+  G_LOCK (store_updates);
+  g_queue_push_tail (&store_updates, update);
+  start = !store_updates_running;
+  store_updates_running = TRUE;
+  G_UNLOCK (store_updates);
+
+  if (start)
+    {
+      g_autoptr(GTask) task = g_task_new (NULL, NULL, NULL, NULL);
+
+      xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND,
+                            update_permissions_store_in_thread_func);
     }
 }
 
@@ -355,7 +415,7 @@ send_response_in_thread_func (GTask *task,
       content_type = (const char *)g_object_get_data (G_OBJECT (request), "content-type");
 
       if (launch_application_with_uri (choice, uri, parent_window, writable))
-        update_permissions_store (xdp_app_info_get_id (request->app_info), content_type, choice);
+        queue_update_permissions_store (xdp_app_info_get_id (request->app_info), content_type, choice);
     }
 
 out:
@@ -377,6 +437,8 @@ app_chooser_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_app_chooser_call_choose_application_finish (XDP_IMPL_APP_CHOOSER (source),
                                                             &response,
                                                             &options,
@@ -392,7 +454,7 @@ app_chooser_done (GObject *source,
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static void
@@ -419,22 +481,117 @@ resolve_scheme_and_content_type (const char *uri,
   g_debug ("Content type for %s uri %s: %s", uri, *scheme, *content_type);
 }
 
+/* Sniffed content types of recently opened files. An entry is only
+ * used while the file is unchanged. */
+#define CONTENT_TYPE_CACHE_SIZE 256
+
+typedef struct
+{
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  char *content_type;
+} ContentTypeEntry;
+
+G_LOCK_DEFINE_STATIC (content_type_cache);
+static GHashTable *content_type_cache;
+
+static void
+content_type_entry_free (ContentTypeEntry *entry)
+{
+  g_free (entry->content_type);
+  g_free (entry);
+}
+
+static gboolean
+content_type_entry_matches (ContentTypeEntry  *entry,
+                            const struct stat *st)
+{
+  return entry->dev == st->st_dev &&
+         entry->ino == st->st_ino &&
+         entry->size == st->st_size &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+         entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static char *
+lookup_cached_content_type (const char        *path,
+                            const struct stat *st)
+{
+  ContentTypeEntry *entry;
+  char *content_type = NULL;
+
+  G_LOCK (content_type_cache);
+  if (content_type_cache)
+    {
+      entry = g_hash_table_lookup (content_type_cache, path);
+      if (entry && content_type_entry_matches (entry, st))
+        content_type = g_strdup (entry->content_type);
+    }
+  G_UNLOCK (content_type_cache);
+
+  return content_type;
+}
+
+static void
+cache_content_type (const char        *path,
+                    const struct stat *st,
+                    const char        *content_type)
+{
+  ContentTypeEntry *entry;
+
+  entry = g_new0 (ContentTypeEntry, 1);
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->content_type = g_strdup (content_type);
+
+  G_LOCK (content_type_cache);
+  if (content_type_cache == NULL)
+    content_type_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)content_type_entry_free);
+  if (g_hash_table_size (content_type_cache) >= CONTENT_TYPE_CACHE_SIZE)
+    g_hash_table_remove_all (content_type_cache);
+  g_hash_table_replace (content_type_cache, g_strdup (path), entry);
+  G_UNLOCK (content_type_cache);
+}
+
 static void
 get_content_type_for_file (const char  *path,
                            char       **content_type)
 {
   g_autoptr(GError) error = NULL;
-  g_autoptr(GFile) file = g_file_new_for_path (path);
-  g_autoptr(GFileInfo) info = g_file_query_info (file,
-                                                 G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
-                                                 0,
-                                                 NULL,
-                                                 &error);
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  struct stat st;
+  gboolean have_stat;
+
+  have_stat = stat (path, &st) == 0;
+  if (have_stat)
+    {
+      *content_type = lookup_cached_content_type (path, &st);
+      if (*content_type)
+        {
+          g_debug ("Cached content type for file %s: %s", path, *content_type);
+          return;
+        }
+    }
+
+  file = g_file_new_for_path (path);
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+                            0,
+                            NULL,
+                            &error);
 
   if (info != NULL)
     {
       *content_type = g_strdup (g_file_info_get_content_type (info));
       g_debug ("Content type for file %s: %s", path, *content_type);
+      if (have_stat && *content_type)
+        cache_content_type (path, &st, *content_type);
     }
   else
     {
@@ -459,12 +616,110 @@ can_skip_app_chooser (const char *scheme,
   return FALSE;
 }
 
+/* Default and recommended handlers by content type, dropped whenever
+ * the installed applications change. The generation keeps lookups
+ * that raced with a change from being stored. */
+typedef struct
+{
+  char *default_app;
+  GStrv choices;
+  guint n_choices;
+} HandlerEntry;
+
+G_LOCK_DEFINE_STATIC (handler_cache);
+static GHashTable *handler_cache;
+static guint64 handler_cache_generation;
+
 static void
-find_recommended_choices (const char *scheme,
-                          const char *content_type,
-                          char **default_app,
-                          GStrv *choices,
-                          guint *choices_len)
+handler_entry_free (HandlerEntry *entry)
+{
+  g_free (entry->default_app);
+  g_strfreev (entry->choices);
+  g_free (entry);
+}
+
+static void
+invalidate_handler_cache (GAppInfoMonitor *monitor,
+                          gpointer         user_data)
+{
+  G_LOCK (handler_cache);
+  handler_cache_generation++;
+  g_hash_table_remove_all (handler_cache);
+  G_UNLOCK (handler_cache);
+}
+
+static void find_recommended_choices (const char *scheme,
+                                      const char *content_type,
+                                      char **default_app,
+                                      GStrv *choices,
+                                      guint *choices_len);
+
+static void
+refresh_handler_cache_in_thread_func (GTask        *task,
+                                      gpointer      source_object,
+                                      gpointer      task_data,
+                                      GCancellable *cancellable)
+{
+  GStrv content_types = task_data;
+  int i;
+
+  for (i = 0; content_types[i]; i++)
+    {
+      g_autofree char *default_app = NULL;
+      g_auto(GStrv) choices = NULL;
+      guint n_choices;
+
+      find_recommended_choices ("", content_types[i], &default_app, &choices, &n_choices);
+    }
+}
+
+/* GAppInfoMonitor doesn't say what changed, so the handlers of every
+ * content type that was looked up are found again right away, in a
+ * worker thread, rather than by the next requests for them */
+static void
+refresh_handler_cache (GAppInfoMonitor *monitor,
+                       gpointer         user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  GStrv content_types;
+  int i;
+
+  G_LOCK (handler_cache);
+  content_types = (GStrv) g_hash_table_get_keys_as_array (handler_cache, NULL);
+  for (i = 0; content_types[i]; i++)
+    content_types[i] = g_strdup (content_types[i]);
+  handler_cache_generation++;
+  g_hash_table_remove_all (handler_cache);
+  G_UNLOCK (handler_cache);
+
+  if (content_types[0] == NULL)
+    {
+      g_free (content_types);
+      return;
+    }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, content_types, (GDestroyNotify) g_strfreev);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, refresh_handler_cache_in_thread_func);
+}
+
+static void
+trim_caches (void)
+{
+  G_LOCK (content_type_cache);
+  if (content_type_cache)
+    g_hash_table_remove_all (content_type_cache);
+  G_UNLOCK (content_type_cache);
+
+  invalidate_handler_cache (NULL, NULL);
+}
+
+static void
+find_recommended_choices_uncached (const char *scheme,
+                                   const char *content_type,
+                                   char **default_app,
+                                   GStrv *choices,
+                                   guint *choices_len)
 {
   GAppInfo *info;
   GList *infos, *l;
@@ -509,6 +764,53 @@ find_recommended_choices (const char *scheme,
   *choices_len = n_choices;
 }
 
+static void
+find_recommended_choices (const char *scheme,
+                          const char *content_type,
+                          char **default_app,
+                          GStrv *choices,
+                          guint *choices_len)
+{
+  HandlerEntry *entry;
+  guint64 generation;
+
+  G_LOCK (handler_cache);
+  entry = g_hash_table_lookup (handler_cache, content_type);
+  if (entry)
+    {
+      *default_app = g_strdup (entry->default_app);
+      *choices = g_strdupv (entry->choices);
+      *choices_len = entry->n_choices;
+    }
+  generation = handler_cache_generation;
+  G_UNLOCK (handler_cache);
+
+  if (entry)
+    {
+      g_debug ("Cached handlers for %s, %s: %s", scheme, content_type, *default_app);
+      return;
+    }
+
+  find_recommended_choices_uncached (scheme, content_type,
+                                     default_app, choices, choices_len);
+
+  entry = g_new0 (HandlerEntry, 1);
+  entry->default_app = g_strdup (*default_app);
+  entry->choices = g_strdupv (*choices);
+  entry->n_choices = *choices_len;
+
+  G_LOCK (handler_cache);
+  if (generation == handler_cache_generation)
+    {
+      g_hash_table_replace (handler_cache, g_strdup (content_type), entry);
+      entry = NULL;
+    }
+  G_UNLOCK (handler_cache);
+
+  if (entry)
+    handler_entry_free (entry);
+}
+
 static void
 app_info_changed (GAppInfoMonitor *monitor,
                   Request *request)
@@ -541,7 +843,6 @@ handle_open_in_thread_func (GTask *task,
   const char *parent_window;
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autofree char *uri = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   g_autofree char *default_app = NULL;
   g_auto(GStrv) choices = NULL;
   guint n_choices;
@@ -723,13 +1024,7 @@ handle_open_in_thread_func (GTask *task,
   if (uri)
     g_variant_builder_add (&opts_builder, "{sv}", "uri", g_variant_new_string (uri));
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, NULL);
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
 
   g_signal_connect_object (monitor, "changed", G_CALLBACK (app_info_changed), request, 0);
 
@@ -784,7 +1079,7 @@ handle_open_uri (XdpOpenURI *object,
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_open_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, handle_open_in_thread_func);
 
   return TRUE;
 }
@@ -838,7 +1133,7 @@ handle_open_file (XdpOpenURI *object,
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_open_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, handle_open_in_thread_func);
 
   return TRUE;
 }
@@ -885,7 +1180,7 @@ handle_open_directory (XdpOpenURI *object,
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_open_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, handle_open_in_thread_func);
 
   return TRUE;
 }
@@ -933,7 +1228,12 @@ open_uri_create (GDBusConnection *connection,
 
   open_uri = g_object_new (open_uri_get_type (), NULL);
 
-  monitor = g_app_info_monitor_get ();
+  monitor = xdp_get_app_info_monitor ();
+
+  handler_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)handler_entry_free);
+  g_signal_connect (monitor, "changed", G_CALLBACK (refresh_handler_cache), NULL);
+  xdp_add_cache_trim_func (trim_caches);
 
   return G_DBUS_INTERFACE_SKELETON (open_uri);
 }
@@ -23,9 +23,334 @@
 #include <string.h>
 
 #include "permissions.h"
+#include "latency.h"
+#include "xdp-utils.h"
 
 static XdpImplPermissionStore *permission_store = NULL;
 
+/* Permissions of the entries we looked up, kept up to date from the
+ * Changed signal of the permission store. The key is "table\nid" and
+ * the value the a{sas} permissions, the whole (a{sas}v) entry when it
+ * was looked up with its data, or NULL if the entry doesn't exist.
+ * The generation is bumped on every invalidation, so that lookups that
+ * raced with a change don't store stale results. */
+#define PERMISSION_CACHE_SIZE 4096
+
+G_LOCK_DEFINE_STATIC (permission_cache);
+static GHashTable *permission_cache;
+static guint64 permission_cache_generation;
+
+/* Entries of which only one app's permissions were looked up, with
+ * GetPermission. Also keyed by "table\nid", the value maps each app
+ * id to its (a{sas}v) reply, whose permissions only have that app in
+ * them. permission_cache entries take precedence. This shares the lock
+ * and generation of permission_cache, and is invalidated with it. */
+static GHashTable *app_permission_cache;
+
+/* Store calls are attributed by table, which tells which portal
+ * made them */
+static void
+record_store_latency (const char *method,
+                      const char *table,
+                      gint64      start)
+{
+  g_autofree char *name = NULL;
+
+  if (!latency_enabled ())
+    return;
+
+  name = g_strdup_printf ("PermissionStore.%s %s", method, table);
+  latency_record (name, LATENCY_PERMISSION_STORE, g_get_monotonic_time () - start);
+}
+
+static char *
+permission_cache_key (const char *table,
+                      const char *id)
+{
+  return g_strconcat (table, "\n", id, NULL);
+}
+
+static gboolean
+lookup_cached_permissions (const char  *table,
+                           const char  *id,
+                           GVariant   **permissions_out,
+                           guint64     *generation_out)
+{
+  g_autofree char *key = permission_cache_key (table, id);
+  gpointer permissions;
+  gboolean found;
+
+  G_LOCK (permission_cache);
+  found = g_hash_table_lookup_extended (permission_cache, key, NULL, &permissions);
+  if (found && permissions == NULL)
+    *permissions_out = NULL;
+  else if (found && g_variant_is_of_type (permissions, G_VARIANT_TYPE_TUPLE))
+    *permissions_out = g_variant_get_child_value (permissions, 0);
+  else if (found)
+    *permissions_out = g_variant_ref (permissions);
+  *generation_out = permission_cache_generation;
+  G_UNLOCK (permission_cache);
+
+  return found;
+}
+
+/* Like lookup_cached_permissions(), but only entries cached with their
+ * data count */
+static gboolean
+lookup_cached_entry (const char  *table,
+                     const char  *id,
+                     GVariant   **permissions_out,
+                     GVariant   **data_out,
+                     guint64     *generation_out)
+{
+  g_autofree char *key = permission_cache_key (table, id);
+  gpointer entry;
+  gboolean found;
+
+  G_LOCK (permission_cache);
+  found = g_hash_table_lookup_extended (permission_cache, key, NULL, &entry);
+  if (found && entry == NULL)
+    {
+      *permissions_out = NULL;
+      *data_out = NULL;
+    }
+  else if (found && g_variant_is_of_type (entry, G_VARIANT_TYPE_TUPLE))
+    {
+      *permissions_out = g_variant_get_child_value (entry, 0);
+      *data_out = g_variant_get_child_value (entry, 1);
+    }
+  else
+    {
+      found = FALSE;
+    }
+  *generation_out = permission_cache_generation;
+  G_UNLOCK (permission_cache);
+
+  return found;
+}
+
+static gboolean
+lookup_cached_app_entry (const char  *table,
+                         const char  *id,
+                         const char  *app_id,
+                         GVariant   **entry_out,
+                         guint64     *generation_out)
+{
+  g_autofree char *key = permission_cache_key (table, id);
+  GHashTable *apps;
+  GVariant *entry = NULL;
+
+  G_LOCK (permission_cache);
+  apps = g_hash_table_lookup (app_permission_cache, key);
+  if (apps)
+    entry = g_hash_table_lookup (apps, app_id);
+  if (entry)
+    *entry_out = g_variant_ref (entry);
+  *generation_out = permission_cache_generation;
+  G_UNLOCK (permission_cache);
+
+  return entry != NULL;
+}
+
+static void
+cache_app_entry (const char *table,
+                 const char *id,
+                 const char *app_id,
+                 GVariant   *entry,
+                 guint64     generation)
+{
+  G_LOCK (permission_cache);
+  if (generation == permission_cache_generation)
+    {
+      g_autofree char *key = permission_cache_key (table, id);
+      GHashTable *apps;
+
+      if (g_hash_table_size (app_permission_cache) >= PERMISSION_CACHE_SIZE)
+        g_hash_table_remove_all (app_permission_cache);
+
+      apps = g_hash_table_lookup (app_permission_cache, key);
+      if (apps == NULL)
+        {
+          apps = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free, (GDestroyNotify) g_variant_unref);
+          g_hash_table_insert (app_permission_cache, g_steal_pointer (&key), apps);
+        }
+
+      g_hash_table_replace (apps, g_strdup (app_id), g_variant_ref (entry));
+    }
+  G_UNLOCK (permission_cache);
+}
+
+static void
+cache_permissions (const char *table,
+                   const char *id,
+                   GVariant   *permissions,
+                   guint64     generation)
+{
+  G_LOCK (permission_cache);
+  if (generation == permission_cache_generation)
+    {
+      if (g_hash_table_size (permission_cache) >= PERMISSION_CACHE_SIZE)
+        g_hash_table_remove_all (permission_cache);
+
+      g_hash_table_replace (permission_cache,
+                            permission_cache_key (table, id),
+                            permissions ? g_variant_ref (permissions) : NULL);
+    }
+  G_UNLOCK (permission_cache);
+}
+
+static void
+cache_entry (const char *table,
+             const char *id,
+             GVariant   *permissions,
+             GVariant   *data,
+             guint64     generation)
+{
+  g_autoptr(GVariant) entry = NULL;
+
+  entry = g_variant_ref_sink (g_variant_new ("(@a{sas}@v)", permissions, data));
+  cache_permissions (table, id, entry, generation);
+}
+
+static void
+uncache_permissions (const char *table,
+                     const char *id)
+{
+  g_autofree char *key = NULL;
+
+  G_LOCK (permission_cache);
+  permission_cache_generation++;
+  if (table)
+    {
+      key = permission_cache_key (table, id);
+      g_hash_table_remove (permission_cache, key);
+      g_hash_table_remove (app_permission_cache, key);
+    }
+  else
+    {
+      g_hash_table_remove_all (permission_cache);
+      g_hash_table_remove_all (app_permission_cache);
+    }
+  G_UNLOCK (permission_cache);
+}
+
+/* Puts our own change of the permissions of app_id into the cache, if
+ * the entry is cached, so it is seen before the store has handled it */
+static void
+cache_app_permissions (const char         *table,
+                       const char         *id,
+                       const char         *app_id,
+                       const char * const *permissions)
+{
+  g_autofree char *key = permission_cache_key (table, id);
+  g_autoptr(GVariant) old_permissions = NULL;
+  g_autoptr(GVariant) data = NULL;
+  GVariantBuilder builder;
+  GHashTable *apps;
+  gpointer entry;
+
+  G_LOCK (permission_cache);
+
+  permission_cache_generation++;
+
+  apps = g_hash_table_lookup (app_permission_cache, key);
+  if (apps)
+    {
+      GHashTableIter iter;
+      GVariant *other_entry;
+      g_autoptr(GVariant) app_data = NULL;
+
+      /* The data is the same for all apps of the entry */
+      g_hash_table_iter_init (&iter, apps);
+      if (g_hash_table_iter_next (&iter, NULL, (gpointer *) &other_entry))
+        {
+          app_data = g_variant_get_child_value (other_entry, 1);
+
+          g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+          g_variant_builder_add (&builder, "{s^as}", app_id, permissions);
+          g_hash_table_replace (apps, g_strdup (app_id),
+                                g_variant_ref_sink (g_variant_new ("(@a{sas}@v)",
+                                                                   g_variant_builder_end (&builder),
+                                                                   app_data)));
+        }
+    }
+
+  if (g_hash_table_lookup_extended (permission_cache, key, NULL, &entry))
+    {
+      GVariant *new_permissions;
+
+      if (entry && g_variant_is_of_type (entry, G_VARIANT_TYPE_TUPLE))
+        {
+          old_permissions = g_variant_get_child_value (entry, 0);
+          data = g_variant_get_child_value (entry, 1);
+        }
+      else if (entry)
+        old_permissions = g_variant_ref (entry);
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+      if (old_permissions)
+        {
+          GVariantIter iter;
+          const char *app;
+          GVariant *app_permissions;
+
+          g_variant_iter_init (&iter, old_permissions);
+          while (g_variant_iter_next (&iter, "{&s@as}", &app, &app_permissions))
+            {
+              if (strcmp (app, app_id) != 0)
+                g_variant_builder_add (&builder, "{s@as}", app, app_permissions);
+              g_variant_unref (app_permissions);
+            }
+        }
+      g_variant_builder_add (&builder, "{s^as}", app_id, permissions);
+      new_permissions = g_variant_builder_end (&builder);
+
+      if (data)
+        new_permissions = g_variant_new ("(@a{sas}@v)", new_permissions, data);
+
+      g_hash_table_replace (permission_cache,
+                            g_steal_pointer (&key),
+                            g_variant_ref_sink (new_permissions));
+    }
+
+  G_UNLOCK (permission_cache);
+}
+
+static void
+permission_store_changed (XdpImplPermissionStore *store,
+                          const char             *table,
+                          const char             *id,
+                          gboolean                deleted,
+                          GVariant               *data,
+                          GVariant               *permissions,
+                          gpointer                user_data)
+{
+  uncache_permissions (table, id);
+}
+
+static void
+permission_store_owner_changed (GObject    *object,
+                                GParamSpec *pspec,
+                                gpointer    user_data)
+{
+  /* A new store may have different contents */
+  uncache_permissions (NULL, NULL);
+}
+
+static void
+trim_permission_cache (void)
+{
+  uncache_permissions (NULL, NULL);
+}
+
+static void
+variant_unref0 (gpointer data)
+{
+  if (data)
+    g_variant_unref (data);
+}
+
 char **
 get_permissions_sync (const char *app_id,
                       const char *table,
@@ -35,17 +360,50 @@ get_permissions_sync (const char *app_id,
   g_autoptr(GVariant) out_perms = NULL;
   g_autoptr(GVariant) out_data = NULL;
   g_autofree char **permissions = NULL;
+  guint64 generation;
 
-  if (!xdp_impl_permission_store_call_lookup_sync (permission_store,
-                                                   table,
-                                                   id,
-                                                   &out_perms,
-                                                   &out_data,
-                                                   NULL,
-                                                   &error))
+  if (!lookup_cached_permissions (table, id, &out_perms, &generation))
     {
-      g_dbus_error_strip_remote_error (error);
-      g_debug ("No '%s' permissions found: %s", table, error->message);
+      /* Shared ids can have many apps, only ask for this one */
+      if (xdp_impl_permission_store_get_version (permission_store) >= 5)
+        {
+          if (!get_app_permission_entry_sync (app_id, table, id, &out_perms, &out_data, &error))
+            {
+              g_debug ("No '%s' permissions found: %s", table, error->message);
+              return NULL;
+            }
+        }
+      else
+        {
+          gint64 start = g_get_monotonic_time ();
+          gboolean found;
+
+          found = xdp_impl_permission_store_call_lookup_sync (permission_store,
+                                                              table,
+                                                              id,
+                                                              &out_perms,
+                                                              &out_data,
+                                                              NULL,
+                                                              &error);
+          record_store_latency ("Lookup", table, start);
+
+          if (!found)
+            {
+              if (g_error_matches (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND))
+                cache_permissions (table, id, NULL, generation);
+
+              g_dbus_error_strip_remote_error (error);
+              g_debug ("No '%s' permissions found: %s", table, error->message);
+              return NULL;
+            }
+
+          cache_entry (table, id, out_perms, out_data, generation);
+        }
+    }
+
+  if (out_perms == NULL)
+    {
+      g_debug ("No '%s' permissions found for %s", table, id);
       return NULL;
     }
 
@@ -59,6 +417,228 @@ get_permissions_sync (const char *app_id,
   return g_strdupv (permissions);
 }
 
+/* Returns the permissions and data of an entry of the permission
+ * store, from the cache when possible. Missing entries are reported
+ * with XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND. */
+gboolean
+get_permission_entry_sync (const char  *table,
+                           const char  *id,
+                           GVariant   **out_permissions,
+                           GVariant   **out_data,
+                           GError     **error)
+{
+  g_autoptr(GVariant) permissions = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint64 generation;
+
+  if (!lookup_cached_entry (table, id, &permissions, &data, &generation))
+    {
+      gint64 start = g_get_monotonic_time ();
+      gboolean found;
+
+      found = xdp_impl_permission_store_call_lookup_sync (permission_store,
+                                                          table,
+                                                          id,
+                                                          &permissions,
+                                                          &data,
+                                                          NULL,
+                                                          &local_error);
+      record_store_latency ("Lookup", table, start);
+
+      if (!found)
+        {
+          g_dbus_error_strip_remote_error (local_error);
+          if (g_error_matches (local_error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND))
+            cache_permissions (table, id, NULL, generation);
+
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      cache_entry (table, id, permissions, data, generation);
+    }
+
+  if (permissions == NULL)
+    {
+      g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                   "No entry for %s", id);
+      return FALSE;
+    }
+
+  *out_permissions = g_steal_pointer (&permissions);
+  *out_data = g_steal_pointer (&data);
+
+  return TRUE;
+}
+
+/* Like get_permission_entry_sync(), but the returned permissions may
+ * only have app_id in them. Stores that support it are only asked for
+ * the permissions of app_id, which is much less to send for entries
+ * that many apps have permissions for. */
+gboolean
+get_app_permission_entry_sync (const char  *app_id,
+                               const char  *table,
+                               const char  *id,
+                               GVariant   **out_permissions,
+                               GVariant   **out_data,
+                               GError     **error)
+{
+  g_autoptr(GVariant) permissions = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint64 generation;
+  gint64 start;
+  gboolean found;
+
+  if (xdp_impl_permission_store_get_version (permission_store) < 5)
+    return get_permission_entry_sync (table, id, out_permissions, out_data, error);
+
+  if (lookup_cached_entry (table, id, &permissions, &data, &generation))
+    {
+      if (permissions == NULL)
+        {
+          g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                       "No entry for %s", id);
+          return FALSE;
+        }
+
+      *out_permissions = g_steal_pointer (&permissions);
+      *out_data = g_steal_pointer (&data);
+      return TRUE;
+    }
+
+  if (!lookup_cached_app_entry (table, id, app_id, &entry, &generation))
+    {
+      start = g_get_monotonic_time ();
+      found = xdp_impl_permission_store_call_get_permission_sync (permission_store,
+                                                                  table,
+                                                                  id,
+                                                                  app_id,
+                                                                  &permissions,
+                                                                  &data,
+                                                                  NULL,
+                                                                  &local_error);
+      record_store_latency ("GetPermission", table, start);
+
+      if (!found)
+        {
+          g_dbus_error_strip_remote_error (local_error);
+          if (g_error_matches (local_error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND))
+            cache_permissions (table, id, NULL, generation);
+
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      entry = g_variant_ref_sink (g_variant_new ("(@a{sas}@v)", permissions, data));
+      cache_app_entry (table, id, app_id, entry, generation);
+    }
+
+  *out_permissions = g_variant_get_child_value (entry, 0);
+  *out_data = g_variant_get_child_value (entry, 1);
+
+  return TRUE;
+}
+
+/* Looks up the permissions of app_id for all ids, in one round trip
+ * when the store supports it. The result maps each id that has
+ * permissions for the app to its permissions. */
+GHashTable *
+get_permissions_many_sync (const char         *app_id,
+                           const char         *table,
+                           const char * const *ids)
+{
+  g_autoptr(GHashTable) entries = NULL;
+  g_autoptr(GPtrArray) missing = NULL;
+  GHashTable *result;
+  guint64 generation = 0;
+  int i;
+
+  entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, variant_unref0);
+  missing = g_ptr_array_new ();
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      GVariant *perms = NULL;
+      guint64 id_generation;
+
+      if (lookup_cached_permissions (table, ids[i], &perms, &id_generation))
+        g_hash_table_insert (entries, (char *) ids[i], perms);
+      else
+        {
+          if (missing->len == 0)
+            generation = id_generation;
+          g_ptr_array_add (missing, (char *) ids[i]);
+        }
+    }
+
+  if (missing->len > 0 &&
+      xdp_impl_permission_store_get_version (permission_store) >= 3)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(GVariant) out_entries = NULL;
+      gint64 start = g_get_monotonic_time ();
+      gboolean found;
+
+      g_ptr_array_add (missing, NULL);
+      found = xdp_impl_permission_store_call_lookup_many_sync (permission_store,
+                                                               table,
+                                                               (const char * const *) missing->pdata,
+                                                               &out_entries,
+                                                               NULL,
+                                                               &error);
+      record_store_latency ("LookupMany", table, start);
+
+      if (found)
+        {
+          for (i = 0; missing->pdata[i] != NULL; i++)
+            {
+              const char *id = missing->pdata[i];
+              g_autoptr(GVariant) perms = NULL;
+
+              if (!g_variant_lookup (out_entries, id, "(@a{sas}*)", &perms, NULL))
+                perms = NULL;
+
+              cache_permissions (table, id, perms, generation);
+              g_hash_table_insert (entries, (char *) id, g_steal_pointer (&perms));
+            }
+        }
+      else
+        {
+          g_dbus_error_strip_remote_error (error);
+          g_debug ("No '%s' permissions found: %s", table, error->message);
+        }
+    }
+  else
+    {
+      /* Older stores, one call per id */
+      for (i = 0; i < (int) missing->len; i++)
+        {
+          const char *id = missing->pdata[i];
+          g_auto(GStrv) perms = get_permissions_sync (app_id, table, id);
+          g_autoptr(GVariant) cached = NULL;
+
+          if (lookup_cached_permissions (table, id, &cached, &generation))
+            g_hash_table_insert (entries, (char *) id, g_steal_pointer (&cached));
+        }
+    }
+
+  result = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_strfreev);
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      GVariant *perms = g_hash_table_lookup (entries, ids[i]);
+      g_autofree char **permissions = NULL;
+
+      if (perms && g_variant_lookup (perms, app_id, "^a&s", &permissions))
+        g_hash_table_replace (result, g_strdup (ids[i]), g_strdupv (permissions));
+    }
+
+  return result;
+}
+
 Permission
 permissions_to_tristate (char **permissions)
 {
@@ -121,19 +701,140 @@ set_permissions_sync (const char *app_id,
                       const char * const *permissions)
 {
   g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time ();
+  gboolean ok;
 
-  if (!xdp_impl_permission_store_call_set_permission_sync (permission_store,
+  ok = xdp_impl_permission_store_call_set_permission_sync (permission_store,
                                                            table,
                                                            TRUE,
                                                            id,
                                                            app_id,
                                                            permissions,
                                                            NULL,
-                                                           &error))
+                                                           &error);
+  record_store_latency ("SetPermission", table, start);
+
+  if (!ok)
+    {
+      g_dbus_error_strip_remote_error (error);
+      g_warning ("Error updating permission store: %s", error->message);
+    }
+
+  /* Don't wait for the Changed signal to see our own change */
+  uncache_permissions (table, id);
+}
+
+/* Sets the same permissions of app_id for all ids, in one round trip
+ * when the store supports it */
+void
+set_permissions_many_sync (const char         *app_id,
+                           const char         *table,
+                           const char * const *ids,
+                           const char * const *permissions)
+{
+  const char *no_permissions[] = { NULL };
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+  gint64 start;
+  gboolean ok;
+  int i;
+
+  if (permissions == NULL)
+    permissions = no_permissions;
+
+  if (xdp_impl_permission_store_get_version (permission_store) < 3)
+    {
+      for (i = 0; ids[i] != NULL; i++)
+        set_permissions_sync (app_id, table, ids[i], permissions);
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  for (i = 0; ids[i] != NULL; i++)
+    g_variant_builder_add (&builder, "(ss^as)", ids[i], app_id, permissions);
+
+  start = g_get_monotonic_time ();
+  ok = xdp_impl_permission_store_call_set_many_sync (permission_store,
+                                                     table,
+                                                     TRUE,
+                                                     g_variant_builder_end (&builder),
+                                                     NULL,
+                                                     &error);
+  record_store_latency ("SetMany", table, start);
+
+  if (!ok)
     {
       g_dbus_error_strip_remote_error (error);
       g_warning ("Error updating permission store: %s", error->message);
     }
+
+  for (i = 0; ids[i] != NULL; i++)
+    uncache_permissions (table, ids[i]);
+}
+
+static void
+set_permission_done (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      data)
+{
+  g_autofree char *key = data;
+  g_autoptr(GError) error = NULL;
+
+  if (!xdp_impl_permission_store_call_set_permission_finish (XDP_IMPL_PERMISSION_STORE (source),
+                                                             result,
+                                                             &error))
+    {
+      g_auto(GStrv) parts = g_strsplit (key, "\n", 2);
+
+      g_dbus_error_strip_remote_error (error);
+      g_warning ("Error updating permission store: %s", error->message);
+
+      /* Our cached change didn't make it */
+      uncache_permissions (parts[0], parts[1]);
+    }
+}
+
+/* Like set_permission_sync(), but doesn't wait for the store. The change
+ * is visible to lookups right away. */
+void
+set_permission_in_background (const char *app_id,
+                              const char *table,
+                              const char *id,
+                              Permission permission)
+{
+  const char *no_permissions[] = { NULL };
+  g_auto(GStrv) perms = NULL;
+
+  perms = permissions_from_tristate (permission);
+
+  cache_app_permissions (table, id, app_id,
+                         perms ? (const char * const *) perms : no_permissions);
+
+  xdp_impl_permission_store_call_set_permission (permission_store,
+                                                 table,
+                                                 TRUE,
+                                                 id,
+                                                 app_id,
+                                                 perms ? (const char * const *) perms : no_permissions,
+                                                 NULL,
+                                                 set_permission_done,
+                                                 permission_cache_key (table, id));
+}
+
+/* Whether looking up the entry would be answered from the cache,
+ * rather than by the permission store */
+gboolean
+permission_is_cached (const char *table,
+                      const char *id)
+{
+  g_autofree char *key = permission_cache_key (table, id);
+  gboolean found;
+
+  G_LOCK (permission_cache);
+  found = g_hash_table_contains (permission_cache, key);
+  G_UNLOCK (permission_cache);
+
+  return found;
 }
 
 Permission
@@ -166,13 +867,27 @@ init_permission_store (GDBusConnection *connection)
 {
   g_autoptr(GError) error = NULL;
 
+  permission_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, variant_unref0);
+  app_permission_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, (GDestroyNotify) g_hash_table_unref);
+  xdp_add_cache_trim_func (trim_permission_cache);
+
   permission_store = xdp_impl_permission_store_proxy_new_sync (connection,
                                                                G_DBUS_PROXY_FLAGS_NONE,
                                                                "org.freedesktop.impl.portal.PermissionStore",
                                                                "/org/freedesktop/impl/portal/PermissionStore",
                                                                NULL, &error);
   if (permission_store == NULL)
-    g_warning ("No permission store: %s", error->message);
+    {
+      g_warning ("No permission store: %s", error->message);
+      return;
+    }
+
+  g_signal_connect (permission_store, "changed",
+                    G_CALLBACK (permission_store_changed), NULL);
+  g_signal_connect (permission_store, "notify::g-name-owner",
+                    G_CALLBACK (permission_store_owner_changed), NULL);
 }
 
 XdpImplPermissionStore *
@@ -40,6 +40,31 @@ void set_permissions_sync (const char *app_id,
                            const char *id,
                            const char * const *permissions);
 
+gboolean get_permission_entry_sync (const char  *table,
+                                    const char  *id,
+                                    GVariant   **out_permissions,
+                                    GVariant   **out_data,
+                                    GError     **error);
+
+gboolean get_app_permission_entry_sync (const char  *app_id,
+                                        const char  *table,
+                                        const char  *id,
+                                        GVariant   **out_permissions,
+                                        GVariant   **out_data,
+                                        GError     **error);
+
+GHashTable *get_permissions_many_sync (const char         *app_id,
+                                       const char         *table,
+                                       const char * const *ids);
+
+void set_permissions_many_sync (const char         *app_id,
+                                const char         *table,
+                                const char * const *ids,
+                                const char * const *permissions);
+
+gboolean permission_is_cached (const char *table,
+                               const char *id);
+
 Permission get_permission_sync (const char *app_id,
                                 const char *table,
                                 const char *id);
@@ -49,6 +74,11 @@ void set_permission_sync (const char *app_id,
                           const char *id,
                           Permission permission);
 
+void set_permission_in_background (const char *app_id,
+                                   const char *table,
+                                   const char *id,
+                                   Permission permission);
+
 char **permissions_from_tristate (Permission permission);
 
 Permission permissions_to_tristate (char **permissions);
@@ -32,8 +32,52 @@ typedef struct _PipeWireSource
   PipeWireRemote *remote;
 } PipeWireSource;
 
+/* Client remotes, the short lived ones handed out by OpenPipeWireRemote,
+ * all live in one loop and context that are created once. The loop is
+ * run by whichever handler thread is waiting for PipeWire, so it and
+ * everything connected to it is protected by the shared lock. A core of
+ * our own tracks the node factory, so new client remotes don't need to
+ * enumerate the registry. */
+typedef struct
+{
+  struct pw_main_loop *loop;
+  struct pw_context *context;
+
+  struct pw_core *core;
+  struct spa_hook core_listener;
+  struct pw_registry *registry;
+  struct spa_hook registry_listener;
+  int sync_seq;
+  gboolean sync_done;
+  gboolean broken;
+
+  uint32_t node_factory_id;
+} SharedContext;
+
+/* How long a client remote may wait for PipeWire to answer */
+#define PIPEWIRE_TIMEOUT_MS 5000
+
+static SharedContext shared;
+G_LOCK_DEFINE_STATIC (shared);
+
 static gboolean is_pipewire_initialized = FALSE;
 
+static gboolean
+is_node_factory (const char *type,
+                 const struct spa_dict *props)
+{
+  const struct spa_dict_item *factory_object_type;
+
+  if (strcmp (type, PW_TYPE_INTERFACE_Factory) != 0)
+    return FALSE;
+
+  factory_object_type = spa_dict_lookup_item (props, "factory.type.name");
+  if (!factory_object_type)
+    return FALSE;
+
+  return strcmp (factory_object_type->value, "PipeWire:Interface:ClientNode") == 0;
+}
+
 static void
 registry_event_global (void *user_data,
                        uint32_t id,
@@ -43,7 +87,6 @@ registry_event_global (void *user_data,
                        const struct spa_dict *props)
 {
   PipeWireRemote *remote = user_data;
-  const struct spa_dict_item *factory_object_type;
   PipeWireGlobal *global;
 
   global = g_new0 (PipeWireGlobal, 1);
@@ -55,14 +98,7 @@ registry_event_global (void *user_data,
   if (remote->global_added_cb)
     remote->global_added_cb (remote, id, type, props, remote->user_data);
 
-  if (strcmp(type, PW_TYPE_INTERFACE_Factory) != 0)
-    return;
-
-  factory_object_type = spa_dict_lookup_item (props, "factory.type.name");
-  if (!factory_object_type)
-    return;
-
-  if (strcmp (factory_object_type->value, "PipeWire:Interface:ClientNode") == 0)
+  if (is_node_factory (type, props))
     {
       remote->node_factory_id = id;
       pw_main_loop_quit (remote->loop);
@@ -86,11 +122,73 @@ static const struct pw_registry_events registry_events = {
   .global_remove = registry_event_global_remove,
 };
 
-void
-pipewire_remote_roundtrip (PipeWireRemote *remote)
+/* Called with the shared lock held, iterates the shared loop until
+ * *done is set or the timeout runs out. Events for other client remotes
+ * are dispatched along the way. */
+static gboolean
+shared_loop_run_until (gboolean *done,
+                       GError  **error)
+{
+  struct pw_loop *loop = pw_main_loop_get_loop (shared.loop);
+  gint64 deadline;
+
+  deadline = g_get_monotonic_time () + PIPEWIRE_TIMEOUT_MS * 1000;
+
+  pw_loop_enter (loop);
+  while (!*done)
+    {
+      gint64 remaining = deadline - g_get_monotonic_time ();
+      int result;
+
+      if (remaining <= 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                       "Timed out waiting for PipeWire");
+          break;
+        }
+
+      result = pw_loop_iterate (loop, (remaining + 999) / 1000);
+      if (result < 0 && result != -EINTR)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "pipewire_loop_iterate failed: %s", spa_strerror (result));
+          break;
+        }
+    }
+  pw_loop_leave (loop);
+
+  return *done;
+}
+
+gboolean
+pipewire_remote_roundtrip (PipeWireRemote *remote,
+                           GError **error)
 {
+  if (remote->is_shared)
+    {
+      gboolean ret;
+
+      G_LOCK (shared);
+      remote->sync_done = FALSE;
+      remote->sync_seq = pw_core_sync (remote->core, PW_ID_CORE, remote->sync_seq);
+      ret = shared_loop_run_until (&remote->sync_done, error);
+      if (!ret)
+        shared.broken = TRUE;
+      G_UNLOCK (shared);
+
+      if (ret && remote->error)
+        {
+          g_propagate_error (error, g_error_copy (remote->error));
+          ret = FALSE;
+        }
+
+      return ret;
+    }
+
   remote->sync_seq = pw_core_sync (remote->core, PW_ID_CORE, remote->sync_seq);
   pw_main_loop_run (remote->loop);
+
+  return TRUE;
 }
 
 static gboolean
@@ -105,7 +203,7 @@ discover_node_factory_sync (PipeWireRemote *remote,
                             &registry_events,
                             remote);
 
-  pipewire_remote_roundtrip (remote);
+  pipewire_remote_roundtrip (remote, NULL);
 
   if (remote->node_factory_id == 0)
     {
@@ -128,9 +226,20 @@ core_event_error (void       *user_data,
 
   if (id == PW_ID_CORE)
     {
+      g_clear_error (&remote->error);
       g_set_error (&remote->error, G_IO_ERROR, G_IO_ERROR_FAILED,
                  "%s", message);
-      pw_main_loop_quit (remote->loop);
+      if (remote->is_shared)
+        {
+          /* PipeWire may have gone away, make sure the node
+           * factory is looked up again */
+          shared.broken = TRUE;
+          remote->sync_done = TRUE;
+        }
+      else
+        {
+          pw_main_loop_quit (remote->loop);
+        }
     }
 }
 
@@ -141,7 +250,12 @@ core_event_done (void *user_data,
   PipeWireRemote *remote = user_data;
 
   if (id == PW_ID_CORE && remote->sync_seq == seq)
-    pw_main_loop_quit (remote->loop);
+    {
+      if (remote->is_shared)
+        remote->sync_done = TRUE;
+      else
+        pw_main_loop_quit (remote->loop);
+    }
 }
 
 static const struct pw_core_events core_events = {
@@ -150,6 +264,164 @@ static const struct pw_core_events core_events = {
   .done = core_event_done,
 };
 
+static void
+shared_registry_event_global (void *user_data,
+                              uint32_t id,
+                              uint32_t permissions,
+                              const char *type,
+                              uint32_t version,
+                              const struct spa_dict *props)
+{
+  if (is_node_factory (type, props))
+    shared.node_factory_id = id;
+}
+
+static void
+shared_registry_event_global_remove (void *user_data,
+                                     uint32_t id)
+{
+  if (shared.node_factory_id == id)
+    shared.node_factory_id = 0;
+}
+
+static const struct pw_registry_events shared_registry_events = {
+  PW_VERSION_REGISTRY_EVENTS,
+  .global = shared_registry_event_global,
+  .global_remove = shared_registry_event_global_remove,
+};
+
+static void
+shared_core_event_error (void       *user_data,
+                         uint32_t    id,
+                         int         seq,
+                         int         res,
+                         const char *message)
+{
+  if (id == PW_ID_CORE)
+    {
+      g_debug ("Shared PipeWire connection failed: %s", message);
+      shared.broken = TRUE;
+      shared.sync_done = TRUE;
+    }
+}
+
+static void
+shared_core_event_done (void *user_data,
+                        uint32_t id, int seq)
+{
+  if (id == PW_ID_CORE && shared.sync_seq == seq)
+    shared.sync_done = TRUE;
+}
+
+static const struct pw_core_events shared_core_events = {
+  PW_VERSION_CORE_EVENTS,
+  .error = shared_core_event_error,
+  .done = shared_core_event_done,
+};
+
+static void
+shared_disconnect_locked (void)
+{
+  if (shared.registry)
+    {
+      spa_hook_remove (&shared.registry_listener);
+      pw_proxy_destroy ((struct pw_proxy *) shared.registry);
+      shared.registry = NULL;
+    }
+  if (shared.core)
+    {
+      spa_hook_remove (&shared.core_listener);
+      g_clear_pointer (&shared.core, pw_core_disconnect);
+    }
+  shared.node_factory_id = 0;
+  shared.broken = FALSE;
+}
+
+/* Returns with a connected shared context that knows the node factory */
+static gboolean
+ensure_shared_context_locked (GError **error)
+{
+  if (!shared.loop)
+    {
+      shared.loop = pw_main_loop_new (NULL);
+      if (!shared.loop)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Couldn't create PipeWire main loop");
+          return FALSE;
+        }
+    }
+
+  if (!shared.context)
+    {
+      shared.context = pw_context_new (pw_main_loop_get_loop (shared.loop), NULL, 0);
+      if (!shared.context)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Couldn't create PipeWire context");
+          return FALSE;
+        }
+    }
+
+  /* Catch up with what happened since the loop last ran, e.g. the
+   * node factory going away with a PipeWire restart */
+  if (shared.core)
+    {
+      struct pw_loop *loop = pw_main_loop_get_loop (shared.loop);
+
+      pw_loop_enter (loop);
+      while (pw_loop_iterate (loop, 0) > 0)
+        ;
+      pw_loop_leave (loop);
+    }
+
+  if (shared.broken || (shared.core && shared.node_factory_id == 0))
+    shared_disconnect_locked ();
+
+  if (shared.core)
+    return TRUE;
+
+  shared.core = pw_context_connect (shared.context,
+                                    pw_properties_new ("pipewire.access.portal.is_portal", "true",
+                                                       NULL),
+                                    0);
+  if (!shared.core)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Couldn't connect to PipeWire");
+      return FALSE;
+    }
+
+  pw_core_add_listener (shared.core,
+                        &shared.core_listener,
+                        &shared_core_events,
+                        NULL);
+
+  shared.registry = pw_core_get_registry (shared.core, PW_VERSION_REGISTRY, 0);
+  pw_registry_add_listener (shared.registry,
+                            &shared.registry_listener,
+                            &shared_registry_events,
+                            NULL);
+
+  shared.sync_done = FALSE;
+  shared.sync_seq = pw_core_sync (shared.core, PW_ID_CORE, shared.sync_seq);
+  if (!shared_loop_run_until (&shared.sync_done, error))
+    {
+      shared_disconnect_locked ();
+      return FALSE;
+    }
+
+  if (shared.broken || shared.node_factory_id == 0)
+    {
+      shared_disconnect_locked ();
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "No node factory discovered");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 pipewire_loop_source_prepare (GSource *base,
                               int *timeout)
@@ -208,6 +480,21 @@ static GSourceFuncs pipewire_source_funcs =
 void
 pipewire_remote_destroy (PipeWireRemote *remote)
 {
+  if (remote->is_shared)
+    {
+      G_LOCK (shared);
+      if (remote->core)
+        {
+          spa_hook_remove (&remote->core_listener);
+          g_clear_pointer (&remote->core, pw_core_disconnect);
+        }
+      G_UNLOCK (shared);
+
+      /* The loop and context belong to the shared context */
+      remote->context = NULL;
+      remote->loop = NULL;
+    }
+
   g_clear_pointer (&remote->globals, g_hash_table_destroy);
   g_clear_pointer (&remote->core, pw_core_disconnect);
   g_clear_pointer (&remote->context, pw_context_destroy);
@@ -234,6 +521,7 @@ pipewire_remote_create_source (PipeWireRemote *remote)
   PipeWireSource *pipewire_source;
   struct pw_loop *loop;
 
+  g_return_val_if_fail (!remote->is_shared, NULL);
 
   pipewire_source = (PipeWireSource *) g_source_new (&pipewire_source_funcs,
                                                      sizeof (PipeWireSource));
@@ -313,3 +601,84 @@ pipewire_remote_new_sync (struct pw_properties *pipewire_properties,
 
   return remote;
 }
+
+/* Creates a client remote on the shared loop and context. Client
+ * remotes are only used synchronously, to set up permissions before
+ * their fd is handed out, and can't be attached with
+ * pipewire_remote_create_source(). */
+PipeWireRemote *
+pipewire_remote_new_client_sync (struct pw_properties *pipewire_properties,
+                                 GError **error)
+{
+  PipeWireRemote *remote;
+
+  ensure_pipewire_is_initialized ();
+
+  G_LOCK (shared);
+
+  if (!ensure_shared_context_locked (error))
+    {
+      G_UNLOCK (shared);
+      pw_properties_free (pipewire_properties);
+      return NULL;
+    }
+
+  remote = g_new0 (PipeWireRemote, 1);
+  remote->is_shared = TRUE;
+  remote->loop = shared.loop;
+  remote->context = shared.context;
+  remote->node_factory_id = shared.node_factory_id;
+  remote->globals = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  remote->core = pw_context_connect (shared.context, pipewire_properties, 0);
+  if (!remote->core)
+    {
+      shared.broken = TRUE;
+      G_UNLOCK (shared);
+      pipewire_remote_destroy (remote);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Couldn't connect to PipeWire");
+      return NULL;
+    }
+
+  pw_core_add_listener (remote->core,
+                        &remote->core_listener,
+                        &core_events,
+                        remote);
+
+  G_UNLOCK (shared);
+
+  return remote;
+}
+
+void
+pipewire_remote_update_permissions (PipeWireRemote *remote,
+                                    uint32_t n_permissions,
+                                    const struct pw_permission *permissions)
+{
+  if (remote->is_shared)
+    G_LOCK (shared);
+
+  pw_client_update_permissions (pw_core_get_client (remote->core),
+                                n_permissions,
+                                permissions);
+
+  if (remote->is_shared)
+    G_UNLOCK (shared);
+}
+
+int
+pipewire_remote_steal_fd (PipeWireRemote *remote)
+{
+  int fd;
+
+  if (remote->is_shared)
+    G_LOCK (shared);
+
+  fd = pw_core_steal_fd (remote->core);
+
+  if (remote->is_shared)
+    G_UNLOCK (shared);
+
+  return fd;
+}
@@ -60,6 +60,10 @@ struct _PipeWireRemote
   uint32_t node_factory_id;
 
   GError *error;
+
+  /* Client remote on the shared loop and context */
+  gboolean is_shared;
+  gboolean sync_done;
 };
 
 PipeWireRemote * pipewire_remote_new_sync (struct pw_properties *pipewire_properties,
@@ -69,8 +73,18 @@ PipeWireRemote * pipewire_remote_new_sync (struct pw_properties *pipewire_proper
                                            gpointer user_data,
                                            GError **error);
 
+PipeWireRemote * pipewire_remote_new_client_sync (struct pw_properties *pipewire_properties,
+                                                  GError **error);
+
 void pipewire_remote_destroy (PipeWireRemote *remote);
 
-void pipewire_remote_roundtrip (PipeWireRemote *remote);
+void pipewire_remote_update_permissions (PipeWireRemote *remote,
+                                         uint32_t n_permissions,
+                                         const struct pw_permission *permissions);
+
+int pipewire_remote_steal_fd (PipeWireRemote *remote);
+
+gboolean pipewire_remote_roundtrip (PipeWireRemote *remote,
+                                    GError **error);
 
 GSource * pipewire_remote_create_source (PipeWireRemote *remote);
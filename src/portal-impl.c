@@ -25,13 +25,34 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <gio/gio.h>
 
-static void
-portal_implementation_free (PortalImplementation *impl)
+static PortalImplementation *
+portal_implementation_new (void)
+{
+  PortalImplementation *impl = g_new0 (PortalImplementation, 1);
+
+  impl->ref_count = 1;
+  return impl;
+}
+
+PortalImplementation *
+portal_implementation_ref (PortalImplementation *impl)
 {
+  g_atomic_int_inc (&impl->ref_count);
+  return impl;
+}
+
+void
+portal_implementation_unref (PortalImplementation *impl)
+{
+  if (!g_atomic_int_dec_and_test (&impl->ref_count))
+    return;
+
   g_free (impl->source);
   g_free (impl->dbus_name);
   g_strfreev (impl->interfaces);
@@ -39,26 +60,37 @@ portal_implementation_free (PortalImplementation *impl)
   g_free (impl);
 }
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC(PortalImplementation, portal_implementation_free)
-
+/* Each holds a ref. Implementations from before a reload are freed
+ * once the portals still starting up with them drop theirs. */
 static GList *implementations = NULL;
 
+typedef struct {
+  PortalImplementation *preferred;
+  GPtrArray *all; /* Sorted by name, like implementations */
+} PortalRoute;
+
+/* interface -> PortalRoute, rebuilt whenever the portals are loaded */
+static GHashTable *routes = NULL;
+
+static GFileMonitor *portal_dir_monitor = NULL;
+static guint reload_timeout = 0;
+static gboolean load_verbose = FALSE;
+static PortalsChangedCallback portals_changed_cb = NULL;
+
+static void
+portal_route_free (PortalRoute *route)
+{
+  g_ptr_array_unref (route->all);
+  g_free (route);
+}
+
+/* Checks what both .portal files and the cache provide */
 static gboolean
-register_portal (const char *path, gboolean opt_verbose, GError **error)
+validate_portal (PortalImplementation  *impl,
+                 GError               **error)
 {
-  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
-  g_autoptr(PortalImplementation) impl = g_new0 (PortalImplementation, 1);
   int i;
 
-  g_debug ("loading %s", path);
-
-  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, error))
-    return FALSE;
-
-  impl->source = g_path_get_basename (path);
-  impl->dbus_name = g_key_file_get_string (keyfile, "portal", "DBusName", error);
-  if (impl->dbus_name == NULL)
-    return FALSE;
   if (!g_dbus_is_name (impl->dbus_name))
     {
       g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
@@ -66,9 +98,6 @@ register_portal (const char *path, gboolean opt_verbose, GError **error)
       return FALSE;
     }
 
-  impl->interfaces = g_key_file_get_string_list (keyfile, "portal", "Interfaces", NULL, error);
-  if (impl->interfaces == NULL)
-    return FALSE;
   for (i = 0; impl->interfaces[i]; i++)
     {
       if (!g_dbus_is_interface_name (impl->interfaces[i]))
@@ -85,9 +114,14 @@ register_portal (const char *path, gboolean opt_verbose, GError **error)
         }
     }
 
-  impl->use_in = g_key_file_get_string_list (keyfile, "portal", "UseIn", NULL, error);
-  if (impl->use_in == NULL)
-    return FALSE;
+  return TRUE;
+}
+
+static void
+add_portal (PortalImplementation *impl,
+            gboolean              opt_verbose)
+{
+  int i;
 
   if (opt_verbose)
     {
@@ -98,7 +132,36 @@ register_portal (const char *path, gboolean opt_verbose, GError **error)
     }
 
   implementations = g_list_prepend (implementations, impl);
-  impl = NULL;
+}
+
+static gboolean
+register_portal (const char *path, gboolean opt_verbose, GError **error)
+{
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(PortalImplementation) impl = portal_implementation_new ();
+
+  g_debug ("loading %s", path);
+
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, error))
+    return FALSE;
+
+  impl->source = g_path_get_basename (path);
+  impl->dbus_name = g_key_file_get_string (keyfile, "portal", "DBusName", error);
+  if (impl->dbus_name == NULL)
+    return FALSE;
+
+  impl->interfaces = g_key_file_get_string_list (keyfile, "portal", "Interfaces", NULL, error);
+  if (impl->interfaces == NULL)
+    return FALSE;
+
+  impl->use_in = g_key_file_get_string_list (keyfile, "portal", "UseIn", NULL, error);
+  if (impl->use_in == NULL)
+    return FALSE;
+
+  if (!validate_portal (impl, error))
+    return FALSE;
+
+  add_portal (g_steal_pointer (&impl), opt_verbose);
 
   return TRUE;
 }
@@ -113,18 +176,250 @@ sort_impl_by_name (gconstpointer a,
   return strcmp (pa->source, pb->source);
 }
 
-void
-load_installed_portals (gboolean opt_verbose)
+static gboolean g_strv_case_contains (const gchar * const *strv,
+                                      const gchar         *str);
+
+static void
+build_routes (void)
+{
+  const char *desktops_str = g_getenv ("XDG_CURRENT_DESKTOP");
+  g_auto(GStrv) desktops = NULL;
+  GHashTableIter iter;
+  PortalRoute *route;
+  GList *l;
+  int i;
+
+  g_clear_pointer (&routes, g_hash_table_unref);
+  routes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  NULL, (GDestroyNotify) portal_route_free);
+
+  for (l = implementations; l != NULL; l = l->next)
+    {
+      PortalImplementation *impl = l->data;
+
+      for (i = 0; impl->interfaces[i]; i++)
+        {
+          route = g_hash_table_lookup (routes, impl->interfaces[i]);
+          if (route == NULL)
+            {
+              route = g_new0 (PortalRoute, 1);
+              route->all = g_ptr_array_new ();
+              g_hash_table_insert (routes, impl->interfaces[i], route);
+            }
+
+          /* Skip interfaces that are listed twice */
+          if (route->all->len == 0 ||
+              g_ptr_array_index (route->all, route->all->len - 1) != impl)
+            g_ptr_array_add (route->all, impl);
+        }
+    }
+
+  if (desktops_str == NULL)
+    desktops_str = "";
+  desktops = g_strsplit (desktops_str, ":", -1);
+
+  /* The first desktop in XDG_CURRENT_DESKTOP with an implementation
+   * wins, otherwise fall back to *any* installed implementation */
+  g_hash_table_iter_init (&iter, routes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &route))
+    {
+      guint j;
+
+      for (i = 0; desktops[i] != NULL && route->preferred == NULL; i++)
+        {
+          for (j = 0; j < route->all->len; j++)
+            {
+              PortalImplementation *impl = g_ptr_array_index (route->all, j);
+
+              if (g_strv_case_contains ((const char **)impl->use_in, desktops[i]))
+                {
+                  route->preferred = impl;
+                  break;
+                }
+            }
+        }
+
+      if (route->preferred == NULL)
+        route->preferred = g_ptr_array_index (route->all, 0);
+    }
+}
+
+static const char *
+get_portal_dir (void)
 {
   const char *portal_dir;
-  g_autoptr(GFile) dir = NULL;
-  g_autoptr(GFileEnumerator) enumerator = NULL;
 
   /* We need to override this in the tests */
   portal_dir = g_getenv ("XDG_DESKTOP_PORTAL_DIR");
   if (portal_dir == NULL)
     portal_dir = DATADIR "/xdg-desktop-portal/portals";
 
+  return portal_dir;
+}
+
+/* The parsed .portal files are kept in the runtime dir, so restarts
+ * (e.g. when activation fails repeatedly) don't parse them again. The
+ * cache is used as long as the directory and every .portal file in it,
+ * including the ones that failed to load, have the mtimes they had when
+ * they were read. */
+
+#define PORTAL_CACHE_VERSION 2
+#define PORTAL_CACHE_TYPE "(usxua(sxu)a(ssasas))"
+
+static char *
+get_portal_cache_path (void)
+{
+  return g_build_filename (g_get_user_runtime_dir (), "xdg-desktop-portal",
+                           "portals.cache", NULL);
+}
+
+static gboolean
+same_mtime (struct stat *st,
+            gint64       sec,
+            guint32      nsec)
+{
+  return st->st_mtim.tv_sec == sec && st->st_mtim.tv_nsec == nsec;
+}
+
+static gboolean
+load_portals_from_cache (const char  *portal_dir,
+                         struct stat *dir_st,
+                         gboolean     opt_verbose)
+{
+  g_autofree char *path = get_portal_cache_path ();
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GVariantIter) files = NULL;
+  g_autoptr(GVariantIter) iter = NULL;
+  GList *loaded = NULL;
+  const char *cached_dir;
+  const char *source;
+  const char *dbus_name;
+  const char **interfaces;
+  const char **use_in;
+  guint32 version;
+  gint64 sec;
+  guint32 nsec;
+
+  mapped = g_mapped_file_new (path, FALSE, NULL);
+  if (mapped == NULL)
+    return FALSE;
+
+  bytes = g_mapped_file_get_bytes (mapped);
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (PORTAL_CACHE_TYPE),
+                                                        bytes, FALSE));
+
+  g_variant_get (cache, "(u&sxua(sxu)a(ssasas))",
+                 &version, &cached_dir, &sec, &nsec, &files, &iter);
+  if (version != PORTAL_CACHE_VERSION ||
+      strcmp (cached_dir, portal_dir) != 0 ||
+      !same_mtime (dir_st, sec, nsec))
+    return FALSE;
+
+  while (g_variant_iter_next (files, "(&sxu)", &source, &sec, &nsec))
+    {
+      g_autofree char *file = g_build_filename (portal_dir, source, NULL);
+      struct stat st;
+
+      if (stat (file, &st) != 0 || !same_mtime (&st, sec, nsec))
+        return FALSE;
+    }
+
+  while (g_variant_iter_next (iter, "(&s&s^a&s^a&s)",
+                              &source, &dbus_name, &interfaces, &use_in))
+    {
+      g_autoptr(PortalImplementation) impl = NULL;
+      g_autofree const char **owned_interfaces = interfaces;
+      g_autofree const char **owned_use_in = use_in;
+
+      impl = portal_implementation_new ();
+      impl->source = g_strdup (source);
+      impl->dbus_name = g_strdup (dbus_name);
+      impl->interfaces = g_strdupv ((char **) interfaces);
+      impl->use_in = g_strdupv ((char **) use_in);
+
+      if (!validate_portal (impl, NULL))
+        goto out;
+
+      loaded = g_list_prepend (loaded, g_steal_pointer (&impl));
+    }
+
+  g_debug ("loaded portals from %s", path);
+
+  while (loaded)
+    {
+      add_portal (loaded->data, opt_verbose);
+      loaded = g_list_delete_link (loaded, loaded);
+    }
+
+  return TRUE;
+
+out:
+  g_list_free_full (loaded, (GDestroyNotify) portal_implementation_unref);
+  return FALSE;
+}
+
+static void
+save_portals_to_cache (const char      *portal_dir,
+                       struct stat     *dir_st,
+                       GVariantBuilder *files)
+{
+  g_autofree char *path = get_portal_cache_path ();
+  g_autofree char *dir = g_path_get_dirname (path);
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+  GList *l;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssasas)"));
+  for (l = implementations; l != NULL; l = l->next)
+    {
+      PortalImplementation *impl = l->data;
+
+      g_variant_builder_add (&builder, "(ss^as^as)",
+                             impl->source,
+                             impl->dbus_name,
+                             impl->interfaces,
+                             impl->use_in);
+    }
+
+  cache = g_variant_ref_sink (g_variant_new (PORTAL_CACHE_TYPE,
+                                             PORTAL_CACHE_VERSION,
+                                             portal_dir,
+                                             (gint64) dir_st->st_mtim.tv_sec,
+                                             (guint32) dir_st->st_mtim.tv_nsec,
+                                             files,
+                                             &builder));
+
+  if (g_mkdir_with_parents (dir, 0700) != 0 ||
+      !g_file_set_contents (path,
+                            g_variant_get_data (cache),
+                            g_variant_get_size (cache),
+                            &error))
+    g_debug ("Can't write %s: %s", path, error ? error->message : g_strerror (errno));
+}
+
+static void
+load_portals_from_dir (const char *portal_dir,
+                       gboolean    use_cache,
+                       gboolean    opt_verbose)
+{
+  g_autoptr(GFile) dir = NULL;
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+  GVariantBuilder files;
+  struct stat dir_st;
+  gboolean have_dir_st;
+
+  have_dir_st = stat (portal_dir, &dir_st) == 0;
+
+  if (use_cache && have_dir_st &&
+      load_portals_from_cache (portal_dir, &dir_st, opt_verbose))
+    {
+      implementations = g_list_sort (implementations, sort_impl_by_name);
+      return;
+    }
+
   g_debug ("load portals from %s", portal_dir);
 
   dir = g_file_new_for_path (portal_dir);
@@ -133,6 +428,8 @@ load_installed_portals (gboolean opt_verbose)
   if (enumerator == NULL)
     return;
 
+  g_variant_builder_init (&files, G_VARIANT_TYPE ("a(sxu)"));
+
   while (TRUE)
     {
       g_autoptr(GFileInfo) info = g_file_enumerator_next_file (enumerator, NULL, NULL);
@@ -140,6 +437,7 @@ load_installed_portals (gboolean opt_verbose)
       g_autofree char *path = NULL;
       const char *name;
       g_autoptr(GError) error = NULL;
+      struct stat st;
 
       if (info == NULL)
         break;
@@ -152,6 +450,14 @@ load_installed_portals (gboolean opt_verbose)
       child = g_file_enumerator_get_child (enumerator, info);
       path = g_file_get_path (child);
 
+      /* Taken before parsing, so a change while reading is seen next time */
+      if (stat (path, &st) == 0)
+        g_variant_builder_add (&files, "(sxu)", name,
+                               (gint64) st.st_mtim.tv_sec,
+                               (guint32) st.st_mtim.tv_nsec);
+      else
+        have_dir_st = FALSE;
+
       if (!register_portal (path, opt_verbose, &error))
         {
           g_warning ("Error loading %s: %s", path, error->message);
@@ -160,6 +466,88 @@ load_installed_portals (gboolean opt_verbose)
     }
 
   implementations = g_list_sort (implementations, sort_impl_by_name);
+
+  if (have_dir_st)
+    save_portals_to_cache (portal_dir, &dir_st, &files);
+  else
+    g_variant_builder_clear (&files);
+}
+
+void
+load_installed_portals (gboolean opt_verbose)
+{
+  load_verbose = opt_verbose;
+  load_portals_from_dir (get_portal_dir (), TRUE, opt_verbose);
+  build_routes ();
+}
+
+/* Reads the .portal files again. Lookups after this see the new
+ * implementations, portals created before keep the ones they have. */
+void
+reload_installed_portals (void)
+{
+  GList *old_implementations = g_steal_pointer (&implementations);
+
+  g_debug ("Reloading portal implementations");
+
+  /* Files may have been changed in place, which the cache can miss
+   * when it happens within the mtime granularity */
+  load_portals_from_dir (get_portal_dir (), FALSE, load_verbose);
+  build_routes ();
+
+  /* The old routes pointed into these */
+  g_list_free_full (old_implementations, (GDestroyNotify) portal_implementation_unref);
+}
+
+static gboolean
+reload_timeout_cb (gpointer user_data)
+{
+  reload_timeout = 0;
+
+  reload_installed_portals ();
+  if (portals_changed_cb)
+    portals_changed_cb ();
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+portal_dir_changed (GFileMonitor      *monitor,
+                    GFile             *file,
+                    GFile             *other_file,
+                    GFileMonitorEvent  event_type,
+                    gpointer           user_data)
+{
+  g_autofree char *name = g_file_get_basename (file);
+
+  if (!g_str_has_suffix (name, ".portal"))
+    return;
+
+  /* Package managers tend to touch several files at once */
+  if (reload_timeout == 0)
+    reload_timeout = g_timeout_add (500, reload_timeout_cb, NULL);
+}
+
+void
+watch_installed_portals (PortalsChangedCallback callback)
+{
+  g_autoptr(GFile) dir = NULL;
+  g_autoptr(GError) error = NULL;
+
+  portals_changed_cb = callback;
+
+  if (portal_dir_monitor)
+    return;
+
+  dir = g_file_new_for_path (get_portal_dir ());
+  portal_dir_monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_NONE, NULL, &error);
+  if (portal_dir_monitor == NULL)
+    {
+      g_warning ("Can't watch the portals directory: %s", error->message);
+      return;
+    }
+
+  g_signal_connect (portal_dir_monitor, "changed", G_CALLBACK (portal_dir_changed), NULL);
 }
 
 static gboolean
@@ -175,68 +563,40 @@ g_strv_case_contains (const gchar * const *strv,
   return FALSE;
 }
 
+/* Only valid until the next reload, ref it to keep it for longer */
 PortalImplementation *
 find_portal_implementation (const char *interface)
 {
-  const char *desktops_str = g_getenv ("XDG_CURRENT_DESKTOP");
-  g_auto(GStrv) desktops = NULL;
-  int i;
-  GList *l;
-
-  if (desktops_str == NULL)
-    desktops_str = "";
+  PortalRoute *route = NULL;
 
-  desktops = g_strsplit (desktops_str, ":", -1);
+  if (routes)
+    route = g_hash_table_lookup (routes, interface);
 
-  for (i = 0; desktops[i] != NULL; i++)
-    {
-     for (l = implementations; l != NULL; l = l->next)
-        {
-          PortalImplementation *impl = l->data;
-
-          if (!g_strv_contains ((const char **)impl->interfaces, interface))
-            continue;
-
-          if (g_strv_case_contains ((const char **)impl->use_in, desktops[i]))
-            {
-              g_debug ("Using %s for %s in %s", impl->source, interface, desktops[i]);
-              return impl;
-            }
-        }
-    }
+  if (route == NULL)
+    return NULL;
 
-  /* Fall back to *any* installed implementation */
-  for (l = implementations; l != NULL; l = l->next)
-    {
-      PortalImplementation *impl = l->data;
-
-      if (!g_strv_contains ((const char **)impl->interfaces, interface))
-        continue;
-
-      g_debug ("Falling back to %s for %s", impl->source, interface);
-      return impl;
-    }
-
-  return NULL;
+  g_debug ("Using %s for %s", route->preferred->source, interface);
+  return route->preferred;
 }
 
 GPtrArray *
 find_all_portal_implementations (const char *interface)
 {
+  PortalRoute *route = NULL;
   GPtrArray *impls;
-  GList *l;
+  guint i;
 
-  impls = g_ptr_array_new ();
+  impls = g_ptr_array_new_with_free_func ((GDestroyNotify) portal_implementation_unref);
 
-  for (l = implementations; l != NULL; l = l->next)
+  if (routes)
+    route = g_hash_table_lookup (routes, interface);
+
+  for (i = 0; route && i < route->all->len; i++)
     {
-      PortalImplementation *impl = l->data;
+      PortalImplementation *impl = g_ptr_array_index (route->all, i);
 
-      if (g_strv_contains ((const char **)impl->interfaces, interface))
-        {
-          g_debug ("Using %s for %s", impl->source, interface);
-          g_ptr_array_add (impls, impl);
-        }
+      g_debug ("Using %s for %s", impl->source, interface);
+      g_ptr_array_add (impls, portal_implementation_ref (impl));
     }
 
   return impls;
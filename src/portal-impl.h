@@ -25,6 +25,7 @@
 #include <glib.h>
 
 typedef struct {
+  gint ref_count;
   char *source;
   char *dbus_name;
   char **interfaces;
@@ -32,7 +33,16 @@ typedef struct {
   int priority;
 } PortalImplementation;
 
+typedef void (* PortalsChangedCallback) (void);
+
+PortalImplementation *portal_implementation_ref       (PortalImplementation *impl);
+void                  portal_implementation_unref     (PortalImplementation *impl);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(PortalImplementation, portal_implementation_unref)
+
 void                  load_installed_portals          (gboolean opt_verbose);
+void                  reload_installed_portals        (void);
+void                  watch_installed_portals         (PortalsChangedCallback callback);
 PortalImplementation *find_portal_implementation      (const char *interface);
 GPtrArray            *find_all_portal_implementations (const char *interface);
 
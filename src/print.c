@@ -52,6 +52,9 @@ struct _PrintClass
 };
 
 static XdpImplPrint *impl;
+static GDBusConnection *impl_connection;
+static char *impl_dbus_name;
+G_LOCK_DEFINE_STATIC (impl);
 static Print *print;
 static XdpImplLockdown *lockdown;
 
@@ -73,6 +76,8 @@ print_done (GObject *source,
 
   REQUEST_AUTOLOCK (request);
 
+  request_impl_done (request);
+
   if (!xdp_impl_print_call_print_finish (XDP_IMPL_PRINT (source),
                                          &response,
                                          &options,
@@ -101,6 +106,68 @@ static XdpOptionKey print_options[] = {
   { "modal", G_VARIANT_TYPE_BOOLEAN, NULL }
 };
 
+/* Tells the backend what it can do with the fd without copying it:
+ * the size of regular files, so it can copy_file_range() or splice()
+ * them straight into the spool, and whether it is a sealed memfd that
+ * can't change under it */
+static void
+add_fd_hints (GVariantBuilder *opt_builder,
+              GUnixFDList     *fd_list,
+              GVariant        *arg_fd)
+{
+  int fd_id = g_variant_get_handle (arg_fd);
+  const int *fds;
+  int n_fds = 0;
+  struct stat st;
+
+  if (fd_list == NULL)
+    return;
+
+  fds = g_unix_fd_list_peek_fds (fd_list, &n_fds);
+  if (fd_id < 0 || fd_id >= n_fds)
+    return;
+
+  if (fstat (fds[fd_id], &st) != 0 || !S_ISREG (st.st_mode))
+    return;
+
+  g_variant_builder_add (opt_builder, "{sv}", "size", g_variant_new_uint64 (st.st_size));
+
+#ifdef F_GET_SEALS
+  {
+    int seals = fcntl (fds[fd_id], F_GET_SEALS);
+    int needed = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+    if (seals != -1 && (seals & needed) == needed)
+      g_variant_builder_add (opt_builder, "{sv}", "sealed", g_variant_new_boolean (TRUE));
+  }
+#endif
+}
+
+/* The backend is only contacted once the portal is used */
+static gboolean
+ensure_impl (GError **error)
+{
+  gboolean ok = TRUE;
+
+  G_LOCK (impl);
+  if (impl == NULL)
+    {
+      impl = xdp_impl_print_proxy_new_sync (impl_connection,
+                                        G_DBUS_PROXY_FLAGS_NONE,
+                                        impl_dbus_name,
+                                        DESKTOP_PORTAL_OBJECT_PATH,
+                                        NULL,
+                                        error);
+      if (impl == NULL)
+        ok = FALSE;
+      else
+        g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
+    }
+  G_UNLOCK (impl);
+
+  return ok;
+}
+
 static gboolean
 handle_print (XdpPrint *object,
               GDBusMethodInvocation *invocation,
@@ -113,7 +180,6 @@ handle_print (XdpPrint *object,
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder opt_builder;
 
   if (xdp_impl_lockdown_get_disable_printing (lockdown))
@@ -127,25 +193,21 @@ handle_print (XdpPrint *object,
     }
 
 
-  REQUEST_AUTOLOCK (request);
-
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
+  if (!ensure_impl (&error))
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
 
-  request_set_impl_request (request, impl_request);
+  REQUEST_AUTOLOCK (request);
+
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
   xdp_filter_options (arg_options, &opt_builder,
                       print_options, G_N_ELEMENTS (print_options), NULL);
+  add_fd_hints (&opt_builder, fd_list, arg_fd);
   xdp_impl_print_call_print(impl,
                             request->id,
                             app_id,
@@ -181,6 +243,8 @@ prepare_print_done (GObject *source,
 
   REQUEST_AUTOLOCK (request);
 
+  request_impl_done (request);
+
   if (!xdp_impl_print_call_prepare_print_finish (XDP_IMPL_PRINT (source),
                                                  &response,
                                                  &options,
@@ -192,18 +256,20 @@ prepare_print_done (GObject *source,
 
   if (request->exported)
     {
-      GVariantBuilder opt_builder;
-
-      g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
+      g_autoptr(GVariant) results = NULL;
 
+      /* Backends return only these keys, and the settings are sent
+       * back to the app without being rebuilt */
       if (response == 0)
-        xdp_filter_options (options, &opt_builder,
-                            response_options, G_N_ELEMENTS (response_options),
-                            NULL);
+        xdp_filter_options_forward (options, &results,
+                                    response_options, G_N_ELEMENTS (response_options),
+                                    NULL);
+      else
+        results = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0));
 
       xdp_request_emit_response (XDP_REQUEST (request),
                                  response,
-                                 g_variant_builder_end (&opt_builder));
+                                 results);
 
       request_unexport (request);
     }
@@ -225,7 +291,6 @@ handle_prepare_print (XdpPrint *object,
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder opt_builder;
 
   if (xdp_impl_lockdown_get_disable_printing (lockdown))
@@ -238,20 +303,15 @@ handle_prepare_print (XdpPrint *object,
       return TRUE;
     }
 
-  REQUEST_AUTOLOCK (request);
-
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
+  if (!ensure_impl (&error))
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
 
-  request_set_impl_request (request, impl_request);
+  REQUEST_AUTOLOCK (request);
+
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
@@ -297,23 +357,10 @@ print_create (GDBusConnection *connection,
               const char *dbus_name,
               gpointer lockdown_proxy)
 {
-  g_autoptr(GError) error = NULL;
-
   lockdown = lockdown_proxy;
 
-  impl = xdp_impl_print_proxy_new_sync (connection,
-                                        G_DBUS_PROXY_FLAGS_NONE,
-                                        dbus_name,
-                                        DESKTOP_PORTAL_OBJECT_PATH,
-                                        NULL,
-                                        &error);
-  if (impl == NULL)
-    {
-      g_warning ("Failed to create print proxy: %s", error->message);
-      return NULL;
-    }
-
-  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
+  impl_connection = g_object_ref (connection);
+  impl_dbus_name = g_strdup (dbus_name);
 
   print = g_object_new (print_get_type (), NULL);
 
@@ -36,6 +36,8 @@ struct _ProxyResolver
   XdpProxyResolverSkeleton parent_instance;
 
   GProxyResolver *resolver;
+  GNetworkMonitor *monitor;
+  GPtrArray *proxy_settings;
 };
 
 struct _ProxyResolverClass
@@ -51,6 +53,80 @@ static void proxy_resolver_iface_init (XdpProxyResolverIface *iface);
 G_DEFINE_TYPE_WITH_CODE (ProxyResolver, proxy_resolver, XDP_TYPE_PROXY_RESOLVER_SKELETON,
                          G_IMPLEMENT_INTERFACE (XDP_TYPE_PROXY_RESOLVER, proxy_resolver_iface_init));
 
+/* Lookups may run a PAC script, so their results are kept for a while.
+ * A PAC script may look at any part of the uri, so only lookups of the
+ * exact same uri share a result. The cache is flushed when the network
+ * or the proxy settings change. */
+#define LOOKUP_CACHE_TTL_USEC (60 * G_USEC_PER_SEC)
+#define LOOKUP_CACHE_SIZE 256
+
+typedef struct
+{
+  char **proxies;
+  gint64 expires;
+} CachedLookup;
+
+G_LOCK_DEFINE_STATIC (lookup_cache);
+static GHashTable *lookup_cache;
+static guint lookup_cache_generation;
+
+static void
+cached_lookup_free (gpointer data)
+{
+  CachedLookup *lookup = data;
+
+  g_strfreev (lookup->proxies);
+  g_free (lookup);
+}
+
+static char **
+lookup_cached (const char *key,
+               guint      *generation)
+{
+  CachedLookup *lookup;
+  char **proxies = NULL;
+
+  G_LOCK (lookup_cache);
+  lookup = g_hash_table_lookup (lookup_cache, key);
+  if (lookup && lookup->expires > g_get_monotonic_time ())
+    proxies = g_strdupv (lookup->proxies);
+  *generation = lookup_cache_generation;
+  G_UNLOCK (lookup_cache);
+
+  return proxies;
+}
+
+static void
+cache_lookup (const char *key,
+              char      **proxies,
+              guint       generation)
+{
+  CachedLookup *lookup;
+
+  G_LOCK (lookup_cache);
+  /* Don't store results that raced with a flush */
+  if (generation == lookup_cache_generation)
+    {
+      if (g_hash_table_size (lookup_cache) >= LOOKUP_CACHE_SIZE)
+        g_hash_table_remove_all (lookup_cache);
+
+      lookup = g_new (CachedLookup, 1);
+      lookup->proxies = g_strdupv (proxies);
+      lookup->expires = g_get_monotonic_time () + LOOKUP_CACHE_TTL_USEC;
+      g_hash_table_replace (lookup_cache, g_strdup (key), lookup);
+    }
+  G_UNLOCK (lookup_cache);
+}
+
+static void
+flush_lookup_cache (void)
+{
+  G_LOCK (lookup_cache);
+  lookup_cache_generation++;
+  g_hash_table_remove_all (lookup_cache);
+  G_UNLOCK (lookup_cache);
+}
+
 static gboolean
 proxy_resolver_handle_lookup (XdpProxyResolver *object,
                               GDBusMethodInvocation *invocation,
@@ -70,8 +146,16 @@ proxy_resolver_handle_lookup (XdpProxyResolver *object,
     {
       g_auto (GStrv) proxies = NULL;
       GError *error = NULL;
+      guint generation;
+
+      proxies = lookup_cached (arg_uri, &generation);
+      if (proxies == NULL)
+        {
+          proxies = g_proxy_resolver_lookup (resolver->resolver, arg_uri, NULL, &error);
+          if (proxies)
+            cache_lookup (arg_uri, proxies, generation);
+        }
 
-      proxies = g_proxy_resolver_lookup (resolver->resolver, arg_uri, NULL, &error);
       if (error)
         g_dbus_method_invocation_take_error (invocation, error);
       else
@@ -88,11 +172,49 @@ proxy_resolver_iface_init (XdpProxyResolverIface *iface)
   iface->handle_lookup = proxy_resolver_handle_lookup;
 }
 
+static void
+proxy_config_changed (ProxyResolver *resolver)
+{
+  g_debug ("Proxy configuration changed, flushing lookup cache");
+  flush_lookup_cache ();
+}
+
 static void
 proxy_resolver_init (ProxyResolver *resolver)
 {
+  GSettingsSchemaSource *source = g_settings_schema_source_get_default ();
+  g_autoptr(GSettingsSchema) schema = NULL;
+
   resolver->resolver = g_proxy_resolver_get_default ();
 
+  lookup_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cached_lookup_free);
+
+  /* WPAD results depend on the network we're on */
+  resolver->monitor = g_network_monitor_get_default ();
+  g_signal_connect_swapped (resolver->monitor, "network-changed",
+                            G_CALLBACK (proxy_config_changed), resolver);
+
+  /* The proxy settings used by the GNOME resolver, when installed */
+  if (source)
+    schema = g_settings_schema_source_lookup (source, "org.gnome.system.proxy", TRUE);
+  if (schema)
+    {
+      g_auto(GStrv) children = g_settings_schema_list_children (schema);
+      GSettings *settings = g_settings_new_full (schema, NULL, NULL);
+      int i;
+
+      resolver->proxy_settings = g_ptr_array_new_with_free_func (g_object_unref);
+      g_ptr_array_add (resolver->proxy_settings, settings);
+
+      /* The per-protocol settings live in child schemas */
+      for (i = 0; children[i]; i++)
+        g_ptr_array_add (resolver->proxy_settings, g_settings_get_child (settings, children[i]));
+
+      for (i = 0; i < resolver->proxy_settings->len; i++)
+        g_signal_connect_swapped (g_ptr_array_index (resolver->proxy_settings, i), "changed",
+                                  G_CALLBACK (proxy_config_changed), resolver);
+    }
+
   xdp_proxy_resolver_set_version (XDP_PROXY_RESOLVER (resolver), 1);
 }
 
@@ -105,6 +227,7 @@ GDBusInterfaceSkeleton *
 proxy_resolver_create (GDBusConnection *connection)
 {
   proxy_resolver = g_object_new (proxy_resolver_get_type (), NULL);
+  xdp_add_cache_trim_func (flush_lookup_cache);
 
   return G_DBUS_INTERFACE_SKELETON (proxy_resolver);
 }
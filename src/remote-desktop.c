@@ -83,7 +83,28 @@ typedef struct _RemoteDesktopSession
 
   DeviceType shared_devices;
 
-  GList *streams;
+  /* The devices events may be sent for: shared_devices once the session
+   * is started, none before or after. Read without the session lock by
+   * the notify methods. */
+  int notify_devices;
+
+  /* Set once the application has its own connection to the input
+   * server, see handle_connect_to_eis() */
+  gboolean eis_connected;
+
+  GArray *streams; /* ScreenCastStream */
+  GHashTable *streams_by_id; /* PipeWire node id -> index in streams + 1 */
+  GArray *stream_permissions;
+
+  /* Relative motion and axis events held back while the backend is
+   * busy, see coalesce_relative_event() */
+  GMutex coalesce_lock;
+  int relative_in_flight;
+  gboolean has_pending_motion;
+  gboolean has_pending_axis;
+  double pending_dx;
+  double pending_dy;
+  guint flush_id;
 } RemoteDesktopSession;
 
 typedef struct _RemoteDesktopSessionClass
@@ -123,10 +144,10 @@ remote_desktop_session_can_select_sources (RemoteDesktopSession *session)
   g_assert_not_reached ();
 }
 
-GList *
-remote_desktop_session_get_streams (RemoteDesktopSession *session)
+GArray *
+remote_desktop_session_get_stream_permissions (RemoteDesktopSession *session)
 {
-  return session->streams;
+  return session->stream_permissions;
 }
 
 void
@@ -192,6 +213,8 @@ create_session_done (GObject *source_object,
   SESSION_AUTOLOCK_UNREF (g_object_ref (session));
   g_object_set_qdata (G_OBJECT (request), quark_request_session, NULL);
 
+  request_impl_done (request);
+
   if (!xdp_impl_remote_desktop_call_create_session_finish (impl,
                                                            &response,
                                                            NULL,
@@ -247,26 +270,13 @@ handle_create_session (XdpRemoteDesktop *object,
 {
   Request *request = request_from_invocation (invocation);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   Session *session;
   GVariantBuilder options_builder;
   GVariant *options;
 
   REQUEST_AUTOLOCK (request);
 
-  impl_request =
-    xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                     G_DBUS_PROXY_FLAGS_NONE,
-                                     g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                     request->id,
-                                     NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   session = (Session *)remote_desktop_session_new (arg_options, request, &error);
@@ -316,6 +326,8 @@ select_devices_done (GObject *source_object,
   SESSION_AUTOLOCK_UNREF (g_object_ref (session));
   g_object_set_qdata (G_OBJECT (request), quark_request_session, NULL);
 
+  request_impl_done (request);
+
   if (!xdp_impl_remote_desktop_call_select_devices_finish (impl,
                                                            &response,
                                                            &results,
@@ -386,7 +398,6 @@ handle_select_devices (XdpRemoteDesktop *object,
   Session *session;
   RemoteDesktopSession *remote_desktop_session;
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder options_builder;
 
   REQUEST_AUTOLOCK (request);
@@ -432,19 +443,7 @@ handle_select_devices (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  impl_request =
-    xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                     G_DBUS_PROXY_FLAGS_NONE,
-                                     g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                     request->id,
-                                     NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
@@ -484,11 +483,30 @@ process_results (RemoteDesktopSession *remote_desktop_session,
 {
   g_autoptr(GVariantIter) streams_iter = NULL;
   uint32_t devices = 0;
+  guint i;
 
   if (g_variant_lookup (results, "streams", "a(ua{sv})", &streams_iter))
     {
-      remote_desktop_session->streams =
-        collect_screen_cast_stream_data (streams_iter);
+      if (remote_desktop_session->streams == NULL)
+        remote_desktop_session->streams = g_array_new (FALSE, FALSE, sizeof (ScreenCastStream));
+      collect_screen_cast_stream_data (streams_iter, remote_desktop_session->streams);
+
+      /* Indices rather than pointers, the array may have moved */
+      if (remote_desktop_session->streams_by_id == NULL)
+        remote_desktop_session->streams_by_id = g_hash_table_new (NULL, NULL);
+      g_hash_table_remove_all (remote_desktop_session->streams_by_id);
+      for (i = 0; i < remote_desktop_session->streams->len; i++)
+        {
+          ScreenCastStream *stream =
+            &g_array_index (remote_desktop_session->streams, ScreenCastStream, i);
+
+          g_hash_table_insert (remote_desktop_session->streams_by_id,
+                               GUINT_TO_POINTER (stream->id), GUINT_TO_POINTER (i + 1));
+        }
+
+      g_clear_pointer (&remote_desktop_session->stream_permissions, g_array_unref);
+      remote_desktop_session->stream_permissions =
+        build_screen_cast_stream_permissions (remote_desktop_session->streams);
     }
 
   if (g_variant_lookup (results, "devices", "u", &devices))
@@ -517,6 +535,8 @@ start_done (GObject *source_object,
   SESSION_AUTOLOCK_UNREF (g_object_ref (session));
   g_object_set_qdata (G_OBJECT (request), quark_request_session, NULL);
 
+  request_impl_done (request);
+
   if (!xdp_impl_remote_desktop_call_start_finish (impl,
                                                   &response,
                                                   &results,
@@ -562,6 +582,8 @@ start_done (GObject *source_object,
                 REMOTE_DESKTOP_SESSION_STATE_STARTING);
       g_debug ("remote desktop session owned by '%s' started", session->sender);
       remote_desktop_session->state = REMOTE_DESKTOP_SESSION_STATE_STARTED;
+      g_atomic_int_set (&remote_desktop_session->notify_devices,
+                        remote_desktop_session->shared_devices);
     }
 }
 
@@ -575,8 +597,6 @@ handle_start (XdpRemoteDesktop *object,
   Request *request = request_from_invocation (invocation);
   Session *session;
   RemoteDesktopSession *remote_desktop_session;
-  g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder options_builder;
   GVariant *options;
 
@@ -631,19 +651,7 @@ handle_start (XdpRemoteDesktop *object,
   g_object_set_data_full (G_OBJECT (request),
                           "window", g_strdup (arg_parent_window), g_free);
 
-  impl_request =
-    xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                     G_DBUS_PROXY_FLAGS_NONE,
-                                     g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                     request->id,
-                                     NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
@@ -670,30 +678,15 @@ handle_start (XdpRemoteDesktop *object,
   return TRUE;
 }
 
+/* Called without the session lock. The streams checked by
+ * check_position() don't change once the session is started. */
 static gboolean
 check_notify (Session *session,
               DeviceType device_type)
 {
   RemoteDesktopSession *remote_desktop_session = (RemoteDesktopSession *)session;
 
-  switch (remote_desktop_session->state)
-    {
-    case REMOTE_DESKTOP_SESSION_STATE_STARTED:
-      break;
-    case REMOTE_DESKTOP_SESSION_STATE_INIT:
-    case REMOTE_DESKTOP_SESSION_STATE_DEVICES_SELECTED:
-    case REMOTE_DESKTOP_SESSION_STATE_SELECTING_DEVICES:
-    case REMOTE_DESKTOP_SESSION_STATE_SOURCES_SELECTED:
-    case REMOTE_DESKTOP_SESSION_STATE_SELECTING_SOURCES:
-    case REMOTE_DESKTOP_SESSION_STATE_STARTING:
-    case REMOTE_DESKTOP_SESSION_STATE_CLOSED:
-      return FALSE;
-    }
-
-  if ((remote_desktop_session->shared_devices & device_type) == 0)
-    return FALSE;
-
-  return TRUE;
+  return (g_atomic_int_get (&remote_desktop_session->notify_devices) & device_type) != 0;
 }
 
 static gboolean
@@ -703,26 +696,222 @@ check_position (Session *session,
                 double y)
 {
   RemoteDesktopSession *remote_desktop_session = (RemoteDesktopSession *)session;
-  GList *l;
+  ScreenCastStream *screen_cast_stream;
+  guint index;
 
-  for (l = remote_desktop_session->streams; l; l = l->next)
-    {
-      ScreenCastStream *stream = l->data;
-      int32_t width, height;
+  if (!remote_desktop_session->streams_by_id)
+    return FALSE;
 
-      screen_cast_stream_get_size (stream, &width, &height);
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (remote_desktop_session->streams_by_id,
+                                                 GUINT_TO_POINTER (stream)));
+  if (index == 0)
+    return FALSE;
 
-      if (x >= 0.0 && x < width &&
-          y >= 0.0 && y < height)
-        return TRUE;
-    }
+  screen_cast_stream = &g_array_index (remote_desktop_session->streams,
+                                       ScreenCastStream, index - 1);
 
-  return FALSE;
+  return x >= 0.0 && x < screen_cast_stream->width &&
+         y >= 0.0 && y < screen_cast_stream->height;
 }
 
 static XdpOptionKey remote_desktop_notify_options[] = {
 };
 
+/* Returns a new reference to the filtered options. Most events come
+ * without options, they all share one empty vardict. */
+static GVariant *
+filter_notify_options (GVariant      *options,
+                       XdpOptionKey  *supported_options,
+                       gsize          n_supported_options,
+                       GError       **error)
+{
+  static GVariant *empty_options;
+  GVariant *filtered;
+
+  if (g_variant_n_children (options) == 0)
+    {
+      if (g_once_init_enter (&empty_options))
+        {
+          GVariant *empty = g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0);
+          g_once_init_leave (&empty_options, g_variant_ref_sink (empty));
+        }
+
+      return g_variant_ref (empty_options);
+    }
+
+  if (!xdp_filter_options_forward (options, &filtered,
+                                   supported_options, n_supported_options,
+                                   error))
+    {
+      g_variant_unref (filtered);
+      return NULL;
+    }
+
+  return filtered;
+}
+
+/* When set, relative motion and axis events that arrive while the
+ * backend hasn't answered the previous one yet are summed up and sent
+ * as one, at the latest after this many milliseconds. */
+static guint coalesce_msec = 0;
+
+void
+remote_desktop_set_coalesce_latency (guint msec)
+{
+  coalesce_msec = msec;
+}
+
+static void send_pending_relative_event_locked (RemoteDesktopSession *remote_desktop_session);
+
+static void
+relative_event_done (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      data)
+{
+  RemoteDesktopSession *remote_desktop_session = data;
+  g_autoptr(GVariant) ret = NULL;
+
+  ret = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, NULL);
+
+  g_mutex_lock (&remote_desktop_session->coalesce_lock);
+  remote_desktop_session->relative_in_flight--;
+  if (remote_desktop_session->relative_in_flight == 0)
+    send_pending_relative_event_locked (remote_desktop_session);
+  g_mutex_unlock (&remote_desktop_session->coalesce_lock);
+
+  g_object_unref (remote_desktop_session);
+}
+
+static void
+send_relative_event_locked (RemoteDesktopSession *remote_desktop_session,
+                            gboolean              axis,
+                            GVariant             *options,
+                            double                dx,
+                            double                dy)
+{
+  Session *session = (Session *)remote_desktop_session;
+
+  remote_desktop_session->relative_in_flight++;
+
+  if (axis)
+    xdp_impl_remote_desktop_call_notify_pointer_axis (impl, session->id, options,
+                                                      dx, dy, NULL,
+                                                      relative_event_done,
+                                                      g_object_ref (remote_desktop_session));
+  else
+    xdp_impl_remote_desktop_call_notify_pointer_motion (impl, session->id, options,
+                                                        dx, dy, NULL,
+                                                        relative_event_done,
+                                                        g_object_ref (remote_desktop_session));
+}
+
+static void
+send_pending_relative_event_locked (RemoteDesktopSession *remote_desktop_session)
+{
+  if (remote_desktop_session->flush_id)
+    {
+      g_source_remove (remote_desktop_session->flush_id);
+      remote_desktop_session->flush_id = 0;
+    }
+
+  if (!remote_desktop_session->has_pending_motion &&
+      !remote_desktop_session->has_pending_axis)
+    return;
+
+  send_relative_event_locked (remote_desktop_session,
+                              remote_desktop_session->has_pending_axis,
+                              g_variant_new ("a{sv}", NULL),
+                              remote_desktop_session->pending_dx,
+                              remote_desktop_session->pending_dy);
+
+  remote_desktop_session->has_pending_motion = FALSE;
+  remote_desktop_session->has_pending_axis = FALSE;
+  remote_desktop_session->pending_dx = 0.0;
+  remote_desktop_session->pending_dy = 0.0;
+}
+
+static gboolean
+flush_pending_relative_event (gpointer data)
+{
+  RemoteDesktopSession *remote_desktop_session = data;
+
+  g_mutex_lock (&remote_desktop_session->coalesce_lock);
+  remote_desktop_session->flush_id = 0;
+  send_pending_relative_event_locked (remote_desktop_session);
+  g_mutex_unlock (&remote_desktop_session->coalesce_lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+coalesce_relative_event (Session  *session,
+                         gboolean  axis,
+                         GVariant *options,
+                         double    dx,
+                         double    dy)
+{
+  RemoteDesktopSession *remote_desktop_session = (RemoteDesktopSession *)session;
+
+  if (coalesce_msec == 0)
+    {
+      if (axis)
+        xdp_impl_remote_desktop_call_notify_pointer_axis (impl, session->id, options,
+                                                          dx, dy, NULL, NULL, NULL);
+      else
+        xdp_impl_remote_desktop_call_notify_pointer_motion (impl, session->id, options,
+                                                            dx, dy, NULL, NULL, NULL);
+      return;
+    }
+
+  g_mutex_lock (&remote_desktop_session->coalesce_lock);
+
+  /* Never merge motion with scrolling, or scrolling with options
+   * (e.g. the end of a scroll sequence) */
+  if ((axis && remote_desktop_session->has_pending_motion) ||
+      (!axis && remote_desktop_session->has_pending_axis) ||
+      g_variant_n_children (options) > 0)
+    send_pending_relative_event_locked (remote_desktop_session);
+
+  if (remote_desktop_session->relative_in_flight == 0 ||
+      g_variant_n_children (options) > 0)
+    {
+      send_relative_event_locked (remote_desktop_session, axis, options, dx, dy);
+    }
+  else
+    {
+      if (axis)
+        remote_desktop_session->has_pending_axis = TRUE;
+      else
+        remote_desktop_session->has_pending_motion = TRUE;
+      remote_desktop_session->pending_dx += dx;
+      remote_desktop_session->pending_dy += dy;
+
+      if (!remote_desktop_session->flush_id)
+        remote_desktop_session->flush_id =
+          g_timeout_add_full (G_PRIORITY_DEFAULT, coalesce_msec,
+                              flush_pending_relative_event,
+                              g_object_ref (remote_desktop_session),
+                              g_object_unref);
+    }
+
+  g_mutex_unlock (&remote_desktop_session->coalesce_lock);
+}
+
+/* Held back relative events go out before any other event, so the
+ * order seen by the backend doesn't change */
+static void
+flush_coalesced_events (Session *session)
+{
+  RemoteDesktopSession *remote_desktop_session = (RemoteDesktopSession *)session;
+
+  if (coalesce_msec == 0)
+    return;
+
+  g_mutex_lock (&remote_desktop_session->coalesce_lock);
+  send_pending_relative_event_locked (remote_desktop_session);
+  g_mutex_unlock (&remote_desktop_session->coalesce_lock);
+}
+
 static gboolean
 handle_notify_pointer_motion (XdpRemoteDesktop *object,
                               GDBusMethodInvocation *invocation,
@@ -732,9 +921,8 @@ handle_notify_pointer_motion (XdpRemoteDesktop *object,
                               double dy)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -747,8 +935,6 @@ handle_notify_pointer_motion (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_POINTER))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -758,22 +944,17 @@ handle_notify_pointer_motion (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
-  options = g_variant_builder_end (&options_builder);
 
-  xdp_impl_remote_desktop_call_notify_pointer_motion (impl,
-                                                      session->id,
-                                                      options,
-                                                      dx, dy,
-                                                      NULL, NULL, NULL);
+  coalesce_relative_event (session, FALSE, options, dx, dy);
 
   xdp_remote_desktop_complete_notify_pointer_motion (object, invocation);
 
@@ -790,9 +971,8 @@ handle_notify_pointer_motion_absolute (XdpRemoteDesktop *object,
                                        double y)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -805,8 +985,6 @@ handle_notify_pointer_motion_absolute (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_POINTER))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -825,17 +1003,17 @@ handle_notify_pointer_motion_absolute (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
 
-  options = g_variant_builder_end (&options_builder);
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_pointer_motion_absolute (impl,
                                                                session->id,
@@ -858,9 +1036,8 @@ handle_notify_pointer_button (XdpRemoteDesktop *object,
                               uint32_t state)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -873,8 +1050,6 @@ handle_notify_pointer_button (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_POINTER))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -884,17 +1059,17 @@ handle_notify_pointer_button (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
 
-  options = g_variant_builder_end (&options_builder);
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_pointer_button (impl,
                                                       session->id,
@@ -921,9 +1096,8 @@ handle_notify_pointer_axis (XdpRemoteDesktop *object,
                             double dy)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -936,8 +1110,6 @@ handle_notify_pointer_axis (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_POINTER))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -947,23 +1119,17 @@ handle_notify_pointer_axis (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_pointer_axis_options,
-                           G_N_ELEMENTS (remote_desktop_notify_pointer_axis_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_pointer_axis_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_pointer_axis_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
 
-  options = g_variant_builder_end (&options_builder);
-
-  xdp_impl_remote_desktop_call_notify_pointer_axis (impl,
-                                                    session->id,
-                                                    options,
-                                                    dx, dy,
-                                                    NULL, NULL, NULL);
+  coalesce_relative_event (session, TRUE, options, dx, dy);
 
   xdp_remote_desktop_complete_notify_pointer_axis (object, invocation);
 
@@ -979,9 +1145,8 @@ handle_notify_pointer_axis_discrete (XdpRemoteDesktop *object,
                                      int32_t steps)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -994,8 +1159,6 @@ handle_notify_pointer_axis_discrete (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_POINTER))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -1005,16 +1168,17 @@ handle_notify_pointer_axis_discrete (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
-  options = g_variant_builder_end (&options_builder);
+
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_pointer_axis_discrete (impl,
                                                              session->id,
@@ -1037,9 +1201,8 @@ handle_notify_keyboard_keycode (XdpRemoteDesktop *object,
                                 uint32_t state)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -1052,8 +1215,6 @@ handle_notify_keyboard_keycode (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_KEYBOARD))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -1063,16 +1224,17 @@ handle_notify_keyboard_keycode (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
-  options = g_variant_builder_end (&options_builder);
+
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_keyboard_keycode (impl,
                                                         session->id,
@@ -1095,9 +1257,8 @@ handle_notify_keyboard_keysym (XdpRemoteDesktop *object,
                                uint32_t state)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -1110,8 +1271,6 @@ handle_notify_keyboard_keysym (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_KEYBOARD))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -1121,16 +1280,17 @@ handle_notify_keyboard_keysym (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
-  options = g_variant_builder_end (&options_builder);
+
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_keyboard_keysym (impl,
                                                        session->id,
@@ -1155,9 +1315,8 @@ handle_notify_touch_down (XdpRemoteDesktop *object,
                           double y)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -1170,8 +1329,6 @@ handle_notify_touch_down (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_TOUCHSCREEN))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -1190,16 +1347,17 @@ handle_notify_touch_down (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
-  options = g_variant_builder_end (&options_builder);
+
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_touch_down (impl,
                                                   session->id,
@@ -1225,9 +1383,8 @@ handle_notify_touch_motion (XdpRemoteDesktop *object,
                             double y)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -1240,8 +1397,6 @@ handle_notify_touch_motion (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_TOUCHSCREEN))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -1260,16 +1415,17 @@ handle_notify_touch_motion (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
-  options = g_variant_builder_end (&options_builder);
+
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_touch_motion (impl,
                                                     session->id,
@@ -1292,9 +1448,8 @@ handle_notify_touch_up (XdpRemoteDesktop *object,
                         uint32_t slot)
 {
   Call *call = call_from_invocation (invocation);
-  Session *session;
-  GVariantBuilder options_builder;
-  GVariant *options;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) error = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
@@ -1307,8 +1462,6 @@ handle_notify_touch_up (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  SESSION_AUTOLOCK_UNREF (session);
-
   if (!check_notify (session, DEVICE_TYPE_TOUCHSCREEN))
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -1318,16 +1471,17 @@ handle_notify_touch_up (XdpRemoteDesktop *object,
       return TRUE;
     }
 
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
-  if (!xdp_filter_options (arg_options, &options_builder,
-                           remote_desktop_notify_options,
-                           G_N_ELEMENTS (remote_desktop_notify_options),
-                           &error))
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
     {
       g_dbus_method_invocation_return_gerror (invocation, error);
       return TRUE;
     }
-  options = g_variant_builder_end (&options_builder);
+
+  flush_coalesced_events (session);
 
   xdp_impl_remote_desktop_call_notify_touch_up (impl,
                                                 session->id,
@@ -1340,6 +1494,490 @@ handle_notify_touch_up (XdpRemoteDesktop *object,
   return TRUE;
 }
 
+/* NotifyEvents */
+
+typedef enum _EventType
+{
+  EVENT_POINTER_MOTION,
+  EVENT_POINTER_MOTION_ABSOLUTE,
+  EVENT_POINTER_BUTTON,
+  EVENT_POINTER_AXIS,
+  EVENT_POINTER_AXIS_DISCRETE,
+  EVENT_KEYBOARD_KEYCODE,
+  EVENT_KEYBOARD_KEYSYM,
+  EVENT_TOUCH_DOWN,
+  EVENT_TOUCH_MOTION,
+  EVENT_TOUCH_UP,
+  N_EVENT_TYPES
+} EventType;
+
+typedef struct
+{
+  const char *parameters;
+  DeviceType device_type;
+  XdpOptionKey *options;
+  gsize n_options;
+} EventTypeInfo;
+
+static const EventTypeInfo event_types[] = {
+  [EVENT_POINTER_MOTION] = { "(dd)", DEVICE_TYPE_POINTER,
+                             remote_desktop_notify_options,
+                             G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_POINTER_MOTION_ABSOLUTE] = { "(udd)", DEVICE_TYPE_POINTER,
+                                      remote_desktop_notify_options,
+                                      G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_POINTER_BUTTON] = { "(iu)", DEVICE_TYPE_POINTER,
+                             remote_desktop_notify_options,
+                             G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_POINTER_AXIS] = { "(dd)", DEVICE_TYPE_POINTER,
+                           remote_desktop_notify_pointer_axis_options,
+                           G_N_ELEMENTS (remote_desktop_notify_pointer_axis_options) },
+  [EVENT_POINTER_AXIS_DISCRETE] = { "(ui)", DEVICE_TYPE_POINTER,
+                                    remote_desktop_notify_options,
+                                    G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_KEYBOARD_KEYCODE] = { "(iu)", DEVICE_TYPE_KEYBOARD,
+                               remote_desktop_notify_options,
+                               G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_KEYBOARD_KEYSYM] = { "(iu)", DEVICE_TYPE_KEYBOARD,
+                              remote_desktop_notify_options,
+                              G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_TOUCH_DOWN] = { "(uudd)", DEVICE_TYPE_TOUCHSCREEN,
+                         remote_desktop_notify_options,
+                         G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_TOUCH_MOTION] = { "(uudd)", DEVICE_TYPE_TOUCHSCREEN,
+                           remote_desktop_notify_options,
+                           G_N_ELEMENTS (remote_desktop_notify_options) },
+  [EVENT_TOUCH_UP] = { "(u)", DEVICE_TYPE_TOUCHSCREEN,
+                       remote_desktop_notify_options,
+                       G_N_ELEMENTS (remote_desktop_notify_options) },
+};
+
+/* Set once the backend is known to implement NotifyEvents */
+static gboolean impl_has_notify_events = FALSE;
+
+static GVariant *
+validate_events (Session   *session,
+                 GVariant  *events,
+                 GError   **error)
+{
+  GVariantBuilder builder;
+  GVariantIter iter;
+  uint32_t type;
+  GVariant *event_options;
+  GVariant *parameters;
+  gsize i = 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ua{sv}v)"));
+
+  g_variant_iter_init (&iter, events);
+  while (g_variant_iter_next (&iter, "(u@a{sv}v)", &type, &event_options, &parameters))
+    {
+      g_autoptr(GVariant) owned_options = event_options;
+      g_autoptr(GVariant) owned_parameters = parameters;
+      g_autoptr(GVariant) filtered_options = NULL;
+      const EventTypeInfo *info;
+
+      if (type >= N_EVENT_TYPES)
+        {
+          g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                       "Event %" G_GSIZE_FORMAT ": unknown type %u", i, type);
+          goto fail;
+        }
+
+      info = &event_types[type];
+
+      if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE (info->parameters)))
+        {
+          g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                       "Event %" G_GSIZE_FORMAT ": expected parameters of type %s, got %s",
+                       i, info->parameters, g_variant_get_type_string (parameters));
+          goto fail;
+        }
+
+      if (!check_notify (session, info->device_type))
+        {
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Event %" G_GSIZE_FORMAT ": invalid call", i);
+          goto fail;
+        }
+
+      if (type == EVENT_POINTER_MOTION_ABSOLUTE ||
+          type == EVENT_TOUCH_DOWN ||
+          type == EVENT_TOUCH_MOTION)
+        {
+          uint32_t stream, slot;
+          double x, y;
+
+          if (type == EVENT_POINTER_MOTION_ABSOLUTE)
+            g_variant_get (parameters, "(udd)", &stream, &x, &y);
+          else
+            g_variant_get (parameters, "(uudd)", &stream, &slot, &x, &y);
+
+          if (!check_position (session, stream, x, y))
+            {
+              g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                           "Event %" G_GSIZE_FORMAT ": invalid position", i);
+              goto fail;
+            }
+        }
+
+      filtered_options = filter_notify_options (event_options,
+                                                info->options, info->n_options,
+                                                error);
+      if (!filtered_options)
+        goto fail;
+
+      g_variant_builder_add (&builder, "(u@a{sv}v)",
+                             type,
+                             filtered_options,
+                             parameters);
+      i++;
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+
+fail:
+  g_variant_builder_clear (&builder);
+  return NULL;
+}
+
+static void
+forward_event (const char *session_id,
+               uint32_t    type,
+               GVariant   *options,
+               GVariant   *parameters)
+{
+  uint32_t u1, u2;
+  int32_t i1;
+  double d1, d2;
+
+  switch ((EventType) type)
+    {
+    case EVENT_POINTER_MOTION:
+      g_variant_get (parameters, "(dd)", &d1, &d2);
+      xdp_impl_remote_desktop_call_notify_pointer_motion (impl, session_id, options,
+                                                          d1, d2, NULL, NULL, NULL);
+      break;
+    case EVENT_POINTER_MOTION_ABSOLUTE:
+      g_variant_get (parameters, "(udd)", &u1, &d1, &d2);
+      xdp_impl_remote_desktop_call_notify_pointer_motion_absolute (impl, session_id, options,
+                                                                   u1, d1, d2, NULL, NULL, NULL);
+      break;
+    case EVENT_POINTER_BUTTON:
+      g_variant_get (parameters, "(iu)", &i1, &u1);
+      xdp_impl_remote_desktop_call_notify_pointer_button (impl, session_id, options,
+                                                          i1, u1, NULL, NULL, NULL);
+      break;
+    case EVENT_POINTER_AXIS:
+      g_variant_get (parameters, "(dd)", &d1, &d2);
+      xdp_impl_remote_desktop_call_notify_pointer_axis (impl, session_id, options,
+                                                        d1, d2, NULL, NULL, NULL);
+      break;
+    case EVENT_POINTER_AXIS_DISCRETE:
+      g_variant_get (parameters, "(ui)", &u1, &i1);
+      xdp_impl_remote_desktop_call_notify_pointer_axis_discrete (impl, session_id, options,
+                                                                 u1, i1, NULL, NULL, NULL);
+      break;
+    case EVENT_KEYBOARD_KEYCODE:
+      g_variant_get (parameters, "(iu)", &i1, &u1);
+      xdp_impl_remote_desktop_call_notify_keyboard_keycode (impl, session_id, options,
+                                                            i1, u1, NULL, NULL, NULL);
+      break;
+    case EVENT_KEYBOARD_KEYSYM:
+      g_variant_get (parameters, "(iu)", &i1, &u1);
+      xdp_impl_remote_desktop_call_notify_keyboard_keysym (impl, session_id, options,
+                                                           i1, u1, NULL, NULL, NULL);
+      break;
+    case EVENT_TOUCH_DOWN:
+      g_variant_get (parameters, "(uudd)", &u1, &u2, &d1, &d2);
+      xdp_impl_remote_desktop_call_notify_touch_down (impl, session_id, options,
+                                                      u1, u2, d1, d2, NULL, NULL, NULL);
+      break;
+    case EVENT_TOUCH_MOTION:
+      g_variant_get (parameters, "(uudd)", &u1, &u2, &d1, &d2);
+      xdp_impl_remote_desktop_call_notify_touch_motion (impl, session_id, options,
+                                                        u1, u2, d1, d2, NULL, NULL, NULL);
+      break;
+    case EVENT_TOUCH_UP:
+      g_variant_get (parameters, "(u)", &u1);
+      xdp_impl_remote_desktop_call_notify_touch_up (impl, session_id, options,
+                                                    u1, NULL, NULL, NULL);
+      break;
+    case N_EVENT_TYPES:
+      g_assert_not_reached ();
+    }
+}
+
+static void
+forward_events_one_by_one (const char *session_id,
+                           GVariant   *events)
+{
+  GVariantIter iter;
+  uint32_t type;
+  GVariant *options;
+  GVariant *parameters;
+
+  g_variant_iter_init (&iter, events);
+  while (g_variant_iter_next (&iter, "(u@a{sv}v)", &type, &options, &parameters))
+    {
+      forward_event (session_id, type, options, parameters);
+      g_variant_unref (options);
+      g_variant_unref (parameters);
+    }
+}
+
+/* Backends are asked once up front whether they implement NotifyEvents,
+ * rather than finding out from a failed batch. Replaying a batch after
+ * the error would let events that were sent in the meantime overtake it.
+ */
+static void
+introspect_impl_done (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      data)
+{
+  g_autoptr(GVariant) ret = NULL;
+  g_autoptr(GDBusNodeInfo) node = NULL;
+  g_autoptr(GError) error = NULL;
+  GDBusInterfaceInfo *info;
+  const char *xml;
+
+  ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+  if (ret == NULL)
+    {
+      g_debug ("Failed to introspect the remote desktop backend: %s", error->message);
+      return;
+    }
+
+  g_variant_get (ret, "(&s)", &xml);
+  node = g_dbus_node_info_new_for_xml (xml, &error);
+  if (node == NULL)
+    {
+      g_debug ("Failed to parse the remote desktop backend introspection: %s", error->message);
+      return;
+    }
+
+  info = g_dbus_node_info_lookup_interface (node, "org.freedesktop.impl.portal.RemoteDesktop");
+  if (info && g_dbus_interface_info_lookup_method (info, "NotifyEvents"))
+    g_atomic_int_set (&impl_has_notify_events, TRUE);
+  else
+    g_debug ("Backend doesn't support NotifyEvents, sending events one by one");
+}
+
+static gboolean
+handle_notify_events (XdpRemoteDesktop *object,
+                      GDBusMethodInvocation *invocation,
+                      const char *arg_session_handle,
+                      GVariant *arg_options,
+                      GVariant *arg_events)
+{
+  Call *call = call_from_invocation (invocation);
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GVariant) events = NULL;
+  g_autoptr(GError) error = NULL;
+
+  session = acquire_session_from_call (arg_session_handle, call);
+  if (!session)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_ACCESS_DENIED,
+                                             "Invalid session");
+      return TRUE;
+    }
+
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  events = validate_events (session, arg_events, &error);
+  if (!events)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  flush_coalesced_events (session);
+
+  if (g_atomic_int_get (&impl_has_notify_events))
+    {
+      xdp_impl_remote_desktop_call_notify_events (impl,
+                                                  session->id,
+                                                  options,
+                                                  events,
+                                                  NULL, NULL, NULL);
+    }
+  else
+    {
+      forward_events_one_by_one (session->id, events);
+    }
+
+  xdp_remote_desktop_complete_notify_events (object, invocation);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  XdpRemoteDesktop *object;
+  GDBusMethodInvocation *invocation;
+  Session *session;
+} ConnectToEisData;
+
+static void
+connect_to_eis_data_free (ConnectToEisData *data)
+{
+  g_object_unref (data->object);
+  g_object_unref (data->invocation);
+  g_object_unref (data->session);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ConnectToEisData, connect_to_eis_data_free)
+
+static void
+connect_to_eis_done (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+  g_autoptr(ConnectToEisData) data = user_data;
+  RemoteDesktopSession *remote_desktop_session =
+    (RemoteDesktopSession *)data->session;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd = NULL;
+  g_autoptr(GError) error = NULL;
+
+  gboolean connected;
+
+  connected = xdp_impl_remote_desktop_call_connect_to_eis_finish (impl,
+                                                                  &fd,
+                                                                  &fd_list,
+                                                                  res,
+                                                                  &error);
+
+  SESSION_AUTOLOCK (data->session);
+
+  if (!connected)
+    {
+      g_dbus_error_strip_remote_error (error);
+      g_warning ("Failed to connect to EIS: %s", error->message);
+
+      remote_desktop_session->eis_connected = FALSE;
+      if (remote_desktop_session->state == REMOTE_DESKTOP_SESSION_STATE_STARTED)
+        g_atomic_int_set (&remote_desktop_session->notify_devices,
+                          remote_desktop_session->shared_devices);
+
+      g_dbus_method_invocation_return_error (data->invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED,
+                                             "Failed to connect to EIS: %s",
+                                             error->message);
+      return;
+    }
+
+  /* The backend ends the connection when the session is closed, but
+   * don't hand out one for a session that was closed meanwhile */
+  if (data->session->closed)
+    {
+      g_dbus_method_invocation_return_error (data->invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_ACCESS_DENIED,
+                                             "Invalid session");
+      return;
+    }
+
+  xdp_remote_desktop_complete_connect_to_eis (data->object, data->invocation,
+                                              fd_list, fd);
+}
+
+/* The authorization is checked once, here: after the handoff the
+ * events go from the application to the compositor directly */
+static gboolean
+handle_connect_to_eis (XdpRemoteDesktop *object,
+                       GDBusMethodInvocation *invocation,
+                       GUnixFDList *in_fd_list,
+                       const char *arg_session_handle,
+                       GVariant *arg_options)
+{
+  Call *call = call_from_invocation (invocation);
+  RemoteDesktopSession *remote_desktop_session;
+  g_autoptr(Session) session = NULL;
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GError) error = NULL;
+  ConnectToEisData *data;
+
+  session = acquire_session_from_call (arg_session_handle, call);
+  if (!session || !is_remote_desktop_session (session))
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_ACCESS_DENIED,
+                                             "Invalid session");
+      return TRUE;
+    }
+
+  options = filter_notify_options (arg_options,
+                                   remote_desktop_notify_options,
+                                   G_N_ELEMENTS (remote_desktop_notify_options),
+                                   &error);
+  if (!options)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  remote_desktop_session = (RemoteDesktopSession *)session;
+
+  SESSION_AUTOLOCK (session);
+
+  if (remote_desktop_session->state != REMOTE_DESKTOP_SESSION_STATE_STARTED ||
+      remote_desktop_session->shared_devices == DEVICE_TYPE_NONE)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED,
+                                             "Session is not started or has no devices");
+      return TRUE;
+    }
+
+  if (remote_desktop_session->eis_connected)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED,
+                                             "Session is already connected to EIS");
+      return TRUE;
+    }
+
+  /* Events sent over the bus could race with the ones on the new
+   * connection, so the Notify methods stop working from here on */
+  remote_desktop_session->eis_connected = TRUE;
+  g_atomic_int_set (&remote_desktop_session->notify_devices, DEVICE_TYPE_NONE);
+  flush_coalesced_events (session);
+
+  data = g_new0 (ConnectToEisData, 1);
+  data->object = g_object_ref (object);
+  data->invocation = g_object_ref (invocation);
+  data->session = g_object_ref (session);
+
+  xdp_impl_remote_desktop_call_connect_to_eis (impl,
+                                               session->id,
+                                               session->app_id,
+                                               options,
+                                               NULL,
+                                               NULL,
+                                               connect_to_eis_done,
+                                               data);
+
+  return TRUE;
+}
+
 static void
 remote_desktop_iface_init (XdpRemoteDesktopIface *iface)
 {
@@ -1357,6 +1995,8 @@ remote_desktop_iface_init (XdpRemoteDesktopIface *iface)
   iface->handle_notify_touch_down = handle_notify_touch_down;
   iface->handle_notify_touch_motion = handle_notify_touch_motion;
   iface->handle_notify_touch_up = handle_notify_touch_up;
+  iface->handle_notify_events = handle_notify_events;
+  iface->handle_connect_to_eis = handle_connect_to_eis;
 }
 
 static void
@@ -1381,7 +2021,7 @@ on_supported_device_types_changed (GObject *gobject,
 static void
 remote_desktop_init (RemoteDesktop *remote_desktop)
 {
-  xdp_remote_desktop_set_version (XDP_REMOTE_DESKTOP (remote_desktop), 1);
+  xdp_remote_desktop_set_version (XDP_REMOTE_DESKTOP (remote_desktop), 3);
 
   g_signal_connect (impl, "notify::supported-device-types",
                     G_CALLBACK (on_supported_device_types_changed),
@@ -1394,13 +2034,51 @@ remote_desktop_class_init (RemoteDesktopClass *klass)
 {
 }
 
+/* When set, the backend is talked to over a bus connection of its own,
+ * so that a flood of input events queues up there rather than in front
+ * of the replies to other clients. */
+static gboolean use_separate_connection = FALSE;
+
+void
+remote_desktop_set_separate_connection (gboolean separate)
+{
+  use_separate_connection = separate;
+}
+
+static GDBusConnection *
+open_impl_connection (GError **error)
+{
+  g_autofree char *address = NULL;
+
+  address = g_dbus_address_get_for_bus_sync (G_BUS_TYPE_SESSION, NULL, error);
+  if (address == NULL)
+    return NULL;
+
+  return g_dbus_connection_new_for_address_sync (address,
+                                                 G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                 G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                 NULL, NULL, error);
+}
+
 GDBusInterfaceSkeleton *
 remote_desktop_create (GDBusConnection *connection,
                        const char *dbus_name)
 {
+  g_autoptr(GDBusConnection) impl_connection = NULL;
   g_autoptr(GError) error = NULL;
 
-  impl = xdp_impl_remote_desktop_proxy_new_sync (connection,
+  if (use_separate_connection)
+    {
+      impl_connection = open_impl_connection (&error);
+      if (impl_connection == NULL)
+        {
+          g_warning ("Failed to open remote desktop backend connection, sharing the main one: %s",
+                     error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  impl = xdp_impl_remote_desktop_proxy_new_sync (impl_connection ? impl_connection : connection,
                                                  G_DBUS_PROXY_FLAGS_NONE,
                                                  dbus_name,
                                                  DESKTOP_PORTAL_OBJECT_PATH,
@@ -1414,6 +2092,19 @@ remote_desktop_create (GDBusConnection *connection,
 
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
 
+  g_dbus_connection_call (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
+                          dbus_name,
+                          DESKTOP_PORTAL_OBJECT_PATH,
+                          "org.freedesktop.DBus.Introspectable",
+                          "Introspect",
+                          NULL,
+                          G_VARIANT_TYPE ("(s)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          -1,
+                          NULL,
+                          introspect_impl_done,
+                          NULL);
+
   remote_desktop = g_object_new (remote_desktop_get_type (), NULL);
 
   return G_DBUS_INTERFACE_SKELETON (remote_desktop);
@@ -1425,6 +2116,17 @@ remote_desktop_session_close (Session *session)
   RemoteDesktopSession *remote_desktop_session = (RemoteDesktopSession *)session;
 
   remote_desktop_session->state = REMOTE_DESKTOP_SESSION_STATE_CLOSED;
+  g_atomic_int_set (&remote_desktop_session->notify_devices, DEVICE_TYPE_NONE);
+
+  g_mutex_lock (&remote_desktop_session->coalesce_lock);
+  if (remote_desktop_session->flush_id)
+    {
+      g_source_remove (remote_desktop_session->flush_id);
+      remote_desktop_session->flush_id = 0;
+    }
+  remote_desktop_session->has_pending_motion = FALSE;
+  remote_desktop_session->has_pending_axis = FALSE;
+  g_mutex_unlock (&remote_desktop_session->coalesce_lock);
 
   g_debug ("remote desktop session owned by '%s' closed", session->sender);
 }
@@ -1434,8 +2136,10 @@ remote_desktop_session_finalize (GObject *object)
 {
   RemoteDesktopSession *remote_desktop_session = (RemoteDesktopSession *)object;
 
-  g_list_free_full (remote_desktop_session->streams,
-                    (GDestroyNotify)screen_cast_stream_free);
+  g_mutex_clear (&remote_desktop_session->coalesce_lock);
+  g_clear_pointer (&remote_desktop_session->streams_by_id, g_hash_table_unref);
+  g_clear_pointer (&remote_desktop_session->streams, g_array_unref);
+  g_clear_pointer (&remote_desktop_session->stream_permissions, g_array_unref);
 
   G_OBJECT_CLASS (remote_desktop_session_parent_class)->finalize (object);
 }
@@ -1443,6 +2147,7 @@ remote_desktop_session_finalize (GObject *object)
 static void
 remote_desktop_session_init (RemoteDesktopSession *remote_desktop_session)
 {
+  g_mutex_init (&remote_desktop_session->coalesce_lock);
 }
 
 static void
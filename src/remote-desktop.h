@@ -27,7 +27,7 @@ typedef struct _RemoteDesktopSession RemoteDesktopSession;
 
 gboolean is_remote_desktop_session (Session *session);
 
-GList * remote_desktop_session_get_streams (RemoteDesktopSession *session);
+GArray * remote_desktop_session_get_stream_permissions (RemoteDesktopSession *session);
 
 gboolean remote_desktop_session_can_select_sources (RemoteDesktopSession *session);
 
@@ -35,5 +35,9 @@ void remote_desktop_session_selecting_sources (RemoteDesktopSession *session);
 
 void remote_desktop_session_sources_selected (RemoteDesktopSession *session);
 
+void remote_desktop_set_coalesce_latency (guint msec);
+
+void remote_desktop_set_separate_connection (gboolean separate);
+
 GDBusInterfaceSkeleton * remote_desktop_create (GDBusConnection *connection,
                                                 const char      *dbus_name);
@@ -20,6 +20,8 @@
  */
 
 #include "request.h"
+#include "call.h"
+#include "latency.h"
 #include "xdp-utils.h"
 
 #include <string.h>
@@ -59,6 +61,32 @@ request_on_signal_response (XdpRequest *object,
   g_list_free_full (connections, g_object_unref);
 }
 
+/* Closes the backend's side of the request. This is just a method
+ * call, so no proxy is created for it. */
+static gboolean
+request_close_impl (Request  *request,
+                    GError  **error)
+{
+  g_autoptr(GVariant) ret = NULL;
+
+  if (request->impl_connection == NULL)
+    return TRUE;
+
+  ret = g_dbus_connection_call_sync (request->impl_connection,
+                                     request->impl_name,
+                                     request->id,
+                                     "org.freedesktop.impl.portal.Request",
+                                     "Close",
+                                     NULL,
+                                     NULL,
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     -1,
+                                     NULL,
+                                     error);
+
+  return ret != NULL;
+}
+
 static gboolean
 handle_close (XdpRequest *object,
               GDBusMethodInvocation *invocation)
@@ -71,8 +99,7 @@ handle_close (XdpRequest *object,
 
   if (request->exported)
     {
-      if (request->impl_request &&
-          !xdp_impl_request_call_close_sync (request->impl_request, NULL, &error))
+      if (!request_close_impl (request, &error))
         {
           if (invocation)
             g_dbus_method_invocation_return_gerror (invocation, error);
@@ -97,11 +124,95 @@ request_skeleton_iface_init (XdpRequestIface *iface)
 
 G_LOCK_DEFINE (requests);
 static GHashTable *requests;
+static GHashTable *requests_by_sender; /* sender -> RequestSender */
+
+#define REQUEST_PATH_PREFIX "/org/freedesktop/portal/desktop/request/"
+
+typedef struct {
+  GQueue requests;
+  char *escaped_sender;
+  guint32 serial;
+  gsize bytes; /* Size of the calls that made the requests */
+} RequestSender;
+
+/* 0 means unlimited */
+static guint max_requests_per_sender;
+
+static void
+request_sender_free (RequestSender *sender)
+{
+  g_free (sender->escaped_sender);
+  g_free (sender);
+}
 
 static void
 request_init (Request *request)
 {
   g_mutex_init (&request->mutex);
+  request->sender_link.data = request;
+}
+
+/* Called with requests locked */
+static RequestSender *
+ensure_request_sender (const char *sender)
+{
+  RequestSender *request_sender;
+  int i;
+
+  request_sender = g_hash_table_lookup (requests_by_sender, sender);
+  if (request_sender == NULL)
+    {
+      request_sender = g_new0 (RequestSender, 1);
+      g_queue_init (&request_sender->requests);
+      request_sender->escaped_sender = g_strdup (sender + 1);
+      for (i = 0; request_sender->escaped_sender[i]; i++)
+        if (request_sender->escaped_sender[i] == '.')
+          request_sender->escaped_sender[i] = '_';
+      g_hash_table_insert (requests_by_sender, g_strdup (sender), request_sender);
+    }
+
+  return request_sender;
+}
+
+/* Called with requests locked */
+static void
+remove_request_for_sender (Request *request)
+{
+  RequestSender *request_sender;
+
+  request_sender = g_hash_table_lookup (requests_by_sender, request->sender);
+  if (request_sender == NULL)
+    return;
+
+  g_queue_unlink (&request_sender->requests, &request->sender_link);
+  request_sender->bytes -= request->accounted_bytes;
+  if (g_queue_is_empty (&request_sender->requests))
+    g_hash_table_remove (requests_by_sender, request->sender);
+}
+
+/* Formats the request path into buf, or into a new allocation if it
+ * doesn't fit. A serial of 0 means no suffix. */
+static char *
+format_request_path (char       *buf,
+                     gsize       size,
+                     const char *escaped_sender,
+                     const char *token,
+                     guint32     serial)
+{
+  int len;
+
+  if (serial == 0)
+    len = g_snprintf (buf, size, REQUEST_PATH_PREFIX "%s/%s", escaped_sender, token);
+  else
+    len = g_snprintf (buf, size, REQUEST_PATH_PREFIX "%s/%s/%u", escaped_sender, token, serial);
+
+  if (len >= 0 && (gsize) len < size)
+    return buf;
+
+  if (serial == 0)
+    return g_strdup_printf (REQUEST_PATH_PREFIX "%s/%s", escaped_sender, token);
+  else
+    return g_strdup_printf (REQUEST_PATH_PREFIX "%s/%s/%u", escaped_sender, token, serial);
 }
 
 static void
@@ -110,10 +221,16 @@ request_finalize (GObject *object)
   Request *request = (Request *)object;
 
   G_LOCK (requests);
-  g_hash_table_remove (requests, request->id);
+  if (request->id)
+    {
+      g_hash_table_remove (requests, request->id);
+      remove_request_for_sender (request);
+    }
   G_UNLOCK (requests);
 
-  g_clear_object (&request->impl_request);
+  g_clear_object (&request->impl_connection);
+  g_free (request->impl_name);
+  g_free (request->method);
 
   g_free (request->sender);
   g_free (request->id);
@@ -123,6 +240,36 @@ request_finalize (GObject *object)
   G_OBJECT_CLASS (request_parent_class)->finalize (object);
 }
 
+static void
+request_memory_usage (GArray *usage)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  guint64 objects = 0;
+  guint64 bytes = 0;
+
+  G_LOCK (requests);
+  g_hash_table_iter_init (&iter, requests_by_sender);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      RequestSender *request_sender = value;
+      GList *l;
+
+      bytes += sizeof (RequestSender) + 2 * (strlen (key) + 1) + request_sender->bytes;
+
+      for (l = request_sender->requests.head; l; l = l->next)
+        {
+          Request *request = l->data;
+
+          objects++;
+          bytes += sizeof (Request) + strlen (request->id) + 1 + strlen (request->sender) + 1;
+        }
+    }
+  G_UNLOCK (requests);
+
+  xdp_memory_usage_add (usage, "requests", objects, bytes);
+}
+
 static void
 request_class_init (RequestClass *klass)
 {
@@ -130,6 +277,9 @@ request_class_init (RequestClass *klass)
 
   requests = g_hash_table_new_full (g_str_hash, g_str_equal,
                                     NULL, NULL);
+  requests_by_sender = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify) request_sender_free);
+  xdp_add_memory_usage_func (request_memory_usage);
 
   gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->finalize  = request_finalize;
@@ -342,38 +492,92 @@ get_token (GDBusMethodInvocation *invocation)
 }
 
 void
-request_init_invocation (GDBusMethodInvocation *invocation, XdpAppInfo *app_info)
+request_set_max_per_sender (guint max_requests)
+{
+  max_requests_per_sender = max_requests;
+}
+
+/* A client that doesn't close its requests would otherwise make the
+ * portal grow without bounds, so it gets refused more of them */
+static gboolean
+check_request_limit (const char  *sender,
+                     GError     **error)
+{
+  RequestSender *request_sender;
+  guint n_requests = 0;
+
+  if (max_requests_per_sender == 0)
+    return TRUE;
+
+  G_LOCK (requests);
+  /* NULL until the first request is created */
+  request_sender = requests_by_sender ? g_hash_table_lookup (requests_by_sender, sender) : NULL;
+  if (request_sender)
+    n_requests = g_queue_get_length (&request_sender->requests);
+  G_UNLOCK (requests);
+
+  if (n_requests < max_requests_per_sender)
+    return TRUE;
+
+  g_warning ("%s has %u open requests, refusing more", sender, n_requests);
+  g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+               "Too many open requests");
+  return FALSE;
+}
+
+gboolean
+request_init_invocation (GDBusMethodInvocation  *invocation,
+                         XdpAppInfo             *app_info,
+                         GError                **error)
 {
   Request *request;
-  guint32 r;
-  char *id = NULL;
+  RequestSender *request_sender;
+  char buf[256];
+  char *id;
   const char *token;
-  g_autofree char *sender = NULL;
-  int i;
+  guint32 serial = 0;
+
+  if (!check_request_limit (g_dbus_method_invocation_get_sender (invocation), error))
+    return FALSE;
 
   request = g_object_new (request_get_type (), NULL);
   request->sender = g_strdup (g_dbus_method_invocation_get_sender (invocation));
   request->app_info = xdp_app_info_ref (app_info);
 
-  token = get_token (invocation);
-  sender = g_strdup (request->sender + 1);
-  for (i = 0; sender[i]; i++)
-    if (sender[i] == '.')
-      sender[i] = '_';
+  if (latency_enabled ())
+    {
+      request->method = g_strconcat (g_dbus_method_invocation_get_interface_name (invocation), ".",
+                                     g_dbus_method_invocation_get_method_name (invocation), NULL);
+      request->start_time = g_get_monotonic_time ();
+    }
 
-  id = g_strdup_printf ("/org/freedesktop/portal/desktop/request/%s/%s", sender, token);
+  token = get_token (invocation);
 
   G_LOCK (requests);
 
-  while (g_hash_table_lookup (requests, id) != NULL)
+  request_sender = ensure_request_sender (request->sender);
+
+  /* Use the plain token path if it is free, then a per-sender serial */
+  while (TRUE)
     {
-      r = g_random_int ();
-      g_free (id);
-      id = g_strdup_printf ("/org/freedesktop/portal/desktop/request/%s/%s/%u", sender, token, r);
+      id = format_request_path (buf, sizeof (buf),
+                                request_sender->escaped_sender, token, serial);
+      if (g_hash_table_lookup (requests, id) == NULL)
+        break;
+
+      if (id != buf)
+        g_free (id);
+
+      do
+        serial = ++request_sender->serial;
+      while (serial == 0);
     }
 
-  request->id = id;
-  g_hash_table_insert (requests, id, request);
+  request->id = id == buf ? g_strdup (buf) : id;
+  g_hash_table_insert (requests, request->id, request);
+  g_queue_push_tail_link (&request_sender->requests, &request->sender_link);
+  request->accounted_bytes = g_variant_get_size (g_dbus_method_invocation_get_parameters (invocation));
+  request_sender->bytes += request->accounted_bytes;
 
   G_UNLOCK (requests);
 
@@ -384,13 +588,44 @@ request_init_invocation (GDBusMethodInvocation *invocation, XdpAppInfo *app_info
                     request->sender);
 
 
-  g_object_set_data_full (G_OBJECT (invocation), "request", request, g_object_unref);
+  call_from_invocation (invocation)->request = request;
+
+  return TRUE;
+}
+
+/* Appends a line for each sender with open requests */
+void
+request_append_usage (GString *usage)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  G_LOCK (requests);
+  if (requests_by_sender == NULL)
+    {
+      G_UNLOCK (requests);
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, requests_by_sender);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      RequestSender *request_sender = value;
+
+      g_string_append_printf (usage, "%s: %u requests, %" G_GSIZE_FORMAT " bytes\n",
+                              (const char *) key,
+                              g_queue_get_length (&request_sender->requests),
+                              request_sender->bytes);
+    }
+  G_UNLOCK (requests);
 }
 
 Request *
 request_from_invocation (GDBusMethodInvocation *invocation)
 {
-  return g_object_get_data (G_OBJECT (invocation), "request");
+  Call *call = call_from_invocation (invocation);
+
+  return call ? call->request : NULL;
 }
 
 void
@@ -410,21 +645,66 @@ request_export (Request *request,
 
   g_object_ref (request);
   request->exported = TRUE;
+
+  /* The backend is called right after exporting */
+  if (request->method)
+    request->impl_start_time = g_get_monotonic_time ();
+}
+
+/* Called when the backend has replied, to split the latency of the
+ * request between the portal and the backend */
+void
+request_impl_done (Request *request)
+{
+  if (request->method && request->impl_done_time == 0)
+    request->impl_done_time = g_get_monotonic_time ();
+}
+
+static void
+request_record_latency (Request *request)
+{
+  gint64 now = g_get_monotonic_time ();
+  g_autofree char *method = g_steal_pointer (&request->method);
+
+  if (method == NULL)
+    return;
+
+  if (request->impl_start_time != 0 && request->impl_done_time != 0)
+    {
+      latency_record (method, LATENCY_BACKEND,
+                      request->impl_done_time - request->impl_start_time);
+      latency_record (method, LATENCY_PORTAL,
+                      (request->impl_start_time - request->start_time) +
+                      (now - request->impl_done_time));
+    }
+  else
+    latency_record (method, LATENCY_PORTAL, now - request->start_time);
 }
 
 void
 request_unexport (Request *request)
 {
+  request_record_latency (request);
+
   request->exported = FALSE;
   g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (request));
   g_object_unref (request);
 }
 
+/* Makes closing the request also close it in the backend behind impl,
+ * or not if impl is NULL */
 void
-request_set_impl_request (Request *request,
-                          XdpImplRequest *impl_request)
+request_set_impl (Request    *request,
+                  GDBusProxy *impl)
 {
-  g_set_object (&request->impl_request, impl_request);
+  g_clear_object (&request->impl_connection);
+  g_clear_pointer (&request->impl_name, g_free);
+
+  if (impl)
+    {
+      request->impl_connection = g_object_ref (g_dbus_proxy_get_connection (impl));
+      request->impl_name = g_strdup (g_dbus_proxy_get_name (impl));
+    }
 }
 
 void
@@ -436,18 +716,16 @@ close_requests_in_thread_func (GTask        *task,
   const char *sender = (const char *)task_data;
   GSList *list = NULL;
   GSList *l;
-  GHashTableIter iter;
-  Request *request;
+  RequestSender *request_sender = NULL;
+  GList *link;
 
   G_LOCK (requests);
-  if (requests)
+  if (requests_by_sender)
+    request_sender = g_hash_table_lookup (requests_by_sender, sender);
+  if (request_sender)
     {
-      g_hash_table_iter_init (&iter, requests);
-      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&request))
-        {
-          if (strcmp (sender, request->sender) == 0)
-            list = g_slist_prepend (list, g_object_ref (request));
-        }
+      for (link = request_sender->requests.head; link; link = link->next)
+        list = g_slist_prepend (list, g_object_ref (link->data));
     }
   G_UNLOCK (requests);
 
@@ -459,8 +737,7 @@ close_requests_in_thread_func (GTask        *task,
 
       if (request->exported)
         {
-          if (request->impl_request)
-            xdp_impl_request_call_close_sync (request->impl_request, NULL, NULL);
+          request_close_impl (request, NULL);
 
           request_unexport (request);
         }
@@ -476,7 +753,7 @@ close_requests_for_sender (const char *sender)
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_strdup (sender), g_free);
-  g_task_run_in_thread (task, close_requests_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, close_requests_in_thread_func);
   g_object_unref (task);
 }
 
@@ -44,7 +44,19 @@ struct _Request
   GMutex mutex;
   XdpAppInfo *app_info;
 
-  XdpImplRequest *impl_request;
+  /* The backend's side of the request, at the same object path */
+  GDBusConnection *impl_connection;
+  char *impl_name;
+
+  /* In the requests_by_sender list, protected by the requests lock */
+  GList sender_link;
+  gsize accounted_bytes;
+
+  /* For the latency summary, only set when it is enabled */
+  char *method;
+  gint64 start_time;
+  gint64 impl_start_time;
+  gint64 impl_done_time;
 };
 
 struct _RequestClass
@@ -56,17 +68,20 @@ GType request_get_type (void) G_GNUC_CONST;
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (Request, g_object_unref)
 
-void request_init_invocation (GDBusMethodInvocation  *invocation, XdpAppInfo *app_info);
+gboolean request_init_invocation (GDBusMethodInvocation  *invocation,
+                                  XdpAppInfo             *app_info,
+                                  GError                **error);
+void request_set_max_per_sender (guint max_requests);
+void request_append_usage (GString *usage);
 Request *request_from_invocation (GDBusMethodInvocation *invocation);
 void request_export (Request *request,
                      GDBusConnection *connection);
 void request_unexport (Request *request);
 void close_requests_for_sender (const char *sender);
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpImplRequest, g_object_unref)
-
-void request_set_impl_request (Request *request,
-                               XdpImplRequest *impl_request);
+void request_set_impl (Request    *request,
+                       GDBusProxy *impl);
+void request_impl_done (Request *request);
 
 static inline void
 auto_unlock_helper (GMutex **mutex)
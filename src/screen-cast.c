@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <pipewire/pipewire.h>
 #include <gio/gunixfdlist.h>
 
@@ -54,6 +55,11 @@ static XdpImplScreenCast *impl;
 static int impl_version;
 static ScreenCast *screen_cast;
 
+/* The backend on the connection remote desktop sessions were created
+ * on, when that isn't ours, see remote_desktop_set_separate_connection() */
+static XdpImplScreenCast *session_impl;
+G_LOCK_DEFINE_STATIC (session_impl);
+
 static unsigned int available_cursor_modes = 0;
 
 GType screen_cast_get_type (void);
@@ -61,13 +67,6 @@ static void screen_cast_iface_init (XdpScreenCastIface *iface);
 
 static GQuark quark_request_session;
 
-struct _ScreenCastStream
-{
-  uint32_t id;
-  int32_t width;
-  int32_t height;
-};
-
 G_DEFINE_TYPE_WITH_CODE (ScreenCast, screen_cast, XDP_TYPE_SCREEN_CAST_SKELETON,
                          G_IMPLEMENT_INTERFACE (XDP_TYPE_SCREEN_CAST,
                                                 screen_cast_iface_init))
@@ -88,7 +87,8 @@ typedef struct _ScreenCastSession
 
   ScreenCastSessionState state;
 
-  GList *streams;
+  GArray *streams; /* ScreenCastStream */
+  GArray *stream_permissions;
 } ScreenCastSession;
 
 typedef struct _ScreenCastSessionClass
@@ -157,6 +157,8 @@ create_session_done (GObject *source_object,
 
   g_variant_builder_init (&results_builder, G_VARIANT_TYPE_VARDICT);
 
+  request_impl_done (request);
+
   if (!xdp_impl_screen_cast_call_create_session_finish (impl,
                                                         &response,
                                                         NULL,
@@ -213,26 +215,13 @@ handle_create_session (XdpScreenCast *object,
 {
   Request *request = request_from_invocation (invocation);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   Session *session;
   GVariantBuilder options_builder;
   GVariant *options;
 
   REQUEST_AUTOLOCK (request);
 
-  impl_request =
-    xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                     G_DBUS_PROXY_FLAGS_NONE,
-                                     g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                     request->id,
-                                     NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   session = (Session *)screen_cast_session_new (arg_options, request, &error);
@@ -264,6 +253,45 @@ handle_create_session (XdpScreenCast *object,
   return TRUE;
 }
 
+/* Calls about a session have to come from the connection that created
+ * it, or the backend won't know it */
+static XdpImplScreenCast *
+get_impl_for_session (Session *session)
+{
+  XdpImplScreenCast *session_proxy = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (session->impl_connection == g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)))
+    return g_object_ref (impl);
+
+  G_LOCK (session_impl);
+  if (session_impl != NULL &&
+      g_dbus_proxy_get_connection (G_DBUS_PROXY (session_impl)) != session->impl_connection)
+    g_clear_object (&session_impl);
+
+  if (session_impl == NULL)
+    {
+      session_impl = xdp_impl_screen_cast_proxy_new_sync (session->impl_connection,
+                                                          G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                                          G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                                          g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
+                                                          DESKTOP_PORTAL_OBJECT_PATH,
+                                                          NULL,
+                                                          &error);
+      if (session_impl)
+        g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (session_impl), G_MAXINT);
+      else
+        g_warning ("Failed to create screen cast proxy for session: %s", error->message);
+    }
+
+  if (session_impl)
+    session_proxy = g_object_ref (session_impl);
+  G_UNLOCK (session_impl);
+
+  /* The session is unknown to it, but the call then fails properly */
+  return session_proxy ? session_proxy : g_object_ref (impl);
+}
+
 static void
 select_sources_done (GObject *source_object,
                      GAsyncResult *res,
@@ -282,7 +310,9 @@ select_sources_done (GObject *source_object,
   SESSION_AUTOLOCK_UNREF (g_object_ref (session));
   g_object_set_qdata (G_OBJECT (request), quark_request_session, NULL);
 
-  if (!xdp_impl_screen_cast_call_select_sources_finish (impl,
+  request_impl_done (request);
+
+  if (!xdp_impl_screen_cast_call_select_sources_finish (XDP_IMPL_SCREEN_CAST (source_object),
                                                         &response,
                                                         &results,
                                                         res,
@@ -387,8 +417,8 @@ handle_select_sources (XdpScreenCast *object,
 {
   Request *request = request_from_invocation (invocation);
   Session *session;
+  g_autoptr(XdpImplScreenCast) session_proxy = NULL;
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder options_builder;
 
   REQUEST_AUTOLOCK (request);
@@ -458,19 +488,8 @@ handle_select_sources (XdpScreenCast *object,
       return TRUE;
     }
 
-  impl_request =
-    xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                     G_DBUS_PROXY_FLAGS_NONE,
-                                     g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                     request->id,
-                                     NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  session_proxy = get_impl_for_session (session);
+  request_set_impl (request, G_DBUS_PROXY (session_proxy));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
@@ -497,7 +516,7 @@ handle_select_sources (XdpScreenCast *object,
       remote_desktop_session_selecting_sources ((RemoteDesktopSession *)session);
     }
 
-  xdp_impl_screen_cast_call_select_sources (impl,
+  xdp_impl_screen_cast_call_select_sources (session_proxy,
                                             request->id,
                                             arg_session_handle,
                                             xdp_app_info_get_id (request->app_info),
@@ -511,50 +530,79 @@ handle_select_sources (XdpScreenCast *object,
   return TRUE;
 }
 
-uint32_t
-screen_cast_stream_get_pipewire_node_id (ScreenCastStream *stream)
-{
-  return stream->id;
-}
-
-static void
-append_stream_permissions (PipeWireRemote *remote,
-                           GArray *permission_items,
-                           GList *streams)
-{
-  GList *l;
-
-  for (l = streams; l; l = l->next)
-    {
-      ScreenCastStream *stream = l->data;
-      uint32_t stream_id;
-
-      stream_id = screen_cast_stream_get_pipewire_node_id (stream);
-      g_array_append_val (permission_items,
-                          PERMISSION_ITEM (stream_id, PW_PERM_RWX));
-    }
-}
+/* Index of the node factory in the permissions built by
+ * build_screen_cast_stream_permissions(). Its id is only known once
+ * connected, it is filled in then. */
+#define NODE_FACTORY_PERMISSION 1
 
 static PipeWireRemote *
 open_pipewire_screen_cast_remote (const char *app_id,
-                                  GList *streams,
+                                  GArray *stream_permissions,
                                   GError **error)
 {
   struct pw_properties *pipewire_properties;
   PipeWireRemote *remote;
-  g_autoptr(GArray) permission_items = NULL;
-  PipeWireGlobal *node_global;
+  g_autofree struct pw_permission *permission_items = NULL;
 
   pipewire_properties = pw_properties_new ("pipewire.access.portal.app_id", app_id,
                                            "pipewire.access.portal.media_roles", "",
                                            NULL);
-  remote = pipewire_remote_new_sync (pipewire_properties,
-                                     NULL, NULL, NULL, NULL,
-                                     error);
+  remote = pipewire_remote_new_client_sync (pipewire_properties, error);
   if (!remote)
-    return FALSE;
+    return NULL;
 
-  permission_items = g_array_new (FALSE, TRUE, sizeof (struct spa_dict_item));
+  permission_items = g_new (struct pw_permission, stream_permissions->len);
+  memcpy (permission_items, stream_permissions->data,
+          stream_permissions->len * sizeof (struct pw_permission));
+  permission_items[NODE_FACTORY_PERMISSION].id = remote->node_factory_id;
+
+  pipewire_remote_update_permissions (remote,
+                                      stream_permissions->len,
+                                      permission_items);
+
+  if (!pipewire_remote_roundtrip (remote, error))
+    {
+      pipewire_remote_destroy (remote);
+      return NULL;
+    }
+
+  return remote;
+}
+
+/* Replaces the contents of streams, so its storage is reused */
+void
+collect_screen_cast_stream_data (GVariantIter *streams_iter,
+                                 GArray       *streams)
+{
+  uint32_t stream_id;
+  GVariant *stream_options;
+
+  g_array_set_size (streams, 0);
+  while (g_variant_iter_next (streams_iter, "(u@a{sv})",
+                              &stream_id, &stream_options))
+    {
+      ScreenCastStream stream = { stream_id, 0, 0, 0, 0 };
+
+      g_variant_lookup (stream_options, "size", "(ii)",
+                        &stream.width, &stream.height);
+      g_variant_lookup (stream_options, "position", "(ii)",
+                        &stream.x, &stream.y);
+      g_variant_unref (stream_options);
+
+      g_array_append_val (streams, stream);
+    }
+}
+
+/* The permissions a client of the given streams gets, all apps
+ * re-opening a remote for the same session share them */
+GArray *
+build_screen_cast_stream_permissions (GArray *streams)
+{
+  GArray *permission_items;
+  guint i;
+
+  permission_items = g_array_sized_new (FALSE, TRUE, sizeof (struct pw_permission),
+                                        streams->len + 3);
 
   /*
    * PipeWire:Interface:Core
@@ -568,9 +616,15 @@ open_pipewire_screen_cast_remote (const char *app_id,
    * Needs r-- so it can be passed to create-object when creating the sink node.
    */
   g_array_append_val (permission_items,
-                      PERMISSION_ITEM (remote->node_factory_id, PW_PERM_R));
+                      PERMISSION_ITEM (PW_ID_ANY, PW_PERM_R));
+
+  for (i = 0; i < streams->len; i++)
+    {
+      ScreenCastStream *stream = &g_array_index (streams, ScreenCastStream, i);
 
-  append_stream_permissions (remote, permission_items, streams);
+      g_array_append_val (permission_items,
+                          PERMISSION_ITEM (stream->id, PW_PERM_RWX));
+    }
 
   /*
    * Hide all existing and future nodes (except the ones we explicitly list above).
@@ -578,51 +632,7 @@ open_pipewire_screen_cast_remote (const char *app_id,
   g_array_append_val (permission_items,
                       PERMISSION_ITEM (PW_ID_ANY, 0));
 
-  pw_client_update_permissions (pw_core_get_client(remote->core),
-                                permission_items->len,
-                                (const struct pw_permission *)permission_items->data);
-
-  pipewire_remote_roundtrip (remote);
-
-  return remote;
-}
-
-void
-screen_cast_stream_get_size (ScreenCastStream *stream,
-                             int32_t *width,
-                             int32_t *height)
-{
-  *width = stream->width;
-  *height = stream->height;
-}
-
-void
-screen_cast_stream_free (ScreenCastStream *stream)
-{
-  g_free (stream);
-}
-
-GList *
-collect_screen_cast_stream_data (GVariantIter *streams_iter)
-{
-  GList *streams = NULL;
-  uint32_t stream_id;
-  g_autoptr(GVariant) stream_options = NULL;
-
-  while (g_variant_iter_next (streams_iter, "(u@a{sv})",
-                              &stream_id, &stream_options))
-    {
-      ScreenCastStream *stream;
-
-      stream = g_new0 (ScreenCastStream, 1);
-      stream->id = stream_id;
-      g_variant_lookup (stream_options, "size", "(ii)",
-                        &stream->width, &stream->height);
-
-      streams = g_list_prepend (streams, stream);
-    }
-
-  return streams;
+  return permission_items;
 }
 
 static gboolean
@@ -638,7 +648,13 @@ process_results (ScreenCastSession *screen_cast_session,
       return FALSE;
     }
 
-  screen_cast_session->streams = collect_screen_cast_stream_data (streams_iter);
+  if (screen_cast_session->streams == NULL)
+    screen_cast_session->streams = g_array_new (FALSE, FALSE, sizeof (ScreenCastStream));
+  collect_screen_cast_stream_data (streams_iter, screen_cast_session->streams);
+
+  g_clear_pointer (&screen_cast_session->stream_permissions, g_array_unref);
+  screen_cast_session->stream_permissions =
+    build_screen_cast_stream_permissions (screen_cast_session->streams);
   return TRUE;
 }
 
@@ -661,7 +677,9 @@ start_done (GObject *source_object,
   SESSION_AUTOLOCK_UNREF (g_object_ref (session));
   g_object_set_qdata (G_OBJECT (request), quark_request_session, NULL);
 
-  if (!xdp_impl_screen_cast_call_start_finish (impl,
+  request_impl_done (request);
+
+  if (!xdp_impl_screen_cast_call_start_finish (XDP_IMPL_SCREEN_CAST (source_object),
                                                &response,
                                                &results,
                                                res,
@@ -721,8 +739,7 @@ handle_start (XdpScreenCast *object,
   Request *request = request_from_invocation (invocation);
   Session *session;
   ScreenCastSession *screen_cast_session;
-  g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
+  g_autoptr(XdpImplScreenCast) session_proxy = NULL;
   GVariantBuilder options_builder;
   GVariant *options;
 
@@ -770,19 +787,8 @@ handle_start (XdpScreenCast *object,
   g_object_set_data_full (G_OBJECT (request),
                           "window", g_strdup (arg_parent_window), g_free);
 
-  impl_request =
-    xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                     G_DBUS_PROXY_FLAGS_NONE,
-                                     g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                     request->id,
-                                     NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  session_proxy = get_impl_for_session (session);
+  request_set_impl (request, G_DBUS_PROXY (session_proxy));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&options_builder, G_VARIANT_TYPE_VARDICT);
@@ -794,7 +800,7 @@ handle_start (XdpScreenCast *object,
                            g_object_unref);
   screen_cast_session->state = SCREEN_CAST_SESSION_STATE_STARTING;
 
-  xdp_impl_screen_cast_call_start (impl,
+  xdp_impl_screen_cast_call_start (session_proxy,
                                    request->id,
                                    arg_session_handle,
                                    xdp_app_info_get_id (request->app_info),
@@ -809,6 +815,70 @@ handle_start (XdpScreenCast *object,
   return TRUE;
 }
 
+typedef struct
+{
+  GDBusMethodInvocation *invocation;
+  char *app_id;
+  GArray *stream_permissions;
+} OpenRemoteData;
+
+static void
+open_remote_data_free (OpenRemoteData *data)
+{
+  g_object_unref (data->invocation);
+  g_free (data->app_id);
+  g_array_unref (data->stream_permissions);
+  g_free (data);
+}
+
+/* Runs in a worker thread, so waiting for PipeWire doesn't hold up
+ * the bus */
+static void
+handle_open_pipewire_remote_in_thread_func (GTask *task,
+                                            gpointer source_object,
+                                            gpointer task_data,
+                                            GCancellable *cancellable)
+{
+  XdpScreenCast *object = source_object;
+  OpenRemoteData *data = task_data;
+  GDBusMethodInvocation *invocation = data->invocation;
+  PipeWireRemote *remote;
+  g_autoptr(GUnixFDList) out_fd_list = NULL;
+  int fd;
+  int fd_id;
+  g_autoptr(GError) error = NULL;
+
+  remote = open_pipewire_screen_cast_remote (data->app_id, data->stream_permissions, &error);
+  if (!remote)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED,
+                                             "%s", error->message);
+      return;
+    }
+
+  out_fd_list = g_unix_fd_list_new ();
+  fd = pipewire_remote_steal_fd (remote);
+  fd_id = g_unix_fd_list_append (out_fd_list, fd, &error);
+  close (fd);
+  pipewire_remote_destroy (remote);
+
+  if (fd_id == -1)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_DBUS_ERROR,
+                                             G_DBUS_ERROR_ACCESS_DENIED,
+                                             "Failed to append fd: %s",
+                                             error->message);
+      return;
+    }
+
+  xdp_screen_cast_complete_open_pipewire_remote (object, invocation,
+                                                 out_fd_list,
+                                                 g_variant_new_handle (fd_id));
+}
+
 static gboolean
 handle_open_pipewire_remote (XdpScreenCast *object,
                              GDBusMethodInvocation *invocation,
@@ -818,12 +888,9 @@ handle_open_pipewire_remote (XdpScreenCast *object,
 {
   Call *call = call_from_invocation (invocation);
   Session *session;
-  GList *streams;
-  PipeWireRemote *remote;
-  g_autoptr(GUnixFDList) out_fd_list = NULL;
-  int fd;
-  int fd_id;
-  g_autoptr(GError) error = NULL;
+  GArray *stream_permissions;
+  OpenRemoteData *data;
+  g_autoptr(GTask) task = NULL;
 
   session = acquire_session_from_call (arg_session_handle, call);
   if (!session)
@@ -841,14 +908,15 @@ handle_open_pipewire_remote (XdpScreenCast *object,
     {
       ScreenCastSession *screen_cast_session = (ScreenCastSession *)session;
 
-      streams = screen_cast_session->streams;
+      stream_permissions = screen_cast_session->stream_permissions;
     }
   else if (is_remote_desktop_session (session))
     {
       RemoteDesktopSession *remote_desktop_session =
         (RemoteDesktopSession *)session;
 
-      streams = remote_desktop_session_get_streams (remote_desktop_session);
+      stream_permissions =
+        remote_desktop_session_get_stream_permissions (remote_desktop_session);
     }
   else
     {
@@ -859,7 +927,7 @@ handle_open_pipewire_remote (XdpScreenCast *object,
       return TRUE;
     }
 
-  if (!streams)
+  if (!stream_permissions)
     {
       g_dbus_method_invocation_return_error (invocation,
                                              G_DBUS_ERROR,
@@ -868,35 +936,18 @@ handle_open_pipewire_remote (XdpScreenCast *object,
       return TRUE;
     }
 
-  remote = open_pipewire_screen_cast_remote (session->app_id, streams, &error);
-  if (!remote)
-    {
-      g_dbus_method_invocation_return_error (invocation,
-                                             G_DBUS_ERROR,
-                                             G_DBUS_ERROR_FAILED,
-                                             "%s", error->message);
-      return TRUE;
-    }
-
-  out_fd_list = g_unix_fd_list_new ();
-  fd = pw_core_steal_fd (remote->core);
-  fd_id = g_unix_fd_list_append (out_fd_list, fd, &error);
-  close (fd);
-  pipewire_remote_destroy (remote);
+  /* Take what's needed while holding the session lock, the remote is
+   * set up without it */
+  data = g_new0 (OpenRemoteData, 1);
+  data->invocation = g_object_ref (invocation);
+  data->app_id = g_strdup (session->app_id);
+  data->stream_permissions = g_array_ref (stream_permissions);
 
-  if (fd_id == -1)
-    {
-      g_dbus_method_invocation_return_error (invocation,
-                                             G_DBUS_ERROR,
-                                             G_DBUS_ERROR_ACCESS_DENIED,
-                                             "Failed to append fd: %s",
-                                             error->message);
-      return TRUE;
-    }
+  task = g_task_new (object, NULL, NULL, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify) open_remote_data_free);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG,
+                        handle_open_pipewire_remote_in_thread_func);
 
-  xdp_screen_cast_complete_open_pipewire_remote (object, invocation,
-                                                 out_fd_list,
-                                                 g_variant_new_handle (fd_id));
   return TRUE;
 }
 
@@ -1011,8 +1062,8 @@ screen_cast_session_finalize (GObject *object)
 {
   ScreenCastSession *screen_cast_session = (ScreenCastSession *)object;
 
-  g_list_free_full (screen_cast_session->streams,
-                    (GDestroyNotify)screen_cast_stream_free);
+  g_clear_pointer (&screen_cast_session->streams, g_array_unref);
+  g_clear_pointer (&screen_cast_session->stream_permissions, g_array_unref);
 
   G_OBJECT_CLASS (screen_cast_session_parent_class)->finalize (object);
 }
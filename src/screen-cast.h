@@ -21,21 +21,21 @@
 #include <gio/gio.h>
 #include <stdint.h>
 
-typedef struct _ScreenCastStream ScreenCastStream;
-
-uint32_t screen_cast_stream_get_pipewire_node_id (ScreenCastStream *stream);
-
-void screen_cast_stream_get_size (ScreenCastStream *stream,
-                                  int32_t *width,
-                                  int32_t *height);
-
-void screen_cast_stream_free (ScreenCastStream *stream);
-
-void screen_cast_stream_get_size (ScreenCastStream *stream,
-                                  int32_t *width,
-                                  int32_t *height);
-
-GList * collect_screen_cast_stream_data (GVariantIter *streams_iter);
+/* Streams are kept by value in a GArray, in the order the backend
+ * listed them */
+typedef struct _ScreenCastStream
+{
+  uint32_t id; /* PipeWire node id */
+  int32_t width;
+  int32_t height;
+  int32_t x;
+  int32_t y;
+} ScreenCastStream;
+
+void collect_screen_cast_stream_data (GVariantIter *streams_iter,
+                                      GArray       *streams);
+
+GArray * build_screen_cast_stream_permissions (GArray *streams);
 
 GDBusInterfaceSkeleton * screen_cast_create (GDBusConnection *connection,
                                              const char      *dbus_name);
@@ -26,7 +26,10 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
@@ -60,6 +63,153 @@ static void screenshot_iface_init (XdpScreenshotIface *iface);
 G_DEFINE_TYPE_WITH_CODE (Screenshot, screenshot, XDP_TYPE_SCREENSHOT_SKELETON,
                          G_IMPLEMENT_INTERFACE (XDP_TYPE_SCREENSHOT, screenshot_iface_init));
 
+/* Images waiting for RetrieveImage, by request handle */
+#define PENDING_IMAGE_TIMEOUT_SEC 60
+
+typedef struct
+{
+  char *handle;
+  char *sender;
+  int fd;
+  guint timeout_id;
+} PendingImage;
+
+G_LOCK_DEFINE_STATIC (pending_images);
+static GHashTable *pending_images;
+
+/* timeout_id is only set while the source is alive, and is changed
+ * and removed with the lock held */
+static void
+pending_image_free (PendingImage *image)
+{
+  if (image->timeout_id)
+    g_source_remove (image->timeout_id);
+  close (image->fd);
+  g_free (image->handle);
+  g_free (image->sender);
+  g_free (image);
+}
+
+/* Looked up by handle, the image may have been retrieved or replaced
+ * meanwhile */
+static gboolean
+pending_image_expired (gpointer data)
+{
+  const char *handle = data;
+  guint source_id = g_source_get_id (g_main_current_source ());
+  PendingImage *image;
+
+  G_LOCK (pending_images);
+  image = g_hash_table_lookup (pending_images, handle);
+  if (image && image->timeout_id == source_id)
+    {
+      g_debug ("Dropping screenshot %s, it wasn't retrieved", handle);
+      image->timeout_id = 0;
+      g_hash_table_remove (pending_images, handle);
+    }
+  G_UNLOCK (pending_images);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+add_pending_image (Request *request,
+                   int fd)
+{
+  PendingImage *image;
+
+  image = g_new0 (PendingImage, 1);
+  image->handle = g_strdup (request->id);
+  image->sender = g_strdup (request->sender);
+  image->fd = fd;
+
+  G_LOCK (pending_images);
+  image->timeout_id = g_timeout_add_seconds_full (G_PRIORITY_DEFAULT,
+                                                  PENDING_IMAGE_TIMEOUT_SEC,
+                                                  pending_image_expired,
+                                                  g_strdup (request->id),
+                                                  g_free);
+  g_hash_table_replace (pending_images, image->handle, image);
+  G_UNLOCK (pending_images);
+}
+
+/* Copies the screenshot the backend saved into a sealed memfd, so apps
+ * that only want the image don't need a document for it */
+static int
+create_screenshot_memfd (const char *path,
+                         GError **error)
+{
+  struct stat st;
+  const char *what;
+  off_t offset = 0;
+  int errsv;
+  int in_fd;
+  int fd = -1;
+
+  in_fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (in_fd == -1)
+    {
+      what = "open";
+      goto fail;
+    }
+
+  if (fstat (in_fd, &st) == -1)
+    {
+      what = "fstat";
+      goto fail;
+    }
+
+  fd = memfd_create ("screenshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    {
+      what = "memfd_create";
+      goto fail;
+    }
+
+  while (offset < st.st_size)
+    {
+      ssize_t res = sendfile (fd, in_fd, &offset, st.st_size - offset);
+
+      if (res < 0 && errno == EINTR)
+        continue;
+
+      if (res < 0)
+        {
+          what = "sendfile";
+          goto fail;
+        }
+
+      if (res == 0)
+        break;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+      what = "fcntl";
+      goto fail;
+    }
+
+  if (lseek (fd, 0, SEEK_SET) == -1)
+    {
+      what = "lseek";
+      goto fail;
+    }
+
+  close (in_fd);
+
+  return fd;
+
+fail:
+  errsv = errno;
+  if (in_fd != -1)
+    close (in_fd);
+  if (fd != -1)
+    close (fd);
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+               "%s: %s", what, g_strerror (errsv));
+  return -1;
+}
+
 static void
 send_response_in_thread_func (GTask *task,
                               gpointer source_object,
@@ -95,6 +245,28 @@ send_response_in_thread_func (GTask *task,
           goto out;
         }
 
+      if (g_object_get_data (G_OBJECT (request), "memfd"))
+        {
+          g_autofree char *path = g_filename_from_uri (uri, NULL, NULL);
+          int fd = -1;
+
+          if (path != NULL)
+            fd = create_screenshot_memfd (path, &error);
+
+          /* Fds can't go in a signal to a name, the app fetches it
+           * with RetrieveImage once it got the response */
+          if (fd != -1)
+            {
+              add_pending_image (request, fd);
+              g_variant_builder_add (&results, "{&sv}", "memfd", g_variant_new_boolean (TRUE));
+              goto out;
+            }
+
+          if (error)
+            g_debug ("Can't return %s as memfd: %s", uri, error->message);
+          g_clear_error (&error);
+        }
+
       ruri = register_document (uri, xdp_app_info_get_id (request->app_info), FALSE, FALSE, &error);
       if (ruri == NULL)
         g_warning ("Failed to register %s: %s", uri, error->message);
@@ -139,6 +311,8 @@ screenshot_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_screenshot_call_screenshot_finish (XDP_IMPL_SCREENSHOT (source),
                                                    &response,
                                                    &options,
@@ -155,7 +329,7 @@ screenshot_done (GObject *source,
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
   g_object_set_data (G_OBJECT (task), "retval", "url");
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static XdpOptionKey screenshot_options[] = {
@@ -170,26 +344,17 @@ handle_screenshot (XdpScreenshot *object,
                    GVariant *arg_options)
 {
   Request *request = request_from_invocation (invocation);
-  g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder opt_builder;
+  gboolean memfd = FALSE;
 
   REQUEST_AUTOLOCK (request);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
+  if (g_variant_lookup (arg_options, "memfd", "b", &memfd) && memfd)
+    g_object_set_data (G_OBJECT (request), "memfd", GINT_TO_POINTER (TRUE));
+
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
   xdp_filter_options (arg_options, &opt_builder,
                       screenshot_options, G_N_ELEMENTS (screenshot_options),
@@ -220,6 +385,8 @@ pick_color_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_screenshot_call_pick_color_finish (XDP_IMPL_SCREENSHOT (source),
                                                    &response,
                                                    &options,
@@ -236,7 +403,7 @@ pick_color_done (GObject *source,
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
   g_object_set_data (G_OBJECT (task), "retval", "color");
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static XdpOptionKey pick_color_options[] = {
@@ -249,24 +416,11 @@ handle_pick_color (XdpScreenshot *object,
                    GVariant *arg_options)
 {
   Request *request = request_from_invocation (invocation);
-  g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder opt_builder;
 
   REQUEST_AUTOLOCK (request);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
@@ -288,17 +442,74 @@ handle_pick_color (XdpScreenshot *object,
   return TRUE;
 }
 
+static gboolean
+handle_retrieve_image (XdpScreenshot *object,
+                       GDBusMethodInvocation *invocation,
+                       GUnixFDList *in_fd_list,
+                       const char *arg_handle,
+                       GVariant *arg_options)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+  g_autoptr(GUnixFDList) out_fd_list = NULL;
+  g_autoptr(GError) error = NULL;
+  PendingImage *image = NULL;
+  gpointer key;
+  int fd_id;
+
+  G_LOCK (pending_images);
+  if (g_hash_table_lookup_extended (pending_images, arg_handle, &key, (gpointer *) &image) &&
+      g_strcmp0 (image->sender, sender) == 0)
+    {
+      g_hash_table_steal (pending_images, key);
+      /* While the lock keeps the timeout from finishing */
+      g_source_remove (image->timeout_id);
+      image->timeout_id = 0;
+    }
+  else
+    image = NULL;
+  G_UNLOCK (pending_images);
+
+  if (image == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR,
+                                             XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                                             "No image for %s", arg_handle);
+      return TRUE;
+    }
+
+  out_fd_list = g_unix_fd_list_new ();
+  fd_id = g_unix_fd_list_append (out_fd_list, image->fd, &error);
+  pending_image_free (image);
+
+  if (fd_id == -1)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  xdp_screenshot_complete_retrieve_image (object, invocation,
+                                          out_fd_list,
+                                          g_variant_new_handle (fd_id));
+
+  return TRUE;
+}
+
 static void
 screenshot_iface_init (XdpScreenshotIface *iface)
 {
   iface->handle_screenshot = handle_screenshot;
   iface->handle_pick_color = handle_pick_color;
+  iface->handle_retrieve_image = handle_retrieve_image;
 }
 
 static void
 screenshot_init (Screenshot *fc)
 {
-  xdp_screenshot_set_version (XDP_SCREENSHOT (fc), 2);
+  pending_images = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, (GDestroyNotify) pending_image_free);
+
+  xdp_screenshot_set_version (XDP_SCREENSHOT (fc), 3);
 }
 
 static void
@@ -100,6 +100,8 @@ retrieve_secret_done (GObject *source,
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
 
+  request_impl_done (request);
+
   if (!xdp_impl_secret_call_retrieve_secret_finish (XDP_IMPL_SECRET (source),
 						    &response,
 						    &results,
@@ -114,7 +116,7 @@ retrieve_secret_done (GObject *source,
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, send_response_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_INTERACTIVE, send_response_in_thread_func);
 }
 
 static gboolean
@@ -127,22 +129,10 @@ handle_retrieve_secret (XdpSecret *object,
   Request *request = request_from_invocation (invocation);
   const char *app_id = xdp_app_info_get_id (request->app_info);
   g_autoptr(GError) error = NULL;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
   GVariantBuilder options;
 
   REQUEST_AUTOLOCK (request);
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  if (!impl_request)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
   g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
 
   if (!xdp_filter_options (arg_options, &options,
@@ -153,7 +143,7 @@ handle_retrieve_secret (XdpSecret *object,
       return TRUE;
     }
 
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
 
   xdp_secret_complete_retrieve_secret (object, invocation, NULL, request->id);
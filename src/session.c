@@ -38,8 +38,15 @@ enum
 
 static GParamSpec *obj_props[PROP_LAST];
 
-G_LOCK_DEFINE (sessions);
+/* Looking up sessions happens on every session method call, including
+ * the high-rate remote desktop events, so lookups only take the lock
+ * for reading and don't serialize each other */
+static GRWLock sessions_lock;
 static GHashTable *sessions;
+static GHashTable *sessions_by_sender; /* sender -> GQueue of Session */
+
+/* 0 means unlimited */
+static guint max_sessions_per_sender;
 
 static void g_initable_iface_init (GInitableIface *iface);
 static void session_skeleton_iface_init (XdpSessionIface *iface);
@@ -69,11 +76,11 @@ acquire_session (const char *session_handle,
 {
   g_autoptr(Session) session = NULL;
 
-  G_LOCK (sessions);
+  g_rw_lock_reader_lock (&sessions_lock);
   session = g_hash_table_lookup (sessions, session_handle);
   if (session)
     g_object_ref (session);
-  G_UNLOCK (sessions);
+  g_rw_lock_reader_unlock (&sessions_lock);
 
   if (!session)
     return NULL;
@@ -93,11 +100,11 @@ acquire_session_from_call (const char *session_handle,
 {
   g_autoptr(Session) session = NULL;
 
-  G_LOCK (sessions);
+  g_rw_lock_reader_lock (&sessions_lock);
   session = g_hash_table_lookup (sessions, session_handle);
   if (session)
     g_object_ref (session);
-  G_UNLOCK (sessions);
+  g_rw_lock_reader_unlock (&sessions_lock);
 
   if (!session)
     return NULL;
@@ -116,11 +123,11 @@ lookup_session (const char *session_handle)
 {
   g_autoptr(Session) session = NULL;
 
-  G_LOCK (sessions);
+  g_rw_lock_reader_lock (&sessions_lock);
   session = g_hash_table_lookup (sessions, session_handle);
   if (session)
     g_object_ref (session);
-  G_UNLOCK (sessions);
+  g_rw_lock_reader_unlock (&sessions_lock);
 
   return g_steal_pointer (&session);
 }
@@ -152,17 +159,56 @@ session_unexport (Session *session)
 void
 session_register (Session *session)
 {
-  G_LOCK (sessions);
+  GQueue *queue;
+
+  g_rw_lock_writer_lock (&sessions_lock);
   g_hash_table_insert (sessions, session->id, session);
-  G_UNLOCK (sessions);
+
+  if (session->sender_link.data == NULL)
+    {
+      queue = g_hash_table_lookup (sessions_by_sender, session->sender);
+      if (queue == NULL)
+        {
+          queue = g_queue_new ();
+          g_hash_table_insert (sessions_by_sender, g_strdup (session->sender), queue);
+        }
+
+      session->sender_link.data = session;
+      g_queue_push_tail_link (queue, &session->sender_link);
+    }
+  g_rw_lock_writer_unlock (&sessions_lock);
 }
 
 static void
 session_unregister (Session *session)
 {
-  G_LOCK (sessions);
+  GQueue *queue;
+
+  g_rw_lock_writer_lock (&sessions_lock);
   g_hash_table_remove (sessions, session->id);
-  G_UNLOCK (sessions);
+
+  if (session->sender_link.data != NULL)
+    {
+      queue = g_hash_table_lookup (sessions_by_sender, session->sender);
+      g_queue_unlink (queue, &session->sender_link);
+      session->sender_link.data = NULL;
+      if (g_queue_is_empty (queue))
+        g_hash_table_remove (sessions_by_sender, session->sender);
+    }
+  g_rw_lock_writer_unlock (&sessions_lock);
+}
+
+static void
+impl_session_close_done (GObject *source_object,
+                         GAsyncResult *result,
+                         gpointer data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!xdp_impl_session_call_close_finish (XDP_IMPL_SESSION (source_object),
+                                           result, &error))
+    g_warning ("Failed to close session implementation: %s",
+               error->message);
 }
 
 void
@@ -181,12 +227,12 @@ session_close (Session *session,
 
   if (session->impl_session)
     {
-      g_autoptr(GError) error = NULL;
-
-      if (!xdp_impl_session_call_close_sync (session->impl_session,
-                                             NULL, &error))
-        g_warning ("Failed to close session implementation: %s",
-                   error->message);
+      /* Don't wait for the backend, so closing all sessions of a peer
+       * doesn't serialize on it. The call holds its own ref to the proxy. */
+      xdp_impl_session_call_close (session->impl_session,
+                                   NULL,
+                                   impl_session_close_done,
+                                   NULL);
 
       g_clear_object (&session->impl_session);
     }
@@ -235,20 +281,18 @@ close_sessions_in_thread_func (GTask *task,
   const char *sender = (const char *)task_data;
   GSList *list = NULL;
   GSList *l;
-  GHashTableIter iter;
-  Session *session;
+  GQueue *queue = NULL;
+  GList *link;
 
-  G_LOCK (sessions);
-  if (sessions)
+  g_rw_lock_reader_lock (&sessions_lock);
+  if (sessions_by_sender)
+    queue = g_hash_table_lookup (sessions_by_sender, sender);
+  if (queue)
     {
-      g_hash_table_iter_init (&iter, sessions);
-      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&session))
-        {
-          if (strcmp (sender, session->sender) == 0)
-            list = g_slist_prepend (list, g_object_ref (session));
-        }
+      for (link = queue->head; link; link = link->next)
+        list = g_slist_prepend (list, g_object_ref (link->data));
     }
-  G_UNLOCK (sessions);
+  g_rw_lock_reader_unlock (&sessions_lock);
 
   for (l = list; l; l = l->next)
     {
@@ -268,7 +312,7 @@ close_sessions_for_sender (const char *sender)
 
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_task_set_task_data (task, g_strdup (sender), g_free);
-  g_task_run_in_thread (task, close_sessions_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, close_sessions_in_thread_func);
 }
 
 static void
@@ -302,23 +346,73 @@ session_authorize_callback (GDBusInterfaceSkeleton *interface,
   return TRUE;
 }
 
+void
+session_set_max_per_sender (guint max_sessions)
+{
+  max_sessions_per_sender = max_sessions;
+}
+
+/* Appends a line for each sender with open sessions */
+void
+session_append_usage (GString *usage)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_rw_lock_reader_lock (&sessions_lock);
+  if (sessions_by_sender == NULL)
+    {
+      g_rw_lock_reader_unlock (&sessions_lock);
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, sessions_by_sender);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_string_append_printf (usage, "%s: %u sessions\n",
+                            (const char *) key, g_queue_get_length (value));
+  g_rw_lock_reader_unlock (&sessions_lock);
+}
+
+static gboolean
+check_session_limit (const char  *sender,
+                     GError     **error)
+{
+  GQueue *queue;
+  guint n_sessions = 0;
+
+  if (max_sessions_per_sender == 0)
+    return TRUE;
+
+  g_rw_lock_reader_lock (&sessions_lock);
+  queue = g_hash_table_lookup (sessions_by_sender, sender);
+  if (queue)
+    n_sessions = g_queue_get_length (queue);
+  g_rw_lock_reader_unlock (&sessions_lock);
+
+  if (n_sessions < max_sessions_per_sender)
+    return TRUE;
+
+  g_warning ("%s has %u open sessions, refusing more", sender, n_sessions);
+  g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+               "Too many open sessions");
+  return FALSE;
+}
+
 static gboolean
 session_initable_init (GInitable *initable,
                        GCancellable *cancellable,
                        GError **error)
 {
   Session *session = (Session *)initable;
-  g_autofree char *sender_escaped = NULL;
+  char sender_escaped[256];
   g_autofree char *id = NULL;
   g_autoptr(XdpImplSession) impl_session = NULL;
   int i;
 
-  sender_escaped = g_strdup (session->sender + 1);
-  for (i = 0; sender_escaped[i]; i++)
-    {
-      if (sender_escaped[i] == '.')
-        sender_escaped[i] = '_';
-    }
+  /* Bus names are at most 255 bytes, so this never truncates */
+  for (i = 0; session->sender[i + 1] && i < (int) sizeof (sender_escaped) - 1; i++)
+    sender_escaped[i] = session->sender[i + 1] == '.' ? '_' : session->sender[i + 1];
+  sender_escaped[i] = '\0';
 
   if (!session->token)
     {
@@ -326,6 +420,9 @@ session_initable_init (GInitable *initable,
       return FALSE;
     }
 
+  if (!check_session_limit (session->sender, error))
+    return FALSE;
+
   id = g_strdup_printf ("/org/freedesktop/portal/desktop/session/%s/%s",
                         sender_escaped, session->token);
 
@@ -467,6 +564,41 @@ session_init (Session *session)
   g_mutex_init (&session->mutex);
 }
 
+static gsize
+strsize (const char *str)
+{
+  return str ? strlen (str) + 1 : 0;
+}
+
+static void
+session_memory_usage (GArray *usage)
+{
+  GHashTableIter iter;
+  gpointer value;
+  guint64 objects = 0;
+  guint64 bytes = 0;
+
+  g_rw_lock_reader_lock (&sessions_lock);
+  g_hash_table_iter_init (&iter, sessions);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Session *session = value;
+      GTypeQuery query;
+
+      /* Sessions of each portal subclass Session */
+      g_type_query (G_TYPE_FROM_INSTANCE (session), &query);
+
+      objects++;
+      bytes += query.instance_size +
+               strsize (session->app_id) + strsize (session->id) +
+               strsize (session->token) + strsize (session->sender) +
+               strsize (session->impl_dbus_name);
+    }
+  g_rw_lock_reader_unlock (&sessions_lock);
+
+  xdp_memory_usage_add (usage, "sessions", objects, bytes);
+}
+
 static void
 session_class_init (SessionClass *klass)
 {
@@ -474,6 +606,9 @@ session_class_init (SessionClass *klass)
 
   sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
                                     NULL, NULL);
+  sessions_by_sender = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify) g_queue_free);
+  xdp_add_memory_usage_func (session_memory_usage);
 
   gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->finalize = session_finalize;
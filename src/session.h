@@ -45,6 +45,10 @@ struct _Session
   char *impl_dbus_name;
   GDBusConnection *impl_connection;
   XdpImplSession *impl_session;
+
+  /* In the sessions_by_sender list while registered, protected by the
+   * sessions lock */
+  GList sender_link;
 };
 
 struct _SessionClass
@@ -76,6 +80,9 @@ gboolean session_export (Session *session,
 
 void close_sessions_for_sender (const char *sender);
 
+void session_set_max_per_sender (guint max_sessions);
+void session_append_usage (GString *usage);
+
 void session_close (Session *session,
                     gboolean notify_close);
 
@@ -22,8 +22,13 @@
 
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 
 #include "settings.h"
 #include "xdp-dbus.h"
@@ -37,6 +42,9 @@ typedef struct _SettingsClass SettingsClass;
 struct _Settings
 {
   XdpSettingsSkeleton parent_instance;
+
+  GHashTable *pending_changes; /* namespace -> (key -> GVariant) */
+  guint pending_changes_id;
 };
 
 struct _SettingsClass
@@ -47,83 +55,750 @@ struct _SettingsClass
 static XdpImplSettings **impls;
 static int n_impls;
 
+/* Everything the backends know is cached here, filled on the first
+ * ReadAll() or Read() and kept up to date through SettingChanged.
+ * A backend emits SettingChanged before replying to any call that
+ * comes after the change, so a ReadAll() snapshot plus the signals
+ * received after it is always current. A backend that restarts loses
+ * that, so its cache is dropped whenever its name owner changes.
+ */
+typedef enum {
+  CACHE_COLD,
+  CACHE_LOADING,
+  CACHE_LOADED,
+} CacheState;
+
+typedef struct {
+  CacheState state;
+  gboolean stale; /* The backend was restarted while loading */
+  GHashTable *namespaces; /* namespace -> (key -> GVariant) */
+} ImplCache;
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  char **namespaces; /* ReadAll() */
+  char *namespace;   /* Read() */
+  char *key;
+  GVariant *value;
+  gboolean shared;   /* ReadAllShared() */
+  int fd;
+  guint64 generation;
+  GError *error;
+} PendingRead;
+
+/* The backends merged into one index. The first backend with a
+ * namespace owns it, and for each key the first backend with it wins,
+ * the way Read() has always walked the backends in order.
+ */
+typedef struct {
+  int owner;
+  GHashTable *keys; /* key -> GVariant */
+} MergedNamespace;
+
+/* Changes for SettingsChanged are held this long to collect a burst */
+#define SETTINGS_CHANGED_DELAY_MS 50
+
+static ImplCache *caches;
+static GHashTable *merged; /* namespace -> MergedNamespace */
+static GQueue pending_reads = G_QUEUE_INIT;
+static int n_loading;
+
+/* ReadAllShared() hands every client the same sealed memfd, made on
+ * the first call after a change. The generation is bumped whenever the
+ * merged settings change. */
+static guint64 generation = 1;
+static int snapshot_fd = -1;
+G_LOCK_DEFINE_STATIC (cache);
+
+/* Clients that asked for their changes to be sent to them directly,
+ * see Subscribe() */
+static GDBusConnection *subscribers_connection;
+static GHashTable *subscribers; /* unique name -> namespace patterns */
+G_LOCK_DEFINE_STATIC (subscribers);
+
 GType settings_get_type (void) G_GNUC_CONST;
 static void settings_iface_init (XdpSettingsIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (Settings, settings, XDP_TYPE_SETTINGS_SKELETON,
                          G_IMPLEMENT_INTERFACE (XDP_TYPE_SETTINGS, settings_iface_init));
 
+static PendingRead *
+pending_read_new (GDBusMethodInvocation *invocation)
+{
+  PendingRead *pending = g_new0 (PendingRead, 1);
+
+  pending->invocation = g_object_ref (invocation);
+  pending->fd = -1;
+
+  return pending;
+}
+
+static void
+pending_read_free (PendingRead *pending)
+{
+  g_object_unref (pending->invocation);
+  g_strfreev (pending->namespaces);
+  g_free (pending->namespace);
+  g_free (pending->key);
+  g_clear_pointer (&pending->value, g_variant_unref);
+  g_clear_error (&pending->error);
+  if (pending->fd != -1)
+    close (pending->fd);
+  g_free (pending);
+}
+
+static GHashTable *
+new_keys_table (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                g_free, (GDestroyNotify)g_variant_unref);
+}
+
+static GHashTable *
+ensure_namespace (GHashTable *namespaces,
+                  const char *namespace)
+{
+  GHashTable *keys;
+
+  keys = g_hash_table_lookup (namespaces, namespace);
+  if (keys == NULL)
+    {
+      keys = new_keys_table ();
+      g_hash_table_insert (namespaces, g_strdup (namespace), keys);
+    }
+
+  return keys;
+}
+
+static void
+merged_namespace_free (MergedNamespace *ns)
+{
+  g_hash_table_unref (ns->keys);
+  g_free (ns);
+}
+
+/* Called with the cache lock held */
+static MergedNamespace *
+ensure_merged_namespace (const char *namespace,
+                         int         owner)
+{
+  MergedNamespace *ns;
+
+  ns = g_hash_table_lookup (merged, namespace);
+  if (ns == NULL)
+    {
+      ns = g_new0 (MergedNamespace, 1);
+      ns->owner = owner;
+      ns->keys = new_keys_table ();
+      g_hash_table_insert (merged, g_strdup (namespace), ns);
+    }
+  else if (owner < ns->owner)
+    {
+      ns->owner = owner;
+    }
+
+  return ns;
+}
+
+/* Called with the cache lock held */
+static void
+settings_changed_locked (void)
+{
+  generation++;
+  if (snapshot_fd != -1)
+    {
+      close (snapshot_fd);
+      snapshot_fd = -1;
+    }
+}
+
+/* Called with the cache lock held */
+static void
+rebuild_merged (void)
+{
+  int i;
+
+  settings_changed_locked ();
+  g_hash_table_remove_all (merged);
+
+  for (i = 0; i < n_impls; i++)
+    {
+      GHashTableIter iter;
+      const char *namespace;
+      GHashTable *keys;
+
+      if (caches[i].state != CACHE_LOADED)
+        continue;
+
+      g_hash_table_iter_init (&iter, caches[i].namespaces);
+      while (g_hash_table_iter_next (&iter, (gpointer *)&namespace, (gpointer *)&keys))
+        {
+          MergedNamespace *ns = ensure_merged_namespace (namespace, i);
+          GHashTableIter key_iter;
+          const char *key;
+          GVariant *value;
+
+          g_hash_table_iter_init (&key_iter, keys);
+          while (g_hash_table_iter_next (&key_iter, (gpointer *)&key, (gpointer *)&value))
+            {
+              if (!g_hash_table_contains (ns->keys, key))
+                g_hash_table_insert (ns->keys, g_strdup (key), g_variant_ref (value));
+            }
+        }
+    }
+}
+
+/* Called with the cache lock held */
+static void
+update_merged (int         index,
+               const char *namespace,
+               const char *key,
+               GVariant   *value)
+{
+  MergedNamespace *ns = ensure_merged_namespace (namespace, index);
+  int i;
+
+  /* Only backends before the owner could shadow this one */
+  for (i = ns->owner; i < index; i++)
+    {
+      GHashTable *keys;
+
+      if (caches[i].state != CACHE_LOADED)
+        continue;
+
+      keys = g_hash_table_lookup (caches[i].namespaces, namespace);
+      if (keys && g_hash_table_contains (keys, key))
+        return;
+    }
+
+  settings_changed_locked ();
+  g_hash_table_insert (ns->keys, g_strdup (key), g_variant_ref (value));
+}
+
 static gboolean
-settings_handle_read_all (XdpSettings           *object,
-                          GDBusMethodInvocation *invocation,
-                          const char    * const *arg_namespaces)
+namespace_matches (const char         *namespace,
+                   const char * const *patterns)
+{
+  size_t i;
+
+  if (patterns == NULL || patterns[0] == NULL)
+    return TRUE;
+
+  for (i = 0; patterns[i]; i++)
+    {
+      const char *pattern = patterns[i];
+      size_t len = strlen (pattern);
+
+      if (len == 0)
+        return TRUE;
+
+      if (pattern[len - 1] == '*')
+        {
+          if (strncmp (namespace, pattern, len - 1) == 0)
+            return TRUE;
+        }
+      else if (strcmp (namespace, pattern) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Called with the cache lock held */
+static GVariant *
+build_read_all_reply (const char * const *namespaces)
 {
   g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("(a{sa{sv}})"));
-  int j;
+  GHashTableIter iter;
+  const char *namespace;
+  MergedNamespace *ns;
 
   g_variant_builder_open (builder, G_VARIANT_TYPE ("a{sa{sv}}"));
 
-  for (j = 0; j < n_impls; j++)
+  g_hash_table_iter_init (&iter, merged);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&namespace, (gpointer *)&ns))
     {
-      g_autoptr(GError) error = NULL;
-      g_autoptr(GVariant) impl_value = NULL;
+      GHashTableIter key_iter;
+      const char *key;
+      GVariant *value;
+
+      if (!namespace_matches (namespace, namespaces))
+        continue;
+
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("{sa{sv}}"));
+      g_variant_builder_add (builder, "s", namespace);
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("a{sv}"));
+
+      g_hash_table_iter_init (&key_iter, ns->keys);
+      while (g_hash_table_iter_next (&key_iter, (gpointer *)&key, (gpointer *)&value))
+        g_variant_builder_add (builder, "{sv}", key, value);
+
+      g_variant_builder_close (builder);
+      g_variant_builder_close (builder);
+    }
+
+  g_variant_builder_close (builder);
+
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+/* Called with the cache lock held */
+static GVariant *
+lookup_cached (const char *namespace,
+               const char *key)
+{
+  MergedNamespace *ns;
+  GVariant *value;
+
+  ns = g_hash_table_lookup (merged, namespace);
+  if (ns == NULL)
+    return NULL;
+
+  value = g_hash_table_lookup (ns->keys, key);
+  if (value == NULL)
+    return NULL;
+
+  return g_variant_ref (value);
+}
 
-      if (!xdp_impl_settings_call_read_all_sync (impls[j], arg_namespaces, &impl_value, NULL, &error))
+static int
+create_snapshot_memfd (GVariant  *settings,
+                       GError   **error)
+{
+  g_autoptr(GVariant) normal = NULL;
+  const guint8 *data;
+  gsize len;
+  const char *what;
+  int errsv;
+  int fd;
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    normal = g_variant_byteswap (settings);
+  else
+    normal = g_variant_get_normal_form (settings);
+
+  fd = memfd_create ("settings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    {
+      what = "memfd_create";
+      goto fail;
+    }
+
+  data = g_variant_get_data (normal);
+  len = g_variant_get_size (normal);
+  while (len > 0)
+    {
+      ssize_t res = write (fd, data, len);
+
+      if (res < 0 && errno == EINTR)
+        continue;
+
+      if (res < 0)
         {
-          g_warning ("Failed to ReadAll() from Settings implementation: %s", error->message);
+          what = "write";
+          goto fail;
         }
-      else
+
+      data += res;
+      len -= res;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+      what = "fcntl";
+      goto fail;
+    }
+
+  return fd;
+
+fail:
+  errsv = errno;
+  if (fd != -1)
+    close (fd);
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+               "%s: %s", what, g_strerror (errsv));
+  return -1;
+}
+
+/* Called with the cache lock held */
+static void
+resolve_shared_read (PendingRead *pending)
+{
+  g_autofree char *proc_path = NULL;
+
+  if (snapshot_fd == -1)
+    {
+      g_autoptr(GVariant) reply = build_read_all_reply (NULL);
+      g_autoptr(GVariant) settings = g_variant_get_child_value (reply, 0);
+
+      snapshot_fd = create_snapshot_memfd (settings, &pending->error);
+      if (snapshot_fd == -1)
+        return;
+    }
+
+  /* The file is sealed, so the clients all share it read-only and it
+   * can be dropped here without affecting them. Each gets a file
+   * description of its own, so reads don't move the others' offset. */
+  proc_path = g_strdup_printf ("/proc/self/fd/%d", snapshot_fd);
+  pending->fd = open (proc_path, O_RDONLY | O_CLOEXEC);
+  if (pending->fd == -1)
+    {
+      int errsv = errno;
+
+      g_set_error (&pending->error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "open %s: %s", proc_path, g_strerror (errsv));
+      return;
+    }
+
+  pending->generation = generation;
+}
+
+/* Called with the cache lock held */
+static void
+resolve_pending_read (PendingRead *pending)
+{
+  if (pending->shared)
+    resolve_shared_read (pending);
+  else if (pending->key)
+    pending->value = lookup_cached (pending->namespace, pending->key);
+  else
+    pending->value = build_read_all_reply ((const char * const *)pending->namespaces);
+}
+
+static void
+return_shared_read (PendingRead *pending)
+{
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GError) error = NULL;
+  int fd_id;
+
+  if (pending->fd == -1)
+    {
+      g_dbus_method_invocation_return_error (pending->invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR,
+                                             XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                                             "Failed to share settings: %s",
+                                             pending->error->message);
+      return;
+    }
+
+  fd_list = g_unix_fd_list_new ();
+  fd_id = g_unix_fd_list_append (fd_list, pending->fd, &error);
+  if (fd_id == -1)
+    {
+      g_dbus_method_invocation_return_error (pending->invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR,
+                                             XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                                             "Failed to append fd: %s",
+                                             error->message);
+      return;
+    }
+
+  g_dbus_method_invocation_return_value_with_unix_fd_list (pending->invocation,
+                                                           g_variant_new ("(ht)",
+                                                                          fd_id,
+                                                                          pending->generation),
+                                                           fd_list);
+}
+
+static void
+return_pending_read (PendingRead *pending)
+{
+  if (pending->shared)
+    {
+      return_shared_read (pending);
+    }
+  else if (pending->key == NULL)
+    {
+      g_dbus_method_invocation_return_value (pending->invocation, pending->value);
+    }
+  else if (pending->value == NULL)
+    {
+      g_debug ("Attempted to read unknown namespace/key pair: %s %s",
+               pending->namespace, pending->key);
+      g_dbus_method_invocation_return_error_literal (pending->invocation, XDG_DESKTOP_PORTAL_ERROR,
+                                                     XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                                                     _("Requested setting not found"));
+    }
+  else
+    {
+      /* Read() has always returned the value boxed in an extra variant */
+      g_dbus_method_invocation_return_value (pending->invocation,
+                                             g_variant_new ("(v)", g_variant_new_variant (pending->value)));
+    }
+}
+
+static void
+read_all_done (GObject      *source,
+               GAsyncResult *result,
+               gpointer      data)
+{
+  ImplCache *impl_cache = data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) impl_value = NULL;
+  GQueue ready = G_QUEUE_INIT;
+  PendingRead *pending;
+
+  if (!xdp_impl_settings_call_read_all_finish (XDP_IMPL_SETTINGS (source), &impl_value, result, &error))
+    g_warning ("Failed to ReadAll() from Settings implementation: %s", error->message);
+
+  G_LOCK (cache);
+
+  /* Possibly from the instance that went away, read it again */
+  if (impl_cache->stale)
+    {
+      impl_cache->stale = FALSE;
+      g_clear_pointer (&impl_value, g_variant_unref);
+    }
+
+  if (impl_value)
+    {
+      GVariantIter iter;
+      const char *namespace;
+      GVariant *keys;
+
+      g_hash_table_remove_all (impl_cache->namespaces);
+
+      g_variant_iter_init (&iter, impl_value);
+      while (g_variant_iter_next (&iter, "{&s@a{sv}}", &namespace, &keys))
         {
-          size_t i;
+          GHashTable *table = ensure_namespace (impl_cache->namespaces, namespace);
+          GVariantIter key_iter;
+          const char *key;
+          GVariant *value;
 
-          for (i = 0; i < g_variant_n_children (impl_value); ++i)
-            {
-              g_autoptr(GVariant) child = g_variant_get_child_value (impl_value, i);
-              g_variant_builder_add_value (builder, child);
-            }
+          g_variant_iter_init (&key_iter, keys);
+          while (g_variant_iter_next (&key_iter, "{&sv}", &key, &value))
+            g_hash_table_insert (table, g_strdup (key), value);
+
+          g_variant_unref (keys);
         }
+
+      impl_cache->state = CACHE_LOADED;
+    }
+  else
+    {
+      /* Leave this backend out of the pending replies, and try again
+       * on the next call */
+      impl_cache->state = CACHE_COLD;
     }
 
-  g_variant_builder_close (builder);
+  if (--n_loading == 0)
+    {
+      rebuild_merged ();
+
+      ready = pending_reads;
+      g_queue_init (&pending_reads);
+      for (GList *l = ready.head; l; l = l->next)
+        resolve_pending_read (l->data);
+    }
+
+  G_UNLOCK (cache);
+
+  while ((pending = g_queue_pop_head (&ready)) != NULL)
+    {
+      return_pending_read (pending);
+      pending_read_free (pending);
+    }
+}
+
+/* Takes ownership of @pending. The reply is sent right away when every
+ * backend is cached, otherwise once the missing ones have been read,
+ * all in parallel. */
+static void
+handle_pending_read (PendingRead *pending)
+{
+  int i;
+
+  G_LOCK (cache);
+
+  for (i = 0; i < n_impls; i++)
+    {
+      if (caches[i].state != CACHE_COLD)
+        continue;
+
+      caches[i].state = CACHE_LOADING;
+      n_loading++;
+      xdp_impl_settings_call_read_all (impls[i], (const char * const []) { NULL }, NULL,
+                                       read_all_done, &caches[i]);
+    }
+
+  if (n_loading > 0)
+    {
+      g_queue_push_tail (&pending_reads, pending);
+      G_UNLOCK (cache);
+      return;
+    }
+
+  resolve_pending_read (pending);
+
+  G_UNLOCK (cache);
+
+  return_pending_read (pending);
+  pending_read_free (pending);
+}
+
+static gboolean
+settings_handle_read_all (XdpSettings           *object,
+                          GDBusMethodInvocation *invocation,
+                          const char    * const *arg_namespaces)
+{
+  PendingRead *pending = pending_read_new (invocation);
+
+  pending->namespaces = g_strdupv ((char **)arg_namespaces);
+
+  handle_pending_read (pending);
+
+  return TRUE;
+}
+
+static gboolean
+settings_handle_read_all_shared (XdpSettings           *object,
+                                 GDBusMethodInvocation *invocation,
+                                 GUnixFDList           *in_fd_list,
+                                 GVariant              *arg_options)
+{
+  PendingRead *pending = pending_read_new (invocation);
+
+  pending->shared = TRUE;
+
+  handle_pending_read (pending);
+
+  return TRUE;
+}
+
+static gboolean
+settings_handle_subscribe (XdpSettings           *object,
+                           GDBusMethodInvocation *invocation,
+                           const char    * const *arg_namespaces)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+
+  if (sender == NULL)
+    {
+      g_dbus_method_invocation_return_error_literal (invocation,
+                                                     XDG_DESKTOP_PORTAL_ERROR,
+                                                     XDG_DESKTOP_PORTAL_ERROR_NOT_ALLOWED,
+                                                     "Subscriptions need a bus name");
+      return TRUE;
+    }
+
+  G_LOCK (subscribers);
+  g_hash_table_insert (subscribers, g_strdup (sender),
+                       g_strdupv ((char **)arg_namespaces));
+  G_UNLOCK (subscribers);
 
-  g_dbus_method_invocation_return_value (invocation, g_variant_builder_end (builder));
+  xdp_settings_complete_subscribe (object, invocation);
 
   return TRUE;
 }
 
+static gboolean
+settings_handle_unsubscribe (XdpSettings           *object,
+                             GDBusMethodInvocation *invocation)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+
+  if (sender)
+    settings_unsubscribe_sender (sender);
+
+  xdp_settings_complete_unsubscribe (object, invocation);
+
+  return TRUE;
+}
+
+void
+settings_unsubscribe_sender (const char *sender)
+{
+  G_LOCK (subscribers);
+  if (subscribers)
+    g_hash_table_remove (subscribers, sender);
+  G_UNLOCK (subscribers);
+}
+
+static void
+notify_subscribers (const char *namespace,
+                    const char *key,
+                    GVariant   *value)
+{
+  GHashTableIter iter;
+  const char *name;
+  char **patterns;
+
+  G_LOCK (subscribers);
+
+  g_hash_table_iter_init (&iter, subscribers);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&patterns))
+    {
+      if (!namespace_matches (namespace, (const char * const *)patterns))
+        continue;
+
+      g_dbus_connection_emit_signal (subscribers_connection,
+                                     name,
+                                     DESKTOP_PORTAL_OBJECT_PATH,
+                                     "org.freedesktop.portal.Settings",
+                                     "SettingChanged",
+                                     g_variant_new ("(ss@v)", namespace, key, value),
+                                     NULL);
+    }
+
+  G_UNLOCK (subscribers);
+}
+
 static gboolean
 settings_handle_read (XdpSettings           *object,
                       GDBusMethodInvocation *invocation,
                       const char            *arg_namespace,
                       const char            *arg_key)
 {
-  int i;
+  PendingRead *pending = pending_read_new (invocation);
 
   g_debug ("Read %s %s", arg_namespace, arg_key);
 
- for (i = 0; i < n_impls; i++)
+  pending->namespace = g_strdup (arg_namespace);
+  pending->key = g_strdup (arg_key);
+
+  handle_pending_read (pending);
+
+  return TRUE;
+}
+
+static gboolean
+emit_settings_changed (gpointer data)
+{
+  Settings *settings = data;
+  g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sa{sv}}"));
+  GHashTableIter iter;
+  const char *namespace;
+  GHashTable *keys;
+
+  settings->pending_changes_id = 0;
+
+  g_hash_table_iter_init (&iter, settings->pending_changes);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&namespace, (gpointer *)&keys))
     {
-      g_autoptr(GError) error = NULL;
-      g_autoptr(GVariant) impl_value = NULL;
+      GHashTableIter key_iter;
+      const char *key;
+      GVariant *value;
 
-      if (!xdp_impl_settings_call_read_sync (impls[i], arg_namespace, arg_key, &impl_value, NULL, &error))
-        {
-          /* A key not being found is expected, continue to our implementation */
-          g_debug ("Failed to Read() from Settings implementation: %s", error->message);
-        }
-      else
-        {
-          g_dbus_method_invocation_return_value (invocation, g_variant_new ("(v)", impl_value));
-          return TRUE;
-        }
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("{sa{sv}}"));
+      g_variant_builder_add (builder, "s", namespace);
+      g_variant_builder_open (builder, G_VARIANT_TYPE ("a{sv}"));
+
+      g_hash_table_iter_init (&key_iter, keys);
+      while (g_hash_table_iter_next (&key_iter, (gpointer *)&key, (gpointer *)&value))
+        g_variant_builder_add (builder, "{sv}", key, value);
+
+      g_variant_builder_close (builder);
+      g_variant_builder_close (builder);
     }
 
-  g_debug ("Attempted to read unknown namespace/key pair: %s %s", arg_namespace, arg_key);
-  g_dbus_method_invocation_return_error_literal (invocation, XDG_DESKTOP_PORTAL_ERROR,
-                                                 XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
-                                                 _("Requested setting not found"));
+  g_hash_table_remove_all (settings->pending_changes);
 
-  return TRUE;
+  g_debug ("Emitting batched changes");
+  xdp_settings_emit_settings_changed (XDP_SETTINGS (settings), g_variant_builder_end (builder));
+
+  return G_SOURCE_REMOVE;
 }
 
 static void
@@ -131,10 +806,70 @@ on_impl_settings_changed (XdpImplSettings *impl,
                           const char      *arg_namespace,
                           const char      *arg_key,
                           GVariant        *arg_value,
-                          XdpSettings     *settings)
+                          XdpSettings     *object)
 {
+  Settings *settings = (Settings *)object;
+  g_autoptr(GVariant) value = g_variant_get_variant (arg_value);
+  GHashTable *keys;
+  int i;
+
+  G_LOCK (cache);
+
+  for (i = 0; i < n_impls; i++)
+    {
+      if (impls[i] != impl)
+        continue;
+
+      /* A cold cache picks the change up when it is loaded */
+      if (caches[i].state != CACHE_LOADED)
+        break;
+
+      keys = ensure_namespace (caches[i].namespaces, arg_namespace);
+      g_hash_table_insert (keys, g_strdup (arg_key), g_variant_ref (value));
+      update_merged (i, arg_namespace, arg_key, value);
+      break;
+    }
+
+  G_UNLOCK (cache);
+
   g_debug ("Emitting changed for %s %s", arg_namespace, arg_key);
-  xdp_settings_emit_setting_changed (settings, arg_namespace, arg_key, arg_value);
+  xdp_settings_emit_setting_changed (object, arg_namespace, arg_key, arg_value);
+  notify_subscribers (arg_namespace, arg_key, arg_value);
+
+  keys = ensure_namespace (settings->pending_changes, arg_namespace);
+  g_hash_table_insert (keys, g_strdup (arg_key), g_variant_ref (value));
+  if (settings->pending_changes_id == 0)
+    settings->pending_changes_id = g_timeout_add (SETTINGS_CHANGED_DELAY_MS, emit_settings_changed, settings);
+}
+
+static void
+on_impl_name_owner_changed (GObject    *object,
+                            GParamSpec *pspec,
+                            gpointer    data)
+{
+  int i;
+
+  G_LOCK (cache);
+
+  for (i = 0; i < n_impls; i++)
+    {
+      if (impls[i] != (XdpImplSettings *) object)
+        continue;
+
+      g_debug ("Settings backend %d changed owner, dropping its cache", i);
+
+      if (caches[i].state == CACHE_LOADING)
+        caches[i].stale = TRUE;
+      else if (caches[i].state == CACHE_LOADED)
+        {
+          caches[i].state = CACHE_COLD;
+          g_hash_table_remove_all (caches[i].namespaces);
+          rebuild_merged ();
+        }
+      break;
+    }
+
+  G_UNLOCK (cache);
 }
 
 static void
@@ -142,12 +877,18 @@ settings_iface_init (XdpSettingsIface *iface)
 {
   iface->handle_read = settings_handle_read;
   iface->handle_read_all = settings_handle_read_all;
+  iface->handle_read_all_shared = settings_handle_read_all_shared;
+  iface->handle_subscribe = settings_handle_subscribe;
+  iface->handle_unsubscribe = settings_handle_unsubscribe;
 }
 
 static void
 settings_init (Settings *self)
 {
-  xdp_settings_set_version (XDP_SETTINGS (self), 1);
+  self->pending_changes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, (GDestroyNotify)g_hash_table_unref);
+
+  xdp_settings_set_version (XDP_SETTINGS (self), 4);
 }
 
 static void
@@ -157,7 +898,12 @@ settings_finalize (GObject *object)
   int i;
 
   for (i = 0; i < n_impls; i++)
-    g_signal_handlers_disconnect_by_data (impls[i], self);
+    if (impls[i])
+      g_signal_handlers_disconnect_by_data (impls[i], self);
+
+  if (self->pending_changes_id)
+    g_source_remove (self->pending_changes_id);
+  g_hash_table_unref (self->pending_changes);
 
   G_OBJECT_CLASS (settings_parent_class)->finalize (object);
 }
@@ -175,11 +921,19 @@ settings_create (GDBusConnection *connection,
                  GPtrArray       *implementations)
 {
   Settings *settings;
-  g_autoptr(GError) error = NULL;
   int i;
 
   n_impls = implementations->len;
   impls = g_new (XdpImplSettings *, n_impls);
+  caches = g_new0 (ImplCache, n_impls);
+  merged = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, (GDestroyNotify)merged_namespace_free);
+
+  G_LOCK (subscribers);
+  subscribers_connection = g_object_ref (connection);
+  subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, (GDestroyNotify)g_strfreev);
+  G_UNLOCK (subscribers);
 
   settings = g_object_new (settings_get_type (), NULL);
 
@@ -187,6 +941,10 @@ settings_create (GDBusConnection *connection,
     {
       PortalImplementation *impl = g_ptr_array_index (implementations, i);
       const char *dbus_name = impl->dbus_name;
+      g_autoptr(GError) error = NULL;
+
+      caches[i].namespaces = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, (GDestroyNotify)g_hash_table_unref);
 
       impls[i] = xdp_impl_settings_proxy_new_sync (connection,
                                                    G_DBUS_PROXY_FLAGS_NONE,
@@ -195,9 +953,16 @@ settings_create (GDBusConnection *connection,
                                                    NULL,
                                                    &error);
       if (impls[i] == NULL)
-        g_warning ("Failed to create settings proxy: %s", error->message);
+        {
+          g_warning ("Failed to create settings proxy: %s", error->message);
+          /* Nothing to read, serve the others */
+          caches[i].state = CACHE_LOADED;
+        }
       else
-        g_signal_connect (impls[i], "setting-changed", G_CALLBACK (on_impl_settings_changed), settings);
+        {
+          g_signal_connect (impls[i], "setting-changed", G_CALLBACK (on_impl_settings_changed), settings);
+          g_signal_connect (impls[i], "notify::g-name-owner", G_CALLBACK (on_impl_name_owner_changed), NULL);
+        }
     }
 
   return G_DBUS_INTERFACE_SKELETON (settings);
@@ -25,3 +25,5 @@
 
 GDBusInterfaceSkeleton * settings_create (GDBusConnection *connection,
                                           GPtrArray       *impls);
+
+void settings_unsubscribe_sender (const char *sender);
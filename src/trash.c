@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
@@ -98,23 +99,126 @@ handle_trash_file (XdpTrash *object,
   g_variant_get (arg_fd, "h", &idx);
   fd = g_unix_fd_list_get (fd_list, idx, NULL);
 
-  result = trash_file (request->app_info, request->sender, fd);
+  if (fd == -1)
+    result = 0;
+  else
+    {
+      result = trash_file (request->app_info, request->sender, fd);
+      close (fd);
+    }
 
   xdp_trash_complete_trash_file (object, invocation, NULL, result);
 
   return TRUE;
 }
 
+/* Each file needs an fd of its own, and the kernel passes at most
+ * SCM_MAX_FD (253) of them in one message, so more entries than that
+ * can't refer to different files */
+#define MAX_TRASH_FILES 253
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  XdpAppInfo *app_info;
+  char *sender;
+  GUnixFDList *fd_list;
+  GVariant *fds;
+} TrashFilesData;
+
+static void
+trash_files_data_free (TrashFilesData *data)
+{
+  g_object_unref (data->invocation);
+  xdp_app_info_unref (data->app_info);
+  g_free (data->sender);
+  g_clear_object (&data->fd_list);
+  g_variant_unref (data->fds);
+  g_free (data);
+}
+
+/* Runs in a worker thread, trashing can take a while for many files
+ * or on slow filesystems */
+static void
+trash_files_in_thread_func (GTask *task,
+                            gpointer source_object,
+                            gpointer task_data,
+                            GCancellable *cancellable)
+{
+  XdpTrash *object = source_object;
+  TrashFilesData *data = task_data;
+  g_autoptr(GVariantBuilder) results = g_variant_builder_new (G_VARIANT_TYPE ("au"));
+  const int *fds = NULL;
+  int n_fds = 0;
+  GVariantIter iter;
+  int idx;
+
+  if (data->fd_list)
+    fds = g_unix_fd_list_peek_fds (data->fd_list, &n_fds);
+
+  g_variant_iter_init (&iter, data->fds);
+  while (g_variant_iter_next (&iter, "h", &idx))
+    {
+      guint result = 0;
+
+      if (idx >= 0 && idx < n_fds)
+        result = trash_file (data->app_info, data->sender, fds[idx]);
+
+      g_variant_builder_add (results, "u", result);
+    }
+
+  xdp_trash_complete_trash_files (object, data->invocation, NULL,
+                                  g_variant_builder_end (results));
+}
+
+static gboolean
+handle_trash_files (XdpTrash *object,
+                    GDBusMethodInvocation *invocation,
+                    GUnixFDList *fd_list,
+                    GVariant *arg_fds)
+{
+  Request *request = request_from_invocation (invocation);
+  g_autoptr(GTask) task = NULL;
+  TrashFilesData *data;
+
+  g_debug ("Handling TrashFiles");
+
+  if (g_variant_n_children (arg_fds) > MAX_TRASH_FILES)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR,
+                                             XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                                             "Too many files, at most %d can be trashed at once",
+                                             MAX_TRASH_FILES);
+      return TRUE;
+    }
+
+  REQUEST_AUTOLOCK (request);
+
+  data = g_new0 (TrashFilesData, 1);
+  data->invocation = g_object_ref (invocation);
+  data->app_info = xdp_app_info_ref (request->app_info);
+  data->sender = g_strdup (request->sender);
+  data->fd_list = fd_list ? g_object_ref (fd_list) : NULL;
+  data->fds = g_variant_ref (arg_fds);
+
+  task = g_task_new (object, NULL, NULL, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify) trash_files_data_free);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_BACKGROUND, trash_files_in_thread_func);
+
+  return TRUE;
+}
+
 static void
 trash_iface_init (XdpTrashIface *iface)
 {
   iface->handle_trash_file = handle_trash_file;
+  iface->handle_trash_files = handle_trash_files;
 }
 
 static void
 trash_init (Trash *fc)
 {
-  xdp_trash_set_version (XDP_TRASH (fc), 1);
+  xdp_trash_set_version (XDP_TRASH (fc), 2);
 }
 
 static void
@@ -21,6 +21,8 @@
 #include "config.h"
 
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
 #include <gio/gdesktopappinfo.h>
@@ -53,6 +55,9 @@ static XdpImplWallpaper *impl;
 static XdpImplAccess *access_impl;
 static Wallpaper *wallpaper;
 
+/* Cleared when the backend turns out not to implement SetWallpaperFile */
+static int impl_has_set_wallpaper_file = TRUE;
+
 GType wallpaper_get_type (void) G_GNUC_CONST;
 static void wallpaper_iface_init (XdpWallpaperIface *iface);
 
@@ -85,6 +90,8 @@ handle_set_wallpaper_uri_done (GObject *source,
   g_autoptr(GError) error = NULL;
   Request *request = data;
 
+  request_impl_done (request);
+
   if (!xdp_impl_wallpaper_call_set_wallpaper_uri_finish (XDP_IMPL_WALLPAPER (source),
                                                          &response,
                                                          result,
@@ -97,6 +104,95 @@ handle_set_wallpaper_uri_done (GObject *source,
   g_object_unref (request);
 }
 
+static void
+set_wallpaper_uri (Request *request,
+                   const char *uri,
+                   GVariant *options)
+{
+  const char *parent_window;
+
+  parent_window = (const char *)g_object_get_data (G_OBJECT (request), "parent-window");
+
+  g_debug ("Calling SetWallpaperURI with %s", uri);
+  xdp_impl_wallpaper_call_set_wallpaper_uri (impl,
+                                             request->id,
+                                             xdp_app_info_get_id (request->app_info),
+                                             parent_window,
+                                             uri,
+                                             options,
+                                             NULL,
+                                             handle_set_wallpaper_uri_done,
+                                             g_object_ref (request));
+}
+
+static void
+handle_set_wallpaper_file_done (GObject *source,
+                                GAsyncResult *result,
+                                gpointer data)
+{
+  guint response = 2;
+  g_autoptr(GError) error = NULL;
+  Request *request = data;
+
+  request_impl_done (request);
+
+  if (!xdp_impl_wallpaper_call_set_wallpaper_file_finish (XDP_IMPL_WALLPAPER (source),
+                                                          &response,
+                                                          NULL,
+                                                          result,
+                                                          &error))
+    {
+      if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        {
+          g_debug ("Backend doesn't support SetWallpaperFile, passing the uri");
+          g_atomic_int_set (&impl_has_set_wallpaper_file, FALSE);
+          set_wallpaper_uri (request,
+                             g_object_get_data (G_OBJECT (request), "uri"),
+                             g_object_get_data (G_OBJECT (request), "impl-options"));
+          g_object_unref (request);
+          return;
+        }
+
+      g_warning ("A backend call failed: %s", error->message);
+    }
+
+  send_response (request, response);
+  g_object_unref (request);
+}
+
+/* The backend has to be able to read from the fd, so O_PATH fds are
+ * reopened through /proc, which gives the same file, not whatever is
+ * at its path now */
+static GUnixFDList *
+fd_list_for_backend (int fd)
+{
+  g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
+  int flags;
+
+  flags = fcntl (fd, F_GETFL);
+  if (flags == -1)
+    return NULL;
+
+  if ((flags & O_PATH) != 0)
+    {
+      g_autofree char *proc_path = g_strdup_printf ("/proc/self/fd/%d", fd);
+      int read_fd;
+
+      read_fd = open (proc_path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+      if (read_fd == -1)
+        return NULL;
+
+      if (g_unix_fd_list_append (fd_list, read_fd, NULL) == -1)
+        g_clear_object (&fd_list);
+      close (read_fd);
+    }
+  else if ((flags & O_ACCMODE) == O_WRONLY ||
+           g_unix_fd_list_append (fd_list, fd, NULL) == -1)
+    g_clear_object (&fd_list);
+
+  return g_steal_pointer (&fd_list);
+}
+
 static gboolean
 validate_set_on (const char *key,
                  GVariant *value,
@@ -127,7 +223,8 @@ handle_set_wallpaper_in_thread_func (GTask *task,
   g_autoptr(GError) error = NULL;
   g_autofree char *uri = NULL;
   GVariantBuilder opt_builder;
-  g_autoptr(XdpImplRequest) impl_request = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  GVariant *impl_options;
   GVariant *options;
   gboolean show_preview = FALSE;
   int fd;
@@ -218,6 +315,7 @@ handle_set_wallpaper_in_thread_func (GTask *task,
     {
       g_autofree char *path = NULL;
 
+      /* This also checks that the app can see the file */
       path = xdp_app_info_get_path_for_fd (request->app_info, fd, 0, NULL, NULL);
       if (path == NULL)
         {
@@ -234,30 +332,38 @@ handle_set_wallpaper_in_thread_func (GTask *task,
 
       uri = g_filename_to_uri (path, NULL, NULL);
       g_object_set_data_full (G_OBJECT (request), "uri", g_strdup (uri), g_free);
+
+      if (g_atomic_int_get (&impl_has_set_wallpaper_file))
+        fd_list = fd_list_for_backend (fd);
     }
 
-  impl_request = xdp_impl_request_proxy_new_sync (g_dbus_proxy_get_connection (G_DBUS_PROXY (impl)),
-                                                  G_DBUS_PROXY_FLAGS_NONE,
-                                                  g_dbus_proxy_get_name (G_DBUS_PROXY (impl)),
-                                                  request->id,
-                                                  NULL, &error);
-  request_set_impl_request (request, impl_request);
+  request_set_impl (request, G_DBUS_PROXY (impl));
 
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
   xdp_filter_options (options, &opt_builder,
                       wallpaper_options, G_N_ELEMENTS (wallpaper_options),
                       NULL);
+  impl_options = g_variant_ref_sink (g_variant_builder_end (&opt_builder));
+  g_object_set_data_full (G_OBJECT (request), "impl-options",
+                          impl_options, (GDestroyNotify)g_variant_unref);
 
-  g_debug ("Calling SetWallpaperURI with %s", uri);
-  xdp_impl_wallpaper_call_set_wallpaper_uri (impl,
-                                             request->id,
-                                             app_id,
-                                             parent_window,
-                                             uri,
-                                             g_variant_builder_end (&opt_builder),
-                                             NULL,
-                                             handle_set_wallpaper_uri_done,
-                                             g_object_ref (request));
+  if (fd_list == NULL)
+    {
+      set_wallpaper_uri (request, uri, impl_options);
+      return;
+    }
+
+  g_debug ("Calling SetWallpaperFile for %s", uri);
+  xdp_impl_wallpaper_call_set_wallpaper_file (impl,
+                                              request->id,
+                                              app_id,
+                                              parent_window,
+                                              g_variant_new_handle (0),
+                                              impl_options,
+                                              fd_list,
+                                              NULL,
+                                              handle_set_wallpaper_file_done,
+                                              g_object_ref (request));
 }
 
 static gboolean
@@ -284,11 +390,17 @@ handle_set_wallpaper_uri (XdpWallpaper *object,
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_set_wallpaper_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG, handle_set_wallpaper_in_thread_func);
 
   return TRUE;  
 }
 
+static void
+close_fd (gpointer data)
+{
+  close (GPOINTER_TO_INT (data));
+}
+
 static gboolean
 handle_set_wallpaper_file (XdpWallpaper *object,
                            GDBusMethodInvocation *invocation,
@@ -312,7 +424,7 @@ handle_set_wallpaper_file (XdpWallpaper *object,
       return TRUE;
     }
 
-  g_object_set_data (G_OBJECT (request), "fd", GINT_TO_POINTER (fd));
+  g_object_set_data_full (G_OBJECT (request), "fd", GINT_TO_POINTER (fd), close_fd);
   g_object_set_data_full (G_OBJECT (request), "parent-window", g_strdup (arg_parent_window), g_free);
   g_object_set_data_full (G_OBJECT (request),
                           "options",
@@ -324,7 +436,7 @@ handle_set_wallpaper_file (XdpWallpaper *object,
 
   task = g_task_new (object, NULL, NULL, NULL);
   g_task_set_task_data (task, g_object_ref (request), g_object_unref);
-  g_task_run_in_thread (task, handle_set_wallpaper_in_thread_func);
+  xdp_task_run_in_pool (task, XDP_WORKER_POOL_DIALOG, handle_set_wallpaper_in_thread_func);
 
   return TRUE;
 }
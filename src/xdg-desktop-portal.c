@@ -32,6 +32,8 @@
 #include "xdp-impl-dbus.h"
 #include "request.h"
 #include "call.h"
+#include "session.h"
+#include "latency.h"
 #include "portal-impl.h"
 #include "documents.h"
 #include "permissions.h"
@@ -63,14 +65,74 @@ static GMainLoop *loop = NULL;
 gboolean opt_verbose;
 static gboolean opt_replace;
 static gboolean show_version;
+static int opt_prewarm_rate;
+static int opt_interactive_threads;
+static int opt_background_threads;
+static gboolean opt_print_startup_timings;
+static int opt_background_grace = -1;
+static int opt_coalesce_input;
+static gboolean opt_separate_input_connection;
+static int opt_max_requests = 512;
+static int opt_max_sessions = 64;
+static char **opt_thread_sched;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information during command processing", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace a running instance", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &show_version, "Show program version.", NULL},
+  { "prewarm-app-info", 0, 0, G_OPTION_ARG_INT, &opt_prewarm_rate, "Look up new clients in the background, at most N per second", "N" },
+  { "interactive-threads", 0, 0, G_OPTION_ARG_INT, &opt_interactive_threads, "Number of worker threads for interactive portals", "N" },
+  { "background-threads", 0, 0, G_OPTION_ARG_INT, &opt_background_threads, "Number of worker threads for background portals", "N" },
+  { "background-grace-seconds", 0, 0, G_OPTION_ARG_INT, &opt_background_grace, "Seconds an app may stay in the background before the Background portal acts", "N" },
+  { "coalesce-input-msec", 0, 0, G_OPTION_ARG_INT, &opt_coalesce_input, "Merge relative pointer events for up to N milliseconds while the remote desktop backend is busy", "N" },
+  { "separate-input-connection", 0, 0, G_OPTION_ARG_NONE, &opt_separate_input_connection, "Talk to the remote desktop backend over a bus connection of its own", NULL },
+  { "max-requests-per-client", 0, 0, G_OPTION_ARG_INT, &opt_max_requests, "Refuse new requests from a client with N open requests, 0 for no limit", "N" },
+  { "max-sessions-per-client", 0, 0, G_OPTION_ARG_INT, &opt_max_sessions, "Refuse new sessions from a client with N open sessions, 0 for no limit", "N" },
+  { "print-startup-timings", 0, 0, G_OPTION_ARG_NONE, &opt_print_startup_timings, "Print how long each startup step took", NULL },
+  { "thread-sched", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_thread_sched, "Scheduling for a kind of thread (interactive, background or monitor), e.g. monitor=idle or interactive=other:-5", "KIND=POLICY[:NICE]" },
   { NULL }
 };
 
+/* Startup steps are timed relative to the start of main(). The
+ * summary is printed when the bus name is acquired. */
+static gint64 startup_time;
+G_LOCK_DEFINE_STATIC (startup_timings);
+static GString *startup_timings;
+
+static void
+startup_mark (const char *what,
+              gint64      start)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  g_debug ("Startup: %s took %.1f ms", what, (now - start) / 1000.0);
+
+  if (!opt_print_startup_timings)
+    return;
+
+  G_LOCK (startup_timings);
+  if (startup_timings == NULL)
+    startup_timings = g_string_new ("");
+  g_string_append_printf (startup_timings, "%8.1f ms %8.1f ms  %s\n",
+                          (start - startup_time) / 1000.0,
+                          (now - start) / 1000.0,
+                          what);
+  G_UNLOCK (startup_timings);
+}
+
+static void
+print_startup_timings (void)
+{
+  if (!opt_print_startup_timings)
+    return;
+
+  G_LOCK (startup_timings);
+  g_print ("Startup timings (start, duration, step):\n%s",
+           startup_timings ? startup_timings->str : "");
+  g_print ("%8.1f ms total\n", (g_get_monotonic_time () - startup_time) / 1000.0);
+  G_UNLOCK (startup_timings);
+}
+
 static void
 message_handler (const gchar *log_domain,
                  GLogLevelFlags log_level,
@@ -79,9 +141,9 @@ message_handler (const gchar *log_domain,
 {
   /* Make this look like normal console output */
   if (log_level & G_LOG_LEVEL_DEBUG)
-    printf ("XDP: %s\n", message);
+    xdp_log_write (g_strdup_printf ("XDP: %s\n", message));
   else
-    printf ("%s: %s\n", g_get_prgname (), message);
+    xdp_log_write (g_strdup_printf ("%s: %s\n", g_get_prgname (), message));
 }
 
 static void
@@ -98,15 +160,14 @@ printerr_handler (const gchar *string)
   fprintf (stderr, "%serror: %s%s\n", prefix, suffix, string);
 }
 
+typedef enum {
+  METHOD_NEEDS_REQUEST = 1 << 0,
+} MethodFlags;
+
 static gboolean
-method_needs_request (GDBusMethodInvocation *invocation)
+method_needs_request (const char *interface,
+                      const char *method)
 {
-  const char *interface;
-  const char *method;
-
-  interface = g_dbus_method_invocation_get_interface_name (invocation);
-  method = g_dbus_method_invocation_get_method_name (invocation);
-
   if (strcmp (interface, "org.freedesktop.portal.ScreenCast") == 0)
     {
       if (strcmp (method, "OpenPipeWireRemote") == 0)
@@ -128,22 +189,139 @@ method_needs_request (GDBusMethodInvocation *invocation)
       else
         return TRUE;
     }
+  else if (strcmp (interface, "org.freedesktop.portal.Screenshot") == 0)
+    {
+      if (strcmp (method, "RetrieveImage") == 0)
+        return FALSE;
+      else
+        return TRUE;
+    }
   else
     {
       return TRUE;
     }
 }
 
+/* Maps the GDBusMethodInfo of each method of the interface to its
+ * MethodFlags, so calls don't need to compare names. The table is not
+ * changed after the skeleton is exported. */
+static GHashTable *
+build_method_flags (GDBusInterfaceInfo *info)
+{
+  GHashTable *method_flags;
+  int i;
+
+  method_flags = g_hash_table_new (NULL, NULL);
+
+  for (i = 0; info->methods && info->methods[i]; i++)
+    {
+      GDBusMethodInfo *method = info->methods[i];
+      MethodFlags flags = 0;
+
+      if (method_needs_request (info->name, method->name))
+        flags |= METHOD_NEEDS_REQUEST;
+
+      g_hash_table_insert (method_flags, method, GUINT_TO_POINTER (flags));
+    }
+
+  return method_flags;
+}
+
+static MethodFlags
+get_method_flags (GHashTable            *method_flags,
+                  GDBusMethodInvocation *invocation)
+{
+  const GDBusMethodInfo *method;
+  gpointer flags;
+
+  method = g_dbus_method_invocation_get_method_info (invocation);
+  if (method && g_hash_table_lookup_extended (method_flags, method, NULL, &flags))
+    return GPOINTER_TO_UINT (flags);
+
+  return method_needs_request (g_dbus_method_invocation_get_interface_name (invocation),
+                               g_dbus_method_invocation_get_method_name (invocation))
+         ? METHOD_NEEDS_REQUEST : 0;
+}
+
+#define LATENCY_SUMMARY_INTERVAL 60
+
+static gboolean
+log_latency_summary (gpointer data)
+{
+  g_autofree char *summary = latency_summary ();
+  g_autofree char *memory = xdp_memory_usage_summary ();
+  g_autoptr(GString) usage = g_string_new ("");
+  NotificationStats stats;
+
+  if (summary)
+    g_debug ("Request latencies in the last %d seconds:\n%s",
+             LATENCY_SUMMARY_INTERVAL, summary);
+
+  request_append_usage (usage);
+  session_append_usage (usage);
+  if (usage->len > 0)
+    g_debug ("Open requests and sessions by client:\n%s", usage->str);
+
+  notification_get_stats (&stats);
+  g_debug ("Notifications: %" G_GUINT64_FORMAT " forwarded, %" G_GUINT64_FORMAT " delayed, "
+           "%" G_GUINT64_FORMAT " coalesced, %" G_GUINT64_FORMAT " dropped, %u queued",
+           stats.forwarded, stats.delayed, stats.coalesced, stats.dropped, stats.queued);
+
+  g_debug ("Memory usage (objects, bytes):\n%s", memory);
+
+  return G_SOURCE_CONTINUE;
+}
+
+typedef struct {
+  char *method;
+  gint64 start;
+  gint64 authorized;
+} MethodTiming;
+
+/* The invocation goes away once the call has been replied to */
+static void
+method_timing_done (gpointer  data,
+                    GObject  *where_the_object_was)
+{
+  MethodTiming *timing = data;
+  gint64 now = g_get_monotonic_time ();
+
+  g_debug ("%s handled in %.1f ms (%.1f ms to authorize)",
+           timing->method,
+           (now - timing->start) / 1000.0,
+           (timing->authorized - timing->start) / 1000.0);
+
+  g_free (timing->method);
+  g_free (timing);
+}
+
 static gboolean
 authorize_callback (GDBusInterfaceSkeleton *interface,
                     GDBusMethodInvocation  *invocation,
                     gpointer                user_data)
 {
+  GHashTable *method_flags = user_data;
   g_autoptr(XdpAppInfo) app_info = NULL;
+  MethodTiming *timing = NULL;
 
   g_autoptr(GError) error = NULL;
 
+  if (opt_verbose)
+    {
+      timing = g_new0 (MethodTiming, 1);
+      timing->method = g_strconcat (g_dbus_method_invocation_get_interface_name (invocation), ".",
+                                    g_dbus_method_invocation_get_method_name (invocation), NULL);
+      timing->start = g_get_monotonic_time ();
+    }
+
   app_info = xdp_invocation_lookup_app_info_sync (invocation, NULL, &error);
+
+  if (timing)
+    {
+      timing->authorized = g_get_monotonic_time ();
+      g_object_weak_ref (G_OBJECT (invocation), method_timing_done, timing);
+    }
+
   if (app_info == NULL)
     {
       g_dbus_method_invocation_return_error (invocation,
@@ -153,10 +331,16 @@ authorize_callback (GDBusInterfaceSkeleton *interface,
       return FALSE;
     }
 
-  if (method_needs_request (invocation))
-    request_init_invocation (invocation, app_info);
-  else
-    call_init_invocation (invocation, app_info);
+  call_init_invocation (invocation, app_info);
+
+  if (get_method_flags (method_flags, invocation) & METHOD_NEEDS_REQUEST)
+    {
+      if (!request_init_invocation (invocation, app_info, &error))
+        {
+          g_dbus_method_invocation_return_gerror (invocation, error);
+          return FALSE;
+        }
+    }
 
   return TRUE;
 }
@@ -175,8 +359,10 @@ export_portal_implementation (GDBusConnection *connection,
 
   g_dbus_interface_skeleton_set_flags (skeleton,
                                        G_DBUS_INTERFACE_SKELETON_FLAGS_HANDLE_METHOD_INVOCATIONS_IN_THREAD);
-  g_signal_connect (skeleton, "g-authorize-method",
-                    G_CALLBACK (authorize_callback), NULL);
+  g_signal_connect_data (skeleton, "g-authorize-method",
+                         G_CALLBACK (authorize_callback),
+                         build_method_flags (g_dbus_interface_skeleton_get_info (skeleton)),
+                         (GClosureNotify) g_hash_table_unref, 0);
 
   if (!g_dbus_interface_skeleton_export (skeleton,
                                          connection,
@@ -195,27 +381,228 @@ peer_died_cb (const char *name)
 {
   close_requests_for_sender (name);
   close_sessions_for_sender (name);
+  settings_unsubscribe_sender (name);
+}
+
+/* Portals whose backend proxies are created in a thread at startup */
+typedef enum {
+  PORTAL_SETTINGS,
+  PORTAL_FILE_CHOOSER,
+  PORTAL_OPEN_URI,
+  PORTAL_PRINT,
+  PORTAL_SCREENSHOT,
+  PORTAL_NOTIFICATION,
+  PORTAL_INHIBIT,
+  PORTAL_DEVICE,
+  PORTAL_LOCATION,
+  PORTAL_BACKGROUND,
+  PORTAL_WALLPAPER,
+  PORTAL_ACCOUNT,
+  PORTAL_EMAIL,
+  PORTAL_SECRET,
+  PORTAL_SCREEN_CAST,
+  PORTAL_REMOTE_DESKTOP,
+} PortalKind;
+
+typedef struct {
+  PortalKind kind;
+  GDBusConnection *connection;
+  /* Copied, the portals can be reloaded while these start up */
+  char *dbus_name;
+  char *dbus_name2;
+  GPtrArray *impls;
+} PortalStartup;
+
+static XdpImplLockdown *lockdown;
+static guint pending_portals;
+static gint64 portals_start;
+static gint64 name_request_time;
+static guint owner_id;
+
+static void
+portal_startup_free (PortalStartup *startup)
+{
+  g_object_unref (startup->connection);
+  g_free (startup->dbus_name);
+  g_free (startup->dbus_name2);
+  g_clear_pointer (&startup->impls, g_ptr_array_unref);
+  g_free (startup);
+}
+
+static GDBusInterfaceSkeleton *
+create_portal (PortalStartup *startup)
+{
+  GDBusConnection *connection = startup->connection;
+
+  switch (startup->kind)
+    {
+    case PORTAL_SETTINGS:
+      return settings_create (connection, startup->impls);
+    case PORTAL_FILE_CHOOSER:
+      return file_chooser_create (connection, startup->dbus_name, lockdown);
+    case PORTAL_OPEN_URI:
+      return open_uri_create (connection, startup->dbus_name, lockdown);
+    case PORTAL_PRINT:
+      return print_create (connection, startup->dbus_name, lockdown);
+    case PORTAL_SCREENSHOT:
+      return screenshot_create (connection, startup->dbus_name);
+    case PORTAL_NOTIFICATION:
+      return notification_create (connection, startup->dbus_name);
+    case PORTAL_INHIBIT:
+      return inhibit_create (connection, startup->dbus_name);
+    case PORTAL_DEVICE:
+      return device_create (connection, startup->dbus_name, lockdown);
+#ifdef HAVE_GEOCLUE
+    case PORTAL_LOCATION:
+      return location_create (connection, startup->dbus_name, lockdown);
+#endif
+    case PORTAL_BACKGROUND:
+      return background_create (connection, startup->dbus_name, startup->dbus_name2);
+    case PORTAL_WALLPAPER:
+      return wallpaper_create (connection, startup->dbus_name, startup->dbus_name2);
+    case PORTAL_ACCOUNT:
+      return account_create (connection, startup->dbus_name);
+    case PORTAL_EMAIL:
+      return email_create (connection, startup->dbus_name);
+    case PORTAL_SECRET:
+      return secret_create (connection, startup->dbus_name);
+#ifdef HAVE_PIPEWIRE
+    case PORTAL_SCREEN_CAST:
+      return screen_cast_create (connection, startup->dbus_name);
+    case PORTAL_REMOTE_DESKTOP:
+      return remote_desktop_create (connection, startup->dbus_name);
+#endif
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static void
+create_portal_in_thread_func (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+  PortalStartup *startup = task_data;
+  GDBusInterfaceSkeleton *skeleton;
+  gint64 start = g_get_monotonic_time ();
+
+  skeleton = create_portal (startup);
+  if (skeleton)
+    startup_mark (g_dbus_interface_skeleton_get_info (skeleton)->name, start);
+  g_task_return_pointer (task, skeleton, skeleton ? g_object_unref : NULL);
+}
+
+static void
+on_name_acquired (GDBusConnection *connection,
+                  const gchar     *name,
+                  gpointer         user_data);
+static void
+on_name_lost (GDBusConnection *connection,
+              const gchar     *name,
+              gpointer         user_data);
+
+static void
+own_portal_name (GDBusConnection *connection)
+{
+  name_request_time = g_get_monotonic_time ();
+  owner_id = g_bus_own_name_on_connection (connection,
+                                           "org.freedesktop.portal.Desktop",
+                                           G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | (opt_replace ? G_BUS_NAME_OWNER_FLAGS_REPLACE : 0),
+                                           on_name_acquired,
+                                           on_name_lost,
+                                           NULL,
+                                           NULL);
+}
+
+static void
+portal_created (GObject      *source_object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  PortalStartup *startup = g_task_get_task_data (G_TASK (result));
+  GDBusConnection *connection = g_object_ref (startup->connection);
+  g_autoptr(GDBusInterfaceSkeleton) skeleton = NULL;
+
+  skeleton = g_task_propagate_pointer (G_TASK (result), NULL);
+  export_portal_implementation (connection, skeleton ? g_object_ref (skeleton) : NULL);
+
+  /* Only take the name once everything is exported, so activated
+   * clients don't see missing interfaces */
+  if (--pending_portals == 0)
+    {
+      startup_mark ("creating portals", portals_start);
+      own_portal_name (connection);
+    }
+
+  g_object_unref (connection);
 }
 
 static void
-on_bus_acquired (GDBusConnection *connection,
-                 const gchar     *name,
-                 gpointer         user_data)
+start_portal (GDBusConnection *connection,
+              PortalKind       kind,
+              const char      *dbus_name,
+              const char      *dbus_name2,
+              GPtrArray       *impls)
+{
+  g_autoptr(GTask) task = NULL;
+  PortalStartup *startup;
+
+  startup = g_new0 (PortalStartup, 1);
+  startup->kind = kind;
+  startup->connection = g_object_ref (connection);
+  startup->dbus_name = g_strdup (dbus_name);
+  startup->dbus_name2 = g_strdup (dbus_name2);
+  startup->impls = impls;
+
+  pending_portals++;
+
+  task = g_task_new (NULL, NULL, portal_created, NULL);
+  g_task_set_task_data (task, startup, (GDestroyNotify) portal_startup_free);
+  g_task_run_in_thread (task, create_portal_in_thread_func);
+}
+
+/* The backend proxies are created in parallel, since creating them
+ * can activate the backends and that is slow */
+static void
+on_bus_acquired (GDBusConnection *connection)
 {
   PortalImplementation *implementation;
   PortalImplementation *implementation2;
   g_autoptr(GError) error = NULL;
-  XdpImplLockdown *lockdown;
   GQuark portal_errors G_GNUC_UNUSED;
-  GPtrArray *impls;
+  gint64 start;
 
   /* make sure errors are registered */
   portal_errors = XDG_DESKTOP_PORTAL_ERROR;
 
+  xdp_set_app_info_prewarm (MAX (opt_prewarm_rate, 0));
+  if (opt_interactive_threads > 0)
+    xdp_set_worker_pool_size (XDP_WORKER_POOL_INTERACTIVE, opt_interactive_threads);
+  if (opt_background_threads > 0)
+    xdp_set_worker_pool_size (XDP_WORKER_POOL_BACKGROUND, opt_background_threads);
+  if (opt_background_grace >= 0)
+    background_set_grace_period (opt_background_grace);
+#ifdef HAVE_PIPEWIRE
+  if (opt_coalesce_input > 0)
+    remote_desktop_set_coalesce_latency (opt_coalesce_input);
+  remote_desktop_set_separate_connection (opt_separate_input_connection);
+#endif
+  request_set_max_per_sender (MAX (opt_max_requests, 0));
+  session_set_max_per_sender (MAX (opt_max_sessions, 0));
   xdp_connection_track_name_owners (connection, peer_died_cb);
+
+  start = g_get_monotonic_time ();
   init_document_proxy (connection);
+  startup_mark ("init_document_proxy", start);
+
+  start = g_get_monotonic_time ();
   init_permission_store (connection);
+  startup_mark ("init_permission_store", start);
+
+  start = g_get_monotonic_time ();
 
+  /* Other portals need this, so it comes first */
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Lockdown");
   if (implementation != NULL)
     lockdown = xdp_impl_lockdown_proxy_new_sync (connection,
@@ -225,102 +612,101 @@ on_bus_acquired (GDBusConnection *connection,
                                                  NULL, &error);
   else
     lockdown = xdp_impl_lockdown_skeleton_new ();
+  startup_mark ("lockdown", start);
 
+  /* Released once all portals are started, so a quick start can't
+   * take the name too early */
+  pending_portals = 1;
+  portals_start = g_get_monotonic_time ();
+
+  start = g_get_monotonic_time ();
   export_portal_implementation (connection, memory_monitor_create (connection));
   export_portal_implementation (connection, network_monitor_create (connection));
   export_portal_implementation (connection, proxy_resolver_create (connection));
   export_portal_implementation (connection, trash_create (connection));
   export_portal_implementation (connection, game_mode_create (connection));
+  startup_mark ("local portals", start);
 
-  impls = find_all_portal_implementations ("org.freedesktop.impl.portal.Settings");
-  export_portal_implementation (connection, settings_create (connection, impls));
-  g_ptr_array_free (impls, TRUE);
+  start_portal (connection, PORTAL_SETTINGS, NULL, NULL,
+                find_all_portal_implementations ("org.freedesktop.impl.portal.Settings"));
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.FileChooser");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  file_chooser_create (connection, implementation->dbus_name, lockdown));
+    start_portal (connection, PORTAL_FILE_CHOOSER, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.AppChooser");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  open_uri_create (connection, implementation->dbus_name, lockdown));
+    start_portal (connection, PORTAL_OPEN_URI, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Print");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  print_create (connection, implementation->dbus_name, lockdown));
+    start_portal (connection, PORTAL_PRINT, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Screenshot");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  screenshot_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_SCREENSHOT, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Notification");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  notification_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_NOTIFICATION, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Inhibit");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  inhibit_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_INHIBIT, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Access");
   implementation2 = find_portal_implementation ("org.freedesktop.impl.portal.Background");
   if (implementation != NULL)
     {
-      export_portal_implementation (connection,
-                                    device_create (connection, implementation->dbus_name, lockdown));
+      start_portal (connection, PORTAL_DEVICE, implementation->dbus_name, NULL, NULL);
 #ifdef HAVE_GEOCLUE
-      export_portal_implementation (connection,
-                                    location_create (connection, implementation->dbus_name, lockdown));
+      start_portal (connection, PORTAL_LOCATION, implementation->dbus_name, NULL, NULL);
 #endif
 
 #ifdef HAVE_PIPEWIRE
+      /* This sets up PipeWire, keep it in the main thread */
+      start = g_get_monotonic_time ();
       export_portal_implementation (connection, camera_create (connection, lockdown));
+      startup_mark ("org.freedesktop.portal.Camera", start);
 #endif
     }
 
   if (implementation != NULL && implementation2 != NULL)
-    export_portal_implementation (connection,
-                                  background_create (connection,
-                                                     implementation->dbus_name,
-                                                     implementation2->dbus_name));
+    start_portal (connection, PORTAL_BACKGROUND,
+                  implementation->dbus_name, implementation2->dbus_name, NULL);
 
   implementation2 = find_portal_implementation ("org.freedesktop.impl.portal.Wallpaper");
   if (implementation != NULL && implementation2 != NULL)
-    export_portal_implementation (connection,
-                                  wallpaper_create (connection,
-                                                    implementation->dbus_name,
-                                                    implementation2->dbus_name));
+    start_portal (connection, PORTAL_WALLPAPER,
+                  implementation->dbus_name, implementation2->dbus_name, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Account");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  account_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_ACCOUNT, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Email");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  email_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_EMAIL, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.Secret");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-				  secret_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_SECRET, implementation->dbus_name, NULL, NULL);
 
 #ifdef HAVE_PIPEWIRE
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.ScreenCast");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  screen_cast_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_SCREEN_CAST, implementation->dbus_name, NULL, NULL);
 
   implementation = find_portal_implementation ("org.freedesktop.impl.portal.RemoteDesktop");
   if (implementation != NULL)
-    export_portal_implementation (connection,
-                                  remote_desktop_create (connection, implementation->dbus_name));
+    start_portal (connection, PORTAL_REMOTE_DESKTOP, implementation->dbus_name, NULL, NULL);
 #endif
+
+  if (--pending_portals == 0)
+    {
+      startup_mark ("creating portals", portals_start);
+      own_portal_name (connection);
+    }
 }
 
 static void
@@ -329,6 +715,9 @@ on_name_acquired (GDBusConnection *connection,
                   gpointer         user_data)
 {
   g_debug ("%s acquired", name);
+
+  startup_mark ("acquiring the bus name", name_request_time);
+  print_startup_timings ();
 }
 
 static void
@@ -342,10 +731,13 @@ on_name_lost (GDBusConnection *connection,
 int
 main (int argc, char *argv[])
 {
-  guint owner_id;
   g_autoptr(GError) error = NULL;
   g_autoptr(GDBusConnection) session_bus = NULL;
   g_autoptr(GOptionContext) context;
+  gint64 start;
+  int i;
+
+  startup_time = g_get_monotonic_time ();
 
   setlocale (LC_ALL, "");
   bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
@@ -381,6 +773,15 @@ main (int argc, char *argv[])
       return 1;
     }
 
+  for (i = 0; opt_thread_sched && opt_thread_sched[i]; i++)
+    {
+      if (!xdp_set_thread_sched (opt_thread_sched[i], &error))
+        {
+          g_printerr ("%s: %s\n", g_get_application_name (), error->message);
+          return 1;
+        }
+    }
+
   if (show_version)
     {
       g_print (PACKAGE_STRING "\n");
@@ -390,11 +791,23 @@ main (int argc, char *argv[])
   g_set_printerr_handler (printerr_handler);
 
   if (opt_verbose)
-    g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
+    {
+      const char *domains[] = { G_LOG_DOMAIN, NULL };
+
+      xdp_log_set_debug_domains (domains, message_handler);
+
+      latency_enable ();
+      g_timeout_add_seconds (LATENCY_SUMMARY_INTERVAL, log_latency_summary, NULL);
+    }
 
   g_set_prgname (argv[0]);
 
+  xdp_dump_memory_usage_on_signal ();
+
+  start = g_get_monotonic_time ();
   load_installed_portals (opt_verbose);
+  startup_mark ("load_installed_portals", start);
+  watch_installed_portals (NULL);
 
   loop = g_main_loop_new (NULL, FALSE);
 
@@ -405,18 +818,12 @@ main (int argc, char *argv[])
       return 2;
     }
 
-  owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
-                             "org.freedesktop.portal.Desktop",
-                             G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | (opt_replace ? G_BUS_NAME_OWNER_FLAGS_REPLACE : 0),
-                             on_bus_acquired,
-                             on_name_acquired,
-                             on_name_lost,
-                             NULL,
-                             NULL);
+  on_bus_acquired (session_bus);
 
   g_main_loop_run (loop);
 
-  g_bus_unown_name (owner_id);
+  if (owner_id)
+    g_bus_unown_name (owner_id);
   g_main_loop_unref (loop);
 
   return 0;
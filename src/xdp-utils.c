@@ -25,14 +25,24 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <mntent.h>
 #include <unistd.h>
 #include <sys/vfs.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#if defined(HAVE_MALLOC_TRIM) || defined(HAVE_MALLINFO2)
+#include <malloc.h>
+#endif
 
 #include <gio/gdesktopappinfo.h>
+#include <glib-unix.h>
 
 #include "xdp-utils.h"
 
@@ -41,7 +51,30 @@
 #define DBUS_PATH_DBUS "/org/freedesktop/DBus"
 
 G_LOCK_DEFINE (app_infos);
-static GHashTable *app_info_by_unique_name;
+static GHashTable *app_info_by_unique_name; /* sender -> AppInfoCacheEntry */
+
+/* Most recently used first. Peers are normally dropped when they leave
+ * the bus, the bound is for when that is missed. */
+#define APP_INFO_CACHE_SIZE 1024
+static GQueue app_info_lru = G_QUEUE_INIT;
+static XdpAppInfoCacheStats app_info_cache_stats;
+
+/* Lookups in flight, so that concurrent callers for the same sender
+ * share one. Protected by app_infos, finished lookups are signalled on
+ * app_info_lookups_cond. */
+typedef struct {
+  GPtrArray *tasks; /* Async callers waiting for the result */
+  gboolean peer_died; /* Don't cache the result */
+} AppInfoLookup;
+
+static GHashTable *app_info_lookups; /* sender -> AppInfoLookup */
+static GCond app_info_lookups_cond;
+
+/* Max number of background lookups for new peers per second, 0 to
+ * disable. See xdp_set_app_info_prewarm(). */
+static guint prewarm_rate;
+static gint64 prewarm_window_start;
+static guint prewarm_window_count;
 
 /* Based on g_mkstemp from glib */
 
@@ -115,16 +148,29 @@ typedef enum
   XDP_APP_INFO_KIND_SNAP    = 2,
 } XdpAppInfoKind;
 
+/* What the hot checks need, worked out once when the app info is
+ * created */
+typedef enum
+{
+  XDP_APP_INFO_FLAG_HAS_NETWORK    = 1 << 0,
+  XDP_APP_INFO_FLAG_SUPPORTS_OPATH = 1 << 1,
+  XDP_APP_INFO_FLAG_REMAPS_PATHS   = 1 << 2,
+} XdpAppInfoFlags;
+
 struct _XdpAppInfo {
   volatile gint ref_count;
   char *id;
   XdpAppInfoKind kind;
+  XdpAppInfoFlags flags;
 
   union
     {
       struct
         {
-          GKeyFile *keyfile;
+          /* Only what is needed of .flatpak-info */
+          char *instance_id;
+          char *app_path;
+          char *runtime_path;
 	   /* pid namespace mapping */
           GMutex *pidns_lock;
           ino_t   pidns_id;
@@ -142,6 +188,26 @@ xdp_app_info_new (XdpAppInfoKind kind)
   XdpAppInfo *app_info = g_new0 (XdpAppInfo, 1);
   app_info->ref_count = 1;
   app_info->kind = kind;
+
+  switch (kind)
+    {
+    case XDP_APP_INFO_KIND_FLATPAK:
+      /* Network access comes from .flatpak-info */
+      app_info->flags = XDP_APP_INFO_FLAG_SUPPORTS_OPATH |
+                        XDP_APP_INFO_FLAG_REMAPS_PATHS;
+      break;
+
+    case XDP_APP_INFO_KIND_SNAP:
+      app_info->flags = XDP_APP_INFO_FLAG_HAS_NETWORK; /* FIXME */
+      break;
+
+    case XDP_APP_INFO_KIND_HOST:
+    default:
+      app_info->flags = XDP_APP_INFO_FLAG_HAS_NETWORK |
+                        XDP_APP_INFO_FLAG_SUPPORTS_OPATH;
+      break;
+    }
+
   return app_info;
 }
 
@@ -161,7 +227,9 @@ xdp_app_info_free (XdpAppInfo *app_info)
   switch (app_info->kind)
     {
     case XDP_APP_INFO_KIND_FLATPAK:
-      g_clear_pointer (&app_info->u.flatpak.keyfile, g_key_file_free);
+      g_free (app_info->u.flatpak.instance_id);
+      g_free (app_info->u.flatpak.app_path);
+      g_free (app_info->u.flatpak.runtime_path);
       break;
 
     case XDP_APP_INFO_KIND_SNAP:
@@ -216,6 +284,85 @@ xdp_app_info_load_app_info (XdpAppInfo *app_info)
   return G_APP_INFO (g_desktop_app_info_new (desktop_id));
 }
 
+/* app ID -> display name from its desktop file. Parsing desktop files
+ * is slow enough to matter for portals that show the same apps again
+ * and again, so names are kept until the installed apps change. */
+#define DISPLAY_NAME_CACHE_SIZE 256
+
+G_LOCK_DEFINE_STATIC (display_names);
+static GHashTable *display_names;
+static GAppInfoMonitor *app_info_monitor;
+
+static void
+display_names_clear (void)
+{
+  G_LOCK (display_names);
+  if (display_names)
+    g_hash_table_remove_all (display_names);
+  G_UNLOCK (display_names);
+}
+
+static void
+app_infos_changed (GAppInfoMonitor *monitor,
+                   gpointer         data)
+{
+  display_names_clear ();
+}
+
+/* The monitor reports changes in the thread-default main context of
+ * the first caller, so this shouldn't first be called from a thread
+ * whose context stops running */
+GAppInfoMonitor *
+xdp_get_app_info_monitor (void)
+{
+  if (g_once_init_enter (&app_info_monitor))
+    {
+      GAppInfoMonitor *monitor = g_app_info_monitor_get ();
+
+      g_signal_connect (monitor, "changed", G_CALLBACK (app_infos_changed), NULL);
+      xdp_add_cache_trim_func (display_names_clear);
+      g_once_init_leave (&app_info_monitor, monitor);
+    }
+
+  return app_info_monitor;
+}
+
+/* Returns the name apps are shown with in dialogs and notifications,
+ * or the app ID if it has no desktop file */
+char *
+xdp_get_app_display_name (const char *app_id)
+{
+  g_autofree char *desktop_id = NULL;
+  g_autoptr(GAppInfo) info = NULL;
+  char *name;
+
+  if (app_id[0] == '\0')
+    return g_strdup (app_id);
+
+  xdp_get_app_info_monitor ();
+
+  G_LOCK (display_names);
+  name = display_names ? g_strdup (g_hash_table_lookup (display_names, app_id)) : NULL;
+  G_UNLOCK (display_names);
+
+  if (name)
+    return name;
+
+  desktop_id = g_strconcat (app_id, ".desktop", NULL);
+  info = (GAppInfo *) g_desktop_app_info_new (desktop_id);
+  name = g_strdup (info ? g_app_info_get_display_name (info) : app_id);
+
+  G_LOCK (display_names);
+  if (display_names == NULL)
+    display_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  if (g_hash_table_size (display_names) >= DISPLAY_NAME_CACHE_SIZE)
+    g_hash_table_remove_all (display_names);
+  g_hash_table_replace (display_names, g_strdup (app_id), g_strdup (name));
+  G_UNLOCK (display_names);
+
+  return name;
+}
+
 char **
 xdp_app_info_rewrite_commandline (XdpAppInfo *app_info,
                                   const char * const *commandline)
@@ -261,10 +408,7 @@ xdp_app_info_get_instance (XdpAppInfo *app_info)
   if (app_info->kind != XDP_APP_INFO_KIND_FLATPAK)
     return NULL;
 
-  return g_key_file_get_string (app_info->u.flatpak.keyfile,
-                                FLATPAK_METADATA_GROUP_INSTANCE,
-                                FLATPAK_METADATA_KEY_INSTANCE_ID,
-                                NULL);
+  return g_strdup (app_info->u.flatpak.instance_id);
 }
 
 gboolean
@@ -278,24 +422,17 @@ xdp_app_info_is_host (XdpAppInfo *app_info)
 gboolean
 xdp_app_info_supports_opath (XdpAppInfo  *app_info)
 {
-  return
-    app_info->kind == XDP_APP_INFO_KIND_FLATPAK ||
-    app_info->kind == XDP_APP_INFO_KIND_HOST;
+  return (app_info->flags & XDP_APP_INFO_FLAG_SUPPORTS_OPATH) != 0;
 }
 
 char *
 xdp_app_info_remap_path (XdpAppInfo *app_info,
                          const char *path)
 {
-  if (app_info->kind == XDP_APP_INFO_KIND_FLATPAK)
+  if (app_info->flags & XDP_APP_INFO_FLAG_REMAPS_PATHS)
     {
-      g_autofree char *app_path = g_key_file_get_string (app_info->u.flatpak.keyfile,
-                                                         FLATPAK_METADATA_GROUP_INSTANCE,
-                                                         FLATPAK_METADATA_KEY_APP_PATH, NULL);
-      g_autofree char *runtime_path = g_key_file_get_string (app_info->u.flatpak.keyfile,
-                                                             FLATPAK_METADATA_GROUP_INSTANCE,
-                                                             FLATPAK_METADATA_KEY_RUNTIME_PATH,
-                                                             NULL);
+      const char *app_path = app_info->u.flatpak.app_path;
+      const char *runtime_path = app_info->u.flatpak.runtime_path;
 
       /* For apps we translate /app and /usr to the installed locations.
          Also, we need to rewrite to drop the /newroot prefix added by
@@ -323,252 +460,774 @@ xdp_app_info_remap_path (XdpAppInfo *app_info,
 gboolean
 xdp_app_info_has_network (XdpAppInfo *app_info)
 {
-  gboolean has_network;
+  return (app_info->flags & XDP_APP_INFO_FLAG_HAS_NETWORK) != 0;
+}
 
-  switch (app_info->kind)
-    {
-    case XDP_APP_INFO_KIND_FLATPAK:
-      {
-        g_auto(GStrv) shared = g_key_file_get_string_list (app_info->u.flatpak.keyfile,
-                                                           "Context", "shared",
-                                                           NULL, NULL);
-        if (shared)
-          has_network = g_strv_contains ((const char * const *)shared, "network");
-        else
-          has_network = FALSE;
-      }
-      break;
+typedef struct {
+  XdpAppInfo *app_info;
+  gsize size;
+  GList link;
+} AppInfoCacheEntry;
 
-    case XDP_APP_INFO_KIND_SNAP:
-      has_network = TRUE; /* FIXME */
-      break;
+static gsize
+app_info_get_size (XdpAppInfo *app_info)
+{
+  gsize size = sizeof (XdpAppInfo) + strlen (app_info->id) + 1;
 
-    case XDP_APP_INFO_KIND_HOST:
-    default:
-      has_network = TRUE;
-      break;
+  if (app_info->kind == XDP_APP_INFO_KIND_FLATPAK)
+    {
+      if (app_info->u.flatpak.instance_id)
+        size += strlen (app_info->u.flatpak.instance_id) + 1;
+      if (app_info->u.flatpak.app_path)
+        size += strlen (app_info->u.flatpak.app_path) + 1;
+      if (app_info->u.flatpak.runtime_path)
+        size += strlen (app_info->u.flatpak.runtime_path) + 1;
     }
 
-  return has_network;
+  return size;
 }
 
+/* Called with app_infos locked */
 static void
-ensure_app_info_by_unique_name (void)
+app_info_cache_entry_free (AppInfoCacheEntry *entry)
 {
-  if (app_info_by_unique_name == NULL)
-    app_info_by_unique_name = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                     g_free,
-                                                     (GDestroyNotify)xdp_app_info_unref);
+  g_queue_unlink (&app_info_lru, &entry->link);
+  app_info_cache_stats.bytes -= entry->size;
+  xdp_app_info_unref (entry->app_info);
+  g_free (entry);
 }
 
-/* Returns NULL with error set on failure, NULL with no error set if not a flatpak, and app-info otherwise */
+/* Called with app_infos locked */
 static XdpAppInfo *
-parse_app_info_from_flatpak_info (int pid, GError **error)
+app_info_cache_lookup (const char *sender)
 {
-  g_autofree char *root_path = NULL;
-  int root_fd = -1;
-  int info_fd = -1;
-  struct stat stat_buf;
-  g_autoptr(GError) local_error = NULL;
-  g_autoptr(GMappedFile) mapped = NULL;
-  g_autoptr(GKeyFile) metadata = NULL;
-  g_autoptr(XdpAppInfo) app_info = NULL;
-  const char *group;
-  g_autofree char *id = NULL;
-
-  root_path = g_strdup_printf ("/proc/%u/root", pid);
-  root_fd = openat (AT_FDCWD, root_path, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
-  if (root_fd == -1)
-    {
-      if (errno == EACCES)
-        {
-          struct statfs buf;
+  AppInfoCacheEntry *entry = NULL;
 
-          /* Access to the root dir isn't allowed. This can happen if the root is on a fuse
-           * filesystem, such as in a toolbox container. We will never have a fuse rootfs
-           * in the flatpak case, so in that case its safe to ignore this and
-           * continue to detect other types of apps.
-           */
-          if (statfs (root_path, &buf) == 0 &&
-              buf.f_type == 0x65735546) /* FUSE_SUPER_MAGIC */
-            return NULL;
-        }
+  if (app_info_by_unique_name)
+    entry = g_hash_table_lookup (app_info_by_unique_name, sender);
 
-      /* Otherwise, we should be able to open the root dir. Probably the app died and
-         we're failing due to /proc/$pid not existing. In that case fail instead
-         of treating this as privileged. */
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Unable to open %s", root_path);
+  if (entry == NULL)
+    {
+      app_info_cache_stats.misses++;
       return NULL;
     }
 
-  metadata = g_key_file_new ();
-
-  info_fd = openat (root_fd, ".flatpak-info", O_RDONLY | O_CLOEXEC | O_NOCTTY);
-  close (root_fd);
-  if (info_fd == -1)
-    {
-      if (errno == ENOENT)
-        {
-          /* No file => on the host, return NULL with no error */
-          return NULL;
-        }
+  app_info_cache_stats.hits++;
+  g_queue_unlink (&app_info_lru, &entry->link);
+  g_queue_push_head_link (&app_info_lru, &entry->link);
 
-      /* Some weird error => failure */
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Unable to open application info file");
-      return NULL;
-    }
+  return xdp_app_info_ref (entry->app_info);
+}
 
-  if (fstat (info_fd, &stat_buf) != 0 || !S_ISREG (stat_buf.st_mode))
-    {
-      /* Some weird fd => failure */
-      close (info_fd);
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Unable to open application info file");
-      return NULL;
-    }
+/* Called with app_infos locked */
+static void
+app_info_cache_insert (const char *sender,
+                       XdpAppInfo *app_info)
+{
+  AppInfoCacheEntry *entry;
+  char *key;
 
-  mapped = g_mapped_file_new_from_fd  (info_fd, FALSE, &local_error);
-  if (mapped == NULL)
-    {
-      close (info_fd);
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Can't map .flatpak-info file: %s", local_error->message);
-      return NULL;
-    }
+  if (app_info_by_unique_name == NULL)
+    app_info_by_unique_name = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free,
+                                                     (GDestroyNotify) app_info_cache_entry_free);
 
-  if (!g_key_file_load_from_data (metadata,
-                                  g_mapped_file_get_contents (mapped),
-                                  g_mapped_file_get_length (mapped),
-                                  G_KEY_FILE_NONE, &local_error))
-    {
-      close (info_fd);
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Can't load .flatpak-info file: %s", local_error->message);
-      return NULL;
-    }
+  key = g_strdup (sender);
+  entry = g_new0 (AppInfoCacheEntry, 1);
+  entry->app_info = xdp_app_info_ref (app_info);
+  entry->size = app_info_get_size (app_info) + strlen (key) + 1 + sizeof (AppInfoCacheEntry);
+  entry->link.data = key;
 
-  group = "Application";
-  if (g_key_file_has_group (metadata, "Runtime"))
-    group = "Runtime";
+  g_hash_table_replace (app_info_by_unique_name, key, entry);
+  g_queue_push_head_link (&app_info_lru, &entry->link);
+  app_info_cache_stats.bytes += entry->size;
 
-  id = g_key_file_get_string (metadata, group, "name", error);
-  if (id == NULL)
+  while (app_info_lru.length > APP_INFO_CACHE_SIZE)
     {
-      close (info_fd);
-      return NULL;
+      GList *oldest = g_queue_peek_tail_link (&app_info_lru);
+
+      app_info_cache_stats.evictions++;
+      g_hash_table_remove (app_info_by_unique_name, oldest->data);
     }
 
-  close (info_fd);
+  app_info_cache_stats.size = app_info_lru.length;
+}
 
-  app_info = xdp_app_info_new (XDP_APP_INFO_KIND_FLATPAK);
-  app_info->id = g_steal_pointer (&id);
-  app_info->u.flatpak.keyfile = g_steal_pointer (&metadata);
+/* Called with app_infos locked */
+static void
+app_info_cache_remove (const char *sender)
+{
+  if (app_info_by_unique_name)
+    g_hash_table_remove (app_info_by_unique_name, sender);
+  app_info_cache_stats.size = app_info_lru.length;
+}
 
-  return g_steal_pointer (&app_info);
+void
+xdp_app_info_get_cache_stats (XdpAppInfoCacheStats *stats)
+{
+  G_LOCK (app_infos);
+  *stats = app_info_cache_stats;
+  G_UNLOCK (app_infos);
 }
 
-static gboolean
-aa_is_enabled (void)
+static void
+app_info_cache_clear (void)
 {
-  static int apparmor_enabled = -1;
-  struct stat statbuf;
-  struct mntent *mntpt;
-  FILE *mntfile;
+  G_LOCK (app_infos);
+  if (app_info_by_unique_name)
+    g_hash_table_remove_all (app_info_by_unique_name);
+  app_info_cache_stats.size = app_info_lru.length;
+  G_UNLOCK (app_infos);
+}
 
-  if (apparmor_enabled >= 0)
-    return apparmor_enabled;
+static void pid_maps_clear (void);
 
-  apparmor_enabled = FALSE;
+/* Caches that can be rebuilt on demand, dropped on memory pressure */
+G_LOCK_DEFINE_STATIC (cache_trim_funcs);
+static GArray *cache_trim_funcs;
 
-  mntfile = setmntent ("/proc/mounts", "r");
-  if (!mntfile)
-    return FALSE;
+void
+xdp_add_cache_trim_func (XdpCacheTrimFunc func)
+{
+  G_LOCK (cache_trim_funcs);
+  if (cache_trim_funcs == NULL)
+    cache_trim_funcs = g_array_new (FALSE, FALSE, sizeof (XdpCacheTrimFunc));
+  g_array_append_val (cache_trim_funcs, func);
+  G_UNLOCK (cache_trim_funcs);
+}
 
-  while ((mntpt = getmntent (mntfile)))
+void
+xdp_trim_caches (void)
+{
+  g_autoptr(GArray) funcs = NULL;
+  guint i;
+
+  G_LOCK (cache_trim_funcs);
+  if (cache_trim_funcs)
     {
-      g_autofree char *proposed = NULL;
+      funcs = g_array_sized_new (FALSE, FALSE, sizeof (XdpCacheTrimFunc), cache_trim_funcs->len);
+      g_array_append_vals (funcs, cache_trim_funcs->data, cache_trim_funcs->len);
+    }
+  G_UNLOCK (cache_trim_funcs);
 
-      if (strcmp (mntpt->mnt_type, "securityfs") != 0)
-        continue;
+  g_debug ("Trimming caches");
 
-      proposed = g_strdup_printf ("%s/apparmor", mntpt->mnt_dir);
-      if (stat (proposed, &statbuf) == 0)
-        {
-          apparmor_enabled = TRUE;
-          break;
-        }
-    }
+  app_info_cache_clear ();
+  pid_maps_clear ();
 
-  endmntent (mntfile);
+  for (i = 0; funcs && i < funcs->len; i++)
+    g_array_index (funcs, XdpCacheTrimFunc, i) ();
 
-  return apparmor_enabled;
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim (0);
+#endif
 }
 
-#define UNCONFINED		"unconfined"
-#define UNCONFINED_SIZE		strlen(UNCONFINED)
+/* Estimates of the memory held by each subsystem, so growth over a
+ * long session can be attributed. Each func appends the usage of its
+ * own structures. */
+G_LOCK_DEFINE_STATIC (memory_usage_funcs);
+static GArray *memory_usage_funcs;
 
-static gboolean
-parse_unconfined (char *con, int size)
+void
+xdp_add_memory_usage_func (XdpMemoryUsageFunc func)
 {
-  return size == UNCONFINED_SIZE && strncmp (con, UNCONFINED, UNCONFINED_SIZE) == 0;
+  G_LOCK (memory_usage_funcs);
+  if (memory_usage_funcs == NULL)
+    memory_usage_funcs = g_array_new (FALSE, FALSE, sizeof (XdpMemoryUsageFunc));
+  g_array_append_val (memory_usage_funcs, func);
+  G_UNLOCK (memory_usage_funcs);
 }
 
-static char *
-aa_splitcon (char *con, char **mode)
+void
+xdp_memory_usage_add (GArray     *usage,
+                      const char *name,
+                      guint64     objects,
+                      guint64     bytes)
 {
-  char *label = NULL;
-  char *mode_str = NULL;
-  char *newline = NULL;
-  int size = strlen (con);
+  XdpMemoryUsage entry = { name, objects, bytes };
 
-  if (size == 0)
-    return NULL;
+  g_array_append_val (usage, entry);
+}
 
-  /* Strip newline */
-  if (con[size - 1] == '\n')
-    {
-      newline = &con[size - 1];
-      size--;
-    }
+static GArray *
+collect_memory_usage (void)
+{
+  g_autoptr(GArray) funcs = NULL;
+  XdpAppInfoCacheStats cache_stats;
+  GArray *usage;
+  guint i;
 
-  if (parse_unconfined (con, size))
+  G_LOCK (memory_usage_funcs);
+  if (memory_usage_funcs)
     {
-      label = con;
+      funcs = g_array_sized_new (FALSE, FALSE, sizeof (XdpMemoryUsageFunc), memory_usage_funcs->len);
+      g_array_append_vals (funcs, memory_usage_funcs->data, memory_usage_funcs->len);
     }
-  else if (size > 3 && con[size - 1] == ')')
-    {
-      int pos = size - 2;
+  G_UNLOCK (memory_usage_funcs);
 
-      while (pos > 0 && !(con[pos] == ' ' && con[pos + 1] == '('))
-        pos--;
+  usage = g_array_new (FALSE, FALSE, sizeof (XdpMemoryUsage));
 
-      if (pos > 0)
-        {
-          con[pos] = 0; /* overwrite ' ' */
-          con[size - 1] = 0; /* overwrite trailing ) */
-          mode_str = &con[pos + 2]; /* skip '(' */
-          label = con;
-        }
-    }
+  xdp_app_info_get_cache_stats (&cache_stats);
+  xdp_memory_usage_add (usage, "app-info-cache", cache_stats.size, cache_stats.bytes);
 
-  if (label && newline)
-    *newline = 0; /* overwrite '\n', if requested, on success */
-  if (mode)
-    *mode = mode_str;
+  for (i = 0; funcs && i < funcs->len; i++)
+    g_array_index (funcs, XdpMemoryUsageFunc, i) (usage);
 
-  return label;
+#ifdef HAVE_MALLINFO2
+  {
+    struct mallinfo2 info = mallinfo2 ();
+
+    /* What the counters above don't account for shows up here */
+    xdp_memory_usage_add (usage, "heap-in-use", 0, info.uordblks + info.hblkhd);
+    xdp_memory_usage_add (usage, "heap-free", 0, info.fordblks);
+  }
+#endif
+
+  return usage;
 }
 
-static XdpAppInfo *
-parse_app_info_from_security_label (const char *security_label)
+/* Returns a{s(tt)}, name -> (objects, bytes) */
+GVariant *
+xdp_get_memory_usage (void)
 {
-  char *label, *dot;
-  g_autofree char *snap_name = NULL;
-  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GArray) usage = collect_memory_usage ();
+  GVariantBuilder builder;
+  guint i;
 
-  /* Snap confinement requires AppArmor */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(tt)}"));
+  for (i = 0; i < usage->len; i++)
+    {
+      XdpMemoryUsage *entry = &g_array_index (usage, XdpMemoryUsage, i);
+
+      g_variant_builder_add (&builder, "{s(tt)}", entry->name,
+                             entry->objects, entry->bytes);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+char *
+xdp_memory_usage_summary (void)
+{
+  g_autoptr(GArray) usage = collect_memory_usage ();
+  GString *summary = g_string_new ("");
+  guint i;
+
+  for (i = 0; i < usage->len; i++)
+    {
+      XdpMemoryUsage *entry = &g_array_index (usage, XdpMemoryUsage, i);
+
+      g_string_append_printf (summary, "%-24s %10" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " bytes\n",
+                              entry->name, entry->objects, entry->bytes);
+    }
+
+  return g_string_free (summary, FALSE);
+}
+
+static gboolean
+dump_memory_usage (gpointer user_data)
+{
+  g_autofree char *summary = xdp_memory_usage_summary ();
+
+  g_message ("Memory usage (objects, bytes):\n%s", summary);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Dumps the memory usage summary on SIGUSR1 */
+void
+xdp_dump_memory_usage_on_signal (void)
+{
+  g_unix_signal_add (SIGUSR1, dump_memory_usage, NULL);
+}
+
+/* Debug output is written by a flusher thread, so that threads logging
+ * on hot paths don't block on a slow stdout (e.g. journald). Lines are
+ * dropped rather than queued without bound if the reader can't keep
+ * up. */
+#define MAX_QUEUED_LOG_LINES 8192
+
+static GAsyncQueue *log_queue;
+static GThread *log_thread;
+static guint log_lines_dropped; /* atomic */
+static char log_flush_marker;
+
+static GMutex log_flush_mutex;
+static GCond log_flush_cond;
+static guint64 log_flush_serial;
+
+G_LOCK_DEFINE_STATIC (log_domains);
+static GHashTable *log_handlers; /* domain -> handler id */
+
+static gpointer
+log_flusher (gpointer data)
+{
+  while (TRUE)
+    {
+      char *line = g_async_queue_pop (log_queue);
+      guint dropped;
+
+      if (line == &log_flush_marker)
+        {
+          fflush (stdout);
+          g_mutex_lock (&log_flush_mutex);
+          log_flush_serial++;
+          g_cond_broadcast (&log_flush_cond);
+          g_mutex_unlock (&log_flush_mutex);
+          continue;
+        }
+
+      fputs (line, stdout);
+      g_free (line);
+
+      dropped = g_atomic_int_and (&log_lines_dropped, 0);
+      if (dropped > 0)
+        printf ("XDP: %u log messages dropped\n", dropped);
+
+      /* Batch writes while more lines are queued */
+      if (g_async_queue_length (log_queue) <= 0)
+        fflush (stdout);
+    }
+
+  return NULL;
+}
+
+static void
+xdp_log_start (void)
+{
+  static gsize started = 0;
+
+  if (g_once_init_enter (&started))
+    {
+      log_queue = g_async_queue_new ();
+      log_thread = g_thread_new ("log flusher", log_flusher, NULL);
+      atexit (xdp_log_flush);
+      g_once_init_leave (&started, 1);
+    }
+}
+
+/* Takes ownership of line, which should end with a newline */
+void
+xdp_log_write (char *line)
+{
+  if (log_queue == NULL)
+    {
+      fputs (line, stdout);
+      g_free (line);
+      return;
+    }
+
+  if (g_async_queue_length (log_queue) >= MAX_QUEUED_LOG_LINES)
+    {
+      g_atomic_int_inc (&log_lines_dropped);
+      g_free (line);
+      return;
+    }
+
+  g_async_queue_push (log_queue, line);
+}
+
+/* Waits until the lines logged so far have been written */
+void
+xdp_log_flush (void)
+{
+  guint64 serial;
+
+  if (log_queue == NULL || g_thread_self () == log_thread)
+    {
+      fflush (stdout);
+      return;
+    }
+
+  g_mutex_lock (&log_flush_mutex);
+  serial = log_flush_serial;
+  g_async_queue_push (log_queue, &log_flush_marker);
+  while (log_flush_serial == serial)
+    g_cond_wait (&log_flush_cond, &log_flush_mutex);
+  g_mutex_unlock (&log_flush_mutex);
+}
+
+/* Routes debug messages of the given log domains to handler, and stops
+ * routing them for the domains that were set before but aren't listed
+ * anymore. Can be called again at any time, e.g. from a D-Bus method. */
+void
+xdp_log_set_debug_domains (const char * const *domains,
+                           GLogFunc            handler)
+{
+  g_autoptr(GHashTable) old_handlers = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  gsize i;
+
+  if (domains && domains[0])
+    xdp_log_start ();
+
+  G_LOCK (log_domains);
+
+  old_handlers = g_steal_pointer (&log_handlers);
+  log_handlers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (i = 0; domains && domains[i]; i++)
+    {
+      if (old_handlers && g_hash_table_steal_extended (old_handlers, domains[i], &key, &value))
+        {
+          g_hash_table_insert (log_handlers, key, value);
+          continue;
+        }
+
+      if (g_hash_table_contains (log_handlers, domains[i]))
+        continue;
+
+      g_hash_table_insert (log_handlers, g_strdup (domains[i]),
+                           GUINT_TO_POINTER (g_log_set_handler (domains[i], G_LOG_LEVEL_DEBUG,
+                                                                handler, NULL)));
+    }
+
+  if (old_handlers)
+    {
+      g_hash_table_iter_init (&iter, old_handlers);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        g_log_remove_handler (key, GPOINTER_TO_UINT (value));
+    }
+
+  G_UNLOCK (log_domains);
+}
+
+gboolean
+xdp_log_debug_domain_enabled (const char *domain)
+{
+  gboolean enabled;
+
+  G_LOCK (log_domains);
+  enabled = log_handlers && g_hash_table_contains (log_handlers, domain);
+  G_UNLOCK (log_domains);
+
+  return enabled;
+}
+
+/* Parsed .flatpak-info files, shared by all the connections of a
+ * flatpak instance. They are found by the file they were read from,
+ * which is kept open so that its inode can't be reused while cached.
+ * Entries go away once no connection uses them or the instance dir is
+ * removed, see sweep_instance_infos(). */
+typedef struct {
+  int info_fd;
+  char *instance_dir; /* NULL if unknown */
+  XdpAppInfo *app_info;
+} InstanceInfo;
+
+G_LOCK_DEFINE_STATIC (instance_infos);
+static GHashTable *instance_infos; /* "dev:ino" -> InstanceInfo */
+
+static void
+instance_info_free (InstanceInfo *info)
+{
+  close (info->info_fd);
+  g_free (info->instance_dir);
+  xdp_app_info_unref (info->app_info);
+  g_free (info);
+}
+
+static char *
+instance_info_key (struct stat *stat_buf)
+{
+  return g_strdup_printf ("%" G_GINT64_MODIFIER "x:%" G_GINT64_MODIFIER "x",
+                          (guint64) stat_buf->st_dev, (guint64) stat_buf->st_ino);
+}
+
+static XdpAppInfo *
+lookup_instance_info (struct stat *stat_buf)
+{
+  g_autofree char *key = instance_info_key (stat_buf);
+  XdpAppInfo *app_info = NULL;
+  InstanceInfo *info;
+
+  G_LOCK (instance_infos);
+  if (instance_infos)
+    {
+      info = g_hash_table_lookup (instance_infos, key);
+      if (info)
+        app_info = xdp_app_info_ref (info->app_info);
+    }
+  G_UNLOCK (instance_infos);
+
+  return app_info;
+}
+
+/* Takes ownership of info_fd */
+static void
+cache_instance_info (int          info_fd,
+                     struct stat *stat_buf,
+                     XdpAppInfo  *app_info)
+{
+  InstanceInfo *info = g_new0 (InstanceInfo, 1);
+  g_autofree char *instance = xdp_app_info_get_instance (app_info);
+
+  info->info_fd = info_fd;
+  info->app_info = xdp_app_info_ref (app_info);
+  if (instance)
+    info->instance_dir = g_build_filename (g_get_user_runtime_dir (), ".flatpak", instance, NULL);
+
+  G_LOCK (instance_infos);
+  if (instance_infos == NULL)
+    instance_infos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) instance_info_free);
+  g_hash_table_replace (instance_infos, instance_info_key (stat_buf), info);
+  G_UNLOCK (instance_infos);
+}
+
+static void
+sweep_instance_infos (void)
+{
+  GHashTableIter iter;
+  InstanceInfo *info;
+
+  G_LOCK (instance_infos);
+  if (instance_infos)
+    {
+      g_hash_table_iter_init (&iter, instance_infos);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &info))
+        {
+          /* Only referenced by us */
+          if (g_atomic_int_get (&info->app_info->ref_count) == 1 ||
+              (info->instance_dir && !g_file_test (info->instance_dir, G_FILE_TEST_IS_DIR)))
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+  G_UNLOCK (instance_infos);
+}
+
+/* Returns NULL with error set on failure, NULL with no error set if not a flatpak, and app-info otherwise */
+static XdpAppInfo *
+parse_app_info_from_flatpak_info (int pid, GError **error)
+{
+  g_autofree char *root_path = NULL;
+  int root_fd = -1;
+  int info_fd = -1;
+  struct stat stat_buf;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GKeyFile) metadata = NULL;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  const char *group;
+  g_autofree char *id = NULL;
+  g_auto(GStrv) shared = NULL;
+
+  root_path = g_strdup_printf ("/proc/%u/root", pid);
+  root_fd = openat (AT_FDCWD, root_path, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
+  if (root_fd == -1)
+    {
+      if (errno == EACCES)
+        {
+          struct statfs buf;
+
+          /* Access to the root dir isn't allowed. This can happen if the root is on a fuse
+           * filesystem, such as in a toolbox container. We will never have a fuse rootfs
+           * in the flatpak case, so in that case its safe to ignore this and
+           * continue to detect other types of apps.
+           */
+          if (statfs (root_path, &buf) == 0 &&
+              buf.f_type == 0x65735546) /* FUSE_SUPER_MAGIC */
+            return NULL;
+        }
+
+      /* Otherwise, we should be able to open the root dir. Probably the app died and
+         we're failing due to /proc/$pid not existing. In that case fail instead
+         of treating this as privileged. */
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unable to open %s", root_path);
+      return NULL;
+    }
+
+  metadata = g_key_file_new ();
+
+  info_fd = openat (root_fd, ".flatpak-info", O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  close (root_fd);
+  if (info_fd == -1)
+    {
+      if (errno == ENOENT)
+        {
+          /* No file => on the host, return NULL with no error */
+          return NULL;
+        }
+
+      /* Some weird error => failure */
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unable to open application info file");
+      return NULL;
+    }
+
+  if (fstat (info_fd, &stat_buf) != 0 || !S_ISREG (stat_buf.st_mode))
+    {
+      /* Some weird fd => failure */
+      close (info_fd);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unable to open application info file");
+      return NULL;
+    }
+
+  app_info = lookup_instance_info (&stat_buf);
+  if (app_info)
+    {
+      close (info_fd);
+      return g_steal_pointer (&app_info);
+    }
+
+  mapped = g_mapped_file_new_from_fd  (info_fd, FALSE, &local_error);
+  if (mapped == NULL)
+    {
+      close (info_fd);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Can't map .flatpak-info file: %s", local_error->message);
+      return NULL;
+    }
+
+  if (!g_key_file_load_from_data (metadata,
+                                  g_mapped_file_get_contents (mapped),
+                                  g_mapped_file_get_length (mapped),
+                                  G_KEY_FILE_NONE, &local_error))
+    {
+      close (info_fd);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Can't load .flatpak-info file: %s", local_error->message);
+      return NULL;
+    }
+
+  group = "Application";
+  if (g_key_file_has_group (metadata, "Runtime"))
+    group = "Runtime";
+
+  id = g_key_file_get_string (metadata, group, "name", error);
+  if (id == NULL)
+    {
+      close (info_fd);
+      return NULL;
+    }
+
+  app_info = xdp_app_info_new (XDP_APP_INFO_KIND_FLATPAK);
+  app_info->id = g_steal_pointer (&id);
+  app_info->u.flatpak.instance_id = g_key_file_get_string (metadata,
+                                                           FLATPAK_METADATA_GROUP_INSTANCE,
+                                                           FLATPAK_METADATA_KEY_INSTANCE_ID,
+                                                           NULL);
+  app_info->u.flatpak.app_path = g_key_file_get_string (metadata,
+                                                        FLATPAK_METADATA_GROUP_INSTANCE,
+                                                        FLATPAK_METADATA_KEY_APP_PATH,
+                                                        NULL);
+  app_info->u.flatpak.runtime_path = g_key_file_get_string (metadata,
+                                                            FLATPAK_METADATA_GROUP_INSTANCE,
+                                                            FLATPAK_METADATA_KEY_RUNTIME_PATH,
+                                                            NULL);
+  shared = g_key_file_get_string_list (metadata, "Context", "shared", NULL, NULL);
+  if (shared != NULL && g_strv_contains ((const char * const *) shared, "network"))
+    app_info->flags |= XDP_APP_INFO_FLAG_HAS_NETWORK;
+
+  cache_instance_info (info_fd, &stat_buf, app_info); /* Takes ownership of info_fd */
+
+  return g_steal_pointer (&app_info);
+}
+
+static gboolean
+aa_is_enabled (void)
+{
+  static int apparmor_enabled = -1;
+  struct stat statbuf;
+  struct mntent *mntpt;
+  FILE *mntfile;
+
+  if (apparmor_enabled >= 0)
+    return apparmor_enabled;
+
+  apparmor_enabled = FALSE;
+
+  mntfile = setmntent ("/proc/mounts", "r");
+  if (!mntfile)
+    return FALSE;
+
+  while ((mntpt = getmntent (mntfile)))
+    {
+      g_autofree char *proposed = NULL;
+
+      if (strcmp (mntpt->mnt_type, "securityfs") != 0)
+        continue;
+
+      proposed = g_strdup_printf ("%s/apparmor", mntpt->mnt_dir);
+      if (stat (proposed, &statbuf) == 0)
+        {
+          apparmor_enabled = TRUE;
+          break;
+        }
+    }
+
+  endmntent (mntfile);
+
+  return apparmor_enabled;
+}
+
+#define UNCONFINED		"unconfined"
+#define UNCONFINED_SIZE		strlen(UNCONFINED)
+
+static gboolean
+parse_unconfined (char *con, int size)
+{
+  return size == UNCONFINED_SIZE && strncmp (con, UNCONFINED, UNCONFINED_SIZE) == 0;
+}
+
+static char *
+aa_splitcon (char *con, char **mode)
+{
+  char *label = NULL;
+  char *mode_str = NULL;
+  char *newline = NULL;
+  int size = strlen (con);
+
+  if (size == 0)
+    return NULL;
+
+  /* Strip newline */
+  if (con[size - 1] == '\n')
+    {
+      newline = &con[size - 1];
+      size--;
+    }
+
+  if (parse_unconfined (con, size))
+    {
+      label = con;
+    }
+  else if (size > 3 && con[size - 1] == ')')
+    {
+      int pos = size - 2;
+
+      while (pos > 0 && !(con[pos] == ' ' && con[pos + 1] == '('))
+        pos--;
+
+      if (pos > 0)
+        {
+          con[pos] = 0; /* overwrite ' ' */
+          con[size - 1] = 0; /* overwrite trailing ) */
+          mode_str = &con[pos + 2]; /* skip '(' */
+          label = con;
+        }
+    }
+
+  if (label && newline)
+    *newline = 0; /* overwrite '\n', if requested, on success */
+  if (mode)
+    *mode = mode_str;
+
+  return label;
+}
+
+static XdpAppInfo *
+parse_app_info_from_security_label (const char *security_label)
+{
+  char *label, *dot;
+  g_autofree char *snap_name = NULL;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+
+  /* Snap confinement requires AppArmor */
   if (aa_is_enabled ())
     {
       /* Parse the security label as an AppArmor context.  We take a copy
@@ -582,60 +1241,272 @@ parse_app_info_from_security_label (const char *security_label)
            * snap.$PACKAGE.$APPLICATION.  We want to extract the package
            * name */
 
-          label += 5;
-          dot = strchr (label, '.');
-          if (!dot)
-            return NULL;
-          snap_name = g_strndup (label, dot - label);
+          label += 5;
+          dot = strchr (label, '.');
+          if (!dot)
+            return NULL;
+          snap_name = g_strndup (label, dot - label);
+
+          app_info = xdp_app_info_new (XDP_APP_INFO_KIND_SNAP);
+          app_info->id = g_strconcat ("snap.", snap_name, NULL);
+
+          return g_steal_pointer (&app_info);
+        }
+    }
+
+  return NULL;
+}
+
+
+XdpAppInfo *
+xdp_get_app_info_from_pid (pid_t pid,
+                           GError **error)
+{
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  /* TODO: Handle snap support via apparmor here */
+
+  app_info = parse_app_info_from_flatpak_info (pid, &local_error);
+  if (app_info == NULL && local_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  if (app_info == NULL)
+    app_info = xdp_app_info_new_host ();
+
+  return g_steal_pointer (&app_info);
+}
+
+static XdpAppInfo *
+app_info_from_credentials (GVariant  *credentials,
+                           GError   **error)
+{
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GVariantIter) iter = NULL;
+  const char *key;
+  GVariant *value;
+  g_autofree char *security_label = NULL;
+  guint32 pid = 0;
+
+  g_variant_get (credentials, "(a{sv})", &iter);
+  while (g_variant_iter_loop (iter, "{&sv}", &key, &value))
+    {
+      if (strcmp (key, "ProcessID") == 0)
+        pid = g_variant_get_uint32 (value);
+      else if (strcmp (key, "LinuxSecurityLabel") == 0)
+        {
+          g_clear_pointer (&security_label, g_free);
+          security_label = g_variant_dup_bytestring (value, NULL);
+        }
+    }
+
+  if (app_info == NULL && security_label != NULL)
+    {
+      app_info = parse_app_info_from_security_label (security_label);
+    }
+
+  if (app_info == NULL)
+    {
+      g_autoptr(GError) local_error = NULL;
+      app_info = parse_app_info_from_flatpak_info (pid, &local_error);
+      if (app_info == NULL && local_error)
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return NULL;
+        }
+    }
+
+  if (app_info == NULL)
+    app_info = xdp_app_info_new_host ();
+
+  return g_steal_pointer (&app_info);
+}
+
+static GDBusMessage *
+new_get_credentials_message (const char *sender)
+{
+  GDBusMessage *msg;
+
+  msg = g_dbus_message_new_method_call (DBUS_NAME_DBUS,
+                                        DBUS_PATH_DBUS,
+                                        DBUS_INTERFACE_DBUS,
+                                        "GetConnectionCredentials");
+  g_dbus_message_set_body (msg, g_variant_new ("(s)", sender));
+
+  return msg;
+}
+
+/* Looks up the cache, or else registers a lookup for sender. Returns
+ * TRUE if the caller should run the lookup. If another lookup is in
+ * flight, task is queued on it, or without a task this waits for it
+ * and checks the cache again. Called with app_infos locked. */
+static gboolean
+start_app_info_lookup (const char  *sender,
+                       GTask       *task,
+                       XdpAppInfo **app_info_out)
+{
+  AppInfoLookup *lookup;
+
+  *app_info_out = NULL;
+
+  while (TRUE)
+    {
+      *app_info_out = app_info_cache_lookup (sender);
+      if (*app_info_out)
+        return FALSE;
+
+      if (app_info_lookups == NULL)
+        app_info_lookups = g_hash_table_new (g_str_hash, g_str_equal);
 
-          app_info = xdp_app_info_new (XDP_APP_INFO_KIND_SNAP);
-          app_info->id = g_strconcat ("snap.", snap_name, NULL);
+      lookup = g_hash_table_lookup (app_info_lookups, sender);
+      if (lookup == NULL)
+        break;
 
-          return g_steal_pointer (&app_info);
+      if (task)
+        {
+          g_ptr_array_add (lookup->tasks, g_object_ref (task));
+          return FALSE;
         }
+
+      /* If the other lookup fails, we try again ourselves */
+      g_cond_wait (&app_info_lookups_cond, &G_LOCK_NAME (app_infos));
     }
 
-  return NULL;
-}
+  lookup = g_new0 (AppInfoLookup, 1);
+  lookup->tasks = g_ptr_array_new_with_free_func (g_object_unref);
+  if (task)
+    g_ptr_array_add (lookup->tasks, g_object_ref (task));
+  g_hash_table_insert (app_info_lookups, g_strdup (sender), lookup);
 
+  return TRUE;
+}
 
-XdpAppInfo *
-xdp_get_app_info_from_pid (pid_t pid,
-                           GError **error)
+/* Caches the result of a lookup started by start_app_info_lookup()
+ * and passes it to everyone waiting for it */
+static void
+finish_app_info_lookup (const char   *sender,
+                        XdpAppInfo   *app_info,
+                        const GError *error)
 {
-  g_autoptr(XdpAppInfo) app_info = NULL;
-  g_autoptr(GError) local_error = NULL;
+  gpointer key;
+  gpointer value;
+  AppInfoLookup *lookup = NULL;
+  guint i;
 
-  /* TODO: Handle snap support via apparmor here */
+  G_LOCK (app_infos);
+  if (g_hash_table_steal_extended (app_info_lookups, sender, &key, &value))
+    {
+      g_free (key);
+      lookup = value;
+    }
+  if (app_info && (lookup == NULL || !lookup->peer_died))
+    app_info_cache_insert (sender, app_info);
+  g_cond_broadcast (&app_info_lookups_cond);
+  G_UNLOCK (app_infos);
 
-  app_info = parse_app_info_from_flatpak_info (pid, &local_error);
-  if (app_info == NULL && local_error)
+  if (lookup == NULL)
+    return;
+
+  for (i = 0; i < lookup->tasks->len; i++)
     {
-      g_propagate_error (error, g_steal_pointer (&local_error));
-      return NULL;
+      GTask *task = g_ptr_array_index (lookup->tasks, i);
+
+      if (app_info)
+        g_task_return_pointer (task, xdp_app_info_ref (app_info),
+                               (GDestroyNotify) xdp_app_info_unref);
+      else
+        g_task_return_error (task, g_error_copy (error));
     }
 
-  if (app_info == NULL)
-    app_info = xdp_app_info_new_host ();
+  g_ptr_array_unref (lookup->tasks);
+  g_free (lookup);
+}
 
-  return g_steal_pointer (&app_info);
+/* Unless prewarming needs to see new names, only the names that have
+ * used us are watched, with one arg0 match each, so unrelated name
+ * changes on the bus don't wake us up. The match is added before the
+ * credentials of the name are asked for, so when those arrive a later
+ * disconnect is sure to be reported. */
+G_LOCK_DEFINE_STATIC (watched_names);
+static GDBusConnection *tracked_connection;
+static XdpPeerDiedCallback tracked_peer_died_cb;
+static gboolean track_all_names;
+static GHashTable *watched_names; /* unique name -> subscription id */
+
+static void name_owner_changed (GDBusConnection *connection,
+                                const gchar     *sender_name,
+                                const gchar     *object_path,
+                                const gchar     *interface_name,
+                                const gchar     *signal_name,
+                                GVariant        *parameters,
+                                gpointer         user_data);
+
+static void
+watch_name (GDBusConnection *connection,
+            const char      *name)
+{
+  guint id;
+
+  if (track_all_names || connection != tracked_connection ||
+      name == NULL || name[0] != ':')
+    return;
+
+  G_LOCK (watched_names);
+  if (!g_hash_table_contains (watched_names, name))
+    {
+      /* Signals are delivered to the main thread, whichever thread
+       * the lookup runs in */
+      g_main_context_push_thread_default (NULL);
+      id = g_dbus_connection_signal_subscribe (connection,
+                                               DBUS_NAME_DBUS,
+                                               DBUS_INTERFACE_DBUS,
+                                               "NameOwnerChanged",
+                                               DBUS_PATH_DBUS,
+                                               name,
+                                               G_DBUS_SIGNAL_FLAGS_NONE,
+                                               name_owner_changed,
+                                               tracked_peer_died_cb, NULL);
+      g_main_context_pop_thread_default (NULL);
+
+      g_hash_table_insert (watched_names, g_strdup (name), GUINT_TO_POINTER (id));
+    }
+  G_UNLOCK (watched_names);
 }
 
-static XdpAppInfo *
-lookup_cached_app_info_by_sender (const char *sender)
+static void
+unwatch_name (GDBusConnection *connection,
+              const char      *name)
 {
-  XdpAppInfo *app_info = NULL;
+  gpointer key, value;
+  guint id = 0;
 
-  G_LOCK (app_infos);
-  if (app_info_by_unique_name)
+  if (track_all_names || connection != tracked_connection)
+    return;
+
+  G_LOCK (watched_names);
+  if (g_hash_table_steal_extended (watched_names, name, &key, &value))
     {
-      app_info = g_hash_table_lookup (app_info_by_unique_name, sender);
-      if (app_info)
-        xdp_app_info_ref (app_info);
+      g_free (key);
+      id = GPOINTER_TO_UINT (value);
     }
-  G_UNLOCK (app_infos);
+  G_UNLOCK (watched_names);
 
-  return app_info;
+  if (id != 0)
+    g_dbus_connection_signal_unsubscribe (connection, id);
+}
+
+/* Whether the bus said the name is gone, as opposed to the lookup
+ * failing for some other reason, e.g. a timeout */
+static gboolean
+is_name_has_no_owner_reply (GDBusMessage *reply)
+{
+  return reply != NULL &&
+         g_dbus_message_get_message_type (reply) == G_DBUS_MESSAGE_TYPE_ERROR &&
+         g_strcmp0 (g_dbus_message_get_error_name (reply),
+                    "org.freedesktop.DBus.Error.NameHasNoOwner") == 0;
 }
 
 static XdpAppInfo *
@@ -647,78 +1518,176 @@ xdp_connection_lookup_app_info_sync (GDBusConnection       *connection,
   g_autoptr(GDBusMessage) msg = NULL;
   g_autoptr(GDBusMessage) reply = NULL;
   g_autoptr(XdpAppInfo) app_info = NULL;
-  GVariant *body;
-  g_autoptr(GVariantIter) iter = NULL;
-  const char *key;
-  GVariant *value;
-  g_autofree char *security_label = NULL;
-  guint32 pid = 0;
+  g_autoptr(GError) local_error = NULL;
+  gboolean run_lookup;
 
-  app_info = lookup_cached_app_info_by_sender (sender);
-  if (app_info)
+  G_LOCK (app_infos);
+  run_lookup = start_app_info_lookup (sender, NULL, &app_info);
+  G_UNLOCK (app_infos);
+
+  if (!run_lookup)
     return g_steal_pointer (&app_info);
 
-  msg = g_dbus_message_new_method_call (DBUS_NAME_DBUS,
-                                        DBUS_PATH_DBUS,
-                                        DBUS_INTERFACE_DBUS,
-                                        "GetConnectionCredentials");
-  g_dbus_message_set_body (msg, g_variant_new ("(s)", sender));
+  watch_name (connection, sender);
 
+  msg = new_get_credentials_message (sender);
   reply = g_dbus_connection_send_message_with_reply_sync (connection, msg,
                                                           G_DBUS_SEND_MESSAGE_FLAGS_NONE,
                                                           30000,
                                                           NULL,
                                                           cancellable,
-                                                          error);
-  if (reply == NULL)
-    return NULL;
+                                                          &local_error);
+  if (reply != NULL &&
+      g_dbus_message_get_message_type (reply) == G_DBUS_MESSAGE_TYPE_ERROR)
+    g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED, "Can't find peer app id");
+  else if (reply != NULL)
+    app_info = app_info_from_credentials (g_dbus_message_get_body (reply), &local_error);
 
-  if (g_dbus_message_get_message_type (reply) == G_DBUS_MESSAGE_TYPE_ERROR)
+  finish_app_info_lookup (sender, app_info, local_error);
+
+  if (app_info == NULL)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Can't find peer app id");
+      /* Gone already, maybe without us hearing of it. Otherwise the
+       * match stays, so a later disconnect is still seen. */
+      if (is_name_has_no_owner_reply (reply))
+        unwatch_name (connection, sender);
+      g_propagate_error (error, g_steal_pointer (&local_error));
       return NULL;
     }
 
-  body = g_dbus_message_get_body (reply);
+  return g_steal_pointer (&app_info);
+}
 
-  g_variant_get (body, "(a{sv})", &iter);
-  while (g_variant_iter_loop (iter, "{&sv}", &key, &value))
-    {
-      if (strcmp (key, "ProcessID") == 0)
-        pid = g_variant_get_uint32 (value);
-      else if (strcmp (key, "LinuxSecurityLabel") == 0)
-        {
-          g_clear_pointer (&security_label, g_free);
-          security_label = g_variant_dup_bytestring (value, NULL);
-        }
-    }
+typedef struct {
+  char *sender;
+  GVariant *credentials;
+} AppInfoLookupData;
 
-  if (app_info == NULL && security_label != NULL)
-    {
-      app_info = parse_app_info_from_security_label (security_label);
-    }
+static void
+app_info_lookup_data_free (AppInfoLookupData *data)
+{
+  g_free (data->sender);
+  g_clear_pointer (&data->credentials, g_variant_unref);
+  g_free (data);
+}
 
-  if (app_info == NULL)
+/* Reading .flatpak-info may block, so it is done in a thread */
+static void
+app_info_from_credentials_thread (GTask        *task,
+                                  gpointer      source_object,
+                                  gpointer      task_data,
+                                  GCancellable *cancellable)
+{
+  AppInfoLookupData *data = task_data;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GError) error = NULL;
+
+  app_info = app_info_from_credentials (data->credentials, &error);
+  finish_app_info_lookup (data->sender, app_info, error);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+got_credentials_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  AppInfoLookupData *data = g_task_get_task_data (task);
+  g_autoptr(GDBusMessage) reply = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reply = g_dbus_connection_send_message_with_reply_finish (G_DBUS_CONNECTION (source_object),
+                                                            res, &error);
+  if (reply != NULL &&
+      g_dbus_message_get_message_type (reply) == G_DBUS_MESSAGE_TYPE_ERROR)
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Can't find peer app id");
+
+  if (error)
     {
-      g_autoptr(GError) local_error = NULL;
-      app_info = parse_app_info_from_flatpak_info (pid, &local_error);
-      if (app_info == NULL && local_error)
-        {
-          g_propagate_error (error, g_steal_pointer (&local_error));
-          return NULL;
-        }
+      finish_app_info_lookup (data->sender, NULL, error);
+      if (is_name_has_no_owner_reply (reply))
+        unwatch_name (G_DBUS_CONNECTION (source_object), data->sender);
+      g_task_return_boolean (task, FALSE);
+      return;
     }
 
-  if (app_info == NULL)
-    app_info = xdp_app_info_new_host ();
+  data->credentials = g_variant_ref (g_dbus_message_get_body (reply));
+  g_task_run_in_thread (task, app_info_from_credentials_thread);
+}
+
+/* Like xdp_connection_lookup_app_info_sync(), but doesn't block. Concurrent
+ * lookups for the same sender, sync or not, share one D-Bus round trip. */
+void
+xdp_connection_lookup_app_info (GDBusConnection     *connection,
+                                const char          *sender,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GDBusMessage) msg = NULL;
+  AppInfoLookupData *data;
+  GTask *lookup_task;
+  gboolean run_lookup;
+
+  task = g_task_new (connection, cancellable, callback, user_data);
+  g_task_set_source_tag (task, xdp_connection_lookup_app_info);
 
   G_LOCK (app_infos);
-  ensure_app_info_by_unique_name ();
-  g_hash_table_insert (app_info_by_unique_name, g_strdup (sender),
-                       xdp_app_info_ref (app_info));
+  run_lookup = start_app_info_lookup (sender, task, &app_info);
   G_UNLOCK (app_infos);
 
-  return g_steal_pointer (&app_info);
+  if (app_info)
+    {
+      g_task_return_pointer (task, g_steal_pointer (&app_info),
+                             (GDestroyNotify) xdp_app_info_unref);
+      return;
+    }
+
+  if (!run_lookup)
+    return;
+
+  /* The shared lookup isn't cancelled with any one caller */
+  lookup_task = g_task_new (connection, NULL, NULL, NULL);
+  data = g_new0 (AppInfoLookupData, 1);
+  data->sender = g_strdup (sender);
+  g_task_set_task_data (lookup_task, data, (GDestroyNotify) app_info_lookup_data_free);
+
+  watch_name (connection, sender);
+
+  msg = new_get_credentials_message (sender);
+  g_dbus_connection_send_message_with_reply (connection, msg,
+                                             G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                             30000,
+                                             NULL,
+                                             NULL,
+                                             got_credentials_cb,
+                                             lookup_task);
+}
+
+XdpAppInfo *
+xdp_connection_lookup_app_info_finish (GDBusConnection  *connection,
+                                       GAsyncResult     *result,
+                                       GError          **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, connection), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+void
+xdp_invocation_lookup_app_info (GDBusMethodInvocation *invocation,
+                                GCancellable          *cancellable,
+                                GAsyncReadyCallback    callback,
+                                gpointer               user_data)
+{
+  GDBusConnection *connection = g_dbus_method_invocation_get_connection (invocation);
+  const gchar *sender = g_dbus_method_invocation_get_sender (invocation);
+
+  xdp_connection_lookup_app_info (connection, sender, cancellable, callback, user_data);
 }
 
 XdpAppInfo *
@@ -732,6 +1701,48 @@ xdp_invocation_lookup_app_info_sync (GDBusMethodInvocation *invocation,
   return xdp_connection_lookup_app_info_sync (connection, sender, cancellable, error);
 }
 
+/* Resolves the app info of new peers in the background, so that their
+ * first portal call finds it cached. Every new connection on the bus
+ * causes a lookup, so this is rate-limited to rate per second. */
+void
+xdp_set_app_info_prewarm (guint rate)
+{
+  prewarm_rate = rate;
+}
+
+static void
+prewarm_done_cb (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GError) error = NULL;
+
+  app_info = xdp_connection_lookup_app_info_finish (G_DBUS_CONNECTION (source_object),
+                                                    res, &error);
+  if (app_info == NULL)
+    g_debug ("Failed to prewarm app info: %s", error->message);
+}
+
+static void
+prewarm_app_info (GDBusConnection *connection,
+                  const char      *name)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (now - prewarm_window_start >= G_USEC_PER_SEC)
+    {
+      prewarm_window_start = now;
+      prewarm_window_count = 0;
+    }
+
+  if (prewarm_window_count >= prewarm_rate)
+    return;
+
+  prewarm_window_count++;
+  xdp_connection_lookup_app_info (connection, name, NULL, prewarm_done_cb, NULL);
+}
+
 static void
 name_owner_changed (GDBusConnection *connection,
                     const gchar     *sender_name,
@@ -751,19 +1762,48 @@ name_owner_changed (GDBusConnection *connection,
       strcmp (to, "") == 0)
     {
       G_LOCK (app_infos);
-      if (app_info_by_unique_name)
-        g_hash_table_remove (app_info_by_unique_name, name);
+      app_info_cache_remove (name);
+      if (app_info_lookups)
+        {
+          AppInfoLookup *lookup = g_hash_table_lookup (app_info_lookups, name);
+          if (lookup)
+            lookup->peer_died = TRUE;
+        }
       G_UNLOCK (app_infos);
 
+      /* Unique names are never reused */
+      unwatch_name (connection, name);
+
+      sweep_instance_infos ();
+
       if (peer_died_cb)
         peer_died_cb (name);
     }
+  else if (prewarm_rate > 0 &&
+           name[0] == ':' &&
+           strcmp (from, "") == 0 &&
+           strcmp (name, to) == 0 &&
+           strcmp (name, g_dbus_connection_get_unique_name (connection)) != 0)
+    {
+      prewarm_app_info (connection, name);
+    }
 }
 
+/* Reports the disconnects of the peers that looked up their app info
+ * on connection. Must be called before the first lookup. */
 void
 xdp_connection_track_name_owners (GDBusConnection *connection,
                                   XdpPeerDiedCallback peer_died_cb)
 {
+  tracked_connection = connection;
+  tracked_peer_died_cb = peer_died_cb;
+  watched_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* Prewarming is about names we haven't heard from yet */
+  track_all_names = prewarm_rate > 0;
+  if (!track_all_names)
+    return;
+
   g_dbus_connection_signal_subscribe (connection,
                                       DBUS_NAME_DBUS,
                                       DBUS_INTERFACE_DBUS,
@@ -775,40 +1815,308 @@ xdp_connection_track_name_owners (GDBusConnection *connection,
                                       peer_died_cb, NULL);
 }
 
+/* Blocking portal work runs in our own thread pools rather than in
+ * GLib's shared one, so that background portals can't starve the ones
+ * the user is waiting on. Work that can block on a dialog for as long
+ * as the user takes goes to the unbounded dialog pool, so a few open
+ * dialogs can't hold up everything queued behind them. That pool is
+ * backed by GLib's shared threads and keeps the default scheduling. */
+
+typedef struct {
+  GThreadPool *pool;
+  XdpThreadKind thread_kind;
+  guint max_threads;
+  guint running;
+  guint queued;
+  guint max_queued;
+  guint64 completed;
+} WorkerPool;
+
+typedef struct {
+  WorkerPool *pool;
+  GTask *task;
+  GTaskThreadFunc func;
+} WorkerJob;
+
+G_LOCK_DEFINE_STATIC (worker_pools);
+static WorkerPool worker_pools[XDP_WORKER_POOL_LAST] = {
+  [XDP_WORKER_POOL_INTERACTIVE] = { NULL, XDP_THREAD_KIND_INTERACTIVE, 8, },
+  [XDP_WORKER_POOL_BACKGROUND] = { NULL, XDP_THREAD_KIND_BACKGROUND, 4, },
+  [XDP_WORKER_POOL_DIALOG] = { NULL, XDP_THREAD_KIND_INTERACTIVE, 0, },
+};
+
+/* Set in the threads of pools with their own scheduling */
+static GPrivate worker_sched_applied;
+
+static void
+worker_pool_func (gpointer data,
+                  gpointer user_data)
+{
+  WorkerJob *job = data;
+  WorkerPool *pool = job->pool;
+  GTask *task = job->task;
+
+  G_LOCK (worker_pools);
+  pool->queued--;
+  pool->running++;
+  G_UNLOCK (worker_pools);
+
+  if (pool->max_threads > 0 &&
+      xdp_thread_sched_is_set (pool->thread_kind) &&
+      g_private_get (&worker_sched_applied) == NULL)
+    {
+      xdp_thread_apply_sched (pool->thread_kind);
+      g_private_set (&worker_sched_applied, GINT_TO_POINTER (TRUE));
+    }
+
+  job->func (task,
+             g_task_get_source_object (task),
+             g_task_get_task_data (task),
+             g_task_get_cancellable (task));
+
+  G_LOCK (worker_pools);
+  pool->running--;
+  pool->completed++;
+  G_UNLOCK (worker_pools);
+
+  g_object_unref (task);
+  g_free (job);
+}
+
+void
+xdp_set_worker_pool_size (XdpWorkerPoolKind kind,
+                          guint             max_threads)
+{
+  WorkerPool *pool;
+
+  g_return_if_fail (kind < XDP_WORKER_POOL_LAST);
+  g_return_if_fail (kind != XDP_WORKER_POOL_DIALOG);
+  g_return_if_fail (max_threads > 0);
+
+  G_LOCK (worker_pools);
+  pool = &worker_pools[kind];
+  pool->max_threads = max_threads;
+  if (pool->pool)
+    g_thread_pool_set_max_threads (pool->pool, max_threads, NULL);
+  G_UNLOCK (worker_pools);
+}
+
+/* Like g_task_run_in_thread(), but in one of our pools */
+void
+xdp_task_run_in_pool (GTask             *task,
+                      XdpWorkerPoolKind  kind,
+                      GTaskThreadFunc    func)
+{
+  WorkerPool *pool;
+  WorkerJob *job;
+
+  g_return_if_fail (kind < XDP_WORKER_POOL_LAST);
+
+  job = g_new0 (WorkerJob, 1);
+  job->task = g_object_ref (task);
+  job->func = func;
+
+  G_LOCK (worker_pools);
+  pool = &worker_pools[kind];
+  /* Threads with their own scheduling must not go back to GLib's
+   * shared threads, so those pools get exclusive ones */
+  if (pool->pool == NULL && pool->max_threads == 0)
+    pool->pool = g_thread_pool_new (worker_pool_func, NULL, -1, FALSE, NULL);
+  else if (pool->pool == NULL)
+    pool->pool = g_thread_pool_new (worker_pool_func, NULL,
+                                    pool->max_threads,
+                                    xdp_thread_sched_is_set (pool->thread_kind),
+                                    NULL);
+  job->pool = pool;
+  pool->queued++;
+  pool->max_queued = MAX (pool->max_queued, pool->queued);
+  G_UNLOCK (worker_pools);
+
+  g_thread_pool_push (pool->pool, job, NULL);
+}
+
+void
+xdp_get_worker_pool_stats (XdpWorkerPoolKind   kind,
+                           XdpWorkerPoolStats *stats)
+{
+  WorkerPool *pool;
+
+  g_return_if_fail (kind < XDP_WORKER_POOL_LAST);
+
+  G_LOCK (worker_pools);
+  pool = &worker_pools[kind];
+  stats->max_threads = pool->max_threads;
+  stats->running = pool->running;
+  stats->queued = pool->queued;
+  stats->max_queued = pool->max_queued;
+  stats->completed = pool->completed;
+  G_UNLOCK (worker_pools);
+}
+
+/* Scheduling policy and niceness for each kind of thread, set at
+ * startup with xdp_set_thread_sched() and applied by the threads
+ * themselves with xdp_thread_apply_sched() */
+typedef struct {
+  gboolean set;
+  int policy;
+  int nice;
+} ThreadSched;
+
+static ThreadSched thread_sched[XDP_THREAD_KIND_LAST];
+
+static const char *thread_kind_names[XDP_THREAD_KIND_LAST] = {
+  [XDP_THREAD_KIND_INTERACTIVE] = "interactive",
+  [XDP_THREAD_KIND_BACKGROUND] = "background",
+  [XDP_THREAD_KIND_MONITOR] = "monitor",
+  [XDP_THREAD_KIND_FUSE] = "fuse",
+};
+
+/* Parses KIND=POLICY[:NICE], where POLICY is other, batch or idle */
 gboolean
-xdp_filter_options (GVariant *options,
-                    GVariantBuilder *filtered,
-                    XdpOptionKey *supported_options,
-                    int n_supported_options,
-                    GError **error)
+xdp_set_thread_sched (const char  *spec,
+                      GError     **error)
 {
-  int i;
+  g_auto(GStrv) kind_and_rest = g_strsplit (spec, "=", 2);
+  g_auto(GStrv) policy_and_nice = NULL;
+  ThreadSched sched = { TRUE, SCHED_OTHER, 0 };
+  int kind;
+
+  for (kind = 0; kind < XDP_THREAD_KIND_LAST; kind++)
+    if (g_strcmp0 (kind_and_rest[0], thread_kind_names[kind]) == 0)
+      break;
+
+  if (kind == XDP_THREAD_KIND_LAST || kind_and_rest[1] == NULL)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Invalid thread scheduling '%s', expected KIND=POLICY[:NICE]", spec);
+      return FALSE;
+    }
+
+  policy_and_nice = g_strsplit (kind_and_rest[1], ":", 2);
+
+  if (strcmp (policy_and_nice[0], "other") == 0)
+    sched.policy = SCHED_OTHER;
+  else if (strcmp (policy_and_nice[0], "batch") == 0)
+    sched.policy = SCHED_BATCH;
+  else if (strcmp (policy_and_nice[0], "idle") == 0)
+    sched.policy = SCHED_IDLE;
+  else
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Unknown scheduling policy '%s', expected other, batch or idle",
+                   policy_and_nice[0]);
+      return FALSE;
+    }
+
+  if (policy_and_nice[1] != NULL)
+    {
+      gint64 nice;
+
+      if (!g_ascii_string_to_signed (policy_and_nice[1], 10, -20, 19, &nice, error))
+        return FALSE;
+
+      sched.nice = (int) nice;
+    }
+
+  thread_sched[kind] = sched;
+
+  return TRUE;
+}
+
+static void
+set_thread_sched (int policy,
+                  int nice)
+{
+  struct sched_param param = { 0 };
+  int res;
+
+  res = pthread_setschedparam (pthread_self (), policy, &param);
+  if (res != 0)
+    g_debug ("Unable to set scheduling policy: %s", g_strerror (res));
+
+  /* Niceness is per thread on Linux. Raising priority needs
+   * CAP_SYS_NICE or a matching RLIMIT_NICE. */
+  if (setpriority (PRIO_PROCESS, (id_t) syscall (SYS_gettid), nice) != 0)
+    g_debug ("Unable to set thread niceness to %d: %s", nice, g_strerror (errno));
+}
+
+/* Called by a thread of the given kind when it starts */
+void
+xdp_thread_apply_sched (XdpThreadKind kind)
+{
+  ThreadSched *sched;
+
+  g_return_if_fail (kind < XDP_THREAD_KIND_LAST);
+
+  sched = &thread_sched[kind];
+  if (sched->set)
+    set_thread_sched (sched->policy, sched->nice);
+}
+
+gboolean
+xdp_thread_sched_is_set (XdpThreadKind kind)
+{
+  g_return_val_if_fail (kind < XDP_THREAD_KIND_LAST, FALSE);
+
+  return thread_sched[kind].set;
+}
+
+/* Makes a single pass over options, without allocating a copy of
+ * each value for every supported key like g_variant_lookup_value()
+ * would. Options that are given more than once are only used once,
+ * the first time. keep[i] is set for each child of options that
+ * passes, and the number of those is returned in n_kept. */
+static gboolean
+check_options (GVariant *options,
+               XdpOptionKey *supported_options,
+               int n_supported_options,
+               gboolean *keep,
+               gsize *n_kept,
+               GError **error)
+{
+  gboolean *seen = g_newa (gboolean, n_supported_options);
   gboolean ret = TRUE;
+  gsize n_children;
+  gsize j;
+  int i;
+
+  memset (seen, 0, sizeof (gboolean) * n_supported_options);
+  *n_kept = 0;
 
-  for (i = 0; i < n_supported_options; i++)
+  n_children = g_variant_n_children (options);
+  for (j = 0; j < n_children; j++)
     {
       g_autoptr(GVariant) value = NULL;
+      const char *key;
+
+      keep[j] = FALSE;
+
+      g_variant_get_child (options, j, "{&sv}", &key, &value);
+
+      for (i = 0; i < n_supported_options; i++)
+        {
+          if (strcmp (key, supported_options[i].key) == 0)
+            break;
+        }
+
+      if (i == n_supported_options || seen[i])
+        continue;
+
+      seen[i] = TRUE;
 
-      value = g_variant_lookup_value (options,
-                                      supported_options[i].key,
-                                      supported_options[i].type);
-      if (!value)
+      if (!g_variant_is_of_type (value, supported_options[i].type))
         {
-          value = g_variant_lookup_value (options, supported_options[i].key, NULL);
-          if (value)
-            {
-              if (*error == NULL)
-                g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
-                             "Expected type '%s' for option '%s', got '%s'",
-                             g_variant_type_peek_string (supported_options[i].type),
-                             supported_options[i].key,
-                             g_variant_type_peek_string (g_variant_get_type (value)));
-              ret = FALSE;
-            }
+          if (error && *error == NULL)
+            g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                         "Expected type '%s' for option '%s', got '%s'",
+                         g_variant_type_peek_string (supported_options[i].type),
+                         supported_options[i].key,
+                         g_variant_type_peek_string (g_variant_get_type (value)));
+          ret = FALSE;
 
           continue;
         }
-         
+
       if (supported_options[i].validate)
         {
           g_autoptr(GError) local_error = NULL;
@@ -829,9 +2137,79 @@ xdp_filter_options (GVariant *options,
             }
         }
 
-      g_variant_builder_add (filtered, "{sv}", supported_options[i].key, g_steal_pointer (&value));
+      keep[j] = TRUE;
+      (*n_kept)++;
+    }
+
+  return ret;
+}
+
+static void
+add_kept_options (GVariant *options,
+                  const gboolean *keep,
+                  GVariantBuilder *filtered)
+{
+  gsize n_children = g_variant_n_children (options);
+  gsize j;
+
+  for (j = 0; j < n_children; j++)
+    {
+      if (keep[j])
+        {
+          g_autoptr(GVariant) entry = g_variant_get_child_value (options, j);
+
+          g_variant_builder_add_value (filtered, entry);
+        }
+    }
+}
+
+gboolean
+xdp_filter_options (GVariant *options,
+                    GVariantBuilder *filtered,
+                    XdpOptionKey *supported_options,
+                    int n_supported_options,
+                    GError **error)
+{
+  g_autofree gboolean *keep = g_new (gboolean, g_variant_n_children (options));
+  gboolean ret;
+  gsize n_kept;
+
+  ret = check_options (options, supported_options, n_supported_options,
+                       keep, &n_kept, error);
+  add_kept_options (options, keep, filtered);
+
+  return ret;
+}
+
+/* Like xdp_filter_options(), but for options that are passed on as
+ * they are. When no option is dropped, *filtered is a new reference
+ * to options itself, so the serialized data is sent on without being
+ * rebuilt. *filtered is set even when FALSE is returned. */
+gboolean
+xdp_filter_options_forward (GVariant *options,
+                            GVariant **filtered,
+                            XdpOptionKey *supported_options,
+                            int n_supported_options,
+                            GError **error)
+{
+  g_autofree gboolean *keep = g_new (gboolean, g_variant_n_children (options));
+  GVariantBuilder builder;
+  gboolean ret;
+  gsize n_kept;
+
+  ret = check_options (options, supported_options, n_supported_options,
+                       keep, &n_kept, error);
+
+  if (n_kept == g_variant_n_children (options))
+    {
+      *filtered = g_variant_ref (options);
+      return ret;
     }
 
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  add_kept_options (options, keep, &builder);
+  *filtered = g_variant_ref_sink (g_variant_builder_end (&builder));
+
   return ret;
 }
 
@@ -889,6 +2267,34 @@ verify_proc_self_fd (XdpAppInfo *app_info,
   return xdp_app_info_remap_path (app_info, path_buffer);
 }
 
+/* Only the identity of the file is needed, so where possible this
+ * asks for just that instead of filling all of struct stat */
+static gboolean
+path_is_same_file (const char  *path,
+                   struct stat *st_buf)
+{
+#if defined(STATX_INO)
+  struct statx stx;
+
+  if (statx (AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, STATX_INO, &stx) == 0)
+    return (stx.stx_mask & STATX_INO) != 0 &&
+      makedev (stx.stx_dev_major, stx.stx_dev_minor) == st_buf->st_dev &&
+      stx.stx_ino == st_buf->st_ino;
+
+  if (errno != ENOSYS)
+    return FALSE;
+#endif
+
+  {
+    struct stat real_st_buf;
+
+    return
+      stat (path, &real_st_buf) == 0 &&
+      st_buf->st_dev == real_st_buf.st_dev &&
+      st_buf->st_ino == real_st_buf.st_ino;
+  }
+}
+
 char *
 xdp_app_info_get_path_for_fd (XdpAppInfo *app_info,
                               int fd,
@@ -896,10 +2302,9 @@ xdp_app_info_get_path_for_fd (XdpAppInfo *app_info,
                               struct stat *st_buf,
                               gboolean *writable_out)
 {
-  g_autofree char *proc_path = NULL;
+  char proc_path[sizeof "/proc/self/fd/" + 3 * sizeof (int)];
   int fd_flags;
   struct stat st_buf_store;
-  struct stat real_st_buf;
   gboolean writable = FALSE;
   g_autofree char *path = NULL;
 
@@ -923,7 +2328,7 @@ xdp_app_info_get_path_for_fd (XdpAppInfo *app_info,
       (st_buf->st_mode & S_IFMT) != require_st_mode)
     return NULL;
 
-  proc_path = g_strdup_printf ("/proc/self/fd/%d", fd);
+  g_snprintf (proc_path, sizeof proc_path, "/proc/self/fd/%d", fd);
 
   /* Must be able to read valid path from /proc/self/fd */
   /* This is an absolute and (at least at open time) symlink-expanded path */
@@ -958,12 +2363,18 @@ xdp_app_info_get_path_for_fd (XdpAppInfo *app_info,
         read_access_mode |= X_OK;
 
       /* Must be able to access the path via the sandbox supplied O_PATH fd,
-         which applies the sandbox side mount options (like readonly). */
-      if (access (proc_path, read_access_mode) != 0)
-        return NULL;
-
-      if (xdp_app_info_is_host (app_info) || access (proc_path, W_OK) == 0)
+         which applies the sandbox side mount options (like readonly).
+         Most files are writable, so try both at once first. */
+      if (xdp_app_info_is_host (app_info))
+        {
+          if (access (proc_path, read_access_mode) != 0)
+            return NULL;
+          writable = TRUE;
+        }
+      else if (access (proc_path, read_access_mode | W_OK) == 0)
         writable = TRUE;
+      else if (access (proc_path, read_access_mode) != 0)
+        return NULL;
     }
   else /* Regular file with no O_PATH */
     {
@@ -982,9 +2393,7 @@ xdp_app_info_get_path_for_fd (XdpAppInfo *app_info,
     }
 
   /* Verify that this is the same file as the app opened */
-  if (stat (path, &real_st_buf) < 0 ||
-      st_buf->st_dev != real_st_buf.st_dev ||
-      st_buf->st_ino != real_st_buf.st_ino)
+  if (!path_is_same_file (path, st_buf))
     {
       /* Different files on the inside and the outside, reject the request */
       return NULL;
@@ -996,14 +2405,54 @@ xdp_app_info_get_path_for_fd (XdpAppInfo *app_info,
   return g_steal_pointer (&path);
 }
 
-static gboolean
+/* Validates all of @fds in one go, for requests that carry many of
+ * them. The same fd passed more than once is only checked once. Returns
+ * %NULL if any of the fds is not valid. */
+char **
+xdp_app_info_get_paths_for_fds (XdpAppInfo  *app_info,
+                                const int   *fds,
+                                int          n_fds,
+                                int          require_st_mode,
+                                GError     **error)
+{
+  g_auto(GStrv) paths = NULL;
+  int i, j;
+
+  paths = g_new0 (char *, n_fds + 1);
+
+  for (i = 0; i < n_fds; i++)
+    {
+      for (j = 0; j < i; j++)
+        {
+          if (fds[j] == fds[i])
+            break;
+        }
+
+      if (j < i)
+        paths[i] = g_strdup (paths[j]);
+      else
+        paths[i] = xdp_app_info_get_path_for_fd (app_info, fds[i], require_st_mode, NULL, NULL);
+
+      if (paths[i] == NULL)
+        {
+          g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                       "Invalid file descriptor at index %d", i);
+          return NULL;
+        }
+    }
+
+  return g_steal_pointer (&paths);
+}
+
+/* The dash is only allowed in the last element of an app id.
+ * g_ascii_isalnum() is a table lookup, and doesn't depend on the
+ * locale. */
+static inline gboolean
 is_valid_name_character (gint c, gboolean allow_dash)
 {
-  return
-    (c >= 'A' && c <= 'Z') ||
-    (c >= 'a' && c <= 'z') ||
-    (c >= '0' && c <= '9') ||
-    (c == '_') || (allow_dash && c == '-');
+  return g_ascii_isalnum (c) ||
+         c == '_' ||
+         (allow_dash && c == '-');
 }
 
 /* This is the same as flatpak apps, except we also allow
@@ -1101,42 +2550,44 @@ xdp_quote_argv (const char *argv[])
   return g_string_free (res, FALSE);
 }
 
-typedef struct
+static GSubprocess *
+spawn_subprocess (GFile                *dir,
+                  GSubprocessFlags      flags,
+                  GError              **error,
+                  const gchar * const  *argv)
 {
-  GError    *error;
-  GError    *splice_error;
-  GMainLoop *loop;
-  int        refs;
-} SpawnData;
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autofree gchar *commandline = NULL;
 
-static void
-spawn_data_exit (SpawnData *data)
-{
-  data->refs--;
-  if (data->refs == 0)
-    g_main_loop_quit (data->loop);
-}
+  launcher = g_subprocess_launcher_new (0);
 
-static void
-spawn_output_spliced_cb (GObject      *obj,
-                         GAsyncResult *result,
-                         gpointer      user_data)
-{
-  SpawnData *data = user_data;
+  g_subprocess_launcher_set_flags (launcher, flags);
+
+  if (dir)
+    {
+      g_autofree char *path = g_file_get_path (dir);
+      g_subprocess_launcher_set_cwd (launcher, path);
+    }
+
+  commandline = xdp_quote_argv ((const char **)argv);
+  g_debug ("Running: %s", commandline);
 
-  g_output_stream_splice_finish (G_OUTPUT_STREAM (obj), result, &data->splice_error);
-  spawn_data_exit (data);
+  return g_subprocess_launcher_spawnv (launcher, argv, error);
 }
 
-static void
-spawn_exit_cb (GObject      *obj,
-               GAsyncResult *result,
-               gpointer      user_data)
+/* Null terminated copy of the output */
+static char *
+spawn_output_to_string (GBytes *bytes)
 {
-  SpawnData *data = user_data;
+  gsize len = 0;
+  const char *data = bytes ? g_bytes_get_data (bytes, &len) : NULL;
+  char *str = g_malloc (len + 1);
 
-  g_subprocess_wait_check_finish (G_SUBPROCESS (obj), result, &data->error);
-  spawn_data_exit (data);
+  if (len > 0)
+    memcpy (str, data, len);
+  str[len] = 0;
+
+  return str;
 }
 
 gboolean
@@ -1164,6 +2615,8 @@ xdp_spawn (GFile       *dir,
   return res;
 }
 
+/* Waits without running a main loop, so nothing else is dispatched on
+ * the calling thread's context meanwhile */
 gboolean
 xdp_spawnv (GFile                *dir,
             char                **output,
@@ -1171,78 +2624,27 @@ xdp_spawnv (GFile                *dir,
             GError              **error,
             const gchar * const  *argv)
 {
-  g_autoptr(GSubprocessLauncher) launcher = NULL;
   g_autoptr(GSubprocess) subp = NULL;
-  GInputStream *in;
-  g_autoptr(GOutputStream) out = NULL;
-  g_autoptr(GMainLoop) loop = NULL;
-  SpawnData data = {0};
-  g_autofree gchar *commandline = NULL;
-
-  launcher = g_subprocess_launcher_new (0);
+  g_autoptr(GBytes) stdout_buf = NULL;
 
   if (output)
     flags |= G_SUBPROCESS_FLAGS_STDOUT_PIPE;
 
-  g_subprocess_launcher_set_flags (launcher, flags);
-
-  if (dir)
-    {
-      g_autofree char *path = g_file_get_path (dir);
-      g_subprocess_launcher_set_cwd (launcher, path);
-    }
-
-  commandline = xdp_quote_argv ((const char **)argv);
-  g_debug ("Running: %s", commandline);
-
-  subp = g_subprocess_launcher_spawnv (launcher, argv, error);
-
+  subp = spawn_subprocess (dir, flags, error, argv);
   if (subp == NULL)
     return FALSE;
 
-  loop = g_main_loop_new (NULL, FALSE);
+  if (!g_subprocess_communicate (subp, NULL, NULL,
+                                 output ? &stdout_buf : NULL, NULL,
+                                 error))
+    return FALSE;
 
-  data.loop = loop;
-  data.refs = 1;
+  /* Already exited, this only checks the status */
+  if (!g_subprocess_wait_check (subp, NULL, error))
+    return FALSE;
 
   if (output)
-    {
-      data.refs++;
-      in = g_subprocess_get_stdout_pipe (subp);
-      out = g_memory_output_stream_new_resizable ();
-      g_output_stream_splice_async (out,
-                                    in,
-                                    G_OUTPUT_STREAM_SPLICE_NONE,
-                                    0,
-                                    NULL,
-                                    spawn_output_spliced_cb,
-                                    &data);
-    }
-
-  g_subprocess_wait_async (subp, NULL, spawn_exit_cb, &data);
-
-  g_main_loop_run (loop);
-
-  if (data.error)
-    {
-      g_propagate_error (error, data.error);
-      g_clear_error (&data.splice_error);
-      return FALSE;
-    }
-
-  if (out)
-    {
-      if (data.splice_error)
-        {
-          g_propagate_error (error, data.splice_error);
-          return FALSE;
-        }
-
-      /* Null terminate */
-      g_output_stream_write (out, "\0", 1, NULL, NULL);
-      g_output_stream_close (out, NULL, NULL);
-      *output = g_memory_output_stream_steal_data (G_MEMORY_OUTPUT_STREAM (out));
-    }
+    *output = spawn_output_to_string (stdout_buf);
 
   return TRUE;
 }
@@ -1473,17 +2875,30 @@ open_pid_fd (int      proc_fd,
   return fd;
 }
 
+G_LOCK_DEFINE_STATIC (fdinfo_dir);
+
+/* The directory is only used with openat(), so it is opened once and
+ * kept; the returned fd must not be closed */
 static int
 open_fdinfo_dir (GError **error)
 {
+  static int fdinfo_dir = -1;
   int fd;
 
-  fd = open ("/proc/self/fdinfo", O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
+  G_LOCK (fdinfo_dir);
 
-  if (fd < 0)
-    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
-                 "Could not to open /proc/self/fdinfo: %s",
-                 g_strerror (errno));
+  if (fdinfo_dir == -1)
+    {
+      fdinfo_dir = open ("/proc/self/fdinfo", O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
+
+      if (fdinfo_dir < 0)
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "Could not to open /proc/self/fdinfo: %s",
+                     g_strerror (errno));
+    }
+  fd = fdinfo_dir;
+
+  G_UNLOCK (fdinfo_dir);
 
   return fd;
 }
@@ -1506,6 +2921,146 @@ find_pid (pid_t *pids,
   return FALSE;
 }
 
+/* Inside -> outside pids of the pid namespaces of apps, built from the
+ * /proc walk in map_pids(). Entries are checked against /proc before
+ * they are used and dropped when stale, so the walk is only needed
+ * for pids not seen before. */
+#define MAX_CACHED_PIDNS 64
+
+G_LOCK_DEFINE_STATIC (pid_maps);
+static GHashTable *pid_maps; /* guint64 pidns -> GHashTable (inside -> outside) */
+
+static pid_t
+lookup_cached_pid (ino_t pidns,
+                   pid_t inside)
+{
+  guint64 key = pidns;
+  GHashTable *map;
+  pid_t outside = 0;
+
+  G_LOCK (pid_maps);
+  if (pid_maps)
+    {
+      map = g_hash_table_lookup (pid_maps, &key);
+      if (map)
+        outside = GPOINTER_TO_INT (g_hash_table_lookup (map, GINT_TO_POINTER (inside)));
+    }
+  G_UNLOCK (pid_maps);
+
+  return outside;
+}
+
+static void
+uncache_pid (ino_t pidns,
+             pid_t inside)
+{
+  guint64 key = pidns;
+  GHashTable *map;
+
+  G_LOCK (pid_maps);
+  if (pid_maps)
+    {
+      map = g_hash_table_lookup (pid_maps, &key);
+      if (map)
+        g_hash_table_remove (map, GINT_TO_POINTER (inside));
+    }
+  G_UNLOCK (pid_maps);
+}
+
+static void
+pid_maps_clear (void)
+{
+  G_LOCK (pid_maps);
+  g_clear_pointer (&pid_maps, g_hash_table_unref);
+  G_UNLOCK (pid_maps);
+}
+
+/* Takes ownership of map */
+static void
+cache_pids (ino_t       pidns,
+            GHashTable *map)
+{
+  guint64 key = pidns;
+
+  G_LOCK (pid_maps);
+  if (pid_maps == NULL)
+    pid_maps = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  /* Namespaces of apps that are gone are never looked up again */
+  if (g_hash_table_size (pid_maps) >= MAX_CACHED_PIDNS &&
+      !g_hash_table_contains (pid_maps, &key))
+    g_hash_table_remove_all (pid_maps);
+
+  g_hash_table_replace (pid_maps, g_memdup (&key, sizeof (key)), map);
+  G_UNLOCK (pid_maps);
+}
+
+/* Reads the pid namespace, the pid inside of it and the uid of the
+ * process with (outside) pid name */
+static int
+read_pid_info (int         proc_fd,
+               const char *name,
+               ino_t      *ns,
+               pid_t      *inside,
+               uid_t      *uid)
+{
+  xdp_autofd int pid_fd = -1;
+  int r;
+
+  pid_fd = openat (proc_fd, name, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
+  if (pid_fd == -1)
+    return -errno;
+
+  r = lookup_ns_from_pid_fd (pid_fd, ns);
+  if (r < 0)
+    return r;
+
+  return parse_status_file (pid_fd, inside, uid);
+}
+
+/* Maps pids from the cache if all of them are in there and still valid */
+static gboolean
+map_cached_pids (DIR      *proc,
+                 ino_t     pidns,
+                 pid_t    *pids,
+                 pid_t    *res,
+                 guint     n_pids,
+                 uid_t     target_uid,
+                 gboolean *mismatch)
+{
+  for (guint i = 0; i < n_pids; i++)
+    {
+      char buf[20] = {0, };
+      pid_t outside;
+      pid_t inside = 0;
+      uid_t uid = 0;
+      ino_t ns = 0;
+
+      outside = lookup_cached_pid (pidns, pids[i]);
+      if (outside == 0)
+        return FALSE;
+
+      snprintf (buf, sizeof(buf), "%u", (guint) outside);
+      if (read_pid_info (dirfd (proc), buf, &ns, &inside, &uid) < 0 ||
+          ns != pidns || inside != pids[i])
+        {
+          uncache_pid (pidns, pids[i]);
+          return FALSE;
+        }
+
+      if (uid != target_uid)
+        {
+          *mismatch = TRUE;
+          return FALSE;
+        }
+
+      res[i] = outside;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 map_pids (DIR     *proc,
           ino_t    pidns,
@@ -1514,6 +3069,8 @@ map_pids (DIR     *proc,
           uid_t    target_uid,
           GError **error)
 {
+  g_autoptr(GHashTable) seen = NULL;
+  gboolean uid_mismatch = FALSE;
   pid_t *res = NULL;
   struct dirent *de;
   guint count = 0;
@@ -1521,9 +3078,24 @@ map_pids (DIR     *proc,
   res = g_alloca (sizeof (pid_t) * n_pids);
   memset (res, 0, sizeof (pid_t) * n_pids);
 
+  if (map_cached_pids (proc, pidns, pids, res, n_pids, target_uid, &uid_mismatch))
+    {
+      memcpy (pids, res, sizeof (pid_t) * n_pids);
+      return TRUE;
+    }
+
+  if (uid_mismatch)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+                           "Matching pid doesn't belong to the target user");
+      return FALSE;
+    }
+
+  memset (res, 0, sizeof (pid_t) * n_pids);
+  seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+
   while ((de = readdir (proc)) != NULL)
     {
-      xdp_autofd int pid_fd = -1;
       pid_t outside = 0;
       pid_t inside = 0;
       uid_t uid = 0;
@@ -1534,24 +3106,19 @@ map_pids (DIR     *proc,
       if (de->d_type != DT_DIR)
         continue;
 
-      pid_fd = openat (dirfd (proc), de->d_name, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC | O_NOCTTY);
-      if (pid_fd == -1)
+      r = parse_pid (de->d_name, &outside);
+      if (r < 0)
         continue;
 
-      r = lookup_ns_from_pid_fd (pid_fd, &ns);
+      r = read_pid_info (dirfd (proc), de->d_name, &ns, &inside, &uid);
       if (r < 0)
         continue;
 
       if (pidns != ns)
         continue;
 
-      r = parse_pid (de->d_name, &outside);
-      if (r < 0)
-        continue;
-
-      r = parse_status_file (pid_fd, &inside, &uid);
-      if (r < 0)
-        continue;
+      if (uid == target_uid)
+        g_hash_table_insert (seen, GINT_TO_POINTER (inside), GINT_TO_POINTER (outside));
 
       if (!find_pid (pids, n_pids, inside, &idx))
         continue;
@@ -1576,6 +3143,8 @@ map_pids (DIR     *proc,
         }
     }
 
+  cache_pids (pidns, g_steal_pointer (&seen));
+
   if (count != n_pids)
     {
       g_autoptr(GString) str = NULL;
@@ -1600,74 +3169,69 @@ map_pids (DIR     *proc,
 static gboolean
 pidfd_to_pid (int fdinfo, const int pidfd, pid_t *pid, GError **error)
 {
-  g_autofree char *name = NULL;
-  g_autofree char *key = NULL;
-  g_autofree char *val = NULL;
-  gboolean found = FALSE;
-  FILE *f = NULL;
-  size_t keylen = 0;
-  size_t vallen = 0;
+  char name[32];
+  char buf[1024];
+  const char *line;
+  size_t len = 0;
   ssize_t n;
   int fd;
-  int r = 0;
+  int r;
 
   *pid = 0;
 
-  name = g_strdup_printf ("%d", pidfd);
+  g_snprintf (name, sizeof (name), "%d", pidfd);
 
   fd = openat (fdinfo, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
-
-  if (fd != -1)
-    f = fdopen (fd, "r");
-
-  if (f == NULL)
+  if (fd == -1)
     {
       g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
                    "Unable to open /proc/self/fdinfo/%d: %s",
-                   fd, g_strerror (errno));
+                   pidfd, g_strerror (errno));
       return FALSE;
     }
 
-  do {
-    n = getdelim (&key, &keylen, ':', f);
-    if (n == -1)
-      {
-        r = errno;
-        break;
-      }
-
-    n = getdelim (&val, &vallen, '\n', f);
-    if (n == -1)
-      {
-        r = errno;
-        break;
-      }
-
-    g_strstrip (key);
-
-    if (!strncmp (key, "Pid", 3))
-      {
-        r = parse_status_field_pid (val, pid);
-        found = r > -1;
-      }
-
-  } while (r == 0 && !found);
+  /* fdinfo is small, read all of it at once instead of line by line */
+  do
+    {
+      n = read (fd, buf + len, sizeof (buf) - 1 - len);
+      if (n > 0)
+        len += n;
+    }
+  while ((n > 0 && len < sizeof (buf) - 1) || (n == -1 && errno == EINTR));
 
-  fclose (f);
+  r = n == -1 ? -errno : 0;
+  close (fd);
 
   if (r < 0)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Could not parse fdinfo::%s: %s",
-                   key, g_strerror (-r));
+                   "Could not read fdinfo: %s", g_strerror (-r));
+      return FALSE;
     }
-  else if (!found)
+
+  buf[len] = '\0';
+
+  if (strncmp (buf, "Pid:", 4) == 0)
+    line = buf;
+  else if ((line = strstr (buf, "\nPid:")) != NULL)
+    line++;
+
+  if (line == NULL)
     {
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                            "Could not parse fdinfo: Pid field missing");
+      return FALSE;
     }
 
-  return found;
+  r = parse_pid (line + 4, pid);
+  if (r < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Could not parse fdinfo::Pid: %s", g_strerror (-r));
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 static JsonNode *
@@ -1892,7 +3456,5 @@ xdg_app_info_pidfds_to_pids (XdpAppInfo  *app_info,
   for (gint i = 0; i < count && ok; i++)
     ok = pidfd_to_pid (fdinfo, fds[i], &pids[i], error);
 
-  (void) close (fdinfo);
-
   return ok;
 }
@@ -30,6 +30,10 @@
 
 #define DESKTOP_PORTAL_OBJECT_PATH "/org/freedesktop/portal/desktop"
 
+/* Private socket of the document portal for unsandboxed peers on the
+ * same host, relative to the user runtime dir */
+#define DOCUMENT_PORTAL_PEER_SOCKET "xdg-document-portal/peer"
+
 #define FLATPAK_METADATA_GROUP_APPLICATION "Application"
 #define FLATPAK_METADATA_KEY_NAME "name"
 #define FLATPAK_METADATA_GROUP_INSTANCE "Instance"
@@ -70,6 +74,11 @@ char *      xdp_app_info_get_path_for_fd (XdpAppInfo  *app_info,
                                           int          require_st_mode,
                                           struct stat *st_buf,
                                           gboolean    *writable_out);
+char **     xdp_app_info_get_paths_for_fds (XdpAppInfo  *app_info,
+                                            const int   *fds,
+                                            int          n_fds,
+                                            int          require_st_mode,
+                                            GError     **error);
 gboolean    xdp_app_info_has_network     (XdpAppInfo  *app_info);
 XdpAppInfo *xdp_get_app_info_from_pid    (pid_t        pid,
                                           GError     **error);
@@ -77,13 +86,103 @@ GAppInfo *  xdp_app_info_load_app_info   (XdpAppInfo *app_info);
 char **     xdp_app_info_rewrite_commandline (XdpAppInfo *app_info,
                                               const char *const *commandline);
 
+GAppInfoMonitor *xdp_get_app_info_monitor (void);
+char *      xdp_get_app_display_name     (const char *app_id);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(XdpAppInfo, xdp_app_info_unref)
 
 XdpAppInfo *xdp_invocation_lookup_app_info_sync (GDBusMethodInvocation *invocation,
                                                  GCancellable          *cancellable,
                                                  GError               **error);
+void        xdp_invocation_lookup_app_info (GDBusMethodInvocation *invocation,
+                                            GCancellable          *cancellable,
+                                            GAsyncReadyCallback    callback,
+                                            gpointer               user_data);
+void        xdp_connection_lookup_app_info (GDBusConnection       *connection,
+                                            const char            *sender,
+                                            GCancellable          *cancellable,
+                                            GAsyncReadyCallback    callback,
+                                            gpointer               user_data);
+XdpAppInfo *xdp_connection_lookup_app_info_finish (GDBusConnection  *connection,
+                                                   GAsyncResult     *result,
+                                                   GError          **error);
 void   xdp_connection_track_name_owners  (GDBusConnection       *connection,
                                           XdpPeerDiedCallback    peer_died_cb);
+void   xdp_set_app_info_prewarm          (guint                  rate);
+
+typedef struct {
+  guint64 hits;
+  guint64 misses;
+  guint64 evictions;
+  guint64 size;  /* Number of cached peers */
+  guint64 bytes; /* Estimated memory used by the cache */
+} XdpAppInfoCacheStats;
+
+void   xdp_app_info_get_cache_stats      (XdpAppInfoCacheStats  *stats);
+
+typedef enum {
+  XDP_WORKER_POOL_INTERACTIVE,
+  XDP_WORKER_POOL_BACKGROUND,
+  XDP_WORKER_POOL_DIALOG, /* Waits on the user or a backend, unbounded */
+  XDP_WORKER_POOL_LAST
+} XdpWorkerPoolKind;
+
+typedef struct {
+  guint max_threads; /* 0 if unbounded */
+  guint running;
+  guint queued;
+  guint max_queued;
+  guint64 completed;
+} XdpWorkerPoolStats;
+
+void   xdp_task_run_in_pool              (GTask                 *task,
+                                          XdpWorkerPoolKind      kind,
+                                          GTaskThreadFunc        func);
+void   xdp_set_worker_pool_size          (XdpWorkerPoolKind      kind,
+                                          guint                  max_threads);
+void   xdp_get_worker_pool_stats         (XdpWorkerPoolKind      kind,
+                                          XdpWorkerPoolStats    *stats);
+
+typedef enum {
+  XDP_THREAD_KIND_INTERACTIVE,
+  XDP_THREAD_KIND_BACKGROUND,
+  XDP_THREAD_KIND_MONITOR,
+  XDP_THREAD_KIND_FUSE,
+  XDP_THREAD_KIND_LAST
+} XdpThreadKind;
+
+gboolean xdp_set_thread_sched            (const char            *spec,
+                                          GError               **error);
+void     xdp_thread_apply_sched          (XdpThreadKind          kind);
+gboolean xdp_thread_sched_is_set         (XdpThreadKind          kind);
+
+typedef void (*XdpCacheTrimFunc) (void);
+
+void   xdp_add_cache_trim_func           (XdpCacheTrimFunc       func);
+void   xdp_trim_caches                   (void);
+
+typedef struct {
+  const char *name;
+  guint64 objects;
+  guint64 bytes; /* Estimated */
+} XdpMemoryUsage;
+
+typedef void (*XdpMemoryUsageFunc) (GArray *usage);
+
+void      xdp_add_memory_usage_func       (XdpMemoryUsageFunc     func);
+void      xdp_memory_usage_add            (GArray                *usage,
+                                           const char            *name,
+                                           guint64                objects,
+                                           guint64                bytes);
+GVariant *xdp_get_memory_usage            (void);
+char     *xdp_memory_usage_summary        (void);
+void      xdp_dump_memory_usage_on_signal (void);
+
+void     xdp_log_write                   (char                  *line);
+void     xdp_log_flush                   (void);
+void     xdp_log_set_debug_domains       (const char * const    *domains,
+                                          GLogFunc               handler);
+gboolean xdp_log_debug_domain_enabled    (const char            *domain);
 
 
 typedef struct {
@@ -97,6 +196,11 @@ gboolean xdp_filter_options (GVariant *options_in,
                              XdpOptionKey *supported_options,
                              int n_supported_options,
                              GError **error);
+gboolean xdp_filter_options_forward (GVariant *options_in,
+                                     GVariant **options_out,
+                                     XdpOptionKey *supported_options,
+                                     int n_supported_options,
+                                     GError **error);
 
 typedef enum {
   XDG_DESKTOP_PORTAL_ERROR_FAILED     = 0,
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+
+# Throughput and latency benchmarks for the document portal fuse
+# filesystem. Needs a running document portal, see
+# bench-document-fuse.sh. Results are printed one JSON object per line,
+# like bench-permission-db.
+
+import os, sys, random, argparse, threading, time, json
+from gi.repository import Gio, GLib
+
+DOCUMENT_ADD_FLAGS_REUSE_EXISTING             = (1 << 0)
+DOCUMENT_ADD_FLAGS_DIRECTORY                  = (1 << 3)
+
+APP_ID = "org.bench.App"
+BLOCK_SIZE = 4096
+
+workloads = [ "stat", "lookup", "readdir", "seqread", "randread",
+              "seqwrite", "randwrite", "atomic-save" ]
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--threads", type=int, default=8, help="Number of threads per workload")
+parser.add_argument("--duration", type=float, default=5.0, help="Seconds to run each workload")
+parser.add_argument("--files", type=int, default=1000, help="Number of files in the document directory")
+parser.add_argument("--file-size", type=int, default=4*1024*1024, help="Size of the file used for reads and writes")
+parser.add_argument("--workload", action="append", choices=workloads, help="Workload to run, can be repeated (default: all)")
+args = parser.parse_args(sys.argv[1:])
+
+def filename_to_ay(filename):
+    return list(filename.encode("utf-8")) + [0]
+
+class DocPortal:
+    def __init__(self):
+        self.bus = Gio.bus_get_sync(Gio.BusType.SESSION, None)
+        self.proxy = Gio.DBusProxy.new_sync(self.bus, Gio.DBusProxyFlags.NONE, None,
+                                            "org.freedesktop.portal.Documents", "/org/freedesktop/portal/documents", "org.freedesktop.portal.Documents", None)
+        res = self.proxy.call_sync("GetMountPoint", GLib.Variant('()', ()), 0, -1, None)
+        self.mountpoint = bytearray(res[0][:-1]).decode("utf-8")
+
+    def add_full(self, path, flags, app_id, permissions):
+        fdlist = Gio.UnixFDList.new()
+        fd = os.open(path, os.O_PATH)
+        handle = fdlist.append(fd)
+        os.close(fd)
+        res = self.proxy.call_with_unix_fd_list_sync("AddFull",
+                                                     GLib.Variant('(ahusas)',
+                                                                  ([handle], flags, app_id, permissions)),
+                                                     0, -1, fdlist, None)
+        return res[0][0][0]
+
+    def app_doc_path(self, doc_id):
+        return os.path.join(self.mountpoint, "by-app", APP_ID, doc_id)
+
+def setup(portal, data_dir):
+    big_dir = os.path.join(data_dir, "bench-dir")
+    os.makedirs(big_dir, exist_ok=True)
+    for i in range(args.files):
+        with open(os.path.join(big_dir, "file-%d" % i), "w") as f:
+            f.write("%d\n" % i)
+
+    data_file = os.path.join(big_dir, "data")
+    with open(data_file, "wb") as f:
+        f.write(os.urandom(args.file_size))
+
+    save_dir = os.path.join(data_dir, "bench-save")
+    os.makedirs(save_dir, exist_ok=True)
+    save_file = os.path.join(save_dir, "document.txt")
+    with open(save_file, "w") as f:
+        f.write("initial\n")
+
+    permissions = ["read", "write"]
+    dir_id = portal.add_full(big_dir, DOCUMENT_ADD_FLAGS_REUSE_EXISTING | DOCUMENT_ADD_FLAGS_DIRECTORY,
+                             APP_ID, permissions)
+    save_id = portal.add_full(save_file, DOCUMENT_ADD_FLAGS_REUSE_EXISTING, APP_ID, permissions)
+
+    return (os.path.join(portal.app_doc_path(dir_id), "bench-dir"),
+            portal.app_doc_path(save_id))
+
+def op_stat(ctx, rnd):
+    os.stat(os.path.join(ctx["dir"], "file-%d" % rnd.randrange(args.files)))
+
+def op_lookup(ctx, rnd):
+    try:
+        os.stat(os.path.join(ctx["dir"], "missing-%d" % rnd.randrange(args.files)))
+    except FileNotFoundError:
+        pass
+
+def op_readdir(ctx, rnd):
+    with os.scandir(ctx["dir"]) as it:
+        for entry in it:
+            pass
+
+def op_seqread(ctx, rnd):
+    fd = ctx["fd"]
+    if os.read(fd, 128 * 1024) == b"":
+        os.lseek(fd, 0, os.SEEK_SET)
+
+def op_randread(ctx, rnd):
+    os.pread(ctx["fd"], BLOCK_SIZE, rnd.randrange(args.file_size // BLOCK_SIZE) * BLOCK_SIZE)
+
+def op_seqwrite(ctx, rnd):
+    fd = ctx["fd"]
+    if os.lseek(fd, 0, os.SEEK_CUR) >= args.file_size:
+        os.lseek(fd, 0, os.SEEK_SET)
+    os.write(fd, ctx["block"] * 32)
+
+def op_randwrite(ctx, rnd):
+    os.pwrite(ctx["fd"], ctx["block"], rnd.randrange(args.file_size // BLOCK_SIZE) * BLOCK_SIZE)
+
+# Like editors: write a temp file next to the document, then rename it
+# over the document
+def op_atomic_save(ctx, rnd):
+    tmp = os.path.join(ctx["save_dir"], ".document.txt.%d~" % threading.get_ident())
+    with open(tmp, "w") as f:
+        f.write("saved %d\n" % rnd.randrange(1000000))
+    os.rename(tmp, os.path.join(ctx["save_dir"], "document.txt"))
+
+ops = {
+    "stat": (op_stat, None),
+    "lookup": (op_lookup, None),
+    "readdir": (op_readdir, None),
+    "seqread": (op_seqread, os.O_RDONLY),
+    "randread": (op_randread, os.O_RDONLY),
+    "seqwrite": (op_seqwrite, os.O_WRONLY),
+    "randwrite": (op_randwrite, os.O_WRONLY),
+    "atomic-save": (op_atomic_save, None),
+}
+
+def worker(name, paths, deadline, latencies, errors):
+    (op, open_flags) = ops[name]
+    rnd = random.Random()
+    ctx = { "dir": paths[0], "save_dir": paths[1], "block": os.urandom(BLOCK_SIZE) }
+    if open_flags is not None:
+        ctx["fd"] = os.open(os.path.join(paths[0], "data"), open_flags)
+
+    try:
+        while time.monotonic() < deadline:
+            start = time.perf_counter_ns()
+            try:
+                op(ctx, rnd)
+            except OSError:
+                errors.append(1)
+            latencies.append(time.perf_counter_ns() - start)
+    finally:
+        if "fd" in ctx:
+            os.close(ctx["fd"])
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100))]
+
+def run(name, paths):
+    threads = []
+    results = []
+    errors = []
+    start = time.monotonic()
+    deadline = start + args.duration
+
+    for i in range(args.threads):
+        latencies = []
+        results.append(latencies)
+        t = threading.Thread(target=worker, args=(name, paths, deadline, latencies, errors))
+        t.start()
+        threads.append(t)
+
+    for t in threads:
+        t.join()
+
+    elapsed = time.monotonic() - start
+    latencies = sorted([l for r in results for l in r])
+
+    print(json.dumps({ "bench": name,
+                       "threads": args.threads,
+                       "ops": len(latencies),
+                       "errors": len(errors),
+                       "ops_per_sec": round(len(latencies) / elapsed, 1),
+                       "p50_usec": round(percentile(latencies, 50) / 1000, 1),
+                       "p99_usec": round(percentile(latencies, 99) / 1000, 1) }))
+    sys.stdout.flush()
+
+portal = DocPortal()
+paths = setup(portal, os.environ['TEST_DATA_DIR'])
+
+for name in args.workload or workloads:
+    run(name, paths)
@@ -0,0 +1,54 @@
+#!/bin/bash
+
+# Runs bench-document-fuse.py against a private document portal.
+# Extra arguments are passed to the benchmark, and XDP_BENCH_PORTAL_ARGS
+# to the portal (e.g. "--fuse-threads=4 --writeback-cache").
+
+set -e
+
+if [ -n "${G_TEST_SRCDIR:-}" ]; then
+    test_srcdir="${G_TEST_SRCDIR}"
+else
+    test_srcdir=$(realpath $(dirname $0))
+fi
+
+if [ -n "${G_TEST_BUILDDIR:-}" ]; then
+    test_builddir="${G_TEST_BUILDDIR}"
+else
+    test_builddir=$(realpath $(dirname $0))
+fi
+
+export TEST_DATA_DIR=`mktemp -d /tmp/xdp-XXXXXX`
+mkdir -p ${TEST_DATA_DIR}/home
+mkdir -p ${TEST_DATA_DIR}/runtime
+
+export HOME=${TEST_DATA_DIR}/home
+export XDG_CACHE_HOME=${TEST_DATA_DIR}/home/cache
+export XDG_CONFIG_HOME=${TEST_DATA_DIR}/home/config
+export XDG_DATA_HOME=${TEST_DATA_DIR}/home/share
+export XDG_RUNTIME_DIR=${TEST_DATA_DIR}/runtime
+
+cleanup () {
+    fusermount -u $XDG_RUNTIME_DIR/doc || :
+    sleep 0.1
+    /bin/kill -9 $DBUS_SESSION_BUS_PID
+    kill $(jobs -p) &> /dev/null || true
+    rm -rf $TEST_DATA_DIR
+}
+trap cleanup EXIT
+
+sed s#@testdir@#${test_builddir}# ${test_srcdir}/session.conf.in > ${TEST_DATA_DIR}/session.conf
+
+dbus-daemon --fork --config-file=${TEST_DATA_DIR}/session.conf --print-address=3 --print-pid=4 \
+            3> ${TEST_DATA_DIR}/dbus-session-bus-address 4> ${TEST_DATA_DIR}/dbus-session-bus-pid
+export DBUS_SESSION_BUS_ADDRESS="$(cat ${TEST_DATA_DIR}/dbus-session-bus-address)"
+DBUS_SESSION_BUS_PID="$(cat ${TEST_DATA_DIR}/dbus-session-bus-pid)"
+
+if ! /bin/kill -0 "$DBUS_SESSION_BUS_PID"; then
+    echo "Failed to start dbus-daemon" >&2
+    exit 1
+fi
+
+./xdg-document-portal -r ${XDP_BENCH_PORTAL_ARGS:-} &
+
+python3 ${test_srcdir}/bench-document-fuse.py "$@"
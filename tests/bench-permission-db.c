@@ -0,0 +1,289 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmarks for PermissionDb and, optionally, a running permission
+ * store. Results are printed one JSON object per line, so they can be
+ * collected and compared between releases. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+
+#include "permission-db.h"
+#include "permission-store-dbus.h"
+
+#define BENCH_TABLE "bench-permission-db"
+
+static int opt_entries = 10000;
+static int opt_apps = 10;
+static int opt_iterations = 10000;
+static gboolean opt_dbus;
+
+static GOptionEntry entries[] = {
+  { "entries", 'n', 0, G_OPTION_ARG_INT, &opt_entries, "Number of entries in the table", "N" },
+  { "apps", 'a', 0, G_OPTION_ARG_INT, &opt_apps, "Number of apps", "N" },
+  { "iterations", 'i', 0, G_OPTION_ARG_INT, &opt_iterations, "Iterations per benchmark", "N" },
+  { "dbus", 0, 0, G_OPTION_ARG_NONE, &opt_dbus, "Also measure D-Bus calls to the running permission store", NULL },
+  { NULL }
+};
+
+static void
+report (const char *name,
+        int         iterations,
+        gint64      elapsed_usec)
+{
+  g_print ("{\"bench\": \"%s\", \"entries\": %d, \"apps\": %d, \"iterations\": %d, "
+           "\"total_usec\": %" G_GINT64_FORMAT ", \"nsec_per_op\": %.1f}\n",
+           name, opt_entries, opt_apps, iterations, elapsed_usec,
+           iterations > 0 ? (double) elapsed_usec * 1000 / iterations : 0.0);
+}
+
+static char *
+make_id (int i)
+{
+  return g_strdup_printf ("%x", i);
+}
+
+static char *
+make_app (int i)
+{
+  return g_strdup_printf ("org.bench.App%d", i);
+}
+
+static GVariant *
+make_data (int i)
+{
+  g_autofree char *path = g_strdup_printf ("/home/user/bench/file-%d", i);
+
+  return g_variant_new ("(^ayttu)", path, (guint64) 1, (guint64) i, 0);
+}
+
+static PermissionDb *
+create_db (void)
+{
+  const char *permissions[] = { "read", "write", NULL };
+  PermissionDb *db;
+  GError *error = NULL;
+  int i;
+
+  db = permission_db_new (NULL, FALSE, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < opt_entries; i++)
+    {
+      g_autofree char *id = make_id (i);
+      g_autofree char *app = make_app (i % opt_apps);
+      g_autoptr(PermissionDbEntry) entry = NULL;
+      g_autoptr(PermissionDbEntry) new_entry = NULL;
+
+      entry = permission_db_entry_new (make_data (i));
+      new_entry = permission_db_entry_set_app_permissions (entry, app, permissions);
+      permission_db_set_entry (db, id, new_entry);
+    }
+
+  permission_db_update (db);
+
+  return db;
+}
+
+static void
+bench_lookup (PermissionDb *db)
+{
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autofree char *id = make_id (g_random_int_range (0, opt_entries));
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
+
+      g_assert (entry != NULL);
+    }
+  report ("lookup", opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_list_ids_by_app (PermissionDb *db)
+{
+  int iterations = MAX (opt_iterations / 100, 1);
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    {
+      g_autofree char *app = make_app (i % opt_apps);
+      g_auto(GStrv) ids = permission_db_list_ids_by_app (db, app);
+    }
+  report ("list_ids_by_app", iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_list_ids_by_value (PermissionDb *db)
+{
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autoptr(GVariant) data = g_variant_ref_sink (make_data (g_random_int_range (0, opt_entries)));
+      g_auto(GStrv) ids = permission_db_list_ids_by_value (db, data);
+
+      g_assert (ids[0] != NULL);
+    }
+  report ("list_ids_by_value", opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_update_and_save (PermissionDb *db)
+{
+  const char *permissions[] = { "read", NULL };
+  int iterations = MAX (opt_iterations / 1000, 1);
+  g_autofree char *path = NULL;
+  gint64 update_usec = 0;
+  gint64 save_usec = 0;
+  GError *error = NULL;
+  int fd;
+  int i;
+
+  fd = g_file_open_tmp ("bench-permission-db-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  permission_db_set_path (db, path);
+
+  for (i = 0; i < iterations; i++)
+    {
+      g_autofree char *id = make_id (g_random_int_range (0, opt_entries));
+      g_autofree char *app = make_app (g_random_int_range (0, opt_apps));
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
+      g_autoptr(PermissionDbEntry) new_entry = NULL;
+      gint64 start;
+
+      new_entry = permission_db_entry_set_app_permissions (entry, app, permissions);
+      permission_db_set_entry (db, id, new_entry);
+
+      start = g_get_monotonic_time ();
+      permission_db_update (db);
+      update_usec += g_get_monotonic_time () - start;
+
+      start = g_get_monotonic_time ();
+      permission_db_save_content (db, &error);
+      g_assert_no_error (error);
+      save_usec += g_get_monotonic_time () - start;
+    }
+
+  report ("update", iterations, update_usec);
+  report ("save", iterations, save_usec);
+
+  unlink (path);
+}
+
+static void
+bench_dbus (void)
+{
+  const char *permissions[] = { "read", NULL };
+  g_autoptr(GDBusConnection) session_bus = NULL;
+  g_autoptr(XdgPermissionStore) store = NULL;
+  int iterations = MAX (opt_iterations / 10, 1);
+  GError *error = NULL;
+  gint64 start;
+  int i;
+
+  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+
+  store = xdg_permission_store_proxy_new_sync (session_bus, G_DBUS_PROXY_FLAGS_NONE,
+                                               "org.freedesktop.impl.portal.PermissionStore",
+                                               "/org/freedesktop/impl/portal/PermissionStore",
+                                               NULL, &error);
+  g_assert_no_error (error);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    {
+      g_autofree char *id = make_id (i);
+      g_autofree char *app = make_app (i % opt_apps);
+
+      xdg_permission_store_call_set_permission_sync (store, BENCH_TABLE, TRUE,
+                                                     id, app, permissions,
+                                                     NULL, &error);
+      g_assert_no_error (error);
+    }
+  report ("dbus_set_permission", iterations, g_get_monotonic_time () - start);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    {
+      g_autofree char *id = make_id (i);
+      g_autoptr(GVariant) perms = NULL;
+      g_autoptr(GVariant) data = NULL;
+
+      xdg_permission_store_call_lookup_sync (store, BENCH_TABLE, id,
+                                             &perms, &data,
+                                             NULL, &error);
+      g_assert_no_error (error);
+    }
+  report ("dbus_lookup", iterations, g_get_monotonic_time () - start);
+
+  for (i = 0; i < iterations; i++)
+    {
+      g_autofree char *id = make_id (i);
+
+      xdg_permission_store_call_delete_sync (store, BENCH_TABLE, id, NULL, NULL);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  context = g_option_context_new ("- benchmark the permission db");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("Option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (opt_entries < 1 || opt_apps < 1 || opt_iterations < 1)
+    {
+      g_printerr ("--entries, --apps and --iterations must be positive\n");
+      return 1;
+    }
+
+  start = g_get_monotonic_time ();
+  db = create_db ();
+  report ("create", opt_entries, g_get_monotonic_time () - start);
+
+  bench_lookup (db);
+  bench_list_ids_by_app (db);
+  bench_list_ids_by_value (db);
+  bench_update_and_save (db);
+
+  if (opt_dbus)
+    bench_dbus ();
+
+  return 0;
+}
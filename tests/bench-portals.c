@@ -0,0 +1,654 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Load generator for xdg-desktop-portal. Runs a private bus with the
+ * portal, the permission store and the test backends, like
+ * test-portals, and drives it from several clients at once, each with
+ * its own connection and unique name. Results are printed one JSON
+ * object per line, like bench-permission-db.
+ *
+ * Build it with "make bench-portals" and run it from the build
+ * directory, it needs the portal, the permission store and the test
+ * backends built there. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#define PORTAL_BUS_NAME "org.freedesktop.portal.Desktop"
+#define PORTAL_OBJECT_PATH "/org/freedesktop/portal/desktop"
+#define BACKEND_BUS_NAME "org.freedesktop.impl.portal.Test"
+#define PERMISSION_STORE_BUS_NAME "org.freedesktop.impl.portal.PermissionStore"
+#define DOCUMENTS_BUS_NAME "org.freedesktop.portal.Documents"
+#define DOCUMENTS_OBJECT_PATH "/org/freedesktop/portal/documents"
+
+static int opt_clients = 8;
+static double opt_duration = 5.0;
+static char **opt_workloads;
+
+static GOptionEntry entries[] = {
+  { "clients", 'c', 0, G_OPTION_ARG_INT, &opt_clients, "Number of concurrent clients", "N" },
+  { "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &opt_duration, "Seconds to run each workload", "SECONDS" },
+  { "workload", 'w', 0, G_OPTION_ARG_STRING_ARRAY, &opt_workloads, "Workload to run, can be repeated (default: all)", "NAME" },
+  { NULL }
+};
+
+static char outdir[] = "/tmp/xdp-bench-XXXXXX";
+static char *bus_address;
+static char *document_path;
+
+typedef struct {
+  int index;
+  GDBusConnection *connection;
+  GMainContext *context;
+  char *request_prefix;
+  guint serial;
+  gboolean got_response;
+  guint response;
+} Client;
+
+typedef gboolean (*WorkloadFunc) (Client  *client,
+                                  GError **error);
+
+static GVariant *
+call_portal (Client              *client,
+             const char          *interface,
+             const char          *method,
+             GVariant            *parameters,
+             const GVariantType  *reply_type,
+             GError             **error)
+{
+  return g_dbus_connection_call_sync (client->connection,
+                                      PORTAL_BUS_NAME,
+                                      PORTAL_OBJECT_PATH,
+                                      interface,
+                                      method,
+                                      parameters,
+                                      reply_type,
+                                      G_DBUS_CALL_FLAGS_NONE,
+                                      -1,
+                                      NULL,
+                                      error);
+}
+
+static void
+response_received (GDBusConnection *connection,
+                   const char      *sender_name,
+                   const char      *object_path,
+                   const char      *interface_name,
+                   const char      *signal_name,
+                   GVariant        *parameters,
+                   gpointer         data)
+{
+  Client *client = data;
+
+  g_variant_get (parameters, "(u@a{sv})", &client->response, NULL);
+  client->got_response = TRUE;
+}
+
+/* Makes a call that returns a Request, and waits for its Response. The
+ * subscription is made before the call, so the Response can't be
+ * missed. The options, with a handle token and bool_option if given,
+ * are appended to the parameters. */
+static gboolean
+call_portal_request (Client      *client,
+                     const char  *interface,
+                     const char  *method,
+                     GVariant    *parameters_no_options,
+                     const char  *bool_option,
+                     GError     **error)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autofree char *token = NULL;
+  g_autofree char *path = NULL;
+  GVariantBuilder builder;
+  GVariantBuilder options;
+  GVariantIter iter;
+  GVariant *child;
+  guint subscription;
+
+  token = g_strdup_printf ("bench%u", ++client->serial);
+  path = g_strconcat (client->request_prefix, token, NULL);
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&options, "{sv}", "handle_token", g_variant_new_string (token));
+  if (bool_option)
+    g_variant_builder_add (&options, "{sv}", bool_option, g_variant_new_boolean (TRUE));
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_TUPLE);
+  g_variant_ref_sink (parameters_no_options);
+  g_variant_iter_init (&iter, parameters_no_options);
+  while ((child = g_variant_iter_next_value (&iter)))
+    {
+      g_variant_builder_add_value (&builder, child);
+      g_variant_unref (child);
+    }
+  g_variant_unref (parameters_no_options);
+  g_variant_builder_add_value (&builder, g_variant_builder_end (&options));
+
+  client->got_response = FALSE;
+  subscription = g_dbus_connection_signal_subscribe (client->connection,
+                                                     NULL,
+                                                     "org.freedesktop.portal.Request",
+                                                     "Response",
+                                                     path,
+                                                     NULL,
+                                                     G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE,
+                                                     response_received,
+                                                     client,
+                                                     NULL);
+
+  reply = call_portal (client, interface, method,
+                       g_variant_builder_end (&builder),
+                       G_VARIANT_TYPE ("(o)"), error);
+
+  while (reply != NULL && !client->got_response)
+    g_main_context_iteration (client->context, TRUE);
+
+  g_dbus_connection_signal_unsubscribe (client->connection, subscription);
+
+  return reply != NULL;
+}
+
+static gboolean
+run_open_uri (Client  *client,
+              GError **error)
+{
+  /* Asking forces the app chooser, and the test app chooser cancels,
+   * so nothing gets launched */
+  return call_portal_request (client, "org.freedesktop.portal.OpenURI", "OpenURI",
+                              g_variant_new ("(ss)", "", "http://www.flatpak.org"),
+                              "ask",
+                              error);
+}
+
+static gboolean
+run_screenshot (Client  *client,
+                GError **error)
+{
+  return call_portal_request (client, "org.freedesktop.portal.Screenshot", "Screenshot",
+                              g_variant_new ("(s)", ""),
+                              NULL,
+                              error);
+}
+
+static gboolean
+run_settings (Client  *client,
+              GError **error)
+{
+  const char *namespaces[] = { NULL };
+  g_autoptr(GVariant) reply = NULL;
+
+  reply = call_portal (client, "org.freedesktop.portal.Settings", "ReadAll",
+                       g_variant_new ("(^as)", namespaces),
+                       NULL, error);
+
+  return reply != NULL;
+}
+
+static gboolean
+run_notification (Client  *client,
+                  GError **error)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) notification = NULL;
+
+  notification = g_variant_parse (G_VARIANT_TYPE_VARDICT,
+                                  "{ 'title': <'bench'>, 'body': <'bench notification'> }",
+                                  NULL, NULL, NULL);
+
+  reply = call_portal (client, "org.freedesktop.portal.Notification", "AddNotification",
+                       g_variant_new ("(s@a{sv})", "bench", notification),
+                       NULL, error);
+
+  return reply != NULL;
+}
+
+static gboolean
+run_inhibit (Client  *client,
+             GError **error)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) close_reply = NULL;
+  const char *handle;
+
+  reply = call_portal (client, "org.freedesktop.portal.Inhibit", "Inhibit",
+                       g_variant_new ("(su@a{sv})", "", 4,
+                                      g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                       G_VARIANT_TYPE ("(o)"), error);
+  if (reply == NULL)
+    return FALSE;
+
+  /* An inhibition lasts until its request is closed */
+  g_variant_get (reply, "(&o)", &handle);
+  close_reply = g_dbus_connection_call_sync (client->connection,
+                                             PORTAL_BUS_NAME,
+                                             handle,
+                                             "org.freedesktop.portal.Request",
+                                             "Close",
+                                             NULL,
+                                             NULL,
+                                             G_DBUS_CALL_FLAGS_NONE,
+                                             -1,
+                                             NULL,
+                                             error);
+
+  return close_reply != NULL;
+}
+
+/* The documents portal takes the app id as an argument, so each
+ * client can pretend to be a different app */
+static gboolean
+run_add_full (Client  *client,
+              GError **error)
+{
+  const char *permissions[] = { "read", NULL };
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autofree char *app_id = NULL;
+  gint32 handle;
+  int fd;
+
+  fd = open (document_path, O_PATH | O_CLOEXEC);
+  if (fd == -1)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Failed to open %s", document_path);
+      return FALSE;
+    }
+
+  fd_list = g_unix_fd_list_new ();
+  handle = g_unix_fd_list_append (fd_list, fd, error);
+  close (fd);
+  if (handle == -1)
+    return FALSE;
+
+  app_id = g_strdup_printf ("org.bench.App%d", client->index);
+
+  reply = g_dbus_connection_call_with_unix_fd_list_sync (client->connection,
+                                                         DOCUMENTS_BUS_NAME,
+                                                         DOCUMENTS_OBJECT_PATH,
+                                                         "org.freedesktop.portal.Documents",
+                                                         "AddFull",
+                                                         g_variant_new ("(@ahus^as)",
+                                                                        g_variant_new_fixed_array (G_VARIANT_TYPE_HANDLE,
+                                                                                                   &handle, 1, sizeof (gint32)),
+                                                                        1, /* reuse existing */
+                                                                        app_id,
+                                                                        permissions),
+                                                         NULL,
+                                                         G_DBUS_CALL_FLAGS_NONE,
+                                                         -1,
+                                                         fd_list,
+                                                         NULL,
+                                                         NULL,
+                                                         error);
+
+  return reply != NULL;
+}
+
+static const struct {
+  const char *name;
+  WorkloadFunc func;
+} workloads[] = {
+  { "open-uri", run_open_uri },
+  { "settings", run_settings },
+  { "notification", run_notification },
+  { "inhibit", run_inhibit },
+  { "screenshot", run_screenshot },
+  { "add-full", run_add_full },
+};
+
+typedef struct {
+  int index;
+  WorkloadFunc func;
+  gint64 deadline;
+  GArray *latencies;
+  int errors;
+  char *first_error;
+} ClientRun;
+
+static Client *
+client_new (int      index,
+            GError **error)
+{
+  g_autoptr(GDBusConnection) connection = NULL;
+  g_autofree char *sender = NULL;
+  Client *client;
+  char *p;
+
+  connection = g_dbus_connection_new_for_address_sync (bus_address,
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL, NULL, error);
+  if (connection == NULL)
+    return NULL;
+
+  sender = g_strdup (g_dbus_connection_get_unique_name (connection) + 1);
+  for (p = sender; *p; p++)
+    if (*p == '.')
+      *p = '_';
+
+  client = g_new0 (Client, 1);
+  client->index = index;
+  client->connection = g_steal_pointer (&connection);
+  client->context = g_main_context_ref_thread_default ();
+  client->request_prefix = g_strconcat (PORTAL_OBJECT_PATH, "/request/", sender, "/", NULL);
+
+  return client;
+}
+
+static void
+client_free (Client *client)
+{
+  g_dbus_connection_close_sync (client->connection, NULL, NULL);
+  g_object_unref (client->connection);
+  g_main_context_unref (client->context);
+  g_free (client->request_prefix);
+  g_free (client);
+}
+
+static gpointer
+client_thread (gpointer data)
+{
+  ClientRun *run = data;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  g_autoptr(GError) error = NULL;
+  Client *client;
+
+  g_main_context_push_thread_default (context);
+
+  client = client_new (run->index, &error);
+  if (client == NULL)
+    {
+      run->errors++;
+      run->first_error = g_strdup (error->message);
+      g_main_context_pop_thread_default (context);
+      return NULL;
+    }
+
+  while (g_get_monotonic_time () < run->deadline)
+    {
+      g_autoptr(GError) call_error = NULL;
+      gint64 start = g_get_monotonic_time ();
+      gint64 elapsed;
+
+      if (!run->func (client, &call_error))
+        {
+          run->errors++;
+          if (run->first_error == NULL)
+            run->first_error = g_strdup (call_error->message);
+        }
+
+      elapsed = g_get_monotonic_time () - start;
+      g_array_append_val (run->latencies, elapsed);
+    }
+
+  client_free (client);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static int
+compare_latencies (gconstpointer a,
+                   gconstpointer b)
+{
+  gint64 la = *(const gint64 *) a;
+  gint64 lb = *(const gint64 *) b;
+
+  return la < lb ? -1 : la > lb;
+}
+
+static double
+percentile_usec (GArray *sorted,
+                 int     percent)
+{
+  if (sorted->len == 0)
+    return 0;
+
+  return g_array_index (sorted, gint64, MIN (sorted->len - 1, (sorted->len * percent) / 100));
+}
+
+static void
+run_workload (const char   *name,
+              WorkloadFunc  func)
+{
+  g_autoptr(GPtrArray) threads = NULL;
+  g_autoptr(GArray) all = NULL;
+  g_autofree ClientRun *runs = NULL;
+  gint64 start, elapsed;
+  int errors = 0;
+  const char *first_error = NULL;
+  int i;
+
+  runs = g_new0 (ClientRun, opt_clients);
+  threads = g_ptr_array_new ();
+  all = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_clients; i++)
+    {
+      runs[i].index = i;
+      runs[i].func = func;
+      runs[i].deadline = start + (gint64) (opt_duration * G_USEC_PER_SEC);
+      runs[i].latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+      g_ptr_array_add (threads, g_thread_new ("bench-client", client_thread, &runs[i]));
+    }
+
+  for (i = 0; i < opt_clients; i++)
+    g_thread_join (g_ptr_array_index (threads, i));
+  elapsed = g_get_monotonic_time () - start;
+
+  for (i = 0; i < opt_clients; i++)
+    {
+      g_array_append_vals (all, runs[i].latencies->data, runs[i].latencies->len);
+      errors += runs[i].errors;
+      if (first_error == NULL)
+        first_error = runs[i].first_error;
+    }
+  g_array_sort (all, compare_latencies);
+
+  if (first_error)
+    g_printerr ("%s: %d errors, first: %s\n", name, errors, first_error);
+
+  g_print ("{\"bench\": \"%s\", \"clients\": %d, \"ops\": %u, \"errors\": %d, "
+           "\"ops_per_sec\": %.1f, \"p50_usec\": %.1f, \"p99_usec\": %.1f}\n",
+           name, opt_clients, all->len, errors,
+           all->len * (double) G_USEC_PER_SEC / elapsed,
+           percentile_usec (all, 50),
+           percentile_usec (all, 99));
+
+  for (i = 0; i < opt_clients; i++)
+    {
+      g_array_unref (runs[i].latencies);
+      g_free (runs[i].first_error);
+    }
+}
+
+static void
+write_keyfile (const char *name,
+               const char *contents)
+{
+  g_autofree char *path = g_build_filename (outdir, name, NULL);
+  g_autoptr(GError) error = NULL;
+
+  if (!g_file_set_contents (path, contents, -1, &error))
+    g_error ("Failed to write %s: %s", path, error->message);
+}
+
+/* The test backends read their behaviour from keyfiles in
+ * XDG_DATA_HOME. Respond right away, and don't launch anything. */
+static void
+write_backend_config (void)
+{
+  write_keyfile ("appchooser",
+                 "[backend]\ndelay=0\nresponse=1\n");
+  write_keyfile ("screenshot",
+                 "[backend]\ndelay=0\nresponse=0\n"
+                 "[result]\nuri=file://bench/image\nresponse=0\n");
+  write_keyfile ("inhibit",
+                 "[backend]\ndelay=0\nresponse=0\n"
+                 "[inhibit]\nflags=4\n");
+  write_keyfile ("notification",
+                 "[backend]\ndelay=0\n"
+                 "[notification]\ndata={ 'title': <'bench'>, 'body': <'bench notification'> }\n");
+
+  document_path = g_build_filename (outdir, "document.txt", NULL);
+  if (!g_file_set_contents (document_path, "bench\n", -1, NULL))
+    g_error ("Failed to write %s", document_path);
+}
+
+static void
+name_appeared_cb (GDBusConnection *bus,
+                  const char      *name,
+                  const char      *name_owner,
+                  gpointer         data)
+{
+  *(gboolean *) data = TRUE;
+  g_main_context_wakeup (NULL);
+}
+
+static GSubprocess *
+launch_and_wait (GDBusConnection  *session_bus,
+                 const char       *bus_name,
+                 const char      **argv)
+{
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *portal_dir = NULL;
+  GSubprocess *subprocess;
+  gboolean appeared = FALSE;
+  gint64 timeout;
+  guint watch;
+
+  watch = g_bus_watch_name_on_connection (session_bus, bus_name, 0,
+                                          name_appeared_cb, NULL,
+                                          &appeared, NULL);
+
+  portal_dir = g_build_filename (BENCH_SRCDIR, "tests", "portals", NULL);
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_setenv (launcher, "DBUS_SESSION_BUS_ADDRESS", bus_address, TRUE);
+  g_subprocess_launcher_setenv (launcher, "XDG_DESKTOP_PORTAL_DIR", portal_dir, TRUE);
+  g_subprocess_launcher_setenv (launcher, "XDG_DATA_HOME", outdir, TRUE);
+  g_subprocess_launcher_setenv (launcher, "XDG_RUNTIME_DIR", outdir, TRUE);
+
+  subprocess = g_subprocess_launcher_spawnv (launcher, argv, &error);
+  if (subprocess == NULL)
+    g_error ("Failed to launch %s: %s", argv[0], error->message);
+
+  timeout = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  while (!appeared)
+    {
+      if (g_get_monotonic_time () > timeout)
+        g_error ("%s did not appear on the bus", bus_name);
+      g_main_context_iteration (NULL, FALSE);
+      g_usleep (1000);
+    }
+
+  g_bus_unwatch_name (watch);
+
+  return subprocess;
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GTestDBus) dbus = NULL;
+  g_autoptr(GDBusConnection) session_bus = NULL;
+  g_autoptr(GSubprocess) backends = NULL;
+  g_autoptr(GSubprocess) portal = NULL;
+  g_autoptr(GSubprocess) permission_store = NULL;
+  g_autofree char *services = NULL;
+  const char *backends_argv[] = { BENCH_BUILDDIR "/tests/test-backends", NULL };
+  const char *portal_argv[] = { BENCH_BUILDDIR "/xdg-desktop-portal", NULL };
+  const char *permission_store_argv[] = { BENCH_BUILDDIR "/xdg-permission-store", "--replace", NULL };
+  int i, j;
+
+  context = g_option_context_new ("- benchmark the portals against the test backends");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("Option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (opt_clients < 1 || opt_duration <= 0)
+    {
+      g_printerr ("--clients and --duration must be positive\n");
+      return 1;
+    }
+
+  for (i = 0; opt_workloads && opt_workloads[i]; i++)
+    {
+      for (j = 0; j < G_N_ELEMENTS (workloads); j++)
+        if (strcmp (opt_workloads[i], workloads[j].name) == 0)
+          break;
+
+      if (j == G_N_ELEMENTS (workloads))
+        {
+          g_printerr ("Unknown workload %s\n", opt_workloads[i]);
+          return 1;
+        }
+    }
+
+  g_mkdtemp (outdir);
+  g_setenv ("XDG_DATA_HOME", outdir, TRUE);
+  write_backend_config ();
+
+  dbus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  services = g_build_filename (BENCH_BUILDDIR, "tests", "services", NULL);
+  g_test_dbus_add_service_dir (dbus, services);
+  g_test_dbus_up (dbus);
+
+  /* g_test_dbus_up unsets this, so re-set */
+  g_setenv ("XDG_RUNTIME_DIR", outdir, TRUE);
+
+  bus_address = g_strdup (g_test_dbus_get_bus_address (dbus));
+  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (session_bus == NULL)
+    g_error ("No session bus: %s", error->message);
+
+  backends = launch_and_wait (session_bus, BACKEND_BUS_NAME, backends_argv);
+  portal = launch_and_wait (session_bus, PORTAL_BUS_NAME, portal_argv);
+  permission_store = launch_and_wait (session_bus, PERMISSION_STORE_BUS_NAME, permission_store_argv);
+
+  for (j = 0; j < G_N_ELEMENTS (workloads); j++)
+    {
+      if (opt_workloads && !g_strv_contains ((const char * const *) opt_workloads, workloads[j].name))
+        continue;
+
+      run_workload (workloads[j].name, workloads[j].func);
+    }
+
+  g_subprocess_force_exit (portal);
+  g_subprocess_force_exit (permission_store);
+  g_subprocess_force_exit (backends);
+
+  g_dbus_connection_close_sync (session_bus, NULL, NULL);
+  g_test_dbus_down (dbus);
+
+  return 0;
+}
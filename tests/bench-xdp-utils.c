@@ -0,0 +1,413 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmarks for the xdp-utils helpers that run on every request.
+ * Results are printed one JSON object per line, like
+ * bench-permission-db.
+ *
+ * The pid mapping helpers and the app info internals are static, so
+ * xdp-utils.c is built into this program instead of being linked. */
+
+#include "src/xdp-utils.c"
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+static int opt_iterations = 100000;
+static int opt_options = 32;
+static int opt_depth = 16;
+static int opt_processes = 64;
+
+static GOptionEntry entries[] = {
+  { "iterations", 'i', 0, G_OPTION_ARG_INT, &opt_iterations, "Iterations per benchmark", "N" },
+  { "options", 'o', 0, G_OPTION_ARG_INT, &opt_options, "Number of entries in the options dict", "N" },
+  { "depth", 'd', 0, G_OPTION_ARG_INT, &opt_depth, "Number of elements in paths", "N" },
+  { "processes", 'p', 0, G_OPTION_ARG_INT, &opt_processes, "Number of extra processes for the pid mapping benchmarks, half of them in pid namespaces of their own", "N" },
+  { NULL }
+};
+
+static void
+report (const char *name,
+        int         iterations,
+        gint64      elapsed_usec)
+{
+  g_print ("{\"bench\": \"%s\", \"options\": %d, \"depth\": %d, \"processes\": %d, \"iterations\": %d, "
+           "\"total_usec\": %" G_GINT64_FORMAT ", \"nsec_per_op\": %.1f}\n",
+           name, opt_options, opt_depth, opt_processes, iterations, elapsed_usec,
+           iterations > 0 ? (double) elapsed_usec * 1000 / iterations : 0.0);
+}
+
+static char *
+make_deep_path (const char *prefix,
+                const char *separator)
+{
+  GString *path = g_string_new (prefix);
+  int i;
+
+  for (i = 0; i < opt_depth; i++)
+    g_string_append_printf (path, "%sdir-%d", separator, i);
+
+  return g_string_free (path, FALSE);
+}
+
+static XdpOptionKey bench_options[] = {
+  { "handle_token", G_VARIANT_TYPE_STRING, NULL },
+  { "modal", G_VARIANT_TYPE_BOOLEAN, NULL },
+  { "multiple", G_VARIANT_TYPE_BOOLEAN, NULL },
+  { "directory", G_VARIANT_TYPE_BOOLEAN, NULL },
+  { "accept_label", G_VARIANT_TYPE_STRING, NULL },
+  { "current_name", G_VARIANT_TYPE_STRING, NULL },
+  { "current_folder", G_VARIANT_TYPE_BYTESTRING, NULL },
+  { "choices", (const GVariantType *) "a(ssa(ss)s)", NULL },
+};
+
+/* A dict with all the supported options, padded with unknown ones as
+ * sent by clients that pass everything they have */
+static GVariant *
+make_options (void)
+{
+  GVariantBuilder builder;
+  int i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "handle_token", g_variant_new_string ("bench1"));
+  g_variant_builder_add (&builder, "{sv}", "modal", g_variant_new_boolean (TRUE));
+  g_variant_builder_add (&builder, "{sv}", "multiple", g_variant_new_boolean (FALSE));
+  g_variant_builder_add (&builder, "{sv}", "accept_label", g_variant_new_string ("_Open"));
+  g_variant_builder_add (&builder, "{sv}", "current_folder", g_variant_new_bytestring ("/home/user/Documents"));
+
+  for (i = 5; i < opt_options; i++)
+    {
+      g_autofree char *key = g_strdup_printf ("unknown-option-%d", i);
+
+      g_variant_builder_add (&builder, "{sv}", key, g_variant_new_uint32 (i));
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+bench_filter_options (void)
+{
+  g_autoptr(GVariant) options = make_options ();
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autoptr(GVariant) filtered = NULL;
+      GVariantBuilder builder;
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+      xdp_filter_options (options, &builder, bench_options, G_N_ELEMENTS (bench_options), NULL);
+      filtered = g_variant_ref_sink (g_variant_builder_end (&builder));
+    }
+  report ("filter_options", opt_iterations, g_get_monotonic_time () - start);
+}
+
+static XdpAppInfo *
+make_flatpak_app_info (void)
+{
+  XdpAppInfo *app_info = xdp_app_info_new (XDP_APP_INFO_KIND_FLATPAK);
+
+  app_info->id = g_strdup ("org.bench.App");
+  app_info->u.flatpak.app_path = g_strdup ("/var/lib/flatpak/app/org.bench.App/x86_64/master/active/files");
+  app_info->u.flatpak.runtime_path = g_strdup ("/var/lib/flatpak/runtime/org.bench.Platform/x86_64/1/active/files");
+
+  return app_info;
+}
+
+static void
+bench_get_path_for_fd (const char *name,
+                       XdpAppInfo *app_info,
+                       const char *file,
+                       int         flags)
+{
+  xdp_autofd int fd = -1;
+  gint64 start;
+  int i;
+
+  fd = open (file, flags | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autofree char *path = xdp_app_info_get_path_for_fd (app_info, fd, 0, NULL, NULL);
+
+      g_assert (path != NULL);
+    }
+  report (name, opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_remap_path (XdpAppInfo *app_info)
+{
+  g_autofree char *app_path = make_deep_path ("/app", "/");
+  g_autofree char *usr_path = make_deep_path ("/usr", "/");
+  g_autofree char *newroot_path = make_deep_path ("/newroot/run/host/usr", "/");
+  g_autofree char *home_path = make_deep_path ("/home/user", "/");
+  const char *paths[] = { app_path, usr_path, newroot_path, home_path };
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autofree char *remapped = xdp_app_info_remap_path (app_info, paths[i % G_N_ELEMENTS (paths)]);
+    }
+  report ("remap_path", opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_is_valid_app_id (void)
+{
+  g_autofree char *long_id = make_deep_path ("org.bench", ".");
+  const char *ids[] = {
+    "org.gnome.TextEditor",
+    "com.example.App-Devel",
+    "snap.firefox",
+    long_id,
+    "org.bench.-Invalid",
+    "org..bench",
+  };
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    xdp_is_valid_app_id (ids[i % G_N_ELEMENTS (ids)]);
+  report ("is_valid_app_id", opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_canonicalize_filename (void)
+{
+  g_autofree char *plain = make_deep_path ("/home/user", "/");
+  g_autofree char *messy = make_deep_path ("/home//user/./", "/../x/./");
+  const char *paths[] = { plain, messy };
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autofree char *canonical = xdp_canonicalize_filename (paths[i % G_N_ELEMENTS (paths)]);
+    }
+  report ("canonicalize_filename", opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_has_path_prefix (void)
+{
+  g_autofree char *path = make_deep_path ("/home/user", "/");
+  g_autofree char *prefix = g_strndup (path, strrchr (path, '/') - path);
+  g_autofree char *mismatch = g_strconcat (prefix, "x", NULL);
+  const char *prefixes[] = { prefix, mismatch, "/home/user", "/var" };
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    xdp_has_path_prefix (path, prefixes[i % G_N_ELEMENTS (prefixes)]);
+  report ("has_path_prefix", opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_parse_status_file (void)
+{
+  xdp_autofd int pid_fd = -1;
+  gint64 start;
+  int i;
+
+  pid_fd = open ("/proc/self", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (pid_fd, >=, 0);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      pid_t pid = 0;
+      uid_t uid = 0;
+
+      g_assert_cmpint (parse_status_file (pid_fd, &pid, &uid), ==, 0);
+    }
+  report ("parse_status_file", opt_iterations, g_get_monotonic_time () - start);
+}
+
+/* Children that sleep until the benchmark is done. Every other one
+ * moves its own child into new user and pid namespaces, if allowed, so
+ * the /proc walk sees processes of other namespaces like it does with
+ * running apps. */
+static GArray *
+spawn_processes (void)
+{
+  GArray *children = g_array_new (FALSE, FALSE, sizeof (pid_t));
+  int i;
+
+  for (i = 0; i < opt_processes; i++)
+    {
+      pid_t pid = fork ();
+
+      g_assert_cmpint (pid, >=, 0);
+
+      if (pid == 0)
+        {
+          prctl (PR_SET_PDEATHSIG, SIGKILL);
+
+          if (i % 2 == 1 && unshare (CLONE_NEWUSER | CLONE_NEWPID) == 0)
+            {
+              pid_t inner = fork ();
+
+              if (inner == 0)
+                {
+                  prctl (PR_SET_PDEATHSIG, SIGKILL);
+                  pause ();
+                  _exit (0);
+                }
+            }
+
+          pause ();
+          _exit (0);
+        }
+
+      g_array_append_val (children, pid);
+    }
+
+  return children;
+}
+
+static void
+kill_processes (GArray *children)
+{
+  guint i;
+
+  for (i = 0; i < children->len; i++)
+    kill (g_array_index (children, pid_t, i), SIGKILL);
+  for (i = 0; i < children->len; i++)
+    waitpid (g_array_index (children, pid_t, i), NULL, 0);
+
+  g_array_unref (children);
+}
+
+static void
+bench_map_pids_one (const char *name,
+                    GArray     *children,
+                    ino_t       ns,
+                    gboolean    cached,
+                    int         iterations)
+{
+  pid_t pids[4];
+  gint64 start;
+  int i;
+  guint j;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      DIR *proc;
+
+      /* The children are in the namespace of the benchmark, so their
+       * pids are the same inside and outside */
+      for (j = 0; j < G_N_ELEMENTS (pids); j++)
+        pids[j] = children->len > 0 ? g_array_index (children, pid_t, (i + j) % children->len) : getpid ();
+
+      if (!cached)
+        pid_maps_clear ();
+
+      proc = opendir ("/proc");
+      g_assert (proc != NULL);
+      if (!map_pids (proc, ns, pids, G_N_ELEMENTS (pids), getuid (), &error))
+        g_error ("Mapping pids failed: %s", error->message);
+      closedir (proc);
+    }
+  report (name, iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_map_pids (void)
+{
+  GArray *children = spawn_processes ();
+  xdp_autofd int pid_fd = -1;
+  ino_t ns = 0;
+
+  pid_fd = open ("/proc/self", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (pid_fd, >=, 0);
+  g_assert_cmpint (lookup_ns_from_pid_fd (pid_fd, &ns), ==, 0);
+
+  /* Walking /proc is slow, so fewer iterations for the cold case */
+  bench_map_pids_one ("map_pids_cold", children, ns, FALSE, MAX (opt_iterations / 1000, 1));
+  bench_map_pids_one ("map_pids_cached", children, ns, TRUE, MAX (opt_iterations / 100, 1));
+
+  kill_processes (children);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(XdpAppInfo) host = NULL;
+  g_autoptr(XdpAppInfo) flatpak = NULL;
+  g_autofree char *tmpdir = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *file = NULL;
+
+  context = g_option_context_new ("- benchmark the xdp-utils helpers");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("Option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (opt_iterations < 1 || opt_options < 1 || opt_depth < 1 || opt_processes < 0)
+    {
+      g_printerr ("--iterations, --options and --depth must be positive\n");
+      return 1;
+    }
+
+  tmpdir = g_dir_make_tmp ("bench-xdp-utils-XXXXXX", &error);
+  g_assert_no_error (error);
+  dir = make_deep_path (tmpdir, "/");
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+  file = g_build_filename (dir, "document.txt", NULL);
+  g_file_set_contents (file, "bench\n", -1, &error);
+  g_assert_no_error (error);
+
+  host = xdp_app_info_new_host ();
+  flatpak = make_flatpak_app_info ();
+
+  bench_filter_options ();
+  bench_get_path_for_fd ("get_path_for_fd_host", host, file, O_RDONLY);
+  bench_get_path_for_fd ("get_path_for_fd_opath", flatpak, file, O_PATH);
+  bench_remap_path (flatpak);
+  bench_is_valid_app_id ();
+  bench_canonicalize_filename ();
+  bench_has_path_prefix ();
+  bench_parse_status_file ();
+  bench_map_pids ();
+
+  unlink (file);
+  while (strcmp (dir, tmpdir) != 0)
+    {
+      rmdir (dir);
+      *strrchr (dir, '/') = 0;
+    }
+  rmdir (tmpdir);
+
+  return 0;
+}
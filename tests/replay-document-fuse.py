@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+
+# Records and replays document portal fuse traffic.
+#
+# "dump" saves the trace of a document portal started with --fuse-trace
+# as JSON, "replay" runs a saved trace against a private document
+# portal, see replay-document-fuse.sh. Node ids are only meaningful in
+# the portal that recorded them, so every document node in the trace is
+# mapped to a file of the replay document, keeping the shape of the
+# traffic (which ops, on how many nodes, with what sizes and gaps)
+# rather than the exact paths. Results are printed one JSON object per
+# line, like bench-document-fuse.
+
+import os, sys, argparse, threading, time, json
+from gi.repository import Gio, GLib
+
+DOCUMENT_ADD_FLAGS_REUSE_EXISTING             = (1 << 0)
+DOCUMENT_ADD_FLAGS_DIRECTORY                  = (1 << 3)
+
+APP_ID = "org.replay.App"
+DOCUMENT_DOMAIN = 4
+
+parser = argparse.ArgumentParser()
+sub = parser.add_subparsers(dest="mode", required=True)
+dump_parser = sub.add_parser("dump", help="Save the trace of the running document portal")
+dump_parser.add_argument("output", help="JSON file to write")
+replay_parser = sub.add_parser("replay", help="Replay a saved trace")
+replay_parser.add_argument("input", help="JSON file written by dump")
+replay_parser.add_argument("--threads", type=int, default=4, help="Number of threads issuing requests")
+replay_parser.add_argument("--speed", type=float, default=0.0,
+                           help="Replay at this multiple of the recorded pace (default: as fast as possible)")
+replay_parser.add_argument("--file-size", type=int, default=4*1024*1024, help="Size of the replay files")
+args = parser.parse_args(sys.argv[1:])
+
+def get_proxy(interface, path="/org/freedesktop/portal/documents"):
+    bus = Gio.bus_get_sync(Gio.BusType.SESSION, None)
+    return Gio.DBusProxy.new_sync(bus, Gio.DBusProxyFlags.NONE, None,
+                                  "org.freedesktop.portal.Documents", path, interface, None)
+
+def dump():
+    proxy = get_proxy("org.freedesktop.portal.Documents.Debug")
+    res = proxy.call_sync("GetFuseTrace", None, 0, -1, None)
+    records = [ { "start": start, "duration": duration, "op": op,
+                  "domain": domain, "node": node, "size": size }
+                for (start, duration, op, domain, node, size) in res[0] ]
+    with open(args.output, "w") as f:
+        json.dump(records, f)
+    print("Saved %d requests to %s" % (len(records), args.output), file=sys.stderr)
+
+def add_full(proxy, path, flags, permissions):
+    fdlist = Gio.UnixFDList.new()
+    fd = os.open(path, os.O_PATH)
+    handle = fdlist.append(fd)
+    os.close(fd)
+    res = proxy.call_with_unix_fd_list_sync("AddFull",
+                                            GLib.Variant('(ahusas)',
+                                                         ([handle], flags, APP_ID, permissions)),
+                                            0, -1, fdlist, None)
+    return res[0][0][0]
+
+def setup(records, data_dir):
+    proxy = get_proxy("org.freedesktop.portal.Documents")
+    res = proxy.call_sync("GetMountPoint", None, 0, -1, None)
+    mountpoint = bytearray(res[0][:-1]).decode("utf-8")
+
+    nodes = sorted(set(r["node"] for r in records if r["domain"] == DOCUMENT_DOMAIN))
+    replay_dir = os.path.join(data_dir, "replay-dir")
+    os.makedirs(replay_dir, exist_ok=True)
+    block = os.urandom(64 * 1024)
+    files = {}
+    for i, node in enumerate(nodes):
+        name = "file-%d" % i
+        with open(os.path.join(replay_dir, name), "wb") as f:
+            for _ in range(args.file_size // len(block)):
+                f.write(block)
+        files[node] = name
+
+    doc_id = add_full(proxy, replay_dir,
+                      DOCUMENT_ADD_FLAGS_REUSE_EXISTING | DOCUMENT_ADD_FLAGS_DIRECTORY,
+                      ["read", "write"])
+    app_dir = os.path.join(mountpoint, "by-app", APP_ID)
+    doc_dir = os.path.join(app_dir, doc_id, "replay-dir")
+    paths = { 1: mountpoint, 2: os.path.join(mountpoint, "by-app"), 3: app_dir }
+    return (paths, doc_dir, files)
+
+class Replayer:
+    def __init__(self, paths, doc_dir, files):
+        self.paths = paths
+        self.doc_dir = doc_dir
+        self.files = files
+        self.local = threading.local()
+
+    def path(self, r):
+        if r["domain"] == DOCUMENT_DOMAIN and r["node"] in self.files:
+            return os.path.join(self.doc_dir, self.files[r["node"]])
+        return self.paths.get(r["domain"], self.doc_dir)
+
+    def fd(self, path, flags):
+        fds = getattr(self.local, "fds", None)
+        if fds is None:
+            fds = self.local.fds = {}
+        key = (path, flags)
+        if key not in fds:
+            fds[key] = os.open(path, flags)
+        return fds[key]
+
+    def close(self):
+        for fd in getattr(self.local, "fds", {}).values():
+            os.close(fd)
+
+    # Traces have no offsets, spread requests over the file by start time
+    def offset(self, r):
+        blocks = max((args.file_size - max(r["size"], 1)) // 4096, 1)
+        return (r["start"] % blocks) * 4096
+
+    # Issues the syscall that makes the kernel send a request like r.
+    # Returns False for requests that have no direct equivalent.
+    def run(self, r):
+        op = r["op"]
+        path = self.path(r)
+        if op in ("LOOKUP", "GETATTR", "ACCESS"):
+            os.stat(path)
+        elif op in ("OPENDIR", "READDIR", "READDIRPLUS"):
+            with os.scandir(path if os.path.isdir(path) else self.doc_dir) as it:
+                for entry in it:
+                    pass
+        elif op in ("OPEN", "RELEASE", "FLUSH", "CREATE"):
+            os.close(os.open(path, os.O_RDONLY))
+        elif op == "READ":
+            os.pread(self.fd(path, os.O_RDONLY), max(r["size"], 1), self.offset(r))
+        elif op == "WRITE":
+            os.pwrite(self.fd(path, os.O_WRONLY), b"x" * max(r["size"], 1), self.offset(r))
+        elif op == "FSYNC":
+            os.fsync(self.fd(path, os.O_WRONLY))
+        elif op == "SETATTR":
+            os.utime(path)
+        elif op == "STATFS":
+            os.statvfs(path)
+        elif op in ("GETXATTR", "LISTXATTR"):
+            os.listxattr(path)
+        elif op == "RENAME":
+            tmp = os.path.join(self.doc_dir, ".replay.%d~" % threading.get_ident())
+            with open(tmp, "w") as f:
+                f.write("saved\n")
+            os.rename(tmp, os.path.join(self.doc_dir, ".replay-saved"))
+        else:
+            return False
+        return True
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100))]
+
+def replay():
+    with open(args.input) as f:
+        records = json.load(f)
+
+    replayer = Replayer(*setup(records, os.environ['TEST_DATA_DIR']))
+    latencies = {}
+    errors = {}
+    skipped = {}
+    lock = threading.Lock()
+    # Records are split round-robin so concurrent requests in the trace
+    # stay roughly concurrent
+    shards = [ records[i::args.threads] for i in range(args.threads) ]
+    start = time.monotonic()
+
+    def worker(shard):
+        try:
+            for r in shard:
+                if args.speed > 0:
+                    delay = start + r["start"] / 1e6 / args.speed - time.monotonic()
+                    if delay > 0:
+                        time.sleep(delay)
+                t = time.perf_counter_ns()
+                try:
+                    done = replayer.run(r)
+                    failed = False
+                except OSError:
+                    done = True
+                    failed = True
+                elapsed = time.perf_counter_ns() - t
+                with lock:
+                    if not done:
+                        skipped[r["op"]] = skipped.get(r["op"], 0) + 1
+                        continue
+                    latencies.setdefault(r["op"], []).append(elapsed)
+                    if failed:
+                        errors[r["op"]] = errors.get(r["op"], 0) + 1
+        finally:
+            replayer.close()
+
+    threads = [ threading.Thread(target=worker, args=(shard,)) for shard in shards ]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - start
+
+    for op in sorted(latencies):
+        values = sorted(latencies[op])
+        recorded = sorted(r["duration"] for r in records if r["op"] == op)
+        print(json.dumps({ "replay": op,
+                           "threads": args.threads,
+                           "ops": len(values),
+                           "errors": errors.get(op, 0),
+                           "ops_per_sec": round(len(values) / elapsed, 1),
+                           "p50_usec": round(percentile(values, 50) / 1000, 1),
+                           "p99_usec": round(percentile(values, 99) / 1000, 1),
+                           "recorded_p50_usec": percentile(recorded, 50),
+                           "recorded_p99_usec": percentile(recorded, 99) }))
+    if skipped:
+        print(json.dumps({ "skipped": skipped }))
+    sys.stdout.flush()
+
+if args.mode == "dump":
+    dump()
+else:
+    replay()
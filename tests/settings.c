@@ -0,0 +1,104 @@
+#include <config.h>
+
+#include "settings.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gio/gunixfdlist.h>
+#include "src/xdp-dbus.h"
+
+#define PORTAL_BUS_NAME "org.freedesktop.portal.Desktop"
+#define PORTAL_OBJECT_PATH "/org/freedesktop/portal/desktop"
+
+static int
+read_all_shared (XdpSettings *proxy)
+{
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) fd_handle = NULL;
+  g_autoptr(GError) error = NULL;
+  guint64 generation;
+  int fd;
+
+  xdp_settings_call_read_all_shared_sync (proxy,
+                                          g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                                          NULL,
+                                          &fd_handle,
+                                          &generation,
+                                          &fd_list,
+                                          NULL,
+                                          &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (generation, >, 0);
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (fd_handle), &error);
+  g_assert_no_error (error);
+
+  return fd;
+}
+
+/* The mapped file has the same settings as ReadAll(), and every
+ * client reads it at its own offset */
+void
+test_settings_read_all_shared (void)
+{
+  g_autoptr(GDBusConnection) session_bus = NULL;
+  g_autoptr(XdpSettings) proxy = NULL;
+  g_autoptr(GVariant) all = NULL;
+  g_autoptr(GVariant) shared = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *no_namespaces[] = { NULL };
+  gpointer data = NULL;
+  struct stat st;
+  char c;
+  int fd, other_fd;
+
+  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+
+  proxy = xdp_settings_proxy_new_sync (session_bus, 0,
+                                       PORTAL_BUS_NAME,
+                                       PORTAL_OBJECT_PATH,
+                                       NULL,
+                                       &error);
+  g_assert_no_error (error);
+
+  xdp_settings_call_read_all_sync (proxy, no_namespaces, &all, NULL, &error);
+  g_assert_no_error (error);
+
+  fd = read_all_shared (proxy);
+  other_fd = read_all_shared (proxy);
+
+  g_assert_cmpint (fstat (fd, &st), ==, 0);
+  if (st.st_size > 0)
+    {
+      data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      g_assert_true (data != MAP_FAILED);
+    }
+
+  shared = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("a{sa{sv}}"),
+                                                        data, st.st_size, FALSE,
+                                                        NULL, NULL));
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *swapped = g_variant_byteswap (shared);
+
+      g_variant_unref (shared);
+      shared = swapped;
+    }
+
+  g_assert_true (g_variant_equal (shared, all));
+
+  if (st.st_size > 0)
+    {
+      g_assert_cmpint (read (fd, &c, 1), ==, 1);
+      g_assert_cmpint (lseek (other_fd, 0, SEEK_CUR), ==, 0);
+    }
+
+  /* The variant may point into the mapping */
+  g_clear_pointer (&shared, g_variant_unref);
+  if (data)
+    munmap (data, st.st_size);
+  close (fd);
+  close (other_fd);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+void test_settings_read_all_shared (void);
@@ -916,6 +916,118 @@ global_teardown (void)
   g_assert_no_error (error);
 }
 
+static void
+test_list_paged (void)
+{
+  g_autoptr(GVariant) all_docs = NULL;
+  g_autoptr(GHashTable) seen = NULL;
+  g_autofree char *start_after = g_strdup ("");
+  GError *error = NULL;
+  gboolean res;
+  int i;
+
+  if (cannot_use_fuse != NULL)
+    {
+      g_test_skip (cannot_use_fuse);
+      return;
+    }
+
+  for (i = 0; i < 5; i++)
+    {
+      g_autofree char *basename = g_strdup_printf ("list-paged-%d", i);
+      g_autofree char *id = export_new_file (basename, "content", TRUE);
+    }
+
+  res = xdp_dbus_documents_call_list_sync (documents, "", &all_docs, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (res);
+
+  seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  do
+    {
+      g_autoptr(GVariant) docs = NULL;
+      g_autofree char *next = NULL;
+      GVariantIter iter;
+      const char *id;
+
+      res = xdp_dbus_documents_call_list_paged_sync (documents, "", start_after, 2,
+                                                     &docs, &next, NULL, &error);
+      g_assert_no_error (error);
+      g_assert (res);
+      g_assert_cmpint (g_variant_n_children (docs), <=, 2);
+
+      g_variant_iter_init (&iter, docs);
+      while (g_variant_iter_next (&iter, "{&s@ay}", &id, NULL))
+        {
+          g_autoptr(GVariant) path = g_variant_lookup_value (all_docs, id, NULL);
+
+          g_assert_cmpstr (id, >, start_after);
+          g_assert (path != NULL);
+          g_assert (g_hash_table_add (seen, g_strdup (id)));
+        }
+
+      g_free (start_after);
+      start_after = g_steal_pointer (&next);
+    }
+  while (start_after[0] != '\0');
+
+  g_assert_cmpint (g_hash_table_size (seen), ==, g_variant_n_children (all_docs));
+}
+
+static void
+test_grant_permissions_many (void)
+{
+  g_autofree char *id1 = NULL;
+  g_autofree char *id2 = NULL;
+  GVariantBuilder builder;
+  const char *read_perms[] = { "read", NULL };
+  const char *write_perms[] = { "read", "write", NULL };
+  GError *error = NULL;
+  gboolean res;
+
+  if (cannot_use_fuse != NULL)
+    {
+      g_test_skip (cannot_use_fuse);
+      return;
+    }
+
+  id1 = export_new_file ("grant-many-1", "content1", FALSE);
+  id2 = export_new_file ("grant-many-2", "content2", FALSE);
+
+  /* One bad grant fails the whole batch */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&builder, "(ss^as)", id1, "com.test.App1", read_perms);
+  g_variant_builder_add (&builder, "(ss^as)", "anotherid", "com.test.App1", read_perms);
+  res = xdp_dbus_documents_call_grant_permissions_many_sync (documents,
+                                                             g_variant_builder_end (&builder),
+                                                             NULL, &error);
+  g_assert_nonnull (error);
+  g_assert (!res);
+  g_clear_error (&error);
+  assert_doc_not_exist (id1, "grant-many-1", "com.test.App1");
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&builder, "(ss^as)", id1, "com.test.App1", read_perms);
+  g_variant_builder_add (&builder, "(ss^as)", id2, "com.test.App1", write_perms);
+  g_variant_builder_add (&builder, "(ss^as)", id2, "com.test.App2", read_perms);
+  res = xdp_dbus_documents_call_grant_permissions_many_sync (documents,
+                                                             g_variant_builder_end (&builder),
+                                                             NULL, &error);
+  g_assert_no_error (error);
+  g_assert (res);
+
+  assert_doc_has_contents (id1, "grant-many-1", "com.test.App1", "content1");
+  assert_doc_not_exist (id1, "grant-many-1", "com.test.App2");
+  assert_doc_has_contents (id2, "grant-many-2", "com.test.App1", "content2");
+  assert_doc_has_contents (id2, "grant-many-2", "com.test.App2", "content2");
+
+  update_doc (id2, "grant-many-2", "com.test.App1", "content3", &error);
+  g_assert_no_error (error);
+  update_doc (id1, "grant-many-1", "com.test.App1", "content4", &error);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_ACCES);
+  g_clear_error (&error);
+}
+
 static void
 test_version (void)
 {
@@ -925,7 +1037,7 @@ test_version (void)
       return;
     }
 
-  g_assert_cmpint (xdp_dbus_documents_get_version (documents), ==, 4);
+  g_assert_cmpint (xdp_dbus_documents_get_version (documents), ==, 6);
 }
 
 int
@@ -940,6 +1052,8 @@ main (int argc, char **argv)
   g_test_add_func ("/db/recursive_doc", test_recursive_doc);
   g_test_add_func ("/db/create_docs", test_create_docs);
   g_test_add_func ("/db/add_named", test_add_named);
+  g_test_add_func ("/db/list_paged", test_list_paged);
+  g_test_add_func ("/db/grant_permissions_many", test_grant_permissions_many);
 
   global_setup ();
 
@@ -24,7 +24,7 @@ XdgPermissionStore *permissions;
 static void
 test_version (void)
 {
-  g_assert_cmpint (xdg_permission_store_get_version (permissions), ==, 2);
+  g_assert_cmpint (xdg_permission_store_get_version (permissions), ==, 5);
 }
 
 static int change_count;
@@ -286,6 +286,204 @@ test_create2 (void)
   g_assert_true (res);
 }
 
+static void
+test_get_permission (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) p = NULL;
+  g_autoptr(GVariant) d = NULL;
+  g_autofree char **strv = NULL;
+  GVariantBuilder builder;
+  const char * perms[] = { "one", "two", NULL };
+
+  res = xdg_permission_store_call_get_permission_sync (permissions,
+                                                       "TEST", "get-resource", "a",
+                                                       &p, &d,
+                                                       NULL,
+                                                       &error);
+  g_assert_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND);
+  g_assert_false (res);
+  g_clear_error (&error);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&builder, "(ss^as)", "get-resource", "a", perms);
+  g_variant_builder_add (&builder, "(ss^as)", "get-resource", "b", perms + 1);
+  res = xdg_permission_store_call_set_many_sync (permissions,
+                                                 "TEST", TRUE,
+                                                 g_variant_builder_end (&builder),
+                                                 NULL,
+                                                 &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  res = xdg_permission_store_call_get_permission_sync (permissions,
+                                                       "TEST", "get-resource", "b",
+                                                       &p, &d,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* Only the asked for app is returned */
+  g_assert_cmpint (g_variant_n_children (p), ==, 1);
+  res = g_variant_lookup (p, "b", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (strv), ==, 1);
+  g_assert_cmpstr (strv[0], ==, "two");
+  g_assert_true (g_variant_is_of_type (d, G_VARIANT_TYPE_VARIANT));
+  g_clear_pointer (&p, g_variant_unref);
+  g_clear_pointer (&d, g_variant_unref);
+
+  res = xdg_permission_store_call_get_permission_sync (permissions,
+                                                       "TEST", "get-resource", "c",
+                                                       &p, &d,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (p), ==, 0);
+
+  res = xdg_permission_store_call_delete_sync (permissions, "TEST", "get-resource", NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_many (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) entries = NULL;
+  g_autoptr(GVariant) p = NULL;
+  g_autofree char **strv = NULL;
+  GVariantBuilder builder;
+  const char * perms[] = { "one", "two", NULL };
+  const char * ids[] = { "many1", "many2", "no-such-entry", NULL };
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&builder, "(ss^as)", "many1", "a", perms);
+  g_variant_builder_add (&builder, "(ss^as)", "many2", "b", perms);
+  g_variant_builder_add (&builder, "(ss^as)", "many1", "b", perms + 1);
+
+  /* Nothing is applied if one id is missing */
+  res = xdg_permission_store_call_set_many_sync (permissions,
+                                                 "TEST", FALSE,
+                                                 g_variant_builder_end (&builder),
+                                                 NULL,
+                                                 &error);
+  g_assert_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND);
+  g_assert_false (res);
+  g_clear_error (&error);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "TEST", ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 0);
+  g_clear_pointer (&entries, g_variant_unref);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&builder, "(ss^as)", "many1", "a", perms);
+  g_variant_builder_add (&builder, "(ss^as)", "many2", "b", perms);
+  g_variant_builder_add (&builder, "(ss^as)", "many1", "b", perms + 1);
+
+  res = xdg_permission_store_call_set_many_sync (permissions,
+                                                 "TEST", TRUE,
+                                                 g_variant_builder_end (&builder),
+                                                 NULL,
+                                                 &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "TEST", ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 2);
+
+  res = g_variant_lookup (entries, "many1", "(@a{sas}*)", &p, NULL);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (p), ==, 2);
+  res = g_variant_lookup (p, "b", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (strv), ==, 1);
+  g_assert_cmpstr (strv[0], ==, "two");
+
+  res = xdg_permission_store_call_delete_sync (permissions, "TEST", "many1", NULL, &error);
+  g_assert_no_error (error);
+  res = xdg_permission_store_call_delete_sync (permissions, "TEST", "many2", NULL, &error);
+  g_assert_no_error (error);
+}
+
+static int app_change_count;
+
+static void
+app_changed_cb (XdgPermissionStore *store,
+                const char *table,
+                const char *id,
+                const char *app,
+                const char *const *perms,
+                gpointer user_data)
+{
+  app_change_count++;
+
+  g_assert_cmpstr (table, ==, "TEST");
+  g_assert_cmpstr (id, ==, "subscribed");
+  g_assert_cmpstr (app, ==, "a");
+  g_assert_cmpint (g_strv_length ((char **) perms), ==, 1);
+  g_assert_cmpstr (perms[0], ==, "one");
+}
+
+static void
+test_subscribe (void)
+{
+  gulong changed_handler;
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  const char * perms[] = { "one", NULL };
+  gboolean timeout_reached = FALSE;
+  guint timeout_id;
+
+  changed_handler = g_signal_connect (permissions, "app-permissions-changed", G_CALLBACK (app_changed_cb), NULL);
+  app_change_count = 0;
+
+  res = xdg_permission_store_call_subscribe_sync (permissions, "TEST", "a", TRUE, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* Not for the subscribed app */
+  res = xdg_permission_store_call_set_permission_sync (permissions, "TEST", TRUE,
+                                                       "subscribed", "b", perms,
+                                                       NULL, &error);
+  g_assert_no_error (error);
+  res = xdg_permission_store_call_set_permission_sync (permissions, "TEST", TRUE,
+                                                       "subscribed", "a", perms,
+                                                       NULL, &error);
+  g_assert_no_error (error);
+
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && app_change_count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (app_change_count, ==, 1);
+
+  res = xdg_permission_store_call_unsubscribe_sync (permissions, "TEST", "a", NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_signal_handler_disconnect (permissions, changed_handler);
+
+  res = xdg_permission_store_call_delete_sync (permissions, "TEST", "subscribed", NULL, &error);
+  g_assert_no_error (error);
+}
+
 static void
 test_delete1 (void)
 {
@@ -564,6 +762,9 @@ main (int argc, char **argv)
   g_test_add_func ("/permissions/create1", test_create1);
   g_test_add_func ("/permissions/create2", test_create2);
   g_test_add_func ("/permissions/set-value", test_set_value);
+  g_test_add_func ("/permissions/many", test_many);
+  g_test_add_func ("/permissions/get-permission", test_get_permission);
+  g_test_add_func ("/permissions/subscribe", test_subscribe);
 
   global_setup ();
 
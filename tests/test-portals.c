@@ -19,6 +19,7 @@
 #include "openuri.h"
 #include "print.h"
 #include "screenshot.h"
+#include "settings.h"
 #include "trash.h"
 #include "wallpaper.h"
 #endif
@@ -327,9 +328,9 @@ DEFINE_TEST_EXISTS(notification, NOTIFICATION, 1)
 DEFINE_TEST_EXISTS(open_uri, OPEN_URI, 3)
 DEFINE_TEST_EXISTS(print, PRINT, 1)
 DEFINE_TEST_EXISTS(proxy_resolver, PROXY_RESOLVER, 1)
-DEFINE_TEST_EXISTS(screenshot, SCREENSHOT, 2)
-DEFINE_TEST_EXISTS(settings, SETTINGS, 1)
-DEFINE_TEST_EXISTS(trash, TRASH, 1)
+DEFINE_TEST_EXISTS(screenshot, SCREENSHOT, 3)
+DEFINE_TEST_EXISTS(settings, SETTINGS, 4)
+DEFINE_TEST_EXISTS(trash, TRASH, 2)
 DEFINE_TEST_EXISTS(wallpaper, WALLPAPER, 1)
 
 int
@@ -385,7 +386,11 @@ main (int argc, char **argv)
   g_test_add_func ("/portal/color/close", test_color_close);
   g_test_add_func ("/portal/color/parallel", test_color_parallel);
 
+  g_test_add_func ("/portal/settings/read-all-shared", test_settings_read_all_shared);
+
   g_test_add_func ("/portal/trash/file", test_trash_file);
+  g_test_add_func ("/portal/trash/files", test_trash_files);
+  g_test_add_func ("/portal/trash/files-too-many", test_trash_files_too_many);
 
   g_test_add_func ("/portal/openfile/basic", test_open_file_basic);
   g_test_add_func ("/portal/openfile/delay", test_open_file_delay);
@@ -2,6 +2,7 @@
 
 #include <glib.h>
 #include <document-portal/permission-db.h>
+#include <document-portal/gvdb/gvdb-builder.h>
 
 /*
 static void
@@ -347,6 +348,344 @@ test_modify (void)
   }
 }
 
+static void
+test_update_incremental (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  const char *permissions[] = { "read", NULL };
+  g_autofree char *dump1 = NULL;
+  g_autofree char *dump2 = NULL;
+  g_autofree char *dump3 = NULL;
+  g_autofree char *dump4 = NULL;
+
+  db = create_test_db (TRUE);
+  verify_test_db (db);
+
+  /* Modify on top of an already serialized db */
+  {
+    g_autoptr(PermissionDbEntry) entry1 = NULL;
+    g_autoptr(PermissionDbEntry) entry2 = NULL;
+
+    entry1 = permission_db_entry_new (g_variant_new_string ("gazonk-data"));
+    entry2 = permission_db_entry_set_app_permissions (entry1, "org.test.eapp", permissions);
+    permission_db_set_entry (db, "gazonk", entry2);
+  }
+
+  permission_db_set_entry (db, "bar", NULL);
+
+  dump1 = permission_db_print (db);
+  permission_db_update (db);
+  dump2 = permission_db_print (db);
+  g_assert_cmpstr (dump1, ==, dump2);
+
+  /* And once more, on top of the rebased tables */
+  {
+    g_autoptr(PermissionDbEntry) entry1 = NULL;
+    g_autoptr(PermissionDbEntry) entry2 = NULL;
+
+    entry1 = permission_db_lookup (db, "foo");
+    entry2 = permission_db_entry_remove_app_permissions (entry1, "org.test.bapp");
+    permission_db_set_entry (db, "foo", entry2);
+  }
+
+  dump3 = permission_db_print (db);
+  permission_db_update (db);
+  dump4 = permission_db_print (db);
+  g_assert_cmpstr (dump3, ==, dump4);
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids (db);
+    g_auto(GStrv) apps = permission_db_list_apps (db);
+
+    g_assert_cmpint (g_strv_length (ids), ==, 2);
+    g_assert (g_strv_contains ((const char **) ids, "foo"));
+    g_assert (g_strv_contains ((const char **) ids, "gazonk"));
+
+    g_assert_cmpint (g_strv_length (apps), ==, 3);
+    g_assert (g_strv_contains ((const char **) apps, "org.test.app"));
+    g_assert (g_strv_contains ((const char **) apps, "org.test.capp"));
+    g_assert (g_strv_contains ((const char **) apps, "org.test.eapp"));
+  }
+}
+
+static void
+test_journal (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autoptr(PermissionDb) db3 = NULL;
+  g_autofree char *journal = NULL;
+  g_autofree char *dump1 = NULL;
+  g_autofree char *dump2 = NULL;
+  g_autofree char *dump3 = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+  journal = g_strconcat (tmpfile, ".journal", NULL);
+
+  db = create_test_db (TRUE);
+  permission_db_set_path (db, tmpfile);
+  permission_db_save_content (db, &error);
+  g_assert_no_error (error);
+
+  permission_db_open_journal (db, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (permission_db_get_journal_size (db), ==, 0);
+
+  {
+    g_autoptr(PermissionDbEntry) entry1 = NULL;
+    g_autoptr(PermissionDbEntry) entry2 = NULL;
+    const char *permissions[] = { "read", NULL };
+
+    entry1 = permission_db_entry_new (g_variant_new_string ("gazonk-data"));
+    entry2 = permission_db_entry_set_app_permissions (entry1, "org.test.eapp", permissions);
+    permission_db_set_entry (db, "gazonk", entry2);
+  }
+  permission_db_set_entry (db, "bar", NULL);
+
+  permission_db_sync_journal (db, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (permission_db_get_journal_size (db), >, 0);
+
+  dump1 = permission_db_print (db);
+
+  /* The changes are only in the journal, but are replayed on load */
+  db2 = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  dump2 = permission_db_print (db2);
+  g_assert_cmpstr (dump1, ==, dump2);
+
+  /* Compact */
+  permission_db_update (db);
+  permission_db_save_content (db, &error);
+  g_assert_no_error (error);
+  permission_db_reset_journal (db, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (permission_db_get_journal_size (db), ==, 0);
+
+  db3 = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  dump3 = permission_db_print (db3);
+  g_assert_cmpstr (dump1, ==, dump3);
+
+  unlink (journal);
+  unlink (tmpfile);
+}
+
+static void
+test_list_by_value (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(GVariant) foo_data = g_variant_ref_sink (g_variant_new_string ("foo-data"));
+  g_autoptr(GVariant) new_data = g_variant_ref_sink (g_variant_new_string ("new-data"));
+
+  db = create_test_db (TRUE);
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, foo_data);
+
+    g_assert_cmpint (g_strv_length (ids), ==, 1);
+    g_assert_cmpstr (ids[0], ==, "foo");
+  }
+
+  /* The index follows changes made after it was built */
+  {
+    g_autoptr(PermissionDbEntry) entry1 = NULL;
+    g_autoptr(PermissionDbEntry) entry2 = NULL;
+
+    entry1 = permission_db_lookup (db, "foo");
+    entry2 = permission_db_entry_modify_data (entry1, g_variant_new_string ("new-data"));
+    permission_db_set_entry (db, "foo", entry2);
+  }
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, foo_data);
+    g_auto(GStrv) new_ids = permission_db_list_ids_by_value (db, new_data);
+
+    g_assert_cmpint (g_strv_length (ids), ==, 0);
+    g_assert_cmpint (g_strv_length (new_ids), ==, 1);
+    g_assert_cmpstr (new_ids[0], ==, "foo");
+  }
+
+  permission_db_set_entry (db, "foo", NULL);
+
+  {
+    g_auto(GStrv) new_ids = permission_db_list_ids_by_value (db, new_data);
+
+    g_assert_cmpint (g_strv_length (new_ids), ==, 0);
+  }
+}
+
+static void
+test_volatile (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autoptr(PermissionDb) snapshot = NULL;
+  g_autoptr(PermissionDbEntry) entry1 = NULL;
+  g_autoptr(PermissionDbEntry) entry2 = NULL;
+  g_autoptr(PermissionDbEntry) entry3 = NULL;
+  GError *error = NULL;
+  const char *permissions[] = { "read", NULL };
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  db = create_test_db (TRUE);
+  g_assert (!permission_db_is_dirty (db));
+
+  entry1 = permission_db_entry_new (g_variant_new_string ("baz-data"));
+  entry2 = permission_db_entry_set_app_permissions (entry1, "org.test.eapp", permissions);
+  permission_db_set_volatile_entry (db, "baz", entry2);
+
+  /* Volatile entries are visible like any other, but are not changes
+   * to save */
+  g_assert (!permission_db_is_dirty (db));
+  g_assert_cmpint (permission_db_get_n_updates (db), ==, 0);
+
+  {
+    g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, "baz");
+    g_auto(GStrv) ids = permission_db_list_ids (db);
+    g_auto(GStrv) app_ids = permission_db_list_ids_by_app (db, "org.test.eapp");
+    g_auto(GStrv) apps = permission_db_list_apps (db);
+
+    g_assert (entry != NULL);
+    g_assert_cmpint (g_strv_length (ids), ==, 3);
+    g_assert (g_strv_contains ((const char **) ids, "baz"));
+    g_assert_cmpint (g_strv_length (app_ids), ==, 1);
+    g_assert_cmpstr (app_ids[0], ==, "baz");
+    g_assert_cmpint (g_strv_length (apps), ==, 5);
+    g_assert (g_strv_contains ((const char **) apps, "org.test.eapp"));
+  }
+
+  /* Changes stay volatile */
+  entry3 = permission_db_entry_set_app_permissions (entry2, "org.test.app", permissions);
+  permission_db_set_entry (db, "baz", entry3);
+  g_assert (!permission_db_is_dirty (db));
+
+  {
+    g_auto(GStrv) app_ids = permission_db_list_ids_by_app (db, "org.test.app");
+    g_auto(GStrv) apps = permission_db_list_apps (db);
+
+    g_assert_cmpint (g_strv_length (app_ids), ==, 3);
+    g_assert (g_strv_contains ((const char **) app_ids, "baz"));
+    g_assert_cmpint (g_strv_length (apps), ==, 5);
+  }
+
+  snapshot = permission_db_dup_snapshot (db);
+
+  {
+    g_autoptr(PermissionDbEntry) entry = permission_db_lookup (snapshot, "baz");
+    g_auto(GStrv) app_ids = permission_db_list_ids_by_app (snapshot, "org.test.eapp");
+
+    g_assert (entry != NULL);
+    g_assert_cmpint (g_strv_length (app_ids), ==, 1);
+  }
+
+  /* They are not folded in or saved */
+  permission_db_update (db);
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+
+  permission_db_set_path (db, tmpfile);
+  permission_db_save_content (db, &error);
+  g_assert_no_error (error);
+
+  db2 = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  verify_test_db (db2);
+
+  {
+    g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, "baz");
+
+    g_assert (entry != NULL);
+  }
+
+  permission_db_set_entry (db, "baz", NULL);
+
+  {
+    g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, "baz");
+    g_auto(GStrv) apps = permission_db_list_apps (db);
+
+    g_assert (entry == NULL);
+    g_assert_cmpint (g_strv_length (apps), ==, 4);
+  }
+
+  unlink (tmpfile);
+}
+
+static void
+test_memory_usage (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  PermissionDbMemoryUsage usage;
+  const char *permissions[] = { "read", NULL };
+
+  db = create_test_db (TRUE);
+
+  permission_db_get_memory_usage (db, &usage);
+  g_assert_cmpint (usage.updates, ==, 0);
+  g_assert_cmpint (usage.app_changes, ==, 0);
+  g_assert_cmpint (usage.content_bytes, >, 0);
+
+  {
+    g_autoptr(PermissionDbEntry) entry1 = NULL;
+    g_autoptr(PermissionDbEntry) entry2 = NULL;
+
+    entry1 = permission_db_entry_new (g_variant_new_string ("gazonk-data"));
+    entry2 = permission_db_entry_set_app_permissions (entry1, "org.test.eapp", permissions);
+    permission_db_set_entry (db, "gazonk", entry2);
+  }
+
+  permission_db_get_memory_usage (db, &usage);
+  g_assert_cmpint (usage.updates, ==, 1);
+  g_assert_cmpint (usage.updates_bytes, >, strlen ("gazonk"));
+  g_assert_cmpint (usage.app_changes, ==, 1);
+
+  /* Folding the changes in releases the overlays */
+  permission_db_update (db);
+  permission_db_get_memory_usage (db, &usage);
+  g_assert_cmpint (usage.updates, ==, 0);
+  g_assert_cmpint (usage.updates_bytes, ==, 0);
+  g_assert_cmpint (usage.app_changes, ==, 0);
+}
+
+static void
+test_invalid_entry (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  GHashTable *root, *main_h;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+
+  /* A value of the wrong type is caught when the file is loaded, not
+   * on lookup */
+  root = gvdb_hash_table_new (NULL, NULL);
+  main_h = gvdb_hash_table_new (root, "main");
+  g_hash_table_unref (gvdb_hash_table_new (root, "apps"));
+  gvdb_item_set_value (gvdb_hash_table_insert (main_h, "foo"),
+                       g_variant_new_string ("not-an-entry"));
+  g_hash_table_unref (main_h);
+
+  gvdb_table_write_contents (root, tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  g_hash_table_unref (root);
+
+  db = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+  g_assert (db == NULL);
+  g_clear_error (&error);
+
+  unlink (tmpfile);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -355,6 +694,12 @@ main (int argc, char **argv)
   g_test_add_func ("/db/open", test_db_open);
   g_test_add_func ("/db/serialize", test_serialize);
   g_test_add_func ("/db/modify", test_modify);
+  g_test_add_func ("/db/update-incremental", test_update_incremental);
+  g_test_add_func ("/db/journal", test_journal);
+  g_test_add_func ("/db/list-by-value", test_list_by_value);
+  g_test_add_func ("/db/invalid-entry", test_invalid_entry);
+  g_test_add_func ("/db/volatile", test_volatile);
+  g_test_add_func ("/db/memory-usage", test_memory_usage);
 
   return g_test_run ();
 }
@@ -2,7 +2,15 @@
 
 #include "trash.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <gio/gunixfdlist.h>
 #include <libportal/portal.h>
+#include "src/xdp-dbus.h"
+#include "src/xdp-utils.h"
+
+#define PORTAL_BUS_NAME "org.freedesktop.portal.Desktop"
+#define PORTAL_OBJECT_PATH "/org/freedesktop/portal/desktop"
 
 static gboolean got_info;
 
@@ -45,3 +53,99 @@ test_trash_file (void)
   while (!got_info)
     g_main_context_iteration (NULL, TRUE);    
 }
+
+static XdpTrash *
+get_trash_proxy (void)
+{
+  g_autoptr(GDBusConnection) session_bus = NULL;
+  g_autoptr(GError) error = NULL;
+  XdpTrash *proxy;
+
+  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+
+  proxy = xdp_trash_proxy_new_sync (session_bus, 0,
+                                    PORTAL_BUS_NAME,
+                                    PORTAL_OBJECT_PATH,
+                                    NULL,
+                                    &error);
+  g_assert_no_error (error);
+
+  return proxy;
+}
+
+/* As above, only failures are tested. Entries without an fd fail
+ * too, and don't stop the others from being handled. */
+void
+test_trash_files (void)
+{
+  g_autoptr(XdpTrash) proxy = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) results = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+  guint result;
+  int fd;
+  int idx;
+
+  proxy = get_trash_proxy ();
+
+  fd = open ("/etc/passwd", O_PATH | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+
+  fd_list = g_unix_fd_list_new ();
+  idx = g_unix_fd_list_append (fd_list, fd, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("ah"));
+  g_variant_builder_add (&builder, "h", idx);
+  g_variant_builder_add (&builder, "h", 42);
+  g_variant_builder_add (&builder, "h", idx);
+
+  xdp_trash_call_trash_files_sync (proxy,
+                                   g_variant_builder_end (&builder),
+                                   fd_list,
+                                   &results,
+                                   NULL,
+                                   NULL,
+                                   &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (g_variant_n_children (results), ==, 3);
+  g_variant_get_child (results, 0, "u", &result);
+  g_assert_cmpuint (result, ==, 0);
+  g_variant_get_child (results, 1, "u", &result);
+  g_assert_cmpuint (result, ==, 0);
+  g_variant_get_child (results, 2, "u", &result);
+  g_assert_cmpuint (result, ==, 0);
+}
+
+/* More entries than a message can carry fds for are refused */
+void
+test_trash_files_too_many (void)
+{
+  g_autoptr(XdpTrash) proxy = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) results = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+  int i;
+
+  proxy = get_trash_proxy ();
+
+  fd_list = g_unix_fd_list_new ();
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("ah"));
+  for (i = 0; i < 254; i++)
+    g_variant_builder_add (&builder, "h", i);
+
+  xdp_trash_call_trash_files_sync (proxy,
+                                   g_variant_builder_end (&builder),
+                                   fd_list,
+                                   &results,
+                                   NULL,
+                                   NULL,
+                                   &error);
+  g_assert_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT);
+  g_assert_null (results);
+}
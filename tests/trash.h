@@ -1,3 +1,5 @@
 #pragma once
 
 void test_trash_file (void);
+void test_trash_files (void);
+void test_trash_files_too_many (void);